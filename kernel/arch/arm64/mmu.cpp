@@ -228,6 +228,8 @@ void *paging_map_phys_to_virt(struct mm_address_space *as, uint64_t virt, uint64
     else if (!user)
         as = &kernel_address_space;
 
+    scoped_lock g{as->page_table_lock};
+
     uint64_t *ptentry;
 
     if (!arm64_get_pt_entry((void *) virt, &ptentry, true, as))
@@ -470,7 +472,7 @@ bool arm64_get_pt_entry(void *addr, uint64_t **entry_ptr, bool may_create_path,
 
 bool __paging_change_perms(struct mm_address_space *mm, void *addr, int prot)
 {
-    MUST_HOLD_MUTEX(&mm->vm_lock);
+    scoped_lock g{mm->page_table_lock};
 
     uint64_t *entry;
     if (!arm64_get_pt_entry(addr, &entry, false, mm))
@@ -500,6 +502,8 @@ bool paging_change_perms(void *addr, int prot)
 
 bool paging_write_protect(void *addr, struct mm_address_space *mm)
 {
+    scoped_lock g{mm->page_table_lock};
+
     uint64_t *ptentry;
     if (!arm64_get_pt_entry(addr, &ptentry, false, mm))
         return false;
@@ -762,6 +766,8 @@ void vm_save_current_mmu(struct mm_address_space *mm)
  */
 void vm_mmu_mprotect_page(struct mm_address_space *as, void *addr, int old_prots, int new_prots)
 {
+    scoped_lock g{as->page_table_lock};
+
     uint64_t *ptentry;
     if (!arm64_get_pt_entry(addr, &ptentry, false, as))
         return;
@@ -1041,6 +1047,7 @@ int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages)
 {
     unsigned long virt = (unsigned long) addr;
     size_t size = pages << PAGE_SHIFT;
+    scoped_lock g{as->page_table_lock};
 
     page_table_iterator it{virt, size, as};
 
@@ -208,6 +208,8 @@ void *paging_map_phys_to_virt(struct mm_address_space *as, uint64_t virt, uint64
         assert(as != nullptr);
     }
 
+    scoped_lock g{as->page_table_lock};
+
     uint64_t *ptentry;
 
     if (!riscv_get_pt_entry((void *) virt, &ptentry, true, as))
@@ -300,7 +302,8 @@ bool riscv_get_pt_entry_with_ptables(void *addr, uint64_t **entry_ptr, struct mm
  */
 int paging_clone_as(mm_address_space *addr_space, mm_address_space *original)
 {
-    scoped_mutex g{original->vm_lock};
+    scoped_rwlock<rw_lock::read> g{original->vm_lock};
+    scoped_lock g2{original->page_table_lock};
     PML *new_pml = alloc_pt();
     if (!new_pml)
         return -ENOMEM;
@@ -444,7 +447,7 @@ bool riscv_get_pt_entry(void *addr, uint64_t **entry_ptr, bool may_create_path,
 
 bool __paging_change_perms(struct mm_address_space *mm, void *addr, int prot)
 {
-    MUST_HOLD_MUTEX(&mm->vm_lock);
+    scoped_lock g{mm->page_table_lock};
 
     uint64_t *entry;
     if (!riscv_get_pt_entry(addr, &entry, false, mm))
@@ -478,6 +481,8 @@ bool paging_change_perms(void *addr, int prot)
 
 bool paging_write_protect(void *addr, struct mm_address_space *mm)
 {
+    scoped_lock g{mm->page_table_lock};
+
     uint64_t *ptentry;
     if (!riscv_get_pt_entry(addr, &ptentry, false, mm))
         return false;
@@ -708,6 +713,8 @@ void vm_save_current_mmu(struct mm_address_space *mm)
  */
 void vm_mmu_mprotect_page(struct mm_address_space *as, void *addr, int old_prots, int new_prots)
 {
+    scoped_lock g{as->page_table_lock};
+
     uint64_t *ptentry;
     if (!riscv_get_pt_entry(addr, &ptentry, false, as))
         return;
@@ -989,6 +996,7 @@ int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages)
 {
     unsigned long virt = (unsigned long) addr;
     size_t size = pages << PAGE_SHIFT;
+    scoped_lock g{as->page_table_lock};
 
     page_table_iterator it{virt, size, as};
 
@@ -87,7 +87,7 @@ void platform_init_clockevents(void)
     else
     {
         this_timer->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
-        INIT_LIST_HEAD(&this_timer->event_list);
+        timer_init_events(this_timer);
     }
 }
 
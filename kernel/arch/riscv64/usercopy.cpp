@@ -128,3 +128,29 @@ fault:
     CLEAR_USER_MEMORY_ACCESS;
     return -EFAULT;
 }
+
+long cmpxchg_user32(unsigned int *uaddr, unsigned int *expected, unsigned int desired)
+{
+    DO_USER_POINTER_CHECKS(uaddr, sizeof(uint32_t));
+    ALLOW_USER_MEMORY_ACCESS;
+    __asm__ goto("    lw t2, %0\n\t"
+                 ".Llr%=: lr.w.aqrl t1, (%1)\n\t"
+                 "    bne t1, t2, .Lout%=\n\t"
+                 ".Lsc%=: sc.w.aqrl t3, %2, (%1)\n\t"
+                 "    bnez t3, .Llr%=\n\t"
+                 ".Lout%=: sw t1, %0\n\t"
+                 ".pushsection .ehtable\n\t"
+                 ".dword .Llr%=\n\t"
+                 ".dword %l3\n\t"
+                 ".dword .Lsc%=\n\t"
+                 ".dword %l3\n\t"
+                 ".popsection\n\t" ::"m"(*expected),
+                 "r"(uaddr), "r"(desired)
+                 : "t1", "t2", "t3", "memory"
+                 : fault);
+    CLEAR_USER_MEMORY_ACCESS;
+    return 0;
+fault:
+    CLEAR_USER_MEMORY_ACCESS;
+    return -EFAULT;
+}
@@ -845,7 +845,7 @@ void platform_init_clockevents(void)
     else
     {
         this_timer->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
-        INIT_LIST_HEAD(&this_timer->event_list);
+        timer_init_events(this_timer);
     }
 }
 
@@ -856,7 +856,7 @@ struct timer *platform_get_timer(void)
     if (!get_per_cpu(timer_initialised))
     {
         /* This is for clocksources that register themselves earlier than the platform timers */
-        INIT_LIST_HEAD(&this_timer->event_list);
+        timer_init_events(this_timer);
         this_timer->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
         write_per_cpu(defer_events, true);
         write_per_cpu(timer_initialised, true);
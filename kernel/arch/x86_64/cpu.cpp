@@ -569,3 +569,10 @@ extern "C" void x86_smap_clac_patch(code_patch_location *loc)
         ktrace::nop_out(loc->address, loc->size);
     }
 }
+
+/* The string functions jump to their rep movsq/stosq paths unless the CPU has fast strings */
+extern "C" void x86_erms_patch(code_patch_location *loc)
+{
+    if (x86_has_cap(X86_FEATURE_ERMS))
+        ktrace::nop_out(loc->address, loc->size);
+}
@@ -13,7 +13,6 @@
 #include <stdlib.h>
 
 #include <onyx/cpu.h>
-#include <onyx/dpc.h>
 #include <onyx/irq.h>
 #include <onyx/panic.h>
 #include <onyx/platform.h>
@@ -480,7 +480,7 @@ bool x86_get_pt_entry_with_ptables(void *addr, uint64_t **entry_ptr, struct mm_a
  */
 int paging_clone_as(mm_address_space *addr_space, mm_address_space *original)
 {
-    scoped_mutex g{original->vm_lock};
+    scoped_rwlock<rw_lock::read> g{original->vm_lock};
     scoped_lock g2{original->page_table_lock};
 
     PML *new_pml = alloc_pt();
@@ -54,7 +54,6 @@
 #include <onyx/vdso.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
-#include <onyx/worker.h>
 #include <onyx/x86/idt.h>
 #include <onyx/x86/kvm.h>
 #include <onyx/x86/msr.h>
@@ -282,6 +281,10 @@ extern "C" void multiboot2_kernel_entry(uintptr_t addr, uint32_t magic)
 
     set_initrd_address((void *) (uintptr_t) initrd.base, initrd.size);
 
+#ifdef CONFIG_ACPI
+    acpi_numa_init();
+#endif
+
     page_init(total_mem, max_pfn);
 
     /* We need to get some early boot rtc data and initialize the entropy,
@@ -7,6 +7,7 @@
  */
 #include <onyx/acpi.h>
 #include <onyx/cpu.h>
+#include <onyx/numa.h>
 #include <onyx/smp.h>
 #include <onyx/vector.h>
 #include <onyx/x86/apic.h>
@@ -50,6 +51,7 @@ void boot(unsigned int cpu)
     s->thread_stack = (unsigned long) get_thread_for_cpu(cpu)->kernel_stack_top;
 
     apic_set_lapic_id(cpu, lapic_ids[cpu]);
+    numa_set_cpu_node(cpu, numa_hwid_to_node(lapic_ids[cpu]));
 
     apic_wake_up_processor(static_cast<uint8_t>(lapic_ids[cpu]), s);
 
@@ -79,6 +81,8 @@ extern "C" void smp_parse_cpus(void *__madt)
     smp::set_number_of_cpus(nr_cpus);
     cpu_messages_init(0);
 
+    numa_set_cpu_node(0, numa_hwid_to_node(smp::lapic_ids[0]));
+
     /* We're CPU0 and we're online */
     smp::set_online(0);
 }
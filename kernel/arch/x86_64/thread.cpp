@@ -24,7 +24,6 @@
 #include <onyx/timer.h>
 #include <onyx/tss.h>
 #include <onyx/vm.h>
-#include <onyx/worker.h>
 #include <onyx/x86/apic.h>
 #include <onyx/x86/eflags.h>
 #include <onyx/x86/msr.h>
@@ -20,7 +20,6 @@
 #include <onyx/cpu.h>
 #include <onyx/dev.h>
 #include <onyx/dma.h>
-#include <onyx/dpc.h>
 #include <onyx/irq.h>
 #include <onyx/log.h>
 #include <onyx/module.h>
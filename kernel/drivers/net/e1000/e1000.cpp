@@ -151,12 +151,13 @@ int e1000_process_packet(netif *nif, e1000_rx_desc &desc)
     return netif_process_pbuf(nif, pckt.get());
 }
 
-int e1000_pollrx(netif *nif)
+int e1000_pollrx(netif *nif, int budget)
 {
     e1000_device *dev = (e1000_device *) nif->priv;
 
     uint16_t old_cur = 0;
-    while ((dev->rx_descs[dev->rx_cur].status & RSTA_DD))
+    int done = 0;
+    while (done < budget && (dev->rx_descs[dev->rx_cur].status & RSTA_DD))
     {
         auto &rxd = dev->rx_descs[dev->rx_cur];
 
@@ -168,9 +169,10 @@ int e1000_pollrx(netif *nif)
         dev->rx_cur = (dev->rx_cur + 1) % number_rx_desc;
 
         e1000_write(REG_RXDESCTAIL, old_cur, dev);
+        done++;
     }
 
-    return 0;
+    return done;
 }
 
 void e1000_rxend(netif *nif)
@@ -131,9 +131,10 @@ public:
     /**
      * @brief Does an RX poll
      *
-     * @return 0 on success, else error code
+     * @param budget Max number of packets to process
+     * @return Number of packets processed
      */
-    int poll_rx();
+    int poll_rx(int budget);
 
     /**
      * @brief Ends the rx poll
@@ -360,9 +361,9 @@ int rtl8168_send_packet(packetbuf *buf, netif *nif)
     return ((rtl8168_device *) nif->priv)->send_packet(buf);
 }
 
-int rtl8168_poll_rx(netif *nif)
+int rtl8168_poll_rx(netif *nif, int budget)
 {
-    return ((rtl8168_device *) nif->priv)->poll_rx();
+    return ((rtl8168_device *) nif->priv)->poll_rx(budget);
 }
 
 void rtl8168_rx_end(netif *nif)
@@ -461,18 +462,22 @@ static int process_packet(netif *nif, rtl8168_rx_desc &desc)
 /**
  * @brief Does an RX poll
  *
- * @return 0 on success, else error code
+ * @param budget Max number of packets to process
+ * @return Number of packets processed
  */
-int rtl8168_device::poll_rx()
+int rtl8168_device::poll_rx(int budget)
 {
-    while (!(rxdescs_[rx_cur].status & RTL8168_RX_DESC_FLAG_OWN))
+    int done = 0;
+
+    while (done < budget && !(rxdescs_[rx_cur].status & RTL8168_RX_DESC_FLAG_OWN))
     {
         auto &rx_desc = rxdescs_[rx_cur];
         process_packet(netif_, rx_desc);
         rx_cur = (rx_cur + 1) % number_rx_desc;
+        done++;
     }
 
-    return 0;
+    return done;
 }
 
 /**
@@ -276,23 +276,54 @@ private:
     int cmd_create_io_completion_queue(uint16_t queue, uint64_t queue_address, uint16_t queue_size,
                                        uint16_t interrupt_vector);
 
-    /**
-     * @brief Submit an IO request
-     *
-     * @param namespace NVMe namespace to submit an IO request to
-     * @param req BIO req to serve
-     * @return 0 on success, negative error codes
-     */
-    int submit_request(nvme_namespace *ns, struct bio_req *req);
-
     struct prp_setup
     {
         size_t xfer_blocks;
         size_t nr_entries;
         uint64_t first;
-        cul::vector<unique_page> indirect_list;
+        // PRP list pages, chained through next_un.next_allocation
+        struct page *indirect_list;
     };
 
+    // Per-request driver data, lives in the block layer's tag data
+    struct nvme_request;
+
+    /**
+     * @brief Queue an IO request
+     *
+     * @param ns NVMe namespace to submit an IO request to
+     * @param hwq Block layer hardware queue (IO queue hwq + 1)
+     * @param req BIO req to serve
+     * @return 0 on success, negative error codes
+     */
+    int queue_request(nvme_namespace *ns, unsigned int hwq, struct bio_req *req);
+
+    /**
+     * @brief blk_mq_ops::queue_rq for NVMe namespaces
+     *
+     * @param dev Block device of the namespace
+     * @param hwq Hardware queue index
+     * @param req BIO req to serve
+     * @return 0 on success, negative error codes
+     */
+    static int queue_rq(struct blockdev *dev, unsigned int hwq, struct bio_req *req);
+
+    static const struct blk_mq_ops mq_ops;
+
+    /**
+     * @brief Complete an IO request. Called from IRQ context.
+     *
+     * @param cmd Command of the request
+     */
+    static void complete_request(nvmecmd *cmd);
+
+    /**
+     * @brief Free a PRP list
+     *
+     * @param list First page of the list
+     */
+    static void free_prp_list(struct page *list);
+
     /**
      * @brief Setup a PRP for a bio request
      *
@@ -302,14 +333,6 @@ private:
      */
     expected<prp_setup, int> setup_prp(bio_req *req, nvme_namespace *ns);
 
-    /**
-     * @brief Pick an IO queue for this request
-     *
-     * @param r BIO request
-     * @return IO queue index
-     */
-    uint16_t pick_io_queue(bio_req *r);
-
 public:
     nvme_device(pci::pci_device *dev) : dev_{dev}
     {
@@ -524,6 +547,9 @@ struct nvmecmd
     nvmesqe cmd;
     nvmecqe response;
     bool has_response;
+    // Optional completion callback, called from IRQ context
+    void (*done)(nvmecmd *cmd);
+    void *context;
 };
 
 #define NVME_IDENTIFY_CNS_IDENTIFY_NAMESPACE  0
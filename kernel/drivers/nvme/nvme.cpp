@@ -94,6 +94,10 @@ int nvme_device::nvme_queue::submit_command(nvmecmd *cmd)
 {
     scoped_lock<spinlock, true> g{lock_};
 
+    /* Check for space first, so we don't leak a CID when the queue is full */
+    if ((sq_tail_ + 1) % sq_size_ == sq_head_)
+        return -EAGAIN;
+
     int cid = allocate_cid();
 
     if (cid < 0)
@@ -101,9 +105,6 @@ int nvme_device::nvme_queue::submit_command(nvmecmd *cmd)
 
     auto next_entry = sq_tail_;
 
-    if ((sq_tail_ + 1) % sq_size_ == sq_head_)
-        return -EAGAIN;
-
     sq_tail_ = (sq_tail_ + 1) % sq_size_;
     cmd->cmd.cdw0.cid = cid;
     queued_commands_[cmd->cmd.cdw0.cid] = cmd;
@@ -254,6 +255,35 @@ unique_ptr<blockdev> blkdev_create_nvme(unsigned int device_index, unsigned int
     return cul::move(dev);
 }
 
+struct nvme_device::nvme_request
+{
+    nvmecmd cmd;
+    prp_setup prp;
+    bio_req *req;
+    nvme_namespace *ns;
+};
+
+// Max number of page_iov's in a merged request. Each one is (at most) a page, so 256KiB
+#define NVME_MAX_SEGMENTS 64
+
+/**
+ * @brief blk_mq_ops::queue_rq for NVMe namespaces
+ *
+ * @param dev Block device of the namespace
+ * @param hwq Hardware queue index
+ * @param req BIO req to serve
+ * @return 0 on success, negative error codes
+ */
+int nvme_device::queue_rq(struct blockdev *dev, unsigned int hwq, struct bio_req *req)
+{
+    auto ns = (nvme_namespace *) dev->device_info;
+    return ns->nvme_dev_->queue_request(ns, hwq, req);
+}
+
+const struct blk_mq_ops nvme_device::mq_ops = {
+    .queue_rq = nvme_device::queue_rq,
+};
+
 /**
  * @brief Initialise a new "drive" (namespace)
  *
@@ -285,13 +315,17 @@ int nvme_device::init_drive(uint32_t nsid, unique_page identify_namespace_data)
     d->sector_size = lba;
     d->nr_sectors = nspace_identify->nsze * lba;
     d->device_info = nspace.get();
-    d->submit_request = [](struct blockdev *dev, struct bio_req *req) -> int {
-        nvme_namespace *n = (nvme_namespace *) dev->device_info;
-        // TODO: Hack! The disk driver should never get a request for a partition
-        // and the block subsystem should handle that
-        req->sector_number += dev->offset / n->dev_->sector_size;
-        return n->nvme_dev_->submit_request(n, req);
-    };
+
+    if (queues_.size() < 2)
+        return -EIO;
+
+    // Every IO queue gets its own hardware queue. IO queues are shared between namespaces,
+    // so the queue_rq may still return -EAGAIN even if the block layer thinks there's room.
+    if (int st = blk_mq_init_queue(d.get(), &mq_ops, queues_.size() - 1,
+                                   queues_[1].get_sq_queue_size() - 1, NVME_MAX_SEGMENTS,
+                                   sizeof(nvme_request));
+        st < 0)
+        return st;
 
     if (int st = blkdev_init(d.get()); st < 0)
     {
@@ -377,12 +411,17 @@ auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_se
         // allocate another page
         if (!current_list_page || (list_index == prp_entries - 1 && has_next))
         {
+            struct page *prev_list_page = current_list_page;
             current_list_page = alloc_page(PAGE_ALLOC_NO_ZERO);
             if (!current_list_page)
-                return unexpected{-ENOMEM};
+                return free_prp_list(s.indirect_list), unexpected{-ENOMEM};
 
-            if (!s.indirect_list.push_back(current_list_page))
-                return free_page(current_list_page), unexpected{-ENOMEM};
+            current_list_page->next_un.next_allocation = nullptr;
+
+            if (prev_list_page)
+                prev_list_page->next_un.next_allocation = current_list_page;
+            else
+                s.indirect_list = current_list_page;
 
             if (current_list)
             {
@@ -405,25 +444,53 @@ auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_se
 }
 
 /**
- * @brief Pick an IO queue for this request
+ * @brief Free a PRP list
  *
- * @param r BIO request
- * @return IO queue index
+ * @param list First page of the list
  */
-uint16_t nvme_device::pick_io_queue(bio_req *r)
+void nvme_device::free_prp_list(struct page *list)
 {
-    // Primitive algo: Use the cpu nr as an index
-    return (get_cpu_nr() % (queues_.size() - 1)) + 1;
+    while (list)
+    {
+        struct page *next = list->next_un.next_allocation;
+        free_page(list);
+        list = next;
+    }
 }
 
 /**
- * @brief Submit an IO request
+ * @brief Complete an IO request. Called from IRQ context.
  *
- * @param namespace NVMe namespace to submit an IO request to
+ * @param cmd Command of the request
+ */
+void nvme_device::complete_request(nvmecmd *cmd)
+{
+    auto nreq = (nvme_request *) cmd->context;
+    auto req = nreq->req;
+
+    free_prp_list(nreq->prp.indirect_list);
+
+    if (auto status = NVME_CQE_STATUS_CODE(cmd->response.dw3); status != 0)
+    {
+        printf("nvme%un%u: NVME_NVM_CMD_READ/WRITE: Status error %x\n",
+               nreq->ns->nvme_dev_->device_index_, nreq->ns->nsid_, status);
+        req->flags |= BIO_REQ_EIO;
+    }
+    else
+        req->flags |= BIO_REQ_DONE;
+
+    bio_complete(req);
+}
+
+/**
+ * @brief Queue an IO request
+ *
+ * @param ns NVMe namespace to submit an IO request to
+ * @param hwq Block layer hardware queue (IO queue hwq + 1)
  * @param req BIO req to serve
  * @return 0 on success, negative error codes
  */
-int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
+int nvme_device::queue_request(nvme_namespace *ns, unsigned int hwq, struct bio_req *req)
 {
     uint16_t command;
 
@@ -440,7 +507,8 @@ int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
             return -EOPNOTSUPP;
     }
 
-    nvmecmd cmd;
+    auto nreq = (nvme_request *) blk_mq_rq_to_pdu(req);
+    auto &cmd = nreq->cmd;
     memset(&cmd, 0, sizeof(cmd));
     cmd.cmd.cdw0.cdw0 = NVME_CMD_OPCODE(command) | NVME_CMD_FUSE_NORMAL | NVME_CMD_PSDT_PRP;
     cmd.cmd.nsid = ns->nsid_;
@@ -451,16 +519,18 @@ int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
     if (ex.has_error())
     {
         printf("Error setting up PRPs\n");
-        req->flags |= BIO_REQ_EIO;
         return ex.error();
     }
 
-    const auto &prp = ex.value();
+    nreq->prp = ex.value();
+    nreq->req = req;
+    nreq->ns = ns;
+    const auto &prp = nreq->prp;
 
     cmd.cmd.dptr.prp[0] = prp.first;
 
     if (prp.nr_entries > 1)
-        cmd.cmd.dptr.prp[1] = (prp_entry_t) page_to_phys(prp.indirect_list[0]);
+        cmd.cmd.dptr.prp[1] = (prp_entry_t) page_to_phys(prp.indirect_list);
 
     // Set up the starting LBA and number of sectors
     cmd.cmd.cdw10 = (uint32_t) req->sector_number;
@@ -469,25 +539,15 @@ int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
     cmd.cmd.cdw13 = 0;
     cmd.cmd.cdw14 = 0;
 
-    wait_queue wq;
-    init_wait_queue_head(&wq);
-    cmd.wq = &wq;
-
-    auto &queue = queues_[pick_io_queue(req)];
-    queue.submit_command(&cmd);
+    cmd.done = complete_request;
+    cmd.context = nreq;
 
-    wait_for_event(&wq, cmd.has_response);
-
-    if (auto status = NVME_CQE_STATUS_CODE(cmd.response.dw3); status != 0)
+    if (int st = queues_[hwq + 1].submit_command(&cmd); st < 0)
     {
-        printf("nvme%un%u: NVME_NVM_CMD_READ/WRITE: Status error %x\n", device_index_, ns->nsid_,
-               status);
-        req->flags |= BIO_REQ_EIO;
-        return -EIO;
+        free_prp_list(nreq->prp.indirect_list);
+        return st;
     }
 
-    req->flags |= BIO_REQ_DONE;
-
     return 0;
 }
 
@@ -825,11 +885,15 @@ bool nvme_device::nvme_queue::handle_cq()
             memcpy(&command->response, cqe, sizeof(nvmecqe));
             command->has_response = true;
 
-            if (command->wq)
-                wait_queue_wake_all(command->wq);
             queued_commands_[cid] = nullptr;
             queued_bitmap_.free_bit(cid);
             sq_head_ = NVME_CQE_SQHD(cqe->dw2);
+
+            // Note: done may free the command
+            if (command->done)
+                command->done(command);
+            else if (command->wq)
+                wait_queue_wake_all(command->wq);
         }
         else
             break;
@@ -860,7 +924,8 @@ irqstatus_t nvme_device::handle_irq(const irq_context *ctx)
     bool handled = false;
     for (auto &q : queues_)
     {
-        handled = handled || q.handle_cq();
+        // Every queue needs to be looked at, since they may all share the same vector
+        handled |= q.handle_cq();
     }
 
     return handled ? IRQ_HANDLED : IRQ_UNHANDLED;
@@ -12,7 +12,6 @@
 #include <stdint.h>
 
 #include <onyx/dev.h>
-#include <onyx/dpc.h>
 #include <onyx/driver.h>
 #include <onyx/irq.h>
 #include <onyx/port_io.h>
@@ -33,10 +33,13 @@ static uint32_t bio_req_to_virtio_blk_type(uint8_t op)
     }
 }
 
-int blk_vdev::submit_request(struct bio_req *req)
+int blk_vdev::queue_request(struct bio_req *req)
 {
     uint8_t op = req->flags & BIO_REQ_OP_MASK;
 
+    if (bio_req_to_virtio_blk_type(op) == (uint32_t) -1)
+        return -EIO;
+
     // We allocate a meta page that will hold the header and status
     // Yes, it's a bit wasteful, but much faster than walking page tables for stack
     // variables' physical addresses
@@ -48,13 +51,6 @@ int blk_vdev::submit_request(struct bio_req *req)
     virtio_blk_tail *btail = (virtio_blk_tail *) (breq + 1);
 
     breq->type = bio_req_to_virtio_blk_type(op);
-
-    if (breq->type == (uint32_t) -1)
-    {
-        free_page(meta_page);
-        return -EIO;
-    }
-
     breq->sector = req->sector_number;
     breq->reserved = 0;
     btail->status = 0;
@@ -62,7 +58,7 @@ int blk_vdev::submit_request(struct bio_req *req)
     const auto &requestq = get_vq(0);
 
     virtio_allocation_info alloc_info;
-    virtio_completion completion;
+    auto completion = new (blk_mq_rq_to_pdu(req)) blk_vdev_request{req, meta_page};
 
     alloc_info.nr_vecs = req->nr_vecs + 2;
     alloc_info.vec = req->vec;
@@ -102,13 +98,20 @@ int blk_vdev::submit_request(struct bio_req *req)
         return {v, alloc_flags};
     };
 
-    alloc_info.completion = &completion;
+    alloc_info.completion = completion;
 
     requestq->allocate_descriptors(alloc_info, false);
 
+    scoped_lock<spinlock, true> g{submit_lock_};
     requestq->put_buffer(alloc_info, true);
 
-    completion.wait();
+    return 0;
+}
+
+void blk_vdev_request::wake()
+{
+    virtio_blk_tail *btail =
+        (virtio_blk_tail *) ((virtio_blk_request *) PAGE_TO_VIRT(meta_page) + 1);
 
     if (btail->status == VIRTIO_BLK_S_OK)
     {
@@ -118,14 +121,15 @@ int blk_vdev::submit_request(struct bio_req *req)
     {
         req->flags |= BIO_REQ_NOT_SUPP;
     }
-    else if (btail->status == VIRTIO_BLK_S_IOERR)
+    else
     {
         req->flags |= BIO_REQ_EIO;
     }
 
     free_page(meta_page);
 
-    return 0;
+    // Note: This frees us
+    bio_complete(req);
 }
 
 void blk_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
@@ -139,14 +143,17 @@ void blk_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
 namespace blk
 {
 
-int blk_submit_request(struct blockdev *dev, struct bio_req *req)
+int blk_queue_rq(struct blockdev *dev, unsigned int hwq, struct bio_req *req)
 {
     auto blkdev = reinterpret_cast<virtio::blk_vdev *>(dev->device_info);
 
-    req->sector_number += dev->offset / 512;
-    return blkdev->submit_request(req);
+    return blkdev->queue_request(req);
 }
 
+const struct blk_mq_ops blk_mq_ops = {
+    .queue_rq = blk_queue_rq,
+};
+
 } // namespace blk
 
 bool blk_vdev::perform_subsystem_initialization()
@@ -177,9 +184,17 @@ bool blk_vdev::perform_subsystem_initialization()
     if (!dev)
         return false;
 
-    dev->submit_request = blk::blk_submit_request;
+    dev->device_info = this;
     dev->sector_size = 512;
 
+    // Every request takes 2 descriptors for the header and status, on top of its page_iov's
+    const unsigned int queue_size = get_vq(0)->get_queue_size();
+    const unsigned int max_segments = cul::min(queue_size - 2, 64U);
+
+    if (blk_mq_init_queue(dev.get(), &blk::blk_mq_ops, 1, queue_size / 3, max_segments,
+                          sizeof(blk_vdev_request)) < 0)
+        return false;
+
     if (blkdev_init(dev.get()) < 0)
         return false;
 
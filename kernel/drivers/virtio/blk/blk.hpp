@@ -62,17 +62,38 @@ private:
     size_t block_size;
     size_t disk_size;
     size_t size_max, seg_max;
+    // Serialises put_buffer between submitters
+    spinlock submit_lock_;
 
 public:
-    blk_vdev(pci::pci_device *d) : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}
+    blk_vdev(pci::pci_device *d)
+        : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}, submit_lock_{}
     {
+        spinlock_init(&submit_lock_);
     }
     ~blk_vdev();
 
     bool perform_subsystem_initialization() override;
 
     void handle_used_buffer(const virtq_used_elem &elem, virtq *vq) override;
-    int submit_request(struct bio_req *req);
+    int queue_request(struct bio_req *req);
+};
+
+/**
+ * @brief Per-request driver data, lives in the block layer's tag data.
+ * Completes the bio_req when the device is done with the descriptors.
+ */
+struct blk_vdev_request : public virtio_completion
+{
+    struct bio_req *req;
+    struct page *meta_page;
+
+    blk_vdev_request(struct bio_req *req, struct page *meta_page)
+        : virtio_completion{}, req{req}, meta_page{meta_page}
+    {
+    }
+
+    void wake() override;
 };
 
 struct virtio_blk_request
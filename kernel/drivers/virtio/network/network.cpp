@@ -56,11 +56,11 @@ void network_vdev::__rx_end(netif *nif)
     dev->rx_end();
 }
 
-int network_vdev::__poll_rx(netif *nif)
+int network_vdev::__poll_rx(netif *nif, int budget)
 {
     auto dev = static_cast<network_vdev *>(nif->priv);
 
-    return dev->poll_rx();
+    return dev->poll_rx(budget);
 }
 
 static constexpr unsigned int network_receiveq = 0;
@@ -73,12 +73,11 @@ void network_vdev::rx_end()
     vq->enable_interrupts();
 }
 
-int network_vdev::poll_rx()
+int network_vdev::poll_rx(int budget)
 {
     auto &vq = get_vq(network_receiveq);
 
-    vq->handle_irq();
-    return 0;
+    return vq->poll(budget);
 }
 
 int network_vdev::send_packet(packetbuf *buf)
@@ -466,7 +466,14 @@ void virtq_split::free_chain(uint32_t id)
 
 void virtq_split::handle_irq()
 {
-    while (used->idx != last_seen_used_idx)
+    poll(UINT_MAX);
+}
+
+unsigned int virtq_split::poll(unsigned int budget)
+{
+    unsigned int done = 0;
+
+    while (done < budget && used->idx != last_seen_used_idx)
     {
         auto &elem = used->ring[last_seen_used_idx % this->queue_size];
 
@@ -478,7 +485,10 @@ void virtq_split::handle_irq()
         }
 
         last_seen_used_idx++;
+        done++;
     }
+
+    return done;
 }
 
 void virtq_split::disable_interrupts()
@@ -198,6 +198,14 @@ public:
     virtual void allocate_buffer_list(virtio_allocation_info &info) = 0;
     virtual void notify() = 0;
     virtual void handle_irq() = 0;
+
+    /**
+     * @brief Process up to budget used buffers
+     *
+     * @param budget Max number of buffers to process
+     * @return Number of buffers processed
+     */
+    virtual unsigned int poll(unsigned int budget) = 0;
     unsigned int get_nr() const
     {
         return nr;
@@ -280,6 +288,8 @@ public:
 
     void handle_irq() override;
 
+    unsigned int poll(unsigned int budget) override;
+
     cul::pair<unsigned long, size_t> get_buf_from_id(uint16_t id) const override;
 
     void disable_interrupts() override;
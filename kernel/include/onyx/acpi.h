@@ -52,6 +52,12 @@ struct acpi_dev_id
 
 uintptr_t acpi_get_rsdp(void);
 
+/**
+ * @brief Parse the SRAT and SLIT in order to discover the NUMA topology
+ * Needs to be called before page_init, as the page allocator creates a node per proximity domain.
+ */
+void acpi_numa_init();
+
 int acpi_initialize(void);
 
 uint32_t acpi_shutdown(void);
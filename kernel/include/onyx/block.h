@@ -13,12 +13,17 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <onyx/bitmap.h>
 #include <onyx/culstring.h>
 #include <onyx/dev.h>
 #include <onyx/list.h>
 #include <onyx/page.h>
 #include <onyx/page_iov.h>
+#include <onyx/spinlock.h>
+#include <onyx/wait_queue.h>
+#include <onyx/workqueue.h>
 
+#include <onyx/atomic.hpp>
 #include <onyx/slice.hpp>
 
 /* Power management operations*/
@@ -40,6 +45,20 @@ typedef uint64_t sector_t;
 #define BIO_REQ_EIO      (1 << 9)
 #define BIO_REQ_TIMEOUT  (1 << 10)
 #define BIO_REQ_NOT_SUPP (1 << 11)
+/* Don't merge this request with adjacent ones */
+#define BIO_REQ_NOMERGE (1 << 12)
+
+#define BIO_REQ_STATUS_MASK (BIO_REQ_DONE | BIO_REQ_EIO | BIO_REQ_TIMEOUT | BIO_REQ_NOT_SUPP)
+
+struct bio_req;
+struct blk_mq_hw_queue;
+
+/**
+ * @brief Completion callback of a bio_req.
+ * Called with the request's status flags set, possibly from IRQ context. It must not sleep,
+ * allocate memory or submit new requests.
+ */
+typedef void (*bio_end_io_t)(struct bio_req *req);
 
 struct bio_req
 {
@@ -48,6 +67,15 @@ struct bio_req
     struct page_iov *vec;
     size_t nr_vecs;
     size_t curr_vec_index;
+    bio_end_io_t b_end_io;
+    void *b_private;
+
+    /* Block layer private - don't touch */
+    struct blockdev *b_dev;
+    struct list_head b_queue_node;
+    struct list_head b_merged;
+    struct blk_mq_hw_queue *b_hw;
+    unsigned int b_tag;
 };
 
 typedef ssize_t (*__blkread)(size_t offset, size_t count, void *buffer, struct blockdev *_this);
@@ -57,6 +85,68 @@ typedef int (*__blkpowermanagement)(int op, struct blockdev *_this);
 
 struct superblock;
 
+struct blk_mq_ops
+{
+    /**
+     * @brief Queue a request to a hardware queue.
+     * The driver calls bio_complete() when the request is done. May sleep.
+     *
+     * @param dev Block device (never a partition)
+     * @param hwq Hardware queue index
+     * @param req Request to queue
+     * @return 0 on success, -EAGAIN if the hardware queue is full, negative error codes
+     */
+    int (*queue_rq)(struct blockdev *dev, unsigned int hwq, struct bio_req *req);
+};
+
+/**
+ * Multi-queue block layer. Each CPU has a software queue where requests get sorted and merged,
+ * and software queues map onto the device's hardware queues. Each hardware queue has a fixed
+ * number of tags (in-flight requests), and each tag has cmd_size bytes of driver-private data.
+ */
+struct blk_mq_hw_queue
+{
+    struct spinlock lock;
+    Bitmap<0, false> tags;
+    unsigned int nr_inflight;
+    struct wait_queue wait;
+    unsigned char *tag_data;
+    atomic<unsigned long> nr_dispatched;
+    atomic<unsigned long> nr_merged;
+    /* Requests the driver bounced with -EAGAIN, sorted. Protected by lock */
+    struct list_head requeue;
+
+    /* Dispatches requeue once something completes. blk_mq_hw_queue isn't standard-layout, so
+     * the work carries the device and queue index instead of relying on container_of.
+     */
+    struct blk_mq_run_work
+    {
+        struct delayed_work dwork;
+        struct blockdev *dev;
+        unsigned int hwq;
+    } run_work;
+};
+
+struct blk_mq_sw_queue
+{
+    struct spinlock lock;
+    /* Pending requests, sorted by sector number */
+    struct list_head reqs;
+};
+
+struct blk_mq_queue
+{
+    const struct blk_mq_ops *ops;
+    unsigned int nr_hw_queues;
+    unsigned int queue_depth;
+    unsigned int max_segments;
+    size_t cmd_size;
+    size_t tag_size;
+    struct blk_mq_hw_queue *hw_queues;
+    struct blk_mq_sw_queue *sw_queues;
+    unsigned int nr_sw_queues;
+};
+
 struct blockdev
 {
     __blkread read;
@@ -72,6 +162,8 @@ struct blockdev
     struct blockdev *actual_blockdev; // isn't null when blockdev is a partition
     size_t offset;
     int (*submit_request)(struct blockdev *dev, struct bio_req *req);
+    /* Multi-queue state, for drivers that complete requests asynchronously */
+    struct blk_mq_queue *mq;
     /* This vmo serves as the buffer cache of the block device, exactly like the page cache */
     struct vm_object *vmo;
     /* This will have the mounted superblock here if this block device is mounted */
@@ -84,7 +176,7 @@ struct blockdev
 
     constexpr blockdev()
         : read{}, write{}, flush{}, power{}, name{}, sector_size{}, nr_sectors{}, device_info{},
-          actual_blockdev{}, offset{}, submit_request{}, vmo{}, sb{}, dev{}, partition_prefix{}
+          actual_blockdev{}, offset{}, submit_request{}, mq{}, vmo{}, sb{}, dev{}, partition_prefix{}
     {
     }
 };
@@ -142,8 +234,121 @@ int blkdev_flush(struct blockdev *dev);
  */
 int blkdev_power(int op, struct blockdev *dev);
 
+/**
+ * @brief Submit a request and wait for it to complete
+ *
+ * @param dev Block device
+ * @param req Request
+ * @return 0 on success, negative error codes
+ */
 int bio_submit_request(struct blockdev *dev, struct bio_req *req);
 
+/**
+ * @brief Submit a request asynchronously.
+ * req->b_end_io gets called when the request completes. req and its page_iov's must stay alive
+ * until then.
+ *
+ * @param dev Block device
+ * @param req Request
+ * @return 0 on success (b_end_io will be called), negative error codes (it won't)
+ */
+int bio_submit_async(struct blockdev *dev, struct bio_req *req);
+
+/**
+ * A set of asynchronous requests that get waited on as a whole.
+ */
+struct bio_batch
+{
+    struct wait_queue wq;
+    atomic<unsigned long> pending;
+    atomic<int> state;
+    atomic<int> error;
+};
+
+/**
+ * @brief Initialise a bio_batch
+ *
+ * @param batch Batch
+ */
+void bio_batch_init(struct bio_batch *batch);
+
+/**
+ * @brief Submit a request as part of a batch. Overrides b_end_io and b_private.
+ *
+ * @param batch Batch
+ * @param dev Block device
+ * @param req Request
+ * @return 0 on success, negative error codes
+ */
+int bio_batch_submit(struct bio_batch *batch, struct blockdev *dev, struct bio_req *req);
+
+/**
+ * @brief Wait for every request in the batch to complete
+ *
+ * @param batch Batch
+ * @return 0 if every request succeeded, else -EIO
+ */
+int bio_batch_wait(struct bio_batch *batch);
+
+/**
+ * @brief Complete a request. Called by drivers once the request's status flags are set.
+ * May be called from IRQ context.
+ *
+ * @param req Request
+ */
+void bio_complete(struct bio_req *req);
+
+/**
+ * @brief Set up multi-queue submission for a block device
+ *
+ * @param dev Block device
+ * @param ops Driver operations
+ * @param nr_hw_queues Number of hardware queues
+ * @param queue_depth Maximum number of in-flight requests, per hardware queue
+ * @param max_segments Maximum number of page_iov's in a merged request (0 disables merging)
+ * @param cmd_size Size of the per-request driver data
+ * @return 0 on success, negative error codes
+ */
+int blk_mq_init_queue(struct blockdev *dev, const struct blk_mq_ops *ops,
+                      unsigned int nr_hw_queues, unsigned int queue_depth,
+                      unsigned int max_segments, size_t cmd_size);
+
+/**
+ * @brief Get the driver-private data of an in-flight request
+ *
+ * @param req Request (as passed to queue_rq)
+ * @return Pointer to cmd_size bytes of driver data
+ */
+void *blk_mq_rq_to_pdu(struct bio_req *req);
+
+/**
+ * Plugging lets a thread batch up requests, so they can be sorted and merged before
+ * getting to the driver. Plugged requests are issued on blk_finish_plug, or when the thread
+ * waits on a synchronous request.
+ */
+struct blk_plug
+{
+    struct list_head reqs;
+    unsigned int nr_reqs;
+};
+
+/* Flush the plug when it gets this many requests */
+#define BLK_PLUG_MAX_REQS 32
+
+/**
+ * @brief Start plugging requests submitted by this thread
+ *
+ * @param plug Plug, usually on the stack
+ */
+void blk_start_plug(struct blk_plug *plug);
+
+/**
+ * @brief Stop plugging and issue every plugged request
+ *
+ * @param plug Plug passed to blk_start_plug
+ */
+void blk_finish_plug(struct blk_plug *plug);
+
 static inline bool block_get_device_letter_from_id(unsigned int id, cul::slice<char> buffer)
 {
     if (id > 26)
@@ -40,6 +40,10 @@ struct block_buf
 
 #define BLOCKBUF_FLAG_DIRTY    (1 << 0)
 #define BLOCKBUF_FLAG_UNDER_WB (1 << 1)
+/* The block has data, but the filesystem hasn't picked a block for it yet (delayed allocation).
+ * It does so when the page gets written back.
+ */
+#define BLOCKBUF_FLAG_DELALLOC (1 << 2)
 
 #define MAX_BLOCK_SIZE PAGE_SIZE
 
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_DIRECT_IO_H
+#define _ONYX_DIRECT_IO_H
+
+#include <stddef.h>
+
+#include <onyx/block.h>
+
+/**
+ * Direct I/O (O_DIRECT) moves data between a user buffer and the disk without going through the
+ * page cache. The user buffer's pages get pinned and handed to the block layer as is, so there's
+ * no copy. Filesystems only need to map file ranges to sectors (see dio_get_extent_t).
+ */
+
+struct inode;
+struct vm_object;
+
+/* dio_extent::sector of an extent that's a hole in the file */
+#define DIO_EXTENT_HOLE ((sector_t) -1)
+
+struct dio_extent
+{
+    /* First sector of the extent, or DIO_EXTENT_HOLE */
+    sector_t sector;
+    /* Length of the extent, in bytes */
+    size_t length;
+};
+
+/**
+ * @brief Map the start of a file range to a run of contiguous sectors (or a hole).
+ * Writes must not get holes back, so the filesystem needs to allocate blocks for them.
+ *
+ * @param ino Inode
+ * @param offset Offset in the file
+ * @param len Length of the range
+ * @param op BIO_REQ_READ_OP or BIO_REQ_WRITE_OP
+ * @param ext Extent to fill; its length may be shorter than len, but not 0
+ * @return 0 on success, negative error codes
+ */
+typedef int (*dio_get_extent_t)(struct inode *ino, size_t offset, size_t len, unsigned int op,
+                                struct dio_extent *ext);
+
+/**
+ * @brief Do direct I/O between a user buffer and a block device.
+ * The caller needs to check alignment (offset, len and the buffer need to be at least sector
+ * aligned) and hold the appropriate locks. Cached pages in the range get written back before the
+ * I/O, and updated after a write, so the cache stays coherent with the disk.
+ *
+ * @param ino Inode
+ * @param dev Block device
+ * @param cache VM object that caches the range, or nullptr
+ * @param offset Offset of the I/O
+ * @param len Length of the I/O
+ * @param ubuf User buffer
+ * @param op BIO_REQ_READ_OP or BIO_REQ_WRITE_OP
+ * @param get_extent Extent mapping callback
+ * @return Number of bytes transferred, or negative error codes
+ */
+ssize_t dio_rw(struct inode *ino, struct blockdev *dev, struct vm_object *cache, size_t offset,
+               size_t len, void *ubuf, unsigned int op, dio_get_extent_t get_extent);
+
+#endif
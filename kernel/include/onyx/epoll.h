@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_EPOLL_H
+#define _ONYX_EPOLL_H
+
+struct file;
+
+/**
+ * @brief Remove a file from every epoll instance that's watching it
+ * Called when the last reference to the file goes away.
+ *
+ * @param f File
+ */
+void epoll_release_file(struct file *f);
+
+#endif
@@ -6,6 +6,8 @@
 #ifndef _KERNEL_FUTEX_H
 #define _KERNEL_FUTEX_H
 
+#include <stdint.h>
+
 #include <onyx/list.h>
 #include <onyx/process.h>
 #include <onyx/spinlock.h>
@@ -28,6 +30,52 @@
 #define FUTEX_CLOCK_REALTIME 256
 #define FUTEX_OP_MASK        ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
+/* FUTEX_WAIT_BITSET and FUTEX_WAKE_BITSET with this bitset behave like FUTEX_WAIT/WAKE */
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+
+/* PI futex word layout: the owner's TID, plus these two flags */
+#define FUTEX_WAITERS    0x80000000
+#define FUTEX_OWNER_DIED 0x40000000
+#define FUTEX_TID_MASK   0x3fffffff
+
+/* FUTEX_WAKE_OP's val3 encodes an operation on *uaddr2, and a comparison with its old value */
+#define FUTEX_OP_SET  0 /* uaddr2 = oparg */
+#define FUTEX_OP_ADD  1 /* uaddr2 += oparg */
+#define FUTEX_OP_OR   2 /* uaddr2 |= oparg */
+#define FUTEX_OP_ANDN 3 /* uaddr2 &= ~oparg */
+#define FUTEX_OP_XOR  4 /* uaddr2 ^= oparg */
+
+/* Use (1 << oparg) as the operand */
+#define FUTEX_OP_OPARG_SHIFT 8
+
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+/* futex_waitv(2) */
+#define FUTEX_WAITV_MAX 128
+#define FUTEX2_SIZE_U32 0x02
+#define FUTEX2_PRIVATE  FUTEX_PRIVATE_FLAG
+
+struct futex_waitv
+{
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t __reserved;
+};
+
 int futex_wake(int *uaddr, int nr_waiters);
 
+/**
+ * @brief Give away the PI futexes a thread owns, as it exits
+ * Each futex goes to its top waiter, with FUTEX_OWNER_DIED set.
+ *
+ * @param thread Exiting thread (the current one)
+ */
+void futex_exit_pi(struct thread *thread);
+
 #endif
@@ -56,6 +56,5 @@ void dispatch_irq(unsigned int irq, struct irq_context *context);
 int install_irq(unsigned int irq, irq_t handler, struct device *device, unsigned int flags,
                 void *cookie);
 void free_irq(unsigned int irq, struct device *device);
-void irq_init(void);
 
 #endif
@@ -13,22 +13,26 @@
 #include <onyx/timer.h>
 #include <onyx/vm.h>
 
+#include <onyx/public/ktrace.h>
+
 void ktrace_init(void);
 
-enum ktrace_type_entry
-{
-    KTRACE_TYPE_ENTRY = 0,
-    KTRACE_TYPE_EXIT = 1
-};
+/**
+ * @brief Reserve space for a record in the current CPU's trace ring
+ * Must be called with IRQs disabled, and followed by ktrace_commit().
+ *
+ * @param type KTRACE_EV_* type
+ * @param size Size of the record, header included
+ * @return Pointer to the record, with the header filled in, or NULL if the ring is full
+ */
+void *ktrace_reserve(unsigned int type, size_t size);
 
-struct ktrace_ftrace_data
-{
-    unsigned int tid;
-    pid_t pid;
-    unsigned long caller;
-    hrtime_t timestamp;
-    enum ktrace_type_entry type;
-} __attribute__((packed));
+/**
+ * @brief Commit the record reserved by the last ktrace_reserve()
+ *
+ * @param record Record
+ */
+void ktrace_commit(void *record);
 
 #ifdef __cplusplus
 
@@ -38,16 +42,37 @@ struct ktrace_ftrace_data
 namespace ktrace
 {
 
+/**
+ * @brief Sorted copy of a code location section (like __mcount_loc), so we can binary search it
+ */
+class loc_index
+{
+private:
+    unsigned long *locs{nullptr};
+    size_t nr_locs{0};
+
+public:
+    bool init(linker_section &section);
+
+    bool initialized() const
+    {
+        return locs != nullptr;
+    }
+
+    /**
+     * @brief Find the first location in [start, end)
+     *
+     * @param start Start of the range
+     * @param end End of the range
+     * @return The location, or -1 if there's none
+     */
+    unsigned long find(unsigned long start, unsigned long end) const;
+};
+
 class ktracepoint
 {
 private:
     const char *function_name;
-    struct page *ring_buffer;
-    static constexpr size_t ring_buffer_size = PAGE_SIZE * 8;
-    size_t read_pointer;
-    size_t write_pointer;
-    unsigned long nr_overruns;
-    struct spinlock buf_lock;
     bool activated;
     struct symbol *sym;
     unsigned long mcount_call_addr;
@@ -55,21 +80,10 @@ private:
 
     static constexpr unsigned long search_bad_addr = -1;
 
-    template <linker_section &section>
-    unsigned long search_loc()
+    unsigned long search_loc(const loc_index &index)
     {
-        auto locs = section.as<unsigned long>();
-        size_t loc_entries = section.size() / sizeof(unsigned long);
-
-        for (size_t i = 0; i < loc_entries; i++)
-        {
-            if (locs[i] >= sym->value && locs[i] < sym->value + sym->size)
-                return locs[i];
-        }
-
-        return search_bad_addr;
+        return index.find(sym->value, sym->value + sym->size);
     }
-    void put_entry(ktrace_ftrace_data &data);
 
 public:
     unsigned long get_entry_addr()
@@ -78,13 +92,12 @@ public:
     }
 
     ktracepoint(const char *function_name, struct symbol *sym)
-        : function_name(function_name), ring_buffer{nullptr}, read_pointer{0}, write_pointer{0},
-          nr_overruns{0}, buf_lock{}, sym(sym), mcount_call_addr{}, return_call_addr{}
+        : function_name(function_name), activated{}, sym(sym), mcount_call_addr{},
+          return_call_addr{}
     {
     }
 
     bool find_call_addrs();
-    bool allocate_buffer();
 
     void activate();
     void deactivate();
@@ -93,6 +106,14 @@ public:
     static fnv_hash_t hash(unique_ptr<ktracepoint> &t);
 };
 
+/**
+ * @brief Trace calls to a function
+ *
+ * @param func Name of the function
+ * @return 0 on success, negative error codes
+ */
+int add_function(const char *func);
+
 void log_func_entry(unsigned long ip, unsigned long caller);
 
 }; // namespace ktrace
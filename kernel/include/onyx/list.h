@@ -130,6 +130,24 @@ static inline void list_reset(struct list_head *head)
     INIT_LIST_HEAD(head);
 }
 
+/**
+ * @brief Move every element of a list to another (empty) list, leaving the old list empty
+ *
+ * @param new_head New (empty) list head
+ * @param old_head Old list head
+ */
+static inline void list_move(struct list_head *new_head, struct list_head *old_head)
+{
+    if (list_is_empty(old_head))
+        return;
+
+    new_head->next = old_head->next;
+    new_head->prev = old_head->prev;
+    new_head->next->prev = new_head;
+    new_head->prev->next = new_head;
+    INIT_LIST_HEAD(old_head);
+}
+
 #define list_for_every(lh) for (struct list_head *l = (lh)->next; l != (lh); l = l->next)
 
 /* Again, this one is also very clearly inspired by linux */
@@ -7,23 +7,43 @@
 #ifndef _ONYX_MM_FLUSH_H
 #define _ONYX_MM_FLUSH_H
 
+#include <onyx/block.h>
 #include <onyx/list.h>
 #include <onyx/mutex.h>
-#include <onyx/semaphore.h>
 #include <onyx/spinlock.h>
 #include <onyx/vm.h>
+#include <onyx/workqueue.h>
 
 /* TODO: This file started as mm specific but it's quite fs now, no? */
 
 struct inode;
 
 struct flush_object;
+
+/* A write of a single flush object, that writeback can sort and batch with others */
+struct flush_wb_req
+{
+    struct bio_req req;
+    struct page_iov vec;
+    struct blockdev *dev;
+    struct flush_object *obj;
+};
+
 /* Implemented by users of the flush subsystem */
 struct flush_ops
 {
     ssize_t (*flush)(struct flush_object *fmd);
     bool (*is_dirty)(struct flush_object *fmd);
     void (*set_dirty)(bool value, struct flush_object *fmd);
+    /* Optional: describe the object's write in req (req, vec and dev) and mark it as under
+     * writeback, instead of writing it out right away. Returns 0 on success, or a negative error
+     * code if it needs to go through flush().
+     */
+    int (*prepare_wb)(struct flush_object *fmd, struct flush_wb_req *req);
+    /* Optional: block device the object gets written to */
+    struct blockdev *(*get_dev)(struct flush_object *fmd);
+    /* Optional: size of the object's data in bytes, for dirty accounting. Defaults to PAGE_SIZE */
+    size_t (*get_size)(struct flush_object *fmd);
 };
 
 struct flush_object
@@ -43,6 +63,28 @@ void flush_remove_inode(struct inode *ino);
 ssize_t flush_sync_one(struct flush_object *obj);
 void flush_do_sync(void);
 
+/**
+ * @brief Throttle the current thread if there's too much dirty data
+ * Writers should call this after dirtying data, without holding any locks writeback needs.
+ *
+ * @param bdev Block device the data was dirtied for, or NULL if unknown
+ */
+void flush_balance_dirty(struct blockdev *bdev);
+
+/**
+ * @brief Get the amount of dirty data (pages and filesystem blocks)
+ *
+ * @return Dirty data, in pages
+ */
+unsigned long flush_get_nr_dirty(void);
+
+/**
+ * @brief Get the amount of data under writeback
+ *
+ * @return Data under writeback, in pages
+ */
+unsigned long flush_get_nr_writeback(void);
+
 #ifdef __cplusplus
 
 #include <onyx/atomic.hpp>
@@ -57,17 +99,40 @@ private:
     struct list_head dirty_bufs;
     struct list_head dirty_inodes;
     atomic<unsigned long> block_load;
+    /* Bytes of dirty (or under writeback) data on this dev */
+    atomic<unsigned long> dirty_bytes;
+    /* Bytes this dev wrote out recently, to give it its share of the dirty threshold */
+    atomic<unsigned long> nr_written;
+    /* Held while writing back. Filesystems call into us to dirty things while holding their own
+     * locks (which writeback may need), so dirtying only takes list_lock.
+     */
     struct mutex __lock;
-    /* Each flush dev also is associated with a thread that runs every x seconds */
-    struct thread *thread;
-    struct semaphore thread_sem;
+    /* Protects the dirty lists */
+    struct spinlock list_lock;
+    /* Writeback runs off a delayed work item, every wb_run_delta_ms while there's dirty data */
+    struct delayed_work wb_work;
+    /* Kicked by throttled writers, to start writeback right away */
+    struct work_struct wb_now_work;
+
+    static void wb_work_func(struct work_struct *work);
+    static void wb_now_work_func(struct work_struct *work);
+    void queue_writeback();
+    void writeback_inodes();
+    void writeback_bufs();
+    void submit_wb_batch(struct flush_wb_req *reqs, size_t nr);
+    void written(unsigned long bytes);
+    void cleaned(unsigned long bytes);
 
 public:
     static constexpr unsigned long wb_run_delta_ms = 10000;
+    /* Max number of objects we sort and submit at once */
+    static constexpr size_t wb_batch_size = 256;
     constexpr flush_dev()
-        : dirty_bufs{}, dirty_inodes{}, block_load{0}, __lock{}, thread{}, thread_sem{}
+        : dirty_bufs{}, dirty_inodes{}, block_load{0}, dirty_bytes{0}, nr_written{0}, __lock{},
+          list_lock{}, wb_work{}, wb_now_work{}
     {
         mutex_init(&__lock);
+        spinlock_init(&list_lock);
         INIT_LIST_HEAD(&dirty_bufs);
         INIT_LIST_HEAD(&dirty_inodes);
     }
@@ -81,6 +146,18 @@ public:
         return block_load;
     }
 
+    unsigned long get_dirty_pages()
+    {
+        return dirty_bytes >> PAGE_SHIFT;
+    }
+
+    unsigned long get_nr_written()
+    {
+        return nr_written;
+    }
+
+    void kick_writeback();
+
     void lock()
     {
         mutex_lock(&__lock);
@@ -92,7 +169,6 @@ public:
     bool called_from_sync();
 
     void init();
-    void run();
     bool add_buf(struct flush_object *buf);
     void remove_buf(struct flush_object *buf);
     void add_inode(struct inode *ino);
@@ -12,6 +12,7 @@
 
 #include <onyx/list.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/numa.h>
 #include <onyx/spinlock.h>
 
 #include <onyx/atomic.hpp>
@@ -25,29 +26,39 @@ struct slab_cache_percpu_context
     atomic<int> touched;
 } __align_cache;
 
-struct slab_cache
+/**
+ * @brief Per-NUMA-node slab lists
+ * Each slab belongs to the node of the CPU that created it, and CPUs only refill from their own
+ * node's lists. This keeps objects node-local and spreads lock contention across nodes.
+ */
+struct slab_cache_node
 {
-    const char *name;
     struct list_head partial_slabs;
     struct list_head free_slabs;
     struct list_head full_slabs;
+    size_t npartialslabs;
+    size_t nfreeslabs;
+    size_t nfullslabs;
+    spinlock lock;
+} __align_cache;
+
+struct slab_cache
+{
+    const char *name;
     size_t nr_objects;
     size_t active_objects;
     size_t alignment;
     size_t objsize;
     size_t actual_objsize;
     size_t redzone;
-    size_t npartialslabs;
-    size_t nfreeslabs;
-    size_t nfullslabs;
     struct list_head cache_list_node;
     unsigned int flags;
-    spinlock lock;
     void (*ctor)(void *);
     int mag_limit;
     // TODO: This is horrible. We need a way to allocate percpu memory,
     // and then either trim it or grow it when CPUs come online.
     struct slab_cache_percpu_context pcpu[CONFIG_SMP_NR_CPUS] __align_cache;
+    struct slab_cache_node node[CONFIG_NUMA_NR_NODES];
 };
 
 #define KMEM_CACHE_HWALIGN (1 << 0)
@@ -16,8 +16,7 @@
 #include <onyx/list.h>
 #include <onyx/mutex.h>
 #include <onyx/page.h>
-
-#include <libdict/rb_tree.h>
+#include <onyx/radix.h>
 
 enum vmo_type
 {
@@ -59,6 +58,10 @@ struct vm_object_ops
 #define VMO_FLAG_LOCK_FUTURE_PAGES (1 << 0)
 #define VMO_FLAG_DEVICE_MAPPING    (1 << 1)
 
+/* Page tags, kept in the vmo's page tree */
+#define VMO_TAG_DIRTY     0
+#define VMO_TAG_WRITEBACK 1
+
 /**
  * @brief Represents a generic VM object, that may have backing or may just be anonymous.
  * The VM subsystem works with these objects, and each VM region points to a
@@ -71,7 +74,8 @@ struct vm_object
     size_t size;
     unsigned long flags;
 
-    rb_tree *pages;
+    /* Resident pages, indexed by page number (off >> PAGE_SHIFT) */
+    struct radix_tree pages;
 
     /* Points to (or is) private data that may be needed by the backer of this VM */
     void *priv;
@@ -115,6 +119,35 @@ struct vm_object
 
         return true;
     }
+
+    /**
+     * @brief Calls c(page, off) for every resident page in [start, end), in order.
+     * The caller should hold page_lock if the pages may go away.
+     *
+     * @param start Start of the range
+     * @param end End of the range
+     * @param c Callable; returning false stops the iteration
+     * @param tag Only visit pages with this tag (VMO_TAG_*), or RADIX_TREE_NO_TAG
+     * @return False if c stopped the iteration, else true
+     */
+    template <typename Callable>
+    bool for_every_page(size_t start, size_t end, Callable c, int tag = RADIX_TREE_NO_TAG)
+    {
+        if (start >= end)
+            return true;
+
+        unsigned long index;
+        void *entry;
+
+        radix_tree_for_each_tagged(&pages, index, entry, start >> PAGE_SHIFT,
+                                   (end - 1) >> PAGE_SHIFT, tag)
+        {
+            if (!c((struct page *) entry, index << PAGE_SHIFT))
+                return false;
+        }
+
+        return true;
+    }
 };
 
 /**
@@ -193,6 +226,16 @@ vm_object *vmo_create_phys(size_t size);
  */
 vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page **ppage);
 
+/**
+ * @brief Look up and pin a resident page without taking the page_lock
+ * Safe to call with the page_lock held.
+ *
+ * @param vmo The VMO
+ * @param off Offset of the page
+ * @return The pinned page, or NULL if it wasn't found (or went away while we looked at it)
+ */
+struct page *vmo_get_lockless(vm_object *vmo, size_t off);
+
 /**
  * @brief Forks the VMO, performing any COW tricks that may be required.
  *
@@ -273,6 +316,37 @@ int vmo_add_page(size_t off, page *p, vm_object *vmo);
  */
 int vmo_add_page_unlocked(size_t off, page *p, vm_object *vmo);
 
+/**
+ * @brief Looks up a page in the VMO, without pinning it.
+ * The caller needs to hold the page_lock.
+ *
+ * @param vmo The VMO.
+ * @param off Offset of the page.
+ * @return The page, or NULL if it's not resident.
+ */
+static inline struct page *vmo_find_page(vm_object *vmo, size_t off)
+{
+    return (struct page *) radix_tree_lookup(&vmo->pages, off >> PAGE_SHIFT);
+}
+
+/**
+ * @brief Sets a tag (VMO_TAG_*) on a resident page.
+ *
+ * @param vmo The VMO.
+ * @param off Offset of the page.
+ * @param tag The tag.
+ */
+void vmo_set_page_tag(vm_object *vmo, size_t off, unsigned int tag);
+
+/**
+ * @brief Clears a tag (VMO_TAG_*) on a page.
+ *
+ * @param vmo The VMO.
+ * @param off Offset of the page.
+ * @param tag The tag.
+ */
+void vmo_clear_page_tag(vm_object *vmo, size_t off, unsigned int tag);
+
 /**
  * @brief Increments the reference counter on the VMO.
  *
@@ -318,9 +392,10 @@ void vmo_uncow(vm_object *vmo);
  *
  * @param vmo The VMO.
  * @param off Offset of the page.
+ * @param expected The page the faulting mapping had.
  * @return The struct page of the new copied-to page.
  */
-struct page *vmo_cow_on_page(vm_object *vmo, size_t off);
+struct page *vmo_cow_on_page(vm_object *vmo, size_t off, struct page *expected);
 
 /**
  * @brief Determines whether the vmo is a COW copy.
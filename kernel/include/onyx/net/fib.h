@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NET_FIB_H
+#define _ONYX_NET_FIB_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <onyx/mutex.h>
+#include <onyx/scoped_lock.h>
+
+/* Keys are addresses in network byte order, so bit 0 is the MSB of the first byte */
+#define FIB_KEY_BYTES 16
+
+struct fib_key
+{
+    uint8_t bytes[FIB_KEY_BYTES];
+};
+
+/**
+ * @brief Get the number of leading bits two keys have in common
+ *
+ * @param a First key
+ * @param b Second key
+ * @param max Max number of bits to look at
+ * @return Number of common bits, up to max
+ */
+unsigned int fib_common_bits(const fib_key &a, const fib_key &b, unsigned int max);
+
+/**
+ * @brief Get the prefix length of a netmask
+ *
+ * @param mask Netmask, in network byte order
+ * @param len Length of the mask, in bytes
+ * @return Prefix length, or -1 if the mask isn't contiguous
+ */
+int fib_mask_to_prefix_len(const void *mask, unsigned int len);
+
+/**
+ * @brief Get the current FIB generation
+ * The generation gets bumped every time a routing table (of any family) changes, so routes that
+ * were looked up in an older generation may be stale.
+ *
+ * @return Current generation
+ */
+unsigned long fib_generation();
+
+/**
+ * @brief Bump the FIB generation, invalidating every cached route
+ *
+ */
+void fib_bump_generation();
+
+/**
+ * Forwarding information base: a path-compressed binary trie that does longest prefix matching.
+ * Every node stores its full prefix, so nodes with a single child get skipped over entirely and
+ * lookups only look at as many nodes as there are distinct prefixes on the way to the address.
+ *
+ * Lookups don't take any locks. Writers serialise on a mutex and build every new node completely
+ * before publishing it with a release store, so a concurrent lookup sees the trie either before or
+ * after the insertion. This only works because routes never get removed (there's no way to delete
+ * a route yet); removal will need some kind of grace period before nodes can be freed.
+ */
+template <typename Route, unsigned int KeyBits>
+class fib_trie
+{
+private:
+    struct fib_entry
+    {
+        fib_entry *next;
+        Route route;
+    };
+
+    struct fib_node
+    {
+        fib_key key;
+        unsigned int prefix_len;
+        fib_node *child[2];
+        /* Routes for exactly this prefix, nullptr if the node is only a branch */
+        fib_entry *entries;
+    };
+
+    fib_node *root{};
+    mutex lock;
+
+    static bool key_bit(const fib_key &key, unsigned int bit)
+    {
+        return key.bytes[bit / 8] & (0x80 >> (bit % 8));
+    }
+
+    template <typename T>
+    static T *load(T *const *ptr)
+    {
+        return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    }
+
+    template <typename T>
+    static void publish(T **ptr, T *val)
+    {
+        __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+    }
+
+    static fib_node *new_node(const fib_key &key, unsigned int prefix_len)
+    {
+        auto node = new fib_node{};
+        if (!node)
+            return nullptr;
+
+        node->prefix_len = prefix_len;
+
+        /* Keep the bits past the prefix clear */
+        memcpy(node->key.bytes, key.bytes, prefix_len / 8);
+        if (prefix_len % 8)
+        {
+            unsigned int last = prefix_len / 8;
+            node->key.bytes[last] = key.bytes[last] & (0xff00 >> (prefix_len % 8));
+        }
+
+        return node;
+    }
+
+public:
+    /**
+     * @brief Add a route to the trie
+     *
+     * @param key Destination of the route
+     * @param prefix_len Prefix length of the route
+     * @param route Route
+     * @return True on success, false if we're out of memory
+     */
+    bool insert(const fib_key &key, unsigned int prefix_len, const Route &route)
+    {
+        auto entry = new fib_entry{nullptr, route};
+        if (!entry)
+            return false;
+
+        scoped_mutex g{lock};
+
+        fib_node **slot = &root;
+
+        while (true)
+        {
+            fib_node *node = *slot;
+
+            if (!node)
+            {
+                auto leaf = new_node(key, prefix_len);
+                if (!leaf)
+                    break;
+
+                leaf->entries = entry;
+                publish(slot, leaf);
+                return true;
+            }
+
+            unsigned int common =
+                fib_common_bits(node->key, key, prefix_len < node->prefix_len ? prefix_len
+                                                                               : node->prefix_len);
+
+            if (common == node->prefix_len)
+            {
+                if (node->prefix_len == prefix_len)
+                {
+                    entry->next = node->entries;
+                    publish(&node->entries, entry);
+                    return true;
+                }
+
+                /* The node's prefix contains ours, go down */
+                slot = &node->child[key_bit(key, node->prefix_len)];
+                continue;
+            }
+
+            if (common == prefix_len)
+            {
+                /* Our prefix contains the node's, so we go in its place */
+                auto parent = new_node(key, prefix_len);
+                if (!parent)
+                    break;
+
+                parent->entries = entry;
+                parent->child[key_bit(node->key, prefix_len)] = node;
+                publish(slot, parent);
+                return true;
+            }
+
+            /* The prefixes diverge, so we need a branch where they do */
+            auto branch = new_node(key, common);
+            auto leaf = new_node(key, prefix_len);
+
+            if (!branch || !leaf)
+            {
+                delete branch;
+                delete leaf;
+                break;
+            }
+
+            leaf->entries = entry;
+            branch->child[key_bit(key, common)] = leaf;
+            branch->child[key_bit(node->key, common)] = node;
+            publish(slot, branch);
+            return true;
+        }
+
+        delete entry;
+        return false;
+    }
+
+    /**
+     * @brief Look up the longest prefix that has a usable route to an address
+     * Doesn't take any locks.
+     *
+     * @param key Address
+     * @param score Callable that takes a const Route & and returns how good it is; negative
+     * scores mean the route can't be used. The best route of a prefix wins, ties go to the most
+     * recently added route.
+     * @param out Where to copy the route to
+     * @return True if we found a route, else false
+     */
+    template <typename Score>
+    bool lookup(const fib_key &key, Score score, Route &out) const
+    {
+        bool found = false;
+        const fib_node *node = load(&root);
+
+        while (node)
+        {
+            if (fib_common_bits(node->key, key, node->prefix_len) != node->prefix_len)
+                break;
+
+            const fib_entry *best = nullptr;
+            int best_score = -1;
+
+            for (const fib_entry *e = load(&node->entries); e; e = e->next)
+            {
+                int s = score(e->route);
+
+                if (s > best_score)
+                {
+                    best = e;
+                    best_score = s;
+                }
+            }
+
+            /* Deeper prefixes override what we found before */
+            if (best)
+            {
+                out = best->route;
+                found = true;
+            }
+
+            if (node->prefix_len == KeyBits)
+                break;
+
+            node = load(&node->child[key_bit(key, node->prefix_len)]);
+        }
+
+        return found;
+    }
+};
+
+#endif
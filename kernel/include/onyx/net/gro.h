@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NET_GRO_H
+#define _ONYX_NET_GRO_H
+
+struct netif;
+struct packetbuf;
+
+/**
+ * @brief Start a GRO run on this CPU
+ * Packets received from nif until gro_end() may get held back and coalesced.
+ * Must be called with preemption disabled.
+ *
+ * @param nif Interface that's being polled
+ */
+void gro_begin(struct netif *nif);
+
+/**
+ * @brief End the GRO run, sending every held packet up the stack
+ *
+ * @param nif Interface that was being polled
+ */
+void gro_end(struct netif *nif);
+
+/**
+ * @brief Receive a packet through GRO
+ * The packet either gets merged into (or held as) a bigger packet of the same TCP flow, or goes
+ * up the stack right away.
+ *
+ * @param nif Interface
+ * @param buf Packet, with data pointing to the link layer header
+ * @return 0 on success, negative error codes
+ */
+int gro_receive(struct netif *nif, struct packetbuf *buf);
+
+#endif
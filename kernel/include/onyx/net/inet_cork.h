@@ -14,6 +14,8 @@
 #include <onyx/net/inet_packet_flow.h>
 #include <onyx/packetbuf.h>
 
+#include <onyx/expected.hpp>
+
 class inet_cork
 {
 protected:
@@ -28,8 +30,12 @@ protected:
     int alloc_and_append(const iovec *vec, size_t vec_len, size_t proto_hdr_len,
                          size_t max_packet_len, size_t skip_first);
 
+    expected<packetbuf *, int> zerocopy_tail(size_t proto_hdr_len, size_t max_packet_len,
+                                             zerocopy_notif *notif, unsigned int &room);
+
 public:
-    inet_cork(int sock_type) : pending_{AF_UNSPEC}, length_{}, sock_type{sock_type}
+    inet_cork(int sock_type)
+        : packet_list_len{}, pending_{AF_UNSPEC}, length_{}, sock_type{sock_type}
     {
         INIT_LIST_HEAD(&packet_list);
     }
@@ -38,6 +44,34 @@ public:
 
     int append_data(const iovec *vec, size_t vec_len, size_t proto_hdr_size, size_t max_packet_len);
 
+    /**
+     * @brief Append user memory without copying it, by attaching the (pinned) user pages to
+     * the packets
+     *
+     * @param vec Iovecs
+     * @param vec_len Number of iovecs
+     * @param proto_hdr_size Size of the protocol header
+     * @param max_packet_len Max length of a packet, including the protocol header
+     * @param notif Zerocopy notification of the send, which the packets hold on to
+     * @return 0 on success, negative error codes
+     */
+    int append_user_pages(const iovec *vec, size_t vec_len, size_t proto_hdr_size,
+                          size_t max_packet_len, zerocopy_notif *notif);
+
+    /**
+     * @brief Append a page fragment without copying it
+     *
+     * @param page Page, which the packets take references to
+     * @param off Offset of the data in the page
+     * @param len Length of the data
+     * @param proto_hdr_size Size of the protocol header
+     * @param max_packet_len Max length of a packet, including the protocol header
+     * @param notif Zerocopy notification of the send, may be nullptr
+     * @return 0 on success, negative error codes
+     */
+    int append_page(struct page *page, unsigned int off, unsigned int len, size_t proto_hdr_size,
+                    size_t max_packet_len, zerocopy_notif *notif);
+
     int send(const iflow &flow, void (*prepare_headers)(packetbuf *buf, const iflow &flow));
 
     list_head *get_packet_list()
@@ -58,6 +58,8 @@ struct inet_route
     netif *nif;
     unsigned short flags;
     shared_ptr<neighbour> dst_hw;
+    /* FIB generation the route was looked up in, the route is stale once it changes */
+    unsigned long fib_gen;
 };
 
 #endif
@@ -8,6 +8,7 @@
 #define _ONYX_NET_INET_SOCKET_H
 
 #include <onyx/byteswap.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/inet_cork.h>
 #include <onyx/net/inet_proto.h>
 #include <onyx/net/inet_route.h>
@@ -126,6 +127,25 @@ struct inet_socket : public socket
 
     void append_inet_rx_pbuf(packetbuf *buf);
 
+    /**
+     * @brief Check if the cached route is still up to date with the routing tables
+     *
+     * @return True if it is, else false
+     */
+    bool route_cache_fresh() const
+    {
+        return route_cache_valid && route_cache.fib_gen == fib_generation();
+    }
+
+    /**
+     * @brief Get the route to our connected destination
+     * Uses the cached route, and looks it up again if the routing tables changed.
+     *
+     * @param domain Domain of the destination address
+     * @return The route, or a negative error code
+     */
+    expected<inet_route, int> connected_route(int domain);
+
     virtual ~inet_socket();
 
     int setsockopt_inet(int level, int opt, const void *optval, socklen_t len);
@@ -85,7 +85,7 @@ public:
             /* A better API would come in handy for TCP retransmissions */
             expiry_timer.deadline = clocksource_get_time() + validity * NS_PER_MS;
             expiry_timer.priv = this;
-            expiry_timer.flags = CLOCKEVENT_FLAG_PULSE;
+            expiry_timer.flags = CLOCKEVENT_FLAG_PULSE | CLOCKEVENT_FLAG_COARSE;
             expiry_timer.callback = neighbour_revalidate;
             timer_queue_clockevent(&expiry_timer);
         }
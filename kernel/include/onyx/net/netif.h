@@ -31,6 +31,9 @@ struct netif;
 #define NETIF_DOING_RX_POLL         (1 << 7)
 #define NETIF_MISSED_RX             (1 << 8)
 
+/* Default number of packets an interface may process per poll, see netif::rx_weight */
+#define NETIF_RX_WEIGHT 64
+
 struct packetbuf;
 
 struct netif_inet6_addr
@@ -79,8 +82,13 @@ struct netif
     struct list_head inet6_addr_list;
 
     int (*sendpacket)(packetbuf *buf, struct netif *nif);
-    int (*poll_rx)(struct netif *nif);
+    /* Process up to budget packets, returning how many were processed. Returning less than budget
+     * means the RX ring is empty, in which case rx_end() gets called.
+     */
+    int (*poll_rx)(struct netif *nif, int budget);
     void (*rx_end)(struct netif *nif);
+    /* Max packets we process per poll before moving on to other interfaces */
+    unsigned int rx_weight;
 
     struct list_head list_node;
     struct list_head rx_queue_node;
@@ -88,8 +96,8 @@ struct netif
 
     netif()
         : name{}, device_file{}, priv{}, if_id{}, flags{}, mtu{}, mac_address{}, local_ip{},
-          inet6_addr_list_lock{}, inet6_addr_list{}, sendpacket{}, poll_rx{}, rx_end{}, list_node{},
-          rx_queue_node{}, dll_ops{}
+          inet6_addr_list_lock{}, inet6_addr_list{}, sendpacket{}, poll_rx{}, rx_end{},
+          rx_weight{NETIF_RX_WEIGHT}, list_node{}, rx_queue_node{}, dll_ops{}
     {
         INIT_LIST_HEAD(&inet6_addr_list);
     }
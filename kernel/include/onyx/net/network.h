@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #include <onyx/vfs.h>
+#include <onyx/workqueue.h>
 
 #ifdef __cplusplus
 #include <onyx/net/socket.h>
@@ -22,6 +23,7 @@ struct network_args
     uint8_t *buffer;
     uint16_t size;
     struct netif *netif;
+    struct work_struct work;
 };
 
 void network_dispatch_receive(uint8_t *packet, uint16_t len, struct netif *netif);
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NET_SOCK_ERRQUEUE_H
+#define _ONYX_NET_SOCK_ERRQUEUE_H
+
+#include <onyx/list.h>
+#include <onyx/public/errqueue.h>
+#include <onyx/public/socket.h>
+#include <onyx/refcount.h>
+#include <onyx/spinlock.h>
+#include <onyx/wait_queue.h>
+
+struct sock_err_entry
+{
+    struct sock_extended_err ee;
+    struct list_head list_node;
+};
+
+/**
+ * Queue of extended errors (and zerocopy completions) of a socket, read with
+ * recvmsg(MSG_ERRQUEUE). It's refcounted separately from the socket, because completions hold a
+ * reference to it and may come after the socket is gone; they just get dropped then.
+ *
+ * Entries can be queued from any context, including IRQs.
+ */
+class sock_errqueue : public refcountable
+{
+private:
+    struct spinlock lock;
+    struct list_head queue;
+    wait_queue wq;
+
+public:
+    sock_errqueue() : lock{}
+    {
+        INIT_LIST_HEAD(&queue);
+        init_wait_queue_head(&wq);
+    }
+
+    ~sock_errqueue() override;
+
+    /**
+     * @brief Queue an entry, and wake up anyone polling for POLLERR
+     * Zerocopy completions get merged with the last entry if their ranges are contiguous, in
+     * which case the entry is freed.
+     *
+     * @param entry Entry, which the queue takes ownership of
+     */
+    void push(sock_err_entry *entry);
+
+    /**
+     * @brief Take the oldest entry out of the queue
+     *
+     * @return The entry (that the caller now owns), or nullptr if the queue is empty
+     */
+    sock_err_entry *pop();
+
+    bool empty();
+
+    /**
+     * @brief Poll the queue for POLLERR
+     *
+     * @param poll_file Poll file
+     * @return True if there are entries, else false
+     */
+    bool poll(void *poll_file);
+};
+
+/**
+ * @brief Receive an extended error off a socket's error queue
+ * The error gets copied to the control message buffer, as SOL_IP/IP_RECVERR (or
+ * SOL_IPV6/IPV6_RECVERR for AF_INET6 sockets), and no data is returned.
+ *
+ * @param queue Error queue, may be nullptr
+ * @param domain Domain of the socket
+ * @param msg Message header (kernel copy)
+ * @return 0 on success, -EAGAIN if there are no errors, or a negative error code
+ */
+ssize_t sock_recv_errqueue(sock_errqueue *queue, int domain, struct msghdr *msg);
+
+#endif
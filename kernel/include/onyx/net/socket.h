@@ -16,6 +16,7 @@
 #include <onyx/hybrid_lock.h>
 #include <onyx/net/netif.h>
 #include <onyx/net/proto_family.h>
+#include <onyx/net/sock_errqueue.h>
 #include <onyx/object.h>
 #include <onyx/refcount.h>
 #include <onyx/semaphore.h>
@@ -43,6 +44,7 @@ struct socket_conn_request
 };
 
 struct socket;
+class zerocopy_notif;
 
 static inline ssize_t iovec_count_length(iovec *vec, unsigned int n)
 {
@@ -152,6 +154,14 @@ public:
 
     bool broadcast_allowed : 1;
 
+    /* SO_ZEROCOPY: Allow MSG_ZEROCOPY sends */
+    bool zerocopy : 1;
+
+    /* Allocated on first use, since most sockets never get errors queued */
+    sock_errqueue *errqueue;
+    /* ID of the next MSG_ZEROCOPY send */
+    uint32_t zc_next_id;
+
     hrtime_t rcv_timeout;
     hrtime_t snd_timeout;
     unsigned int shutdown_state;
@@ -162,13 +172,16 @@ public:
           socket_lock{}, bound{}, connected{}, listener_sem{}, conn_req_list_lock{},
           conn_request_list{}, nr_pending{}, backlog{}, proto_domain{},
           rx_max_buf{DEFAULT_RX_MAX_BUF}, tx_max_buf{DEFAULT_TX_MAX_BUF}, reuse_addr{false},
-          rcv_timeout{0}, snd_timeout{0}, shutdown_state{}
+          zerocopy{false}, errqueue{}, zc_next_id{0}, rcv_timeout{0}, snd_timeout{0},
+          shutdown_state{}
     {
         INIT_LIST_HEAD(&socket_backlog);
     }
 
     virtual ~socket()
     {
+        if (errqueue)
+            errqueue->unref();
     }
 
     ssize_t default_recvfrom(void *buf, size_t len, int flags, sockaddr *src_addr, socklen_t *slen);
@@ -227,6 +240,29 @@ public:
         return ret;
     }
 
+    /**
+     * @brief Get the error queue of the socket, allocating it if needed
+     *
+     * @return The error queue, or nullptr if we're out of memory
+     */
+    sock_errqueue *get_errqueue();
+
+    /**
+     * @brief Start a MSG_ZEROCOPY send
+     *
+     * @return Notification for the send, or nullptr if we're out of memory
+     */
+    zerocopy_notif *zerocopy_start();
+
+    /**
+     * @brief Finish a MSG_ZEROCOPY send, and drop our reference to the notification.
+     * The completion gets queued once every packet that has the send's pages is gone.
+     *
+     * @param notif Notification of the send
+     * @param sent True if any data got queued, else the notification is thrown away
+     */
+    void zerocopy_end(zerocopy_notif *notif, bool sent);
+
 #define CONSUME_SOCK_ERR \
     if (has_sock_err())  \
     return consume_sock_err()
@@ -237,6 +273,19 @@ public:
     virtual int connect(sockaddr *addr, socklen_t addrlen, int flags);
     virtual ssize_t sendmsg(const struct msghdr *msg, int flags);
     virtual ssize_t recvmsg(struct msghdr *msg, int flags);
+
+    /**
+     * @brief Send data straight from a page (used by sendfile)
+     * The default implementation copies the data through sendmsg(); protocols that can should
+     * reference the page instead.
+     *
+     * @param page Page
+     * @param off Offset of the data in the page
+     * @param len Length of the data, which can't cross the end of the page
+     * @param flags MSG_* flags
+     * @return Amount sent, or a negative error code
+     */
+    virtual ssize_t sendpage(struct page *page, unsigned int off, unsigned int len, int flags);
     virtual int getsockname(sockaddr *addr, socklen_t *addrlen);
     virtual int getpeername(sockaddr *addr, socklen_t *addrlen);
     virtual int shutdown(int how);
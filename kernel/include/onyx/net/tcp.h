@@ -14,6 +14,8 @@
 #include <onyx/mutex.h>
 #include <onyx/net/ip.h>
 #include <onyx/net/socket.h>
+#include <onyx/net/tcp_cong.h>
+#include <onyx/net/tcp_ooo.h>
 #include <onyx/packetbuf.h>
 #include <onyx/refcount.h>
 #include <onyx/scoped_lock.h>
@@ -61,6 +63,87 @@ struct tcp_header
 #define TCP_OPTION_SACK           (5)
 #define TCP_OPTION_TIMESTAMP      (8)
 
+/* Max window scale shift (RFC 7323, section 2.3) */
+#define TCP_MAX_WINDOW_SHIFT 14
+
+/* Default receive buffer size. This is what we advertise as our window, so it's above 64KiB in
+ * order to keep fast links busy. */
+#define TCP_DEFAULT_RX_MAX_BUF (256 * 1024)
+
+/* Socket options and struct tcp_info, with the same ABI as <netinet/tcp.h> */
+#define TCP_INFO       11
+#define TCP_CONGESTION 13
+
+/* tcpi_state */
+#define TCP_ESTABLISHED 1
+#define TCP_SYN_SENT    2
+#define TCP_SYN_RECV    3
+#define TCP_FIN_WAIT1   4
+#define TCP_FIN_WAIT2   5
+#define TCP_TIME_WAIT   6
+#define TCP_CLOSE       7
+#define TCP_CLOSE_WAIT  8
+#define TCP_LAST_ACK    9
+#define TCP_LISTEN      10
+#define TCP_CLOSING     11
+
+/* tcpi_ca_state */
+#define TCP_CA_Open     0
+#define TCP_CA_Disorder 1
+#define TCP_CA_CWR      2
+#define TCP_CA_Recovery 3
+#define TCP_CA_Loss     4
+
+#define TCPI_OPT_SACK   2
+#define TCPI_OPT_WSCALE 4
+
+struct tcp_info
+{
+    uint8_t tcpi_state;
+    uint8_t tcpi_ca_state;
+    uint8_t tcpi_retransmits;
+    uint8_t tcpi_probes;
+    uint8_t tcpi_backoff;
+    uint8_t tcpi_options;
+    uint8_t tcpi_snd_wscale : 4, tcpi_rcv_wscale : 4;
+    uint8_t tcpi_delivery_rate_app_limited : 1;
+    uint32_t tcpi_rto;
+    uint32_t tcpi_ato;
+    uint32_t tcpi_snd_mss;
+    uint32_t tcpi_rcv_mss;
+    uint32_t tcpi_unacked;
+    uint32_t tcpi_sacked;
+    uint32_t tcpi_lost;
+    uint32_t tcpi_retrans;
+    uint32_t tcpi_fackets;
+    uint32_t tcpi_last_data_sent;
+    uint32_t tcpi_last_ack_sent;
+    uint32_t tcpi_last_data_recv;
+    uint32_t tcpi_last_ack_recv;
+    uint32_t tcpi_pmtu;
+    uint32_t tcpi_rcv_ssthresh;
+    uint32_t tcpi_rtt;
+    uint32_t tcpi_rttvar;
+    uint32_t tcpi_snd_ssthresh;
+    uint32_t tcpi_snd_cwnd;
+    uint32_t tcpi_advmss;
+    uint32_t tcpi_reordering;
+    uint32_t tcpi_rcv_rtt;
+    uint32_t tcpi_rcv_space;
+    uint32_t tcpi_total_retrans;
+    uint64_t tcpi_pacing_rate;
+    uint64_t tcpi_max_pacing_rate;
+    uint64_t tcpi_bytes_acked;
+    uint64_t tcpi_bytes_received;
+    uint32_t tcpi_segs_out;
+    uint32_t tcpi_segs_in;
+    uint32_t tcpi_notsent_bytes;
+    uint32_t tcpi_min_rtt;
+    uint32_t tcpi_data_segs_in;
+    uint32_t tcpi_data_segs_out;
+    uint64_t tcpi_delivery_rate;
+};
+
 #define TCP_GET_DATA_OFF(off) (off >> TCP_DATA_OFFSET_SHIFT)
 
 #ifdef __cplusplus
@@ -275,6 +358,12 @@ struct tcp_connection_req
     uint32_t seq_number;
     uint32_t window_size;
     uint8_t window_shift;
+    /* Our receive window, and its scale */
+    uint32_t rcv_window;
+    uint8_t rcv_window_shift;
+    /* Options the other side sent in its SYN */
+    bool wscale_ok;
+    bool sack_ok;
     struct list_head list_node;
     inet_route route;
     int domain;
@@ -289,7 +378,8 @@ struct tcp_connection_req
     CLASS_DISALLOW_MOVE(tcp_connection_req);
 
     tcp_connection_req(inet_route &&route, int domain)
-        : mss{default_mss}, route{cul::move(route)}, domain{domain}
+        : mss{default_mss}, window_shift{}, rcv_window{}, rcv_window_shift{}, wscale_ok{},
+          sack_ok{}, route{cul::move(route)}, domain{domain}
     {
         INIT_LIST_HEAD(&received_data);
     }
@@ -344,6 +434,20 @@ private:
     uint32_t expected_ack;
     bool connection_pending;
     inet_cork pending_out;
+    /* Congestion state and algorithm, protected by pending_out_lock */
+    tcp_cong_state cong;
+    unique_ptr<tcp_congestion_ops> cc;
+    /* Window advertised in the last ACK, used to tell duplicate ACKs apart from window updates */
+    uint16_t last_ack_window;
+    /* True if both sides agreed on SACK */
+    bool sack_ok;
+    /* SACK scoreboard, protected by pending_out_lock: bytes SACKed, highest SACKed sequence
+     * number, and the highest sequence number we resent in this recovery */
+    uint32_t sacked_out;
+    uint32_t high_sacked;
+    uint32_t high_rxt;
+    /* Segments that arrived out of order */
+    tcp_ooo_queue ooo_queue;
     /* TODO: Add a lock for this stuff up here */
     struct list_head pending_accept_node;
     struct list_head pending_accept_list;
@@ -431,7 +535,8 @@ private:
 
     int wait_for_segments()
     {
-        return wait_for_event_socklocked_interruptible(&rx_wq, !list_is_empty(&rx_packet_list));
+        return wait_for_event_socklocked_interruptible(
+            &rx_wq, !list_is_empty(&rx_packet_list) || shutdown_state & SHUTDOWN_RD);
     }
 
     /**
@@ -488,6 +593,93 @@ private:
      */
     void append_backlog(packetbuf *buf);
 
+    uint32_t bytes_in_flight() const
+    {
+        return seq_number - last_ack_number;
+    }
+
+    /**
+     * @brief Get the window to put in a segment's header
+     *
+     * @param syn True if the segment has SYN set, as those windows aren't scaled
+     * @return The window
+     */
+    uint16_t advertised_window(bool syn) const
+    {
+        uint32_t window = syn ? our_window_size : our_window_size >> our_window_shift;
+        return (uint16_t) cul::min(window, (uint32_t) UINT16_MAX);
+    }
+
+    /**
+     * @brief Queue received data, dealing with segments that arrive out of order
+     *
+     * @param buf Segment, with data pointing to its payload
+     * @param seq Sequence number of the segment
+     * @param fin True if the segment has FIN set
+     */
+    void receive_data(packetbuf *buf, uint32_t seq, bool fin);
+
+    /**
+     * @brief Process the SACK blocks in an incoming ACK
+     * Note: pending_out_lock held
+     *
+     * @param tcphdr Header of the segment
+     * @param ack Ack number
+     */
+    void sack_update(const tcp_header *tcphdr, uint32_t ack);
+
+    /**
+     * @brief Check if the congestion window lets us send a segment
+     *
+     * @param len Length of the segment
+     * @return True if we can send it, else false
+     */
+    bool cong_can_send(uint32_t len) const;
+
+    /**
+     * @brief Update the congestion state after an ACK that acks new data
+     * Note: pending_out_lock held
+     *
+     * @param ack Ack number
+     * @param acked Number of newly acked bytes
+     * @param flight Bytes in flight before the ACK
+     */
+    void cong_new_ack(uint32_t ack, uint32_t acked, uint32_t flight);
+
+    /**
+     * @brief Handle a duplicate ACK, doing fast retransmit and recovery
+     * Note: pending_out_lock held
+     *
+     */
+    void cong_dupack();
+
+    /**
+     * @brief Retransmit the oldest unacked segment
+     * Note: pending_out_lock held
+     *
+     */
+    void retransmit_first();
+
+    /**
+     * @brief Retransmit the next segment we think got lost
+     * With SACK, that's the first hole below the highest SACKed segment we haven't resent in
+     * this recovery yet (RFC 6675). Without it, we can only resend the oldest segment.
+     * Note: pending_out_lock held
+     *
+     */
+    void retransmit_next();
+
+    /**
+     * @brief Switch to another congestion control algorithm
+     *
+     * @param name Name of the algorithm
+     * @return 0 on success, negative error codes
+     */
+    int set_congestion_control(const char *name);
+
+    int setsockopt_tcp(int opt, const void *optval, socklen_t optlen);
+    int getsockopt_tcp(int opt, void *optval, socklen_t *optlen);
+
 public:
     struct spinlock pending_out_lock;
 
@@ -576,10 +768,12 @@ public:
     tcp_socket()
         : inet_socket{}, state(tcp_state::TCP_STATE_CLOSED), type(SOCK_STREAM), packet_semaphore{},
           packet_list_head{}, packet_lock{}, tcp_ack_list_lock{}, pending_out_packets{},
-          tcp_ack_wq{}, conn_wq{}, seq_number{0}, ack_number{0}, current_pos{}, mss{default_mss},
-          window_size{0}, window_size_shift{default_window_size_shift}, our_window_size{UINT16_MAX},
-          our_window_shift{default_window_size_shift}, expected_ack{0}, connection_pending{},
-          pending_out{SOCK_STREAM}, pending_accept_list{}, nagle_enabled{false}, time_wait_timer{},
+          tcp_ack_wq{}, conn_wq{}, seq_number{0}, ack_number{0}, last_ack_number{0}, current_pos{},
+          mss{default_mss}, window_size{0}, window_size_shift{default_window_size_shift},
+          our_window_size{UINT16_MAX}, our_window_shift{default_window_size_shift}, expected_ack{0},
+          connection_pending{}, pending_out{SOCK_STREAM}, cong{}, cc{tcp_cong_create(nullptr)},
+          last_ack_window{}, sack_ok{}, sacked_out{}, high_sacked{}, high_rxt{}, ooo_queue{},
+          pending_accept_list{}, nagle_enabled{false}, time_wait_timer{},
           syn_queue_len{}, syn_queue{}, accept_queue_len{}, accept_queue{}, accept_node{this},
           pending_out_lock{}
     {
@@ -591,6 +785,8 @@ public:
         INIT_LIST_HEAD(&syn_queue);
         INIT_LIST_HEAD(&accept_queue);
         init_wait_queue_head(&accept_wq);
+        tcp_cong_init(cong);
+        rx_max_buf = TCP_DEFAULT_RX_MAX_BUF;
     }
 
     bool can_send() const
@@ -640,6 +836,20 @@ public:
     }
 
     ssize_t queue_data(iovec *vec, int vlen, size_t count);
+    ssize_t queue_data_zerocopy(iovec *vec, int vlen);
+
+    /**
+     * @brief Check if we can hand the device someone else's pages
+     * That's only when it computes the checksum itself, since we never read the data then.
+     *
+     * @return True if so, else false
+     */
+    bool can_send_pages() const
+    {
+        return route_cache.nif->flags & NETIF_SUPPORTS_CSUM_OFFLOAD;
+    }
+
+    ssize_t sendpage(struct page *page, unsigned int off, unsigned int len, int flags) override;
 
     int setsockopt(int level, int opt, const void *optval, socklen_t optlen) override;
     int getsockopt(int level, int opt, void *optval, socklen_t *optlen) override;
@@ -671,6 +881,44 @@ public:
      */
     void do_ack(packetbuf *buf);
 
+    /**
+     * @brief Retransmit a segment
+     *
+     * @param pkt Segment to retransmit
+     * @return 0 on success, negative error codes
+     */
+    int retransmit(tcp_pending_out *pkt);
+
+    /**
+     * @brief Handle a retransmission timeout, cutting the congestion window
+     * Note: pending_out_lock held
+     *
+     * @param pkt Segment that timed out
+     * @return Timeout for the segment's next retransmission, in ns
+     */
+    hrtime_t retransmit_timeout(tcp_pending_out *pkt);
+
+    /**
+     * @brief Check if a segment needs to be retransmitted when its timer fires
+     * SACKed segments don't, unless they're holding up the window.
+     * Note: pending_out_lock held
+     *
+     * @param pkt Segment
+     * @return True if it needs to be retransmitted, else false
+     */
+    bool should_retransmit(const tcp_pending_out *pkt);
+
+    /**
+     * @brief Get the current retransmission timeout
+     * Note: pending_out_lock held
+     *
+     * @return RTO, in ns
+     */
+    hrtime_t current_rto() const
+    {
+        return tcp_rto(cong, cong.backoff);
+    }
+
     /**
      * @brief Fail a connection attempt
      *
@@ -718,6 +966,20 @@ constexpr inline uint16_t tcp_header_data_off_to_length(uint16_t len)
     return len << 2;
 }
 
+/**
+ * @brief Test if sequence number a comes before b, taking wraparound into account
+ *
+ */
+constexpr inline bool tcp_seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+constexpr inline bool tcp_seq_after(uint32_t a, uint32_t b)
+{
+    return tcp_seq_before(b, a);
+}
+
 /**
  * @brief Describes a packet that is pending out
  *
@@ -728,6 +990,12 @@ struct tcp_pending_out : public refcountable
     struct clockevent timer;
     list_head_cpp<tcp_pending_out> node;
     unsigned int transmission_try{};
+    /* Time of the first transmission */
+    hrtime_t sent_at{};
+    /* Retransmitted segments can't be used for RTT samples (Karn's algorithm) */
+    bool retransmitted{};
+    /* The receiver told us it has this segment */
+    bool sacked{};
     union {
         tcp_socket *sock;
         tcp_connection_req *req;
@@ -794,13 +1062,19 @@ struct tcp_pending_out : public refcountable
     }
 
     /**
-     * @brief Test if an ack was for this packet
+     * @brief Get the segment's starting sequence number
      *
-     * @param last_ack Last ack we got
-     * @param this_ack This ack
-     * @return True if this ack acks this packet, else false
      */
-    bool ack_for_packet(uint32_t last_ack, uint32_t this_ack) const
+    uint32_t seq() const
+    {
+        return ntohl(((const tcp_header *) buf->transport_header)->sequence_number);
+    }
+
+    /**
+     * @brief Get the sequence number right after the segment
+     *
+     */
+    uint32_t end_seq() const
     {
         const auto tcphdr = (const tcp_header *) buf->transport_header;
         uint32_t header_len =
@@ -813,11 +1087,19 @@ struct tcp_pending_out : public refcountable
         if (flags & TCP_FLAG_FIN)
             ack_length++;
 
-        auto starting_seq_number = ntohl(tcphdr->sequence_number);
-        if (starting_seq_number >= last_ack && this_ack >= starting_seq_number + ack_length)
-            return true;
+        return seq() + ack_length;
+    }
 
-        return false;
+    /**
+     * @brief Test if an ack was for this packet
+     *
+     * @param last_ack Last ack we got
+     * @param this_ack This ack
+     * @return True if this ack acks this packet, else false
+     */
+    bool ack_for_packet(uint32_t last_ack, uint32_t this_ack) const
+    {
+        return !tcp_seq_before(seq(), last_ack) && !tcp_seq_before(this_ack, end_seq());
     }
 
     /**
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NET_TCP_CONG_H
+#define _ONYX_NET_TCP_CONG_H
+
+#include <stdint.h>
+
+#include <onyx/clock.h>
+
+/* Initial RTO, before we have an RTT sample (RFC 6298, section 2.1) */
+#define TCP_RTO_INITIAL (1000 * NS_PER_MS)
+#define TCP_RTO_MIN     (200 * NS_PER_MS)
+#define TCP_RTO_MAX     (120 * NS_PER_SEC)
+
+/* Initial window, in segments (RFC 6928) */
+#define TCP_INIT_CWND 10
+
+/* Number of duplicate ACKs that trigger a fast retransmit */
+#define TCP_DUPACK_THRESHOLD 3
+
+#define TCP_INFINITE_SSTHRESH 0x7fffffff
+
+/* Max length of a congestion control algorithm's name, including the NUL byte */
+#define TCP_CA_NAME_MAX 16
+
+enum class tcp_ca_state : uint8_t
+{
+    /* Everything's fine */
+    TCP_CA_OPEN = 0,
+    /* Fast recovery, after a fast retransmit */
+    TCP_CA_RECOVERY,
+    /* Recovering from a retransmission timeout */
+    TCP_CA_LOSS
+};
+
+/**
+ * Congestion control state of a TCP connection. cwnd and ssthresh are kept in bytes.
+ * The TCP core takes care of RTT estimation, fast retransmit and recovery; the congestion control
+ * algorithm only decides how the window grows, and how much it shrinks after a loss.
+ */
+struct tcp_cong_state
+{
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t mss;
+    tcp_ca_state ca_state;
+    uint8_t dupacks;
+    /* Number of consecutive RTO backoffs */
+    uint8_t backoff;
+    /* Highest sequence number sent when we entered recovery/loss */
+    uint32_t recover;
+    /* RFC 6298 estimator, in ns; srtt is 0 until we get the first sample */
+    hrtime_t srtt;
+    hrtime_t rttvar;
+    hrtime_t rto;
+    uint32_t total_retrans;
+};
+
+class tcp_congestion_ops
+{
+public:
+    virtual ~tcp_congestion_ops() = default;
+
+    virtual const char *name() const = 0;
+
+    /**
+     * @brief Grow the congestion window after new data got acked
+     * Not called while recovering from a loss.
+     *
+     * @param st Congestion state
+     * @param acked Number of newly acked bytes
+     */
+    virtual void cong_avoid(tcp_cong_state &st, uint32_t acked) = 0;
+
+    /**
+     * @brief Get the new slow start threshold after a loss
+     * Called on fast retransmit and on retransmission timeouts, before the window is cut.
+     *
+     * @param st Congestion state
+     * @return New ssthresh, in bytes
+     */
+    virtual uint32_t ssthresh(tcp_cong_state &st) = 0;
+};
+
+/**
+ * @brief Create an instance of a congestion control algorithm
+ *
+ * @param name Name of the algorithm, or nullptr for the default one
+ * @return The new instance, or nullptr if there's no such algorithm or we're out of memory
+ */
+tcp_congestion_ops *tcp_cong_create(const char *name);
+
+/**
+ * @brief Check if a congestion control algorithm exists
+ *
+ * @param name Name of the algorithm
+ * @return True if it does, else false
+ */
+bool tcp_cong_exists(const char *name);
+
+/**
+ * @brief Initialise congestion state for a new socket
+ *
+ * @param st Congestion state
+ */
+void tcp_cong_init(tcp_cong_state &st);
+
+/**
+ * @brief Set up the initial window once the connection is established
+ *
+ * @param st Congestion state
+ * @param mss Connection's MSS
+ * @param syn_lost True if the SYN (or SYN-ACK) had to be retransmitted
+ */
+void tcp_cong_start(tcp_cong_state &st, uint32_t mss, bool syn_lost);
+
+/**
+ * @brief Update the RTT estimate and the RTO with a new sample
+ * Samples must not come from retransmitted segments (Karn's algorithm).
+ *
+ * @param st Congestion state
+ * @param rtt Measured RTT, in ns
+ */
+void tcp_rtt_sample(tcp_cong_state &st, hrtime_t rtt);
+
+/**
+ * @brief Get the retransmission timeout for a segment
+ *
+ * @param st Congestion state
+ * @param tries Number of times the segment was retransmitted
+ * @return Timeout, in ns
+ */
+hrtime_t tcp_rto(const tcp_cong_state &st, unsigned int tries);
+
+/**
+ * @brief Grow the window in slow start
+ *
+ * @param st Congestion state
+ * @param acked Number of newly acked bytes
+ * @return Number of acked bytes left for congestion avoidance (if we reached ssthresh)
+ */
+uint32_t tcp_slow_start(tcp_cong_state &st, uint32_t acked);
+
+#endif
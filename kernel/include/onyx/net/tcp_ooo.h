@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NET_TCP_OOO_H
+#define _ONYX_NET_TCP_OOO_H
+
+#include <stdint.h>
+
+#include <lib/binary_search_tree.h>
+
+struct packetbuf;
+
+/* Max number of SACK blocks we send. Without timestamps, 4 blocks fit in the option space. */
+#define TCP_MAX_SACK_BLOCKS 4
+
+struct tcp_sack_block
+{
+    uint32_t start;
+    uint32_t end;
+};
+
+/**
+ * Queue of segments that arrived out of order, waiting for the holes before them to get filled.
+ * Segments are kept in a tree sorted by sequence number, and never overlap: overlapping data gets
+ * trimmed when a segment is queued. Since the intervals are disjoint, looking up any segment that
+ * overlaps a range is a plain tree search.
+ */
+class tcp_ooo_queue
+{
+private:
+    struct bst_root root;
+    /* Number of payload bytes queued */
+    uint32_t nr_bytes;
+    /* Start of the last segment that was queued, its block goes first in SACK options */
+    uint32_t last_seq;
+    uint32_t fin_seq;
+    bool has_fin;
+
+public:
+    tcp_ooo_queue() : root{BST_ROOT_INITIAL_VALUE}, nr_bytes{}, last_seq{}, fin_seq{}, has_fin{}
+    {
+    }
+
+    ~tcp_ooo_queue()
+    {
+        clear();
+    }
+
+    bool empty() const
+    {
+        return root.root == nullptr;
+    }
+
+    uint32_t bytes() const
+    {
+        return nr_bytes;
+    }
+
+    /**
+     * @brief Queue an out of order segment
+     * The payload (data to tail) must be linear.
+     *
+     * @param buf Segment, which gets a new reference if it's queued
+     * @param seq Sequence number of the first byte of the payload
+     * @param fin True if the segment has FIN set
+     * @return True if the segment got queued (or we already had its data), false if we're out of
+     * memory
+     */
+    bool insert(packetbuf *buf, uint32_t seq, bool fin);
+
+    /**
+     * @brief Take the next in-order segment out of the queue
+     *
+     * @param rcv_nxt Next sequence number we expect
+     * @return The segment, trimmed to start at rcv_nxt (the caller gets our reference), or
+     * nullptr if there's a hole at rcv_nxt
+     */
+    packetbuf *pop(uint32_t rcv_nxt);
+
+    /**
+     * @brief Check if the FIN is the next thing we expect, and take it out of the queue if so
+     *
+     * @param rcv_nxt Next sequence number we expect
+     * @return True if we had an out of order FIN at rcv_nxt
+     */
+    bool pop_fin(uint32_t rcv_nxt);
+
+    /**
+     * @brief Build SACK blocks (RFC 2018) out of the queue
+     * The block with the most recently queued segment goes first.
+     *
+     * @param blocks Array of blocks
+     * @param max Size of the array
+     * @return Number of blocks
+     */
+    unsigned int sack_blocks(tcp_sack_block *blocks, unsigned int max);
+
+    /**
+     * @brief Drop every queued segment
+     *
+     */
+    void clear();
+};
+
+#endif
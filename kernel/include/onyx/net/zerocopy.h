@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NET_ZEROCOPY_H
+#define _ONYX_NET_ZEROCOPY_H
+
+#include <stdint.h>
+
+#include <onyx/net/sock_errqueue.h>
+#include <onyx/refcount.h>
+
+/**
+ * Completion of a MSG_ZEROCOPY send. Every packetbuf that has pages of the send holds a
+ * reference, so the last reference goes away once the stack is done with the user's pages
+ * (for TCP, once the data is acked), and that's when the completion gets queued on the error
+ * queue.
+ */
+class zerocopy_notif : public refcountable
+{
+private:
+    sock_errqueue *queue;
+    sock_err_entry *entry;
+
+public:
+    zerocopy_notif(sock_errqueue *queue, sock_err_entry *entry) : queue{queue}, entry{entry}
+    {
+        queue->ref();
+    }
+
+    ~zerocopy_notif() override;
+
+    /**
+     * @brief Note that (some of) the data had to be copied
+     * Applications use this to figure out if MSG_ZEROCOPY is worth it.
+     *
+     */
+    void set_copied()
+    {
+        entry->ee.ee_code = SO_EE_CODE_ZEROCOPY_COPIED;
+    }
+
+    /**
+     * @brief Don't queue a completion, because the send failed before using the notification
+     *
+     */
+    void cancel()
+    {
+        delete entry;
+        entry = nullptr;
+    }
+};
+
+/**
+ * @brief Create a zerocopy notification for a send
+ *
+ * @param queue Error queue of the socket
+ * @param id ID of the send; IDs go up by one for every zerocopy send that goes through
+ * @return The notification, or nullptr if we're out of memory
+ */
+zerocopy_notif *zerocopy_notif_create(sock_errqueue *queue, uint32_t id);
+
+#endif
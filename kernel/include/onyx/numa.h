@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NUMA_H
+#define _ONYX_NUMA_H
+
+#include <stdint.h>
+
+#include <onyx/percpu.h>
+#include <onyx/smp.h>
+
+#ifndef CONFIG_NUMA_NR_NODES
+#define CONFIG_NUMA_NR_NODES 16
+#endif
+
+#define NUMA_NO_NODE (-1)
+
+/* Distances as defined by the ACPI SLIT */
+#define NUMA_LOCAL_DISTANCE  10
+#define NUMA_REMOTE_DISTANCE 20
+
+/**
+ * @brief Get the NUMA node for a given proximity domain, allocating one if needed
+ *
+ * @param pxm Proximity domain (as given by the firmware)
+ * @return NUMA node id, or NUMA_NO_NODE if we ran out of nodes
+ */
+int numa_pxm_to_node(uint32_t pxm);
+
+/**
+ * @brief Register a range of physical memory as belonging to a NUMA node
+ *
+ * @param node NUMA node
+ * @param start Start of the range
+ * @param end End of the range (exclusive)
+ */
+void numa_add_memblk(int node, unsigned long start, unsigned long end);
+
+/**
+ * @brief Register a CPU (by its hardware id, e.g the x86 APIC ID) as belonging to a NUMA node
+ *
+ * @param hwid Hardware id of the CPU
+ * @param node NUMA node
+ */
+void numa_add_cpu_hwid(uint32_t hwid, int node);
+
+/**
+ * @brief Get the NUMA node of a CPU, by its hardware id
+ *
+ * @param hwid Hardware id of the CPU
+ * @return NUMA node (node 0 if unknown)
+ */
+int numa_hwid_to_node(uint32_t hwid);
+
+/**
+ * @brief Set the distance between two nodes
+ *
+ * @param from Source node
+ * @param to Destination node
+ * @param distance Distance, in SLIT units
+ */
+void numa_set_distance(int from, int to, uint8_t distance);
+
+/**
+ * @brief Get the distance between two nodes
+ *
+ * @param from Source node
+ * @param to Destination node
+ * @return Distance, in SLIT units
+ */
+int numa_distance(int from, int to);
+
+/**
+ * @brief Finish setting up the NUMA topology
+ * Needs to be called after every memblk and distance has been registered, and before page_init.
+ */
+void numa_init_done();
+
+/**
+ * @brief Get the number of NUMA nodes in the system
+ *
+ * @return Number of nodes (always >= 1)
+ */
+unsigned int numa_nr_nodes();
+
+/**
+ * @brief Get the NUMA node a physical address belongs to
+ *
+ * @param paddr Physical address
+ * @return NUMA node (node 0 if not covered by any memblk)
+ */
+int numa_phys_to_node(unsigned long paddr);
+
+/**
+ * @brief Get the NUMA node a physical address belongs to, and where that node's range ends
+ * Used to split up memory ranges without having to look up every page.
+ *
+ * @param paddr Physical address
+ * @param end Pointer to where to store the end of the range (exclusive)
+ * @return NUMA node (node 0 if not covered by any memblk)
+ */
+int numa_phys_to_node_range(unsigned long paddr, unsigned long *end);
+
+/**
+ * @brief Get the node fallback list for a node
+ * The list starts with the node itself and is sorted by increasing distance.
+ *
+ * @param node NUMA node
+ * @return Pointer to an array of numa_nr_nodes() node ids
+ */
+const int *numa_node_fallback(int node);
+
+extern int numa_node;
+
+/**
+ * @brief Set the NUMA node of a CPU
+ *
+ * @param cpu CPU number
+ * @param node NUMA node
+ */
+void numa_set_cpu_node(unsigned int cpu, int node);
+
+/**
+ * @brief Get the NUMA node of a CPU
+ *
+ * @param cpu CPU number
+ * @return NUMA node
+ */
+static inline int cpu_to_node(unsigned int cpu)
+{
+    return get_per_cpu_any(numa_node, cpu);
+}
+
+/**
+ * @brief Get the NUMA node of the current CPU
+ *
+ * @return NUMA node
+ */
+static inline int numa_local_node()
+{
+    return get_per_cpu(numa_node);
+}
+
+#endif
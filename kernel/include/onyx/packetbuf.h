@@ -22,6 +22,7 @@
 #define DEFAULT_HEADER_LEN 128
 
 struct vm_object;
+class zerocopy_notif;
 
 #define PACKETBUF_GSO_TSO4 (1 << 0)
 #define PACKETBUF_GSO_TSO6 (1 << 1)
@@ -42,11 +43,12 @@ struct vm_object;
  *    fit in the head area.
  *
  *
- * Future design considerations:
- * 1) Future implementations of zero copy networking may need to reserve the first iov. It is then
- *    unclear if there are going to limitations in the packet's physical fragmentation of memory.
+ * Zero copy packetbufs (see attach_page()) keep only the headers in the head area, and reference
+ * someone else's pages (pinned user memory or page cache pages) in the data area. Those can't be
+ * written to, so they can't be expanded with put() or expand_buffer().
  *
- * 2) The packetbufs don't yet account for memory. It's noteworthy that packetbufs have huge
+ * Future design considerations:
+ * 1) The packetbufs don't yet account for memory. It's noteworthy that packetbufs have huge
  * internal fragmentation, since every page_iov has a single PAGE_SIZE'd page that may consume a lot
  * more memory than the actual packet's size. We should either: 1) Ignore any wastefulness(provides
  * less accurate bookkeeping) or 2) Add some kmalloc-like-thing that allocates a chunk of physically
@@ -81,6 +83,8 @@ struct packetbuf : public refcountable
     uint16_t *csum_offset;
     unsigned char *csum_start;
     vm_object *vmo;
+    /* Completion of the MSG_ZEROCOPY send whose pages we're holding, if any */
+    zerocopy_notif *zc;
 
     unsigned int header_length;
     uint16_t gso_size;
@@ -109,6 +113,8 @@ private:
         return end - tail;
     }
 
+    bool do_allocate_space(size_t length, bool linear);
+
 public:
     /**
      * @brief Construct a new default packetbuf object.
@@ -117,7 +123,7 @@ public:
     packetbuf()
         : refcountable{}, page_vec{}, phy_header{}, link_header{}, net_header{},
           transport_header{}, data{}, tail{}, end{}, buffer_start{}, csum_offset{nullptr},
-          csum_start{nullptr}, vmo{}, header_length{}, gso_size{}, gso_flags{},
+          csum_start{nullptr}, vmo{}, zc{}, header_length{}, gso_size{}, gso_flags{},
           needs_csum{0}, zero_copy{0}, domain{0}, list_node{this}
     {
     }
@@ -142,6 +148,17 @@ public:
      */
     bool allocate_space(size_t length);
 
+    /**
+     * @brief Reserve space for the packet, as a single physically contiguous head area.
+     * Meant for packets that need to be linear but may not fit in a page (e.g GRO'd packets).
+     * Like allocate_space(), it's only meant to be called once.
+     *
+     * @param length The maximum length of the whole packet(including headers and footers)
+     *
+     * @return Returns true if it was successful, false if it was not.
+     */
+    bool allocate_linear_space(size_t length);
+
     /**
      * @brief Reserve space for the headers.
      *
@@ -244,6 +261,34 @@ public:
      */
     ssize_t expand_buffer(const void *ubuf, unsigned int len);
 
+    /**
+     * @brief Attach a page fragment to the end of the data area, without copying it.
+     * Takes a reference to the page, and makes the packetbuf a zero copy one.
+     *
+     * @param page Page
+     * @param off Offset of the data in the page
+     * @param len Length of the data
+     * @return 0 on success, -ENOBUFS if the page vector is full
+     */
+    int attach_page(struct page *page, unsigned int off, unsigned int len);
+
+    /**
+     * @brief Pin user memory and attach it to the end of the data area, without copying it.
+     *
+     * @param ubuf User address of the buffer.
+     * @param len Length of the buffer.
+     * @return The amount attached (which may be short if the page vector fills up), or a negative
+     * error code if we failed to attach anything.
+     */
+    ssize_t attach_user_pages(const void *ubuf, unsigned int len);
+
+    /**
+     * @brief Set the zerocopy notification of the packetbuf, taking a reference to it.
+     *
+     * @param notif Notification
+     */
+    void set_zerocopy_notif(zerocopy_notif *notif);
+
     /**
      * @brief Counts all valid page vector entries.
      *
@@ -257,7 +302,18 @@ public:
                 return i;
         }
 
-        __builtin_unreachable();
+        /* Every vector is in use, page_vec[PACKETBUF_MAX_NR_PAGES + 1] is the canary */
+        return PACKETBUF_MAX_NR_PAGES + 1;
+    }
+
+    /**
+     * @brief Check if we can attach another page fragment.
+     *
+     * @return True if there's room in the page vector, else false.
+     */
+    bool can_attach_page() const
+    {
+        return count_page_vecs() < PACKETBUF_MAX_NR_PAGES + 1;
     }
 };
 
@@ -20,31 +20,18 @@
 #include <onyx/spinlock.h>
 #include <onyx/vm.h>
 
-/* The default physical allocator is the buddy allocator */
-#define CONFIG_BUDDY_ALLOCATOR 1
 #if defined(__x86_64__) || defined(__riscv) || defined(__aarch64__)
 
 #include <platform/page.h>
 
-#define PAGES_PER_AREA 512
 #define MAX_ORDER      11
 #define HUGE_PAGE_SIZE 0x200000
 
-#define DMA_UPPER_LIMIT   (void *) 0x1000000
-#define HIGH_MEM_FLOOR    DMA_UPPER_LIMIT
-#define HIGH_MEM_LIMIT    (void *) 0xFFFFFFFF
-#define HIGH_MEM_64_FLOOR HIGH_MEM_LIMIT
-#define HIGH_MEM_64_LIMIT (void *) -1
-
 #else
-#error "Define PAGES_PER_AREA and/or MAX_ORDER"
+#error "Define MAX_ORDER"
 #endif
 
-#define NR_ZONES            3
-#define IS_HUGE_ALIGNED(x)  (((unsigned long) x % HUGE_PAGE_SIZE) ? 0 : 1)
-#define IS_DMA_PTR(x)       x < DMA_UPPER_LIMIT
-#define IS_HIGHMEM_PTR(x)   x > HIGH_MEM_FLOOR &&x < HIGH_MEM_LIMIT
-#define IS_HIGHMEM64_PTR(x) x > HIGH_MEM_64_FLOOR &&x < HIGH_MEM_64_LIMIT
+#define IS_HUGE_ALIGNED(x) (((unsigned long) x % HUGE_PAGE_SIZE) ? 0 : 1)
 
 /* Passed to alloc_page() */
 
@@ -56,6 +43,7 @@
 #define PAGE_FLAG_FREE     (1 << 3)
 #define PAGE_FLAG_BUFFER   (1 << 4) /* Used by the filesystem code */
 #define PAGE_FLAG_FLUSHING (1 << 5)
+#define PAGE_FLAG_READAHEAD (1 << 6) /* Readahead marker, see onyx/readahead.h */
 
 /* struct page - Represents every usable page on the system
  * Everything is native-word-aligned in order to allow atomic changes
@@ -76,46 +64,6 @@ struct page
     unsigned long priv;
 };
 
-#ifdef CONFIG_BUDDY_ALLOCATOR
-/* A structure describing areas of size 2^order pages */
-typedef struct free_area
-{
-    /* Each of them contains a list of free pages */
-    struct extrusive_list_head free_list;
-    /* And a bitmap of buddies */
-    unsigned long *map;
-    /* Each "sub-zone" has a buddy, and to merge an area into a larger area,
-     * we need both buddies to be free; because of that, we use a bitmap of buddies to represent
-     * them. We use a bit for each buddy, if it's set, the buddy is allocated, if not, it's set to
-     * 0.
-     */
-} free_area_t;
-
-#else
-
-typedef struct page_zone
-{
-    /* We obviously need a lock to protect this page zone */
-    struct spinlock lock __attribute__((aligned(16)));
-    0t * free_areas __attribute__((aligned(16)));
-    /* The name of the page zone */
-    char *name;
-    /* The size of the page zone */
-    size_t size;
-    /* The allocated/free pages */
-    size_t allocated_pages, free_pages;
-
-} page_zone_t;
-
-typedef struct 0
-{
-    struct 0 * prev;
-    struct 0 * next;
-}
-0t;
-
-#endif /* CONFIG_BUDDY_ALLOCATOR */
-
 void page_get_stats(struct memstat *memstat);
 
 struct bootmodule
@@ -163,6 +111,25 @@ static inline bool __page_should_zero(unsigned long flags)
 
 struct page *alloc_pages(size_t nr_pages, unsigned long flags);
 
+/**
+ * @brief Allocate pages, preferring a specific NUMA node
+ * If the node is out of memory, other nodes are tried by increasing distance.
+ *
+ * @param nid NUMA node
+ * @param nr_pages Number of pages
+ * @param flags Flags (see PAGE_ALLOC_*)
+ * @return A list of pages, or nullptr
+ */
+struct page *alloc_pages_node(int nid, size_t nr_pages, unsigned long flags);
+
+/**
+ * @brief Get the NUMA node a page belongs to
+ *
+ * @param p Page
+ * @return NUMA node
+ */
+int page_to_nid(struct page *p);
+
 static inline struct page *alloc_page(unsigned long flags)
 {
     return alloc_pages(1, flags);
@@ -215,6 +182,26 @@ static inline void page_unpin(struct page *p)
     page_unref(p);
 }
 
+/**
+ * @brief Try to pin a page that may be getting freed under us (e.g found by a lockless lookup)
+ *
+ * @param p Page
+ * @return True if we got a reference, false if the page was already free
+ */
+static inline bool page_try_pin(struct page *p)
+{
+    unsigned long ref = __atomic_load_n(&p->ref, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (ref == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&p->ref, &ref, ref + 1, false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    return true;
+}
+
 void __reclaim_page(struct page *new_page);
 void reclaim_pages(unsigned long start, unsigned long end);
 void page_allocate_pagemap(unsigned long __maxpfn);
@@ -44,7 +44,10 @@ void pagecache_init(void);
 void page_cache_destroy(struct page_cache_block *block);
 size_t pagecache_get_used_pages(void);
 ssize_t file_write_cache(void *buffer, size_t len, struct inode *file, size_t offset);
-ssize_t file_read_cache(void *buffer, size_t len, struct inode *file, size_t off);
+ssize_t file_read_cache(void *buffer, size_t len, struct inode *file, size_t off,
+                        struct file_ra_state *ra = nullptr);
 ssize_t file_write_cache_unlocked(void *buffer, size_t len, struct inode *ino, size_t offset);
+struct page_cache_block *file_get_cache_page(struct file *f, size_t offset, size_t len);
+void wait_for_flush(struct page *page);
 
 #endif
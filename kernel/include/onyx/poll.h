@@ -86,7 +86,24 @@ public:
 
 class poll_table;
 
-class poll_file
+/**
+ * Whatever gets passed as the poll_file to poll handlers. poll_wait_helper() hands it the wait
+ * queues the file would wake up on.
+ */
+class poll_waiter
+{
+public:
+    virtual ~poll_waiter() = default;
+
+    /**
+     * @brief Wait on a wait queue (doesn't block, just queues)
+     *
+     * @param queue Wait queue
+     */
+    virtual void wait(wait_queue *queue) = 0;
+};
+
+class poll_file : public poll_waiter
 {
 private:
     poll_table *pt;
@@ -109,7 +126,7 @@ public:
     {
     }
 
-    ~poll_file()
+    ~poll_file() override
     {
         if (file)
             fd_put(file);
@@ -157,7 +174,7 @@ public:
         rhs.fd = 0;
     }
 
-    void wait(wait_queue *queue);
+    void wait(wait_queue *queue) override;
 
     struct file *get_file() const
     {
@@ -243,8 +260,50 @@ public:
     sleep_result sleep_poll(hrtime_t timeout, bool timeout_valid) const;
 };
 
+/**
+ * @brief Wait on a wait queue, from a poll handler
+ * Poll handlers should call this for every wait queue that's relevant to the events, whether or
+ * not the file is ready at the moment: epoll keeps these waits around to find out about new
+ * events.
+ *
+ * @param poll_file poll_file argument of the handler (a poll_waiter)
+ * @param q Wait queue
+ */
 void poll_wait_helper(void *poll_file, struct wait_queue *q);
 
+/* Installs a temporary signal mask for the duration of a p* (ppoll, pselect, epoll_pwait) call */
+class auto_signal_mask
+{
+private:
+    bool sigmask_valid;
+    sigset_t &temp_sigmask;
+    bool disable_{false};
+
+public:
+    auto_signal_mask(bool valid, sigset_t &set) : sigmask_valid{valid}, temp_sigmask{set}
+    {
+        if (!sigmask_valid)
+            return;
+        auto thread = get_current_thread();
+        thread->sinfo.original_sigset = thread->sinfo.set_blocked(&temp_sigmask);
+        thread->sinfo.flags |= THREAD_SIGNAL_ORIGINAL_SIGSET;
+    }
+
+    ~auto_signal_mask()
+    {
+        if (!sigmask_valid || disable_)
+            return;
+        auto thread = get_current_thread();
+        thread->sinfo.set_blocked(&thread->sinfo.original_sigset);
+        thread->sinfo.flags &= ~THREAD_SIGNAL_ORIGINAL_SIGSET;
+    }
+
+    void disable()
+    {
+        disable_ = true;
+    }
+};
+
 struct pselect_arg
 {
     const sigset_t *mask;
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _ONYX_PUBLIC_ERRQUEUE_H
+#define _ONYX_PUBLIC_ERRQUEUE_H
+
+/* Error queue messages, read with recvmsg(MSG_ERRQUEUE). Same layout as Linux's. */
+struct sock_extended_err
+{
+    unsigned int ee_errno;
+    unsigned char ee_origin;
+    unsigned char ee_type;
+    unsigned char ee_code;
+    unsigned char ee_pad;
+    unsigned int ee_info;
+    unsigned int ee_data;
+};
+
+#define SO_EE_ORIGIN_NONE     0
+#define SO_EE_ORIGIN_LOCAL    1
+#define SO_EE_ORIGIN_ICMP     2
+#define SO_EE_ORIGIN_ICMP6    3
+#define SO_EE_ORIGIN_ZEROCOPY 5
+
+/* MSG_ZEROCOPY completions carry the range of sends that completed in [ee_info, ee_data] */
+
+/* The data got copied anyway, so zerocopy didn't help */
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+
+/* Export the definitions to user-space */
+
+#ifndef IP_RECVERR
+#define IP_RECVERR 11
+#endif
+
+#ifndef IPV6_RECVERR
+#define IPV6_RECVERR 25
+#endif
+
+#endif
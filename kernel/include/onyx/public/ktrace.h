@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_PUBLIC_KTRACE_H
+#define _ONYX_PUBLIC_KTRACE_H
+
+#include <stdint.h>
+
+/**
+ * /dev/ktrace gives out a trace ring per CPU. Each ring is mmap'd at offset
+ * cpu * KTRACE_RING_MMAP_SIZE, and is made out of a header page followed by the data pages.
+ * The kernel produces records at head, and the consumer advances tail as it consumes them, so the
+ * mapping needs to be writable. When the ring is full, new records get dropped (and counted in
+ * lost) instead of overwriting older ones.
+ *
+ * The data area is split into sub-buffers. Records never cross a sub-buffer boundary: if one
+ * doesn't fit in the rest of the sub-buffer, the kernel fills it up with a KTRACE_EV_PADDING
+ * record, of which only type and size are valid.
+ */
+
+#define KTRACE_RING_DATA_PAGES 64
+#define KTRACE_SUBBUF_SIZE     4096
+#define KTRACE_RING_DATA_SIZE  (KTRACE_RING_DATA_PAGES * 4096UL)
+#define KTRACE_RING_MMAP_SIZE  (KTRACE_RING_DATA_SIZE + 4096UL)
+
+struct ktrace_ring_header
+{
+    /* Bytes produced so far. Written by the kernel */
+    uint64_t head;
+    /* Bytes consumed so far. Written by the consumer */
+    uint64_t tail;
+    /* Records that were dropped because the ring was full */
+    uint64_t lost;
+    uint32_t data_size;
+    uint32_t subbuf_size;
+};
+
+#define KTRACE_EV_PADDING           0
+#define KTRACE_EV_FUNCTION          1
+#define KTRACE_EV_SCHED_SWITCH      2
+#define KTRACE_EV_PAGE_FAULT        3
+#define KTRACE_EV_BLOCK_RQ_ISSUE    4
+#define KTRACE_EV_BLOCK_RQ_COMPLETE 5
+#define KTRACE_EV_TCP_RETRANSMIT    6
+#define KTRACE_EV_MAX               7
+
+#define KTRACE_EV_MASK(ev) (1UL << (ev))
+
+/* Records are 8-byte aligned */
+#define KTRACE_RECORD_ALIGN 8
+
+struct ktrace_record
+{
+    uint16_t type;
+    uint16_t size;
+    uint32_t cpu;
+    uint64_t timestamp;
+};
+
+struct ktrace_function_event
+{
+    struct ktrace_record hdr;
+    uint32_t tid;
+    int32_t pid;
+    uint64_t ip;
+    uint64_t caller;
+};
+
+struct ktrace_sched_switch_event
+{
+    struct ktrace_record hdr;
+    uint32_t prev_tid;
+    uint32_t next_tid;
+    /* THREAD_* status of the previous thread */
+    int32_t prev_status;
+    uint32_t pad;
+};
+
+#define KTRACE_PF_WRITE (1 << 0)
+#define KTRACE_PF_EXEC  (1 << 1)
+#define KTRACE_PF_USER  (1 << 2)
+
+struct ktrace_page_fault_event
+{
+    struct ktrace_record hdr;
+    uint64_t address;
+    uint64_t ip;
+    uint32_t tid;
+    uint32_t flags;
+};
+
+struct ktrace_block_rq_event
+{
+    struct ktrace_record hdr;
+    uint64_t sector;
+    /* Length, in bytes */
+    uint64_t length;
+    /* BIO_REQ_* op */
+    uint32_t op;
+    /* BIO_REQ_* status, for completions */
+    uint32_t status;
+};
+
+struct ktrace_tcp_retransmit_event
+{
+    struct ktrace_record hdr;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t seq;
+    uint32_t try_nr;
+    uint32_t pad;
+};
+
+struct ktrace_info
+{
+    uint32_t nr_cpus;
+    uint32_t data_size;
+    uint32_t subbuf_size;
+    uint32_t mmap_size;
+};
+
+/* Get a struct ktrace_info */
+#define KTRACE_GET_INFO       0
+/* Set the enabled events, from a KTRACE_EV_MASK()'d uint64_t */
+#define KTRACE_ENABLE_EVENTS  1
+/* Trace calls to the function named by the string pointed to by argp */
+#define KTRACE_TRACE_FUNCTION 2
+
+#endif
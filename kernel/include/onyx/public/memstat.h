@@ -9,12 +9,21 @@
 
 #include <stddef.h>
 
+#define MEMSTAT_NR_ORDERS 11
+
 struct memstat
 {
     size_t total_pages;
     size_t allocated_pages;
     size_t page_cache_pages;
     size_t kernel_heap_pages;
+    /* Number of free 2^order page blocks in the buddy allocator, per order */
+    size_t free_blocks[MEMSTAT_NR_ORDERS];
+    /* Free pages sitting in per-CPU page caches */
+    size_t pcp_cached_pages;
+    /* Pages (and block buffers) waiting to be written back, and under writeback */
+    size_t dirty_pages;
+    size_t writeback_pages;
 };
 
 #endif
\ No newline at end of file
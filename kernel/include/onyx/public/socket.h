@@ -230,6 +230,7 @@ struct linger
 #define SO_ATTACH_REUSEPORT_CBPF 51
 #define SO_ATTACH_REUSEPORT_EBPF 52
 #define SO_CNX_ADVICE            53
+#define SO_ZEROCOPY              60
 
 #ifndef SOL_SOCKET
 #define SOL_SOCKET 1
@@ -282,6 +283,7 @@ struct linger
 #define MSG_MORE         0x8000
 #define MSG_WAITFORONE   0x10000
 #define MSG_BATCH        0x40000
+#define MSG_ZEROCOPY     0x4000000
 #define MSG_FASTOPEN     0x20000000
 #define MSG_CMSG_CLOEXEC 0x40000000
 
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_RADIX_H
+#define _ONYX_RADIX_H
+
+#include <stddef.h>
+
+#include <onyx/spinlock.h>
+
+/**
+ * Radix tree, indexed by an unsigned long. Every node has RADIX_TREE_MAP_SIZE slots, and
+ * the tree grows in height as bigger indices get inserted.
+ *
+ * Every node keeps a bitmap per tag, where a bit is set if the slot (or something under it) is
+ * tagged. That makes it cheap to find every tagged entry (e.g dirty pages) without walking the
+ * whole tree.
+ *
+ * Modifications are serialized by the tree's spinlock. Lookups and iteration don't take any
+ * lock, and pointers are published with release semantics, so a reader always sees a consistent
+ * (if slightly stale) tree. Callers are responsible for making sure whatever they find stays alive
+ * (see vmo_get()).
+ *
+ * Nodes that become empty on delete get unlinked right away, but readers may still be walking
+ * through them. Lockless readers publish the global radix epoch in a per-cpu variable for the
+ * duration of the walk (with preemption disabled), and every unlink bumps the epoch. Unlinked
+ * nodes get freed by a later writer once every CPU is either not reading, or started reading
+ * after the unlink (or when the tree is destroyed).
+ */
+
+#define RADIX_TREE_MAP_SHIFT 6
+#define RADIX_TREE_MAP_SIZE  (1UL << RADIX_TREE_MAP_SHIFT)
+#define RADIX_TREE_MAP_MASK  (RADIX_TREE_MAP_SIZE - 1)
+
+/* Number of user-visible tags */
+#define RADIX_TREE_MAX_TAGS 2
+/* Pass as tag to radix_tree_next() to iterate over every entry */
+#define RADIX_TREE_NO_TAG   -1
+
+struct radix_tree_node
+{
+    /* Shift of this node's index bits; 0 for leaves */
+    unsigned int shift;
+    /* Our slot in the parent */
+    unsigned int offset;
+    struct radix_tree_node *parent;
+    /* Radix epoch at the time the node got unlinked */
+    unsigned long retire_epoch;
+    /* tags[0] tracks which slots are present, the rest are the user tags */
+    unsigned long tags[RADIX_TREE_MAX_TAGS + 1];
+    void *slots[RADIX_TREE_MAP_SIZE];
+};
+
+struct radix_tree
+{
+    struct radix_tree_node *root;
+    struct spinlock lock;
+    /* Unlinked nodes waiting for the readers to go away, chained through ->parent, newest first */
+    struct radix_tree_node *free_list;
+};
+
+/**
+ * @brief Initialise a radix tree
+ *
+ * @param tree Tree
+ */
+void radix_tree_init(struct radix_tree *tree);
+
+/**
+ * @brief Destroy a radix tree, freeing every node
+ * The caller must make sure nobody is looking at the tree.
+ *
+ * @param tree Tree
+ * @param free_entry Callback for every entry in the tree, or NULL
+ */
+void radix_tree_destroy(struct radix_tree *tree,
+                        void (*free_entry)(unsigned long index, void *entry));
+
+/**
+ * @brief Look up an index
+ * May be called without any locks held.
+ *
+ * @param tree Tree
+ * @param index Index
+ * @return The entry, or NULL if it's not present
+ */
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index);
+
+/**
+ * @brief Insert an entry
+ *
+ * @param tree Tree
+ * @param index Index
+ * @param entry Entry (must not be NULL)
+ * @return 0 on success, -EEXIST if there's already something there, -ENOMEM if out of memory
+ */
+int radix_tree_insert(struct radix_tree *tree, unsigned long index, void *entry);
+
+/**
+ * @brief Replace an existing entry, keeping its tags
+ *
+ * @param tree Tree
+ * @param index Index
+ * @param entry New entry (must not be NULL)
+ * @return The old entry, or NULL if it wasn't present (in which case nothing was done)
+ */
+void *radix_tree_replace(struct radix_tree *tree, unsigned long index, void *entry);
+
+/**
+ * @brief Remove an entry, and clear its tags
+ *
+ * @param tree Tree
+ * @param index Index
+ * @return The removed entry, or NULL if it wasn't present
+ */
+void *radix_tree_delete(struct radix_tree *tree, unsigned long index);
+
+/**
+ * @brief Set a tag on a present entry
+ *
+ * @param tree Tree
+ * @param index Index
+ * @param tag Tag
+ * @return True if the entry was present, else false
+ */
+bool radix_tree_tag_set(struct radix_tree *tree, unsigned long index, unsigned int tag);
+
+/**
+ * @brief Clear a tag on an entry
+ *
+ * @param tree Tree
+ * @param index Index
+ * @param tag Tag
+ */
+void radix_tree_tag_clear(struct radix_tree *tree, unsigned long index, unsigned int tag);
+
+/**
+ * @brief Test if an entry is tagged
+ *
+ * @param tree Tree
+ * @param index Index
+ * @param tag Tag
+ * @return True if tagged, else false
+ */
+bool radix_tree_tag_get(struct radix_tree *tree, unsigned long index, unsigned int tag);
+
+/**
+ * @brief Test if anything in the tree is tagged
+ *
+ * @param tree Tree
+ * @param tag Tag
+ * @return True if at least an entry is tagged, else false
+ */
+bool radix_tree_tagged(struct radix_tree *tree, unsigned int tag);
+
+/**
+ * @brief Find the first entry at *index or after it, up to and including max
+ * May be called without any locks held.
+ *
+ * @param tree Tree
+ * @param index Pointer to the index to start at; the entry's index is stored here
+ * @param max Last index to look at
+ * @param tag Only look at entries with this tag, or RADIX_TREE_NO_TAG
+ * @return The entry, or NULL if there isn't one
+ */
+void *radix_tree_next(struct radix_tree *tree, unsigned long *index, unsigned long max, int tag);
+
+/**
+ * @brief Find the next entry after *index, up to and including max
+ * Like radix_tree_next, but it steps past *index first, without wrapping around.
+ *
+ * @param tree Tree
+ * @param index Pointer to the index of the last entry; the next entry's index is stored here
+ * @param max Last index to look at
+ * @param tag Only look at entries with this tag, or RADIX_TREE_NO_TAG
+ * @return The entry, or NULL if there isn't one
+ */
+static inline void *radix_tree_next_after(struct radix_tree *tree, unsigned long *index,
+                                          unsigned long max, int tag)
+{
+    /* *index == max also covers max == ~0UL, where *index + 1 would wrap around to 0 */
+    if (*index >= max)
+        return NULL;
+    (*index)++;
+    return radix_tree_next(tree, index, max, tag);
+}
+
+#define radix_tree_for_each_tagged(tree, index, entry, start, max, tag)                    \
+    for (index = (start), entry = radix_tree_next(tree, &index, max, tag); entry;         \
+         entry = radix_tree_next_after(tree, &index, max, tag))
+
+#define radix_tree_for_each_range(tree, index, entry, start, max) \
+    radix_tree_for_each_tagged(tree, index, entry, start, max, RADIX_TREE_NO_TAG)
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_READAHEAD_H
+#define _ONYX_READAHEAD_H
+
+#include <stddef.h>
+
+/* Default max readahead window, in pages (128KiB) */
+#define RA_DEFAULT_PAGES 32
+/* Smallest window we start with */
+#define RA_MIN_PAGES     4
+
+/**
+ * Per-file readahead state.
+ * The current window is [start, start + size). When the reader gets to the page at
+ * start + size - async_size (which is marked with PAGE_FLAG_READAHEAD), we read the next window
+ * before it's needed. Every time a window gets read sequentially, the next one doubles, up
+ * to ra_pages.
+ */
+struct file_ra_state
+{
+    unsigned long start;
+    unsigned int size;
+    unsigned int async_size;
+    /* Max window size, 0 disables readahead (POSIX_FADV_RANDOM) */
+    unsigned int ra_pages;
+    /* Last page we read, used to detect sequential access */
+    unsigned long prev_pgoff;
+};
+
+struct inode;
+struct file;
+struct page;
+
+/**
+ * @brief Initialise a file's readahead state
+ *
+ * @param ra Readahead state
+ */
+void file_ra_state_init(struct file_ra_state *ra);
+
+/**
+ * @brief Readahead on a page cache miss
+ *
+ * @param ino Inode
+ * @param ra Readahead state
+ * @param pgoff Page that missed
+ * @param req_pages Number of pages the caller wants to read, starting from pgoff
+ */
+void page_cache_sync_readahead(struct inode *ino, struct file_ra_state *ra, unsigned long pgoff,
+                               unsigned long req_pages);
+
+/**
+ * @brief Readahead when hitting a page marked with PAGE_FLAG_READAHEAD
+ *
+ * @param ino Inode
+ * @param ra Readahead state
+ * @param page Marker page
+ * @param pgoff Page offset of the marker
+ * @param req_pages Number of pages the caller wants to read, starting from pgoff
+ */
+void page_cache_async_readahead(struct inode *ino, struct file_ra_state *ra, struct page *page,
+                                unsigned long pgoff, unsigned long req_pages);
+
+/**
+ * @brief Read a range of a file into the page cache, regardless of readahead state.
+ * Used by readahead(2), POSIX_FADV_WILLNEED and MADV_WILLNEED.
+ *
+ * @param ino Inode
+ * @param pgoff First page
+ * @param nr_pages Number of pages
+ * @return 0 on success, negative error codes
+ */
+int force_page_cache_readahead(struct inode *ino, unsigned long pgoff, unsigned long nr_pages);
+
+/**
+ * @brief Readahead for a page fault on a file mapping
+ *
+ * @param f File that's mapped
+ * @param pgoff Page offset (in the file) that faulted
+ * @param sequential True if the mapping was madvise'd MADV_SEQUENTIAL
+ */
+void filemap_fault_readahead(struct file *f, unsigned long pgoff, bool sequential);
+
+#endif
@@ -13,14 +13,18 @@
 
 #define RDWR_LOCK_WRITE LONG_MAX
 
+struct thread;
+
 struct rwlock
 {
     unsigned long lock;
     struct list_head waiting_list;
     struct spinlock llock;
+    /* Thread that holds the write lock, if any */
+    struct thread *writer;
 
 #ifdef __cplusplus
-    constexpr rwlock() : lock{}, waiting_list{}, llock{}
+    constexpr rwlock() : lock{}, waiting_list{}, llock{}, writer{}
     {
         spinlock_init(&llock);
         INIT_LIST_HEAD(&waiting_list);
@@ -53,10 +57,14 @@ int rw_lock_write_interruptible(struct rwlock *lock);
 int rw_lock_read_interruptible(struct rwlock *lock);
 void rw_unlock_read(struct rwlock *lock);
 void rw_unlock_write(struct rwlock *lock);
+bool rw_lock_holds_write(struct rwlock *lock);
+
+#define MUST_HOLD_RWLOCK_WRITE(l) assert(rw_lock_holds_write(l) == true)
 
 static inline void rwlock_init(struct rwlock *lock)
 {
     lock->lock = 0;
+    lock->writer = NULL;
     INIT_LIST_HEAD(&lock->waiting_list);
     spinlock_init(&lock->llock);
 }
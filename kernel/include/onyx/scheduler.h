@@ -18,6 +18,9 @@
 #include <onyx/percpu.h>
 #include <onyx/signal.h>
 #include <onyx/spinlock.h>
+#include <onyx/workqueue.h>
+
+#include <lib/binary_search_tree.h>
 
 #define NUM_PRIO 40
 
@@ -27,9 +30,17 @@
 #define SCHED_PRIO_HIGH      30
 #define SCHED_PRIO_VERY_HIGH 39
 
+/* Threads with priority >= SCHED_PRIO_RT_MIN are real-time threads, and get scheduled in strict
+ * priority order. Every other thread gets a fair share of the CPU, weighted by its priority.
+ */
+#define SCHED_PRIO_RT_MIN SCHED_PRIO_HIGH
+
 using thread_callback_t = void (*)(void *);
 struct process;
 struct mm_address_space;
+struct blk_plug;
+struct worker;
+struct futex_pi_state;
 
 #define THREAD_STRUCT_CANARY 0xcacacacafdfddead
 #define THREAD_DEAD_CANARY   0xdeadbeefbeefdead
@@ -64,9 +75,32 @@ using thread_t = struct thread
      * and it's used to futex_wake any threads blocked by join.
      */
     void *ctid;
+    /* Block request plug, see blk_start_plug */
+    struct blk_plug *plug;
 
     struct thread_cputime_info cputime_info;
     mm_address_space *aspace{};
+
+    /* Fair scheduling class state */
+    struct bst_node fair_node{};
+    /* Weighted virtual runtime, in ns */
+    hrtime_t vruntime{};
+    /* Last time we accounted runtime */
+    hrtime_t exec_start{};
+    /* When the thread got picked to run, used to enforce its slice */
+    hrtime_t slice_start{};
+    /* Workqueue worker this thread runs, if any */
+    struct worker *wq_worker{};
+    /* Used to finish destroying the thread after it's gone */
+    struct work_struct destroy_work;
+    /* PI futexes we own that have waiters, and the one we're blocked on. Protected by the futex
+     * code's PI lock. */
+    struct list_head pi_owned;
+    struct futex_pi_state *pi_blocked_on{};
+    /* Priority we had before PI futex waiters boosted us, or -1 if we're not boosted */
+    int pi_saved_priority{-1};
+    /* Nesting count of pagefault_disable() */
+    unsigned int pagefault_disabled{};
     /* And arch dependent stuff in this ifdef */
 #ifdef __x86_64__
     void *fs;
@@ -80,12 +114,13 @@ using thread_t = struct thread
         : refcount{}, canary{}, kernel_stack{}, kernel_stack_top{}, owner{}, entry{}, flags{}, id{},
           status{}, priority{}, cpu{}, next{}, prev_prio{}, next_prio{}, prev_wait{}, next_wait{},
           fpu_area{}, sem_prev{}, sem_next{}, lock{}, errno_val{}, thread_list_head{}, addr_limit{},
-          wait_list_head{}, ctid{}, cputime_info{}
+          wait_list_head{}, ctid{}, plug{}, cputime_info{}
 #ifdef __x86_64__
           ,
           fs{}, gs{}
 #endif
     {
+        INIT_LIST_HEAD(&pi_owned);
     }
 #endif
 
@@ -113,6 +148,10 @@ using thread_t = struct thread
 #define THREAD_IS_DYING      (1 << 2)
 #define THREAD_SHOULD_DIE    (1 << 3)
 #define THREAD_ACTIVE        (1 << 4)
+/* The thread can't be migrated to another CPU by the load balancer */
+#define THREAD_CPU_BOUND     (1 << 5)
+/* The thread is exiting and can't own PI futexes anymore, see futex_exit_pi() */
+#define THREAD_PI_EXITED     (1 << 6)
 
 int sched_init(void);
 
@@ -182,6 +221,15 @@ void thread_remove_from_list(struct thread *t);
 
 struct thread *thread_get_from_tid(int tid);
 
+/**
+ * @brief Change a thread's priority
+ * A queued thread gets requeued with its new priority, and may preempt the running one.
+ *
+ * @param thread Thread
+ * @param prio New priority
+ */
+void sched_set_priority(struct thread *thread, int prio);
+
 extern "C" unsigned long thread_get_addr_limit(void);
 
 void *sched_preempt_thread(void *current_stack);
@@ -202,6 +250,28 @@ static inline void sched_should_resched(void)
         t->flags |= THREAD_NEEDS_RESCHED;
 }
 
+/**
+ * @brief Make page faults fail right away instead of getting handled, so user copies can be done
+ * under spinlocks (they return -EFAULT instead of faulting the page in).
+ */
+static inline void pagefault_disable(void)
+{
+    get_current_thread()->pagefault_disabled++;
+    COMPILER_BARRIER();
+}
+
+static inline void pagefault_enable(void)
+{
+    COMPILER_BARRIER();
+    get_current_thread()->pagefault_disabled--;
+}
+
+static inline bool pagefault_is_disabled(void)
+{
+    struct thread *t = get_current_thread();
+    return t && t->pagefault_disabled;
+}
+
 #define set_current_state(state)                                 \
     do                                                           \
     {                                                            \
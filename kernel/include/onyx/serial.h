@@ -13,6 +13,7 @@
 
 #include <onyx/tty.h>
 #include <onyx/wait_queue.h>
+#include <onyx/workqueue.h>
 
 class serial_port
 {
@@ -27,6 +28,17 @@ private:
      */
     unsigned int allocate_serial_index();
 
+    /* Hands off received bytes to the tty, out of IRQ context. serial_port isn't standard-layout,
+     * so the work carries a pointer back to the port instead of relying on container_of.
+     */
+    struct dispatch_work_struct
+    {
+        work_struct work;
+        serial_port *port;
+    } dispatch_work;
+
+    static void dispatch_work_func(work_struct *work);
+
 protected:
     spinlock bytebuf_lock;
     uint8_t byte_buf[100];
@@ -51,6 +63,8 @@ public:
     {
         nr = allocate_serial_index();
         spinlock_init(&bytebuf_lock);
+        work_init(&dispatch_work.work, dispatch_work_func);
+        dispatch_work.port = this;
     }
 
     void dispatch();
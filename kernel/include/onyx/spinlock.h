@@ -26,13 +26,37 @@
 
 typedef unsigned int raw_spinlock_t;
 
+/**
+ * Spinlocks are MCS-style queued locks, packed in 32 bits:
+ * The low 16 bits hold the owner (cpu + 1, or 0 if unlocked), and the high 16 bits hold the
+ * tail of the queue of waiters (see spinlock.cpp), which is 0 if nobody is waiting.
+ */
+#define SPINLOCK_OWNER_MASK 0xffffU
+#define SPINLOCK_TAIL_SHIFT 16
+
+#ifdef CONFIG_SPINLOCK_STATS
+struct spinlock_stats
+{
+    /* Number of times the lock was taken */
+    unsigned long acquisitions;
+    /* Number of those that had to wait */
+    unsigned long contentions;
+    /* Total and longest time spent waiting, in ns */
+    unsigned long wait_ns;
+    unsigned long max_wait_ns;
+};
+#endif
+
 struct spinlock
 {
-    /* TODO: Conditionally have these debug features, and have owner_cpu be in lock */
     raw_spinlock_t lock;
 #ifdef CONFIG_SPINLOCK_DEBUG
     unsigned long holder;
 #endif
+#ifdef CONFIG_SPINLOCK_STATS
+    /* Only updated by the lock's holder */
+    struct spinlock_stats stats;
+#endif
 };
 
 #ifdef __cplusplus
@@ -58,6 +82,10 @@ CONSTEXPR static inline void spinlock_init(struct spinlock *s)
 #endif
 
     s->lock = 0;
+
+#ifdef CONFIG_SPINLOCK_STATS
+    s->stats = {};
+#endif
 }
 
 #define STATIC_SPINLOCK_INIT \
@@ -79,7 +107,8 @@ static inline void spin_unlock_irqrestore(struct spinlock *lock, unsigned long o
 
 static inline bool spin_lock_held(struct spinlock *lock)
 {
-    return lock->lock == get_cpu_nr() + 1;
+    return (__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) & SPINLOCK_OWNER_MASK) ==
+           get_cpu_nr() + 1;
 }
 
 #define MUST_HOLD_LOCK(lock) assert(spin_lock_held(lock) != false)
@@ -96,7 +125,7 @@ public:
     constexpr Spinlock() : lock{}, cpu_flags{} {};
     ~Spinlock()
     {
-        assert(lock.lock != 1);
+        assert(!IsLocked());
     }
     void Lock()
     {
@@ -120,7 +149,7 @@ public:
 
     bool IsLocked()
     {
-        return lock.lock == 1;
+        return __atomic_load_n(&lock.lock, __ATOMIC_RELAXED) & SPINLOCK_OWNER_MASK;
     }
 };
 
@@ -21,6 +21,9 @@ void ndelay(unsigned int ns);
 #define CLOCKEVENT_FLAG_PULSE \
     (1 << 2) /* Automatically requeue the same struct (that was modified by the cb) */
 #define CLOCKEVENT_FLAG_POISON (1 << 3)
+#define CLOCKEVENT_FLAG_COARSE \
+    (1 << 4) /* The deadline may be rounded up (by up to 1/8th of the timeout) */
+#define CLOCKEVENT_FLAG_WHEEL (1 << 5) /* Internal: is queued in the timer wheel */
 
 struct timer;
 
@@ -36,7 +39,13 @@ struct clockevent
     void *priv;
     unsigned int flags;
     void (*callback)(struct clockevent *ev);
+    /* Timer wheel bucket, or the timer's pending list */
     struct list_head list_node;
+    /* Pairing heap links, for high resolution events */
+    struct clockevent *heap_child;
+    struct clockevent *heap_next;
+    struct clockevent *heap_prev;
+    unsigned int wheel_idx;
     struct timer *timer;
 
     ~clockevent()
@@ -48,12 +57,39 @@ struct clockevent
 
 #define TIMER_NEXT_EVENT_NOT_PENDING UINT64_MAX
 
+/**
+ * Hierarchical timer wheel, for CLOCKEVENT_FLAG_COARSE events.
+ * Every level has TIMER_WHEEL_LVL_SIZE buckets, each level being 8 times coarser than the one
+ * below it. Events never cascade down; they get rounded up to their level's granularity instead.
+ */
+#define TIMER_WHEEL_LVL_BITS  6
+#define TIMER_WHEEL_LVL_SIZE  (1UL << TIMER_WHEEL_LVL_BITS)
+#define TIMER_WHEEL_CLK_SHIFT 3
+#define TIMER_WHEEL_DEPTH     8
+/* Granularity of the first level */
+#define TIMER_WHEEL_GRAN_NS   NS_PER_MS
+
+struct timer_wheel
+{
+    /* Next tick we need to look at */
+    unsigned long clk;
+    /* Earliest bucket expiry (in ticks), or ULONG_MAX */
+    unsigned long next_expiry;
+    /* Bitmap of non-empty buckets, per level */
+    unsigned long pending[TIMER_WHEEL_DEPTH];
+    struct list_head buckets[TIMER_WHEEL_DEPTH * TIMER_WHEEL_LVL_SIZE];
+};
+
 struct timer
 {
     const char *name;
     hrtime_t next_event;
     void *priv;
-    struct list_head event_list;
+    /* High resolution events, in a pairing heap ordered by deadline */
+    struct clockevent *heap;
+    struct timer_wheel wheel;
+    /* Expired non-atomic events, waiting for the timer softirq */
+    struct list_head pending_list;
     struct spinlock event_list_lock;
     void (*set_oneshot)(hrtime_t in_future);
     void (*set_periodic)(unsigned long freq);
@@ -62,6 +98,7 @@ struct timer
 };
 
 struct timer *platform_get_timer(void);
+void timer_init_events(struct timer *t);
 void timer_queue_clockevent(struct clockevent *ev);
 void timer_handle_events(struct timer *t);
 
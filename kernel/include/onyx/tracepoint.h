@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_TRACEPOINT_H
+#define _ONYX_TRACEPOINT_H
+
+#include <stdint.h>
+
+#include <onyx/compiler.h>
+
+#include <onyx/public/ktrace.h>
+
+/**
+ * Static tracepoints. DECLARE_TRACEPOINT(name, ev, proto, args) declares trace_name(proto), which
+ * logs a KTRACE_EV_* event to the current CPU's trace ring. When the event isn't enabled, it
+ * costs a load and a predicted branch, and without CONFIG_KTRACE it compiles to nothing.
+ */
+
+#define TP_PROTO(...) __VA_ARGS__
+#define TP_ARGS(...)  __VA_ARGS__
+
+#ifdef CONFIG_KTRACE
+
+extern unsigned long ktrace_enabled_events;
+
+#define DECLARE_TRACEPOINT(name, ev, proto, args)                                          \
+    void __trace_##name(proto);                                                            \
+    static inline void trace_##name(proto)                                                 \
+    {                                                                                      \
+        if (unlikely(__atomic_load_n(&ktrace_enabled_events, __ATOMIC_RELAXED) &           \
+                     KTRACE_EV_MASK(ev)))                                                  \
+            __trace_##name(args);                                                          \
+    }
+
+#else
+
+#define DECLARE_TRACEPOINT(name, ev, proto, args) \
+    static inline void trace_##name(proto)        \
+    {                                             \
+    }
+
+#endif
+
+DECLARE_TRACEPOINT(sched_switch, KTRACE_EV_SCHED_SWITCH,
+                   TP_PROTO(uint32_t prev_tid, uint32_t next_tid, int prev_status),
+                   TP_ARGS(prev_tid, next_tid, prev_status))
+
+DECLARE_TRACEPOINT(page_fault, KTRACE_EV_PAGE_FAULT,
+                   TP_PROTO(unsigned long address, unsigned long ip, unsigned int flags),
+                   TP_ARGS(address, ip, flags))
+
+DECLARE_TRACEPOINT(block_rq_issue, KTRACE_EV_BLOCK_RQ_ISSUE,
+                   TP_PROTO(uint64_t sector, uint64_t length, unsigned int op),
+                   TP_ARGS(sector, length, op))
+
+DECLARE_TRACEPOINT(block_rq_complete, KTRACE_EV_BLOCK_RQ_COMPLETE,
+                   TP_PROTO(uint64_t sector, uint64_t length, unsigned int op,
+                            unsigned int status),
+                   TP_ARGS(sector, length, op, status))
+
+DECLARE_TRACEPOINT(tcp_retransmit, KTRACE_EV_TCP_RETRANSMIT,
+                   TP_PROTO(uint16_t sport, uint16_t dport, uint32_t seq, unsigned int try_nr),
+                   TP_ARGS(sport, dport, seq, try_nr))
+
+#endif
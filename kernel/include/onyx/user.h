@@ -22,6 +22,16 @@ ssize_t strlen_user(const char *user);
 long get_user32(unsigned int *uaddr, unsigned int *dest);
 long get_user64(unsigned long *uaddr, unsigned long *dest);
 
+/**
+ * @brief Atomically compare and exchange a 32-bit user value
+ *
+ * @param uaddr User address
+ * @param expected Pointer to the expected value. Gets the value we found at uaddr
+ * @param desired Value to store, if *uaddr == *expected
+ * @return 0 on success (even if the values didn't match), -EFAULT if we faulted
+ */
+long cmpxchg_user32(unsigned int *uaddr, unsigned int *expected, unsigned int desired);
+
 #ifdef __cplusplus
 }
 #endif
@@ -18,6 +18,7 @@
 #include <onyx/mm/vm_object.h>
 #include <onyx/object.h>
 #include <onyx/public/socket.h>
+#include <onyx/readahead.h>
 #include <onyx/rwlock.h>
 #include <onyx/superblock.h>
 #include <onyx/vm.h>
@@ -35,6 +36,7 @@
 struct inode;
 struct file;
 struct dentry;
+struct flush_wb_req;
 
 typedef size_t (*__read)(size_t offset, size_t sizeofread, void *buffer, struct file *file);
 typedef size_t (*__write)(size_t offset, size_t sizeofwrite, void *buffer, struct file *file);
@@ -72,6 +74,33 @@ struct file_ops
     ssize_t (*writepage)(struct page *page, size_t offset, struct inode *ino);
     int (*prepare_write)(struct inode *ino, struct page *page, size_t page_off, size_t offset,
                          size_t len);
+    /* Optional: undo what prepare_write() set up, when the data couldn't be copied into the
+     * page (and so the page didn't get dirtied).
+     */
+    void (*abort_write)(struct inode *ino, struct page *page, size_t page_off, size_t offset,
+                        size_t len);
+    /* Optional: read nr_pages contiguous pages (chained through next_allocation) in one go.
+     * Returns the number of pages (from the start) that were read, or a negative error code.
+     */
+    ssize_t (*readpages)(struct page *pages, unsigned long nr_pages, size_t offset,
+                         struct inode *ino);
+    /* Optional: write len bytes from a page without copying them (used by sendfile).
+     * Returns the number of bytes written, or a negative error code.
+     */
+    ssize_t (*sendpage)(struct page *page, unsigned int off, unsigned int len, struct file *f);
+    /* Optional: describe writepage()'s write as a single request, so writeback can sort and
+     * batch it. Returns 0 on success, or a negative error code to fall back to writepage().
+     */
+    int (*prepare_writepage)(struct page *page, size_t offset, struct inode *ino,
+                             struct flush_wb_req *req);
+    /* Optional: read or write bypassing the page cache, for O_DIRECT (see onyx/direct_io.h).
+     * Returns the number of bytes transferred, or -1 with errno set.
+     */
+    ssize_t (*direct_io)(size_t offset, size_t len, void *buffer, struct file *f, bool write);
+    /* Optional: called when the last reference to an open file goes away (on_open's
+     * counterpart).
+     */
+    void (*release)(struct file *f);
 };
 
 struct getdents_ret
@@ -145,10 +174,17 @@ struct file
     struct inode *f_ino;
     unsigned int f_flags;
     struct dentry *f_dentry;
+    struct file_ra_state f_ra;
+    /* epoll items watching this file */
+    struct list_head f_epitems;
 };
 
 int inode_create_vmo(struct inode *ino);
 
+struct vm_object_ops;
+/* vmo ops of regular page cache backed inodes */
+extern const struct vm_object_ops inode_vmo_ops;
+
 #define OPEN_FLAG_NOFOLLOW     (1 << 0)
 #define OPEN_FLAG_FAIL_IF_LINK (1 << 1)
 #define OPEN_FLAG_MUST_BE_DIR  (1 << 2)
@@ -19,6 +19,7 @@
 #include <onyx/mutex.h>
 #include <onyx/paging.h>
 #include <onyx/refcount.h>
+#include <onyx/rwlock.h>
 #include <onyx/scheduler.h>
 #include <onyx/spinlock.h>
 
@@ -88,6 +89,9 @@ static inline unsigned long vm_prot_to_cache_type(uint64_t prot)
 
 #define VM_PFNMAP               (1 << 1)
 #define VM_USING_MAP_SHARED_OPT (1 << 2)
+/* madvise(2) readahead hints */
+#define VM_SEQ_READ  (1 << 3)
+#define VM_RAND_READ (1 << 4)
 
 struct vm_object;
 
@@ -148,7 +152,10 @@ struct mm_address_space : public refcountable
     struct bst_root region_tree;
     unsigned long start{};
     unsigned long end{};
-    mutex vm_lock{};
+    /* Protects the region tree. Page faults take it shared, anything that modifies
+     * the regions takes it exclusive.
+     */
+    rwlock vm_lock{};
 
     /* mmap(2) base */
     void *mmap_base{};
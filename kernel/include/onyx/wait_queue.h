@@ -16,15 +16,22 @@
 #include <onyx/spinlock.h>
 #include <onyx/task_switching.h>
 
+/* Persistent tokens stay queued when woken up; they only get their callback called, and it's
+ * up to the owner to remove them. Used by epoll to keep watching a file across wakeups.
+ */
+#define WQ_TOKEN_PERSISTENT (1 << 0)
+
 struct wait_queue_token
 {
     struct thread *thread;
     void (*callback)(void *context, struct wait_queue_token *token);
     void *context;
     bool signaled;
+    unsigned int flags;
     struct list_head token_node;
 
-    constexpr wait_queue_token() : thread{}, callback{}, context{}, signaled{}, token_node{}
+    constexpr wait_queue_token()
+        : thread{}, callback{}, context{}, signaled{}, flags{}, token_node{}
     {
     }
 };
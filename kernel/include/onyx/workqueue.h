@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_WORKQUEUE_H
+#define _ONYX_WORKQUEUE_H
+
+#include <stdbool.h>
+
+#include <onyx/clock.h>
+#include <onyx/list.h>
+#include <onyx/timer.h>
+#include <onyx/utils.h>
+
+/**
+ * Workqueues run deferred work in process context, on kernel worker threads.
+ *
+ * Work items are embedded in their owner's structure and never allocated by us, so queueing is
+ * allocation-free and can be done from IRQ context. Bound workqueues run work on the CPU that
+ * queued it, on that CPU's worker pool; unbound ones use a shared pool that can run work on any
+ * CPU. Pools are concurrency-managed: a bound pool keeps only one worker running at a time, but
+ * wakes up another one as soon as a worker blocks, so a sleeping work item doesn't hold up the
+ * rest of the CPU's work.
+ */
+
+struct work_struct;
+struct worker_pool;
+struct workqueue;
+struct thread;
+
+typedef void (*work_func_t)(struct work_struct *work);
+
+/* The work is queued, or is going to be (i.e delayed work with its timer armed) */
+#define WORK_PENDING (1 << 0)
+/* Internal: the work is in a pool's worklist */
+#define WORK_QUEUED  (1 << 1)
+
+struct work_struct
+{
+    work_func_t func{};
+    unsigned int flags{};
+    struct list_head list_node{};
+    /* Pool and workqueue it was last queued on */
+    struct worker_pool *pool{};
+    struct workqueue *wq{};
+};
+
+struct delayed_work
+{
+    struct work_struct work;
+    struct clockevent timer;
+    struct workqueue *wq{};
+    unsigned int cpu{};
+    /* Set while the timer is armed and hasn't queued the work yet */
+    bool armed{};
+};
+
+/* Work doesn't need to run on the CPU that queued it */
+#define WQ_UNBOUND (1 << 0)
+
+/* Per-CPU workqueue, for short work items */
+extern struct workqueue *system_wq;
+/* Unbound workqueue, for long running work items or ones that block a lot */
+extern struct workqueue *system_unbound_wq;
+
+static inline void work_init(struct work_struct *work, work_func_t func)
+{
+    work->func = func;
+    work->flags = 0;
+    work->pool = nullptr;
+    work->wq = nullptr;
+    INIT_LIST_HEAD(&work->list_node);
+}
+
+/**
+ * @brief Initialize a delayed work item
+ *
+ * @param dwork Delayed work
+ * @param func Function to call
+ */
+void delayed_work_init(struct delayed_work *dwork, work_func_t func);
+
+static inline struct delayed_work *to_delayed_work(struct work_struct *work)
+{
+    return container_of(work, struct delayed_work, work);
+}
+
+/**
+ * @brief Create a new workqueue
+ *
+ * @param name Name of the workqueue
+ * @param flags WQ_* flags
+ * @return Pointer to the workqueue, or nullptr on OOM
+ */
+struct workqueue *workqueue_create(const char *name, unsigned int flags);
+
+/**
+ * @brief Queue work on a workqueue
+ * Bound workqueues run it on the current CPU. Can be called from IRQ context.
+ *
+ * @param wq Workqueue
+ * @param work Work item
+ * @return True if it got queued, false if it was already pending
+ */
+bool queue_work(struct workqueue *wq, struct work_struct *work);
+
+/**
+ * @brief Queue work on a specific CPU
+ * Same as queue_work, but bound workqueues run the work on cpu instead of the current CPU.
+ *
+ * @param cpu CPU
+ * @param wq Workqueue
+ * @param work Work item
+ * @return True if it got queued, false if it was already pending
+ */
+bool queue_work_on(unsigned int cpu, struct workqueue *wq, struct work_struct *work);
+
+/**
+ * @brief Queue work after a delay
+ *
+ * @param wq Workqueue
+ * @param dwork Delayed work item
+ * @param delay Delay, in ns. If 0, the work gets queued right away
+ * @return True if it got queued, false if it was already pending
+ */
+bool queue_delayed_work(struct workqueue *wq, struct delayed_work *dwork, hrtime_t delay);
+
+/**
+ * @brief Wait for a work item to finish executing
+ * Waits for the work's last queueing to finish running. Doesn't wait for delayed work whose
+ * timer hasn't fired yet.
+ *
+ * @param work Work item
+ * @return True if we had to wait, else false
+ */
+bool flush_work(struct work_struct *work);
+
+/**
+ * @brief Wait for every work item queued on a workqueue to finish
+ * Work that keeps requeueing itself will make this wait for it to stop doing so.
+ *
+ * @param wq Workqueue
+ */
+void flush_workqueue(struct workqueue *wq);
+
+/**
+ * @brief Cancel a work item and wait for it to finish executing
+ * The caller needs to make sure no one requeues the work in the meanwhile.
+ *
+ * @param work Work item
+ * @return True if it was pending, else false
+ */
+bool cancel_work_sync(struct work_struct *work);
+
+/**
+ * @brief Cancel a delayed work item and wait for it to finish executing
+ * Like cancel_work_sync, but also disarms the timer.
+ *
+ * @param dwork Delayed work item
+ * @return True if it was pending, else false
+ */
+bool cancel_delayed_work_sync(struct delayed_work *dwork);
+
+/**
+ * @brief Called by the scheduler when a worker thread is about to block
+ *
+ * @param thread Current thread
+ */
+void wq_worker_sleeping(struct thread *thread);
+
+/**
+ * @brief Called by the scheduler when a worker thread that blocked is running again
+ *
+ * @param thread Current thread
+ */
+void wq_worker_running(struct thread *thread);
+
+#endif
@@ -19,6 +19,20 @@
     .quad priv1;                                                      \
     .quad priv2;                                                      \
     .popsection;
+
+/* A jmp to target that the patching function may nop out. Unlike the sites above, this is already
+ * valid code before x86_do_alternatives() runs, so it can be used in functions that run that early.
+ */
+#define __ASM_ALTERNATIVE_JUMP(patch_func, target, priv1, priv2) \
+    4096 :.byte 0xe9;                                            \
+    .long target - 4097f;                                        \
+    4097 :.pushsection .code_patch;                              \
+    .quad 4096b;                                                 \
+    .quad 5;                                                     \
+    .quad patch_func;                                            \
+    .quad priv1;                                                 \
+    .quad priv2;                                                 \
+    .popsection;
 // clang-format on
 #ifndef __ASSEMBLER__
 
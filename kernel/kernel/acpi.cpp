@@ -21,6 +21,7 @@
 #include <onyx/limits.h>
 #include <onyx/log.h>
 #include <onyx/mutex.h>
+#include <onyx/numa.h>
 #include <onyx/panic.h>
 #include <onyx/platform.h>
 #include <onyx/spinlock.h>
@@ -497,6 +498,145 @@ unsigned int acpi_power_event_handler(void *context)
     return acpi_shutdown();
 }
 
+/**
+ * @brief Find an ACPI table by walking the XSDT (or RSDT) by hand
+ * This is meant for early boot, when ACPICA's table manager isn't up yet. It only requires
+ * physical memory to be mapped.
+ *
+ * @param signature Table signature
+ * @return Pointer to the table header, or nullptr if not found
+ */
+static ACPI_TABLE_HEADER *acpi_early_find_table(const char *signature)
+{
+    auto rsdp_table = (ACPI_TABLE_RSDP *) PHYS_TO_VIRT(rsdp);
+    bool use_xsdt = rsdp_table->Revision >= 2 && rsdp_table->XsdtPhysicalAddress;
+    unsigned long root_table =
+        use_xsdt ? rsdp_table->XsdtPhysicalAddress : rsdp_table->RsdtPhysicalAddress;
+    auto root = (ACPI_TABLE_HEADER *) PHYS_TO_VIRT(root_table);
+    size_t entry_size = use_xsdt ? sizeof(UINT64) : sizeof(UINT32);
+    size_t nr_entries = (root->Length - sizeof(ACPI_TABLE_HEADER)) / entry_size;
+    auto entries = (char *) (root + 1);
+
+    for (size_t i = 0; i < nr_entries; i++)
+    {
+        unsigned long table_phys;
+
+        if (use_xsdt)
+            memcpy(&table_phys, entries + i * entry_size, sizeof(UINT64));
+        else
+            table_phys = *(UINT32 *) (entries + i * entry_size);
+
+        auto table = (ACPI_TABLE_HEADER *) PHYS_TO_VIRT(table_phys);
+        if (ACPI_COMPARE_NAMESEG(table->Signature, signature) &&
+            AcpiTbChecksum((uint8_t *) table, table->Length) == 0)
+            return table;
+    }
+
+    return nullptr;
+}
+
+static void acpi_numa_parse_srat(ACPI_TABLE_SRAT *srat)
+{
+    auto end = (ACPI_SUBTABLE_HEADER *) ((char *) srat + srat->Header.Length);
+
+    for (auto i = (ACPI_SUBTABLE_HEADER *) (srat + 1); i < end;
+         i = (ACPI_SUBTABLE_HEADER *) ((char *) i + i->Length))
+    {
+        if (i->Length == 0)
+            break;
+
+        switch (i->Type)
+        {
+            case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+                auto cpu = (ACPI_SRAT_CPU_AFFINITY *) i;
+                if (!(cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY))
+                    break;
+
+                uint32_t pxm = cpu->ProximityDomainLo;
+
+                /* SRAT revision 1 and earlier only had 8-bit proximity domains */
+                if (srat->TableRevision >= 2)
+                {
+                    pxm |= cpu->ProximityDomainHi[0] << 8 | cpu->ProximityDomainHi[1] << 16 |
+                           cpu->ProximityDomainHi[2] << 24;
+                }
+
+                int node = numa_pxm_to_node(pxm);
+                if (node != NUMA_NO_NODE)
+                    numa_add_cpu_hwid(cpu->ApicId, node);
+                break;
+            }
+
+            case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+                auto cpu = (ACPI_SRAT_X2APIC_CPU_AFFINITY *) i;
+                if (!(cpu->Flags & ACPI_SRAT_CPU_ENABLED))
+                    break;
+
+                int node = numa_pxm_to_node(cpu->ProximityDomain);
+                if (node != NUMA_NO_NODE)
+                    numa_add_cpu_hwid(cpu->ApicId, node);
+                break;
+            }
+
+            case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+                auto mem = (ACPI_SRAT_MEM_AFFINITY *) i;
+                if (!(mem->Flags & ACPI_SRAT_MEM_ENABLED) || mem->Length == 0)
+                    break;
+
+                uint32_t pxm = mem->ProximityDomain;
+                if (srat->TableRevision < 2)
+                    pxm &= 0xff;
+
+                int node = numa_pxm_to_node(pxm);
+                if (node != NUMA_NO_NODE)
+                    numa_add_memblk(node, mem->BaseAddress, mem->BaseAddress + mem->Length);
+                break;
+            }
+        }
+    }
+}
+
+static void acpi_numa_parse_slit(ACPI_TABLE_SLIT *slit)
+{
+    const auto count = slit->LocalityCount;
+
+    for (UINT64 i = 0; i < count; i++)
+    {
+        for (UINT64 j = 0; j < count; j++)
+        {
+            int from = numa_pxm_to_node(i);
+            int to = numa_pxm_to_node(j);
+
+            if (from == NUMA_NO_NODE || to == NUMA_NO_NODE)
+                continue;
+
+            numa_set_distance(from, to, slit->Entry[i * count + j]);
+        }
+    }
+}
+
+/**
+ * @brief Parse the SRAT and SLIT in order to discover the NUMA topology
+ * Needs to be called before page_init, as the page allocator creates a node per proximity domain.
+ */
+void acpi_numa_init()
+{
+    acpi_find_rsdp();
+
+    if (!rsdp)
+        return;
+
+    auto srat = (ACPI_TABLE_SRAT *) acpi_early_find_table(ACPI_SIG_SRAT);
+    if (!srat)
+        return;
+
+    acpi_numa_parse_srat(srat);
+
+    auto slit = (ACPI_TABLE_SLIT *) acpi_early_find_table(ACPI_SIG_SLIT);
+    if (slit)
+        acpi_numa_parse_slit(slit);
+}
+
 unsigned int acpi_suspend_event_handler(void *context)
 {
     (void) context;
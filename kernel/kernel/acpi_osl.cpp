@@ -12,7 +12,6 @@
 
 #include <onyx/acpi.h>
 #include <onyx/cpu.h>
-#include <onyx/dpc.h>
 #include <onyx/irq.h>
 #include <onyx/limits.h>
 #include <onyx/mm/slab.h>
@@ -23,6 +22,7 @@
 #include <onyx/task_switching.h>
 #include <onyx/timer.h>
 #include <onyx/vm.h>
+#include <onyx/workqueue.h>
 
 #include <pci/pci.h>
 
@@ -31,9 +31,33 @@ uint64_t __pci_read(pci::pci_device *dev, uint16_t off, size_t size);
 extern "C"
 {
 
+/* ACPICA's deferred callbacks may sleep, so they run on their own unbound workqueue, which
+ * also lets AcpiOsWaitEventsComplete wait for them.
+ */
+static struct workqueue *acpi_wq;
+
+struct acpi_exec_work
+{
+    struct work_struct work;
+    ACPI_OSD_EXEC_CALLBACK func;
+    void *context;
+};
+
+static void acpi_exec_work_func(struct work_struct *work)
+{
+    auto w = container_of(work, acpi_exec_work, work);
+    w->func(w->context);
+    delete w;
+}
+
 ACPI_STATUS AcpiOsInitialize()
 {
     printf("ACPI initializing!\n");
+
+    acpi_wq = workqueue_create("acpi", WQ_UNBOUND);
+    if (!acpi_wq)
+        return AE_NO_MEMORY;
+
     return AE_OK;
 }
 
@@ -121,24 +145,22 @@ ACPI_THREAD_ID AcpiOsGetThreadId()
 
 ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE Type, ACPI_OSD_EXEC_CALLBACK Function, void *Context)
 {
-    struct dpc_work w;
-    w.context = Context;
-    w.funcptr = Function;
+    auto w = new acpi_exec_work;
+    if (!w)
+        return AE_NO_MEMORY;
 
-    /* TODO: Something tells me these callbacks may sleep, and henceforth they're not
-     * okay to use in dpc contexts, where latency is key.
-     */
+    work_init(&w->work, acpi_exec_work_func);
+    w->func = Function;
+    w->context = Context;
 
-    /* My really crappy fix that doesn't fix a lot right now is to set the priority to LOW */
-    if (dpc_schedule_work(&w, DPC_PRIORITY_LOW) < 0)
-        return AE_NO_MEMORY;
+    queue_work(acpi_wq, &w->work);
 
     return AE_OK;
 }
 
 void AcpiOsWaitEventsComplete(void)
 {
-    /* TODO: This is impossible to implement right now */
+    flush_workqueue(acpi_wq);
 }
 
 void AcpiOsSleep(UINT64 Milliseconds)
@@ -321,7 +321,7 @@ int flush_old_exec(struct exec_state *state)
     vm_set_aspace(state->new_address_space.get());
 
     curr->address_space = cul::move(state->new_address_space);
-    mutex_init(&curr->address_space->vm_lock);
+    rwlock_init(&curr->address_space->vm_lock);
 
     /* Close O_CLOEXEC files */
     file_do_cloexec(&curr->ctx);
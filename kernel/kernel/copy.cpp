@@ -20,3 +20,75 @@ weak_alias(set_non_temporal_generic, __set_non_temporal)
 }
 
 weak_alias(copy_non_temporal_generic, __copy_non_temporal)
+
+#ifdef CONFIG_KTEST_STRING
+
+#include <libtest/libtest.h>
+
+#define STRING_TEST_SIZE 1024
+
+static unsigned char string_test_buf[STRING_TEST_SIZE * 2];
+static unsigned char string_test_ref[STRING_TEST_SIZE * 2];
+
+static void string_test_fill()
+{
+    for (unsigned int i = 0; i < sizeof(string_test_buf); i++)
+        string_test_buf[i] = string_test_ref[i] = i * 7 + (i >> 8);
+}
+
+/* Exercise every size class of memmove/memcpy/memset, at every alignment and overlap we care
+ * about, against a byte-at-a-time reference.
+ */
+static bool string_test()
+{
+    for (size_t n = 0; n < STRING_TEST_SIZE - 16; n += n < 80 ? 1 : 31)
+    {
+        for (long d = -40; d <= 40; d++)
+        {
+            size_t src = STRING_TEST_SIZE / 2;
+            size_t dst = src + d;
+
+            string_test_fill();
+
+            if (d > 0)
+            {
+                for (size_t i = n; i != 0; i--)
+                    string_test_ref[dst + i - 1] = string_test_ref[src + i - 1];
+            }
+            else
+            {
+                for (size_t i = 0; i < n; i++)
+                    string_test_ref[dst + i] = string_test_ref[src + i];
+            }
+
+            if (memmove(string_test_buf + dst, string_test_buf + src, n) != string_test_buf + dst)
+                return false;
+
+            if (memcmp(string_test_buf, string_test_ref, sizeof(string_test_buf)))
+                return false;
+
+            if (d > 8 || d < -8)
+                continue;
+
+            /* Non-overlapping copies with different (mis)alignments */
+            string_test_fill();
+
+            for (size_t i = 0; i < n; i++)
+                string_test_ref[STRING_TEST_SIZE + 8 + d + i] = string_test_ref[8 + i];
+            memcpy(string_test_buf + STRING_TEST_SIZE + 8 + d, string_test_buf + 8, n);
+
+            for (size_t i = 0; i < n; i++)
+                string_test_ref[8 + d + i] = (unsigned char) (n + d);
+            memset(string_test_buf + 8 + d, (int) (n + d) | 0x100, n);
+
+            if (memcmp(string_test_buf, string_test_ref, sizeof(string_test_buf)))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+DECLARE_TEST(string_test, 1);
+
+#endif
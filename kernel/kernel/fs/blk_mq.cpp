@@ -0,0 +1,657 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/block.h>
+#include <onyx/compiler.h>
+#include <onyx/cpu.h>
+#include <onyx/scheduler.h>
+#include <onyx/tracepoint.h>
+#include <onyx/wait_queue.h>
+
+/**
+ * Each tag is laid out as a spare bio_req (+ page_iov's) used when merging requests, followed
+ * by the driver's private data.
+ */
+struct blk_mq_merged_req
+{
+    struct bio_req req;
+    struct page_iov vec[];
+};
+
+static size_t blk_mq_merged_size(const struct blk_mq_queue *q)
+{
+    return ALIGN_TO(sizeof(blk_mq_merged_req) + q->max_segments * sizeof(page_iov), 64);
+}
+
+static unsigned char *blk_mq_tag_data(const struct blk_mq_queue *q, struct blk_mq_hw_queue *hw,
+                                      unsigned int tag)
+{
+    return hw->tag_data + q->tag_size * tag;
+}
+
+static void blk_mq_run_work_func(struct work_struct *work);
+
+int blk_mq_init_queue(struct blockdev *dev, const struct blk_mq_ops *ops,
+                      unsigned int nr_hw_queues, unsigned int queue_depth,
+                      unsigned int max_segments, size_t cmd_size)
+{
+    if (!nr_hw_queues || !queue_depth)
+        return -EINVAL;
+
+    auto q = new blk_mq_queue{};
+    if (!q)
+        return -ENOMEM;
+
+    q->ops = ops;
+    q->nr_hw_queues = nr_hw_queues;
+    q->queue_depth = queue_depth;
+    q->max_segments = max_segments;
+    q->cmd_size = cmd_size;
+    q->tag_size = blk_mq_merged_size(q) + ALIGN_TO(cmd_size, 64);
+    q->nr_sw_queues = get_nr_cpus();
+
+    q->hw_queues = new blk_mq_hw_queue[nr_hw_queues]();
+    if (!q->hw_queues)
+        goto err;
+
+    q->sw_queues = new blk_mq_sw_queue[q->nr_sw_queues]();
+    if (!q->sw_queues)
+        goto err;
+
+    for (unsigned int i = 0; i < nr_hw_queues; i++)
+    {
+        auto hw = &q->hw_queues[i];
+        spinlock_init(&hw->lock);
+        init_wait_queue_head(&hw->wait);
+        INIT_LIST_HEAD(&hw->requeue);
+        delayed_work_init(&hw->run_work.dwork, blk_mq_run_work_func);
+        hw->run_work.dev = dev;
+        hw->run_work.hwq = i;
+        hw->tags.set_size(queue_depth);
+        if (!hw->tags.allocate_bitmap())
+            goto err;
+
+        hw->tag_data = (unsigned char *) calloc(queue_depth, q->tag_size);
+        if (!hw->tag_data)
+            goto err;
+    }
+
+    for (unsigned int i = 0; i < q->nr_sw_queues; i++)
+    {
+        spinlock_init(&q->sw_queues[i].lock);
+        INIT_LIST_HEAD(&q->sw_queues[i].reqs);
+    }
+
+    dev->mq = q;
+    return 0;
+err:
+    if (q->hw_queues)
+    {
+        for (unsigned int i = 0; i < nr_hw_queues; i++)
+            free(q->hw_queues[i].tag_data);
+        delete[] q->hw_queues;
+    }
+
+    delete[] q->sw_queues;
+    delete q;
+    return -ENOMEM;
+}
+
+void *blk_mq_rq_to_pdu(struct bio_req *req)
+{
+    auto q = req->b_dev->mq;
+    return blk_mq_tag_data(q, req->b_hw, req->b_tag) + blk_mq_merged_size(q);
+}
+
+static bool blk_mq_try_get_tag(struct blk_mq_hw_queue *hw, unsigned int *tag)
+{
+    unsigned long bit;
+    scoped_lock<spinlock, true> g{hw->lock};
+
+    if (!hw->tags.find_free_bit(&bit))
+        return false;
+
+    hw->nr_inflight++;
+    *tag = (unsigned int) bit;
+    return true;
+}
+
+static void blk_mq_put_tag(struct blk_mq_hw_queue *hw, unsigned int tag)
+{
+    bool rerun;
+
+    {
+        scoped_lock<spinlock, true> g{hw->lock};
+        hw->tags.free_bit(tag);
+        hw->nr_inflight--;
+        rerun = !list_is_empty(&hw->requeue);
+    }
+
+    wait_queue_wake_all(&hw->wait);
+
+    /* Something completed, so the hardware queue may have room for the requeued requests */
+    if (rerun)
+        queue_delayed_work(system_unbound_wq, &hw->run_work.dwork, 0);
+}
+
+static size_t bio_req_length(const struct bio_req *req)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < req->nr_vecs; i++)
+        len += req->vec[i].length;
+    return len;
+}
+
+/**
+ * @brief Check if next can be merged at the end of prev
+ *
+ * @param dev Block device
+ * @param prev Previous request
+ * @param next Next request
+ * @param nr_vecs Number of vecs prev (and anything merged into it) has
+ * @param end End sector of prev
+ * @return True if mergeable, else false
+ */
+static bool blk_mq_can_merge(struct blockdev *dev, const struct bio_req *prev,
+                             const struct bio_req *next, size_t nr_vecs, sector_t end)
+{
+    if ((prev->flags | next->flags) & BIO_REQ_NOMERGE)
+        return false;
+    if ((prev->flags & BIO_REQ_OP_MASK) != (next->flags & BIO_REQ_OP_MASK))
+        return false;
+    if (end != next->sector_number)
+        return false;
+    if (nr_vecs + next->nr_vecs > dev->mq->max_segments)
+        return false;
+
+    /* Only merge at page boundaries, so drivers with PRP/SG-list constraints see the same
+     * kind of vecs they would see without merging.
+     */
+    const auto &last = prev->vec[prev->nr_vecs - 1];
+    return last.page_off + last.length == PAGE_SIZE && next->vec[0].page_off == 0;
+}
+
+static void blk_mq_merged_end_io(struct bio_req *req)
+{
+    list_for_every_safe (&req->b_merged)
+    {
+        auto child = container_of(l, bio_req, b_queue_node);
+        list_remove(&child->b_queue_node);
+        child->flags |= req->flags & BIO_REQ_STATUS_MASK;
+        if (child->b_end_io)
+            child->b_end_io(child);
+    }
+}
+
+/**
+ * @brief Pull requests off the head of a list and merge them into the tag's merge request,
+ * if possible.
+ *
+ * @param dev Block device
+ * @param list Sorted list of requests
+ * @param merged Tag's merge request
+ * @return The request to dispatch
+ */
+static struct bio_req *blk_mq_merge(struct blockdev *dev, struct list_head *list,
+                                    struct blk_mq_merged_req *merged)
+{
+    auto first = container_of(list_first_element(list), bio_req, b_queue_node);
+    list_remove(&first->b_queue_node);
+
+    if (!dev->mq->max_segments || list_is_empty(list))
+        return first;
+
+    size_t nr_vecs = first->nr_vecs;
+    sector_t end = first->sector_number + bio_req_length(first) / dev->sector_size;
+    const struct bio_req *last = first;
+    auto rq = &merged->req;
+
+    INIT_LIST_HEAD(&rq->b_merged);
+
+    while (!list_is_empty(list))
+    {
+        auto next = container_of(list_first_element(list), bio_req, b_queue_node);
+        if (!blk_mq_can_merge(dev, last, next, nr_vecs, end))
+            break;
+
+        if (last == first)
+        {
+            memcpy(merged->vec, first->vec, first->nr_vecs * sizeof(page_iov));
+            list_add_tail(&first->b_queue_node, &rq->b_merged);
+        }
+
+        list_remove(&next->b_queue_node);
+        memcpy(merged->vec + nr_vecs, next->vec, next->nr_vecs * sizeof(page_iov));
+        list_add_tail(&next->b_queue_node, &rq->b_merged);
+        nr_vecs += next->nr_vecs;
+        end += bio_req_length(next) / dev->sector_size;
+        last = next;
+    }
+
+    if (last == first)
+        return first;
+
+    rq->flags = first->flags & BIO_REQ_OP_MASK;
+    rq->sector_number = first->sector_number;
+    rq->vec = merged->vec;
+    rq->nr_vecs = nr_vecs;
+    rq->curr_vec_index = 0;
+    rq->b_end_io = blk_mq_merged_end_io;
+    rq->b_private = nullptr;
+    rq->b_dev = dev;
+    return rq;
+}
+
+/**
+ * @brief Undo a merge, putting the requests back at the head of the list
+ *
+ * @param rq Request returned by blk_mq_merge
+ * @param list List of requests
+ */
+static void blk_mq_unmerge(struct bio_req *rq, struct list_head *list)
+{
+    if (rq->b_end_io != blk_mq_merged_end_io)
+    {
+        list_add(&rq->b_queue_node, list);
+        return;
+    }
+
+    /* Go back to front, so the list keeps its order */
+    while (!list_is_empty(&rq->b_merged))
+    {
+        auto child = container_of(rq->b_merged.prev, bio_req, b_queue_node);
+        list_remove(&child->b_queue_node);
+        list_add(&child->b_queue_node, list);
+    }
+}
+
+static void bio_fail(struct bio_req *req)
+{
+    req->flags |= BIO_REQ_EIO;
+    if (req->b_end_io)
+        req->b_end_io(req);
+}
+
+/**
+ * @brief Dispatch a sorted list of requests to a hardware queue
+ *
+ * @param dev Block device
+ * @param hwq Hardware queue index
+ * @param list List of requests
+ */
+/* How long to wait before rerunning a hardware queue that bounced requests with nothing of ours
+ * in flight (i.e the hardware queue is shared, and we won't see the completion that frees it up)
+ */
+#define BLK_MQ_RERUN_DELAY NS_PER_MS
+
+/**
+ * @brief Park requests on the hardware queue's requeue list, to be dispatched again once
+ * something completes
+ *
+ * @param hw Hardware queue
+ * @param list List of requests
+ */
+static void blk_mq_requeue(struct blk_mq_hw_queue *hw, struct list_head *list)
+{
+    bool inflight;
+
+    {
+        scoped_lock<spinlock, true> g{hw->lock};
+        list_for_every_safe (list)
+        {
+            list_remove(l);
+            list_add_tail(l, &hw->requeue);
+        }
+
+        inflight = hw->nr_inflight > 0;
+    }
+
+    if (!inflight)
+        queue_delayed_work(system_unbound_wq, &hw->run_work.dwork, BLK_MQ_RERUN_DELAY);
+}
+
+/**
+ * @brief Check if the hardware queue has requeued requests, and if so, queue list behind them
+ *
+ * @param hw Hardware queue
+ * @param list List of requests
+ * @return True if the requests got queued, else false
+ */
+static bool blk_mq_queue_behind_requeue(struct blk_mq_hw_queue *hw, struct list_head *list)
+{
+    {
+        scoped_lock<spinlock, true> g{hw->lock};
+        if (list_is_empty(&hw->requeue))
+            return false;
+    }
+
+    /* Don't overtake the requests waiting for a rerun. */
+    blk_mq_requeue(hw, list);
+    return true;
+}
+
+static void blk_mq_dispatch(struct blockdev *dev, unsigned int hwq, struct list_head *list)
+{
+    auto q = dev->mq;
+    auto hw = &q->hw_queues[hwq];
+
+    if (blk_mq_queue_behind_requeue(hw, list))
+        return;
+
+    while (!list_is_empty(list))
+    {
+        unsigned int tag;
+        wait_for_event(&hw->wait, blk_mq_try_get_tag(hw, &tag));
+
+        auto merged = (blk_mq_merged_req *) blk_mq_tag_data(q, hw, tag);
+        auto rq = blk_mq_merge(dev, list, merged);
+
+        rq->b_hw = hw;
+        rq->b_tag = tag;
+
+        trace_block_rq_issue(rq->sector_number, bio_req_length(rq), rq->flags & BIO_REQ_OP_MASK);
+
+        int st = q->ops->queue_rq(dev, hwq, rq);
+
+        if (st == -EAGAIN)
+        {
+            /* The hardware queue is full (it may be shared with another device). Put
+             * everything back and rerun the queue once something completes. Release the tag
+             * before requeueing, so putting it doesn't kick off a rerun right away.
+             */
+            rq->b_hw = nullptr;
+            blk_mq_unmerge(rq, list);
+            blk_mq_put_tag(hw, tag);
+            blk_mq_requeue(hw, list);
+            return;
+        }
+
+        hw->nr_dispatched++;
+        if (rq->b_end_io == blk_mq_merged_end_io)
+            hw->nr_merged++;
+
+        if (st < 0)
+        {
+            rq->b_hw = nullptr;
+            bio_fail(rq);
+            blk_mq_put_tag(hw, tag);
+        }
+    }
+}
+
+/**
+ * @brief Get the software queue of the current CPU
+ *
+ * @param q Queue
+ * @return Software queue
+ */
+static struct blk_mq_sw_queue *blk_mq_get_sw_queue(struct blk_mq_queue *q)
+{
+    return &q->sw_queues[get_cpu_nr() % q->nr_sw_queues];
+}
+
+static void blk_mq_insert(struct blk_mq_sw_queue *swq, struct bio_req *req)
+{
+    scoped_lock<spinlock, true> g{swq->lock};
+
+    /* Keep the list sorted. Sequential IO is the common case, so search from the tail */
+    struct list_head *pos = swq->reqs.prev;
+    while (pos != &swq->reqs)
+    {
+        auto r = container_of(pos, bio_req, b_queue_node);
+        if (r->sector_number <= req->sector_number)
+            break;
+        pos = pos->prev;
+    }
+
+    list_add(&req->b_queue_node, pos);
+}
+
+/**
+ * @brief Dispatch the requests queued on a software queue
+ * We may have migrated since we queued them, so this takes the software queue instead of looking
+ * up the current CPU's.
+ *
+ * @param dev Block device
+ * @param swq Software queue
+ */
+static void blk_mq_run_sw_queue(struct blockdev *dev, struct blk_mq_sw_queue *swq)
+{
+    unsigned int hwq = (swq - dev->mq->sw_queues) % dev->mq->nr_hw_queues;
+    DEFINE_LIST(list);
+
+    {
+        scoped_lock<spinlock, true> g{swq->lock};
+        if (list_is_empty(&swq->reqs))
+            return;
+        list_move(&list, &swq->reqs);
+    }
+
+    blk_mq_dispatch(dev, hwq, &list);
+}
+
+static void blk_mq_run_work_func(struct work_struct *work)
+{
+    auto run_work = container_of(to_delayed_work(work), blk_mq_hw_queue::blk_mq_run_work, dwork);
+    auto hw = &run_work->dev->mq->hw_queues[run_work->hwq];
+    DEFINE_LIST(list);
+
+    {
+        scoped_lock<spinlock, true> g{hw->lock};
+        if (list_is_empty(&hw->requeue))
+            return;
+        list_move(&list, &hw->requeue);
+    }
+
+    blk_mq_dispatch(run_work->dev, run_work->hwq, &list);
+}
+
+/**
+ * @brief Flush a plug, issuing every plugged request
+ *
+ * @param plug Plug
+ */
+static void blk_flush_plug(struct blk_plug *plug)
+{
+    /* Requests are usually plugged for a single device, so batch up runs of the same device */
+    while (!list_is_empty(&plug->reqs))
+    {
+        auto first = container_of(list_first_element(&plug->reqs), bio_req, b_queue_node);
+        auto dev = first->b_dev;
+        auto swq = blk_mq_get_sw_queue(dev->mq);
+
+        list_for_every_safe (&plug->reqs)
+        {
+            auto req = container_of(l, bio_req, b_queue_node);
+            if (req->b_dev != dev)
+                continue;
+            list_remove(&req->b_queue_node);
+            blk_mq_insert(swq, req);
+        }
+
+        blk_mq_run_sw_queue(dev, swq);
+    }
+
+    plug->nr_reqs = 0;
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+    auto thread = get_current_thread();
+
+    INIT_LIST_HEAD(&plug->reqs);
+    plug->nr_reqs = 0;
+
+    /* Nested plugs get folded into the outermost one */
+    if (!thread->plug)
+        thread->plug = plug;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+    auto thread = get_current_thread();
+
+    if (thread->plug != plug)
+        return;
+
+    blk_flush_plug(plug);
+    thread->plug = nullptr;
+}
+
+int bio_submit_async(struct blockdev *dev, struct bio_req *req)
+{
+    auto bdev = blkdev_is_partition(dev) ? dev->actual_blockdev : dev;
+
+    if (!bdev->mq)
+    {
+        /* Synchronous driver, complete it right away */
+        if (unlikely(dev->submit_request == NULL))
+            return -EIO;
+
+        int st = dev->submit_request(dev, req);
+        if (st < 0)
+            return st;
+
+        if (req->b_end_io)
+            req->b_end_io(req);
+        return 0;
+    }
+
+    if (bdev != dev)
+        req->sector_number += dev->offset / dev->sector_size;
+
+    req->flags &= ~BIO_REQ_STATUS_MASK;
+    req->b_dev = bdev;
+    req->b_hw = nullptr;
+
+    auto thread = get_current_thread();
+    if (thread && thread->plug)
+    {
+        auto plug = thread->plug;
+        list_add_tail(&req->b_queue_node, &plug->reqs);
+        if (++plug->nr_reqs >= BLK_PLUG_MAX_REQS)
+            blk_flush_plug(plug);
+        return 0;
+    }
+
+    auto swq = blk_mq_get_sw_queue(bdev->mq);
+    blk_mq_insert(swq, req);
+    blk_mq_run_sw_queue(bdev, swq);
+    return 0;
+}
+
+void bio_complete(struct bio_req *req)
+{
+    trace_block_rq_complete(req->sector_number, bio_req_length(req), req->flags & BIO_REQ_OP_MASK,
+                            req->flags & BIO_REQ_STATUS_MASK);
+
+    auto hw = req->b_hw;
+    req->b_hw = nullptr;
+
+    if (req->b_end_io)
+        req->b_end_io(req);
+
+    /* Release the tag last, since a merged request lives in the tag's data */
+    if (hw)
+        blk_mq_put_tag(hw, req->b_tag);
+}
+
+#define BIO_BATCH_PENDING 0
+#define BIO_BATCH_WOKEN   1
+#define BIO_BATCH_DONE    2
+
+void bio_batch_init(struct bio_batch *batch)
+{
+    init_wait_queue_head(&batch->wq);
+    /* The submitter holds a bias reference until bio_batch_wait */
+    batch->pending.store(1, mem_order::relaxed);
+    batch->state.store(BIO_BATCH_PENDING, mem_order::relaxed);
+    batch->error.store(0, mem_order::relaxed);
+}
+
+static void bio_batch_put(struct bio_batch *batch)
+{
+    if (batch->pending.sub_fetch(1, mem_order::acq_rel) != 0)
+        return;
+
+    batch->state.store(BIO_BATCH_WOKEN, mem_order::release);
+    wait_queue_wake_all(&batch->wq);
+    /* After this store, the waiter may free the structure */
+    batch->state.store(BIO_BATCH_DONE, mem_order::release);
+}
+
+static void bio_batch_end_io(struct bio_req *req)
+{
+    auto batch = (bio_batch *) req->b_private;
+
+    if (req->flags & (BIO_REQ_EIO | BIO_REQ_TIMEOUT | BIO_REQ_NOT_SUPP))
+        batch->error.store(-EIO, mem_order::relaxed);
+
+    bio_batch_put(batch);
+}
+
+int bio_batch_submit(struct bio_batch *batch, struct blockdev *dev, struct bio_req *req)
+{
+    req->b_end_io = bio_batch_end_io;
+    req->b_private = batch;
+
+    batch->pending.add_fetch(1, mem_order::relaxed);
+
+    if (int st = bio_submit_async(dev, req); st < 0)
+    {
+        /* Can't drop to zero, we still hold the bias */
+        batch->pending.sub_fetch(1, mem_order::relaxed);
+        return st;
+    }
+
+    return 0;
+}
+
+int bio_batch_wait(struct bio_batch *batch)
+{
+    /* Don't sleep on requests that are sitting in our own plug */
+    auto thread = get_current_thread();
+    if (thread && thread->plug)
+        blk_flush_plug(thread->plug);
+
+    if (batch->pending.sub_fetch(1, mem_order::acq_rel) != 0)
+    {
+        wait_for_event(&batch->wq,
+                       batch->state.load(mem_order::acquire) != BIO_BATCH_PENDING);
+
+        while (batch->state.load(mem_order::acquire) != BIO_BATCH_DONE)
+            cpu_relax();
+    }
+
+    return batch->error.load(mem_order::relaxed);
+}
+
+int bio_submit_request(struct blockdev *dev, struct bio_req *req)
+{
+    auto bdev = blkdev_is_partition(dev) ? dev->actual_blockdev : dev;
+
+    if (!bdev->mq)
+    {
+        if (unlikely(dev->submit_request == NULL))
+            return -EIO;
+
+        return dev->submit_request(dev, req);
+    }
+
+    bio_batch batch;
+    bio_batch_init(&batch);
+
+    if (int st = bio_batch_submit(&batch, dev, req); st < 0)
+        return st;
+
+    return bio_batch_wait(&batch);
+}
@@ -15,6 +15,7 @@
 
 #include <onyx/block.h>
 #include <onyx/buffer.h>
+#include <onyx/direct_io.h>
 #include <onyx/page.h>
 #include <onyx/page_iov.h>
 #include <onyx/rwlock.h>
@@ -259,12 +260,49 @@ size_t blkdev_write_file(size_t offset, size_t len, void *buffer, struct file *f
     return written;
 }
 
+static int blkdev_dio_extent(struct inode *ino, size_t offset, size_t len, unsigned int op,
+                             struct dio_extent *ext)
+{
+    auto d = (blockdev *) ino->i_helper;
+
+    /* The device is one big extent */
+    ext->sector = offset / d->sector_size;
+    ext->length = len;
+    return 0;
+}
+
+ssize_t blkdev_direct_io(size_t offset, size_t len, void *buffer, struct file *f, bool write)
+{
+    auto d = blkdev_get_dev(f);
+    size_t size = d->nr_sectors * d->sector_size;
+
+    if ((offset | len | (unsigned long) buffer) & (d->sector_size - 1))
+        return errno = EINVAL, -1;
+
+    if (offset >= size)
+    {
+        if (write && len)
+            return errno = ENOSPC, -1;
+        return 0;
+    }
+
+    len = min(len, size - offset);
+
+    ssize_t st = dio_rw(f->f_ino, d, d->vmo, offset, len, buffer,
+                        write ? BIO_REQ_WRITE_OP : BIO_REQ_READ_OP, blkdev_dio_extent);
+    if (st < 0)
+        return errno = -st, -1;
+
+    return st;
+}
+
 const struct vm_object_ops blk_vmo_ops = {.commit = bbuffer_commit};
 
 const struct file_ops blkdev_ops = {
     .read = blkdev_read_file,
     .write = blkdev_write_file,
     .ioctl = blkdev_ioctl,
+    .direct_io = blkdev_direct_io,
 };
 
 int blkdev_init(struct blockdev *blk)
@@ -380,14 +418,6 @@ int blkdev_power(int op, struct blockdev *dev)
     return dev->power(op, dev);
 }
 
-int bio_submit_request(struct blockdev *dev, struct bio_req *req)
-{
-    if (unlikely(dev->submit_request == NULL))
-        return -EIO;
-
-    return dev->submit_request(dev, req);
-}
-
 atomic<unsigned int> next_scsi_dev_num = 0;
 /**
  * @brief Create a SCSI-like(sdX) block device
@@ -10,6 +10,7 @@
 #include <onyx/buffer.h>
 #include <onyx/cpu.h>
 #include <onyx/mm/flush.h>
+#include <onyx/pagecache.h>
 
 #include <onyx/mm/pool.hpp>
 
@@ -18,39 +19,93 @@ memory_pool<block_buf, 0> block_buf_pool;
 ssize_t block_buf_flush(flush_object *fo);
 bool block_buf_is_dirty(flush_object *fo);
 static void block_buf_set_dirty(bool dirty, flush_object *fo);
+static int block_buf_prepare_wb(flush_object *fo, flush_wb_req *req);
+static blockdev *block_buf_get_dev(flush_object *fo);
+static size_t block_buf_get_size(flush_object *fo);
 
-const struct flush_ops blockbuf_fops = {
-    .flush = block_buf_flush, .is_dirty = block_buf_is_dirty, .set_dirty = block_buf_set_dirty};
+const struct flush_ops blockbuf_fops = {.flush = block_buf_flush,
+                                        .is_dirty = block_buf_is_dirty,
+                                        .set_dirty = block_buf_set_dirty,
+                                        .prepare_wb = block_buf_prepare_wb,
+                                        .get_dev = block_buf_get_dev,
+                                        .get_size = block_buf_get_size};
 
 #define block_buf_from_flush_obj(fo) container_of(fo, block_buf, flush_obj)
 
-ssize_t block_buf_flush(flush_object *fo)
+/**
+ * @brief Set or clear a tag (VMO_TAG_*) on the page a buffer lives in
+ *
+ * @param buf Block buffer
+ * @param tag Tag
+ * @param set True to set, false to clear
+ */
+static void block_buf_tag_page(block_buf *buf, unsigned int tag, bool set)
 {
-    auto buf = block_buf_from_flush_obj(fo);
+    struct page *page = buf->this_page;
+    struct vm_object *vmo;
+    size_t off;
 
-    sector_t disk_sect = (buf->block_nr * buf->block_size) / buf->dev->sector_size;
+    if (page->cache)
+    {
+        /* File data, it lives in the inode's page cache */
+        vmo = page->cache->node->i_pages;
+        off = page->cache->offset;
+    }
+    else
+    {
+        vmo = buf->dev->vmo;
+        off = buf->block_nr * buf->block_size - buf->page_off;
+    }
 
-    struct page_iov vec;
-    vec.length = buf->block_size;
-    vec.page_off = buf->page_off;
-    vec.page = buf->this_page;
+    if (set)
+        vmo_set_page_tag(vmo, off, tag);
+    else
+        vmo_clear_page_tag(vmo, off, tag);
+}
 
-    struct bio_req r
-    {
-    };
-    r.nr_vecs = 1;
-    r.sector_number = disk_sect;
-    r.flags = BIO_REQ_WRITE_OP;
+static int block_buf_prepare_wb(flush_object *fo, flush_wb_req *req)
+{
+    auto buf = block_buf_from_flush_obj(fo);
 
-    r.vec = &vec;
+    req->vec.length = buf->block_size;
+    req->vec.page_off = buf->page_off;
+    req->vec.page = buf->this_page;
+
+    req->req = {};
+    req->req.nr_vecs = 1;
+    req->req.sector_number = (buf->block_nr * buf->block_size) / buf->dev->sector_size;
+    req->req.flags = BIO_REQ_WRITE_OP;
+    req->req.vec = &req->vec;
+    req->dev = buf->dev;
 
     __atomic_fetch_or(&buf->flags, BLOCKBUF_FLAG_UNDER_WB, __ATOMIC_RELAXED);
-    __atomic_fetch_or(&vec.page->flags, PAGE_FLAG_FLUSHING, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&buf->this_page->flags, PAGE_FLAG_FLUSHING, __ATOMIC_RELAXED);
+    block_buf_tag_page(buf, VMO_TAG_WRITEBACK, true);
 
-    if (bio_submit_request(buf->dev, &r) < 0)
+    return 0;
+}
+
+static blockdev *block_buf_get_dev(flush_object *fo)
+{
+    return block_buf_from_flush_obj(fo)->dev;
+}
+
+static size_t block_buf_get_size(flush_object *fo)
+{
+    return block_buf_from_flush_obj(fo)->block_size;
+}
+
+ssize_t block_buf_flush(flush_object *fo)
+{
+    auto buf = block_buf_from_flush_obj(fo);
+    flush_wb_req req;
+
+    block_buf_prepare_wb(fo, &req);
+
+    if (bio_submit_request(buf->dev, &req.req) < 0)
         return -EIO;
 #if 0
-	printk("Flushed #%lu[sector %lu].\n", buf->block_nr, disk_sect);
+	printk("Flushed #%lu[sector %lu].\n", buf->block_nr, req.req.sector_number);
 #endif
 
     return buf->block_size;
@@ -103,6 +158,7 @@ static void block_buf_set_dirty(bool dirty, flush_object *fo)
 
         if (!(old_flags & BLOCKBUF_FLAG_DIRTY))
         {
+            block_buf_tag_page(buf, VMO_TAG_DIRTY, true);
             flush_add_buf(fo);
         }
     }
@@ -115,8 +171,12 @@ static void block_buf_set_dirty(bool dirty, flush_object *fo)
         __atomic_and_fetch(&buf->flags, ~(BLOCKBUF_FLAG_DIRTY | BLOCKBUF_FLAG_UNDER_WB),
                            __ATOMIC_RELAXED);
         if (!page_has_dirty_bufs(page))
+        {
             __atomic_and_fetch(&page->flags, ~(PAGE_FLAG_DIRTY | PAGE_FLAG_FLUSHING),
                                __ATOMIC_RELAXED);
+            block_buf_tag_page(buf, VMO_TAG_DIRTY, false);
+            block_buf_tag_page(buf, VMO_TAG_WRITEBACK, false);
+        }
     }
 }
 
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/block.h>
+#include <onyx/buffer.h>
+#include <onyx/direct_io.h>
+#include <onyx/mm/flush.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/page.h>
+#include <onyx/pagecache.h>
+#include <onyx/vm.h>
+
+#include <onyx/utility.hpp>
+
+/* Max number of vecs in a single bio */
+#define DIO_BIO_VECS 32
+/* Max number of user pages we pin at once (1MiB) */
+#define DIO_MAX_PAGES 256
+
+struct dio_bio
+{
+    struct bio_req req;
+    struct dio_bio *next;
+    struct page_iov vec[DIO_BIO_VECS];
+};
+
+/**
+ * @brief Write back a cached page, if it's dirty
+ *
+ * @param page Page
+ */
+static void dio_writeback_page(struct page *page)
+{
+    if (page->cache)
+    {
+        /* Page cache page, dirtied as a whole */
+        if (page->flags & PAGE_FLAG_DIRTY)
+            flush_sync_one(&page->cache->fobj);
+    }
+    else
+    {
+        /* Buffer cache page, dirtied per block */
+        for (struct block_buf *b = block_buf_from_page(page); b; b = b->next)
+        {
+            if (b->flags & BLOCKBUF_FLAG_DIRTY)
+                flush_sync_one(&b->flush_obj);
+        }
+    }
+
+    wait_for_flush(page);
+}
+
+/**
+ * @brief Make sure the disk is up to date with the cached pages in a range
+ *
+ * @param cache VM object
+ * @param offset Offset of the range
+ * @param len Length of the range
+ */
+static void dio_sync_cache(struct vm_object *cache, size_t offset, size_t len)
+{
+    for (size_t off = offset & -PAGE_SIZE; off < offset + len; off += PAGE_SIZE)
+    {
+        struct page *page;
+
+        /* Don't populate anything, we only care about resident pages */
+        if (vmo_get(cache, off, 0, &page) != VMO_STATUS_OK)
+            continue;
+
+        dio_writeback_page(page);
+        page_unref(page);
+    }
+}
+
+/**
+ * @brief Copy what we've just written to the cached pages in the range
+ *
+ * @param cache VM object
+ * @param offset Offset of the range
+ * @param len Length of the range
+ * @param ubuf User buffer that was written
+ */
+static void dio_update_cache(struct vm_object *cache, size_t offset, size_t len, void *ubuf)
+{
+    for (size_t off = offset & -PAGE_SIZE; off < offset + len; off += PAGE_SIZE)
+    {
+        struct page *page;
+
+        if (vmo_get(cache, off, 0, &page) != VMO_STATUS_OK)
+            continue;
+
+        size_t start = cul::max(off, offset);
+        size_t end = cul::min(off + PAGE_SIZE, offset + len);
+
+        /* The disk already has the data, so a fault here only leaves the page stale. The user
+         * would need to unmap the buffer under us for that to happen.
+         */
+        copy_from_user((char *) PAGE_TO_VIRT(page) + (start - off),
+                       (char *) ubuf + (start - offset), end - start);
+        page_unref(page);
+    }
+}
+
+/**
+ * @brief Zero part of a pinned user buffer (for holes)
+ *
+ * @param pages Pinned pages
+ * @param off Offset in the buffer (from the start of the first page)
+ * @param len Length to zero
+ */
+static void dio_zero(struct page **pages, size_t off, size_t len)
+{
+    while (len)
+    {
+        size_t page_off = off & (PAGE_SIZE - 1);
+        size_t to_zero = cul::min(len, PAGE_SIZE - page_off);
+
+        memset((char *) PAGE_TO_VIRT(pages[off >> PAGE_SHIFT]) + page_off, 0, to_zero);
+
+        off += to_zero;
+        len -= to_zero;
+    }
+}
+
+/**
+ * @brief Do the I/O for a pinned chunk of the user buffer
+ *
+ * @param ino Inode
+ * @param dev Block device
+ * @param offset Offset of the chunk in the file
+ * @param len Length of the chunk
+ * @param pages Pinned pages of the chunk
+ * @param first_off Offset of the chunk in the first page
+ * @param op BIO_REQ_READ_OP or BIO_REQ_WRITE_OP
+ * @param get_extent Extent mapping callback
+ * @return 0 on success, negative error codes
+ */
+static int dio_do_chunk(struct inode *ino, struct blockdev *dev, size_t offset, size_t len,
+                        struct page **pages, size_t first_off, unsigned int op,
+                        dio_get_extent_t get_extent)
+{
+    struct bio_batch batch;
+    struct blk_plug plug;
+    struct dio_bio *bios = nullptr;
+    struct dio_bio *curr = nullptr;
+    size_t pos = 0;
+    int st = 0;
+
+    bio_batch_init(&batch);
+    blk_start_plug(&plug);
+
+    while (pos < len)
+    {
+        struct dio_extent ext;
+
+        if (st = get_extent(ino, offset + pos, len - pos, op, &ext); st < 0)
+            goto out;
+
+        size_t ext_len = cul::min(ext.length, len - pos);
+        assert(ext_len != 0);
+
+        if (ext.sector == DIO_EXTENT_HOLE)
+        {
+            if (op == BIO_REQ_WRITE_OP)
+            {
+                st = -EIO;
+                goto out;
+            }
+
+            dio_zero(pages, first_off + pos, ext_len);
+            pos += ext_len;
+            continue;
+        }
+
+        /* Describe the extent's part of the user buffer, splitting it at page boundaries */
+        for (size_t done = 0; done < ext_len;)
+        {
+            size_t buf_off = first_off + pos + done;
+            unsigned int page_off = buf_off & (PAGE_SIZE - 1);
+            unsigned int length = cul::min(ext_len - done, PAGE_SIZE - page_off);
+
+            if (curr && curr->req.nr_vecs == DIO_BIO_VECS)
+            {
+                st = bio_batch_submit(&batch, dev, &curr->req);
+                curr = nullptr;
+                if (st < 0)
+                    goto out;
+            }
+
+            if (!curr)
+            {
+                curr = (dio_bio *) zalloc(sizeof(dio_bio));
+                if (!curr)
+                {
+                    st = -ENOMEM;
+                    goto out;
+                }
+
+                curr->next = bios;
+                bios = curr;
+                curr->req.flags = op;
+                curr->req.sector_number = ext.sector + done / dev->sector_size;
+                curr->req.vec = curr->vec;
+            }
+
+            curr->vec[curr->req.nr_vecs++] = {pages[buf_off >> PAGE_SHIFT], length, page_off};
+            done += length;
+        }
+
+        /* The next extent isn't contiguous with this one */
+        st = bio_batch_submit(&batch, dev, &curr->req);
+        curr = nullptr;
+        if (st < 0)
+            goto out;
+
+        pos += ext_len;
+    }
+
+out:
+    if (curr)
+    {
+        if (int st2 = bio_batch_submit(&batch, dev, &curr->req); st2 < 0)
+            st = st2;
+    }
+
+    blk_finish_plug(&plug);
+
+    if (int st2 = bio_batch_wait(&batch); st2 < 0)
+        st = st2;
+
+    while (bios)
+    {
+        auto next = bios->next;
+        free(bios);
+        bios = next;
+    }
+
+    return st;
+}
+
+ssize_t dio_rw(struct inode *ino, struct blockdev *dev, struct vm_object *cache, size_t offset,
+               size_t len, void *ubuf, unsigned int op, dio_get_extent_t get_extent)
+{
+    unsigned int gpp_flags = GPP_USER | (op == BIO_REQ_WRITE_OP ? GPP_READ : GPP_WRITE);
+    size_t done = 0;
+    int st = 0;
+
+    struct page **pages = (struct page **) malloc(DIO_MAX_PAGES * sizeof(struct page *));
+    if (!pages)
+        return -ENOMEM;
+
+    if (cache)
+        dio_sync_cache(cache, offset, len);
+
+    while (done < len)
+    {
+        unsigned long addr = (unsigned long) ubuf + done;
+        size_t first_off = addr & (PAGE_SIZE - 1);
+        size_t chunk = cul::min(len - done, (DIO_MAX_PAGES << PAGE_SHIFT) - first_off);
+        size_t nr_pages = (first_off + chunk + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+        if (!(get_phys_pages((void *) (addr - first_off), gpp_flags, pages, nr_pages) &
+              GPP_ACCESS_OK))
+        {
+            st = -EFAULT;
+            break;
+        }
+
+        st = dio_do_chunk(ino, dev, offset + done, chunk, pages, first_off, op, get_extent);
+
+        for (size_t i = 0; i < nr_pages; i++)
+            page_unpin(pages[i]);
+
+        if (st < 0)
+            break;
+
+        done += chunk;
+    }
+
+    free(pages);
+
+    if (op == BIO_REQ_WRITE_OP && cache && done)
+        dio_update_cache(cache, offset, done, ubuf);
+
+    return done ?: st;
+}
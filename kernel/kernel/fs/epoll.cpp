@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/epoll.h>
+
+#include <onyx/clock.h>
+#include <onyx/dentry.h>
+#include <onyx/epoll.h>
+#include <onyx/file.h>
+#include <onyx/fnv.h>
+#include <onyx/mutex.h>
+#include <onyx/poll.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/spinlock.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <onyx/hashtable.hpp>
+
+/*
+ * epoll keeps a persistent set of files it's interested in (the interest set) and a list of the
+ * ones that may be ready (the ready list). Each item hooks a persistent token into the wait queues
+ * its file's poll handler hands it, so wakeups on the file move the item to the ready list.
+ * epoll_wait then only has to poll the items on the ready list, instead of every file.
+ *
+ * Locking: ep->lock (a mutex) protects the interest set and serialises polling items.
+ * ep->ready_lock (a spinlock, taken from wait queue callbacks) protects the ready list and item
+ * state. epitems_lock protects every file's f_epitems, and epmutex keeps epoll instances from
+ * going away while a closing file is being removed from them. The order is epmutex, ep->lock,
+ * wait queue locks, ep->ready_lock, and epitems_lock is taken on its own.
+ */
+
+/* Events the user can ask for, as opposed to the flags that change how they're reported */
+#define EP_EVENTS_MASK (~(EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP))
+
+struct eventpoll;
+
+struct epitem_wait
+{
+    struct wait_queue_token token;
+    struct wait_queue *queue;
+    epitem_wait *next;
+};
+
+struct epitem;
+
+/* epitem is a poll_waiter, so it isn't standard-layout and we can't container_of into it. Keep its
+ * list nodes in here instead, along with a pointer back to the item.
+ */
+struct epitem_links
+{
+    /* Protected by ep->ready_lock */
+    struct list_head rdllink;
+    /* Interest set node */
+    struct list_head list_node;
+    /* Node in file->f_epitems */
+    struct list_head file_node;
+    epitem *item;
+};
+
+struct epitem : public poll_waiter
+{
+    eventpoll *ep;
+    struct file *file;
+    int fd;
+    uint32_t events;
+    epoll_data_t data;
+
+    /* Wait queues we're hooked into */
+    epitem_wait *waits{nullptr};
+    bool wait_error{false};
+
+    /* Protected by ep->ready_lock */
+    bool ready{false};
+    /* Set after an EPOLLONESHOT item gets reported, until EPOLL_CTL_MOD rearms it */
+    bool disabled{false};
+
+    struct epitem_links links;
+
+    epitem(eventpoll *ep, struct file *file, int fd, const struct epoll_event &ev)
+        : ep{ep}, file{file}, fd{fd}, events{ev.events}, data{ev.data}
+    {
+        links.item = this;
+    }
+
+    void wait(wait_queue *queue) override;
+
+    /**
+     * @brief Unhook the item from every wait queue
+     * Once this returns, the wakeup callback can't be running anymore.
+     *
+     */
+    void unhook();
+};
+
+static uint32_t epitem_key_hash(const struct file *file, int fd)
+{
+    fnv_hash_t hash = fnv_hash(&file, sizeof(file));
+    return fnv_hash_cont(&fd, sizeof(fd), hash);
+}
+
+static uint32_t epitem_hash(epitem &item)
+{
+    return epitem_key_hash(item.file, item.fd);
+}
+
+static constexpr size_t ep_hashtable_buckets = 512;
+
+struct eventpoll
+{
+    struct mutex lock;
+    cul::hashtable2<epitem, ep_hashtable_buckets, uint32_t, epitem_hash> items;
+
+    struct spinlock ready_lock;
+    struct list_head ready_list;
+    unsigned long nr_ready{0};
+
+    /* epoll_wait()ers, and poll()ers of the epoll fd */
+    wait_queue wq;
+
+    eventpoll() : lock{}, items{}, ready_lock{}
+    {
+        INIT_LIST_HEAD(&ready_list);
+        init_wait_queue_head(&wq);
+    }
+};
+
+static struct mutex epmutex;
+static struct spinlock epitems_lock;
+
+static void ep_poll_callback(void *context, struct wait_queue_token *token)
+{
+    epitem *item = static_cast<epitem *>(context);
+    eventpoll *ep = item->ep;
+
+    unsigned long cpu_flags = spin_lock_irqsave(&ep->ready_lock);
+
+    if (item->ready || item->disabled)
+    {
+        spin_unlock_irqrestore(&ep->ready_lock, cpu_flags);
+        return;
+    }
+
+    list_add_tail(&item->links.rdllink, &ep->ready_list);
+    item->ready = true;
+    ep->nr_ready++;
+
+    spin_unlock_irqrestore(&ep->ready_lock, cpu_flags);
+
+    wait_queue_wake_all(&ep->wq);
+}
+
+void epitem::wait(wait_queue *queue)
+{
+    /* Poll handlers wait on the same queues every time they're called, only hook in once */
+    for (epitem_wait *w = waits; w; w = w->next)
+    {
+        if (w->queue == queue)
+            return;
+    }
+
+    epitem_wait *w = new epitem_wait;
+    if (!w)
+    {
+        wait_error = true;
+        return;
+    }
+
+    w->queue = queue;
+    w->token.callback = ep_poll_callback;
+    w->token.context = this;
+    w->token.flags = WQ_TOKEN_PERSISTENT;
+    w->next = waits;
+    waits = w;
+
+    wait_queue_add(queue, &w->token);
+}
+
+void epitem::unhook()
+{
+    epitem_wait *w = waits;
+    waits = nullptr;
+
+    while (w)
+    {
+        epitem_wait *next = w->next;
+        wait_queue_remove(w->queue, &w->token);
+        delete w;
+        w = next;
+    }
+}
+
+/**
+ * @brief Poll an item's file
+ * Hooks the item into any new wait queues along the way.
+ *
+ * @param item Item
+ * @return The item's ready events, or a negative error code
+ */
+static int ep_item_poll(epitem *item)
+{
+    uint32_t mask = (item->events & EP_EVENTS_MASK) | EPOLLERR | EPOLLHUP;
+
+    item->wait_error = false;
+    uint16_t revents = poll_vfs(static_cast<poll_waiter *>(item), (short) mask, item->file);
+
+    if (item->wait_error)
+        return -ENOMEM;
+
+    return revents & mask;
+}
+
+/**
+ * @brief Put an item on the ready list, if it's not there already
+ *
+ * @param ep Epoll instance
+ * @param item Item
+ */
+static void ep_make_ready(eventpoll *ep, epitem *item)
+{
+    unsigned long cpu_flags = spin_lock_irqsave(&ep->ready_lock);
+
+    if (item->ready || item->disabled)
+    {
+        spin_unlock_irqrestore(&ep->ready_lock, cpu_flags);
+        return;
+    }
+
+    list_add_tail(&item->links.rdllink, &ep->ready_list);
+    item->ready = true;
+    ep->nr_ready++;
+
+    spin_unlock_irqrestore(&ep->ready_lock, cpu_flags);
+
+    wait_queue_wake_all(&ep->wq);
+}
+
+/**
+ * @brief Take an item off the ready list, and make sure it doesn't get back on
+ *
+ * @param ep Epoll instance
+ * @param item Item
+ * @param disable True to keep it off the ready list until it's reenabled
+ */
+static void ep_unready(eventpoll *ep, epitem *item, bool disable)
+{
+    unsigned long cpu_flags = spin_lock_irqsave(&ep->ready_lock);
+
+    if (item->ready)
+    {
+        list_remove(&item->links.rdllink);
+        item->ready = false;
+        ep->nr_ready--;
+    }
+
+    item->disabled = disable;
+
+    spin_unlock_irqrestore(&ep->ready_lock, cpu_flags);
+}
+
+static bool ep_has_ready(eventpoll *ep)
+{
+    return __atomic_load_n(&ep->nr_ready, __ATOMIC_RELAXED) != 0;
+}
+
+static epitem *ep_find(eventpoll *ep, struct file *file, int fd)
+{
+    MUST_HOLD_MUTEX(&ep->lock);
+
+    auto index = ep->items.get_hashtable_index(epitem_key_hash(file, fd));
+
+    list_for_every (ep->items.get_hashtable(index))
+    {
+        epitem *item = container_of(l, epitem_links, list_node)->item;
+
+        if (item->file == file && item->fd == fd)
+            return item;
+    }
+
+    return nullptr;
+}
+
+static void ep_remove(eventpoll *ep, epitem *item)
+{
+    MUST_HOLD_MUTEX(&ep->lock);
+
+    /* Unhook the item first, so it can't get back on the ready list */
+    item->unhook();
+    ep_unready(ep, item, true);
+
+    spin_lock(&epitems_lock);
+    list_remove(&item->links.file_node);
+    spin_unlock(&epitems_lock);
+
+    ep->items.remove_element(*item, &item->links.list_node);
+
+    delete item;
+}
+
+static int ep_insert(eventpoll *ep, struct file *file, int fd, const struct epoll_event &ev)
+{
+    MUST_HOLD_MUTEX(&ep->lock);
+
+    epitem *item = new epitem{ep, file, fd, ev};
+    if (!item)
+        return -ENOMEM;
+
+    ep->items.add_element(*item, &item->links.list_node);
+
+    spin_lock(&epitems_lock);
+    list_add_tail(&item->links.file_node, &file->f_epitems);
+    spin_unlock(&epitems_lock);
+
+    /* Hook into the file's wait queues, and catch any events that came before that */
+    int revents = ep_item_poll(item);
+    if (revents < 0)
+    {
+        ep_remove(ep, item);
+        return revents;
+    }
+
+    if (revents)
+        ep_make_ready(ep, item);
+
+    return 0;
+}
+
+static int ep_modify(eventpoll *ep, epitem *item, const struct epoll_event &ev)
+{
+    MUST_HOLD_MUTEX(&ep->lock);
+
+    item->events = ev.events;
+    item->data = ev.data;
+
+    /* This also rearms EPOLLONESHOT items */
+    ep_unready(ep, item, false);
+
+    int revents = ep_item_poll(item);
+    if (revents < 0)
+        return revents;
+
+    if (revents)
+        ep_make_ready(ep, item);
+
+    return 0;
+}
+
+/**
+ * @brief Report the ready items
+ * Every item that was on the ready list when we got here gets polled once (at most), so
+ * level-triggered items that get requeued don't make us loop forever.
+ *
+ * @param ep Epoll instance
+ * @param uevents User event array
+ * @param maxevents Size of the array
+ * @return Number of events reported, or a negative error code
+ */
+static int ep_send_events(eventpoll *ep, struct epoll_event *uevents, int maxevents)
+{
+    MUST_HOLD_MUTEX(&ep->lock);
+
+    int nr = 0;
+    unsigned long to_scan = __atomic_load_n(&ep->nr_ready, __ATOMIC_RELAXED);
+
+    while (to_scan-- && nr < maxevents)
+    {
+        unsigned long cpu_flags = spin_lock_irqsave(&ep->ready_lock);
+
+        if (list_is_empty(&ep->ready_list))
+        {
+            spin_unlock_irqrestore(&ep->ready_lock, cpu_flags);
+            break;
+        }
+
+        auto links = container_of(list_first_element(&ep->ready_list), epitem_links, rdllink);
+        epitem *item = links->item;
+        list_remove(&item->links.rdllink);
+        item->ready = false;
+        ep->nr_ready--;
+
+        spin_unlock_irqrestore(&ep->ready_lock, cpu_flags);
+
+        /* Wakeups from here on put the item back on the ready list, so we can't miss events
+         * that come in after the poll.
+         */
+        int revents = ep_item_poll(item);
+        if (revents < 0)
+        {
+            ep_make_ready(ep, item);
+            return nr ? nr : revents;
+        }
+
+        /* Not ready after all (the wakeup was for something else) */
+        if (revents == 0)
+            continue;
+
+        struct epoll_event ev;
+        ev.events = revents;
+        ev.data = item->data;
+
+        if (copy_to_user(&uevents[nr], &ev, sizeof(ev)) < 0)
+        {
+            ep_make_ready(ep, item);
+            return nr ? nr : -EFAULT;
+        }
+
+        nr++;
+
+        if (item->events & EPOLLONESHOT)
+            ep_unready(ep, item, true);
+        else if (!(item->events & EPOLLET))
+        {
+            /* Level-triggered items stay ready until a poll says otherwise */
+            ep_make_ready(ep, item);
+        }
+    }
+
+    return nr;
+}
+
+static long ep_wait_ready(eventpoll *ep)
+{
+    return wait_for_event_interruptible(&ep->wq, ep_has_ready(ep));
+}
+
+static long ep_wait_ready_timeout(eventpoll *ep, hrtime_t timeout)
+{
+    return wait_for_event_timeout_interruptible(&ep->wq, ep_has_ready(ep), timeout);
+}
+
+static int ep_poll(eventpoll *ep, struct epoll_event *uevents, int maxevents, int timeout)
+{
+    hrtime_t deadline = 0;
+
+    if (timeout > 0)
+        deadline = clocksource_get_time() + (hrtime_t) timeout * NS_PER_MS;
+
+    while (true)
+    {
+        int nr;
+
+        {
+            scoped_mutex g{ep->lock};
+            nr = ep_send_events(ep, uevents, maxevents);
+        }
+
+        if (nr != 0)
+            return nr;
+
+        if (timeout == 0)
+            return 0;
+
+        long st;
+
+        if (timeout < 0)
+            st = ep_wait_ready(ep);
+        else
+        {
+            hrtime_t now = clocksource_get_time();
+            if (now >= deadline)
+                return 0;
+
+            st = ep_wait_ready_timeout(ep, deadline - now);
+        }
+
+        if (st == -ETIMEDOUT)
+            return 0;
+        if (st < 0)
+            return st;
+    }
+}
+
+static eventpoll *file_to_ep(struct file *f)
+{
+    return (eventpoll *) f->f_ino->i_helper;
+}
+
+short epoll_poll(void *poll_file, short events, struct file *f)
+{
+    eventpoll *ep = file_to_ep(f);
+
+    poll_wait_helper(poll_file, &ep->wq);
+
+    /* Items on the ready list may turn out not to be ready when polled, but the worst this does
+     * is give out an epoll_wait() that returns 0.
+     */
+    return ep_has_ready(ep) ? (events & POLLIN) : 0;
+}
+
+void epoll_close(struct inode *ino)
+{
+    eventpoll *ep = (eventpoll *) ino->i_helper;
+
+    {
+        scoped_mutex g{epmutex};
+        scoped_mutex g2{ep->lock};
+
+        for (size_t i = 0; i < ep_hashtable_buckets; i++)
+        {
+            list_for_every_safe (ep->items.get_hashtable(i))
+                ep_remove(ep, container_of(l, epitem_links, list_node)->item);
+        }
+    }
+
+    delete ep;
+}
+
+struct file_ops epoll_ops = {.close = epoll_close, .poll = epoll_poll};
+
+static bool file_is_epoll(struct file *f)
+{
+    return f->f_ino->i_fops == &epoll_ops;
+}
+
+void epoll_release_file(struct file *f)
+{
+    /* Nobody can add the file to an epoll instance anymore (that takes a reference), so if it's
+     * not on any now, it won't be.
+     */
+    if (list_is_empty(&f->f_epitems))
+        return;
+
+    scoped_mutex g{epmutex};
+
+    while (true)
+    {
+        spin_lock(&epitems_lock);
+
+        if (list_is_empty(&f->f_epitems))
+        {
+            spin_unlock(&epitems_lock);
+            break;
+        }
+
+        auto links = container_of(list_first_element(&f->f_epitems), epitem_links, file_node);
+        epitem *item = links->item;
+
+        spin_unlock(&epitems_lock);
+
+        /* The instance can't go away, since we hold epmutex */
+        eventpoll *ep = item->ep;
+        scoped_mutex g2{ep->lock};
+        ep_remove(ep, item);
+    }
+}
+
+int sys_epoll_create1(int flags)
+{
+    if (flags & ~EPOLL_CLOEXEC)
+        return -EINVAL;
+
+    eventpoll *ep = new eventpoll;
+    if (!ep)
+        return -ENOMEM;
+
+    struct inode *ino = inode_create(false);
+    if (!ino)
+    {
+        delete ep;
+        return -ENOMEM;
+    }
+
+    ino->i_fops = &epoll_ops;
+    ino->i_type = VFS_TYPE_UNK;
+    ino->i_helper = ep;
+
+    struct file *f = inode_to_file(ino);
+    if (!f)
+    {
+        /* Dropping the inode closes it, which frees ep */
+        inode_unref(ino);
+        return -ENOMEM;
+    }
+
+    struct dentry *d = dentry_create("<epoll>", ino, nullptr);
+    if (!d)
+    {
+        fd_put(f);
+        return -ENOMEM;
+    }
+
+    f->f_dentry = d;
+
+    int fd = open_with_vnode(f, O_RDWR | (flags & EPOLL_CLOEXEC));
+
+    /* open_with_vnode grabs its own reference on success */
+    fd_put(f);
+
+    return fd;
+}
+
+int sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event *uevent)
+{
+    struct epoll_event ev = {};
+
+    if (op != EPOLL_CTL_ADD && op != EPOLL_CTL_DEL && op != EPOLL_CTL_MOD)
+        return -EINVAL;
+
+    if (op != EPOLL_CTL_DEL && copy_from_user(&ev, uevent, sizeof(ev)) < 0)
+        return -EFAULT;
+
+    auto_file epf, target;
+
+    if (int st = epf.from_fd(epfd); st < 0)
+        return st;
+
+    if (int st = target.from_fd(fd); st < 0)
+        return st;
+
+    if (!file_is_epoll(epf.get_file()))
+        return -EINVAL;
+
+    /* Nested epoll isn't supported, wakeups can't go through more than one instance */
+    if (file_is_epoll(target.get_file()))
+        return -EINVAL;
+
+    /* Like Linux, files that don't know how to poll (and are therefore always ready) can't be
+     * watched.
+     */
+    if (!target.get_file()->f_ino->i_fops->poll)
+        return -EPERM;
+
+    /* EPOLLEXCLUSIVE is taken (but not honoured, every waiter gets woken up) on ADD only */
+    if (op == EPOLL_CTL_MOD && ev.events & EPOLLEXCLUSIVE)
+        return -EINVAL;
+
+    eventpoll *ep = file_to_ep(epf.get_file());
+    scoped_mutex g{ep->lock};
+
+    epitem *item = ep_find(ep, target.get_file(), fd);
+
+    switch (op)
+    {
+        case EPOLL_CTL_ADD:
+            if (item)
+                return -EEXIST;
+            return ep_insert(ep, target.get_file(), fd, ev);
+        case EPOLL_CTL_DEL:
+            if (!item)
+                return -ENOENT;
+            ep_remove(ep, item);
+            return 0;
+        case EPOLL_CTL_MOD:
+            if (!item)
+                return -ENOENT;
+            return ep_modify(ep, item, ev);
+    }
+
+    return -EINVAL;
+}
+
+int sys_epoll_pwait(int epfd, struct epoll_event *uevents, int maxevents, int timeout,
+                    const sigset_t *usigmask, size_t sigsetsize)
+{
+    bool valid_sigmask = false;
+    sigset_t set = {};
+
+    if (maxevents <= 0 || (unsigned long) maxevents > INT_MAX / sizeof(struct epoll_event))
+        return -EINVAL;
+
+    if (usigmask)
+    {
+        if (sigsetsize != sizeof(sigset_t))
+            return -EINVAL;
+        if (copy_from_user(&set, usigmask, sizeof(set)) < 0)
+            return -EFAULT;
+        valid_sigmask = true;
+    }
+
+    auto_file epf;
+    if (int st = epf.from_fd(epfd); st < 0)
+        return st;
+
+    if (!file_is_epoll(epf.get_file()))
+        return -EINVAL;
+
+    auto_signal_mask mask_guard{valid_sigmask, set};
+
+    int st = ep_poll(file_to_ep(epf.get_file()), uevents, maxevents, timeout);
+
+    /* Keep the temporary mask around until the signal is delivered */
+    if (st == -EINTR)
+        mask_guard.disable();
+
+    return st;
+}
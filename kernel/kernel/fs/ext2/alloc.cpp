@@ -73,7 +73,8 @@ void ext2_superblock::free_inode(ext2_inode_no inode)
     block_groups[bg_no].free_inode(inode, this);
 }
 
-ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr)
+ext2_block_no ext2_superblock::try_allocate_blocks_from_bg(ext2_block_group_no nr, uint32_t goal,
+                                                           unsigned int max, unsigned int *count)
 {
     if (nr >= number_of_block_groups)
     {
@@ -85,14 +86,28 @@ ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr
     if (bg.get_bgd()->unallocated_blocks_in_group == 0)
         return EXT2_ERR_INV_BLOCK;
 
-    auto res = bg.allocate_block(this);
+    auto res = bg.allocate_blocks(this, goal, max, count);
 
 #if 0
-	printk("Allocated block %u from bg %u\n", res.value_or(EXT2_ERR_INV_BLOCK), nr);
+	printk("Allocated %u blocks at %u from bg %u\n", *count, res.value_or(EXT2_ERR_INV_BLOCK), nr);
 #endif
     return res.value_or(EXT2_ERR_INV_BLOCK);
 }
 
+/**
+ * @brief Check if the current user may dip into the root-reserved blocks
+ */
+bool ext2_superblock::may_use_reserved_blocks() const
+{
+    auto c = creds_get();
+
+    bool may_use_blocks = c->euid == sb->s_def_resuid || c->egid == sb->s_def_resgid;
+
+    creds_put(c);
+
+    return may_use_blocks;
+}
+
 /**
  * @brief Allocates a block, taking into account the preferred block group
  *
@@ -101,26 +116,53 @@ ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr
  */
 ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
 {
-    if (sb->s_free_blocks_count == 0) [[unlikely]]
-        return EXT2_ERR_INV_BLOCK;
+    unsigned int count;
+    ext2_block_no goal = EXT2_ERR_INV_BLOCK;
 
-    if (sb->s_free_blocks_count <= sb->s_r_blocks_count) [[unlikely]]
-    {
-        auto c = creds_get();
+    if (preferred != (ext2_block_group_no) -1)
+        goal = preferred * blocks_per_block_group + first_data_block();
 
-        bool may_use_blocks = c->euid == sb->s_def_resuid || c->egid == sb->s_def_resgid;
+    return allocate_blocks(goal, 1, &count);
+}
 
-        creds_put(c);
+/**
+ * @brief Allocates a run of contiguous blocks, as close to the goal as possible
+ *
+ * @param goal Block we'd like to get, or EXT2_ERR_INV_BLOCK if we don't care
+ * @param max Max number of blocks
+ * @param count Pointer to where the number of blocks we got gets stored
+ * @param flags EXT2_ALLOC_* flags
+ * @return First block of the run, or EXT2_ERR_INV_BLOCK if we couldn't allocate any.
+ */
+ext2_block_no ext2_superblock::allocate_blocks(ext2_block_no goal, unsigned int max,
+                                               unsigned int *count, unsigned int flags)
+{
+    unsigned long free_blocks = sb->s_free_blocks_count;
+
+    if (!(flags & EXT2_ALLOC_RESERVED))
+    {
+        /* Blocks reserved for delayed allocation aren't ours to take */
+        unsigned long reserved = __atomic_load_n(&delalloc_reserved, __ATOMIC_RELAXED);
+        free_blocks = free_blocks > reserved ? free_blocks - reserved : 0;
 
-        if (!may_use_blocks)
+        if (free_blocks <= sb->s_r_blocks_count && free_blocks && !may_use_reserved_blocks())
             return EXT2_ERR_INV_BLOCK;
     }
 
-    if (preferred == (ext2_block_group_no) -1)
-        preferred = 0;
+    if (free_blocks == 0) [[unlikely]]
+        return EXT2_ERR_INV_BLOCK;
+
+    max = cul::min((unsigned long) max, free_blocks);
+
+    if (goal < first_data_block() || goal >= total_blocks)
+        goal = first_data_block();
+
+    ext2_block_group_no preferred = (goal - first_data_block()) / blocks_per_block_group;
+    uint32_t goal_bit = (goal - first_data_block()) % blocks_per_block_group;
 
     /* Our algorithm works like this: We take the preferred block group, and then we'll
      * iterate the block groups inside-out, trying them according to the distance.
+     * Only the preferred block group gets the goal, the others get scanned from the start.
      */
 
     auto max_block_group = this->number_of_block_groups - 1;
@@ -136,13 +178,13 @@ ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
          * we'll only need to try once, since both tries will point to the same block group.
          */
         if (dist && dist_start >= 0)
-            block = try_allocate_block_from_bg(preferred - dist);
+            block = try_allocate_blocks_from_bg(preferred - dist, 0, max, count);
 
         if (block != EXT2_ERR_INV_BLOCK)
             return block;
 
         if (dist_end >= 0)
-            block = try_allocate_block_from_bg(preferred + dist);
+            block = try_allocate_blocks_from_bg(preferred + dist, dist ? 0 : goal_bit, max, count);
 
         if (block != EXT2_ERR_INV_BLOCK)
             return block;
@@ -157,12 +199,137 @@ ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
  * @param block Block number to free
  */
 void ext2_superblock::free_block(ext2_block_no block)
+{
+    free_blocks(block, 1);
+}
+
+/**
+ * @brief Frees a run of blocks
+ *
+ * @param block First block of the run
+ * @param count Number of blocks
+ */
+void ext2_superblock::free_blocks(ext2_block_no block, unsigned int count)
 {
     assert(block != EXT2_ERR_INV_BLOCK);
 
-    auto block_group = (block - first_data_block()) / blocks_per_block_group;
+    while (count)
+    {
+        auto block_group = (block - first_data_block()) / blocks_per_block_group;
+
+        assert(block_group < number_of_block_groups);
+
+        /* Don't cross into the next block group */
+        auto in_group = (block - first_data_block()) % blocks_per_block_group;
+        unsigned int to_free = cul::min(count, blocks_per_block_group - in_group);
+
+        block_groups[block_group].free_blocks(block, to_free, this);
+
+        block += to_free;
+        count -= to_free;
+    }
+}
+
+/**
+ * @brief Reserve space for delayed allocation, so writeback can't run out of it
+ *
+ * @param nr Number of blocks
+ * @return True if we reserved them, false if there's not enough space
+ */
+bool ext2_superblock::reserve_blocks(unsigned long nr)
+{
+    unsigned long reserved = __atomic_load_n(&delalloc_reserved, __ATOMIC_RELAXED);
+    bool checked_creds = false;
+    bool privileged = false;
+
+    do
+    {
+        unsigned long want = reserved + nr;
+        /* Leave room for the indirect blocks the reserved blocks may need */
+        want += want / (block_size / sizeof(uint32_t)) + 3;
+
+        unsigned long free_blocks = sb->s_free_blocks_count;
+
+        if (free_blocks < want)
+            return false;
+
+        if (free_blocks - want < sb->s_r_blocks_count)
+        {
+            if (!checked_creds)
+            {
+                privileged = may_use_reserved_blocks();
+                checked_creds = true;
+            }
+
+            if (!privileged)
+                return false;
+        }
+    } while (!__atomic_compare_exchange_n(&delalloc_reserved, &reserved, reserved + nr, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+ext2_block_no ext2_alloc_data_blocks(inode *ino, ext2_block_no goal, unsigned int nr,
+                                     unsigned int *count, unsigned int flags)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    auto info = ext2_inode_info_from_node(ino);
+
+    /* Continue from the preallocation window, if that's where we're going */
+    if (info->prealloc_len && (goal == EXT2_FILE_HOLE_BLOCK || goal == info->prealloc_start))
+    {
+        ext2_block_no block = info->prealloc_start;
+        *count = cul::min(nr, info->prealloc_len);
+
+        info->prealloc_start += *count;
+        info->prealloc_len -= *count;
+        return block;
+    }
+
+    if (goal == EXT2_FILE_HOLE_BLOCK)
+    {
+        /* Keep files close to their inodes */
+        goal = ext2_inode_number_to_bg(ino->i_inode, sb) * sb->blocks_per_block_group +
+               sb->first_data_block();
+    }
+
+    unsigned int want = nr;
+
+    /* Files that are being written to get a window of extra blocks (if there's space to spare),
+     * so their next allocation lands right after this one, instead of wherever other files'
+     * allocations left the bitmap. We only keep one window, and random writes don't get one.
+     */
+    bool new_window = S_ISREG(ino->i_mode) && info->writers && !info->prealloc_len;
+    if (new_window && sb->sb->s_free_blocks_count >
+                          __atomic_load_n(&sb->delalloc_reserved, __ATOMIC_RELAXED) +
+                              2 * (nr + EXT2_PREALLOC_BLOCKS) + sb->sb->s_r_blocks_count)
+        want += EXT2_PREALLOC_BLOCKS;
+
+    ext2_block_no block = sb->allocate_blocks(goal, want, count, flags);
+    if (block == EXT2_ERR_INV_BLOCK)
+        return block;
+
+    if (*count > nr)
+    {
+        info->prealloc_start = block + nr;
+        info->prealloc_len = *count - nr;
+        *count = nr;
+    }
+
+    return block;
+}
+
+void ext2_discard_prealloc(inode *ino)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    auto info = ext2_inode_info_from_node(ino);
+
+    scoped_mutex g{info->alloc_lock};
 
-    assert(block_group < number_of_block_groups);
+    if (!info->prealloc_len)
+        return;
 
-    block_groups[block_group].free_block(block, this);
+    sb->free_blocks(info->prealloc_start, info->prealloc_len);
+    info->prealloc_len = 0;
 }
@@ -74,7 +74,44 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_inode(ext2_superblock *s
     return nr * sb->inodes_per_block_group + bit + 1;
 }
 
-expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *sb)
+static constexpr uint32_t bits_per_long = WORD_SIZE * CHAR_BIT;
+
+static inline bool ext2_test_bit(const unsigned long *bitmap, uint32_t bit)
+{
+    return bitmap[bit / bits_per_long] & (1UL << (bit % bits_per_long));
+}
+
+/**
+ * @brief Find the next set (or clear) bit in a bitmap
+ *
+ * @param bitmap Bitmap
+ * @param size Size of the bitmap, in bits
+ * @param start Bit to start at
+ * @param set True to look for a set bit, false for a clear one
+ * @return The bit, or size if there's none
+ */
+static uint32_t ext2_find_next_bit(const unsigned long *bitmap, uint32_t size, uint32_t start,
+                                   bool set)
+{
+    while (start < size)
+    {
+        uint32_t word_start = start - start % bits_per_long;
+        unsigned long word = set ? bitmap[start / bits_per_long] : ~bitmap[start / bits_per_long];
+
+        word &= ~0UL << (start % bits_per_long);
+
+        if (word)
+            return cul::min(size, word_start + __builtin_ctzl(word));
+
+        start = word_start + bits_per_long;
+    }
+
+    return size;
+}
+
+expected<ext2_block_no, int> ext2_block_group::allocate_blocks(ext2_superblock *sb, uint32_t goal,
+                                                               unsigned int max,
+                                                               unsigned int *count)
 {
     scoped_mutex g{block_bitmap_lock};
 
@@ -88,30 +125,62 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *s
     }
 
     auto bitmap = static_cast<unsigned long *>(block_buf_data(buf));
+    uint32_t nr_bits = sb->blocks_in_group(nr);
+    uint32_t best = 0;
+    uint32_t best_len = 0;
 
-    auto bit = ext2_scan_zero(bitmap, sb->s_block_size);
+    if (goal >= nr_bits)
+        goal = 0;
 
-    if (bit == SCAN_ZERO_NOT_FOUND)
-        return unexpected{-ENOSPC};
-
-    static constexpr auto bits_per_long = WORD_SIZE * CHAR_BIT;
+    if (!ext2_test_bit(bitmap, goal))
+    {
+        /* The goal is free, take what we can from there */
+        best = goal;
+        best_len = ext2_find_next_bit(bitmap, nr_bits, goal, true) - goal;
+    }
+    else
+    {
+        /* Look at the free runs from the goal to the end, then from the start to the goal. The
+         * goal is in use, so no run can cross it.
+         */
+        for (int pass = 0; pass < 2 && best_len < max; pass++)
+        {
+            uint32_t pos = pass == 0 ? goal : 0;
+            uint32_t end = pass == 0 ? nr_bits : goal;
+
+            while (pos < end && best_len < max)
+            {
+                uint32_t run_start = ext2_find_next_bit(bitmap, end, pos, false);
+                if (run_start == end)
+                    break;
+
+                uint32_t run_end = ext2_find_next_bit(bitmap, end, run_start, true);
+
+                if (run_end - run_start > best_len)
+                {
+                    best = run_start;
+                    best_len = run_end - run_start;
+                }
+
+                pos = run_end;
+            }
+        }
+    }
 
-    /* Set the corresponding bit */
-#if 0
-	printk("Got bit %lu\n", bit);
-	printk("setting %lu on word %lu\n", (bit % bits_per_long), bit / bits_per_long);
-#endif
+    if (best_len == 0)
+        return unexpected{-ENOSPC};
 
-    bitmap[bit / bits_per_long] |= (1UL << (bit % bits_per_long));
+    best_len = cul::min(best_len, (uint32_t) max);
 
-    assert(ext2_scan_zero(bitmap, sb->s_block_size) != bit);
+    for (uint32_t bit = best; bit < best + best_len; bit++)
+        bitmap[bit / bits_per_long] |= (1UL << (bit % bits_per_long));
 
     /* Change the block group and superblock
        structures in order to reflect it */
 
-    dec_unallocated_blocks();
+    dec_unallocated_blocks(best_len);
 
-    EXT2_ATOMIC_SUB(sb->sb->s_free_blocks_count, 1);
+    EXT2_ATOMIC_SUB(sb->sb->s_free_blocks_count, best_len);
     /* Actually register the changes on disk */
     /* We give the bitmap priority here,
      * since there can be a disk failure or a
@@ -121,10 +190,13 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *s
     block_buf_dirty(buf);
     ext2_dirty_sb(sb);
 
-    return nr * sb->blocks_per_block_group + bit + sb->first_data_block();
+    *count = best_len;
+
+    return nr * sb->blocks_per_block_group + best + sb->first_data_block();
 }
 
-void ext2_block_group::free_block(ext2_block_no block, ext2_superblock *sb)
+void ext2_block_group::free_blocks(ext2_block_no block, unsigned int count,
+                                   ext2_superblock *sb)
 {
     scoped_mutex g{block_bitmap_lock};
 
@@ -141,24 +213,33 @@ void ext2_block_group::free_block(ext2_block_no block, ext2_superblock *sb)
 
     auto bitmap = static_cast<uint8_t *>(block_buf_data(buf));
 
-    auto bit = (block - sb->first_data_block()) % sb->blocks_per_block_group;
-    auto byte_idx = bit / CHAR_BIT;
-    auto bit_idx = bit % CHAR_BIT;
+    auto first_bit = (block - sb->first_data_block()) % sb->blocks_per_block_group;
+    unsigned int freed = 0;
 
-    /* Let's check for corruption, if it's already free we'll have to error. */
-    if (!(bitmap[byte_idx] & (1 << bit_idx)))
+    for (auto bit = first_bit; bit < first_bit + count; bit++)
     {
-        sb->error("Corruption detected: Block already freed");
-        return;
+        auto byte_idx = bit / CHAR_BIT;
+        auto bit_idx = bit % CHAR_BIT;
+
+        /* Let's check for corruption, if it's already free we'll have to error. */
+        if (!(bitmap[byte_idx] & (1 << bit_idx)))
+        {
+            sb->error("Corruption detected: Block already freed");
+            continue;
+        }
+
+        bitmap[byte_idx] &= ~(1 << bit_idx);
+        freed++;
     }
 
-    bitmap[byte_idx] &= ~(1 << bit_idx);
+    if (!freed)
+        return;
 
     block_buf_dirty(buf);
 
-    inc_unallocated_blocks();
+    inc_unallocated_blocks(freed);
 
-    EXT2_ATOMIC_ADD(sb->sb->s_free_blocks_count, 1);
+    EXT2_ATOMIC_ADD(sb->sb->s_free_blocks_count, freed);
 
     ext2_dirty_sb(sb);
 }
@@ -0,0 +1,983 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/pagecache.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+#include "ext2.h"
+
+/**
+ * Hashed directories (htree), as in ext3/4's dir_index feature.
+ * Names get hashed, and an up to two-level tree of (hash, block) pairs points at the leaf block
+ * that has the names for each hash range. Leaves are regular directory blocks, and the index is
+ * hidden behind dirents, so code that scans directories linearly still works on indexed
+ * directories (and removing entries doesn't need to touch the index).
+ * When an entry doesn't fit in its leaf, the leaf gets split in two by hash. If two leaves share a
+ * hash, the second one's index entry has the low bit set (hashes are always even otherwise).
+ */
+
+#define EXT2_DX_HASH_EOF 0x7fffffffU
+
+/* Mask of the block number in an ext2_dx_entry */
+#define EXT2_DX_BLOCK_MASK 0x0fffffff
+
+/* Legacy hash */
+static uint32_t ext2_dx_hack_hash(const char *name, size_t len, bool unsigned_chars)
+{
+    uint32_t hash0 = 0x12a3fe2d;
+    uint32_t hash1 = 0x37abe8f9;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int c = unsigned_chars ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+        uint32_t hash = hash1 + (hash0 ^ (uint32_t) (c * 7152373));
+
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+/**
+ * @brief Turn (part of) a name into num words of hash input, padding with the length
+ */
+static void ext2_dx_str2hashbuf(const char *name, size_t len, uint32_t *buf, int num,
+                                bool unsigned_chars)
+{
+    uint32_t pad = (uint32_t) len | ((uint32_t) len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+
+    if (len > (size_t) num * 4)
+        len = num * 4;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        int c = unsigned_chars ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+        val = (uint32_t) c + (val << 8);
+
+        if ((i % 4) == 3)
+        {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+static inline uint32_t rol32(uint32_t word, unsigned int shift)
+{
+    return (word << shift) | (word >> (32 - shift));
+}
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+
+#define DX_K1 0
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+/* Cut down MD4 (three rounds of 8 steps), as used by ext3 */
+static void ext2_dx_half_md4(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1, 3);
+    DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1, 7);
+    DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+    DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+    DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1, 3);
+    DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1, 7);
+    DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+    DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+    DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+    DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+    DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+    DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/* 16 rounds of TEA */
+static void ext2_dx_tea(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++)
+    {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/**
+ * @brief Hash a name
+ *
+ * @param name Name
+ * @param len Length of the name
+ * @param version EXT2_HASH_*
+ * @param seed Hash seed (4 words, all zero for the default)
+ * @return The hash, with the low bit clear
+ */
+static uint32_t ext2_dx_hash(const char *name, size_t len, unsigned int version,
+                             const uint32_t *seed)
+{
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint32_t in[8];
+    uint32_t hash;
+    bool unsigned_chars = version >= EXT2_HASH_LEGACY_UNSIGNED;
+
+    if (seed[0] || seed[1] || seed[2] || seed[3])
+        memcpy(buf, seed, sizeof(buf));
+
+    switch (version)
+    {
+        case EXT2_HASH_LEGACY:
+        case EXT2_HASH_LEGACY_UNSIGNED:
+            hash = ext2_dx_hack_hash(name, len, unsigned_chars);
+            break;
+        case EXT2_HASH_HALF_MD4:
+        case EXT2_HASH_HALF_MD4_UNSIGNED:
+            for (const char *p = name; p < name + len; p += 32)
+            {
+                ext2_dx_str2hashbuf(p, name + len - p, in, 8, unsigned_chars);
+                ext2_dx_half_md4(buf, in);
+            }
+
+            hash = buf[1];
+            break;
+        case EXT2_HASH_TEA:
+        case EXT2_HASH_TEA_UNSIGNED:
+            for (const char *p = name; p < name + len; p += 16)
+            {
+                ext2_dx_str2hashbuf(p, name + len - p, in, 4, unsigned_chars);
+                ext2_dx_tea(buf, in);
+            }
+
+            hash = buf[0];
+            break;
+        default:
+            __builtin_unreachable();
+    }
+
+    hash &= ~1;
+    if (hash == (EXT2_DX_HASH_EOF << 1))
+        hash = (EXT2_DX_HASH_EOF - 1) << 1;
+
+    return hash;
+}
+
+/**
+ * @brief Get the hash version to use for a directory
+ *
+ * @param info_version Version in the dx root
+ * @param fs Filesystem
+ * @return EXT2_HASH_*
+ */
+static unsigned int ext2_dx_hash_version(uint8_t info_version, ext2_superblock *fs)
+{
+    /* The unsigned variants aren't stored on disk, they depend on the superblock */
+    if (fs->sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        return info_version + EXT2_HASH_LEGACY_UNSIGNED;
+    return info_version;
+}
+
+bool ext2_dir_is_indexed(inode *dir, ext2_superblock *fs)
+{
+    return fs->features_compat & EXT2_FEATURE_COMPAT_DIR_INDEX &&
+           ext2_get_inode_from_node(dir)->i_flags & EXT2_INDEX_FL;
+}
+
+static int ext2_dx_read_block(inode *dir, ext2_block_no block, void *buf, ext2_superblock *fs)
+{
+    size_t off = (size_t) block << fs->block_size_shift;
+
+    if (off >= dir->i_size)
+        return -EBADMSG;
+
+    auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st = file_read_cache(buf, fs->block_size, dir, off);
+    thread_change_addr_limit(old);
+
+    if (st < 0)
+        return -errno;
+
+    return (size_t) st == fs->block_size ? 0 : -EIO;
+}
+
+static int ext2_dx_write_block(inode *dir, ext2_block_no block, void *buf, ext2_superblock *fs)
+{
+    auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st =
+        file_write_cache_unlocked(buf, fs->block_size, dir, (size_t) block << fs->block_size_shift);
+    thread_change_addr_limit(old);
+
+    return st < 0 ? st : 0;
+}
+
+/* A level of the tree, as we walk down it */
+struct ext2_dx_frame
+{
+    uint8_t *buf;
+    ext2_block_no block;
+    struct ext2_dx_entry *entries;
+    /* The entry we went down through */
+    struct ext2_dx_entry *at;
+};
+
+struct ext2_dx_path
+{
+    struct ext2_dx_frame frames[EXT2_HTREE_MAX_LEVELS + 1];
+    unsigned int nr_frames;
+    uint32_t hash;
+    unsigned int version;
+
+    ext2_dx_path() : frames{}, nr_frames{}, hash{}, version{}
+    {
+    }
+
+    ~ext2_dx_path()
+    {
+        for (auto &f : frames)
+            free(f.buf);
+    }
+};
+
+static inline ext2_dx_countlimit *ext2_dx_cl(ext2_dx_entry *entries)
+{
+    return (ext2_dx_countlimit *) entries;
+}
+
+static inline ext2_block_no ext2_dx_block(const ext2_dx_entry *e)
+{
+    return e->block & EXT2_DX_BLOCK_MASK;
+}
+
+static inline ext2_dx_root_info *ext2_dx_info(uint8_t *root)
+{
+    return (ext2_dx_root_info *) (root + EXT2_DX_ROOT_DOTS_SIZE);
+}
+
+static inline unsigned int ext2_dx_root_limit(ext2_superblock *fs)
+{
+    return (fs->block_size - EXT2_DX_ROOT_DOTS_SIZE - sizeof(ext2_dx_root_info)) /
+           sizeof(ext2_dx_entry);
+}
+
+static inline unsigned int ext2_dx_node_limit(ext2_superblock *fs)
+{
+    return (fs->block_size - EXT2_DX_NODE_HEADER_SIZE) / sizeof(ext2_dx_entry);
+}
+
+/**
+ * @brief Read a level of the index in, and find the entry for the hash
+ *
+ * @param dir Directory
+ * @param path Path
+ * @param block Block of the node
+ * @param hash Hash we're looking for
+ * @param fs Filesystem
+ * @return 0 on success, negative error codes
+ */
+static int ext2_dx_read_node(inode *dir, ext2_dx_path *path, ext2_block_no block, uint32_t hash,
+                             ext2_superblock *fs)
+{
+    bool root = path->nr_frames == 0;
+    auto &frame = path->frames[path->nr_frames];
+
+    frame.buf = (uint8_t *) malloc(fs->block_size);
+    if (!frame.buf)
+        return -ENOMEM;
+
+    if (int st = ext2_dx_read_block(dir, block, frame.buf, fs); st < 0)
+        return st;
+
+    path->nr_frames++;
+    frame.block = block;
+
+    if (root)
+    {
+        auto info = ext2_dx_info(frame.buf);
+
+        if (info->reserved_zero || info->info_length != sizeof(ext2_dx_root_info) ||
+            info->hash_version > EXT2_HASH_TEA || info->indirect_levels > EXT2_HTREE_MAX_LEVELS)
+            return -EBADMSG;
+
+        frame.entries = (ext2_dx_entry *) (frame.buf + EXT2_DX_ROOT_DOTS_SIZE + info->info_length);
+    }
+    else
+        frame.entries = (ext2_dx_entry *) (frame.buf + EXT2_DX_NODE_HEADER_SIZE);
+
+    auto cl = ext2_dx_cl(frame.entries);
+    if (cl->limit != (root ? ext2_dx_root_limit(fs) : ext2_dx_node_limit(fs)) || !cl->count ||
+        cl->count > cl->limit)
+        return -EBADMSG;
+
+    /* Find the last entry whose hash is <= ours. The first entry's hash is implicitly 0. */
+    ext2_dx_entry *p = frame.entries + 1;
+    ext2_dx_entry *q = frame.entries + cl->count - 1;
+
+    while (p <= q)
+    {
+        ext2_dx_entry *m = p + (q - p) / 2;
+        if (m->hash > hash)
+            q = m - 1;
+        else
+            p = m + 1;
+    }
+
+    frame.at = p - 1;
+    return 0;
+}
+
+/**
+ * @brief Walk the index down to the leaf a name belongs to
+ *
+ * @param dir Directory
+ * @param name Name
+ * @param len Length of the name
+ * @param path Path to fill
+ * @param fs Filesystem
+ * @return Leaf block, or negative error codes (-EBADMSG if the index is corrupted)
+ */
+static long ext2_dx_probe(inode *dir, const char *name, size_t len, ext2_dx_path *path,
+                          ext2_superblock *fs)
+{
+    path->frames[0].buf = (uint8_t *) malloc(fs->block_size);
+    if (!path->frames[0].buf)
+        return -ENOMEM;
+
+    /* We need the hash version before we can hash, so peek at the root first */
+    if (int st = ext2_dx_read_block(dir, 0, path->frames[0].buf, fs); st < 0)
+        return st;
+
+    auto info = ext2_dx_info(path->frames[0].buf);
+    if (info->hash_version > EXT2_HASH_TEA)
+        return -EBADMSG;
+
+    path->version = ext2_dx_hash_version(info->hash_version, fs);
+    path->hash = ext2_dx_hash(name, len, path->version, fs->sb->s_hash_seed);
+
+    free(path->frames[0].buf);
+    path->frames[0].buf = nullptr;
+
+    ext2_block_no block = 0;
+    unsigned int levels = 0;
+
+    do
+    {
+        if (int st = ext2_dx_read_node(dir, path, block, path->hash, fs); st < 0)
+            return st;
+
+        if (path->nr_frames == 1)
+            levels = ext2_dx_info(path->frames[0].buf)->indirect_levels;
+
+        block = ext2_dx_block(path->frames[path->nr_frames - 1].at);
+    } while (path->nr_frames <= levels);
+
+    return block;
+}
+
+/**
+ * @brief Move on to the next leaf, if it may have entries with our hash (collisions)
+ *
+ * @param dir Directory
+ * @param path Path
+ * @param fs Filesystem
+ * @return Next leaf block, 0 if there's no point in looking further, or negative error codes
+ */
+static long ext2_dx_next_leaf(inode *dir, ext2_dx_path *path, ext2_superblock *fs)
+{
+    int level = path->nr_frames - 1;
+
+    /* Find the lowest level that has more entries */
+    while (level >= 0)
+    {
+        auto &f = path->frames[level];
+        if (f.at + 1 < f.entries + ext2_dx_cl(f.entries)->count)
+            break;
+        level--;
+    }
+
+    if (level < 0)
+        return 0;
+
+    auto &f = path->frames[level];
+    f.at++;
+
+    /* Unless the next leaf continues our hash, what we're looking for isn't there */
+    if ((f.at->hash & ~1) != path->hash)
+        return 0;
+
+    /* Go down the leftmost side of the subtree */
+    for (unsigned int i = level + 1; i < path->nr_frames; i++)
+    {
+        auto &child = path->frames[i];
+        child.block = ext2_dx_block(path->frames[i - 1].at);
+
+        if (int st = ext2_dx_read_block(dir, child.block, child.buf, fs); st < 0)
+            return st;
+
+        child.entries = (ext2_dx_entry *) (child.buf + EXT2_DX_NODE_HEADER_SIZE);
+        auto cl = ext2_dx_cl(child.entries);
+        if (cl->limit != ext2_dx_node_limit(fs) || !cl->count || cl->count > cl->limit)
+            return -EBADMSG;
+        child.at = child.entries;
+    }
+
+    return ext2_dx_block(path->frames[path->nr_frames - 1].at);
+}
+
+int ext2_dx_lookup(inode *dir, const char *name, ext2_superblock *fs, ext2_dirent_result *res)
+{
+    ext2_dx_path path;
+    size_t len = strlen(name);
+
+    long block = ext2_dx_probe(dir, name, len, &path, fs);
+    if (block < 0)
+        return block;
+
+    char *buf = (char *) malloc(fs->block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    while (true)
+    {
+        if (int st = ext2_dx_read_block(dir, block, buf, fs); st < 0)
+        {
+            free(buf);
+            return st;
+        }
+
+        int off = ext2_search_dir_block(buf, name, len, fs);
+
+        if (off >= 0)
+        {
+            res->block_off = off;
+            res->file_off = ((size_t) block << fs->block_size_shift) + off;
+            res->buf = buf;
+            return 1;
+        }
+
+        if (off != -ENOENT)
+        {
+            free(buf);
+            return off;
+        }
+
+        block = ext2_dx_next_leaf(dir, &path, fs);
+        if (block <= 0)
+        {
+            free(buf);
+            return block < 0 ? block : -ENOENT;
+        }
+    }
+}
+
+/**
+ * @brief Insert an index entry after frame->at. The node must have space.
+ */
+static void ext2_dx_insert_entry(ext2_dx_frame *frame, uint32_t hash, ext2_block_no block)
+{
+    auto cl = ext2_dx_cl(frame->entries);
+    ext2_dx_entry *end = frame->entries + cl->count;
+    ext2_dx_entry *new_entry = frame->at + 1;
+
+    memmove(new_entry + 1, new_entry, (end - new_entry) * sizeof(ext2_dx_entry));
+    new_entry->hash = hash;
+    new_entry->block = block;
+    cl->count++;
+}
+
+static inline ext2_block_no ext2_dir_nr_blocks(inode *dir, ext2_superblock *fs)
+{
+    return dir->i_size >> fs->block_size_shift;
+}
+
+/**
+ * @brief Make space in the index for another leaf.
+ * Splits the full node at the bottom of the path, or adds a level if the root is the one that's
+ * full.
+ *
+ * @param dir Directory
+ * @param path Path, which becomes stale
+ * @param fs Filesystem
+ * @return 0 on success, negative error codes
+ */
+static int ext2_dx_grow_index(inode *dir, ext2_dx_path *path, ext2_superblock *fs)
+{
+    auto &root = path->frames[0];
+    auto root_cl = ext2_dx_cl(root.entries);
+    ext2_block_no new_block = ext2_dir_nr_blocks(dir, fs);
+    int st;
+
+    uint8_t *node = (uint8_t *) zalloc(fs->block_size);
+    if (!node)
+        return -ENOMEM;
+
+    /* Interior nodes are hidden behind an empty dirent */
+    auto fake = (ext2_dir_entry_t *) node;
+    fake->rec_len = fs->block_size;
+    auto node_entries = (ext2_dx_entry *) (node + EXT2_DX_NODE_HEADER_SIZE);
+
+    if (path->nr_frames == 1)
+    {
+        /* The root is full, move its entries down to a new node, and point the root at it */
+        memcpy(node_entries, root.entries, root_cl->count * sizeof(ext2_dx_entry));
+        ext2_dx_cl(node_entries)->limit = ext2_dx_node_limit(fs);
+        ext2_dx_cl(node_entries)->count = root_cl->count;
+
+        root_cl->count = 1;
+        root.entries[0].block = new_block;
+        ext2_dx_info(root.buf)->indirect_levels = 1;
+    }
+    else
+    {
+        if (root_cl->count == root_cl->limit)
+        {
+            free(node);
+            return -ENOSPC;
+        }
+
+        /* Split the node in half, and add the new half to the root */
+        auto &frame = path->frames[1];
+        auto cl = ext2_dx_cl(frame.entries);
+        unsigned int keep = cl->count / 2;
+        unsigned int move = cl->count - keep;
+        uint32_t split_hash = frame.entries[keep].hash;
+
+        memcpy(node_entries, frame.entries + keep, move * sizeof(ext2_dx_entry));
+        ext2_dx_cl(node_entries)->limit = ext2_dx_node_limit(fs);
+        ext2_dx_cl(node_entries)->count = move;
+        cl->count = keep;
+
+        ext2_dx_insert_entry(&root, split_hash, new_block);
+
+        if ((st = ext2_dx_write_block(dir, frame.block, frame.buf, fs)) < 0)
+            goto out;
+    }
+
+    /* Write the new node first, so the root never points past the end of the directory */
+    if ((st = ext2_dx_write_block(dir, new_block, node, fs)) < 0)
+        goto out;
+
+    st = ext2_dx_write_block(dir, root.block, root.buf, fs);
+
+out:
+    free(node);
+    return st;
+}
+
+struct ext2_dx_map_entry
+{
+    uint32_t hash;
+    uint16_t off;
+    uint16_t size;
+};
+
+static int ext2_dx_map_compare(const void *lhs, const void *rhs)
+{
+    auto a = (const ext2_dx_map_entry *) lhs;
+    auto b = (const ext2_dx_map_entry *) rhs;
+
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    return a->off < b->off ? -1 : a->off != b->off;
+}
+
+/**
+ * @brief Lay out a set of entries in a block
+ *
+ * @param dst Destination block
+ * @param src Block the entries are in
+ * @param map Entries
+ * @param nr Number of entries
+ * @param fs Filesystem
+ */
+static void ext2_dx_pack_block(uint8_t *dst, const uint8_t *src, const ext2_dx_map_entry *map,
+                               unsigned int nr, ext2_superblock *fs)
+{
+    ext2_dir_entry_t *last = nullptr;
+    size_t off = 0;
+
+    memset(dst, 0, fs->block_size);
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        last = (ext2_dir_entry_t *) (dst + off);
+        memcpy(last, src + map[i].off, map[i].size);
+        last->rec_len = map[i].size;
+        off += map[i].size;
+    }
+
+    if (last)
+        last->rec_len += fs->block_size - off;
+    else
+        ((ext2_dir_entry_t *) dst)->rec_len = fs->block_size;
+}
+
+/**
+ * @brief Get the index hash of a leaf split that puts map[split] first in the new leaf
+ *
+ * @param map Sorted entries
+ * @param split Index of the first entry of the new leaf (> 0)
+ * @return Split hash
+ */
+static uint32_t ext2_dx_split_hash(const ext2_dx_map_entry *map, unsigned int split)
+{
+    /* If a hash straddles both leaves, flag the new one as a continuation */
+    uint32_t hash = map[split].hash;
+    return hash == map[split - 1].hash ? hash | 1 : hash;
+}
+
+/**
+ * @brief Split a full leaf in two, by hash, and add the new leaf to the index.
+ *
+ * @param dir Directory
+ * @param path Path to the leaf (the bottom node must have space)
+ * @param leaf Leaf block
+ * @param buf Leaf contents, replaced by the leaf the path's hash now belongs to
+ * @param needed Size of the entry we're making space for
+ * @param fs Filesystem
+ * @return The block of the leaf the path's hash belongs to, or negative error codes
+ */
+static long ext2_dx_split_leaf(inode *dir, ext2_dx_path *path, ext2_block_no leaf, uint8_t *buf,
+                               size_t needed, ext2_superblock *fs)
+{
+    size_t total = 0;
+
+    unsigned int max_entries = fs->block_size / EXT2_MIN_DIR_ENTRY_LEN;
+    ext2_block_no new_block = ext2_dir_nr_blocks(dir, fs);
+    unsigned int nr = 0;
+    long st;
+
+    auto map = (ext2_dx_map_entry *) malloc(max_entries * sizeof(ext2_dx_map_entry));
+    uint8_t *blocks = (uint8_t *) malloc(fs->block_size * 2);
+    if (!map || !blocks)
+    {
+        st = -ENOMEM;
+        goto out;
+    }
+
+    for (size_t off = 0; off < fs->block_size;)
+    {
+        auto e = (ext2_dir_entry_t *) (buf + off);
+
+        if (!fs->valid_dirent(e, off))
+        {
+            fs->error("Invalid directory entry");
+            st = -EIO;
+            goto out;
+        }
+
+        if (e->inode)
+        {
+            map[nr].hash = ext2_dx_hash(e->name, e->name_len, path->version, fs->sb->s_hash_seed);
+            map[nr].off = off;
+            map[nr].size = ext2_calculate_dirent_size(e->name_len);
+            total += map[nr].size;
+            nr++;
+        }
+
+        off += e->rec_len;
+    }
+
+    if (nr < 2)
+    {
+        /* A full leaf with less than two entries? */
+        fs->error("Directory leaf is full but has less than two entries");
+        st = -EIO;
+        goto out;
+    }
+
+    qsort(map, nr, sizeof(*map), ext2_dx_map_compare);
+
+    {
+        /* Keep the lower hashes where they are. Pick the split that leaves the fullest leaf the
+         * emptiest, counting the new entry in the leaf it's going to end up in. Just splitting in
+         * half by size isn't enough: with small blocks, the new entry's half may not have room
+         * for a long name.
+         */
+        unsigned int split = 0;
+        size_t best = fs->block_size + 1;
+        size_t lower = 0;
+
+        for (unsigned int i = 1; i < nr; i++)
+        {
+            lower += map[i - 1].size;
+            size_t upper = total - lower;
+            size_t worst;
+
+            if (path->hash >= ext2_dx_split_hash(map, i))
+                worst = cul::max(lower, upper + needed);
+            else
+                worst = cul::max(lower + needed, upper);
+
+            if (worst < best)
+            {
+                best = worst;
+                split = i;
+            }
+        }
+
+        if (split == 0)
+        {
+            fs->error("Directory leaf can't be split to fit a new entry");
+            st = -EIO;
+            goto out;
+        }
+
+        uint32_t split_hash = ext2_dx_split_hash(map, split);
+
+        ext2_dx_pack_block(blocks, buf, map, split, fs);
+        ext2_dx_pack_block(blocks + fs->block_size, buf, map + split, nr - split, fs);
+
+        /* Write the new leaf before the index points at it */
+        if ((st = ext2_dx_write_block(dir, new_block, blocks + fs->block_size, fs)) < 0)
+            goto out;
+
+        if ((st = ext2_dx_write_block(dir, leaf, blocks, fs)) < 0)
+            goto out;
+
+        auto &frame = path->frames[path->nr_frames - 1];
+        ext2_dx_insert_entry(&frame, split_hash, new_block);
+
+        if ((st = ext2_dx_write_block(dir, frame.block, frame.buf, fs)) < 0)
+            goto out;
+
+        if (path->hash >= split_hash)
+        {
+            memcpy(buf, blocks + fs->block_size, fs->block_size);
+            st = new_block;
+        }
+        else
+        {
+            memcpy(buf, blocks, fs->block_size);
+            st = leaf;
+        }
+    }
+
+out:
+    free(map);
+    free(blocks);
+    return st;
+}
+
+int ext2_dx_add_entry(const ext2_dir_entry_t *entry, inode *dir, ext2_superblock *fs)
+{
+    uint8_t *buf = (uint8_t *) malloc(fs->block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    int st;
+
+    while (true)
+    {
+        ext2_dx_path path;
+
+        long leaf = ext2_dx_probe(dir, entry->name, entry->name_len, &path, fs);
+        if (leaf < 0)
+        {
+            st = leaf;
+            break;
+        }
+
+        if (st = ext2_dx_read_block(dir, leaf, buf, fs); st < 0)
+            break;
+
+        if (st = ext2_insert_in_dir_block(buf, entry, fs); st != 0)
+        {
+            if (st > 0)
+                st = ext2_dx_write_block(dir, leaf, buf, fs);
+            break;
+        }
+
+        /* The leaf is full, so we need to split it, which needs space in the index */
+        auto &frame = path.frames[path.nr_frames - 1];
+        auto cl = ext2_dx_cl(frame.entries);
+
+        if (cl->count == cl->limit)
+        {
+            if (st = ext2_dx_grow_index(dir, &path, fs); st < 0)
+                break;
+
+            /* The tree changed shape, so walk it again */
+            continue;
+        }
+
+        long target = ext2_dx_split_leaf(dir, &path, leaf, buf,
+                                         ext2_calculate_dirent_size(entry->name_len), fs);
+        if (target < 0)
+        {
+            st = target;
+            break;
+        }
+
+        st = ext2_insert_in_dir_block(buf, entry, fs);
+        if (st == 0)
+        {
+            /* Can't happen, the split leaves space for the entry in its leaf */
+            fs->error("No space for a directory entry after splitting its leaf");
+            st = -EIO;
+        }
+
+        if (st > 0)
+            st = ext2_dx_write_block(dir, target, buf, fs);
+        break;
+    }
+
+    free(buf);
+    return st;
+}
+
+int ext2_dx_make_indexed(inode *dir, ext2_superblock *fs)
+{
+    auto raw_inode = ext2_get_inode_from_node(dir);
+    uint8_t *root = (uint8_t *) malloc(fs->block_size);
+    uint8_t *leaf = (uint8_t *) zalloc(fs->block_size);
+    int st = 0;
+
+    if (!root || !leaf)
+    {
+        st = -ENOMEM;
+        goto out;
+    }
+
+    if (st = ext2_dx_read_block(dir, 0, root, fs); st < 0)
+        goto out;
+
+    {
+        auto dot = (ext2_dir_entry_t *) root;
+
+        if (!fs->valid_dirent(dot, 0) || dot->name_len != 1 || dot->name[0] != '.' ||
+            !fs->valid_dirent((ext2_dir_entry_t *) (root + dot->rec_len), dot->rec_len))
+        {
+            fs->error("Directory doesn't start with . and ..");
+            st = -EIO;
+            goto out;
+        }
+
+        auto dotdot = (ext2_dir_entry_t *) (root + dot->rec_len);
+
+        if (dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2))
+        {
+            fs->error("Directory doesn't start with . and ..");
+            st = -EIO;
+            goto out;
+        }
+
+        /* Move everything else to a new leaf */
+        ext2_dir_entry_t *last = nullptr;
+        size_t leaf_off = 0;
+
+        for (size_t off = dot->rec_len + dotdot->rec_len; off < fs->block_size;)
+        {
+            auto e = (ext2_dir_entry_t *) (root + off);
+
+            if (!fs->valid_dirent(e, off))
+            {
+                fs->error("Invalid directory entry");
+                st = -EIO;
+                goto out;
+            }
+
+            if (e->inode)
+            {
+                size_t size = ext2_calculate_dirent_size(e->name_len);
+                last = (ext2_dir_entry_t *) (leaf + leaf_off);
+                memcpy(last, e, size);
+                last->rec_len = size;
+                leaf_off += size;
+            }
+
+            off += e->rec_len;
+        }
+
+        if (last)
+            last->rec_len += fs->block_size - leaf_off;
+        else
+            ((ext2_dir_entry_t *) leaf)->rec_len = fs->block_size;
+
+        /* Now build the root. The index hides behind .. */
+        uint32_t parent = dotdot->inode;
+        uint8_t parent_type = dotdot->file_type;
+
+        dot->rec_len = 12;
+        dotdot = (ext2_dir_entry_t *) (root + 12);
+        dotdot->inode = parent;
+        dotdot->rec_len = fs->block_size - 12;
+        dotdot->name_len = 2;
+        dotdot->file_type = parent_type;
+        memcpy(dotdot->name, "..\0\0", 4);
+
+        auto info = ext2_dx_info(root);
+        memset(info, 0, fs->block_size - EXT2_DX_ROOT_DOTS_SIZE);
+        info->hash_version = fs->sb->s_def_hash_version <= EXT2_HASH_TEA
+                                 ? fs->sb->s_def_hash_version
+                                 : EXT2_HASH_HALF_MD4;
+        info->info_length = sizeof(ext2_dx_root_info);
+
+        auto entries = (ext2_dx_entry *) (info + 1);
+        ext2_dx_cl(entries)->limit = ext2_dx_root_limit(fs);
+        ext2_dx_cl(entries)->count = 1;
+        entries[0].block = 1;
+
+        if (st = ext2_dx_write_block(dir, 1, leaf, fs); st < 0)
+            goto out;
+
+        if (st = ext2_dx_write_block(dir, 0, root, fs); st < 0)
+            goto out;
+
+        raw_inode->i_flags |= EXT2_INDEX_FL;
+        inode_mark_dirty(dir);
+    }
+
+out:
+    free(root);
+    free(leaf);
+    return st;
+}
@@ -20,11 +20,14 @@
 #include <onyx/cred.h>
 #include <onyx/dentry.h>
 #include <onyx/dev.h>
+#include <onyx/direct_io.h>
+#include <onyx/file.h>
 #include <onyx/fs_mount.h>
 #include <onyx/limits.h>
 #include <onyx/log.h>
 #include <onyx/pagecache.h>
 #include <onyx/panic.h>
+#include <onyx/rwlock.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
 
@@ -41,7 +44,14 @@ int ext2_fallocate(int mode, off_t off, off_t len, struct file *f);
 int ext2_ftruncate(size_t len, struct file *f);
 ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino);
 ssize_t ext2_writepage(struct page *page, size_t off, struct inode *ino);
+int ext2_prepare_writepage(struct page *page, size_t off, struct inode *ino,
+                           struct flush_wb_req *req);
+ssize_t ext2_readpages(struct page *pages, unsigned long nr_pages, size_t off, struct inode *ino);
 int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len);
+void ext2_abort_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len);
+ssize_t ext2_direct_io(size_t off, size_t len, void *buffer, struct file *f, bool write);
+int ext2_on_open(struct file *f);
+void ext2_release(struct file *f);
 int ext2_link(struct inode *target, const char *name, struct inode *dir);
 inode *ext2_symlink(const char *name, const char *dest, dentry *dir);
 
@@ -54,12 +64,18 @@ struct file_ops ext2_ops = {.open = ext2_open,
                             .ftruncate = ext2_ftruncate,
                             .mkdir = ext2_mkdir,
                             .mknod = ext2_mknod,
+                            .on_open = ext2_on_open,
                             .readlink = ext2_readlink,
                             .unlink = ext2_unlink,
                             .fallocate = ext2_fallocate,
                             .readpage = ext2_readpage,
                             .writepage = ext2_writepage,
-                            .prepare_write = ext2_prepare_write};
+                            .prepare_write = ext2_prepare_write,
+                            .abort_write = ext2_abort_write,
+                            .readpages = ext2_readpages,
+                            .prepare_writepage = ext2_prepare_writepage,
+                            .direct_io = ext2_direct_io,
+                            .release = ext2_release};
 
 void ext2_delete_inode(struct inode *inode_, uint32_t inum, struct ext2_superblock *fs)
 {
@@ -83,6 +99,15 @@ void ext2_close(struct inode *vfs_ino)
 {
     struct ext2_inode *inode = ext2_get_inode_from_node(vfs_ino);
 
+    ext2_discard_prealloc(vfs_ino);
+
+    /* The inode got synced before being evicted, so whatever is still reserved belongs to pages
+     * that never got dirtied, and that are going away with it.
+     */
+    auto info = ext2_inode_info_from_node(vfs_ino);
+    if (info->delalloc_blocks)
+        ext2_superblock_from_inode(vfs_ino)->unreserve_blocks(info->delalloc_blocks);
+
     /* TODO: It would be better, cache-wise and memory allocator-wise if we
      * had ext2_inode incorporate a struct inode inside it, and have everything in the same
      * location.
@@ -90,6 +115,41 @@ void ext2_close(struct inode *vfs_ino)
      * the regular struct inode).
      */
     free(inode);
+    delete info;
+}
+
+int ext2_on_open(struct file *f)
+{
+    if (S_ISREG(f->f_ino->i_mode) && fd_may_access(f, FILE_ACCESS_WRITE))
+    {
+        auto info = ext2_inode_info_from_node(f->f_ino);
+        scoped_mutex g{info->alloc_lock};
+        info->writers++;
+    }
+
+    return 0;
+}
+
+void ext2_release(struct file *f)
+{
+    if (!S_ISREG(f->f_ino->i_mode) || !fd_may_access(f, FILE_ACCESS_WRITE))
+        return;
+
+    auto info = ext2_inode_info_from_node(f->f_ino);
+
+    {
+        scoped_mutex g{info->alloc_lock};
+
+        /* Files that didn't go through on_open can make this unbalanced, so don't underflow */
+        if (info->writers)
+            info->writers--;
+
+        if (info->writers)
+            return;
+    }
+
+    /* The last writer is gone, so give back the blocks we preallocated for it */
+    ext2_discard_prealloc(f->f_ino);
 }
 
 ssize_t ext2_writepage(page *page, size_t off, inode *ino)
@@ -99,8 +159,21 @@ ssize_t ext2_writepage(page *page, size_t off, inode *ino)
 
     assert(buf != nullptr);
 
+    if (int st = ext2_map_delalloc(ino, page, off); st < 0)
+    {
+        sb->error("Error allocating blocks for writeback");
+        return st;
+    }
+
     while (buf)
     {
+        /* Holes that weren't written to stay holes */
+        if (buf->block_nr == EXT2_FILE_HOLE_BLOCK)
+        {
+            buf = buf->next;
+            continue;
+        }
+
         page_iov v[1];
         v->length = buf->block_size;
         v->page = buf->this_page;
@@ -122,55 +195,299 @@ ssize_t ext2_writepage(page *page, size_t off, inode *ino)
     return PAGE_SIZE;
 }
 
-ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino)
+int ext2_prepare_writepage(page *page, size_t off, inode *ino, flush_wb_req *req)
 {
-    bool is_buffer = page->flags & PAGE_FLAG_BUFFER;
+    auto buf = block_buf_from_page(page);
+    auto sb = ext2_superblock_from_inode(ino);
+
+    assert(buf != nullptr);
+
+    /* Pick blocks for the page (and the dirty ones after it) first. If that fails, writepage
+     * will tell us why.
+     */
+    if (int st = ext2_map_delalloc(ino, page, off); st < 0)
+        return st;
 
-    assert(is_buffer == true);
+    /* We can only describe the page as one write if its blocks are contiguous on disk, and there
+     * are no holes.
+     */
+    sector_t first = buf->block_nr;
+    unsigned int len = 0;
 
+    for (auto b = buf; b; b = b->next)
+    {
+        if (b->block_nr == EXT2_FILE_HOLE_BLOCK || b->page_off != len ||
+            b->block_nr != first + len / sb->block_size)
+            return -EINVAL;
+        len += b->block_size;
+    }
+
+    req->vec.page = page;
+    req->vec.page_off = 0;
+    req->vec.length = len;
+
+    req->req = {};
+    req->req.nr_vecs = 1;
+    req->req.vec = &req->vec;
+    req->req.sector_number = first * (sb->block_size / sb->s_bdev->sector_size);
+    req->req.flags = BIO_REQ_WRITE_OP;
+    req->dev = sb->s_bdev;
+
+    return 0;
+}
+
+/**
+ * @brief Map a file range to a run of physically contiguous blocks, for direct I/O.
+ * Writes fill in holes as they go.
+ */
+static int ext2_dio_extent(struct inode *ino, size_t offset, size_t len, unsigned int op,
+                           struct dio_extent *ext)
+{
     auto raw_inode = ext2_get_inode_from_node(ino);
     auto sb = ext2_superblock_from_inode(ino);
-    auto nr_blocks = PAGE_SIZE / sb->block_size;
-    auto base_block_index = off / sb->block_size;
+    auto sectors_per_block = sb->block_size / sb->s_bdev->sector_size;
+    ext2_block_no base = offset >> sb->block_size_shift;
+    size_t nr_blocks = (len + sb->block_size - 1) >> sb->block_size_shift;
+    ext2_block_no first = EXT2_FILE_HOLE_BLOCK;
+    size_t i;
 
-    auto curr_off = 0;
+    scoped_mutex g{ext2_inode_info_from_node(ino)->alloc_lock};
 
-    for (size_t i = 0; i < nr_blocks; i++)
+    for (i = 0; i < nr_blocks; i++)
     {
-        struct block_buf *b = nullptr;
-        if (is_buffer && !(b = page_add_blockbuf(page, curr_off)))
-        {
-            page_destroy_block_bufs(page);
-            return -ENOMEM;
-        }
-
-        auto res = ext2_get_block_from_inode(raw_inode, base_block_index + i, sb);
+        auto res = op == BIO_REQ_WRITE_OP ? ext2_create_path(ino, base + i, sb)
+                                          : ext2_get_block_from_inode(raw_inode, base + i, sb);
         if (res.has_error())
         {
-            page_destroy_block_bufs(page);
-            return -ENOMEM;
+            /* Do what we've got, the next call will return the error */
+            if (i)
+                break;
+            return res.error();
         }
 
-        /* TODO: Coalesce reads */
-        page_iov v[1];
-        v->page = page;
-        v->length = sb->block_size;
-        v->page_off = curr_off;
+        ext2_block_no block = res.value();
 
-        if (sb_read_bio(sb, v, 1, res.value()) < 0)
-        {
-            page_destroy_block_bufs(page);
-            return -EIO;
-        }
+        if (i == 0)
+            first = block;
+        else if (first == EXT2_FILE_HOLE_BLOCK ? block != EXT2_FILE_HOLE_BLOCK
+                                               : block != first + i)
+            break;
+    }
+
+    ext->sector = first == EXT2_FILE_HOLE_BLOCK ? DIO_EXTENT_HOLE
+                                                : (sector_t) first * sectors_per_block;
+    ext->length = i << sb->block_size_shift;
+    return 0;
+}
+
+ssize_t ext2_direct_io(size_t off, size_t len, void *buffer, struct file *f, bool write)
+{
+    struct inode *ino = f->f_ino;
+    auto sb = ext2_superblock_from_inode(ino);
+    ssize_t st;
+
+    /* We don't do partial blocks, as we'd need to zero (or read-modify-write) the rest of them */
+    if ((off | len | (unsigned long) buffer) & (sb->block_size - 1))
+        return errno = EINVAL, -1;
+
+    if (write)
+    {
+        scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
+
+        st = dio_rw(ino, sb->s_bdev, ino->i_pages, off, len, buffer, BIO_REQ_WRITE_OP,
+                    ext2_dio_extent);
+
+        if (st > 0 && off + st > ino->i_size)
+            inode_set_size(ino, off + st);
+    }
+    else
+    {
+        scoped_rwlock<rw_lock::read> g{ino->i_rwlock};
+
+        if (off >= ino->i_size)
+            return 0;
+
+        /* Read the whole last block, but only report what's inside the file */
+        size_t to_read = cul::min(len, ino->i_size - off);
+
+        st = dio_rw(ino, sb->s_bdev, ino->i_pages, off,
+                    cul::align_up2(to_read, (size_t) sb->block_size), buffer, BIO_REQ_READ_OP,
+                    ext2_dio_extent);
+
+        if (st > 0)
+            st = cul::min((size_t) st, to_read);
+    }
+
+    if (st < 0)
+        return errno = -st, -1;
+
+    return st;
+}
+
+/* Max number of vecs in a single read bio */
+#define EXT2_READ_BIO_VECS 32
+
+struct ext2_read_bio
+{
+    struct bio_req req;
+    struct ext2_read_bio *next;
+    struct page_iov vec[EXT2_READ_BIO_VECS];
+};
+
+/**
+ * @brief Read a run of pages from a file, coalescing physically contiguous blocks into a
+ * single request. Requests get submitted asynchronously and waited on as a batch.
+ *
+ * @param pages Pages, linked through next_allocation
+ * @param nr_pages Number of pages
+ * @param off Offset of the first page in the file
+ * @param ino Inode
+ * @return Number of pages read (starting from the first one), or negative error codes
+ */
+ssize_t ext2_readpages(struct page *pages, unsigned long nr_pages, size_t off, struct inode *ino)
+{
+    auto raw_inode = ext2_get_inode_from_node(ino);
+    auto sb = ext2_superblock_from_inode(ino);
+    auto blocks_per_page = PAGE_SIZE / sb->block_size;
+    auto sectors_per_block = sb->block_size / sb->s_bdev->sector_size;
+
+    struct bio_batch batch;
+    struct blk_plug plug;
+    struct ext2_read_bio *bios = nullptr;
+    struct ext2_read_bio *curr = nullptr;
+    ext2_block_no next_block = 0;
+    unsigned long nr_done = 0;
+    int st = 0;
+
+    bio_batch_init(&batch);
+    blk_start_plug(&plug);
+
+    struct page *page = pages;
+    for (unsigned long i = 0; i < nr_pages; i++, page = page->next_un.next_allocation)
+    {
+        bool is_buffer = page->flags & PAGE_FLAG_BUFFER;
+        auto base_block_index = (off + (i << PAGE_SHIFT)) / sb->block_size;
 
-        if (is_buffer)
+        for (size_t j = 0; j < blocks_per_page; j++)
         {
-            b->block_nr = res.value();
-            b->block_size = sb->block_size;
-            b->dev = sb->s_bdev;
+            unsigned int page_off = j * sb->block_size;
+            struct block_buf *b = nullptr;
+
+            if (is_buffer && !(b = page_add_blockbuf(page, page_off)))
+            {
+                st = -ENOMEM;
+                goto out;
+            }
+
+            auto res = ext2_get_block_from_inode(raw_inode, base_block_index + j, sb);
+            if (res.has_error())
+            {
+                st = res.error();
+                goto out;
+            }
+
+            ext2_block_no block = res.value();
+
+            if (is_buffer)
+            {
+                b->block_nr = block;
+                b->block_size = sb->block_size;
+                b->dev = sb->s_bdev;
+            }
+
+            if (block == EXT2_FILE_HOLE_BLOCK)
+            {
+                memset((unsigned char *) PAGE_TO_VIRT(page) + page_off, 0, sb->block_size);
+                continue;
+            }
+
+            if (curr && block == next_block)
+            {
+                auto &last = curr->vec[curr->req.nr_vecs - 1];
+
+                if (last.page == page && last.page_off + last.length == page_off)
+                {
+                    last.length += sb->block_size;
+                    next_block++;
+                    continue;
+                }
+
+                if (curr->req.nr_vecs < EXT2_READ_BIO_VECS)
+                {
+                    curr->vec[curr->req.nr_vecs++] = {page, (unsigned int) sb->block_size,
+                                                      page_off};
+                    next_block++;
+                    continue;
+                }
+            }
+
+            /* Not contiguous with the current request (or it's full), start a new one */
+            if (curr)
+            {
+                st = bio_batch_submit(&batch, sb->s_bdev, &curr->req);
+                curr = nullptr;
+                if (st < 0)
+                    goto out;
+            }
+
+            curr = (ext2_read_bio *) zalloc(sizeof(ext2_read_bio));
+            if (!curr)
+            {
+                st = -ENOMEM;
+                goto out;
+            }
+
+            curr->next = bios;
+            bios = curr;
+            curr->req.flags = BIO_REQ_READ_OP;
+            curr->req.sector_number = block * sectors_per_block;
+            curr->req.vec = curr->vec;
+            curr->req.nr_vecs = 1;
+            curr->vec[0] = {page, (unsigned int) sb->block_size, page_off};
+            next_block = block + 1;
         }
 
-        curr_off += sb->block_size;
+        nr_done++;
+    }
+
+out:
+    if (curr)
+    {
+        if (int st2 = bio_batch_submit(&batch, sb->s_bdev, &curr->req); st2 < 0)
+            st = st2;
+    }
+
+    blk_finish_plug(&plug);
+
+    if (int st2 = bio_batch_wait(&batch); st2 < 0)
+        st = st2;
+
+    while (bios)
+    {
+        auto next = bios->next;
+        free(bios);
+        bios = next;
+    }
+
+    if (st < 0 && !nr_done)
+        return st;
+
+    /* On I/O errors we don't know which pages made it, so fail them all */
+    if (st == -EIO)
+        return -EIO;
+
+    return nr_done;
+}
+
+ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino)
+{
+    page->next_un.next_allocation = nullptr;
+
+    ssize_t st = ext2_readpages(page, 1, off, ino);
+    if (st <= 0)
+    {
+        page_destroy_block_bufs(page);
+        return st < 0 ? st : -EIO;
     }
 
     return min(PAGE_SIZE, ino->i_size - off);
@@ -183,6 +500,11 @@ struct ext2_inode_info *ext2_cache_inode_info(struct inode *ino, struct ext2_ino
         return nullptr;
 
     inf->inode = fs_ino;
+    mutex_init(&inf->alloc_lock);
+    inf->prealloc_start = EXT2_ERR_INV_BLOCK;
+    inf->prealloc_len = 0;
+    inf->writers = 0;
+    inf->delalloc_blocks = 0;
 
     return inf;
 }
@@ -625,20 +947,32 @@ off_t ext2_getdirent(struct dirent *buf, off_t off, struct file *f)
 
     unsigned long old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
 
-    /* Read a dir entry from the offset */
-    read = file_read_cache(&entry, sizeof(ext2_dir_entry_t), f->f_ino, off);
-    if (read < 0)
-        return read;
+    /* Skip unused entries. These include the ones that hide htree index blocks. */
+    while (true)
+    {
+        /* Read a dir entry from the offset */
+        read = file_read_cache(&entry, sizeof(ext2_dir_entry_t), f->f_ino, off);
+        if (read <= 0)
+        {
+            thread_change_addr_limit(old);
+            /* If we reached the end of the directory buffer, return 0 */
+            return read;
+        }
+
+        if (entry.inode)
+            break;
 
-    thread_change_addr_limit(old);
+        /* A zero rec_len would have us loop forever */
+        if (entry.rec_len == 0)
+        {
+            thread_change_addr_limit(old);
+            return 0;
+        }
 
-    /* If we reached the end of the directory buffer, return 0 */
-    if (read == 0)
-        return 0;
+        off += entry.rec_len;
+    }
 
-    /* If we reached the end of the directory list, return 0 */
-    if (!entry.inode)
-        return 0;
+    thread_change_addr_limit(old);
 
     memcpy(buf->d_name, entry.name, entry.name_len);
     buf->d_name[entry.name_len] = '\0';
@@ -715,8 +1049,13 @@ int ext2_superblock::stat_fs(struct statfs *buf)
     buf->f_type = EXT2_SIGNATURE;
     buf->f_bsize = block_size;
     buf->f_blocks = sb->s_blocks_count;
-    buf->f_bfree = sb->s_free_blocks_count;
-    buf->f_bavail = sb->s_free_blocks_count - sb->s_r_blocks_count;
+    /* Blocks reserved by delayed allocation are as good as used */
+    unsigned long reserved = __atomic_load_n(&delalloc_reserved, __ATOMIC_RELAXED);
+    unsigned long free_blocks = sb->s_free_blocks_count;
+    free_blocks = free_blocks > reserved ? free_blocks - reserved : 0;
+
+    buf->f_bfree = free_blocks;
+    buf->f_bavail = free_blocks > sb->s_r_blocks_count ? free_blocks - sb->s_r_blocks_count : 0;
     buf->f_files = sb->s_inodes_count;
     buf->f_ffree = sb->s_free_inodes_count;
 
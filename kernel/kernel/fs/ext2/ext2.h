@@ -23,6 +23,7 @@
 
 #include <onyx/expected.hpp>
 #include <onyx/pair.hpp>
+#include <onyx/utility.hpp>
 
 #define EXT2_SUPERBLOCK_OFFSET 1024
 
@@ -83,7 +84,8 @@
 #define EXT2_NOCOMPR_FL      0x400
 #define EXT2_ECOMPR_FL       0x800
 #define EXT2_BTREE_FL        0x1000
-#define EXT2_INDEX_FL        0x2000
+#define EXT2_INDEX_FL        0x1000
+#define EXT2_IMAGIC_FL       0x2000
 #define EXT3_JOURNAL_DATA_FL 0x4000
 #define EXT2_RESERVED_FL     0x80000000
 
@@ -146,10 +148,24 @@ typedef struct
     uint32_t s_last_orphan;
     uint32_t s_hash_seed[4];
     uint8_t s_def_hash_version;
+    uint8_t s_jnl_backup_type;
+    uint16_t s_desc_size;
     uint32_t s_default_mount_options;
     uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
 } __attribute__((aligned(1024), packed)) superblock_t;
 
+/* s_flags */
+#define EXT2_FLAGS_SIGNED_HASH   0x1
+#define EXT2_FLAGS_UNSIGNED_HASH 0x2
+
 typedef struct
 {
     uint32_t block_usage_addr;
@@ -229,6 +245,47 @@ typedef struct
 
 #define EXT2_MIN_DIR_ENTRY_LEN 8
 
+/* Hashed directory (htree) structures. Block 0 of an indexed directory has the dx root, hidden
+ * behind the rec_len of "..", and interior nodes are hidden behind an empty dirent that spans
+ * the whole block. Leaves are regular directory blocks.
+ */
+#define EXT2_HASH_LEGACY            0
+#define EXT2_HASH_HALF_MD4          1
+#define EXT2_HASH_TEA               2
+#define EXT2_HASH_LEGACY_UNSIGNED   3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED      5
+
+/* Max value of indirect_levels */
+#define EXT2_HTREE_MAX_LEVELS 1
+
+struct ext2_dx_root_info
+{
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+};
+
+struct ext2_dx_entry
+{
+    uint32_t hash;
+    uint32_t block;
+};
+
+/* Overlays the hash of the first ext2_dx_entry of a node, whose hash is implicitly 0 */
+struct ext2_dx_countlimit
+{
+    uint16_t limit;
+    uint16_t count;
+};
+
+/* Size of the "." and ".." entries in front of the dx root */
+#define EXT2_DX_ROOT_DOTS_SIZE 24
+/* Size of the fake dirent in front of dx nodes */
+#define EXT2_DX_NODE_HEADER_SIZE 8
+
 struct ext2_superblock;
 
 using ext2_block_group_no = uint32_t;
@@ -352,22 +409,22 @@ public:
         dirty();
     }
 
-    void dec_unallocated_blocks()
+    void dec_unallocated_blocks(unsigned int nr = 1)
     {
         lock();
 
-        bgd->unallocated_blocks_in_group--;
+        bgd->unallocated_blocks_in_group -= nr;
 
         unlock();
 
         dirty();
     }
 
-    void inc_unallocated_blocks()
+    void inc_unallocated_blocks(unsigned int nr = 1)
     {
         lock();
 
-        bgd->unallocated_blocks_in_group++;
+        bgd->unallocated_blocks_in_group += nr;
 
         unlock();
 
@@ -381,8 +438,29 @@ public:
 
     expected<ext2_inode_no, int> allocate_inode(ext2_superblock *sb);
     void free_inode(ext2_inode_no inode, ext2_superblock *sb);
-    expected<ext2_block_no, int> allocate_block(ext2_superblock *sb);
-    void free_block(ext2_block_no block, ext2_superblock *sb);
+
+    /**
+     * @brief Allocate a run of contiguous blocks, in a single pass over the bitmap.
+     * If the goal is free, the run starts there. Else, we take the first run (from the goal
+     * onwards) that's max blocks long, or the longest one if there's none.
+     *
+     * @param sb Superblock
+     * @param goal Bit of the block we'd like to start at
+     * @param max Max length of the run
+     * @param count Pointer to where the length of the run gets stored
+     * @return First block of the run, or an unexpected negative error code
+     */
+    expected<ext2_block_no, int> allocate_blocks(ext2_superblock *sb, uint32_t goal,
+                                                 unsigned int max, unsigned int *count);
+
+    /**
+     * @brief Free a run of blocks
+     *
+     * @param block First block of the run
+     * @param count Length of the run, which can't cross into another block group
+     * @param sb Superblock
+     */
+    void free_blocks(ext2_block_no block, unsigned int count, ext2_superblock *sb);
 
     auto_block_buf get_inode_table(const ext2_superblock *sb, uint32_t off) const;
 };
@@ -409,7 +487,12 @@ struct ext2_superblock : public superblock
     unsigned int entry_shift;
     cul::vector<ext2_block_group> block_groups;
 
-    ext2_block_no try_allocate_block_from_bg(ext2_block_group_no nr);
+    /* Blocks reserved by delayed allocation, that we'll need to allocate at writeback */
+    unsigned long delalloc_reserved{0};
+
+    ext2_block_no try_allocate_blocks_from_bg(ext2_block_group_no nr, uint32_t goal,
+                                              unsigned int max, unsigned int *count);
+    bool may_use_reserved_blocks() const;
 
 public:
     ext2_superblock()
@@ -447,6 +530,18 @@ public:
      */
     ext2_block_no allocate_block(ext2_block_group_no preferred = -1);
 
+    /**
+     * @brief Allocates a run of contiguous blocks, as close to the goal as possible
+     *
+     * @param goal Block we'd like to get, or EXT2_ERR_INV_BLOCK if we don't care
+     * @param max Max number of blocks
+     * @param count Pointer to where the number of blocks we got gets stored
+     * @param flags EXT2_ALLOC_* flags
+     * @return First block of the run, or EXT2_ERR_INV_BLOCK if we couldn't allocate any.
+     */
+    ext2_block_no allocate_blocks(ext2_block_no goal, unsigned int max, unsigned int *count,
+                                  unsigned int flags = 0);
+
     /**
      * @brief Frees a block
      *
@@ -454,6 +549,44 @@ public:
      */
     void free_block(ext2_block_no block);
 
+    /**
+     * @brief Frees a run of blocks
+     *
+     * @param block First block of the run
+     * @param count Number of blocks
+     */
+    void free_blocks(ext2_block_no block, unsigned int count);
+
+    /**
+     * @brief Reserve space for delayed allocation, so writeback can't run out of it
+     *
+     * @param nr Number of blocks
+     * @return True if we reserved them, false if there's not enough space
+     */
+    bool reserve_blocks(unsigned long nr);
+
+    /**
+     * @brief Give back reserved blocks (because they got allocated or aren't needed anymore)
+     *
+     * @param nr Number of blocks
+     */
+    void unreserve_blocks(unsigned long nr)
+    {
+        __atomic_sub_fetch(&delalloc_reserved, nr, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief Get the number of blocks in a block group
+     *
+     * @param nr Block group number
+     * @return Number of blocks (the last group may be shorter than the rest)
+     */
+    uint32_t blocks_in_group(ext2_block_group_no nr) const
+    {
+        uint32_t left = total_blocks - first_data_block() - nr * blocks_per_block_group;
+        return cul::min(left, blocks_per_block_group);
+    }
+
     /**
      * @brief Read an ext2_inode from disk
      *
@@ -512,14 +645,37 @@ struct ext2_inode_info
 {
     /* Cached copy of the on-disk inode */
     struct ext2_inode *inode;
+    /* Protects the block map, the preallocation window and delayed allocation state */
+    struct mutex alloc_lock;
+    /* Preallocation window: blocks we took from the bitmaps for this inode, but haven't used
+     * yet. The next allocation that follows the inode's last one takes them.
+     */
+    ext2_block_no prealloc_start;
+    unsigned int prealloc_len;
+    /* Number of open files that may write to us */
+    unsigned int writers;
+    /* Number of blocks in the page cache that are waiting for delayed allocation */
+    unsigned long delalloc_blocks;
 };
 
-static inline struct ext2_inode *ext2_get_inode_from_node(struct inode *ino)
+static inline struct ext2_inode_info *ext2_inode_info_from_node(struct inode *ino)
 {
     assert(ino->i_helper != NULL);
-    return ((struct ext2_inode_info *) ino->i_helper)->inode;
+    return (struct ext2_inode_info *) ino->i_helper;
 }
 
+static inline struct ext2_inode *ext2_get_inode_from_node(struct inode *ino)
+{
+    return ext2_inode_info_from_node(ino)->inode;
+}
+
+/* allocate_blocks flags */
+/* The blocks were reserved by reserve_blocks() */
+#define EXT2_ALLOC_RESERVED (1 << 0)
+
+/* Number of extra blocks we preallocate for files that are being written to */
+#define EXT2_PREALLOC_BLOCKS 16
+
 #define EXT2_TYPE_DIRECT_BLOCK 0
 #define EXT2_TYPE_SINGLY_BLOCK 1
 #define EXT2_TYPE_DOUBLY_BLOCK 2
@@ -552,6 +708,55 @@ void ext2_free_inode_space(struct inode *inode, struct ext2_superblock *fs);
 expected<ext2_block_no, int> ext2_get_block_from_inode(ext2_inode *ino, ext2_block_no block,
                                                        ext2_superblock *sb);
 
+/**
+ * @brief Map a block of an inode, allocating it (and the indirect blocks on the way) if needed.
+ * The caller needs to hold the inode's alloc_lock.
+ *
+ * @param ino Inode
+ * @param block Block index in the file
+ * @param sb Superblock
+ * @param phys Block to map it to, or EXT2_FILE_HOLE_BLOCK to allocate one
+ * @param alloc_flags EXT2_ALLOC_* flags
+ * @return The block, or an unexpected negative error code
+ */
+expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no block,
+                                              ext2_superblock *sb,
+                                              ext2_block_no phys = EXT2_FILE_HOLE_BLOCK,
+                                              unsigned int alloc_flags = 0);
+
+/**
+ * @brief Allocate data blocks for an inode, using its preallocation window if we can.
+ * The caller needs to hold the inode's alloc_lock.
+ *
+ * @param ino Inode
+ * @param goal Block we'd like to get (usually the one after the previous block in the file), or
+ *             EXT2_FILE_HOLE_BLOCK if we don't know
+ * @param nr Number of blocks we want
+ * @param count Pointer to where the number of blocks we got gets stored
+ * @param flags EXT2_ALLOC_* flags
+ * @return First block of the run, or EXT2_ERR_INV_BLOCK if we couldn't allocate any.
+ */
+ext2_block_no ext2_alloc_data_blocks(inode *ino, ext2_block_no goal, unsigned int nr,
+                                     unsigned int *count, unsigned int flags);
+
+/**
+ * @brief Give back an inode's preallocation window
+ *
+ * @param ino Inode
+ */
+void ext2_discard_prealloc(inode *ino);
+
+/**
+ * @brief Allocate blocks for a page's delayed allocation blocks, along with the ones that
+ * follow them in the next pages of the file, so they end up contiguous on disk.
+ *
+ * @param ino Inode
+ * @param page Page
+ * @param off Offset of the page in the file
+ * @return 0 on success, negative error codes
+ */
+int ext2_map_delalloc(inode *ino, struct page *page, size_t off);
+
 struct ext2_dirent_result
 {
     off_t file_off;
@@ -562,6 +767,50 @@ struct ext2_dirent_result
 int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *sb,
                          ext2_dirent_result *res);
 
+size_t ext2_calculate_dirent_size(size_t len_name);
+int ext2_search_dir_block(char *buf, const char *name, size_t len, ext2_superblock *fs);
+int ext2_insert_in_dir_block(uint8_t *buf, const ext2_dir_entry_t *entry, ext2_superblock *fs);
+
+/**
+ * @brief Check if a directory is hash indexed
+ *
+ * @param dir Directory
+ * @param fs Filesystem
+ * @return True if we should use its index
+ */
+bool ext2_dir_is_indexed(inode *dir, ext2_superblock *fs);
+
+/**
+ * @brief Look up a name in an indexed directory
+ *
+ * @param dir Directory
+ * @param name Name
+ * @param fs Filesystem
+ * @param res Result, filled like ext2_retrieve_dirent
+ * @return 1 if found, -ENOENT if not, -EBADMSG if the index is corrupted (in which case we
+ *         should fall back to a linear scan), else negative error codes
+ */
+int ext2_dx_lookup(inode *dir, const char *name, ext2_superblock *fs, ext2_dirent_result *res);
+
+/**
+ * @brief Add an entry to an indexed directory
+ *
+ * @param entry Directory entry (rec_len is ignored)
+ * @param dir Directory
+ * @param fs Filesystem
+ * @return 0 on success, -EBADMSG if the index is corrupted, else negative error codes
+ */
+int ext2_dx_add_entry(const ext2_dir_entry_t *entry, inode *dir, ext2_superblock *fs);
+
+/**
+ * @brief Turn a single block, linear directory into an indexed one
+ *
+ * @param dir Directory
+ * @param fs Filesystem
+ * @return 0 on success, negative error codes
+ */
+int ext2_dx_make_indexed(inode *dir, ext2_superblock *fs);
+
 struct inode *ext2_load_inode_from_disk(uint32_t inum, ext2_superblock *fs);
 
 static inline ext2_superblock *ext2_superblock_from_inode(inode *ino)
@@ -198,122 +198,138 @@ bool ext2_superblock::valid_dirent(const ext2_dir_entry_t *entry, size_t offset)
     return true;
 }
 
+/**
+ * @brief Try to insert a directory entry in a directory block
+ *
+ * @param buf Block
+ * @param entry Entry to insert (rec_len is ignored)
+ * @param fs Filesystem
+ * @return 1 if it was inserted, 0 if there's no space, -EIO if the block is corrupted
+ */
+int ext2_insert_in_dir_block(uint8_t *buf, const ext2_dir_entry_t *entry, ext2_superblock *fs)
+{
+    size_t dirent_size = ext2_calculate_dirent_size(entry->name_len);
+
+    for (size_t i = 0; i < fs->block_size;)
+    {
+        ext2_dir_entry_t *e = (ext2_dir_entry_t *) (buf + i);
+
+        if (!fs->valid_dirent(e, i))
+        {
+            fs->error("Invalid directory entry");
+            return -EIO;
+        }
+
+        size_t actual_size = ext2_calculate_dirent_size(e->name_len);
+
+        if (e->inode == 0 && e->rec_len >= dirent_size)
+        {
+            /* This direntry is unused, so use it */
+            e->inode = entry->inode;
+            e->name_len = entry->name_len;
+            memcpy(e->name, entry->name, entry->name_len);
+            e->file_type = entry->file_type;
+            return 1;
+        }
+        else if (e->rec_len > actual_size && e->rec_len - actual_size >= dirent_size)
+        {
+            ext2_dir_entry_t *d = (ext2_dir_entry_t *) (buf + i + actual_size);
+            d->inode = entry->inode;
+            d->rec_len = e->rec_len - actual_size;
+            d->name_len = entry->name_len;
+            d->file_type = entry->file_type;
+            memcpy(d->name, entry->name, entry->name_len);
+            e->rec_len = actual_size;
+            return 1;
+        }
+
+        i += e->rec_len;
+    }
+
+    return 0;
+}
+
 int ext2_add_direntry(const char *name, uint32_t inum, struct ext2_inode *ino, inode *dir,
                       ext2_superblock *fs)
 {
-    uint8_t *buffer;
-    uint8_t *buf = buffer = (uint8_t *) zalloc(fs->block_size);
-    if (!buf)
-        return errno = ENOMEM, -1;
-
     if (inum == 0)
         panic("Bad inode number passed to ext2_add_direntry");
 
-    size_t off = 0;
-
     ext2_dir_entry_t entry;
 
-    size_t dirent_size = ext2_calculate_dirent_size(strlen(name));
-
     entry.inode = inum;
     entry.name_len = strlen(name);
-
     entry.file_type = ext2_file_type_to_type_indicator(ino->i_mode);
-
     strlcpy(entry.name, name, sizeof(entry.name));
 
-    while (true)
+    if (ext2_dir_is_indexed(dir, fs))
     {
-        if (off < dir->i_size)
-        {
-            auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
-
-            auto st = file_read_cache(buffer, fs->block_size, dir, off);
-
-            thread_change_addr_limit(old);
-
-            if (st < 0)
-            {
-                free(buffer);
-                return st;
-            }
-
-            for (size_t i = 0; i < fs->block_size;)
-            {
-                ext2_dir_entry_t *e = (ext2_dir_entry_t *) buf;
-
-                if (!fs->valid_dirent(e, i))
-                {
-                    free(buffer);
-                    fs->error("Invalid directory entry");
-                    return -EIO;
-                }
-
-                size_t actual_size = ext2_calculate_dirent_size(e->name_len);
+        int st = ext2_dx_add_entry(&entry, dir, fs);
+        if (st != -EBADMSG)
+            return st < 0 ? (errno = -st, -1) : 0;
 
-#if 0
-				printk("Entry %s size %u - actual size %lu\n", e->name, e->size, actual_size);
-#endif
+        /* The index is broken, so stop using it. Linear inserts may overwrite it. */
+        ext2_get_inode_from_node(dir)->i_flags &= ~EXT2_INDEX_FL;
+        inode_mark_dirty(dir);
+    }
 
-                if (e->inode == 0 && e->rec_len >= dirent_size)
-                {
-                    /* This direntry is unused, so use it */
-                    e->inode = entry.inode;
-                    e->name_len = entry.name_len;
-                    strlcpy(e->name, entry.name, sizeof(entry.name));
-                    e->file_type = entry.file_type;
+    uint8_t *buf = (uint8_t *) zalloc(fs->block_size);
+    if (!buf)
+        return errno = ENOMEM, -1;
 
-                    if (st = file_write_cache_unlocked(buffer, fs->block_size, dir, off); st < 0)
-                    {
-                        free(buffer);
-                        return st;
-                    }
+    size_t off = 0;
+    ssize_t st = 0;
 
-                    free(buffer);
+    for (; off < dir->i_size; off += fs->block_size)
+    {
+        auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
 
-                    return 0;
-                }
-                else if (e->rec_len > actual_size && e->rec_len - actual_size >= dirent_size)
-                {
-                    ext2_dir_entry_t *d = (ext2_dir_entry_t *) (buf + actual_size);
-                    entry.rec_len = e->rec_len - actual_size;
-                    e->rec_len = actual_size;
-                    memcpy(d, &entry, dirent_size);
+        st = file_read_cache(buf, fs->block_size, dir, off);
 
-                    if (st = file_write_cache_unlocked(buffer, fs->block_size, dir, off); st < 0)
-                    {
-                        free(buffer);
-                        return st;
-                    }
+        thread_change_addr_limit(old);
 
-                    free(buffer);
+        if (st < 0)
+        {
+            free(buf);
+            return st;
+        }
 
-                    return 0;
-                }
+        int inserted = ext2_insert_in_dir_block(buf, &entry, fs);
 
-                buf += e->rec_len;
-                i += e->rec_len;
-            }
+        if (inserted < 0)
+        {
+            free(buf);
+            return errno = -inserted, -1;
         }
-        else
+
+        if (inserted)
         {
-            entry.rec_len = fs->block_size;
-            memcpy(buf, &entry, dirent_size);
+            st = file_write_cache_unlocked(buf, fs->block_size, dir, off);
+            free(buf);
+            return st < 0 ? (errno = -st, -1) : 0;
+        }
+    }
 
-            if (int st = file_write_cache_unlocked(buf, fs->block_size, dir, off); st < 0)
-            {
-                return st;
-            }
+    /* The directory's first block just filled up, so start indexing it */
+    if (off == fs->block_size && fs->features_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+    {
+        free(buf);
 
-            break;
-        }
+        if (int st2 = ext2_dx_make_indexed(dir, fs); st2 < 0)
+            return errno = -st2, -1;
 
-        off += fs->block_size;
-        buf = buffer;
+        st = ext2_dx_add_entry(&entry, dir, fs);
+        return st < 0 ? (errno = -st, -1) : 0;
     }
 
-    free(buffer);
-    return 0;
+    memset(buf, 0, fs->block_size);
+    entry.rec_len = fs->block_size;
+    memcpy(buf, &entry, ext2_calculate_dirent_size(entry.name_len));
+
+    st = file_write_cache_unlocked(buf, fs->block_size, dir, off);
+    free(buf);
+
+    return st < 0 ? (errno = -st, -1) : 0;
 }
 
 void ext2_unlink_dirent(ext2_dir_entry_t *before, ext2_dir_entry_t *entry)
@@ -407,15 +423,59 @@ int ext2_file_present(inode *inode, const char *name, ext2_superblock *fs)
     return st != -ENOENT;
 }
 
+/**
+ * @brief Search a directory block for a name
+ *
+ * @param buf Block
+ * @param name Name
+ * @param len Length of the name
+ * @param fs Filesystem
+ * @return Offset of the entry in the block, -ENOENT if it's not there, or -EIO
+ */
+int ext2_search_dir_block(char *buf, const char *name, size_t len, ext2_superblock *fs)
+{
+    for (char *b = buf; b < buf + fs->block_size;)
+    {
+        ext2_dir_entry_t *entry = (ext2_dir_entry_t *) b;
+        if (entry->rec_len == 0)
+        {
+            fs->error("Directory entry has size 0");
+            return -EIO;
+        }
+
+        if (entry->inode != 0 && entry->name_len == len && !memcmp(entry->name, name, len))
+            return b - buf;
+
+        b += entry->rec_len;
+    }
+
+    return -ENOENT;
+}
+
 int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *fs,
                          ext2_dirent_result *res)
 {
+    if (ext2_dir_is_indexed(inode, fs))
+    {
+        int st = ext2_dx_lookup(inode, name, fs, res);
+        if (st != -EBADMSG)
+            return st;
+
+        /* Corrupted index, stop using it and do it the slow way. We may only hold the directory
+         * shared here, hence the atomic.
+         */
+        __atomic_and_fetch(&ext2_get_inode_from_node(inode)->i_flags, ~EXT2_INDEX_FL,
+                           __ATOMIC_RELAXED);
+        inode_mark_dirty(inode);
+    }
+
     int st = -ENOENT;
     char *buf = static_cast<char *>(zalloc(fs->block_size));
     if (!buf)
         return -ENOMEM;
 
     size_t off = 0;
+    size_t len = strlen(name);
 
     while (off < inode->i_size)
     {
@@ -431,32 +491,19 @@ int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *fs,
             goto out;
         }
 
-        for (char *b = buf; b < buf + fs->block_size;)
+        if (int block_off = ext2_search_dir_block(buf, name, len, fs); block_off != -ENOENT)
         {
-            ext2_dir_entry_t *entry = (ext2_dir_entry_t *) b;
-            if (entry->rec_len == 0)
+            if (block_off < 0)
             {
-                fs->error("Directory entry has size 0");
-                st = -EIO;
+                st = block_off;
                 goto out;
             }
 
-            if (entry->inode == 0)
-            {
-                b += entry->rec_len;
-                continue;
-            }
-
-            if (entry->name_len == strlen(name) && !memcmp(entry->name, name, entry->name_len))
-            {
-                res->block_off = b - buf;
-                res->file_off = off + res->block_off;
-                res->buf = buf;
-                st = 1;
-                goto out;
-            }
-
-            b += entry->rec_len;
+            res->block_off = block_off;
+            res->file_off = off + res->block_off;
+            res->buf = buf;
+            st = 1;
+            goto out;
         }
 
         off += fs->block_size;
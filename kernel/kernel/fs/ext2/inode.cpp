@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <onyx/limits.h>
@@ -124,10 +125,12 @@ expected<ext2_block_no, int> ext2_get_block_from_inode(ext2_inode *ino, ext2_blo
 }
 
 expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no block,
-                                              ext2_superblock *sb)
+                                              ext2_superblock *sb, ext2_block_no phys,
+                                              unsigned int alloc_flags)
 {
     auto preferred_bg = ext2_inode_number_to_bg(ino->i_inode, sb);
     auto raw_inode = ext2_get_inode_from_node(ino);
+    ext2_block_no meta_goal = preferred_bg * sb->blocks_per_block_group + sb->first_data_block();
 
     ext2_block_no offsets[4];
 
@@ -149,7 +152,8 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
 
             if (b == EXT2_ERR_INV_BLOCK)
             {
-                auto block = sb->allocate_block(preferred_bg);
+                unsigned int count;
+                auto block = sb->allocate_blocks(meta_goal, 1, &count, alloc_flags);
                 if (block == EXT2_ERR_INV_BLOCK)
                 {
                     return unexpected<int>{-ENOSPC};
@@ -188,11 +192,24 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
 
             if (dest_block_nr == EXT2_FILE_HOLE_BLOCK)
             {
-                auto block = sb->allocate_block();
-                if (block == EXT2_ERR_INV_BLOCK)
-                    return unexpected<int>{-ENOSPC};
+                if (phys == EXT2_FILE_HOLE_BLOCK)
+                {
+                    /* Try to continue where the previous block in the file left off */
+                    ext2_block_no goal = EXT2_FILE_HOLE_BLOCK;
+                    if (off && curr_block[off - 1] != EXT2_FILE_HOLE_BLOCK)
+                        goal = curr_block[off - 1] + 1;
+
+                    unsigned int count;
+                    phys = ext2_alloc_data_blocks(ino, goal, 1, &count, alloc_flags);
+                    if (phys == EXT2_ERR_INV_BLOCK)
+                        return unexpected<int>{-ENOSPC};
+                }
+
+                dest_block_nr = curr_block[off] = phys;
 
-                dest_block_nr = curr_block[off] = block;
+                /* The block table we just changed may be an indirect block */
+                if (buf)
+                    block_buf_dirty(buf);
 
                 ino->i_blocks += sb->block_size >> 9;
                 // printk("Block: %u\n", block);
@@ -210,12 +227,21 @@ int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t of
 {
     auto end = offset + len;
     auto sb = ext2_superblock_from_inode(ino);
+    auto info = ext2_inode_info_from_node(ino);
+    auto raw_inode = ext2_get_inode_from_node(ino);
 
     auto bufs = block_buf_from_page(page);
 
     auto base_block = page_off / sb->block_size;
     auto nr_blocks = PAGE_SIZE / sb->block_size;
 
+    /* Regular files get their blocks picked at writeback, when we know how much of the file is
+     * dirty. Directories and symlinks get theirs right away.
+     */
+    bool delalloc = S_ISREG(ino->i_mode);
+
+    scoped_mutex g{info->alloc_lock};
+
     /* Handle pages that haven't been mapped yet */
     if (!bufs)
     {
@@ -242,37 +268,323 @@ int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t of
         bufs = block_buf_from_page(page);
     }
 
-    while (bufs)
+    for (; bufs; bufs = bufs->next)
     {
-        if (bufs->page_off >= offset && bufs->page_off < end)
-        {
-            auto relative_block = bufs->page_off / sb->block_size;
+        /* Skip the blocks the write doesn't touch */
+        if (bufs->page_off >= end || bufs->page_off + sb->block_size <= offset)
+            continue;
 
-            auto block_number = bufs->block_nr;
+        if (bufs->block_nr != EXT2_FILE_HOLE_BLOCK || bufs->flags & BLOCKBUF_FLAG_DELALLOC)
+            continue;
 
-            if (block_number == EXT2_FILE_HOLE_BLOCK)
-            {
-                auto res = ext2_create_path(ino, base_block + relative_block, sb);
-                // printk("creating path for poff %u file off %lu\n", bufs->page_off, offset);
+        auto block_index = base_block + bufs->page_off / sb->block_size;
 
-                if (res.has_error())
-                    return res.error();
+        if (delalloc)
+        {
+            /* The page may not know about a block direct I/O allocated */
+            auto res = ext2_get_block_from_inode(raw_inode, block_index, sb);
+            if (res.has_error())
+                return res.error();
 
+            if (res.value() != EXT2_FILE_HOLE_BLOCK)
+            {
                 bufs->block_nr = res.value();
+                continue;
+            }
+
+            /* Just make sure there'll be a block for it at writeback. If we're short on space,
+             * allocate it now instead.
+             */
+            if (sb->reserve_blocks(1))
+            {
+                bufs->flags |= BLOCKBUF_FLAG_DELALLOC;
+                info->delalloc_blocks++;
+                continue;
             }
         }
 
-        bufs = bufs->next;
+        auto res = ext2_create_path(ino, block_index, sb);
+        // printk("creating path for poff %u file off %lu\n", bufs->page_off, offset);
+
+        if (res.has_error())
+            return res.error();
+
+        bufs->block_nr = res.value();
     }
 
     return 0;
 }
 
+/**
+ * @brief Give back a delayed allocation block's reservation
+ * The caller needs to hold the inode's alloc_lock.
+ *
+ * @param ino Inode
+ * @param buf Block buffer
+ * @return 1 if the block had a reservation, else 0
+ */
+static unsigned long ext2_drop_delalloc(inode *ino, struct block_buf *buf)
+{
+    if (!(buf->flags & BLOCKBUF_FLAG_DELALLOC))
+        return 0;
+
+    buf->flags &= ~BLOCKBUF_FLAG_DELALLOC;
+    ext2_inode_info_from_node(ino)->delalloc_blocks--;
+    ext2_superblock_from_inode(ino)->unreserve_blocks(1);
+    return 1;
+}
+
+void ext2_abort_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len)
+{
+    auto info = ext2_inode_info_from_node(ino);
+    auto end = offset + len;
+
+    scoped_mutex g{info->alloc_lock};
+
+    /* If the page is dirty (or being written back), the blocks may hold data from an earlier
+     * write, and writeback is going to map them anyway. Otherwise, the reservations
+     * prepare_write made for the range are unused.
+     */
+    if (page->flags & (PAGE_FLAG_DIRTY | PAGE_FLAG_FLUSHING))
+        return;
+
+    for (auto b = block_buf_from_page(page); b; b = b->next)
+    {
+        if (b->page_off < end && b->page_off + b->block_size > offset)
+            ext2_drop_delalloc(ino, b);
+    }
+}
+
+/* Max number of blocks we allocate in one go at writeback */
+#define EXT2_DELALLOC_MAX_BLOCKS 256
+
+/**
+ * @brief Collect the run of delayed allocation blocks that starts at a block buffer, looking
+ * ahead into the next pages of the file (as long as they're resident).
+ * Pages we look ahead into get a reference, which the caller needs to drop.
+ *
+ * @param ino Inode
+ * @param off Offset of first's page in the file
+ * @param first First block buffer of the run
+ * @param bufs Array of EXT2_DELALLOC_MAX_BLOCKS to fill
+ * @return Length of the run
+ */
+static unsigned int ext2_collect_delalloc(inode *ino, size_t off, struct block_buf *first,
+                                          struct block_buf **bufs)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    struct block_buf *b = first;
+    unsigned int expected_off = first->page_off;
+    unsigned int nr = 0;
+
+    while (true)
+    {
+        for (; b; b = b->next, expected_off += sb->block_size)
+        {
+            if (b->page_off != expected_off || !(b->flags & BLOCKBUF_FLAG_DELALLOC))
+                return nr;
+
+            bufs[nr++] = b;
+
+            if (nr == EXT2_DELALLOC_MAX_BLOCKS)
+                return nr;
+        }
+
+        /* A page that's missing blocks ends the run */
+        if (expected_off != PAGE_SIZE)
+            return nr;
+
+        off += PAGE_SIZE;
+
+        /* We may get called from inode_sync, with the page_lock held, so don't take it. Pages
+         * that aren't resident aren't delalloc anyway.
+         */
+        struct page *page;
+        if (off >= ino->i_size || !(page = vmo_get_lockless(ino->i_pages, off)))
+            return nr;
+
+        b = block_buf_from_page(page);
+        expected_off = 0;
+
+        if (!b || b->page_off != 0 || !(b->flags & BLOCKBUF_FLAG_DELALLOC))
+        {
+            page_unref(page);
+            return nr;
+        }
+    }
+}
+
+/**
+ * @brief Allocate blocks for a run of delayed allocation blocks, and map them.
+ * The caller needs to hold the inode's alloc_lock.
+ *
+ * @param ino Inode
+ * @param off Offset of first's page in the file
+ * @param first First block buffer of the run
+ * @param bufs Scratch array of EXT2_DELALLOC_MAX_BLOCKS
+ * @return 0 on success, negative error codes
+ */
+static int ext2_map_delalloc_run(inode *ino, size_t off, struct block_buf *first,
+                                 struct block_buf **bufs)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    auto info = ext2_inode_info_from_node(ino);
+    auto raw_inode = ext2_get_inode_from_node(ino);
+    ext2_block_no logical = (off + first->page_off) >> sb->block_size_shift;
+    ext2_block_no goal = EXT2_FILE_HOLE_BLOCK;
+    unsigned int mapped = 0;
+    int st = 0;
+
+    unsigned int nr = ext2_collect_delalloc(ino, off, first, bufs);
+
+    /* Go right after the previous block in the file */
+    if (logical)
+    {
+        auto res = ext2_get_block_from_inode(raw_inode, logical - 1, sb);
+        if (res.has_value() && res.value() != EXT2_FILE_HOLE_BLOCK)
+            goal = res.value() + 1;
+    }
+
+    while (mapped < nr)
+    {
+        unsigned int count;
+        ext2_block_no block =
+            ext2_alloc_data_blocks(ino, goal, nr - mapped, &count, EXT2_ALLOC_RESERVED);
+
+        if (block == EXT2_ERR_INV_BLOCK)
+        {
+            sb->error("Ran out of space for reserved blocks");
+            st = -ENOSPC;
+            break;
+        }
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            auto res = ext2_create_path(ino, logical + mapped, sb, block + i, EXT2_ALLOC_RESERVED);
+            if (res.has_error())
+            {
+                sb->free_blocks(block + i, count - i);
+                st = res.error();
+                goto out;
+            }
+
+            /* Mapped under us? Shouldn't happen, but don't leak the block if it does */
+            if (res.value() != block + i)
+                sb->free_block(block + i);
+
+            bufs[mapped]->block_nr = res.value();
+            bufs[mapped]->flags &= ~BLOCKBUF_FLAG_DELALLOC;
+            mapped++;
+        }
+
+        goal = block + count;
+    }
+
+out:
+    info->delalloc_blocks -= mapped;
+    sb->unreserve_blocks(mapped);
+
+    /* Drop the references ext2_collect_delalloc took */
+    for (unsigned int i = 1; i < nr; i++)
+    {
+        if (bufs[i]->this_page != bufs[i - 1]->this_page)
+            page_unref(bufs[i]->this_page);
+    }
+
+    return st;
+}
+
+int ext2_map_delalloc(inode *ino, struct page *page, size_t off)
+{
+    auto info = ext2_inode_info_from_node(ino);
+    struct block_buf **bufs = nullptr;
+    int st = 0;
+
+    scoped_mutex g{info->alloc_lock};
+
+    for (auto b = block_buf_from_page(page); b; b = b->next)
+    {
+        if (!(b->flags & BLOCKBUF_FLAG_DELALLOC))
+            continue;
+
+        if (!bufs)
+        {
+            bufs = (struct block_buf **) malloc(EXT2_DELALLOC_MAX_BLOCKS * sizeof(*bufs));
+            if (!bufs)
+                return -ENOMEM;
+        }
+
+        if (st = ext2_map_delalloc_run(ino, off, b, bufs); st < 0)
+            break;
+    }
+
+    free(bufs);
+    return st;
+}
+
+/**
+ * @brief Drop the delayed allocation state of the cached blocks past new_len, as they're about
+ * to go away
+ *
+ * @param ino Inode
+ * @param new_len New length of the file
+ */
+static void ext2_truncate_delalloc(inode *ino, size_t new_len)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    auto info = ext2_inode_info_from_node(ino);
+    size_t start = cul::align_up2(new_len, (size_t) sb->block_size);
+
+    scoped_mutex g{info->alloc_lock};
+
+    if (!info->delalloc_blocks)
+        return;
+
+    /* Look at every cached page past start, not just the ones below i_size: a write that failed
+     * halfway may have left reservations past the end of the file.
+     */
+    ino->i_pages->for_every_page(
+        cul::align_down2(start, PAGE_SIZE), -1UL, [&](struct page *, size_t off) -> bool {
+            struct page *page = vmo_get_lockless(ino->i_pages, off);
+            if (!page)
+                return true;
+
+            for (auto b = block_buf_from_page(page); b; b = b->next)
+            {
+                if (off + b->page_off >= start)
+                    ext2_drop_delalloc(ino, b);
+            }
+
+            page_unref(page);
+            return info->delalloc_blocks != 0;
+        });
+}
+
+/**
+ * @brief Get rid of the cached state past new_len, before we free the blocks
+ *
+ * @param ino Inode
+ * @param new_len New length of the file
+ */
+static void ext2_truncate_cache(inode *ino, size_t new_len)
+{
+    ext2_truncate_delalloc(ino, new_len);
+
+    /* Dropping the pages before freeing their blocks makes sure writeback doesn't write to blocks
+     * we've freed. This may need to write back the last page, so we can't hold alloc_lock.
+     */
+    if (new_len < ino->i_size)
+        inode_truncate_range(ino, new_len, ino->i_size);
+
+    ext2_discard_prealloc(ino);
+}
+
 int ext2_truncate(size_t len, inode *ino);
 int ext2_free_space(size_t new_len, inode *ino);
 
 void ext2_free_inode_space(inode *inode_, ext2_superblock *fs)
 {
+    ext2_truncate_cache(inode_, 0);
     ext2_free_space(0, inode_);
     assert(inode_->i_blocks == 0);
 }
@@ -342,18 +654,15 @@ expected<ext2_trunc_result, int> ext2_trunc_indirect_block(ext2_block_no block,
                                                            ext2_block_coords &curr_coords,
                                                            inode *ino, ext2_superblock *sb)
 {
-    auto block_off = curr_coords.to_offset(sb);
-
+    /* Note that our callers have already dropped the cached pages of the blocks we free */
     if (indirection_level == 0)
     {
         if (curr_coords == boundary)
             return ext2_trunc_result::stop;
 
 #if 0
-		printk("Freeing block off %lu\n", block_off);
 		printk("coords %u\n", curr_coords.coords[0]);
 #endif
-        inode_truncate_range(ino, block_off, block_off + sb->block_size);
 
         // printk("Iblocks %lu\n", ino->i_blocks);
 
@@ -405,7 +714,6 @@ expected<ext2_trunc_result, int> ext2_trunc_indirect_block(ext2_block_no block,
         }
         else
         {
-            inode_truncate_range(ino, block_off, block_off + sb->block_size);
             sb->free_block(blockbuf[i]);
             ino->i_blocks -= sb->block_size >> 9;
             // printk("Iblocks %lu\n", ino->i_blocks);
@@ -443,6 +751,8 @@ int ext2_free_space(size_t new_len, inode *ino)
     auto sb = ext2_superblock_from_inode(ino);
     auto raw_inode = ext2_get_inode_from_node(ino);
 
+    scoped_mutex g{ext2_inode_info_from_node(ino)->alloc_lock};
+
     // If the inode only has inline data, just return success.
     if (!ext2_has_data_blocks(ino, raw_inode, sb))
     {
@@ -532,19 +842,12 @@ int ext2_free_space(size_t new_len, inode *ino)
         if (raw_inode->i_data[0])
         {
             sb->free_block(raw_inode->i_data[0]);
-            inode_truncate_range(ino, 0, sb->block_size);
             ino->i_blocks = 0;
             // printk("zero Iblocks %lu\n", ino->i_blocks);
             raw_inode->i_data[0] = 0;
         }
     }
 
-    if (new_len & (sb->block_size - 1))
-    {
-        auto page_off = new_len;
-        inode_truncate_range(ino, page_off, ino->i_size);
-    }
-
     return 0;
 }
 
@@ -558,6 +861,8 @@ int ext2_truncate(size_t len, inode *ino)
 
     if (ino->i_size > len)
     {
+        ext2_truncate_cache(ino, len);
+
         if ((st = ext2_free_space(len, ino)) < 0)
         {
             return st;
@@ -19,10 +19,12 @@
 
 #include <onyx/compiler.h>
 #include <onyx/dentry.h>
+#include <onyx/epoll.h>
 #include <onyx/file.h>
 #include <onyx/fs_mount.h>
 #include <onyx/limits.h>
 #include <onyx/mm/slab.h>
+#include <onyx/pagecache.h>
 #include <onyx/panic.h>
 #include <onyx/pipe.h>
 #include <onyx/process.h>
@@ -68,6 +70,9 @@ void fd_put(struct file *fd)
 {
     if (__atomic_sub_fetch(&fd->f_refcount, 1, __ATOMIC_RELEASE) == 0)
     {
+        epoll_release_file(fd);
+        if (fd->f_ino->i_fops->release)
+            fd->f_ino->i_fops->release(fd);
         close_vfs(fd->f_ino);
         // printk("file %s dentry refs %lu\n", fd->f_dentry->d_name, fd->f_dentry->d_ref);
         dentry_put(fd->f_dentry);
@@ -517,6 +522,127 @@ ssize_t sys_pwrite(int fd, const void *buf, size_t count, off_t offset)
     return written;
 }
 
+bool inode_is_cacheable(struct inode *file);
+size_t clamp_length(size_t len);
+
+/**
+ * @brief Write a page cache page to a file
+ * Files that can send pages (sockets) reference the page, everything else gets a copy.
+ *
+ * @param out File we're writing to
+ * @param cache Page cache block
+ * @param off Offset of the data in the page
+ * @param len Length of the data
+ * @return Amount written, or a negative error code
+ */
+static ssize_t sendfile_write_page(struct file *out, struct page_cache_block *cache,
+                                   unsigned int off, unsigned int len)
+{
+    if (out->f_ino->i_fops->sendpage)
+        return out->f_ino->i_fops->sendpage(cache->page, off, len, out);
+
+    if (out->f_flags & O_APPEND)
+        out->f_seek = out->f_ino->i_size;
+
+    unsigned long old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st = write_vfs(out->f_seek, len, (char *) cache->buffer + off, out);
+    thread_change_addr_limit(old);
+
+    if (st < 0)
+        return -errno;
+
+    __sync_add_and_fetch(&out->f_seek, st);
+
+    return st;
+}
+
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *uoffset, size_t count)
+{
+    auto_file in = get_file_description(in_fd);
+    if (!in)
+        return -errno;
+
+    auto_file out = get_file_description(out_fd);
+    if (!out)
+        return -errno;
+
+    struct file *in_f = in.get_file();
+    struct file *out_f = out.get_file();
+
+    if (!fd_may_access(in_f, FILE_ACCESS_READ) || !fd_may_access(out_f, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    struct inode *ino = in_f->f_ino;
+
+    /* We send straight out of the page cache */
+    if (!S_ISREG(ino->i_mode) || !inode_is_cacheable(ino))
+        return -EINVAL;
+
+    off_t offset = in_f->f_seek;
+
+    if (uoffset)
+    {
+        if (copy_from_user(&offset, uoffset, sizeof(off_t)) < 0)
+            return -EFAULT;
+
+        if (offset < 0)
+            return -EINVAL;
+    }
+
+    count = clamp_length(count);
+
+    size_t sent = 0;
+    ssize_t st = 0;
+
+    while (sent < count)
+    {
+        size_t pos = offset + sent;
+        size_t size = ino->i_size;
+
+        if (pos >= size)
+            break;
+
+        size_t len = cul::min(count - sent, size - pos);
+
+        struct page_cache_block *cache = file_get_cache_page(in_f, pos, len);
+        if (!cache)
+        {
+            st = -errno;
+            break;
+        }
+
+        unsigned int page_off = pos & (PAGE_SIZE - 1);
+        unsigned int amount = cul::min(len, PAGE_SIZE - page_off);
+
+        st = sendfile_write_page(out_f, cache, page_off, amount);
+
+        page_unpin(cache->page);
+
+        if (st <= 0)
+            break;
+
+        sent += st;
+
+        if ((unsigned int) st < amount)
+            break;
+    }
+
+    if (!sent)
+        return st;
+
+    offset += sent;
+
+    if (uoffset)
+    {
+        if (copy_to_user(uoffset, &offset, sizeof(off_t)) < 0)
+            return -EFAULT;
+    }
+    else
+        __sync_add_and_fetch(&in_f->f_seek, sent);
+
+    return sent;
+}
+
 void handle_open_flags(struct file *fd, int flags)
 {
     if (flags & O_APPEND)
@@ -594,7 +720,7 @@ static struct file *try_to_open(struct file *base, const char *filename, int fla
 /* TODO: Add O_SYNC */
 #define VALID_OPEN_FLAGS                                                                       \
     (O_RDONLY | O_WRONLY | O_RDWR | O_CREAT | O_DIRECTORY | O_EXCL | O_NOFOLLOW | O_NONBLOCK | \
-     O_APPEND | O_CLOEXEC | O_LARGEFILE | O_TRUNC | O_NOCTTY | O_PATH | O_NOATIME)
+     O_APPEND | O_CLOEXEC | O_LARGEFILE | O_TRUNC | O_NOCTTY | O_PATH | O_NOATIME | O_DIRECT)
 
 int do_sys_open(const char *filename, int flags, mode_t mode, struct file *__rel)
 {
@@ -1128,6 +1254,88 @@ int sys_fallocate(int fd, int mode, off_t offset, off_t len)
     return ret;
 }
 
+/**
+ * @brief Read [offset, offset + len) of a file into the page cache
+ *
+ * @param f File
+ * @param offset Offset
+ * @param len Length, 0 means "until EOF"
+ * @return 0 on success, negative error codes
+ */
+static int file_readahead(struct file *f, off_t offset, size_t len)
+{
+    struct inode *ino = f->f_ino;
+
+    if (!S_ISREG(ino->i_mode))
+        return -EINVAL;
+
+    if (!len || len > ino->i_size)
+        len = ino->i_size;
+
+    unsigned long start = offset >> PAGE_SHIFT;
+    unsigned long end = ((size_t) offset + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+    return force_page_cache_readahead(ino, start, end - start);
+}
+
+int sys_fadvise64(int fd, off_t offset, off_t len, int advice)
+{
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -errno;
+
+    auto fil = f.get_file();
+
+    if (offset < 0 || len < 0)
+        return -EINVAL;
+
+    if (S_ISFIFO(fil->f_ino->i_mode))
+        return -ESPIPE;
+
+    switch (advice)
+    {
+        case POSIX_FADV_NORMAL:
+            fil->f_ra.ra_pages = RA_DEFAULT_PAGES;
+            return 0;
+        case POSIX_FADV_SEQUENTIAL:
+            fil->f_ra.ra_pages = RA_DEFAULT_PAGES * 2;
+            return 0;
+        case POSIX_FADV_RANDOM:
+            fil->f_ra.ra_pages = 0;
+            return 0;
+        case POSIX_FADV_WILLNEED:
+            if (!S_ISREG(fil->f_ino->i_mode))
+                return 0;
+            return file_readahead(fil, offset, len);
+        case POSIX_FADV_DONTNEED:
+        case POSIX_FADV_NOREUSE:
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+ssize_t sys_readahead(int fd, off_t offset, size_t count)
+{
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -errno;
+
+    auto fil = f.get_file();
+
+    if (!fd_may_access(fil, FILE_ACCESS_READ))
+        return -EBADF;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    /* readahead(2) with a count of 0 reads nothing */
+    if (!count)
+        return 0;
+
+    return file_readahead(fil, offset, count);
+}
+
 off_t sys_lseek(int fd, off_t offset, int whence)
 {
     /* TODO: Fix O_APPEND behavior */
@@ -13,6 +13,7 @@
 #include <onyx/dev.h>
 #include <onyx/file.h>
 #include <onyx/fnv.h>
+#include <onyx/mm/flush.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
 #include <onyx/panic.h>
@@ -153,6 +154,8 @@ ssize_t file_write_cache_unlocked(void *buffer, size_t len, struct inode *ino, s
 
         if (copy_from_user((char *) cache->buffer + cache_off, (char *) buffer + wrote, amount) < 0)
         {
+            if (ino->i_fops->abort_write)
+                ino->i_fops->abort_write(ino, page, aligned_off, cache_off, amount);
             page_unpin(page);
             return -EFAULT;
         }
@@ -186,12 +189,68 @@ ssize_t file_write_cache_unlocked(void *buffer, size_t len, struct inode *ino, s
 
 ssize_t file_write_cache(void *buffer, size_t len, struct inode *ino, size_t offset)
 {
-    scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
+    ssize_t st;
 
-    return file_write_cache_unlocked(buffer, len, ino, offset);
+    {
+        scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
+        st = file_write_cache_unlocked(buffer, len, ino, offset);
+    }
+
+    /* Throttle the dirtier without holding the inode lock, as writeback may need it */
+    if (st > 0)
+        flush_balance_dirty(ino->i_sb ? ino->i_sb->s_bdev : nullptr);
+
+    return st;
+}
+
+/**
+ * @brief Get a page for a read, doing readahead on the way
+ *
+ * @param ino Inode
+ * @param ra Readahead state
+ * @param offset Offset of the read
+ * @param len Length of the rest of the read
+ * @return Pinned page cache block, or nullptr
+ */
+static struct page_cache_block *inode_get_page_ra(struct inode *ino, struct file_ra_state *ra,
+                                                  size_t offset, size_t len)
+{
+    unsigned long pgoff = offset >> PAGE_SHIFT;
+    unsigned long req_pages = ((offset + len - 1) >> PAGE_SHIFT) - pgoff + 1;
+    struct page *page;
+
+    auto st = vmo_get(ino->i_pages, pgoff << PAGE_SHIFT, 0, &page);
+
+    if (st == VMO_STATUS_OK)
+    {
+        if (page->flags & PAGE_FLAG_READAHEAD)
+            page_cache_async_readahead(ino, ra, page, pgoff, req_pages);
+        ra->prev_pgoff = pgoff;
+        return page->cache;
+    }
+
+    if (st == VMO_STATUS_NON_EXISTENT)
+        page_cache_sync_readahead(ino, ra, pgoff, req_pages);
+
+    ra->prev_pgoff = pgoff;
+    return inode_get_page(ino, offset);
+}
+
+/**
+ * @brief Get a page cache page of a file for a read, doing readahead on the way
+ *
+ * @param f File
+ * @param offset Offset of the read
+ * @param len Length of the rest of the read
+ * @return Pinned page cache block, or nullptr with errno set
+ */
+struct page_cache_block *file_get_cache_page(struct file *f, size_t offset, size_t len)
+{
+    return inode_get_page_ra(f->f_ino, &f->f_ra, offset, len);
 }
 
-ssize_t file_read_cache(void *buffer, size_t len, struct inode *file, size_t offset)
+ssize_t file_read_cache(void *buffer, size_t len, struct inode *file, size_t offset,
+                        struct file_ra_state *ra)
 {
     if ((size_t) offset >= file->i_size)
         return 0;
@@ -200,7 +259,8 @@ ssize_t file_read_cache(void *buffer, size_t len, struct inode *file, size_t off
 
     while (read != len)
     {
-        struct page_cache_block *cache = inode_get_page(file, offset);
+        struct page_cache_block *cache =
+            ra ? inode_get_page_ra(file, ra, offset, len - read) : inode_get_page(file, offset);
 
         if (!cache)
             return read ?: -1;
@@ -283,27 +343,21 @@ ssize_t inode_sync(struct inode *inode)
 {
     if (!inode->i_pages)
         return 0;
-    struct rb_itor it;
-    it.node = nullptr;
-    scoped_mutex g{inode->i_pages->page_lock};
-
-    it.tree = inode->i_pages->pages;
+    struct vm_object *vmo = inode->i_pages;
+    scoped_mutex g{vmo->page_lock};
 
-    rb_itor_first(&it);
+    /* Only look at the pages that are tagged dirty, instead of walking the whole page cache */
+    vmo->for_every_page(
+        0, -1UL,
+        [](struct page *page, size_t off) -> bool {
+            struct page_cache_block *b = page->cache;
 
-    while (rb_itor_valid(&it))
-    {
-        void *datum = *rb_itor_datum(&it);
-        struct page *page = (struct page *) datum;
-        struct page_cache_block *b = page->cache;
+            if (page->flags & PAGE_FLAG_DIRTY)
+                flush_sync_one(&b->fobj);
 
-        if (page->flags & PAGE_FLAG_DIRTY)
-        {
-            flush_sync_one(&b->fobj);
-        }
-
-        rb_itor_next(&it);
-    }
+            return true;
+        },
+        VMO_TAG_DIRTY);
 
     return 0;
 }
@@ -44,6 +44,23 @@ void wait_for_flush(struct page *page)
         cpu_relax();
 }
 
+/**
+ * @brief Set or clear a tag (VMO_TAG_*) on a cached page, in its inode's page tree
+ *
+ * @param b Page cache block
+ * @param tag Tag
+ * @param set True to set, false to clear
+ */
+static void pagecache_tag_page(struct page_cache_block *b, unsigned int tag, bool set)
+{
+    struct vm_object *vmo = b->node->i_pages;
+
+    if (set)
+        vmo_set_page_tag(vmo, b->offset, tag);
+    else
+        vmo_clear_page_tag(vmo, b->offset, tag);
+}
+
 void pagecache_set_dirty(bool dirty, struct flush_object *fo)
 {
     struct page_cache_block *b = cache_block_from_fo(fo);
@@ -53,14 +70,22 @@ void pagecache_set_dirty(bool dirty, struct flush_object *fo)
     {
         wait_for_flush(page);
         __sync_fetch_and_or(&page->flags, PAGE_FLAG_DIRTY);
+        pagecache_tag_page(b, VMO_TAG_DIRTY, true);
     }
     else
     {
-        /* Re-write-protect shared mappings */
+        /* Clear the dirty bit before re-write-protecting shared mappings. Write faults run
+         * concurrently with us, and they dirty the page after making it writable, so this way
+         * the page can't end up both writable and clean.
+         */
+        __sync_fetch_and_and(&page->flags, ~PAGE_FLAG_DIRTY);
+        pagecache_tag_page(b, VMO_TAG_DIRTY, false);
+
         struct vm_object *vmo = b->node->i_pages;
         vm_wp_page_for_every_region(page, b->offset, vmo);
 
-        __sync_fetch_and_and(&page->flags, ~(PAGE_FLAG_DIRTY | PAGE_FLAG_FLUSHING));
+        __sync_fetch_and_and(&page->flags, ~PAGE_FLAG_FLUSHING);
+        pagecache_tag_page(b, VMO_TAG_WRITEBACK, false);
     }
 }
 
@@ -70,15 +95,42 @@ ssize_t pagecache_flush(struct flush_object *fo)
     struct page *page = b->page;
 
     __sync_or_and_fetch(&page->flags, PAGE_FLAG_FLUSHING);
+    pagecache_tag_page(b, VMO_TAG_WRITEBACK, true);
 
     assert(b->node->i_fops->writepage != nullptr);
     return b->node->i_fops->writepage(b->page, b->offset, b->node);
 }
 
+static int pagecache_prepare_wb(struct flush_object *fo, struct flush_wb_req *req)
+{
+    struct page_cache_block *b = cache_block_from_fo(fo);
+    struct page *page = b->page;
+
+    if (!b->node->i_fops->prepare_writepage)
+        return -EOPNOTSUPP;
+
+    if (int st = b->node->i_fops->prepare_writepage(page, b->offset, b->node, req); st < 0)
+        return st;
+
+    __sync_or_and_fetch(&page->flags, PAGE_FLAG_FLUSHING);
+    pagecache_tag_page(b, VMO_TAG_WRITEBACK, true);
+
+    return 0;
+}
+
+static struct blockdev *pagecache_get_dev(struct flush_object *fo)
+{
+    struct page_cache_block *b = cache_block_from_fo(fo);
+
+    return b->node->i_sb ? b->node->i_sb->s_bdev : nullptr;
+}
+
 const struct flush_ops pagecache_flush_ops = {
     .flush = pagecache_flush,
     .is_dirty = pagecache_is_dirty,
     .set_dirty = pagecache_set_dirty,
+    .prepare_wb = pagecache_prepare_wb,
+    .get_dev = pagecache_get_dev,
 };
 
 struct page_cache_block *pagecache_create_cache_block(struct page *page, size_t size, size_t offset,
@@ -116,6 +168,7 @@ void pagecache_dirty_block(struct page_cache_block *block)
     if (old_flags & PAGE_FLAG_DIRTY)
         return;
 
+    pagecache_tag_page(block, VMO_TAG_DIRTY, true);
     flush_add_buf(&block->fobj);
 }
 
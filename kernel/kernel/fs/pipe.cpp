@@ -244,18 +244,16 @@ short pipe::poll(void *poll_file, short events)
 
     if (events & POLLIN)
     {
+        poll_wait_helper(poll_file, &read_queue);
         if (can_read())
             revents |= POLLIN;
-        else
-            poll_wait_helper(poll_file, &read_queue);
     }
 
     if (events & POLLOUT)
     {
+        poll_wait_helper(poll_file, &write_queue);
         if (can_write())
             revents |= POLLOUT;
-        else
-            poll_wait_helper(poll_file, &write_queue);
     }
 
     return revents;
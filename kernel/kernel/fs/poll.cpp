@@ -95,38 +95,6 @@ short default_poll(void *pf, short events, struct file *f)
     return default_poll_return & events;
 }
 
-class auto_signal_mask
-{
-private:
-    bool sigmask_valid;
-    sigset_t &temp_sigmask;
-    bool disable_{false};
-
-public:
-    auto_signal_mask(bool valid, sigset_t &set) : sigmask_valid{valid}, temp_sigmask{set}
-    {
-        if (!sigmask_valid)
-            return;
-        auto thread = get_current_thread();
-        thread->sinfo.original_sigset = thread->sinfo.set_blocked(&temp_sigmask);
-        thread->sinfo.flags |= THREAD_SIGNAL_ORIGINAL_SIGSET;
-    }
-
-    ~auto_signal_mask()
-    {
-        if (!sigmask_valid || disable_)
-            return;
-        auto thread = get_current_thread();
-        thread->sinfo.set_blocked(&thread->sinfo.original_sigset);
-        thread->sinfo.flags &= ~THREAD_SIGNAL_ORIGINAL_SIGSET;
-    }
-
-    void disable()
-    {
-        disable_ = true;
-    }
-};
-
 struct file *__get_file_description_unlocked(int fd, struct process *p);
 
 int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
@@ -230,7 +198,7 @@ int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
             auto file = pf->get_file();
             auto events = pf->get_efective_event_mask();
 
-            auto revents = poll_vfs(pf.get(), events, file);
+            auto revents = poll_vfs(static_cast<poll_waiter *>(pf.get()), events, file);
 
             if (revents != 0)
             {
@@ -271,8 +239,8 @@ int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
 
 void poll_wait_helper(void *__poll_file, struct wait_queue *q)
 {
-    poll_file *pf = static_cast<poll_file *>(__poll_file);
-    pf->wait(q);
+    poll_waiter *pw = static_cast<poll_waiter *>(__poll_file);
+    pw->wait(q);
 }
 
 int sys_pselect(int nfds, fd_set *ureadfds, fd_set *uwritefds, fd_set *uexceptfds,
@@ -405,7 +373,7 @@ int sys_pselect(int nfds, fd_set *ureadfds, fd_set *uwritefds, fd_set *uexceptfd
             auto file = poll_file->get_file();
             auto events = poll_file->get_efective_event_mask();
 
-            auto revents = poll_vfs(poll_file.get(), events, file);
+            auto revents = poll_vfs(static_cast<poll_waiter *>(poll_file.get()), events, file);
 
             if (revents != 0)
             {
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <onyx/buffer.h>
+#include <onyx/file.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/page.h>
+#include <onyx/pagecache.h>
+#include <onyx/readahead.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+/**
+ * Page cache readahead.
+ * We keep a window per open file and grow it while the file is being read sequentially. The page
+ * at start + size - async_size gets marked with PAGE_FLAG_READAHEAD; when a reader hits it, the
+ * next window gets read in, so sequential readers keep finding their pages in the cache.
+ *
+ * Readahead reads are done while holding the vmo's page_lock (like vmo_populate), since we have no
+ * way of inserting not-yet-uptodate pages into the page cache. Because of that, "async" readahead
+ * is really synchronous, it just happens before the pages are needed.
+ */
+
+/* Biggest run of pages we hand to the filesystem in one go */
+#define RA_MAX_BATCH 64
+
+static bool ra_can_readahead(struct inode *ino)
+{
+    return S_ISREG(ino->i_mode) && ino->i_pages && ino->i_pages->ops == &inode_vmo_ops &&
+           ino->i_fops->readpage;
+}
+
+void file_ra_state_init(struct file_ra_state *ra)
+{
+    ra->start = 0;
+    ra->size = 0;
+    ra->async_size = 0;
+    ra->ra_pages = RA_DEFAULT_PAGES;
+    ra->prev_pgoff = -1UL;
+}
+
+/**
+ * @brief Add a freshly read page to the page cache
+ *
+ * @param ino Inode
+ * @param page Page
+ * @param off Offset of the page in the file
+ * @param marker True if the page should be marked with PAGE_FLAG_READAHEAD
+ * @return 0 on success, negative error codes
+ */
+static int ra_add_page(struct inode *ino, struct page *page, size_t off, bool marker)
+{
+    struct vm_object *vmo = ino->i_pages;
+    size_t to_read = ino->i_size - off < PAGE_SIZE ? ino->i_size - off : PAGE_SIZE;
+
+    memset((unsigned char *) PAGE_TO_VIRT(page) + to_read, 0, PAGE_SIZE - to_read);
+
+    if (!pagecache_create_cache_block(page, to_read, off, ino))
+    {
+        page_destroy_block_bufs(page);
+        free_page(page);
+        return -ENOMEM;
+    }
+
+    if (marker)
+        page->flags |= PAGE_FLAG_READAHEAD;
+
+    if (vmo->flags & VMO_FLAG_LOCK_FUTURE_PAGES)
+        page->flags |= PAGE_FLAG_LOCKED;
+
+    if (vmo_add_page_unlocked(off, page, vmo) < 0)
+    {
+        vmo->ops->free_page(vmo, page);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read a run of pages that aren't in the page cache, and add them to it
+ * Needs to be called with the vmo's page_lock held.
+ *
+ * @param ino Inode
+ * @param start First page of the run
+ * @param nr Number of pages
+ * @param marker Page to mark with PAGE_FLAG_READAHEAD (or -1UL)
+ * @return 0 on success, negative error codes
+ */
+static int ra_read_run(struct inode *ino, unsigned long start, unsigned long nr,
+                       unsigned long marker)
+{
+    MUST_HOLD_MUTEX(&ino->i_pages->page_lock);
+
+    struct page *pages = nullptr;
+    struct page **tail = &pages;
+    unsigned long allocated;
+
+    for (allocated = 0; allocated < nr; allocated++)
+    {
+        struct page *p = alloc_page(PAGE_ALLOC_NO_ZERO);
+        if (!p)
+            break;
+
+        p->flags |= PAGE_FLAG_BUFFER;
+        p->priv = 0;
+        p->next_un.next_allocation = nullptr;
+        *tail = p;
+        tail = &p->next_un.next_allocation;
+    }
+
+    if (!allocated)
+        return -ENOMEM;
+
+    size_t off = start << PAGE_SHIFT;
+    ssize_t nr_read = 0;
+
+    unsigned long old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+
+    if (ino->i_fops->readpages)
+    {
+        nr_read = ino->i_fops->readpages(pages, allocated, off, ino);
+    }
+    else
+    {
+        for (struct page *p = pages; p; p = p->next_un.next_allocation)
+        {
+            size_t page_off = off + (nr_read << PAGE_SHIFT);
+            size_t to_read =
+                ino->i_size - page_off < PAGE_SIZE ? ino->i_size - page_off : PAGE_SIZE;
+
+            if (ino->i_fops->readpage(p, page_off, ino) < (ssize_t) to_read)
+                break;
+            nr_read++;
+        }
+    }
+
+    thread_change_addr_limit(old);
+
+    int st = nr_read > 0 ? 0 : (nr_read < 0 ? nr_read : -EIO);
+
+    struct page *p = pages;
+    for (unsigned long i = 0; i < allocated; i++)
+    {
+        struct page *next = p->next_un.next_allocation;
+        p->next_un.next_allocation = nullptr;
+
+        if ((ssize_t) i < nr_read)
+        {
+            if (int st2 = ra_add_page(ino, p, off + (i << PAGE_SHIFT), start + i == marker);
+                st2 < 0)
+                st = st2;
+        }
+        else
+        {
+            /* The filesystem didn't get to these, throw them away */
+            page_destroy_block_bufs(p);
+            free_page(p);
+        }
+
+        p = next;
+    }
+
+    return st;
+}
+
+/**
+ * @brief Read [start, start + nr) into the page cache, skipping pages that are already cached
+ *
+ * @param ino Inode
+ * @param start First page
+ * @param nr Number of pages
+ * @param async_size Size of the async part of the window, 0 if we shouldn't mark anything
+ * @return 0 on success, negative error codes
+ */
+static int ra_read_pages(struct inode *ino, unsigned long start, unsigned long nr,
+                         unsigned long async_size)
+{
+    struct vm_object *vmo = ino->i_pages;
+    unsigned long end = start + nr;
+    unsigned long file_pages = (ino->i_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    unsigned long vmo_pages = vmo->size >> PAGE_SHIFT;
+    unsigned long marker = async_size ? end - async_size : -1UL;
+
+    if (end > file_pages)
+        end = file_pages;
+    if (end > vmo_pages)
+        end = vmo_pages;
+
+    scoped_mutex g{vmo->page_lock};
+
+    unsigned long i = start;
+    while (i < end)
+    {
+        if (vmo_find_page(vmo, i << PAGE_SHIFT))
+        {
+            i++;
+            continue;
+        }
+
+        /* Find the run of missing pages that starts at i */
+        unsigned long run = 1;
+        while (i + run < end && run < RA_MAX_BATCH &&
+               !vmo_find_page(vmo, (i + run) << PAGE_SHIFT))
+            run++;
+
+        if (int st = ra_read_run(ino, i, run, marker); st < 0)
+            return st;
+
+        i += run;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the size of the first window, given the size of the first read
+ *
+ * @param req_pages Pages the reader asked for
+ * @param max Max window size
+ * @return Window size
+ */
+static unsigned long ra_init_size(unsigned long req_pages, unsigned long max)
+{
+    unsigned long size = 1;
+
+    while (size < req_pages)
+        size <<= 1;
+
+    if (size <= max / 32)
+        size *= 4;
+    else if (size <= max / 4)
+        size *= 2;
+    else
+        size = max;
+
+    if (size < RA_MIN_PAGES)
+        size = RA_MIN_PAGES;
+
+    return size > max ? max : size;
+}
+
+static unsigned long ra_next_size(struct file_ra_state *ra)
+{
+    unsigned long size = ra->size * 2;
+    if (size < RA_MIN_PAGES)
+        size = RA_MIN_PAGES;
+    return size > ra->ra_pages ? ra->ra_pages : size;
+}
+
+static void ra_submit(struct inode *ino, struct file_ra_state *ra)
+{
+    ra_read_pages(ino, ra->start, ra->size, ra->async_size);
+}
+
+void page_cache_sync_readahead(struct inode *ino, struct file_ra_state *ra, unsigned long pgoff,
+                               unsigned long req_pages)
+{
+    if (!ra_can_readahead(ino))
+        return;
+
+    bool sequential = pgoff == 0 || pgoff == ra->prev_pgoff + 1 || pgoff == ra->prev_pgoff;
+
+    if (!ra->ra_pages || !sequential)
+    {
+        /* Random access, just read what was asked for (in one go) */
+        unsigned long max = ra->ra_pages ?: RA_MAX_BATCH;
+        ra_read_pages(ino, pgoff, req_pages < max ? req_pages : max, 0);
+        return;
+    }
+
+    ra->start = pgoff;
+    ra->size = ra_init_size(req_pages, ra->ra_pages);
+    ra->async_size = ra->size > req_pages ? ra->size - req_pages : 0;
+    ra_submit(ino, ra);
+}
+
+void page_cache_async_readahead(struct inode *ino, struct file_ra_state *ra, struct page *page,
+                                unsigned long pgoff, unsigned long req_pages)
+{
+    __atomic_and_fetch(&page->flags, ~PAGE_FLAG_READAHEAD, __ATOMIC_RELAXED);
+
+    if (!ra->ra_pages || !ra_can_readahead(ino))
+        return;
+
+    if (pgoff == ra->start + ra->size - ra->async_size)
+    {
+        /* The marker we left behind, move the window forward */
+        ra->start += ra->size;
+    }
+    else
+    {
+        /* Some other reader's marker (or we lost track), restart right after it */
+        ra->start = pgoff + 1;
+        if (ra->size < req_pages)
+            ra->size = req_pages;
+    }
+
+    ra->size = ra_next_size(ra);
+    ra->async_size = ra->size;
+    ra_submit(ino, ra);
+}
+
+int force_page_cache_readahead(struct inode *ino, unsigned long pgoff, unsigned long nr_pages)
+{
+    if (!ra_can_readahead(ino))
+        return 0;
+
+    unsigned long file_pages = (ino->i_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (pgoff >= file_pages)
+        return 0;
+    if (nr_pages > file_pages - pgoff)
+        nr_pages = file_pages - pgoff;
+
+    while (nr_pages)
+    {
+        unsigned long chunk = nr_pages < RA_MAX_BATCH ? nr_pages : RA_MAX_BATCH;
+
+        if (int st = ra_read_pages(ino, pgoff, chunk, 0); st < 0)
+            return st;
+
+        pgoff += chunk;
+        nr_pages -= chunk;
+    }
+
+    return 0;
+}
+
+void filemap_fault_readahead(struct file *f, unsigned long pgoff, bool sequential)
+{
+    struct inode *ino = f->f_ino;
+    struct file_ra_state *ra = &f->f_ra;
+
+    if (!ra->ra_pages || !ra_can_readahead(ino))
+        return;
+
+    struct page *page;
+    auto st = vmo_get(ino->i_pages, pgoff << PAGE_SHIFT, 0, &page);
+
+    if (st == VMO_STATUS_OK)
+    {
+        if (page->flags & PAGE_FLAG_READAHEAD)
+            page_cache_async_readahead(ino, ra, page, pgoff, 1);
+        page_unpin(page);
+        return;
+    }
+
+    if (st != VMO_STATUS_NON_EXISTENT)
+        return;
+
+    if (sequential)
+    {
+        /* MADV_SEQUENTIAL, read a whole window ahead and keep going halfway through it */
+        ra->start = pgoff;
+        ra->size = ra->ra_pages;
+        ra->async_size = ra->ra_pages / 2;
+    }
+    else
+    {
+        /* Read around the fault, since we can't tell what the access pattern looks like */
+        ra->start = pgoff > ra->ra_pages / 2 ? pgoff - ra->ra_pages / 2 : 0;
+        ra->size = ra->ra_pages;
+        ra->async_size = ra->ra_pages / 4;
+    }
+
+    ra_submit(ino, ra);
+}
@@ -174,10 +174,13 @@ void inode_update_mtime(struct inode *ino)
 
 ssize_t do_actual_read(size_t offset, size_t len, void *buf, struct file *file)
 {
+    if (file->f_flags & O_DIRECT && file->f_ino->i_fops->direct_io)
+        return file->f_ino->i_fops->direct_io(offset, len, buf, file, false);
+
     if (!inode_is_cacheable(file->f_ino))
         return file->f_ino->i_fops->read(offset, len, buf, file);
 
-    return file_read_cache(buf, len, file->f_ino, offset);
+    return file_read_cache(buf, len, file->f_ino, offset, &file->f_ra);
 }
 
 bool is_invalid_length(size_t len)
@@ -219,7 +222,11 @@ ssize_t do_actual_write(size_t offset, size_t len, void *buffer, struct file *f)
     ssize_t st = 0;
     struct inode *ino = f->f_ino;
 
-    if (!inode_is_cacheable(ino))
+    if (f->f_flags & O_DIRECT && ino->i_fops->direct_io)
+    {
+        st = ino->i_fops->direct_io(offset, len, buffer, f, true);
+    }
+    else if (!inode_is_cacheable(ino))
     {
         st = ino->i_fops->write(offset, len, buffer, f);
     }
@@ -689,6 +696,8 @@ struct file *inode_to_file(struct inode *ino)
     f->f_refcount = 1;
     f->f_seek = 0;
     f->f_dentry = nullptr;
+    file_ra_state_init(&f->f_ra);
+    INIT_LIST_HEAD(&f->f_epitems);
 
     return f;
 }
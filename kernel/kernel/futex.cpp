@@ -3,6 +3,7 @@
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
+#include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -11,12 +12,15 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <onyx/clock.h>
 #include <onyx/fnv.h>
 #include <onyx/futex.h>
 #include <onyx/list.h>
 #include <onyx/pagecache.h>
 #include <onyx/process.h>
+#include <onyx/scheduler.h>
 #include <onyx/user.h>
+#include <onyx/vm.h>
 #include <onyx/wait_queue.h>
 
 #include <onyx/hashtable.hpp>
@@ -92,19 +96,41 @@ struct futex_key
     }
 };
 
+/* futex_waitv() waits on all its futexes with a single wait queue */
+struct futex_waitv_state
+{
+    wait_queue wq;
+    /* Index of the first futex that got woken up, or -1 */
+    int woken;
+};
+
 class futex_queue
 {
 public:
     futex_key key;
     bool awaken;
+    /* FUTEX_WAIT_BITSET's bitset, wakes need to match at least one bit */
+    uint32_t bitset;
+    struct thread *waiter;
+    /* Set when a PI futex got handed over to us because its owner died */
+    bool pi_owner_died;
+    /* futex_waitv() state and the index of this futex in the vector, if any */
+    futex_waitv_state *waitv;
+    unsigned int waitv_index;
     wait_queue wq;
     list_head_cpp<futex_queue> list_node;
 
-    futex_queue(futex_key key) : key(key), awaken(false), wq{}, list_node{this}
+    futex_queue(futex_key key)
+        : key(key), awaken(false), bitset(FUTEX_BITSET_MATCH_ANY), waiter(get_current_thread()),
+          pi_owner_died(false), waitv(nullptr), waitv_index(0), wq{}, list_node{this}
     {
         init_wait_queue_head(&wq);
     }
 
+    futex_queue() : futex_queue(futex_key{})
+    {
+    }
+
     ~futex_queue()
     {
     }
@@ -128,7 +154,16 @@ public:
 
         COMPILER_BARRIER();
 
-        wait_queue_wake_all(&wq);
+        if (waitv)
+        {
+            /* Only the first wake gets reported back */
+            int expected = -1;
+            __atomic_compare_exchange_n(&waitv->woken, &expected, (int) waitv_index, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            wait_queue_wake_all(&waitv->wq);
+        }
+        else
+            wait_queue_wake_all(&wq);
     }
 
     futex_key &get_key()
@@ -144,6 +179,34 @@ public:
     void requeue(const futex_key &new_key, struct list_head *new_head);
 };
 
+}; // namespace futex
+
+/* PI futexes with waiters get a futex_pi_state. It tracks the owner (as the TID in the futex word
+ * may be stale or bogus) and the waiters, whose priorities the owner inherits.
+ */
+struct futex_pi_state
+{
+    futex::futex_key key;
+    /* We hold a reference to the owner */
+    struct thread *owner;
+    /* futex_queues of the waiters. Protected by futex_pi_lock */
+    struct list_head waiters;
+    /* Node in the owner's pi_owned list. Protected by futex_pi_lock */
+    struct list_head owner_node;
+    /* Node in the PI state hashtable */
+    struct list_head list_node;
+
+    futex_pi_state(const futex::futex_key &key) : key(key), owner{}
+    {
+        INIT_LIST_HEAD(&waiters);
+        INIT_LIST_HEAD(&owner_node);
+        INIT_LIST_HEAD(&list_node);
+    }
+};
+
+namespace futex
+{
+
 inline uint32_t __futex_hash(futex_key &key)
 {
     return fnv_hash(&key.both, sizeof(key.both));
@@ -163,6 +226,23 @@ static constexpr size_t futex_hashtable_buckets = 1024;
 static cul::hashtable2<futex_queue, futex_hashtable_buckets, uint32_t, futex_hash> futex_hashtable;
 static struct spinlock futex_hashtable_locks[futex_hashtable_buckets];
 
+uint32_t futex_pi_hash(futex_pi_state &state)
+{
+    return __futex_hash(state.key);
+}
+
+/* PI states are hashed like futex_queues, and protected by the same bucket locks */
+static cul::hashtable2<futex_pi_state, futex_hashtable_buckets, uint32_t, futex_pi_hash>
+    futex_pi_states;
+
+/* Protects PI waiter lists, PI ownership and priority boosting. Nests inside the bucket locks,
+ * as priority inheritance chains cross buckets.
+ */
+static struct spinlock futex_pi_lock;
+
+/* How long of a PI chain we walk when boosting owners */
+static constexpr unsigned int futex_pi_max_depth = 32;
+
 uint32_t get_hashtable(futex_key &key)
 {
     auto hash = __futex_hash(key);
@@ -273,26 +353,69 @@ int calculate_key(int *uaddr, int flags, futex_key &out_key)
     return 0;
 }
 
-int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
+/**
+ * @brief Fault in a futex word for writing
+ * Atomic operations on futex words run with the hash bucket locked, where we can't take faults.
+ *
+ * @param uaddr User address
+ * @return 0 on success, -EFAULT if it's not mapped writeable
+ */
+static int fault_in_writeable(int *uaddr)
+{
+    struct page *page;
+
+    if (!(get_phys_pages(uaddr, GPP_WRITE | GPP_USER, &page, 1) & GPP_ACCESS_OK))
+        return -EFAULT;
+
+    page_unpin(page);
+    return 0;
+}
+
+/* The bucket locks are spinlocks, and we can't handle page faults while holding those. So user
+ * accesses under them don't fault: they fail with -EFAULT, and the caller drops its locks, faults
+ * the word in with futex_fault_in() and tries again.
+ */
+
+static long get_user32_nofault(unsigned int *uaddr, unsigned int *dest)
 {
-    bool has_timeout = false;
-    struct timespec ts
-    {
-    };
-    hrtime_t timeout = 0;
-    int st = 0;
+    pagefault_disable();
+    long st = get_user32(uaddr, dest);
+    pagefault_enable();
+    return st;
+}
 
-    if (utimespec != nullptr)
-    {
-        has_timeout = true;
-        if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
-            return -EFAULT;
+static long cmpxchg_user32_nofault(unsigned int *uaddr, unsigned int *expected,
+                                   unsigned int desired)
+{
+    pagefault_disable();
+    long st = cmpxchg_user32(uaddr, expected, desired);
+    pagefault_enable();
+    return st;
+}
 
-        if (!timespec_valid(&ts, false))
-            return -EINVAL;
-    }
+/**
+ * @brief Fault in a futex word after a _nofault access failed
+ *
+ * @param uaddr User address
+ * @param write True if we need to write to it
+ * @return 0 on success, -EFAULT if it's really not accessible
+ */
+static int futex_fault_in(int *uaddr, bool write)
+{
+    unsigned int val;
+
+    if (write)
+        return fault_in_writeable(uaddr);
+
+    return get_user32((unsigned int *) uaddr, &val) < 0 ? -EFAULT : 0;
+}
+
+int wait(int *uaddr, int val, int flags, const hrtime_t *timeout, uint32_t bitset)
+{
+    int st = 0;
 
-    timeout = timespec_to_hrtime(&ts);
+    if (bitset == 0)
+        return -EINVAL;
 
     futex_key key{};
 
@@ -300,28 +423,31 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
         return st;
 
     futex_queue queue{key};
+    queue.bitset = bitset;
 
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-	printk("wuaddr %p index %lu\n", uaddr, index);
-#endif
     /* After making a queue entry for this thread and this key,
      * we're going to atomically calculate a hash index and lock that hash index,
      * then check for the value(and if doesn't match, return -EAGAIN), and finally, sleep.
      */
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-    auto lock = &futex_hashtable_locks[hash_index];
-
     unsigned int curr_val = 0;
+    uint32_t hash_index;
 
-    if (get_user32((unsigned int *) uaddr, &curr_val) < 0)
+    for (;;)
     {
-        st = -EFAULT;
-        goto out;
+        hash_index = get_hashtable(key);
+
+        if (get_user32_nofault((unsigned int *) uaddr, &curr_val) == 0)
+            break;
+
+        spin_unlock(&futex_hashtable_locks[hash_index]);
+
+        if ((st = futex_fault_in(uaddr, false)) < 0)
+            return st;
     }
 
+    auto list_head = futex_hashtable.get_hashtable(hash_index);
+    auto lock = &futex_hashtable_locks[hash_index];
+
     if (curr_val != (unsigned int) val)
     {
         st = -EAGAIN;
@@ -330,8 +456,8 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
 
     list_add_tail(&queue.list_node, list_head);
 
-    if (has_timeout)
-        st = queue.wait(timeout, lock);
+    if (timeout)
+        st = queue.wait(*timeout, lock);
     else
         st = queue.wait(lock);
 
@@ -347,41 +473,27 @@ out:
     return st;
 }
 
-int wake(int *uaddr, int flags, int to_wake)
+/**
+ * @brief Wake up waiters of a futex, in a locked hash bucket
+ *
+ * @param head Bucket list
+ * @param key Futex key
+ * @param to_wake Maximum number of waiters to wake up
+ * @param bitset Only wake up waiters whose bitset has one of these bits set
+ * @return Number of waiters woken up
+ */
+static int wake_bucket(struct list_head *head, futex_key &key, int to_wake, uint32_t bitset)
 {
-    if (to_wake < 0)
-        return -EINVAL;
-
-    int st = 0;
-    futex_key key{};
-
-    if ((st = calculate_key(uaddr, flags, key)) < 0)
-        return st;
-
-        // printk("Shared: %s\n", key.both.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
-
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-
-	printk("uaddr %p index %lu\n", uaddr, index);
-#endif
-
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-
     int awaken = 0;
 
-    list_for_every_safe (list_head)
+    list_for_every_safe (head)
     {
         if (to_wake == 0)
             break;
 
         futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
 
-        MUST_HOLD_LOCK(&futex_hashtable_locks[hash_index]);
-
-        if (f->get_key() == key)
+        if (f->get_key() == key && f->bitset & bitset)
         {
             f->wake();
             to_wake--;
@@ -389,6 +501,25 @@ int wake(int *uaddr, int flags, int to_wake)
         }
     }
 
+    return awaken;
+}
+
+int wake(int *uaddr, int flags, int to_wake, uint32_t bitset)
+{
+    if (to_wake < 0 || bitset == 0)
+        return -EINVAL;
+
+    int st = 0;
+    futex_key key{};
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    auto hash_index = get_hashtable(key);
+    auto list_head = futex_hashtable.get_hashtable(hash_index);
+
+    int awaken = wake_bucket(list_head, key, to_wake, bitset);
+
     spin_unlock(&futex_hashtable_locks[hash_index]);
 
     return awaken;
@@ -421,23 +552,32 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
 
     // printk("Shared: %s\n", key.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
 
-    auto [hash_index1, hash_index2] = lock_two_hashes(key1, key2);
+    unsigned int on_uaddr = 0;
+    uint32_t hash_index1, hash_index2;
+
+    for (;;)
+    {
+        auto indices = lock_two_hashes(key1, key2);
+        hash_index1 = indices.first;
+        hash_index2 = indices.second;
+
+        /* Read val3 now that we're locked */
+        if (!val3_valid || get_user32_nofault((unsigned int *) uaddr, &on_uaddr) == 0)
+            break;
+
+        unlock_two_hashes(hash_index1, hash_index2);
+
+        if ((st = futex_fault_in(uaddr, false)) < 0)
+            return st;
+    }
 
     auto wake_list = futex_hashtable.get_hashtable(hash_index1);
     auto requeue_list = futex_hashtable.get_hashtable(hash_index2);
 
     int awaken = 0, requeued = 0;
 
-    /* Compare val3 now that we're locked */
     if (val3_valid)
     {
-        unsigned int on_uaddr;
-        if (get_user32((unsigned int *) uaddr, &on_uaddr) < 0)
-        {
-            st = -EFAULT;
-            goto out;
-        }
-
         if (on_uaddr != (unsigned int) val3)
         {
             st = -EAGAIN;
@@ -462,7 +602,12 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
             }
             else
             {
-                f->requeue(key2, requeue_list);
+                /* futex_waitv() waiters unqueue themselves from the buckets they were queued on,
+                 * so they can't move. Wake them up instead, they need to recheck anyway. */
+                if (f->waitv)
+                    f->wake();
+                else
+                    f->requeue(key2, requeue_list);
                 to_requeue--;
                 requeued++;
             }
@@ -490,6 +635,744 @@ int requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2)
     return cmp_requeue(uaddr, flags, to_wake, to_requeue, uaddr2, 0, false);
 }
 
+/**
+ * @brief Atomically apply a FUTEX_WAKE_OP operation to a user futex word
+ *
+ * @param uaddr User address
+ * @param op FUTEX_OP_*
+ * @param oparg Operand
+ * @param oldval Gets the old value
+ * @return 0 on success, -EFAULT if we faulted (it doesn't fault the page in)
+ */
+static int atomic_op_user(unsigned int *uaddr, unsigned int op, unsigned int oparg,
+                          unsigned int *oldval)
+{
+    unsigned int old;
+
+    if (get_user32_nofault(uaddr, &old) < 0)
+        return -EFAULT;
+
+    for (;;)
+    {
+        unsigned int newval = 0;
+
+        switch (op)
+        {
+            case FUTEX_OP_SET:
+                newval = oparg;
+                break;
+            case FUTEX_OP_ADD:
+                newval = old + oparg;
+                break;
+            case FUTEX_OP_OR:
+                newval = old | oparg;
+                break;
+            case FUTEX_OP_ANDN:
+                newval = old & ~oparg;
+                break;
+            case FUTEX_OP_XOR:
+                newval = old ^ oparg;
+                break;
+        }
+
+        unsigned int found = old;
+        if (cmpxchg_user32_nofault(uaddr, &found, newval) < 0)
+            return -EFAULT;
+
+        if (found == old)
+            break;
+
+        old = found;
+    }
+
+    *oldval = old;
+    return 0;
+}
+
+static bool wake_op_cmp(unsigned int cmp, int oldval, int cmparg)
+{
+    switch (cmp)
+    {
+        case FUTEX_OP_CMP_EQ:
+            return oldval == cmparg;
+        case FUTEX_OP_CMP_NE:
+            return oldval != cmparg;
+        case FUTEX_OP_CMP_LT:
+            return oldval < cmparg;
+        case FUTEX_OP_CMP_LE:
+            return oldval <= cmparg;
+        case FUTEX_OP_CMP_GT:
+            return oldval > cmparg;
+        case FUTEX_OP_CMP_GE:
+            return oldval >= cmparg;
+    }
+
+    return false;
+}
+
+/* Sign extend a 12-bit FUTEX_WAKE_OP argument */
+static int wake_op_arg(unsigned int arg)
+{
+    return (int) (arg << 20) >> 20;
+}
+
+int wake_op(int *uaddr, int flags, int to_wake, int to_wake2, int *uaddr2, unsigned int val3)
+{
+    if (to_wake < 0 || to_wake2 < 0 || (unsigned long) uaddr2 & (4 - 1))
+        return -EINVAL;
+
+    unsigned int op = (val3 >> 28) & 0xf;
+    unsigned int cmp = (val3 >> 24) & 0xf;
+    int oparg = wake_op_arg((val3 >> 12) & 0xfff);
+    int cmparg = wake_op_arg(val3 & 0xfff);
+
+    if (op & FUTEX_OP_OPARG_SHIFT)
+    {
+        if (oparg < 0 || oparg > 31)
+            return -EINVAL;
+        oparg = 1U << oparg;
+        op &= ~FUTEX_OP_OPARG_SHIFT;
+    }
+
+    if (op > FUTEX_OP_XOR || cmp > FUTEX_OP_CMP_GE)
+        return -ENOSYS;
+
+    int st = 0;
+    futex_key key1{};
+    futex_key key2{};
+
+    if ((st = calculate_key(uaddr, flags, key1)) < 0)
+        return st;
+
+    if ((st = calculate_key(uaddr2, flags, key2)) < 0)
+        return st;
+
+    unsigned int oldval;
+    uint32_t hash_index1, hash_index2;
+
+    for (;;)
+    {
+        auto indices = lock_two_hashes(key1, key2);
+        hash_index1 = indices.first;
+        hash_index2 = indices.second;
+
+        /* Do the operation on uaddr2 first, so waiters of uaddr2 that look at it after we wake
+         * uaddr's (but before we wake theirs) see the new value and don't go to sleep. */
+        if (atomic_op_user((unsigned int *) uaddr2, op, oparg, &oldval) == 0)
+            break;
+
+        unlock_two_hashes(hash_index1, hash_index2);
+
+        if ((st = futex_fault_in(uaddr2, true)) < 0)
+            return st;
+    }
+
+    st = wake_bucket(futex_hashtable.get_hashtable(hash_index1), key1, to_wake,
+                     FUTEX_BITSET_MATCH_ANY);
+
+    if (wake_op_cmp(cmp, (int) oldval, cmparg))
+    {
+        st += wake_bucket(futex_hashtable.get_hashtable(hash_index2), key2, to_wake2,
+                          FUTEX_BITSET_MATCH_ANY);
+    }
+
+    unlock_two_hashes(hash_index1, hash_index2);
+    return st;
+}
+
+/* PI futexes: the futex word holds the owner's TID. User space takes uncontended locks by
+ * cmpxchg'ing 0 -> TID, and only calls into the kernel when that fails. We then set FUTEX_WAITERS,
+ * so the owner's unlock also comes into the kernel, queue ourselves on the futex's pi state and
+ * boost the owner (and whatever owner the owner is blocked on) to our priority. Unlocks hand the
+ * lock directly to the top waiter, so lower priority threads can't steal it.
+ */
+
+static futex_pi_state *pi_state_find(futex_key &key, uint32_t hash_index)
+{
+    MUST_HOLD_LOCK(&futex_hashtable_locks[hash_index]);
+
+    list_for_every (futex_pi_states.get_hashtable(hash_index))
+    {
+        futex_pi_state *state = container_of(l, futex_pi_state, list_node);
+
+        if (state->key == key)
+            return state;
+    }
+
+    return nullptr;
+}
+
+/* The highest priority waiter. Waiters of the same priority get the lock in FIFO order. */
+static futex_queue *pi_top_waiter(futex_pi_state *state)
+{
+    futex_queue *top = nullptr;
+
+    list_for_every (&state->waiters)
+    {
+        futex_queue *q = list_head_cpp<futex_queue>::self_from_list_head(l);
+
+        if (!top || q->waiter->priority > top->waiter->priority)
+            top = q;
+    }
+
+    return top;
+}
+
+/**
+ * @brief Recalculate a thread's priority from its own and its PI waiters'
+ *
+ * @param thread Thread
+ * @return True if it changed, else false
+ */
+static bool pi_adjust_prio(struct thread *thread)
+{
+    MUST_HOLD_LOCK(&futex_pi_lock);
+
+    int base = thread->pi_saved_priority >= 0 ? thread->pi_saved_priority : thread->priority;
+    int prio = base;
+
+    list_for_every (&thread->pi_owned)
+    {
+        futex_pi_state *state = container_of(l, futex_pi_state, owner_node);
+        futex_queue *top = pi_top_waiter(state);
+
+        if (top && top->waiter->priority > prio)
+            prio = top->waiter->priority;
+    }
+
+    if (prio == thread->priority)
+        return false;
+
+    thread->pi_saved_priority = prio == base ? -1 : base;
+    sched_set_priority(thread, prio);
+    return true;
+}
+
+/* Boost (or unboost) an owner, and the owner of whatever it's blocked on, and so on */
+static void pi_propagate(struct thread *owner)
+{
+    for (unsigned int depth = 0; depth < futex_pi_max_depth; depth++)
+    {
+        if (!pi_adjust_prio(owner) || !owner->pi_blocked_on)
+            break;
+        owner = owner->pi_blocked_on->owner;
+    }
+}
+
+/* Check if blocking on state would make a PI chain loop back to thread */
+static bool pi_would_deadlock(futex_pi_state *state, struct thread *thread)
+{
+    for (unsigned int depth = 0; state && depth < futex_pi_max_depth; depth++)
+    {
+        if (state->owner == thread)
+            return true;
+        state = state->owner->pi_blocked_on;
+    }
+
+    return false;
+}
+
+static void pi_state_set_owner(futex_pi_state *state, struct thread *owner)
+{
+    MUST_HOLD_LOCK(&futex_pi_lock);
+    thread_get(owner);
+    state->owner = owner;
+    list_add_tail(&state->owner_node, &owner->pi_owned);
+}
+
+static void pi_state_change_owner(futex_pi_state *state, struct thread *owner)
+{
+    struct thread *old = state->owner;
+
+    list_remove(&state->owner_node);
+    pi_state_set_owner(state, owner);
+
+    pi_adjust_prio(old);
+    /* Exiting owners give their PI futexes away before dropping their last reference, so this
+     * can't be the last one. */
+    thread_put(old);
+
+    pi_propagate(owner);
+}
+
+static void pi_state_free(futex_pi_state *state)
+{
+    MUST_HOLD_LOCK(&futex_pi_lock);
+    assert(list_is_empty(&state->waiters));
+
+    list_remove(&state->owner_node);
+    futex_pi_states.remove_element(*state);
+    thread_put(state->owner);
+    delete state;
+}
+
+/**
+ * @brief Hand a PI futex over to its top waiter
+ * The caller takes care of the futex word, unless owner_died is set (then it's the new owner's
+ * job).
+ *
+ * @param state PI state
+ * @param top Top waiter
+ * @param owner_died True if the owner is exiting
+ */
+static void pi_hand_off(futex_pi_state *state, futex_queue *top, bool owner_died)
+{
+    struct thread *next = top->waiter;
+
+    next->pi_blocked_on = nullptr;
+    top->pi_owner_died = owner_died;
+    top->wake();
+
+    pi_state_change_owner(state, next);
+
+    if (list_is_empty(&state->waiters))
+        pi_state_free(state);
+}
+
+/* The word still has the dead owner's TID, so put ours in. Called without any locks held. */
+static int pi_fixup_owner_died(unsigned int *uaddr, unsigned int tid)
+{
+    unsigned int val;
+
+    if (get_user32(uaddr, &val) < 0)
+        return -EFAULT;
+
+    for (;;)
+    {
+        unsigned int found = val;
+        if (cmpxchg_user32(uaddr, &found, tid | FUTEX_OWNER_DIED | (val & FUTEX_WAITERS)) < 0)
+            return -EFAULT;
+
+        if (found == val)
+            return 0;
+
+        val = found;
+    }
+}
+
+int lock_pi(int *uaddr, int flags, const hrtime_t *timeout, bool trylock)
+{
+    struct thread *curr = get_current_thread();
+    unsigned int tid = curr->id;
+    struct thread *owner = nullptr;
+    futex_pi_state *state;
+    unsigned int val;
+    futex_key key{};
+    int st;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    if ((st = fault_in_writeable(uaddr)) < 0)
+        return st;
+
+    /* We can't allocate the pi state with the bucket locked */
+    unique_ptr<futex_pi_state> new_state;
+    if (!trylock)
+    {
+        new_state = make_unique<futex_pi_state>(key);
+        if (!new_state)
+            return -ENOMEM;
+    }
+
+    futex_queue queue{key};
+    bool fixup_owner_died = false;
+
+    auto hash_index = get_hashtable(key);
+    auto lock = &futex_hashtable_locks[hash_index];
+
+    for (;;)
+    {
+        unsigned int found;
+
+        if (get_user32_nofault((unsigned int *) uaddr, &val) < 0)
+            goto fault;
+
+        if ((val & FUTEX_TID_MASK) == tid)
+        {
+            st = -EDEADLK;
+            goto out;
+        }
+
+        state = pi_state_find(key, hash_index);
+
+        if (!(val & FUTEX_TID_MASK))
+        {
+            /* No one owns it, take it. Keep FUTEX_OWNER_DIED around for user space to see. */
+            found = val;
+            if (cmpxchg_user32_nofault((unsigned int *) uaddr, &found,
+                                       tid | (val & FUTEX_OWNER_DIED) |
+                                           (state ? FUTEX_WAITERS : 0)) < 0)
+                goto fault;
+
+            if (found != val)
+                continue;
+
+            if (state)
+            {
+                spin_lock(&futex_pi_lock);
+                pi_state_change_owner(state, curr);
+                spin_unlock(&futex_pi_lock);
+            }
+
+            st = 0;
+            goto out;
+        }
+
+        if (trylock)
+        {
+            st = -EAGAIN;
+            goto out;
+        }
+
+        if (val & FUTEX_WAITERS)
+            break;
+
+        found = val;
+        if (cmpxchg_user32_nofault((unsigned int *) uaddr, &found, val | FUTEX_WAITERS) < 0)
+            goto fault;
+
+        if (found == val)
+            break;
+        continue;
+    fault:
+        spin_unlock(lock);
+        if ((st = futex_fault_in(uaddr, true)) < 0)
+            return st;
+        spin_lock(lock);
+    }
+
+    spin_lock(&futex_pi_lock);
+
+    if (!state)
+    {
+        owner = thread_get_from_tid(val & FUTEX_TID_MASK);
+
+        if (!owner || !owner->owner || owner->flags & THREAD_PI_EXITED)
+        {
+            st = -ESRCH;
+            goto out_pi;
+        }
+
+        state = new_state.release();
+        pi_state_set_owner(state, owner);
+        futex_pi_states.add_element(*state);
+    }
+
+    if (pi_would_deadlock(state, curr))
+    {
+        st = -EDEADLK;
+        goto out_pi;
+    }
+
+    list_add_tail(&queue.list_node, &state->waiters);
+    curr->pi_blocked_on = state;
+    pi_propagate(state->owner);
+
+    spin_unlock(&futex_pi_lock);
+
+    if (timeout)
+        st = queue.wait(*timeout, lock);
+    else
+        st = queue.wait(lock);
+
+    spin_lock(&futex_pi_lock);
+
+    if (queue.was_awaken())
+    {
+        /* The lock got handed over to us. The pi state already says we own it, so we can fix up
+         * the word once we're unlocked. */
+        spin_unlock(&futex_pi_lock);
+        fixup_owner_died = queue.pi_owner_died;
+        st = 0;
+        goto out;
+    }
+
+    /* We timed out or got interrupted, so stop boosting the owner */
+    list_remove(&queue.list_node);
+    curr->pi_blocked_on = nullptr;
+    pi_propagate(state->owner);
+
+out_pi:
+    if (state && list_is_empty(&state->waiters))
+        pi_state_free(state);
+    spin_unlock(&futex_pi_lock);
+out:
+    spin_unlock(lock);
+
+    if (owner)
+        thread_put(owner);
+
+    if (fixup_owner_died)
+        st = pi_fixup_owner_died((unsigned int *) uaddr, tid);
+    return st;
+}
+
+int unlock_pi(int *uaddr, int flags)
+{
+    unsigned int tid = get_current_thread()->id;
+    futex_queue *top = nullptr;
+    unsigned int val, newval;
+    futex_key key{};
+    int st;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    if ((st = fault_in_writeable(uaddr)) < 0)
+        return st;
+
+    auto hash_index = get_hashtable(key);
+    auto lock = &futex_hashtable_locks[hash_index];
+
+retry:
+    if (get_user32_nofault((unsigned int *) uaddr, &val) < 0)
+    {
+        spin_unlock(lock);
+        if ((st = futex_fault_in(uaddr, true)) < 0)
+            return st;
+        spin_lock(lock);
+        goto retry;
+    }
+
+    spin_lock(&futex_pi_lock);
+
+    {
+        futex_pi_state *state = pi_state_find(key, hash_index);
+
+        newval = 0;
+        top = nullptr;
+
+        if (state)
+        {
+            top = pi_top_waiter(state);
+            /* Keep FUTEX_WAITERS set if anyone else is waiting */
+            newval = top->waiter->id;
+            if (state->waiters.next != state->waiters.prev)
+                newval |= FUTEX_WAITERS;
+        }
+
+        for (;;)
+        {
+            if ((val & FUTEX_TID_MASK) != tid)
+            {
+                st = -EPERM;
+                goto out_pi;
+            }
+
+            unsigned int found = val;
+            if (cmpxchg_user32_nofault((unsigned int *) uaddr, &found, newval) < 0)
+            {
+                spin_unlock(&futex_pi_lock);
+                spin_unlock(lock);
+                if ((st = futex_fault_in(uaddr, true)) < 0)
+                    return st;
+                spin_lock(lock);
+                goto retry;
+            }
+
+            if (found == val)
+                break;
+
+            /* User space set FUTEX_WAITERS (or FUTEX_OWNER_DIED) meanwhile */
+            val = found;
+        }
+
+        if (top)
+            pi_hand_off(state, top, false);
+
+        st = 0;
+    }
+
+out_pi:
+    spin_unlock(&futex_pi_lock);
+    spin_unlock(lock);
+    return st;
+}
+
+void exit_pi(struct thread *thread)
+{
+    for (;;)
+    {
+        spin_lock(&futex_pi_lock);
+
+        if (list_is_empty(&thread->pi_owned))
+        {
+            /* No one can make us own PI futexes from now on */
+            thread_set_flag(thread, THREAD_PI_EXITED);
+            spin_unlock(&futex_pi_lock);
+            return;
+        }
+
+        futex_key key =
+            container_of(list_first_element(&thread->pi_owned), futex_pi_state, owner_node)->key;
+
+        spin_unlock(&futex_pi_lock);
+
+        auto hash_index = get_hashtable(key);
+        spin_lock(&futex_pi_lock);
+
+        /* It may have lost its waiters while we weren't holding any lock */
+        futex_pi_state *state = pi_state_find(key, hash_index);
+        if (state && state->owner == thread)
+            pi_hand_off(state, pi_top_waiter(state), true);
+
+        spin_unlock(&futex_pi_lock);
+        spin_unlock(&futex_hashtable_locks[hash_index]);
+    }
+}
+
+static int waitv_sleep(futex_waitv_state *state)
+{
+    return wait_for_event_interruptible(&state->wq,
+                                        __atomic_load_n(&state->woken, __ATOMIC_ACQUIRE) >= 0);
+}
+
+static int waitv_sleep_timeout(futex_waitv_state *state, hrtime_t timeout)
+{
+    return wait_for_event_timeout_interruptible(
+        &state->wq, __atomic_load_n(&state->woken, __ATOMIC_ACQUIRE) >= 0, timeout);
+}
+
+static int do_waitv(struct futex_waitv *waiters, futex_queue *queues, unsigned int nr_futexes,
+                    const hrtime_t *timeout)
+{
+    futex_waitv_state state;
+    unsigned int queued;
+    int st = 0;
+
+    init_wait_queue_head(&state.wq);
+    state.woken = -1;
+
+    for (unsigned int i = 0; i < nr_futexes; i++)
+    {
+        struct futex_waitv *w = &waiters[i];
+
+        if (w->flags & ~(FUTEX2_SIZE_U32 | FUTEX2_PRIVATE) || !(w->flags & FUTEX2_SIZE_U32) ||
+            w->__reserved || w->uaddr & (4 - 1) || w->val > UINT32_MAX)
+            return -EINVAL;
+
+        if ((st = calculate_key((int *) w->uaddr, w->flags & FUTEX2_PRIVATE, queues[i].key)) < 0)
+            return st;
+
+        queues[i].waitv = &state;
+        queues[i].waitv_index = i;
+    }
+
+    /* Queue on every futex, checking values like FUTEX_WAIT does. Wakes that come in while we're
+     * still at it are fine, they just make the sleep below return right away. */
+    for (queued = 0; queued < nr_futexes; queued++)
+    {
+        futex_queue *q = &queues[queued];
+        int *uaddr = (int *) waiters[queued].uaddr;
+        unsigned int val;
+        uint32_t hash_index;
+
+        for (;;)
+        {
+            hash_index = get_hashtable(q->key);
+
+            if (get_user32_nofault((unsigned int *) uaddr, &val) == 0)
+                break;
+
+            /* Anything we already queued on may wake us up meanwhile, which is fine */
+            spin_unlock(&futex_hashtable_locks[hash_index]);
+
+            if ((st = futex_fault_in(uaddr, false)) < 0)
+                break;
+        }
+
+        if (st < 0)
+            break;
+
+        if (val != (unsigned int) waiters[queued].val)
+            st = -EAGAIN;
+        else
+            list_add_tail(&q->list_node, futex_hashtable.get_hashtable(hash_index));
+
+        spin_unlock(&futex_hashtable_locks[hash_index]);
+
+        if (st < 0)
+            break;
+    }
+
+    if (st == 0)
+        st = timeout ? waitv_sleep_timeout(&state, *timeout) : waitv_sleep(&state);
+
+    /* Unqueue whatever didn't get woken up. Wakers hold the bucket lock, so once we've gone
+     * through all of them, no one's touching the state anymore. */
+    for (unsigned int i = 0; i < queued; i++)
+    {
+        auto hash_index = get_hashtable(queues[i].key);
+
+        if (!queues[i].was_awaken())
+            futex_hashtable.remove_element(queues[i]);
+
+        spin_unlock(&futex_hashtable_locks[hash_index]);
+    }
+
+    /* A wake wins over errors and timeouts */
+    int woken = __atomic_load_n(&state.woken, __ATOMIC_ACQUIRE);
+    return woken >= 0 ? woken : st;
+}
+
+int waitv(struct futex_waitv *uwaiters, unsigned int nr_futexes, unsigned int flags,
+          const hrtime_t *timeout)
+{
+    if (flags != 0 || nr_futexes == 0 || nr_futexes > FUTEX_WAITV_MAX)
+        return -EINVAL;
+
+    struct futex_waitv *waiters = new struct futex_waitv[nr_futexes];
+    futex_queue *queues = new futex_queue[nr_futexes];
+    int st = -ENOMEM;
+
+    if (!waiters || !queues)
+        goto out;
+
+    st = -EFAULT;
+    if (copy_from_user(waiters, uwaiters, sizeof(struct futex_waitv) * nr_futexes) < 0)
+        goto out;
+
+    st = do_waitv(waiters, queues, nr_futexes, timeout);
+out:
+    delete[] waiters;
+    delete[] queues;
+    return st;
+}
+
+/**
+ * @brief Read a futex timeout from user space
+ *
+ * @param utimespec User timespec
+ * @param absolute If true, it's an absolute time on clock, else it's relative
+ * @param clock Clock
+ * @param out Relative timeout, in ns
+ * @return 0 on success, negative error code
+ */
+int get_timeout(const struct timespec *utimespec, bool absolute, clockid_t clock, hrtime_t *out)
+{
+    struct timespec ts;
+
+    if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
+        return -EFAULT;
+
+    if (!timespec_valid(&ts, false))
+        return -EINVAL;
+
+    *out = timespec_to_hrtime(&ts);
+
+    if (absolute)
+    {
+        struct timespec now;
+        clock_gettime_kernel(clock, &now);
+
+        hrtime_t now_ns = timespec_to_hrtime(&now);
+        *out = *out > now_ns ? *out - now_ns : 0;
+    }
+
+    return 0;
+}
+
 }; // namespace futex
 
 int futex_wake(int *uaddr, int nr_waiters)
@@ -497,11 +1380,15 @@ int futex_wake(int *uaddr, int nr_waiters)
     if ((unsigned long) uaddr & (4 - 1))
         return -EINVAL;
 
-    return futex::wake(uaddr, 0, nr_waiters);
+    return futex::wake(uaddr, 0, nr_waiters, FUTEX_BITSET_MATCH_ANY);
+}
+
+void futex_exit_pi(struct thread *thread)
+{
+    futex::exit_pi(thread);
 }
 
-/* TODO: Add FUTEX_CLOCK_REALTIME support */
-#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG)
+#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
 static inline int get_val2(const struct timespec *t)
 {
@@ -512,6 +1399,10 @@ int sys_futex(int *uaddr, int futex_op, int val, const struct timespec *timeout,
               int val3)
 {
     int flags = (futex_op & ~FUTEX_OP_MASK);
+    int op = futex_op & FUTEX_OP_MASK;
+    hrtime_t rel_timeout;
+    hrtime_t *ptimeout = nullptr;
+    int st;
 
     /* Error out on bad flags */
     if (flags & ~FUTEX_KNOWN_FLAGS)
@@ -521,18 +1412,67 @@ int sys_futex(int *uaddr, int futex_op, int val, const struct timespec *timeout,
     if ((unsigned long) uaddr & (4 - 1))
         return -EINVAL;
 
-    switch (futex_op & FUTEX_OP_MASK)
+    if (op == FUTEX_WAIT || op == FUTEX_WAIT_BITSET || op == FUTEX_LOCK_PI)
+    {
+        if (timeout)
+        {
+            /* FUTEX_WAIT's timeout is relative, the others' are absolute. FUTEX_LOCK_PI's is
+             * always measured against CLOCK_REALTIME. */
+            bool realtime = flags & FUTEX_CLOCK_REALTIME || op == FUTEX_LOCK_PI;
+
+            st = futex::get_timeout(timeout, op != FUTEX_WAIT,
+                                    realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC, &rel_timeout);
+            if (st < 0)
+                return st;
+
+            ptimeout = &rel_timeout;
+        }
+    }
+    else if (flags & FUTEX_CLOCK_REALTIME)
+        return -ENOSYS;
+
+    switch (op)
     {
         case FUTEX_WAIT:
-            return futex::wait(uaddr, val, flags, timeout);
+            return futex::wait(uaddr, val, flags, ptimeout, FUTEX_BITSET_MATCH_ANY);
         case FUTEX_WAKE:
-            return futex::wake(uaddr, flags, val);
+            return futex::wake(uaddr, flags, val, FUTEX_BITSET_MATCH_ANY);
+        case FUTEX_WAIT_BITSET:
+            return futex::wait(uaddr, val, flags, ptimeout, val3);
+        case FUTEX_WAKE_BITSET:
+            return futex::wake(uaddr, flags, val, val3);
         case FUTEX_CMP_REQUEUE:
             return futex::cmp_requeue(uaddr, flags, val, get_val2(timeout), uaddr2, val3);
         case FUTEX_REQUEUE:
             // printk("futex(%p, %d, %d)(op %d)\n", uaddr, futex_op, val, futex_op & FUTEX_OP_MASK);
             return futex::requeue(uaddr, flags, val, get_val2(timeout), uaddr2);
+        case FUTEX_WAKE_OP:
+            return futex::wake_op(uaddr, flags, val, get_val2(timeout), uaddr2, val3);
+        case FUTEX_LOCK_PI:
+            return futex::lock_pi(uaddr, flags, ptimeout, false);
+        case FUTEX_TRYLOCK_PI:
+            return futex::lock_pi(uaddr, flags, nullptr, true);
+        case FUTEX_UNLOCK_PI:
+            return futex::unlock_pi(uaddr, flags);
         default:
             return -ENOSYS;
     }
 }
+
+int sys_futex_waitv(struct futex_waitv *waiters, unsigned int nr_futexes, unsigned int flags,
+                    const struct timespec *timeout, clockid_t clockid)
+{
+    hrtime_t rel_timeout;
+
+    if (timeout)
+    {
+        if (clockid != CLOCK_MONOTONIC && clockid != CLOCK_REALTIME)
+            return -EINVAL;
+
+        int st = futex::get_timeout(timeout, true, clockid, &rel_timeout);
+        if (st < 0)
+            return st;
+    }
+
+    return futex::waitv(waiters, nr_futexes, flags, timeout ? &rel_timeout : nullptr);
+}
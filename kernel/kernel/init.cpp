@@ -67,7 +67,6 @@
 #include <onyx/vdso.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
-#include <onyx/worker.h>
 
 #include <acpica/acpi.h>
 #include <pci/pci.h>
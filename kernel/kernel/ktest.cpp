@@ -118,6 +118,91 @@ void page_alloc_perf(void)
 
 #endif
 
+#ifdef CONFIG_KTEST_TIMER
+
+#include <stdlib.h>
+
+#include <onyx/random.h>
+#include <onyx/timer.h>
+
+#define TIMER_TEST_NR_EVENTS 10000
+
+/* ev->priv values */
+#define TIMER_TEST_QUEUED    ((void *) 0)
+#define TIMER_TEST_CANCELLED ((void *) 1)
+#define TIMER_TEST_FIRED     ((void *) 2)
+
+static unsigned long timer_test_early;
+static unsigned long timer_test_bad_cancels;
+
+static void timer_test_callback(struct clockevent *ev)
+{
+    if (clocksource_get_time() < ev->deadline)
+        timer_test_early++;
+    if (ev->priv == TIMER_TEST_CANCELLED)
+        timer_test_bad_cancels++;
+    ev->priv = TIMER_TEST_FIRED;
+}
+
+/* Queues lots of high resolution and coarse events, and cancels about half of them */
+void timer_stress_test(void)
+{
+    struct clockevent *evs =
+        (struct clockevent *) calloc(TIMER_TEST_NR_EVENTS, sizeof(struct clockevent));
+    assert(evs != NULL);
+
+    timer_test_early = timer_test_bad_cancels = 0;
+    hrtime_t now = clocksource_get_time();
+
+    for (unsigned int i = 0; i < TIMER_TEST_NR_EVENTS; i++)
+    {
+        struct clockevent *ev = &evs[i];
+        ev->callback = timer_test_callback;
+        ev->priv = TIMER_TEST_QUEUED;
+        ev->flags = CLOCKEVENT_FLAG_ATOMIC | (i & 1 ? CLOCKEVENT_FLAG_COARSE : 0);
+        /* Between 1ms and 2s */
+        ev->deadline = now + NS_PER_MS + (arc4random() % (2000 * NS_PER_MS));
+        timer_queue_clockevent(ev);
+    }
+
+    for (unsigned int i = 0; i < TIMER_TEST_NR_EVENTS; i++)
+    {
+        if (arc4random() & 1)
+            continue;
+
+        timer_cancel_event(&evs[i]);
+
+        /* If it didn't fire before we got to it, it must never fire */
+        if (evs[i].priv == TIMER_TEST_QUEUED)
+            evs[i].priv = TIMER_TEST_CANCELLED;
+    }
+
+    /* Coarse events may be late by up to 1/8th of the timeout */
+    sched_sleep_ms(2000 + 2000 / 8 + 10);
+
+    unsigned long fired = 0, cancelled = 0;
+
+    for (unsigned int i = 0; i < TIMER_TEST_NR_EVENTS; i++)
+    {
+        assert(evs[i].priv != TIMER_TEST_QUEUED);
+        assert(!(evs[i].flags & CLOCKEVENT_FLAG_POISON));
+
+        if (evs[i].priv == TIMER_TEST_FIRED)
+            fired++;
+        else
+            cancelled++;
+    }
+
+    printk("timer test: %lu fired, %lu cancelled, %lu early\n", fired, cancelled,
+           timer_test_early);
+    assert(timer_test_early == 0);
+    assert(timer_test_bad_cancels == 0);
+
+    free(evs);
+}
+
+#endif
+
 void execute_vm_tests();
 
 static void (*tests[])(void) = {
@@ -139,6 +224,9 @@ static void (*tests[])(void) = {
 #ifdef CONFIG_KTEST_ALLOC_PAGE_PERF
     page_alloc_perf,
 #endif
+#ifdef CONFIG_KTEST_TIMER
+    timer_stress_test,
+#endif
 };
 
 void do_ktests_old(void)
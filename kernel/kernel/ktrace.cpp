@@ -5,22 +5,251 @@
  */
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
+#include <onyx/cpu.h>
+#include <onyx/dev.h>
+#include <onyx/init.h>
 #include <onyx/ktrace.h>
+#include <onyx/mm/vm_object.h>
 #include <onyx/modules.h>
+#include <onyx/mutex.h>
 #include <onyx/process.h>
-#include <onyx/spinlock.h>
+#include <onyx/rwlock.h>
 #include <onyx/symbol.h>
+#include <onyx/tracepoint.h>
+#include <onyx/user.h>
 
 #include <onyx/hashtable.hpp>
 #include <onyx/linker_section.hpp>
 #include <onyx/memory.hpp>
 #include <onyx/utility.hpp>
 
+static_assert(KTRACE_SUBBUF_SIZE == PAGE_SIZE);
+static_assert(KTRACE_RING_MMAP_SIZE == (KTRACE_RING_DATA_PAGES + 1) * PAGE_SIZE);
+
+unsigned long ktrace_enabled_events = 0;
+
+struct ktrace_ring
+{
+    struct ktrace_ring_header *hdr;
+    uint8_t *data;
+    struct page *hdr_page;
+    struct page *data_pages;
+    /* Head after the record that's currently reserved */
+    uint64_t reserved_head;
+};
+
+/* Each CPU only ever touches its own ring, with IRQs disabled, so the rings need no locks. The
+ * only thing we share is the header, with the consumer.
+ */
+static struct ktrace_ring *rings;
+static DECLARE_MUTEX(rings_lock);
+
+static void ktrace_free_ring(struct ktrace_ring *ring)
+{
+    if (ring->hdr_page)
+        free_page(ring->hdr_page);
+    if (ring->data_pages)
+        free_pages(ring->data_pages);
+}
+
+/**
+ * @brief Allocate every CPU's trace ring, if we haven't yet
+ *
+ * @return 0 on success, negative error codes
+ */
+static int ktrace_alloc_rings()
+{
+    scoped_mutex g{rings_lock};
+
+    if (rings)
+        return 0;
+
+    unsigned int nr_cpus = get_nr_cpus();
+    struct ktrace_ring *r = (ktrace_ring *) calloc(nr_cpus, sizeof(ktrace_ring));
+    if (!r)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < nr_cpus; i++)
+    {
+        struct ktrace_ring *ring = &r[i];
+        ring->hdr_page = alloc_page(0);
+        /* Keep these zeroed: they get mapped to user space, and padding records don't
+         * overwrite anything past their header.
+         */
+        ring->data_pages = alloc_pages(KTRACE_RING_DATA_PAGES, PAGE_ALLOC_CONTIGUOUS);
+
+        if (!ring->hdr_page || !ring->data_pages)
+        {
+            for (unsigned int j = 0; j <= i; j++)
+                ktrace_free_ring(&r[j]);
+            free(r);
+            return -ENOMEM;
+        }
+
+        ring->hdr = (ktrace_ring_header *) PAGE_TO_VIRT(ring->hdr_page);
+        ring->data = (uint8_t *) PAGE_TO_VIRT(ring->data_pages);
+        ring->hdr->data_size = KTRACE_RING_DATA_SIZE;
+        ring->hdr->subbuf_size = KTRACE_SUBBUF_SIZE;
+    }
+
+    __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *ktrace_reserve(unsigned int type, size_t size)
+{
+    struct ktrace_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    if (!r)
+        return nullptr;
+
+    unsigned int cpu = get_cpu_nr();
+    struct ktrace_ring *ring = &r[cpu];
+    struct ktrace_ring_header *hdr = ring->hdr;
+
+    size = ALIGN_TO(size, KTRACE_RECORD_ALIGN);
+
+    uint64_t head = hdr->head;
+    /* Note: tail is written by userspace, so it may be garbage. That only hurts the tracer */
+    uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    size_t off = head & (KTRACE_RING_DATA_SIZE - 1);
+    size_t room = KTRACE_SUBBUF_SIZE - (off & (KTRACE_SUBBUF_SIZE - 1));
+    /* Records don't cross sub-buffers, so pad out the rest of this one if we don't fit */
+    size_t pad = size > room ? room : 0;
+
+    if (head + pad + size - tail > KTRACE_RING_DATA_SIZE)
+    {
+        hdr->lost++;
+        return nullptr;
+    }
+
+    if (pad)
+    {
+        struct ktrace_record *padding = (ktrace_record *) (ring->data + off);
+        padding->type = KTRACE_EV_PADDING;
+        padding->size = pad;
+        head += pad;
+    }
+
+    struct ktrace_record *rec =
+        (ktrace_record *) (ring->data + (head & (KTRACE_RING_DATA_SIZE - 1)));
+    rec->type = type;
+    rec->size = size;
+    rec->cpu = cpu;
+    rec->timestamp = clocksource_get_time();
+
+    ring->reserved_head = head + size;
+
+    return rec;
+}
+
+void ktrace_commit(void *record)
+{
+    struct ktrace_ring *ring = &rings[get_cpu_nr()];
+
+    /* Publish the record (and any padding before it) to the consumer */
+    __atomic_store_n(&ring->hdr->head, ring->reserved_head, __ATOMIC_RELEASE);
+}
+
+template <typename Event>
+static Event *ktrace_reserve_event(unsigned int type)
+{
+    return (Event *) ktrace_reserve(type, sizeof(Event));
+}
+
+static uint32_t ktrace_current_tid()
+{
+    struct thread *t = get_current_thread();
+    return t ? t->id : 0;
+}
+
+void __trace_sched_switch(uint32_t prev_tid, uint32_t next_tid, int prev_status)
+{
+    unsigned long flags = irq_save_and_disable();
+
+    auto ev = ktrace_reserve_event<ktrace_sched_switch_event>(KTRACE_EV_SCHED_SWITCH);
+    if (ev)
+    {
+        ev->prev_tid = prev_tid;
+        ev->next_tid = next_tid;
+        ev->prev_status = prev_status;
+        ev->pad = 0;
+        ktrace_commit(ev);
+    }
+
+    irq_restore(flags);
+}
+
+void __trace_page_fault(unsigned long address, unsigned long ip, unsigned int pf_flags)
+{
+    unsigned long flags = irq_save_and_disable();
+
+    auto ev = ktrace_reserve_event<ktrace_page_fault_event>(KTRACE_EV_PAGE_FAULT);
+    if (ev)
+    {
+        ev->address = address;
+        ev->ip = ip;
+        ev->tid = ktrace_current_tid();
+        ev->flags = pf_flags;
+        ktrace_commit(ev);
+    }
+
+    irq_restore(flags);
+}
+
+static void ktrace_block_rq(unsigned int type, uint64_t sector, uint64_t length, unsigned int op,
+                            unsigned int status)
+{
+    unsigned long flags = irq_save_and_disable();
+
+    auto ev = ktrace_reserve_event<ktrace_block_rq_event>(type);
+    if (ev)
+    {
+        ev->sector = sector;
+        ev->length = length;
+        ev->op = op;
+        ev->status = status;
+        ktrace_commit(ev);
+    }
+
+    irq_restore(flags);
+}
+
+void __trace_block_rq_issue(uint64_t sector, uint64_t length, unsigned int op)
+{
+    ktrace_block_rq(KTRACE_EV_BLOCK_RQ_ISSUE, sector, length, op, 0);
+}
+
+void __trace_block_rq_complete(uint64_t sector, uint64_t length, unsigned int op,
+                               unsigned int status)
+{
+    ktrace_block_rq(KTRACE_EV_BLOCK_RQ_COMPLETE, sector, length, op, status);
+}
+
+void __trace_tcp_retransmit(uint16_t sport, uint16_t dport, uint32_t seq, unsigned int try_nr)
+{
+    unsigned long flags = irq_save_and_disable();
+
+    auto ev = ktrace_reserve_event<ktrace_tcp_retransmit_event>(KTRACE_EV_TCP_RETRANSMIT);
+    if (ev)
+    {
+        ev->sport = sport;
+        ev->dport = dport;
+        ev->seq = seq;
+        ev->try_nr = try_nr;
+        ev->pad = 0;
+        ktrace_commit(ev);
+    }
+
+    irq_restore(flags);
+}
+
 namespace ktrace
 {
 
-static struct spinlock tracepoint_lock;
+/* Protects tracepoint_list and mcount_index. Tracing only try-locks it, so it never spins */
+static rwslock tracepoint_lock;
 static cul::hashtable<unique_ptr<ktracepoint>, 16, fnv_hash_t, ktracepoint::hash> tracepoint_list;
 
 DEFINE_LINKER_SECTION_SYMS(__mcount_loc_start, __mcount_loc_end);
@@ -29,6 +258,54 @@ DEFINE_LINKER_SECTION_SYMS(__return_loc_start, __return_loc_end);
 linker_section mcount_loc_section(&__mcount_loc_start, &__mcount_loc_end);
 linker_section return_loc_section(&__return_loc_start, &__return_loc_end);
 
+static loc_index mcount_index;
+
+static int loc_compare(const void *a, const void *b)
+{
+    unsigned long la = *(const unsigned long *) a;
+    unsigned long lb = *(const unsigned long *) b;
+
+    if (la == lb)
+        return 0;
+    return la < lb ? -1 : 1;
+}
+
+bool loc_index::init(linker_section &section)
+{
+    size_t nr = section.size() / sizeof(unsigned long);
+    /* Note: Allocate at least one entry, so an empty section still counts as initialized */
+    unsigned long *l = (unsigned long *) malloc(cul::max(nr, (size_t) 1) * sizeof(unsigned long));
+    if (!l)
+        return false;
+
+    memcpy(l, section.as<unsigned long>(), nr * sizeof(unsigned long));
+    qsort(l, nr, sizeof(unsigned long), loc_compare);
+
+    locs = l;
+    nr_locs = nr;
+    return true;
+}
+
+unsigned long loc_index::find(unsigned long start, unsigned long end) const
+{
+    /* Find the first location >= start */
+    size_t lo = 0, hi = nr_locs;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (locs[mid] < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < nr_locs && locs[lo] < end)
+        return locs[lo];
+
+    return -1;
+}
+
 fnv_hash_t ktracepoint::hash(unique_ptr<ktracepoint> &p)
 {
     return fnv_hash(&p->mcount_call_addr, sizeof(p->mcount_call_addr));
@@ -36,13 +313,8 @@ fnv_hash_t ktracepoint::hash(unique_ptr<ktracepoint> &p)
 
 bool ktracepoint::find_call_addrs()
 {
-    mcount_call_addr = search_loc<mcount_loc_section>();
+    mcount_call_addr = search_loc(mcount_index);
     return !(mcount_call_addr == search_bad_addr);
-#if 0
-	return_call_addr = search_loc<return_loc_section>();
-	if(return_call_addr == search_bad_addr)
-		return false;
-#endif
 }
 
 bool append_tracepoint(unique_ptr<ktracepoint> &p)
@@ -58,11 +330,18 @@ int add_function(const char *func)
     if (!s)
         return -EINVAL;
 
-    scoped_lock g{tracepoint_lock};
+    tracepoint_lock.lock_write();
+
+    if (!mcount_index.initialized() && !mcount_index.init(mcount_loc_section))
+    {
+        tracepoint_lock.unlock_write();
+        return -ENOMEM;
+    }
 
     unique_ptr<ktracepoint> p = make_unique<ktracepoint>(func, s);
     if (!p)
     {
+        tracepoint_lock.unlock_write();
         return -ENOMEM;
     }
 
@@ -71,74 +350,51 @@ int add_function(const char *func)
 
     if (!raw->find_call_addrs())
     {
-        return false;
-    }
-
-    if (!raw->allocate_buffer())
-    {
-        return false;
+        /* Not compiled with mcount calls */
+        tracepoint_lock.unlock_write();
+        return -ENOENT;
     }
 
     if (!append_tracepoint(p))
     {
-        return false;
+        tracepoint_lock.unlock_write();
+        return -ENOMEM;
     }
 
+    tracepoint_lock.unlock_write();
+
     raw->activate();
 
-    return true;
+    return 0;
 }
 
-void ktracepoint::put_entry(ktrace_ftrace_data &data)
+void ktracepoint::log_entry(unsigned long ip, unsigned long caller)
 {
-    scoped_lock g{buf_lock};
-
-    size_t off = write_pointer;
+    if (!(__atomic_load_n(&ktrace_enabled_events, __ATOMIC_RELAXED) &
+          KTRACE_EV_MASK(KTRACE_EV_FUNCTION)))
+        return;
 
-    if (off + sizeof(ktrace_ftrace_data) > ring_buffer_size)
-    {
-        /* Wrap around */
-        off = write_pointer = 0;
-    }
+    struct process *curr_process = get_current_process();
+    unsigned long flags = irq_save_and_disable();
 
-    if (off + sizeof(ktrace_ftrace_data) > read_pointer && off <= read_pointer)
+    auto ev = ktrace_reserve_event<ktrace_function_event>(KTRACE_EV_FUNCTION);
+    if (ev)
     {
-        nr_overruns++;
+        ev->tid = ktrace_current_tid();
+        ev->pid = curr_process ? curr_process->get_pid() : 0;
+        ev->ip = ip;
+        ev->caller = caller;
+        ktrace_commit(ev);
     }
 
-    uint8_t *ptr = ((uint8_t *) PAGE_TO_VIRT(ring_buffer)) + off;
-    memcpy(ptr, &data, sizeof(data));
-
-    write_pointer += sizeof(data);
-}
-
-void ktracepoint::log_entry(unsigned long ip, unsigned long caller)
-{
-    (void) ip;
-    ktrace_ftrace_data data;
-    struct thread *current_thread = get_current_thread();
-    struct process *curr_process = get_current_process();
-
-    if (curr_process)
-        data.pid = curr_process->get_pid();
-    if (current_thread)
-        data.tid = current_thread->id;
-    data.timestamp = get_main_clock()->get_ns();
-    data.type = KTRACE_TYPE_ENTRY;
-    data.caller = caller;
-
-    put_entry(data);
-}
-
-bool ktracepoint::allocate_buffer()
-{
-    ring_buffer = alloc_pages(ring_buffer_size >> PAGE_SHIFT, PAGE_ALLOC_CONTIGUOUS);
-    return ring_buffer != nullptr;
+    irq_restore(flags);
 }
 
 void log_func_entry(unsigned long ip, unsigned long caller)
 {
-    scoped_lock g{tracepoint_lock};
+    /* We may have been called with the lock held, so don't wait for it */
+    if (tracepoint_lock.try_read() < 0)
+        return;
 
     auto it = tracepoint_list.get_hash_list_begin(fnv_hash(&ip, sizeof(ip)));
     auto end = tracepoint_list.get_hash_list_end(fnv_hash(&ip, sizeof(ip)));
@@ -154,10 +410,113 @@ void log_func_entry(unsigned long ip, unsigned long caller)
 
         it++;
     }
+
+    tracepoint_lock.unlock_read();
 }
 
 }; // namespace ktrace
 
+static unsigned int ktrace_ioctl(int request, void *argp, struct file *file)
+{
+    switch (request)
+    {
+        case KTRACE_GET_INFO: {
+            struct ktrace_info info;
+            info.nr_cpus = get_nr_cpus();
+            info.data_size = KTRACE_RING_DATA_SIZE;
+            info.subbuf_size = KTRACE_SUBBUF_SIZE;
+            info.mmap_size = KTRACE_RING_MMAP_SIZE;
+            return copy_to_user(argp, &info, sizeof(info));
+        }
+
+        case KTRACE_ENABLE_EVENTS: {
+            uint64_t mask;
+            if (copy_from_user(&mask, argp, sizeof(mask)) < 0)
+                return -EFAULT;
+
+            if (mask & ~(KTRACE_EV_MASK(KTRACE_EV_MAX) - 1))
+                return -EINVAL;
+
+            if (int st = ktrace_alloc_rings(); st < 0)
+                return st;
+
+            __atomic_store_n(&ktrace_enabled_events, mask, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        case KTRACE_TRACE_FUNCTION: {
+            user_string name;
+            if (auto ex = name.from_user((const char *) argp); ex.has_error())
+                return ex.error();
+
+            int st = ktrace::add_function(name.data());
+            /* The tracepoint keeps the name around */
+            if (st == 0)
+                name.release();
+            return st;
+        }
+    }
+
+    return -ENOTTY;
+}
+
+/**
+ * @brief Map a CPU's trace ring. The offset selects the CPU.
+ *
+ * @param area Region
+ * @param f File
+ * @return Address of the mapping, or NULL with errno set
+ */
+static void *ktrace_mmap(struct vm_region *area, struct file *f)
+{
+    unsigned long cpu = area->offset / KTRACE_RING_MMAP_SIZE;
+
+    if (area->offset % KTRACE_RING_MMAP_SIZE || cpu >= get_nr_cpus() ||
+        area->pages << PAGE_SHIFT != KTRACE_RING_MMAP_SIZE)
+        return errno = EINVAL, nullptr;
+
+    if (ktrace_alloc_rings() < 0)
+        return errno = ENOMEM, nullptr;
+
+    struct ktrace_ring *ring = &rings[cpu];
+    struct vm_object *vmo = vmo_create(KTRACE_RING_MMAP_SIZE, nullptr);
+    if (!vmo)
+        return errno = ENOMEM, nullptr;
+
+    unsigned long data_phys = (unsigned long) page_to_phys(ring->data_pages);
+
+    for (size_t i = 0; i < KTRACE_RING_DATA_PAGES + 1; i++)
+    {
+        struct page *p =
+            i == 0 ? ring->hdr_page : phys_to_page(data_phys + ((i - 1) << PAGE_SHIFT));
+
+        /* The vmo frees its pages when it goes away, but these belong to the ring */
+        page_ref(p);
+
+        if (vmo_add_page(i << PAGE_SHIFT, p, vmo) < 0)
+        {
+            free_page(p);
+            vmo_destroy(vmo);
+            return errno = ENOMEM, nullptr;
+        }
+    }
+
+    vmo_assign_mapping(vmo, area);
+    vmo->flags |= VMO_FLAG_DEVICE_MAPPING;
+
+    area->vmo = vmo;
+    area->offset = 0;
+
+    return (void *) area->base;
+}
+
+const file_ops ktrace_fops = {.ioctl = ktrace_ioctl, .mmap = ktrace_mmap};
+
 void ktrace_init(void)
 {
+    auto ex = dev_register_chardevs(0, 1, 0, &ktrace_fops, "ktrace");
+
+    ex.unwrap()->show(0600);
 }
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(ktrace_init);
@@ -7,11 +7,15 @@
 #include <stdio.h>
 
 #include <onyx/array.h>
+#include <onyx/block.h>
+#include <onyx/fnv.h>
 #include <onyx/mm/flush.h>
 #include <onyx/scheduler.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/signal.h>
 #include <onyx/vfs.h>
 
-static void flush_thr_init(void *arg);
+extern size_t nr_global_pages;
 
 namespace flush
 {
@@ -19,49 +23,230 @@ namespace flush
 static constexpr unsigned long nr_wb_threads = 4UL;
 array<flush::flush_dev, nr_wb_threads> thread_list;
 
+/* Bytes of data that are dirty, and that are being written out. Filesystem blocks may be smaller
+ * than a page, so these are kept in bytes rather than in objects.
+ */
+static atomic<unsigned long> nr_dirty{0};
+static atomic<unsigned long> nr_writeback{0};
+
+/* Dirty thresholds, in percent of total memory. Past the background threshold, writeback starts
+ * right away. Writers get throttled more and more as they go from halfway between the two up to
+ * the dirty threshold, and past that they wait until writeback catches up.
+ */
+static constexpr unsigned long dirty_background_ratio = 10;
+static constexpr unsigned long dirty_ratio = 20;
+static constexpr unsigned long max_pause_ms = 200;
+
+/* Every wb_share_period written bytes, the devs' writeout counts get halved, so a dev's share of
+ * the dirty threshold follows its recent writeout rate.
+ */
+static constexpr unsigned long wb_share_period = 4096 * PAGE_SIZE;
+static atomic<unsigned long> total_written{0};
+
 void flush_dev::init()
 {
-    thread = sched_create_thread(flush_thr_init, THREAD_KERNEL, (void *) this);
-    assert(thread != nullptr);
-    sched_start_thread(thread);
+    delayed_work_init(&wb_work, wb_work_func);
+    work_init(&wb_now_work, wb_now_work_func);
 }
 
-void flush_dev::sync()
+void flush_dev::queue_writeback()
 {
-    lock();
+    queue_delayed_work(system_unbound_wq, &wb_work, wb_run_delta_ms * NS_PER_MS);
+}
+
+void flush_dev::kick_writeback()
+{
+    queue_work(system_unbound_wq, &wb_now_work);
+}
+
+static unsigned long flush_obj_size(struct flush_object *obj)
+{
+    return obj->ops->get_size ? obj->ops->get_size(obj) : PAGE_SIZE;
+}
+
+void flush_dev::written(unsigned long bytes)
+{
+    nr_written += bytes;
+
+    if ((total_written += bytes) < wb_share_period)
+        return;
+
+    /* Note: This is racy, but these are just estimates */
+    for (auto &dev : thread_list)
+        dev.nr_written = dev.nr_written / 2;
+    total_written = total_written / 2;
+}
+
+/**
+ * @brief Account for dirty data that's no longer dirty (it got written out, or discarded)
+ *
+ * @param bytes Bytes of data
+ */
+void flush_dev::cleaned(unsigned long bytes)
+{
+    dirty_bytes -= bytes;
+}
+
+/**
+ * @brief Write out an object synchronously, with its flush() op
+ *
+ * @param obj Object
+ * @return Result of flush()
+ */
+static ssize_t flush_obj_sync(struct flush_object *obj)
+{
+    unsigned long size = flush_obj_size(obj);
+
+    nr_dirty -= size;
+    nr_writeback += size;
+
+    ssize_t st = obj->ops->flush(obj);
+    obj->ops->set_dirty(false, obj);
+
+    nr_writeback -= size;
+    return st;
+}
 
-    // printk("Syncing\n");
-    /* We have to use list_for_every_safe because between clearing the dirty
-     * flag and going to the next buf some other cpu can see the flag is clear,
-     * and queue it up for another flush in another flush_dev (which isn't locked) */
-    list_for_every_safe (&dirty_bufs)
+static int wb_req_compare(const void *lhs, const void *rhs)
+{
+    const struct flush_wb_req *a = (const flush_wb_req *) lhs;
+    const struct flush_wb_req *b = (const flush_wb_req *) rhs;
+
+    if (a->dev != b->dev)
+        return (unsigned long) a->dev < (unsigned long) b->dev ? -1 : 1;
+    if (a->req.sector_number != b->req.sector_number)
+        return a->req.sector_number < b->req.sector_number ? -1 : 1;
+    return 0;
+}
+
+/**
+ * @brief Sort a batch of writes by sector and submit them together
+ * Submitting them in order, under a plug, lets the block layer merge adjacent writes.
+ *
+ * @param reqs Writes
+ * @param nr Number of writes
+ */
+void flush_dev::submit_wb_batch(struct flush_wb_req *reqs, size_t nr)
+{
+    qsort(reqs, nr, sizeof(*reqs), wb_req_compare);
+
+    struct bio_batch batch;
+    struct blk_plug plug;
+    bio_batch_init(&batch);
+    blk_start_plug(&plug);
+
+    for (size_t i = 0; i < nr; i++)
     {
-        flush_object *buf = container_of(l, flush_object, dirty_list);
-        /*printk("writeback file %p, size %lu, off %lu\n", blk->node,
-            blk->size, blk->offset);*/
+        /* As with flush(), errors don't keep the object dirty */
+        bio_batch_submit(&batch, reqs[i].dev, &reqs[i].req);
+    }
 
-        buf->ops->flush(buf);
+    blk_finish_plug(&plug);
+    bio_batch_wait(&batch);
 
-        buf->ops->set_dirty(false, buf);
+    unsigned long bytes = 0;
 
-        block_load--;
+    for (size_t i = 0; i < nr; i++)
+    {
+        unsigned long size = flush_obj_size(reqs[i].obj);
+        reqs[i].obj->ops->set_dirty(false, reqs[i].obj);
+        nr_writeback -= size;
+        bytes += size;
     }
 
-    list_for_every_safe (&dirty_inodes)
+    block_load -= nr;
+    cleaned(bytes);
+    written(bytes);
+}
+
+void flush_dev::writeback_bufs()
+{
+    /* If we can't allocate this, everything goes through flush() */
+    struct flush_wb_req *reqs = (flush_wb_req *) malloc(wb_batch_size * sizeof(flush_wb_req));
+
+    /* Objects dirtied while we write (by us, see add_buf) get appended, so keep going until the
+     * list is empty.
+     */
+    while (true)
     {
-        struct inode *ino = container_of(l, struct inode, i_dirty_inode_node);
+        size_t nr = 0;
 
-        __sync_fetch_and_and(&ino->i_flags, ~INODE_FLAG_DIRTY);
-        __sync_synchronize();
+        while (nr < wb_batch_size)
+        {
+            flush_object *obj;
+
+            {
+                scoped_lock g{list_lock};
+                if (list_is_empty(&dirty_bufs))
+                    break;
+
+                obj = container_of(list_first_element(&dirty_bufs), flush_object, dirty_list);
+                /* Take it off the list before clearing the dirty flag, as whoever dirties it
+                 * again is going to add it to a list again.
+                 */
+                list_remove(&obj->dirty_list);
+            }
+
+            if (reqs && obj->ops->prepare_wb && obj->ops->prepare_wb(obj, &reqs[nr]) == 0)
+            {
+                unsigned long size = flush_obj_size(obj);
+                reqs[nr++].obj = obj;
+                nr_dirty -= size;
+                nr_writeback += size;
+                continue;
+            }
+
+            unsigned long size = flush_obj_size(obj);
+            flush_obj_sync(obj);
+            block_load--;
+            cleaned(size);
+            written(size);
+        }
+
+        if (!nr)
+            break;
+
+        submit_wb_batch(reqs, nr);
+    }
+
+    free(reqs);
+}
+
+void flush_dev::writeback_inodes()
+{
+    while (true)
+    {
+        struct inode *ino;
+
+        {
+            scoped_lock g{list_lock};
+            if (list_is_empty(&dirty_inodes))
+                break;
+
+            ino = container_of(list_first_element(&dirty_inodes), struct inode,
+                               i_dirty_inode_node);
+            list_remove(&ino->i_dirty_inode_node);
+            __sync_fetch_and_and(&ino->i_flags, ~INODE_FLAG_DIRTY);
+        }
 
         inode_flush(ino);
         block_load--;
     }
+}
+
+void flush_dev::sync()
+{
+    lock();
 
-    /* reset the list */
-    list_reset(&dirty_bufs);
-    list_reset(&dirty_inodes);
-    assert(block_load == 0);
+    /* Write inodes first, as writing them may dirty buffers that we can then batch with the
+     * rest. Writing the data out may dirty inodes again (filesystems that pick blocks at
+     * writeback), so go around a second time for those.
+     */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        writeback_inodes();
+        writeback_bufs();
+    }
 
     unlock();
 }
@@ -70,32 +255,47 @@ ssize_t flush_dev::sync_one(struct flush_object *obj)
 {
     lock();
 
-    size_t res = obj->ops->flush(obj);
+    /* Writeback may have gotten to it while we waited for the lock */
+    if (!obj->ops->is_dirty(obj))
+    {
+        unlock();
+        return 0;
+    }
 
-    obj->ops->set_dirty(false, obj);
+    {
+        scoped_lock g{list_lock};
+        list_remove(&obj->dirty_list);
+    }
+
+    ssize_t res = flush_obj_sync(obj);
 
-    list_remove(&obj->dirty_list);
     block_load--;
+    cleaned(flush_obj_size(obj));
 
     unlock();
 
     return res;
 }
 
-void flush_dev::run()
+void flush_dev::wb_work_func(struct work_struct *work)
 {
-    while (true)
-    {
-        while (this->get_load())
-        {
-            sched_sleep_ms(flush_dev::wb_run_delta_ms);
+    flush_dev *dev = container_of(to_delayed_work(work), flush_dev, wb_work);
 
-            // printk("Flushing data to disk\n");
-            sync();
-        }
+    // printk("Flushing data to disk\n");
+    dev->sync();
 
-        sem_wait(&thread_sem);
-    }
+    /* Something got dirtied after we synced. Whoever dirtied it has probably requeued us
+     * already, in which case this does nothing.
+     */
+    if (dev->get_load())
+        dev->queue_writeback();
+}
+
+void flush_dev::wb_now_work_func(struct work_struct *work)
+{
+    flush_dev *dev = container_of(work, flush_dev, wb_now_work);
+
+    dev->sync();
 }
 
 bool flush_dev::called_from_sync()
@@ -106,32 +306,28 @@ bool flush_dev::called_from_sync()
 
 bool flush_dev::add_buf(struct flush_object *obj)
 {
-    /* It's very possible the flush code is calling us from sync and trying to
-     * lock the flush dev would cause a deadlock. Therefore, we want to sync it ourselves right now.
+    /* It's very possible the flush code is calling us from sync, in which case there's no need
+     * to queue writeback, as sync picks up anything that gets added to the list while it's
+     * writing.
      */
-    if (called_from_sync())
-    {
-        obj->ops->flush(obj);
-        obj->ops->set_dirty(false, obj);
-        return false;
-    }
-
-    lock();
+    bool from_sync = called_from_sync();
+    scoped_lock g{list_lock};
 
     list_add_tail(&obj->dirty_list, &dirty_bufs);
-    if (block_load++ == 0)
-    {
-        sem_signal(&thread_sem);
-    }
-
-    unlock();
+    unsigned long size = flush_obj_size(obj);
+    nr_dirty += size;
+    dirty_bytes += size;
+    if (block_load++ == 0 && !from_sync)
+        queue_writeback();
 
     return true;
 }
 
 void flush_dev::remove_buf(struct flush_object *obj)
 {
+    /* Take the writeback lock too, so we don't pull the object out from under writeback */
     lock();
+    spin_lock(&list_lock);
 
     /* We do a last check here inside the lock to be sure it's actually still dirty */
     if (obj->ops->is_dirty(obj))
@@ -140,30 +336,33 @@ void flush_dev::remove_buf(struct flush_object *obj)
          * to a different flushdev(but in that case, should we be removing it anyways?).
          * This also applies to remove_inode().
          */
+        unsigned long size = flush_obj_size(obj);
         block_load--;
+        nr_dirty -= size;
+        cleaned(size);
         list_remove(&obj->dirty_list);
     }
 
+    spin_unlock(&list_lock);
     unlock();
 }
 
 void flush_dev::add_inode(struct inode *ino)
 {
-    lock();
+    /* Like add_buf, this gets called from sync when writeback allocates blocks */
+    bool from_sync = called_from_sync();
+    scoped_lock g{list_lock};
 
     list_add_tail(&ino->i_dirty_inode_node, &dirty_inodes);
 
-    if (block_load++ == 0)
-    {
-        sem_signal(&thread_sem);
-    }
-
-    unlock();
+    if (block_load++ == 0 && !from_sync)
+        queue_writeback();
 }
 
 void flush_dev::remove_inode(struct inode *ino)
 {
     lock();
+    spin_lock(&list_lock);
 
     /* We do a last check here inside the lock to be sure it's actually still dirty */
     if (ino->i_flags & INODE_FLAG_DIRTY)
@@ -172,22 +371,36 @@ void flush_dev::remove_inode(struct inode *ino)
         list_remove(&ino->i_dirty_inode_node);
     }
 
+    spin_unlock(&list_lock);
     unlock();
 }
 
 } // namespace flush
 
-void flush_thr_init(void *arg)
+/**
+ * @brief Pick the flush dev for a block device
+ * All of a device's dirty data goes through the same flush dev, so its writeback can be sorted
+ * and batched, and its dirty data can be accounted for.
+ *
+ * @param bdev Block device
+ * @return Flush dev
+ */
+static flush::flush_dev *flush_dev_for_bdev(struct blockdev *bdev)
 {
-    flush::flush_dev *b = reinterpret_cast<flush::flush_dev *>(arg);
-    b->run();
+    if (blkdev_is_partition(bdev))
+        bdev = bdev->actual_blockdev;
+
+    return &flush::thread_list[fnv_hash(&bdev, sizeof(bdev)) % flush::nr_wb_threads];
 }
 
-flush::flush_dev *flush_allocate_dev()
+static flush::flush_dev *flush_allocate_dev(struct blockdev *bdev)
 {
     flush::flush_dev *blk = nullptr;
     unsigned long load = ~0UL;
 
+    if (bdev)
+        return flush_dev_for_bdev(bdev);
+
     for (auto &b : flush::thread_list)
     {
         if (b.get_load() < load)
@@ -202,12 +415,11 @@ flush::flush_dev *flush_allocate_dev()
 
 void flush_add_buf(struct flush_object *f)
 {
-    flush::flush_dev *blk = flush_allocate_dev();
+    flush::flush_dev *blk = flush_allocate_dev(f->ops->get_dev ? f->ops->get_dev(f) : nullptr);
 
     /* wat */
     assert(blk != nullptr);
 
-    /* If we were flushed right away, we're going to want to avoid setting f->blk_list */
     if (!blk->add_buf(f))
         return;
 
@@ -231,7 +443,7 @@ void flush_init(void)
 
 void flush_add_inode(struct inode *ino)
 {
-    auto dev = flush_allocate_dev();
+    auto dev = flush_allocate_dev(ino->i_sb ? ino->i_sb->s_bdev : nullptr);
 
     ino->i_flush_dev = dev;
 
@@ -262,6 +474,86 @@ void flush_do_sync()
     }
 }
 
+unsigned long flush_get_nr_dirty(void)
+{
+    return flush::nr_dirty >> PAGE_SHIFT;
+}
+
+unsigned long flush_get_nr_writeback(void)
+{
+    return flush::nr_writeback >> PAGE_SHIFT;
+}
+
+/**
+ * @brief Get a flush dev's share of the dirty threshold
+ * Devs get a share proportional to how much they wrote out recently, so fast devices get to keep
+ * more dirty data around than slow ones.
+ *
+ * @param dev Flush dev
+ * @param thresh Global dirty threshold
+ * @return The dev's dirty threshold
+ */
+static unsigned long flush_dev_thresh(flush::flush_dev *dev, unsigned long thresh)
+{
+    unsigned long total = 0;
+    for (auto &d : flush::thread_list)
+        total += d.get_nr_written();
+
+    unsigned long dev_thresh =
+        total ? thresh * dev->get_nr_written() / total : thresh / flush::nr_wb_threads;
+
+    /* Don't starve devs that haven't written anything in a while */
+    return cul::max(dev_thresh, thresh / (2 * flush::nr_wb_threads));
+}
+
+void flush_balance_dirty(struct blockdev *bdev)
+{
+    flush::flush_dev *dev = bdev ? flush_dev_for_bdev(bdev) : nullptr;
+
+    /* Writeback itself must never be throttled */
+    if (dev && dev->called_from_sync())
+        return;
+
+    while (true)
+    {
+        unsigned long total = nr_global_pages;
+        unsigned long bg_thresh = total * flush::dirty_background_ratio / 100;
+        unsigned long thresh = total * flush::dirty_ratio / 100;
+        unsigned long setpoint = (bg_thresh + thresh) / 2;
+        unsigned long dirty = flush_get_nr_dirty() + flush_get_nr_writeback();
+        unsigned long dev_dirty = dev ? dev->get_dirty_pages() : 0;
+        unsigned long dev_thresh = dev ? flush_dev_thresh(dev, thresh) : 0;
+
+        if (dirty <= bg_thresh && dev_dirty <= dev_thresh)
+            return;
+
+        /* Don't wait for the periodic writeback */
+        for (auto &d : flush::thread_list)
+        {
+            if (d.get_load())
+                d.kick_writeback();
+        }
+
+        if (dirty <= setpoint && dev_dirty <= dev_thresh)
+            return;
+
+        /* Pause for longer the closer we are to the limits */
+        unsigned long pause = 0;
+        if (dirty > setpoint)
+            pause = (dirty - setpoint) * flush::max_pause_ms / (thresh - setpoint);
+        if (dev_dirty > dev_thresh)
+            pause = cul::max(pause, (dev_dirty - dev_thresh) * flush::max_pause_ms / dev_thresh);
+
+        pause = cul::min(cul::max(pause, 1UL), flush::max_pause_ms);
+
+        sched_sleep_ms(pause);
+
+        /* Past the limits, wait until writeback catches up */
+        if ((dirty < thresh && dev_dirty < 2 * dev_thresh) || signal_is_pending())
+            return;
+    }
+}
+
 void sys_sync()
 {
     flush_do_sync();
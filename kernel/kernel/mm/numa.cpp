@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <onyx/numa.h>
+#include <onyx/percpu.h>
+
+/**
+ * NUMA topology, as described by the firmware (ACPI SRAT and SLIT, on x86).
+ * Everything here gets set up before the page allocator is up, so it's all statically sized.
+ * If nothing gets registered, we end up with a single node 0 that spans all of memory.
+ */
+
+#define NUMA_MAX_MEMBLKS 128
+#define NUMA_MAX_CPUS    CONFIG_SMP_NR_CPUS
+
+struct numa_memblk
+{
+    unsigned long start;
+    unsigned long end;
+    int node;
+};
+
+static numa_memblk memblks[NUMA_MAX_MEMBLKS];
+static unsigned int nr_memblks;
+
+static uint32_t node_pxm[CONFIG_NUMA_NR_NODES];
+static unsigned int nr_nodes;
+
+static uint8_t distances[CONFIG_NUMA_NR_NODES][CONFIG_NUMA_NR_NODES];
+static int fallback_lists[CONFIG_NUMA_NR_NODES][CONFIG_NUMA_NR_NODES];
+
+struct numa_cpu_hwid
+{
+    uint32_t hwid;
+    int node;
+};
+
+static numa_cpu_hwid cpu_hwids[NUMA_MAX_CPUS];
+static unsigned int nr_cpu_hwids;
+
+PER_CPU_VAR(int numa_node) = 0;
+
+int numa_pxm_to_node(uint32_t pxm)
+{
+    for (unsigned int i = 0; i < nr_nodes; i++)
+    {
+        if (node_pxm[i] == pxm)
+            return i;
+    }
+
+    if (nr_nodes == CONFIG_NUMA_NR_NODES)
+    {
+        printf("numa: Too many proximity domains, ignoring PXM %u\n", pxm);
+        return NUMA_NO_NODE;
+    }
+
+    node_pxm[nr_nodes] = pxm;
+    return nr_nodes++;
+}
+
+void numa_add_memblk(int node, unsigned long start, unsigned long end)
+{
+    if (nr_memblks == NUMA_MAX_MEMBLKS)
+    {
+        printf("numa: Too many memory affinity ranges, ignoring %016lx-%016lx\n", start, end);
+        return;
+    }
+
+    printf("numa: Node %d: %016lx-%016lx\n", node, start, end - 1);
+
+    /* Keep the memblks sorted, since we look them up on every page free */
+    unsigned int i = nr_memblks;
+    while (i > 0 && memblks[i - 1].start > start)
+    {
+        memblks[i] = memblks[i - 1];
+        i--;
+    }
+
+    memblks[i] = {start, end, node};
+    nr_memblks++;
+}
+
+void numa_add_cpu_hwid(uint32_t hwid, int node)
+{
+    if (nr_cpu_hwids == NUMA_MAX_CPUS)
+        return;
+    cpu_hwids[nr_cpu_hwids++] = {hwid, node};
+}
+
+int numa_hwid_to_node(uint32_t hwid)
+{
+    for (unsigned int i = 0; i < nr_cpu_hwids; i++)
+    {
+        if (cpu_hwids[i].hwid == hwid)
+            return cpu_hwids[i].node;
+    }
+
+    return 0;
+}
+
+void numa_set_distance(int from, int to, uint8_t distance)
+{
+    distances[from][to] = distance;
+}
+
+int numa_distance(int from, int to)
+{
+    return distances[from][to];
+}
+
+void numa_init_done()
+{
+    if (nr_nodes == 0)
+        nr_nodes = 1;
+
+    /* Fill in any distance the firmware didn't give us (or all of them, if there's no SLIT) */
+    for (unsigned int i = 0; i < nr_nodes; i++)
+    {
+        for (unsigned int j = 0; j < nr_nodes; j++)
+        {
+            if (distances[i][j])
+                continue;
+            distances[i][j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    /* Build each node's fallback list, by increasing distance (insertion sort, nr_nodes is tiny) */
+    for (unsigned int i = 0; i < nr_nodes; i++)
+    {
+        int *list = fallback_lists[i];
+        list[0] = i;
+
+        unsigned int len = 1;
+        for (unsigned int j = 0; j < nr_nodes; j++)
+        {
+            if (j == i)
+                continue;
+
+            unsigned int k = len++;
+            while (k > 1 && distances[i][list[k - 1]] > distances[i][j])
+            {
+                list[k] = list[k - 1];
+                k--;
+            }
+
+            list[k] = j;
+        }
+    }
+
+    if (nr_nodes > 1)
+        printf("numa: %u nodes\n", nr_nodes);
+}
+
+unsigned int numa_nr_nodes()
+{
+    return nr_nodes ?: 1;
+}
+
+int numa_phys_to_node_range(unsigned long paddr, unsigned long *end)
+{
+    /* Binary search the sorted memblks, for the first one that ends after paddr */
+    unsigned int lo = 0;
+    unsigned int hi = nr_memblks;
+
+    while (lo < hi)
+    {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (paddr >= memblks[mid].end)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == nr_memblks)
+    {
+        *end = ~0UL;
+        return 0;
+    }
+
+    const auto &blk = memblks[lo];
+
+    if (paddr < blk.start)
+    {
+        /* In a hole, which goes to node 0 until the next memblk starts */
+        *end = blk.start;
+        return 0;
+    }
+
+    *end = blk.end;
+    return blk.node;
+}
+
+int numa_phys_to_node(unsigned long paddr)
+{
+    if (nr_memblks == 0)
+        return 0;
+
+    unsigned long end;
+    return numa_phys_to_node_range(paddr, &end);
+}
+
+const int *numa_node_fallback(int node)
+{
+    return fallback_lists[node];
+}
+
+void numa_set_cpu_node(unsigned int cpu, int node)
+{
+    write_per_cpu_any(numa_node, node, cpu);
+}
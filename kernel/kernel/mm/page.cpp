@@ -37,6 +37,10 @@ void page_allocate_pagemap(unsigned long __maxpfn)
 {
     maxpfn = __maxpfn;
     page_map = (page *) __ksbrk((maxpfn - base_pfn) * sizeof(struct page));
+    /* The buddy allocator looks at the struct pages of holes when coalescing, so they can't have
+     * garbage in them.
+     */
+    memset(page_map, 0, (maxpfn - base_pfn) * sizeof(struct page));
 }
 
 struct page *phys_to_page(uintptr_t phys)
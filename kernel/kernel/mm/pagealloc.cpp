@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 Pedro Falcato
+ * Copyright (c) 2017 - 2022 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
@@ -15,8 +15,10 @@
 #include <unistd.h>
 
 #include <onyx/copy.h>
+#include <onyx/numa.h>
 #include <onyx/page.h>
 #include <onyx/panic.h>
+#include <onyx/percpu.h>
 #include <onyx/spinlock.h>
 #include <onyx/utils.h>
 #include <onyx/vm.h>
@@ -32,36 +34,119 @@ static inline unsigned long pow2(int exp)
     return (1UL << (unsigned long) exp);
 }
 
+struct page_zone;
+
+/* Free pages (or free blocks of pages, in the buddy's case) keep their list node inside the page
+ * itself, so we don't need to grow struct page.
+ */
 struct page_list
 {
     struct page *page;
     struct list_head list_node;
+    /* Zone whose free lists this block is on (only set for buddy blocks) */
+    struct page_zone *zone;
+};
+
+#define ADDRESS_4GB_MARK 0x100000000
+#define PFN_4GB_MARK     (ADDRESS_4GB_MARK >> PAGE_SHIFT)
+
+enum page_zone_type
+{
+    ZONE_DMA32 = 0,
+    ZONE_NORMAL,
+    NR_ZONES
 };
 
-struct page_arena
+/**
+ * @brief A buddy allocator zone.
+ * Free pages are kept in blocks of 2^order pages, in per-order free lists. The head page of each
+ * free block is marked PAGE_FLAG_FREE and stores its order in page->priv; every other page in the
+ * block has its flags cleared. Freeing a block merges it with its buddy while the buddy is free
+ * and of the same order.
+ *
+ * Zones of different nodes may interleave, so [start_pfn, end_pfn) can have other zones' pages in
+ * it. Free blocks record their zone (see page_list), so checking a buddy doesn't need to look up
+ * what node it belongs to.
+ */
+struct page_zone
 {
-    void *start_arena;
-    void *end_arena;
-    struct list_head arena_list_node;
+    const char *name;
+    int nid;
+    struct spinlock lock;
+    unsigned long start_pfn;
+    unsigned long end_pfn;
+    unsigned long total_pages;
+    unsigned long free_pages;
+    struct list_head free_areas[MAX_ORDER];
+    unsigned long nr_free[MAX_ORDER];
+
+    constexpr page_zone()
+        : name{}, nid{}, lock{}, start_pfn{}, end_pfn{}, total_pages{}, free_pages{}, free_areas{},
+          nr_free{}
+    {
+    }
+
+    void init(const char *name, int nid);
+
+    bool in_span(unsigned long pfn, unsigned int order) const
+    {
+        return pfn >= start_pfn && pfn + pow2(order) <= end_pfn;
+    }
 
-    struct page *alloc_contiguous(size_t nr_pgs, unsigned long flags);
+    bool is_free_block(unsigned long pfn, unsigned int order);
+
+    void grow_span(unsigned long pfn, unsigned long nr_pages);
+    void add_to_free_area(struct page *p, unsigned int order);
+    void remove_from_free_area(struct page *p, unsigned int order);
+    void free_block(unsigned long pfn, unsigned int order);
+    void free_range(unsigned long pfn, unsigned long nr_pages);
+    struct page *alloc_block(unsigned int order);
+    struct page *alloc_large(unsigned long nr_pages);
+    struct page *alloc_range(unsigned long nr_pages);
+};
+
+/**
+ * @brief Per-CPU cache of order-0 pages.
+ * Recently freed (and therefore cache-hot) pages go to the head of the list and get handed out
+ * first, while batches get drained from the tail (the coldest pages) back to the buddy.
+ * The cache gets refilled in batches of page_pcpu_batch pages when empty, and drained when it
+ * grows over page_pcpu_high.
+ */
+struct page_pcpu_cache
+{
+    struct list_head pages;
+    unsigned long count;
 };
 
+static_assert(MAX_ORDER == MEMSTAT_NR_ORDERS, "memstat needs a free_blocks entry per order");
+
+static constexpr unsigned long page_pcpu_batch = 32;
+static constexpr unsigned long page_pcpu_high = 128;
+
+PER_CPU_VAR(struct page_pcpu_cache pcp_cache[CONFIG_NUMA_NR_NODES]);
+
+/**
+ * @brief A NUMA node's worth of physical memory.
+ * Each node has its own zones and its own set of per-CPU caches.
+ */
 class page_node
 {
 private:
-    struct spinlock node_lock;
-    struct list_head arena_list;
-    struct list_head cpu_list_node;
-    struct list_head page_list;
-    unsigned long used_pages;
-    unsigned long total_pages;
+    int nid;
+    page_zone zones[NR_ZONES];
+
+    page_zone *zone_for_pfn(unsigned long pfn)
+    {
+        return &zones[pfn < PFN_4GB_MARK ? ZONE_DMA32 : ZONE_NORMAL];
+    }
 
-    int page_add(struct page_arena *arena, void *__page);
+    void pcp_refill(struct page_pcpu_cache *pcp);
+    void pcp_drain(struct page_pcpu_cache *pcp, unsigned long nr);
+    void prepare_pages(struct page *pages, unsigned long nr_pages, unsigned long flags);
+    struct page_pcpu_cache *get_pcp();
 
 public:
-    constexpr page_node()
-        : node_lock{}, arena_list{}, cpu_list_node{}, page_list{}, used_pages{}, total_pages{}
+    constexpr page_node() : nid{}, zones{}
     {
     }
 
@@ -69,81 +154,278 @@ public:
     {
     }
 
-    void init()
+    void init(int nid)
     {
-        INIT_LIST_HEAD(&arena_list);
-        INIT_LIST_HEAD(&cpu_list_node);
-        INIT_LIST_HEAD(&page_list);
+        this->nid = nid;
+        zones[ZONE_DMA32].init("DMA32", nid);
+        zones[ZONE_NORMAL].init("Normal", nid);
     }
 
     void add_region(unsigned long base, size_t size);
-    struct page *allocate_pages(unsigned long nr_pages, unsigned long flags);
+    void reclaim_page(struct page *p);
     struct page *alloc_page(unsigned long flags);
     struct page *alloc_contiguous(unsigned long nr_pages, unsigned long flags);
     void free_page(struct page *p);
+    void drain_local_pcp();
+    void get_stats(struct memstat *m);
 };
 
 static bool page_is_initialized = false;
-static constexpr size_t arena_default_size = 0x200000;
 
-page_node main_node;
+static page_node nodes[CONFIG_NUMA_NR_NODES];
 
-#include <onyx/clock.h>
+static inline struct page *pfn_to_page(unsigned long pfn)
+{
+    return phys_to_page(pfn_to_paddr(pfn));
+}
 
-#define ADDRESS_4GB_MARK 0x100000000
+static inline struct page_list *page_to_list(struct page *p)
+{
+    return (struct page_list *) PAGE_TO_VIRT(p);
+}
 
-int page_node::page_add(struct page_arena *arena, void *__page)
+static inline unsigned int pages_to_order(unsigned long nr_pages)
 {
-    nr_global_pages++;
-    total_pages++;
+    return nr_pages == 1 ? 0 : ilog2(nr_pages - 1) + 1;
+}
 
-    struct page_list *page = (struct page_list *) PHYS_TO_VIRT(__page);
+void page_zone::init(const char *name, int nid)
+{
+    this->name = name;
+    this->nid = nid;
+    start_pfn = ~0UL;
+    end_pfn = 0;
 
-    page->page = page_add_page(__page);
-    page->page->flags |= PAGE_FLAG_FREE;
-    list_add(&page->list_node, &page_list);
+    for (auto &area : free_areas)
+        INIT_LIST_HEAD(&area);
+}
 
-    return 0;
+void page_zone::grow_span(unsigned long pfn, unsigned long nr_pages)
+{
+    if (pfn < start_pfn)
+        start_pfn = pfn;
+    if (pfn + nr_pages > end_pfn)
+        end_pfn = pfn + nr_pages;
+    total_pages += nr_pages;
 }
 
-void page_node::add_region(uintptr_t base, size_t size)
+void page_zone::add_to_free_area(struct page *p, unsigned int order)
+{
+    p->flags = PAGE_FLAG_FREE;
+    p->priv = order;
+
+    auto list = page_to_list(p);
+    list->page = p;
+    list->zone = this;
+    list_add(&list->list_node, &free_areas[order]);
+    nr_free[order]++;
+    free_pages += pow2(order);
+}
+
+void page_zone::remove_from_free_area(struct page *p, unsigned int order)
+{
+    assert(p->flags & PAGE_FLAG_FREE);
+    assert(p->priv == order);
+
+    list_remove(&page_to_list(p)->list_node);
+    p->flags = 0;
+    p->priv = 0;
+    nr_free[order]--;
+    free_pages -= pow2(order);
+}
+
+/**
+ * @brief Check if pfn is the head of a free block of ours, of the given order
+ *
+ * @param pfn Page frame number
+ * @param order Order of the block
+ * @return True if so, else false
+ */
+bool page_zone::is_free_block(unsigned long pfn, unsigned int order)
 {
-    printf("pagealloc: Adding region %lx, %016lx\n", base, base + size - 1);
-    while (size)
+    if (!in_span(pfn, order))
+        return false;
+
+    struct page *p = pfn_to_page(pfn);
+
+    if (!(p->flags & PAGE_FLAG_FREE) || p->priv != order)
+        return false;
+
+    /* Free, but it may be on another (interleaved) node's free lists */
+    return page_to_list(p)->zone == this;
+}
+
+void page_zone::free_block(unsigned long pfn, unsigned int order)
+{
+    while (order < MAX_ORDER - 1)
+    {
+        unsigned long buddy_pfn = pfn ^ pow2(order);
+
+        if (!is_free_block(buddy_pfn, order))
+            break;
+
+        struct page *buddy = pfn_to_page(buddy_pfn);
+        remove_from_free_area(buddy, order);
+        pfn &= ~pow2(order);
+        order++;
+    }
+
+    add_to_free_area(pfn_to_page(pfn), order);
+}
+
+void page_zone::free_range(unsigned long pfn, unsigned long nr_pages)
+{
+    while (nr_pages)
     {
-        size_t area_size = min(size, arena_default_size);
-        struct page_arena *arena = (struct page_arena *) __ksbrk(sizeof(struct page_arena));
-        assert(arena != NULL);
-        memset_s(arena, 0, sizeof(struct page_arena));
+        /* Pick the largest naturally aligned block that fits */
+        unsigned int order = pfn ? __builtin_ctzl(pfn) : MAX_ORDER - 1;
+        order = min(order, (unsigned int) (MAX_ORDER - 1));
 
-        arena->start_arena = (void *) base;
-        arena->end_arena = (void *) (base + area_size);
+        while (pow2(order) > nr_pages)
+            order--;
 
-        for (size_t i = 0; i < area_size; i += PAGE_SIZE)
+        free_block(pfn, order);
+        pfn += pow2(order);
+        nr_pages -= pow2(order);
+    }
+}
+
+struct page *page_zone::alloc_block(unsigned int order)
+{
+    for (unsigned int current_order = order; current_order < MAX_ORDER; current_order++)
+    {
+        struct list_head *l = list_first_element(&free_areas[current_order]);
+        if (!l)
+            continue;
+
+        struct page *p = container_of(l, struct page_list, list_node)->page;
+        remove_from_free_area(p, current_order);
+
+        /* Split the block, giving back the upper halves */
+        while (current_order > order)
+        {
+            current_order--;
+            add_to_free_area(p + pow2(current_order), current_order);
+        }
+
+        return p;
+    }
+
+    return nullptr;
+}
+
+struct page *page_zone::alloc_large(unsigned long nr_pages)
+{
+    /* Requests that don't fit in a single block look for a run of free max-order blocks */
+    constexpr unsigned int top_order = MAX_ORDER - 1;
+    const unsigned long block_pages = pow2(top_order);
+    const unsigned long nr_blocks = (nr_pages + block_pages - 1) / block_pages;
+
+    list_for_every (&free_areas[top_order])
+    {
+        struct page *head = container_of(l, struct page_list, list_node)->page;
+        unsigned long start = page_to_pfn(head);
+        unsigned long i;
+
+        for (i = 1; i < nr_blocks; i++)
         {
-            page_add(arena, (void *) (base + i));
+            if (!is_free_block(start + i * block_pages, top_order))
+                break;
         }
 
-        list_add_tail(&arena->arena_list_node, &arena_list);
+        if (i != nr_blocks)
+            continue;
+
+        for (i = 0; i < nr_blocks; i++)
+            remove_from_free_area(pfn_to_page(start + i * block_pages), top_order);
 
-        size -= area_size;
-        base += area_size;
+        free_range(start + nr_pages, nr_blocks * block_pages - nr_pages);
+        return head;
     }
+
+    return nullptr;
+}
+
+struct page *page_zone::alloc_range(unsigned long nr_pages)
+{
+    unsigned int order = pages_to_order(nr_pages);
+
+    if (order >= MAX_ORDER)
+        return alloc_large(nr_pages);
+
+    struct page *p = alloc_block(order);
+    if (!p)
+        return nullptr;
+
+    /* Give back the excess pages at the end of the block */
+    if (pow2(order) != nr_pages)
+        free_range(page_to_pfn(p) + nr_pages, pow2(order) - nr_pages);
+
+    return p;
+}
+
+void page_node::add_region(uintptr_t base, size_t size)
+{
+    printf("pagealloc: Adding region %lx, %016lx (node %d)\n", base, base + size - 1, nid);
+
+    unsigned long pfn = base >> PAGE_SHIFT;
+    unsigned long nr_pages = size >> PAGE_SHIFT;
+
+    for (unsigned long i = 0; i < nr_pages; i++)
+        page_add_page((void *) pfn_to_paddr(pfn + i));
+
+    nr_global_pages += nr_pages;
+
+    while (nr_pages)
+    {
+        auto zone = zone_for_pfn(pfn);
+        unsigned long zone_pages = nr_pages;
+
+        /* Regions that cross the 4GB mark get split between DMA32 and Normal */
+        if (pfn < PFN_4GB_MARK && pfn + nr_pages > PFN_4GB_MARK)
+            zone_pages = PFN_4GB_MARK - pfn;
+
+        unsigned long cpu_flags = spin_lock_irqsave(&zone->lock);
+        zone->grow_span(pfn, zone_pages);
+        zone->free_range(pfn, zone_pages);
+        spin_unlock_irqrestore(&zone->lock, cpu_flags);
+
+        pfn += zone_pages;
+        nr_pages -= zone_pages;
+    }
+}
+
+void page_node::reclaim_page(struct page *p)
+{
+    unsigned long pfn = page_to_pfn(p);
+    auto zone = zone_for_pfn(pfn);
+
+    p->ref = 0;
+    p->flags = 0;
+
+    unsigned long cpu_flags = spin_lock_irqsave(&zone->lock);
+    zone->grow_span(pfn, 1);
+    zone->free_block(pfn, 0);
+    spin_unlock_irqrestore(&zone->lock, cpu_flags);
+}
+
+int page_to_nid(struct page *p)
+{
+    return numa_phys_to_node((unsigned long) page_to_phys(p));
 }
 
 void page_init(size_t memory_size, unsigned long maxpfn)
 {
-    main_node.init();
+    numa_init_done();
+
+    for (unsigned int i = 0; i < numa_nr_nodes(); i++)
+        nodes[i].init(i);
 
     printf("page: Memory size: %lu\n", memory_size);
     page_memory_size = memory_size;
     // nr_global_pages = vm_align_size_to_pages(memory_size);
 
-    size_t nr_arenas = page_memory_size / arena_default_size;
-    if (page_memory_size % arena_default_size)
-        nr_arenas++;
-
-    size_t needed_memory = nr_arenas * sizeof(struct page_arena) + maxpfn * sizeof(struct page);
+    size_t needed_memory = maxpfn * sizeof(struct page);
     void *ptr = alloc_boot_page(vm_size_to_pages(needed_memory), 0);
     if (!ptr)
     {
@@ -166,21 +448,64 @@ void page_init(size_t memory_size, unsigned long maxpfn)
         /* page_add_region can't return an error value since it halts
          * on failure
          */
-        main_node.add_region(start, size);
+        if (numa_nr_nodes() == 1)
+        {
+            nodes[0].add_region(start, size);
+            return;
+        }
+
+        /* Split the region at the node boundaries */
+        while (size)
+        {
+            unsigned long end;
+            int nid = numa_phys_to_node_range(start, &end);
+            size_t len = size;
+
+            /* A page that straddles two nodes goes to the first one */
+            if (end - start < size)
+                len = min(size, (size_t) ALIGN_TO(end - start, PAGE_SIZE));
+
+            nodes[nid].add_region(start, len);
+            start += len;
+            size -= len;
+        }
     });
 
     page_is_initialized = true;
 }
 
 #include <onyx/heap.h>
+#include <onyx/mm/flush.h>
 #include <onyx/pagecache.h>
 
+void page_node::get_stats(struct memstat *m)
+{
+    for (auto &zone : zones)
+    {
+        unsigned long cpu_flags = spin_lock_irqsave(&zone.lock);
+
+        for (unsigned int i = 0; i < MAX_ORDER; i++)
+            m->free_blocks[i] += zone.nr_free[i];
+
+        spin_unlock_irqrestore(&zone.lock, cpu_flags);
+    }
+
+    for (unsigned long cpu = 0; cpu < percpu_get_nr_bases(); cpu++)
+        m->pcp_cached_pages += (*other_cpu_get_ptr(pcp_cache, cpu))[nid].count;
+}
+
 void page_get_stats(struct memstat *m)
 {
+    memset(m, 0, sizeof(*m));
     m->total_pages = nr_global_pages;
     m->allocated_pages = used_pages;
     m->page_cache_pages = pagecache_get_used_pages();
     m->kernel_heap_pages = heap_get_used_pages();
+    m->dirty_pages = flush_get_nr_dirty();
+    m->writeback_pages = flush_get_nr_writeback();
+
+    for (unsigned int i = 0; i < numa_nr_nodes(); i++)
+        nodes[i].get_stats(m);
 }
 
 extern unsigned char kernel_end;
@@ -223,7 +548,7 @@ void free_page(struct page *p)
     if (__page_unref(p) == 0)
     {
         p->next_un.next_allocation = NULL;
-        main_node.free_page(p);
+        nodes[page_to_nid(p)].free_page(p);
         // printf("free pages %p, %p\n", page_to_phys(p), __builtin_return_address(0));
     }
 #if 0
@@ -234,49 +559,204 @@ void free_page(struct page *p)
 #endif
 }
 
+struct page_pcpu_cache *page_node::get_pcp()
+{
+    /* Note: Secondary CPUs get a zeroed percpu area, so initialize the list lazily */
+    auto pcp = &(*get_per_cpu_ptr(pcp_cache))[nid];
+    if (unlikely(!pcp->pages.next))
+        INIT_LIST_HEAD(&pcp->pages);
+    return pcp;
+}
+
+/**
+ * @brief Refill the per-CPU cache with a batch of pages from the buddy.
+ * Prefers Normal memory, so DMA32 gets preserved for those who need it.
+ * Must be called with irqs disabled.
+ *
+ * @param pcp Local per-CPU cache
+ */
+void page_node::pcp_refill(struct page_pcpu_cache *pcp)
+{
+    for (int i = NR_ZONES - 1; i >= 0 && pcp->count < page_pcpu_batch; i--)
+    {
+        auto &zone = zones[i];
+
+        spin_lock_preempt(&zone.lock);
+
+        while (pcp->count < page_pcpu_batch)
+        {
+            struct page *p = zone.alloc_block(0);
+            if (!p)
+                break;
+
+            auto list = page_to_list(p);
+            list->page = p;
+            list_add_tail(&list->list_node, &pcp->pages);
+            pcp->count++;
+        }
+
+        spin_unlock_preempt(&zone.lock);
+    }
+}
+
+/**
+ * @brief Drain the nr coldest pages of the per-CPU cache back to the buddy.
+ * Must be called with irqs disabled.
+ *
+ * @param pcp Local per-CPU cache
+ * @param nr Number of pages to drain
+ */
+void page_node::pcp_drain(struct page_pcpu_cache *pcp, unsigned long nr)
+{
+    page_zone *locked = nullptr;
+
+    while (nr-- && pcp->count)
+    {
+        auto list = container_of(pcp->pages.prev, struct page_list, list_node);
+        unsigned long pfn = page_to_pfn(list->page);
+        auto zone = zone_for_pfn(pfn);
+
+        list_remove(&list->list_node);
+        pcp->count--;
+
+        if (zone != locked)
+        {
+            if (locked)
+                spin_unlock_preempt(&locked->lock);
+            spin_lock_preempt(&zone->lock);
+            locked = zone;
+        }
+
+        zone->free_block(pfn, 0);
+    }
+
+    if (locked)
+        spin_unlock_preempt(&locked->lock);
+}
+
+void page_node::drain_local_pcp()
+{
+    unsigned long cpu_flags = irq_save_and_disable();
+    auto pcp = get_pcp();
+    pcp_drain(pcp, pcp->count);
+    irq_restore(cpu_flags);
+}
+
+void page_node::prepare_pages(struct page *pages, unsigned long nr_pages, unsigned long flags)
+{
+    struct page *before = nullptr;
+
+    for (unsigned long i = 0; i < nr_pages; i++)
+    {
+        auto page = pages + i;
+        page->flags = 0;
+        page->priv = 0;
+        page->cache = nullptr;
+        page->next_un.next_allocation = nullptr;
+        page->ref = 1;
+
+        if (before)
+            before->next_un.next_allocation = page;
+
+        before = page;
+    }
+
+    ::used_pages += nr_pages;
+
+    if (page_should_zero(flags))
+    {
+        set_non_temporal(PAGE_TO_VIRT(pages), 0, nr_pages << PAGE_SHIFT);
+    }
+}
+
 struct page *page_node::alloc_page(unsigned long flags)
 {
     struct page *ret = nullptr;
-    struct page_list *p = nullptr;
 
     /* The slow, alloc_contiguous function is the one that handles those requests */
     if (flags & PAGE_ALLOC_4GB_LIMIT)
         return alloc_contiguous(1, flags);
 
-    unsigned long cpu_flags = spin_lock_irqsave(&node_lock);
+    unsigned long cpu_flags = irq_save_and_disable();
+    auto pcp = get_pcp();
 
-    if (list_is_empty(&page_list))
+    if (list_is_empty(&pcp->pages))
+        pcp_refill(pcp);
+
+    if (pcp->count)
     {
-        assert(used_pages == total_pages);
-        goto out;
+        auto list = container_of(list_first_element(&pcp->pages), struct page_list, list_node);
+        list_remove(&list->list_node);
+        pcp->count--;
+        ret = list->page;
     }
 
-    p = container_of(list_first_element(&page_list), struct page_list, list_node);
+    irq_restore(cpu_flags);
 
-    list_remove(&p->list_node);
+    if (ret)
+        prepare_pages(ret, 1, flags);
 
-    assert(p->page->flags & PAGE_FLAG_FREE);
+    return ret;
+}
 
-    p->page->ref = 1;
-    p->page->flags &= ~PAGE_FLAG_FREE;
-    ret = p->page;
+struct page *page_node::alloc_contiguous(size_t nr_pgs, unsigned long flags)
+{
+    struct page *pages = nullptr;
 
-    used_pages++;
-    ::used_pages++;
+    for (int attempt = 0; attempt < 2 && !pages; attempt++)
+    {
+        /* Pages sitting in our per-CPU cache might be what's keeping blocks from coalescing */
+        if (attempt)
+            drain_local_pcp();
 
-out:
-    spin_unlock_irqrestore(&node_lock, cpu_flags);
-    return ret;
+        for (int i = NR_ZONES - 1; i >= 0; i--)
+        {
+            if (flags & PAGE_ALLOC_4GB_LIMIT && i != ZONE_DMA32)
+                continue;
+
+            auto &zone = zones[i];
+            unsigned long cpu_flags = spin_lock_irqsave(&zone.lock);
+            pages = zone.alloc_range(nr_pgs);
+            spin_unlock_irqrestore(&zone.lock, cpu_flags);
+
+            if (pages)
+                break;
+        }
+    }
+
+    if (pages)
+        prepare_pages(pages, nr_pgs, flags);
+
+    return pages;
+}
+
+/**
+ * @brief Allocate a single page, falling back to other nodes by increasing distance
+ *
+ * @param fallback Node fallback list
+ * @param flags Allocation flags
+ * @return The allocated page, or nullptr
+ */
+static struct page *alloc_page_fallback(const int *fallback, unsigned long flags)
+{
+    for (unsigned int i = 0; i < numa_nr_nodes(); i++)
+    {
+        struct page *p = nodes[fallback[i]].alloc_page(flags);
+        if (p)
+            return p;
+    }
+
+    return nullptr;
 }
 
-struct page *page_node::allocate_pages(size_t nr_pgs, unsigned long flags)
+static struct page *allocate_pages(const int *fallback, size_t nr_pgs, unsigned long flags)
 {
     struct page *plist = NULL;
     struct page *ptail = NULL;
 
     for (size_t i = 0; i < nr_pgs; i++)
     {
-        struct page *p = alloc_page(flags);
+        struct page *p = alloc_page_fallback(fallback, flags);
 
         if (!p)
         {
@@ -286,11 +766,6 @@ struct page *page_node::allocate_pages(size_t nr_pgs, unsigned long flags)
             return NULL;
         }
 
-        if (page_should_zero(flags))
-        {
-            set_non_temporal(PAGE_TO_VIRT(p), 0, PAGE_SIZE);
-        }
-
         if (!plist)
         {
             plist = ptail = p;
@@ -308,137 +783,60 @@ struct page *page_node::allocate_pages(size_t nr_pgs, unsigned long flags)
     return plist;
 }
 
-struct page *page_arena::alloc_contiguous(size_t nr_pgs, unsigned long flags)
+struct page *alloc_pages_node(int nid, size_t nr_pgs, unsigned long flags)
 {
-    unsigned long start = (unsigned long) start_arena;
-    unsigned long end = (unsigned long) end_arena & -(PAGE_SIZE - 1);
-    auto current = start;
-    struct page *first_page = nullptr;
-
-    unsigned long contig_in_row = 0;
+    const int *fallback = numa_node_fallback(nid);
 
-    while (current != end)
+    /* Optimise for the possibility that someone's looking to allocate '1' contiguous page */
+    if (unlikely(flags & PAGE_ALLOC_CONTIGUOUS && nr_pgs > 1))
     {
-        struct page *p = phys_to_page(current);
-
-        if (flags & PAGE_ALLOC_4GB_LIMIT && current >= ADDRESS_4GB_MARK)
-            return nullptr;
-
-        if (!(p->flags & PAGE_FLAG_FREE))
+        for (unsigned int i = 0; i < numa_nr_nodes(); i++)
         {
-            contig_in_row = 0;
-            first_page = nullptr;
-        }
-        else
-        {
-            contig_in_row++;
-
-            if (!first_page)
-                first_page = p;
-            assert(p->ref == 0);
+            struct page *pages = nodes[fallback[i]].alloc_contiguous(nr_pgs, flags);
+            if (pages)
+                return pages;
         }
 
-        if (contig_in_row == nr_pgs)
-            break;
-
-        current += PAGE_SIZE;
-    }
-
-    if (contig_in_row != nr_pgs)
         return nullptr;
-
-    struct page *before = nullptr;
-
-    for (size_t i = 0; i < nr_pgs; i++)
-    {
-        auto page = first_page + i;
-        auto page_list_struct = (page_list *) PAGE_TO_VIRT(page);
-        list_remove(&page_list_struct->list_node);
-        page->flags &= ~PAGE_FLAG_FREE;
-
-        page_ref(page);
-
-        if (before)
-            before->next_un.next_allocation = page;
-
-        before = page;
-    }
-
-    used_pages += nr_pgs;
-    ::used_pages += nr_pgs;
-
-    if (page_should_zero(flags))
-    {
-        set_non_temporal(PAGE_TO_VIRT(first_page), 0, nr_pgs << PAGE_SHIFT);
     }
 
-    return first_page;
-}
-
-struct page *page_node::alloc_contiguous(size_t nr_pgs, unsigned long flags)
-{
-    struct page *pages = nullptr;
-    unsigned long cpu_flags = spin_lock_irqsave(&node_lock);
-
-    list_for_every (&arena_list)
-    {
-        page_arena *arena = container_of(l, page_arena, arena_list_node);
-
-        if (flags & PAGE_ALLOC_4GB_LIMIT && (unsigned long) arena->start_arena >= ADDRESS_4GB_MARK)
-            goto out;
-        pages = arena->alloc_contiguous(nr_pgs, flags);
-
-        if (pages)
-            goto out;
-    }
-
-out:
-    spin_unlock_irqrestore(&node_lock, cpu_flags);
-    return pages;
+    return allocate_pages(fallback, nr_pgs, flags);
 }
 
 struct page *alloc_pages(size_t nr_pgs, unsigned long flags)
 {
-    auto &node = main_node;
-
-    /* Optimise for the possibility that someone's looking to allocate '1' contiguous page */
-    if (unlikely(flags & PAGE_ALLOC_CONTIGUOUS && nr_pgs > 1))
-        return node.alloc_contiguous(nr_pgs, flags);
-    else
-        return node.allocate_pages(nr_pgs, flags);
+    return alloc_pages_node(numa_local_node(), nr_pgs, flags);
 }
 
 void __reclaim_page(struct page *new_page)
 {
     __sync_add_and_fetch(&nr_global_pages, 1);
 
-    /* We need to set new_page->ref to 1 as free_page will decrement the ref as to
-     * free it
-     */
-    new_page->ref = 1;
-    free_page(new_page);
+    nodes[page_to_nid(new_page)].reclaim_page(new_page);
 }
 
 void page_node::free_page(struct page *p)
 {
-    unsigned long cpu_flags = spin_lock_irqsave(&node_lock);
-
     /* Reset the page */
     p->flags = 0;
     p->cache = nullptr;
     p->next_un.next_allocation = nullptr;
+    p->priv = 0;
     p->ref = 0;
 
-    p->flags |= PAGE_FLAG_FREE;
+    ::used_pages--;
 
-    auto page_list_node = (struct page_list *) PAGE_TO_VIRT(p);
-    page_list_node->page = p;
+    unsigned long cpu_flags = irq_save_and_disable();
+    auto pcp = get_pcp();
 
     /* Add it at the beginning since it might be fresh in the cache */
-    list_add(&page_list_node->list_node, &page_list);
+    auto list = page_to_list(p);
+    list->page = p;
+    list_add(&list->list_node, &pcp->pages);
+    pcp->count++;
 
-    used_pages--;
-    ::used_pages--;
+    if (pcp->count > page_pcpu_high)
+        pcp_drain(pcp, page_pcpu_batch);
 
-    spin_unlock_irqrestore(&node_lock, cpu_flags);
+    irq_restore(cpu_flags);
 }
@@ -8,6 +8,7 @@
 
 #include <onyx/list.h>
 #include <onyx/mm/slab.h>
+#include <onyx/numa.h>
 #include <onyx/page.h>
 #include <onyx/rwlock.h>
 #include <onyx/vm.h>
@@ -40,6 +41,10 @@ struct bufctl;
  * which hold magazines (atm, up to 128 elements) of objects.
  * Ideally, you allocate and free straight from/to these, bypassing locking. The size of a
  * batch (the allocation/freeing unit) derives from the size of your object.
+ *
+ * The free/partial/full lists are kept per NUMA node (see struct slab_cache_node). A slab
+ * belongs to the node it was created on, CPUs only allocate from their own node's slabs, and
+ * objects always get freed back to the list of the slab's node.
  */
 
 struct slab
@@ -56,6 +61,7 @@ struct slab
     size_t active_objects;
     size_t nobjects;
     struct slab_cache *cache;
+    int nid;
 };
 
 #define SLAB_CANARY 0x00600DBAAE600DBA
@@ -123,13 +129,17 @@ struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align
 
     c->ctor = ctor;
 
-    INIT_LIST_HEAD(&c->free_slabs);
-    INIT_LIST_HEAD(&c->partial_slabs);
-    INIT_LIST_HEAD(&c->full_slabs);
-    spinlock_init(&c->lock);
+    for (auto &n : c->node)
+    {
+        INIT_LIST_HEAD(&n.free_slabs);
+        INIT_LIST_HEAD(&n.partial_slabs);
+        INIT_LIST_HEAD(&n.full_slabs);
+        spinlock_init(&n.lock);
+        n.npartialslabs = n.nfreeslabs = n.nfullslabs = 0;
+    }
+
     c->nr_objects = 0;
     c->active_objects = 0;
-    c->npartialslabs = c->nfreeslabs = c->nfullslabs = 0;
 
     for (auto &pcpu : c->pcpu)
     {
@@ -153,6 +163,17 @@ struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align
 // Note: We can simplify the below slab state transitions to free <-> partial <-> full
 // since each slab always has more than a single object.
 
+/**
+ * @brief Get the slab cache node a slab belongs to
+ *
+ * @param s Slab
+ * @return Pointer to the slab_cache_node
+ */
+ALWAYS_INLINE static inline struct slab_cache_node *kmem_slab_node(struct slab *s)
+{
+    return &s->cache->node[s->nid];
+}
+
 /**
  * @brief Move a slab from its list to partial
  *
@@ -161,13 +182,14 @@ struct slab_cache *kmem_cache_create(const char *name, size_t size, size_t align
  */
 ALWAYS_INLINE static inline void kmem_move_slab_to_partial(struct slab *s, bool free)
 {
+    auto n = kmem_slab_node(s);
     list_remove(&s->slab_list_node);
-    list_add(&s->slab_list_node, &s->cache->partial_slabs);
-    s->cache->npartialslabs++;
+    list_add(&s->slab_list_node, &n->partial_slabs);
+    n->npartialslabs++;
     if (free)
-        s->cache->nfreeslabs--;
+        n->nfreeslabs--;
     else
-        s->cache->nfullslabs--;
+        n->nfullslabs--;
 }
 
 /**
@@ -177,13 +199,14 @@ ALWAYS_INLINE static inline void kmem_move_slab_to_partial(struct slab *s, bool
  */
 ALWAYS_INLINE static inline void kmem_move_slab_to_full(struct slab *s, bool free)
 {
+    auto n = kmem_slab_node(s);
     list_remove(&s->slab_list_node);
-    list_add_tail(&s->slab_list_node, &s->cache->full_slabs);
+    list_add_tail(&s->slab_list_node, &n->full_slabs);
     if (free)
-        s->cache->nfreeslabs--;
+        n->nfreeslabs--;
     else
-        s->cache->npartialslabs--;
-    s->cache->nfullslabs++;
+        n->npartialslabs--;
+    n->nfullslabs++;
 }
 
 /**
@@ -193,10 +216,11 @@ ALWAYS_INLINE static inline void kmem_move_slab_to_full(struct slab *s, bool fre
  */
 ALWAYS_INLINE static inline void kmem_move_slab_to_free(struct slab *s)
 {
+    auto n = kmem_slab_node(s);
     list_remove(&s->slab_list_node);
-    list_add_tail(&s->slab_list_node, &s->cache->free_slabs);
-    s->cache->npartialslabs--;
-    s->cache->nfreeslabs++;
+    list_add_tail(&s->slab_list_node, &n->free_slabs);
+    n->npartialslabs--;
+    n->nfreeslabs++;
 }
 
 /**
@@ -244,14 +268,14 @@ static void *kmem_cache_alloc_from_slab(struct slab *s, unsigned int flags)
 /**
  * @brief Allocate an object from the first slab on the partial list
  *
- * @param cache Slab cache
+ * @param n Slab cache node
  * @param flags Flags
  * @return Allocated object
  */
-static inline void *kmem_cache_alloc_from_partial(struct slab_cache *cache, unsigned int flags)
+static inline void *kmem_cache_alloc_from_partial(struct slab_cache_node *n, unsigned int flags)
 {
     struct slab *s =
-        container_of(list_first_element(&cache->partial_slabs), struct slab, slab_list_node);
+        container_of(list_first_element(&n->partial_slabs), struct slab, slab_list_node);
 
     return kmem_cache_alloc_from_slab(s, flags);
 }
@@ -259,14 +283,13 @@ static inline void *kmem_cache_alloc_from_partial(struct slab_cache *cache, unsi
 /**
  * @brief Allocate an object from the first slab on the free list
  *
- * @param cache Slab cache
+ * @param n Slab cache node
  * @param flags Flags
  * @return Allocated object
  */
-static inline void *kmem_cache_alloc_from_free(struct slab_cache *cache, unsigned int flags)
+static inline void *kmem_cache_alloc_from_free(struct slab_cache_node *n, unsigned int flags)
 {
-    struct slab *s =
-        container_of(list_first_element(&cache->free_slabs), struct slab, slab_list_node);
+    struct slab *s = container_of(list_first_element(&n->free_slabs), struct slab, slab_list_node);
 
     return kmem_cache_alloc_from_slab(s, flags);
 }
@@ -375,12 +398,15 @@ struct slab *kmem_pointer_to_slab_maybe(void *mem)
 
 /**
  * @brief Create a slab for a given cache
+ * The node's lock must be held.
  *
  * @param cache Slab cache
+ * @param nid NUMA node the slab will belong to
  * @param flags Allocation flags
  * @return A pointer to the new slab, or nullptr in OOM situations.
  */
-NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, unsigned int flags)
+NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, int nid,
+                                                   unsigned int flags)
 {
     char *start = nullptr;
     struct page *pages = nullptr;
@@ -390,7 +416,8 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
 
     if (cache->flags & KMEM_CACHE_DIRMAP) [[unlikely]]
     {
-        pages = alloc_pages(slab_size >> PAGE_SHIFT, PAGE_ALLOC_NO_ZERO | PAGE_ALLOC_CONTIGUOUS);
+        pages = alloc_pages_node(nid, slab_size >> PAGE_SHIFT,
+                                 PAGE_ALLOC_NO_ZERO | PAGE_ALLOC_CONTIGUOUS);
         if (!pages)
             return nullptr;
         start = (char *) PAGE_TO_VIRT(pages);
@@ -451,6 +478,7 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
     slab->active_objects = 0;
     slab->nobjects = nr_objects;
     slab->object_list = first;
+    slab->nid = nid;
 
     if (pages)
         slab->pages = pages;
@@ -458,8 +486,8 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
         slab->start = start;
 
     slab->size = slab_size;
-    list_add_tail(&slab->slab_list_node, &cache->free_slabs);
-    cache->nfreeslabs++;
+    list_add_tail(&slab->slab_list_node, &cache->node[nid].free_slabs);
+    cache->node[nid].nfreeslabs++;
 
     // Setup pointers to the slab in the struct pages
     size_t nr_pages = slab_size >> PAGE_SHIFT;
@@ -481,12 +509,13 @@ NO_ASAN static struct slab *kmem_cache_create_slab(struct slab_cache *cache, uns
  * @brief Allocate a slab and take an object from it
  *
  * @param cache Slab cache
+ * @param nid NUMA node
  * @param flags Allocation flags
  * @return Allocated object, or nullptr in OOM situations
  */
-static void *kmem_cache_alloc_noslab(struct slab_cache *cache, unsigned int flags)
+static void *kmem_cache_alloc_noslab(struct slab_cache *cache, int nid, unsigned int flags)
 {
-    struct slab *s = kmem_cache_create_slab(cache, flags);
+    struct slab *s = kmem_cache_create_slab(cache, nid, flags);
     if (!s)
         return nullptr;
     return kmem_cache_alloc_from_slab(s, flags);
@@ -502,25 +531,29 @@ static void *kmem_cache_alloc_noslab(struct slab_cache *cache, unsigned int flag
  */
 void *kmem_cache_alloc_nopcpu(struct slab_cache *cache, unsigned int flags)
 {
-    scoped_lock g{cache->lock};
+    const int nid = numa_local_node();
+    auto n = &cache->node[nid];
+    scoped_lock g{n->lock};
 
-    if (cache->npartialslabs != 0)
+    if (n->npartialslabs != 0)
     {
-        return kmem_cache_alloc_from_partial(cache, flags);
+        return kmem_cache_alloc_from_partial(n, flags);
     }
-    else if (cache->nfreeslabs != 0)
+    else if (n->nfreeslabs != 0)
     {
-        return kmem_cache_alloc_from_free(cache, flags);
+        return kmem_cache_alloc_from_free(n, flags);
     }
 
-    return kmem_cache_alloc_noslab(cache, flags);
+    return kmem_cache_alloc_noslab(cache, nid, flags);
 }
 
 static int kmem_cache_alloc_refill_mag(struct slab_cache *cache,
                                        struct slab_cache_percpu_context *pcpu, unsigned int flags)
 {
-    // Lets attempt to allocate a batch (half our stack)
-    scoped_lock g{cache->lock};
+    // Lets attempt to allocate a batch (half our stack), from our local node
+    const int nid = numa_local_node();
+    auto n = &cache->node[nid];
+    scoped_lock g{n->lock};
 
     const auto objs_per_slab = kmem_calc_slab_nr_objs(cache);
     const auto batch_size = cache->mag_limit / 2;
@@ -532,22 +565,21 @@ static int kmem_cache_alloc_refill_mag(struct slab_cache *cache,
     {
         bool isfree = false;
         struct slab *slab;
-        if (cache->npartialslabs)
+        if (n->npartialslabs)
         {
-            assert(!list_is_empty(&cache->partial_slabs));
-            slab = container_of(list_first_element(&cache->partial_slabs), struct slab,
-                                slab_list_node);
+            assert(!list_is_empty(&n->partial_slabs));
+            slab =
+                container_of(list_first_element(&n->partial_slabs), struct slab, slab_list_node);
         }
-        else if (cache->nfreeslabs)
+        else if (n->nfreeslabs)
         {
-            assert(!list_is_empty(&cache->free_slabs));
-            slab =
-                container_of(list_first_element(&cache->free_slabs), struct slab, slab_list_node);
+            assert(!list_is_empty(&n->free_slabs));
+            slab = container_of(list_first_element(&n->free_slabs), struct slab, slab_list_node);
             isfree = true;
         }
         else
         {
-            slab = kmem_cache_create_slab(cache, flags);
+            slab = kmem_cache_create_slab(cache, nid, flags);
             if (!slab)
             {
                 // Only fail on memory allocation failure if we were allocating extra
@@ -693,8 +725,9 @@ static void kmem_free_to_slab(struct slab_cache *cache, struct slab *slab, void
             // Free the slab, since these objects are way too large
             // we may as well assume they're a one-off allocation, as they
             // usually are.
+            auto n = kmem_slab_node(slab);
             kmem_cache_free_slab(slab);
-            cache->npartialslabs--;
+            n->npartialslabs--;
         }
         else
             // Move partial to free
@@ -717,13 +750,15 @@ static void kfree_nopcpu(void *ptr)
     asan_poison_shadow((unsigned long) ptr, cache->objsize, KASAN_FREED);
 #endif
 
-    scoped_lock g{cache->lock};
+    scoped_lock g{kmem_slab_node(slab)->lock};
     kmem_free_to_slab(cache, slab, ptr);
 }
 
 void kmem_cache_return_pcpu_batch(struct slab_cache *cache, struct slab_cache_percpu_context *pcpu)
 {
-    scoped_lock g{cache->lock};
+    // Objects in the magazine may belong to slabs of different nodes (e.g freed here, but
+    // allocated elsewhere), so we grab each node's lock as needed.
+    struct slab_cache_node *locked = nullptr;
     auto size = cache->mag_limit;
     auto batchsize = size / 2;
     for (int i = 0; i < batchsize; i++)
@@ -733,13 +768,24 @@ void kmem_cache_return_pcpu_batch(struct slab_cache *cache, struct slab_cache_pe
 
         if (slab->cache != cache) [[unlikely]]
             panic("slab: Pointer %p was returned to the wrong cache\n", ptr);
+
+        auto n = kmem_slab_node(slab);
+        if (n != locked)
+        {
+            if (locked)
+                spin_unlock(&locked->lock);
+            spin_lock(&n->lock);
+            locked = n;
+        }
+
         ((bufctl *) ptr)->flags = 0;
         kmem_free_to_slab(cache, slab, ptr);
         pcpu->size--;
     }
 
     // Unlock the cache since we're about to do an expensive-ish memmove
-    g.unlock();
+    if (locked)
+        spin_unlock(&locked->lock);
 
     memmove(pcpu->magazine, &pcpu->magazine[batchsize], (size - pcpu->size) * sizeof(void *));
 }
@@ -881,7 +927,7 @@ static void kmem_purge_local_cache(struct slab_cache *cache)
     if (pcpu->touched.load(mem_order::relaxed))
         return;
 
-    // Cache lock is implicitly held.
+    // Every node lock is implicitly held.
 
     for (int i = 0; i < pcpu->size; i++)
     {
@@ -917,17 +963,44 @@ static void __kmem_cache_purge(struct slab_cache *cache)
 
     sched_enable_preempt();
 
-    if (!cache->nfreeslabs)
-        return;
-
-    list_for_every_safe (&cache->free_slabs)
+    for (unsigned int i = 0; i < numa_nr_nodes(); i++)
     {
-        auto s = container_of(l, struct slab, slab_list_node);
-        kmem_cache_free_slab(s);
-        cache->nfreeslabs--;
+        auto n = &cache->node[i];
+
+        if (!n->nfreeslabs)
+            continue;
+
+        list_for_every_safe (&n->free_slabs)
+        {
+            auto s = container_of(l, struct slab, slab_list_node);
+            kmem_cache_free_slab(s);
+            n->nfreeslabs--;
+        }
     }
 }
 
+/**
+ * @brief Lock every node of a slab cache
+ *
+ * @param cache Slab cache
+ */
+static void kmem_cache_lock_nodes(struct slab_cache *cache)
+{
+    for (unsigned int i = 0; i < numa_nr_nodes(); i++)
+        spin_lock(&cache->node[i].lock);
+}
+
+/**
+ * @brief Unlock every node of a slab cache
+ *
+ * @param cache Slab cache
+ */
+static void kmem_cache_unlock_nodes(struct slab_cache *cache)
+{
+    for (unsigned int i = numa_nr_nodes(); i > 0; i--)
+        spin_unlock(&cache->node[i - 1].lock);
+}
+
 /**
  * @brief Purge a cache
  * This function goes through every free slab and gives it back to the page allocator.
@@ -937,8 +1010,9 @@ static void __kmem_cache_purge(struct slab_cache *cache)
  */
 void kmem_cache_purge(struct slab_cache *cache)
 {
-    scoped_lock g{cache->lock};
+    kmem_cache_lock_nodes(cache);
     __kmem_cache_purge(cache);
+    kmem_cache_unlock_nodes(cache);
 }
 
 /**
@@ -951,20 +1025,24 @@ void kmem_cache_purge(struct slab_cache *cache)
 void kmem_cache_destroy(struct slab_cache *cache)
 {
     // Note: lock the cache list lock first, since we don't want memory reclamation
-    // to possibly get in the way. Reclamation will do cache_list_lock -> cache->lock.
+    // to possibly get in the way. Reclamation will do cache_list_lock -> node locks.
 
     {
         scoped_lock g{cache_list_lock};
-        scoped_lock g2{cache->lock};
+        kmem_cache_lock_nodes(cache);
 
         __kmem_cache_purge(cache);
 
-        if (cache->npartialslabs || cache->nfullslabs)
+        for (unsigned int i = 0; i < numa_nr_nodes(); i++)
         {
-            panic("slab: Tried to destroy cache %s (%p) which has live objects\n", cache->name,
-                  cache);
+            if (cache->node[i].npartialslabs || cache->node[i].nfullslabs)
+            {
+                panic("slab: Tried to destroy cache %s (%p) which has live objects\n",
+                      cache->name, cache);
+            }
         }
 
+        kmem_cache_unlock_nodes(cache);
         list_remove(&cache->cache_list_node);
     }
 
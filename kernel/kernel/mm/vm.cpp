@@ -34,6 +34,7 @@
 #include <onyx/spinlock.h>
 #include <onyx/sysfs.h>
 #include <onyx/timer.h>
+#include <onyx/tracepoint.h>
 #include <onyx/user.h>
 #include <onyx/utils.h>
 #include <onyx/vfs.h>
@@ -145,13 +146,13 @@ bool vm_insert_region(struct mm_address_space *as, struct vm_region *region)
 
 struct vm_region *vm_reserve_region(struct mm_address_space *as, unsigned long start, size_t size)
 {
-    MUST_HOLD_MUTEX(&as->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&as->vm_lock);
 
     struct vm_region *region = vm_alloc_vmregion();
     if (!region)
         return nullptr;
 
-    memset(region, 0, sizeof(*region));
+    memset((void *) region, 0, sizeof(*region));
 
     region->base = start;
     region->pages = vm_size_to_pages(size);
@@ -195,7 +196,7 @@ struct vm_region *vm_reserve_region(struct mm_address_space *as, unsigned long s
 
 unsigned long vm_allocate_base(struct mm_address_space *as, unsigned long min, size_t size)
 {
-    MUST_HOLD_MUTEX(&as->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&as->vm_lock);
 
     if (min < as->start)
         min = as->start;
@@ -310,17 +311,17 @@ void vm_addr_init()
 static inline void __vm_lock(bool kernel)
 {
     if (kernel)
-        mutex_lock(&kernel_address_space.vm_lock);
+        rw_lock_write(&kernel_address_space.vm_lock);
     else
-        mutex_lock(&get_current_process()->get_aspace()->vm_lock);
+        rw_lock_write(&get_current_process()->get_aspace()->vm_lock);
 }
 
 static inline void __vm_unlock(bool kernel)
 {
     if (kernel)
-        mutex_unlock(&kernel_address_space.vm_lock);
+        rw_unlock_write(&kernel_address_space.vm_lock);
     else
-        mutex_unlock(&get_current_process()->get_aspace()->vm_lock);
+        rw_unlock_write(&get_current_process()->get_aspace()->vm_lock);
 }
 
 static inline bool is_higher_half(void *address)
@@ -378,7 +379,7 @@ void vm_late_init()
     vm_addr_init();
 
     heap_size = arch_heap_get_size() - (heap_addr - heap_addr_no_aslr);
-    scoped_mutex g{kernel_address_space.vm_lock};
+    scoped_rwlock<rw_lock::write> g{kernel_address_space.vm_lock};
 
     /* Start populating the address space */
     struct vm_region *v = vm_reserve_region(&kernel_address_space, heap_addr, heap_size);
@@ -460,7 +461,7 @@ void do_vm_unmap(void *range, size_t pages)
     struct vm_region *entry = vm_find_region(range);
     assert(entry != nullptr);
 
-    MUST_HOLD_MUTEX(&entry->mm->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&entry->mm->vm_lock);
 
     vm_mmu_unmap(entry->mm, range, pages);
 }
@@ -524,7 +525,7 @@ bool vm_mapping_requires_write_protect(struct vm_region *reg)
 
 void vm_region_destroy(struct vm_region *region)
 {
-    MUST_HOLD_MUTEX(&region->mm->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&region->mm->vm_lock);
 
     /* First, unref things */
     if (region->fd)
@@ -561,7 +562,7 @@ void vm_destroy_mappings(void *range, size_t pages)
     struct mm_address_space *mm =
         is_higher_half(range) ? &kernel_address_space : get_current_process()->get_aspace();
 
-    scoped_mutex g{mm->vm_lock};
+    scoped_rwlock<rw_lock::write> g{mm->vm_lock};
 
     struct vm_region *reg = vm_find_region(range);
 
@@ -623,7 +624,7 @@ struct vm_region *__vm_allocate_virt_region(uint64_t flags, size_t pages, uint32
     struct mm_address_space *as =
         allocating_kernel ? &kernel_address_space : get_current_process()->get_aspace();
 
-    MUST_HOLD_MUTEX(&as->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&as->vm_lock);
 
     unsigned long base_addr = vm_get_base_address(flags, type);
 
@@ -830,29 +831,19 @@ int vm_flush_mapping(struct vm_region *mapping, struct mm_address_space *mm, uns
     size_t nr_pages = mapping->pages;
 
     size_t off = mapping->offset;
-    struct rb_itor it;
-    it.node = nullptr;
 
     scoped_mutex g{vmo->page_lock};
 
-    it.tree = vmo->pages;
     int mapping_rwx = flags & VM_FLUSH_RWX_VALID ? (int) rwx : mapping->rwx;
 
-    bool node_valid = rb_itor_search_ge(&it, (void *) off);
-    while (node_valid)
-    {
-        struct page *p = (page *) *rb_itor_datum(&it);
-        size_t poff = (size_t) rb_itor_key(&it);
-
-        if (poff >= off + (nr_pages << PAGE_SHIFT))
-            break;
+    auto map_page = [&](struct page *p, size_t poff) -> bool {
         unsigned long reg_off = poff - off;
-        if (!__map_pages_to_vaddr(mm, (void *) (mapping->base + reg_off), page_to_phys(p),
-                                  PAGE_SIZE, mapping_rwx))
-            return -ENOMEM;
+        return __map_pages_to_vaddr(mm, (void *) (mapping->base + reg_off), page_to_phys(p),
+                                    PAGE_SIZE, mapping_rwx) != nullptr;
+    };
 
-        node_valid = rb_itor_next(&it);
-    }
+    if (!vmo->for_every_page(off, off + (nr_pages << PAGE_SHIFT), map_page))
+        return -ENOMEM;
 
     return 0;
 }
@@ -917,7 +908,7 @@ static bool fork_vm_region(struct vm_region *region, struct fork_iteration *it)
         goto ohno;
     }
 
-    memcpy(new_region, region, sizeof(*region));
+    memcpy((void *) new_region, region, sizeof(*region));
 
 #if DEBUG_FORK_VM
     printk("Forking [%016lx, %016lx] perms %x\n", region->base,
@@ -1102,7 +1093,7 @@ int vm_fork_address_space(struct mm_address_space *addr_space)
 
     assert(addr_space->active_mask.is_empty());
 
-    mutex_init(&addr_space->vm_lock);
+    rwlock_init(&addr_space->vm_lock);
 
     __vm_unlock(false);
     return 0;
@@ -1125,10 +1116,10 @@ void vm_change_perms(void *range, size_t pages, int perms)
     else
         as = get_current_process()->get_aspace();
 
-    if (mutex_owner(&as->vm_lock) != get_current_thread())
+    if (!rw_lock_holds_write(&as->vm_lock))
     {
         needs_release = true;
-        mutex_lock(&as->vm_lock);
+        rw_lock_write(&as->vm_lock);
     }
 
     for (size_t i = 0; i < pages; i++)
@@ -1141,7 +1132,7 @@ void vm_change_perms(void *range, size_t pages, int perms)
     vm_invalidate_range((unsigned long) range, pages);
 
     if (needs_release)
-        mutex_unlock(&as->vm_lock);
+        rw_unlock_write(&as->vm_lock);
 }
 
 /**
@@ -1277,7 +1268,7 @@ void *vm_mmap(void *addr, size_t length, int prot, int flags, struct file *file,
     if (off & (PAGE_SIZE - 1))
         return errno = EINVAL, nullptr;
 
-    scoped_mutex g{mm->vm_lock};
+    scoped_rwlock<rw_lock::write> g{mm->vm_lock};
 
     /* Calculate the pages needed for the overall size */
     size_t pages = vm_size_to_pages(length);
@@ -1662,7 +1653,7 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
     unsigned long addr = (unsigned long) __addr;
     unsigned long limit = addr + size;
 
-    scoped_mutex g{as->vm_lock};
+    scoped_rwlock<rw_lock::write> g{as->vm_lock};
 
     while (addr < limit)
     {
@@ -1738,6 +1729,115 @@ int sys_mprotect(void *addr, size_t len, int prot)
     return st;
 }
 
+/**
+ * @brief Sets the readahead hint flags (VM_SEQ_READ, VM_RAND_READ) of a memory range.
+ *
+ * @param as The target address space.
+ * @param addr The start of the memory range.
+ * @param size The size of the memory range, in bytes.
+ * @param hint The new hint flags.
+ * @return 0 on success, negative error codes.
+ */
+static int vm_set_ra_hint(struct mm_address_space *as, unsigned long addr, size_t size, int hint)
+{
+    scoped_rwlock<rw_lock::write> g{as->vm_lock};
+
+    while (size)
+    {
+        struct vm_region *region = vm_search(as, (void *) addr, PAGE_SIZE);
+        if (!region)
+            return -ENOMEM;
+
+        size_t to_shave_off = 0;
+        struct vm_region *new_region = vm_split_region(as, region, addr, size, &to_shave_off);
+        if (!new_region)
+            return -ENOMEM;
+
+        new_region->flags = (new_region->flags & ~(VM_SEQ_READ | VM_RAND_READ)) | hint;
+
+        addr += to_shave_off;
+        size -= to_shave_off;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reads the file pages backing a memory range into the page cache.
+ *
+ * @param as The target address space.
+ * @param addr The start of the memory range.
+ * @param size The size of the memory range, in bytes.
+ * @return 0 on success, negative error codes.
+ */
+static int vm_willneed(struct mm_address_space *as, unsigned long addr, size_t size)
+{
+    scoped_rwlock<rw_lock::read> g{as->vm_lock};
+    unsigned long limit = addr + size;
+
+    while (addr < limit)
+    {
+        struct vm_region *region = vm_search(as, (void *) addr, PAGE_SIZE);
+        if (!region)
+            return -ENOMEM;
+
+        unsigned long start = addr;
+        unsigned long end = region->base + (region->pages << PAGE_SHIFT);
+        if (end > limit)
+            end = limit;
+
+        if (region->fd)
+        {
+            size_t off = (start - region->base) + region->offset;
+            if (region->vmo->cow_clone)
+                off += (size_t) region->vmo->priv;
+
+            int st = force_page_cache_readahead(region->fd->f_ino, off >> PAGE_SHIFT,
+                                                (end - start) >> PAGE_SHIFT);
+            if (st < 0)
+                return st;
+        }
+
+        addr = end;
+    }
+
+    return 0;
+}
+
+int sys_madvise(void *addr, size_t len, int advice)
+{
+    if (is_higher_half(addr))
+        return -EINVAL;
+
+    /* The address needs to be page aligned */
+    if ((unsigned long) addr & (PAGE_SIZE - 1))
+        return -EINVAL;
+
+    len = vm_size_to_pages(len) << PAGE_SHIFT;
+
+    if (!len)
+        return 0;
+
+    struct mm_address_space *as = get_current_process()->get_aspace();
+
+    switch (advice)
+    {
+        case MADV_NORMAL:
+            return vm_set_ra_hint(as, (unsigned long) addr, len, 0);
+        case MADV_SEQUENTIAL:
+            return vm_set_ra_hint(as, (unsigned long) addr, len, VM_SEQ_READ);
+        case MADV_RANDOM:
+            return vm_set_ra_hint(as, (unsigned long) addr, len, VM_RAND_READ);
+        case MADV_WILLNEED:
+            return vm_willneed(as, (unsigned long) addr, len);
+        case MADV_FREE:
+            /* Just a hint, we're allowed to keep the pages around */
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
 int vm_expand_brk(size_t nr_pages);
 
 int do_inc_brk(void *oldbrk, void *newbrk)
@@ -1759,7 +1859,7 @@ uint64_t sys_brk(void *newbrk)
 {
     mm_address_space *as = get_current_address_space();
 
-    scoped_mutex g{as->vm_lock};
+    scoped_rwlock<rw_lock::write> g{as->vm_lock};
 
     if (newbrk == nullptr)
     {
@@ -1990,7 +2090,7 @@ int vm_handle_non_present_wp(struct fault_info *info, struct vm_pf_context *ctx)
                 return -1;
             }
 
-            pagecache_dirty_block(ctx->page->cache);
+            /* The page gets dirtied by vm_handle_non_present_pf, once it's mapped */
         }
         else if (vm_mapping_is_anon(entry))
         {
@@ -2025,11 +2125,18 @@ int vm_handle_non_present_copy_on_write(struct fault_info *info, struct vm_pf_co
     if (!vmo->cow_clone)
     {
         assert(*(volatile int *) PAGE_TO_VIRT(vm_zero_page) == 0);
+        ctx->page_rwx &= ~VM_WRITE;
         page_ref(vm_zero_page);
         page_ref(vm_zero_page);
-        vmo_add_page(vmo_off, vm_zero_page, vmo);
+        if (vmo_add_page(vmo_off, vm_zero_page, vmo) < 0)
+        {
+            /* A concurrent fault got a page in first, map that one instead */
+            page_unref(vm_zero_page);
+            page_unref(vm_zero_page);
+            return 0;
+        }
+
         ctx->page = vm_zero_page;
-        ctx->page_rwx &= ~VM_WRITE;
         return 0;
     }
 
@@ -2050,11 +2157,31 @@ int vm_handle_non_present_copy_on_write(struct fault_info *info, struct vm_pf_co
     return 0;
 }
 
+/**
+ * @brief Do readahead for a fault on a file mapping
+ *
+ * @param ctx Page fault context
+ */
+static void vm_pf_readahead(struct vm_pf_context *ctx)
+{
+    struct vm_region *entry = ctx->entry;
+    size_t off = (ctx->vpage - entry->base) + entry->offset;
+
+    /* Private file mappings keep the file offset in the COW vmo */
+    if (entry->vmo->cow_clone)
+        off += (size_t) entry->vmo->priv;
+
+    filemap_fault_readahead(entry->fd, off >> PAGE_SHIFT, entry->flags & VM_SEQ_READ);
+}
+
 int vm_handle_non_present_pf(struct vm_pf_context *ctx)
 {
     struct vm_region *entry = ctx->entry;
     struct fault_info *info = ctx->info;
 
+    if (entry->fd && !(entry->flags & VM_RAND_READ))
+        vm_pf_readahead(ctx);
+
     if (vm_mapping_requires_write_protect(entry))
     {
         if (vm_handle_non_present_wp(info, ctx) < 0)
@@ -2077,14 +2204,25 @@ int vm_handle_non_present_pf(struct vm_pf_context *ctx)
         }
     }
 
+    /* The zero page may have been put in the vmo by a concurrent read fault */
+    if (ctx->page == vm_zero_page)
+        ctx->page_rwx &= ~VM_WRITE;
+
+    /* Don't map over the page if a concurrent fault mapped it first, as it may have already
+     * been COW'd. If so, the access gets retried against the new mapping.
+     */
     if (!map_pages_to_vaddr((void *) ctx->vpage, page_to_phys(ctx->page), PAGE_SIZE,
-                            ctx->page_rwx | VM_NOFLUSH))
+                            ctx->page_rwx | VM_NOFLUSH | VM_DONT_MAP_OVER))
     {
         page_unpin(ctx->page);
         info->signal = VM_SIGSEGV;
         return -1;
     }
 
+    /* Like vm_handle_write_wb, only dirty the page after it's mapped writable */
+    if (info->write && vm_mapping_requires_wb(entry))
+        pagecache_dirty_block(ctx->page->cache);
+
     page_unpin(ctx->page);
 
     return 0;
@@ -2102,11 +2240,15 @@ int vm_handle_write_wb(struct vm_pf_context *ctx)
         return st;
     }
 
-    pagecache_dirty_block(p->cache);
-
+    /* Make the page writable before dirtying it. Writeback clears the dirty bit before
+     * write-protecting the page, so if it runs concurrently, we either end up write-protected
+     * or dirty.
+     */
     paging_change_perms((void *) ctx->vpage, ctx->page_rwx);
     vm_invalidate_range(ctx->vpage, 1);
 
+    pagecache_dirty_block(p->cache);
+
     return 0;
 }
 
@@ -2130,7 +2272,8 @@ int vm_handle_present_cow(struct vm_pf_context *ctx)
 		printk("\n");
 #endif
 
-    struct page *new_page = vmo_cow_on_page(vmo, vmo_off);
+    struct page *new_page =
+        vmo_cow_on_page(vmo, vmo_off, phys_to_page(MAPPING_INFO_PADDR(ctx->mapping_info)));
     if (!new_page)
     {
         info->signal = VM_SIGSEGV;
@@ -2184,6 +2327,11 @@ int vm_handle_present_pf(struct vm_pf_context *ctx)
 int __vm_handle_pf(struct vm_region *entry, struct fault_info *info)
 {
     assert(entry->vmo != nullptr);
+
+    /* Other threads may be faulting on this page at the same time, so mapping_info is only a
+     * snapshot. The handlers recheck it where it matters: under the page table lock when
+     * mapping a non-present page, and under the vmo's page_lock when COW'ing.
+     */
     struct vm_pf_context context;
     context.entry = entry;
     context.info = info;
@@ -2228,19 +2376,31 @@ int vm_handle_page_fault(struct fault_info *info)
     struct mm_address_space *as =
         use_kernel_as ? &kernel_address_space : get_current_address_space();
 
+    /* The caller is going to handle the failure itself (see pagefault_disable) */
+    if (pagefault_is_disabled())
+    {
+        info->signal = VM_SIGSEGV;
+        return -1;
+    }
+
     if (sched_is_preemption_disabled())
         panic("Page fault while preemption was disabled\n");
     if (irq_is_disabled())
         panic("Page fault while IRQs were disabled\n");
 
+    trace_page_fault(info->fault_address, info->ip,
+                     (info->write ? KTRACE_PF_WRITE : 0) | (info->exec ? KTRACE_PF_EXEC : 0) |
+                         (info->user ? KTRACE_PF_USER : 0));
+
     /* Surrender immediately if there's no user address space or the fault was inside vm code */
-    if (!as || mutex_holds_lock(&as->vm_lock))
+    if (!as || rw_lock_holds_write(&as->vm_lock))
     {
         info->signal = VM_SIGSEGV;
         return -1;
     }
 
-    scoped_mutex g{as->vm_lock};
+    /* Faults only need the region tree to stay stable, so they can run concurrently */
+    scoped_rwlock<rw_lock::read> g{as->vm_lock};
 
     struct vm_region *entry = vm_find_region((void *) info->fault_address);
     if (!entry)
@@ -2313,7 +2473,7 @@ void vm_destroy_addr_space(struct mm_address_space *mm)
     bool free_pgd = true;
 
     /* First, iterate through the rb tree and free/unmap stuff */
-    scoped_mutex g{mm->vm_lock};
+    scoped_rwlock<rw_lock::write> g{mm->vm_lock};
 
     vm_region *entry;
 
@@ -2653,7 +2813,7 @@ void *vm_map_vmo(size_t flags, uint32_t type, size_t pages, size_t prot, vm_obje
     struct mm_address_space *mm =
         kernel ? &kernel_address_space : get_current_process()->get_aspace();
 
-    scoped_mutex g{mm->vm_lock};
+    scoped_rwlock<rw_lock::write> g{mm->vm_lock};
 
     struct vm_region *reg = __vm_allocate_virt_region(flags, pages, type, prot);
     if (!reg)
@@ -2904,7 +3064,7 @@ int vm_create_address_space(struct mm_address_space *mm)
 
     assert(mm->active_mask.is_empty() == true);
 
-    mutex_init(&mm->vm_lock);
+    rwlock_init(&mm->vm_lock);
 
     bst_root_initialize(&mm->region_tree);
 
@@ -2952,14 +3112,14 @@ void *vm_get_fallback_pgd()
 
 void vm_remove_region(struct mm_address_space *as, struct vm_region *region)
 {
-    MUST_HOLD_MUTEX(&as->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&as->vm_lock);
 
     bst_delete(&as->region_tree, &region->tree_node);
 }
 
 int vm_add_region(struct mm_address_space *as, struct vm_region *region)
 {
-    MUST_HOLD_MUTEX(&as->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&as->vm_lock);
 
     return vm_insert_region(as, region);
 }
@@ -2972,7 +3132,7 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size)
     unsigned long limit = addr + size;
     // printk("munmap [%016lx, %016lx]\n", addr, limit - 1);
 
-    MUST_HOLD_MUTEX(&as->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&as->vm_lock);
 
     while (addr < limit)
     {
@@ -3104,7 +3264,7 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size)
  */
 int vm_munmap(struct mm_address_space *as, void *__addr, size_t size)
 {
-    scoped_mutex g{as->vm_lock};
+    scoped_rwlock<rw_lock::write> g{as->vm_lock};
 
     auto addr = (unsigned long) __addr;
     if (addr < as->start || addr > as->end)
@@ -3178,7 +3338,7 @@ int __vm_expand_mapping(struct vm_region *region, size_t new_size)
 
 int vm_expand_mapping(struct mm_address_space *as, struct vm_region *region, size_t new_size)
 {
-    MUST_HOLD_MUTEX(&as->vm_lock);
+    MUST_HOLD_RWLOCK_WRITE(&as->vm_lock);
 
     if (!vm_can_expand(as, region, new_size))
     {
@@ -3384,7 +3544,7 @@ void *sys_mremap(void *old_address, size_t old_size, size_t new_size, int flags,
     bool fixed = flags & MREMAP_FIXED;
     bool wants_create_new_mapping_of_pages = old_size == 0 && may_move;
     void *ret = MAP_FAILED;
-    scoped_mutex g{current->address_space->vm_lock};
+    scoped_rwlock<rw_lock::write> g{current->address_space->vm_lock};
 
     /* TODO: Unsure on what to do if new_size > old_size */
 
@@ -3498,27 +3658,16 @@ int vm_change_locks_range_in_region(struct vm_region *region, unsigned long addr
 
     scoped_mutex g{region->vmo->page_lock};
 
-    struct rb_itor it;
-    it.node = nullptr;
-    it.tree = region->vmo->pages;
     unsigned long starting_off = region->offset + (addr - region->base);
     unsigned long end_off = starting_off + len;
-    bool node_valid = rb_itor_search_ge(&it, (void *) starting_off);
-
-    while (node_valid)
-    {
-        struct page *p = (page *) *rb_itor_datum(&it);
-        size_t poff = (size_t) rb_itor_key(&it);
 
-        if (poff >= end_off)
-            return 0;
+    region->vmo->for_every_page(starting_off, end_off, [flags](struct page *p, size_t) -> bool {
         if (flags & VM_LOCK)
             p->flags |= PAGE_FLAG_LOCKED;
         else
             p->flags &= ~(PAGE_FLAG_LOCKED);
-
-        node_valid = rb_itor_next(&it);
-    }
+        return true;
+    });
 
     return 0;
 }
@@ -3535,7 +3684,7 @@ int vm_change_region_locks(void *__start, unsigned long length, unsigned long fl
     unsigned long limit = (unsigned long) __start + length;
     unsigned long addr = (unsigned long) __start;
 
-    scoped_mutex g{as->vm_lock};
+    scoped_rwlock<rw_lock::write> g{as->vm_lock};
 
     while (addr < limit)
     {
@@ -3579,7 +3728,10 @@ void vm_wp_page(struct mm_address_space *mm, void *vaddr)
 void vm_wp_page_for_every_region(page *page, size_t page_off, vm_object *vmo)
 {
     vmo->for_every_mapping([page_off](vm_region *region) -> bool {
-        scoped_mutex g{region->mm->vm_lock};
+        /* Write faults may run concurrently. That's fine, since the dirty bit is cleared
+         * before we get here, and they only dirty the page after making it writable.
+         */
+        scoped_rwlock<rw_lock::read> g{region->mm->vm_lock};
         const size_t mapping_off = (size_t) region->offset;
         const size_t mapping_size = region->pages << PAGE_SHIFT;
 
@@ -3694,7 +3846,7 @@ int get_phys_pages(void *_addr, unsigned int flags, struct page **pages, size_t
         return ret;
     }
 
-    scoped_mutex g{as->vm_lock};
+    scoped_rwlock<rw_lock::read> g{as->vm_lock};
 
     size_t pages_gotten = 0;
 
@@ -3723,7 +3875,7 @@ int get_phys_pages(void *_addr, unsigned int flags, struct page **pages, size_t
         }
 
         /* Calculate the number of pages we can resolve in this region */
-        size_t vm_region_off_pgs = (reg->base - addr) >> PAGE_SHIFT;
+        size_t vm_region_off_pgs = (addr - reg->base) >> PAGE_SHIFT;
         size_t max_resolved_pgs = reg->pages - vm_region_off_pgs;
         size_t resolved_pgs = min(nr_pgs, max_resolved_pgs);
 
@@ -3736,7 +3888,7 @@ int get_phys_pages(void *_addr, unsigned int flags, struct page **pages, size_t
 
         nr_pgs -= resolved_pgs;
         pages_gotten += resolved_pgs;
-        addr += nr_pgs << PAGE_SHIFT;
+        addr += resolved_pgs << PAGE_SHIFT;
     }
 
     /* Now that we're done, we're pinning the pages we just got */
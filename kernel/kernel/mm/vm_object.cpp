@@ -18,18 +18,8 @@
 #include <onyx/utils.h>
 #include <onyx/vm.h>
 
-#include <libdict/rb_tree.h>
-
 #include <onyx/utility.hpp>
 
-static int page_cmp(const void *k1, const void *k2)
-{
-    if (k1 == k2)
-        return 0;
-
-    return (unsigned long) k1 < (unsigned long) k2 ? -1 : 1;
-}
-
 /**
  * @brief Creates a new VMO.
  *
@@ -49,16 +39,10 @@ vm_object *vmo_create(size_t size, void *priv)
     vmo->priv = priv;
     vmo->refcount = 1;
     INIT_LIST_HEAD(&vmo->mappings);
-    vmo->pages = rb_tree_new(page_cmp);
+    radix_tree_init(&vmo->pages);
     mutex_init(&vmo->page_lock);
     mutex_init(&vmo->mapping_lock);
 
-    if (!vmo->pages)
-    {
-        free(vmo);
-        return nullptr;
-    }
-
     return vmo;
 }
 
@@ -121,22 +105,44 @@ vmo_status_t vmo_populate(vm_object *vmo, size_t off, page **ppage)
     }
 
     // hrtime_t end = get_main_clock()->get_ns();
-    dict_insert_result res = rb_tree_insert(vmo->pages, (void *) off);
-    if (!res.inserted)
+    if (vmo->flags & VMO_FLAG_LOCK_FUTURE_PAGES)
+        page->flags |= PAGE_FLAG_LOCKED;
+
+    if (radix_tree_insert(&vmo->pages, off >> PAGE_SHIFT, page) < 0)
     {
         free_page(page);
         return VMO_STATUS_OUT_OF_MEM;
     }
 
-    if (vmo->flags & VMO_FLAG_LOCK_FUTURE_PAGES)
-        page->flags |= PAGE_FLAG_LOCKED;
-
-    *res.datum_ptr = page;
     *ppage = page;
 
     return VMO_STATUS_OK;
 }
 
+/**
+ * @brief Look up and pin a resident page without taking the page_lock
+ *
+ * @param vmo The VMO
+ * @param off Offset of the page
+ * @return The pinned page, or NULL if it wasn't found (or went away while we looked at it)
+ */
+struct page *vmo_get_lockless(vm_object *vmo, size_t off)
+{
+    struct page *p = (struct page *) radix_tree_lookup(&vmo->pages, off >> PAGE_SHIFT);
+
+    if (!p || !page_try_pin(p))
+        return nullptr;
+
+    /* The page may have been removed (and even reused) between the lookup and the pin */
+    if (radix_tree_lookup(&vmo->pages, off >> PAGE_SHIFT) != p)
+    {
+        page_unpin(p);
+        return nullptr;
+    }
+
+    return p;
+}
+
 /**
  * @brief Fetch a page from a VM object
  *
@@ -166,15 +172,17 @@ vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page
         return VMO_STATUS_BUS_ERROR;
     }
 
-    scoped_mutex g{vmo->page_lock};
-
-    void **pp = rb_tree_search(vmo->pages, (const void *) off);
-
-    if (pp)
+    /* Fast path: the page is already there */
+    if ((p = vmo_get_lockless(vmo, off)))
     {
-        p = (page *) *pp;
+        *ppage = p;
+        return VMO_STATUS_OK;
     }
 
+    scoped_mutex g{vmo->page_lock};
+
+    p = vmo_find_page(vmo, off);
+
     if (!p && is_cow && !may_not_implicit_cow)
     {
         struct page *new_page = alloc_page(PAGE_ALLOC_NO_ZERO);
@@ -200,15 +208,12 @@ vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page
 
         page_unpin(old_page);
 
-        dict_insert_result res = rb_tree_insert(vmo->pages, (void *) off);
-        if (!res.inserted)
+        if (radix_tree_insert(&vmo->pages, off >> PAGE_SHIFT, new_page) < 0)
         {
             free_page(new_page);
             return VMO_STATUS_OUT_OF_MEM;
         }
 
-        *res.datum_ptr = new_page;
-
         p = new_page;
     }
 
@@ -230,57 +235,34 @@ vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page
     return st;
 }
 
-void vmo_rb_delete_func(void *key, void *data)
+static void vmo_free_page_entry(unsigned long index, void *entry)
 {
-    struct page *p = (page *) data;
+    struct page *p = (page *) entry;
 
     // TODO: Memory leak here! We might be a special kind of VMO that needs to free other
     // structures. A good example of an object like this is inode vmos.
     free_page(p);
 }
 
-int vmo_fork_pages(vm_object *vmo)
+/**
+ * @brief Gives vmo a reference to every page in the old vmo
+ * Needs to be called with old's page_lock held.
+ *
+ * @param vmo The new VMO
+ * @param old The VMO we're forking from
+ * @return 0 on success, -1 if out of memory
+ */
+static int vmo_fork_pages(vm_object *vmo, vm_object *old)
 {
-    size_t pages = vm_size_to_pages(vmo->size);
-    if (!pages)
-        return 0;
-
-    rb_itor *it = rb_itor_new(vmo->pages);
-    if (!it)
-        return -1;
-
-    rb_tree *new_tree = rb_tree_new(page_cmp);
-    if (!new_tree)
-    {
-        free(it);
-        return -1;
-    }
+    MUST_HOLD_MUTEX(&old->page_lock);
 
-    scoped_mutex g{vmo->page_lock};
+    return old->for_every_page(0, -1UL, [vmo](struct page *p, size_t off) -> bool {
+        if (radix_tree_insert(&vmo->pages, off >> PAGE_SHIFT, p) < 0)
+            return false;
 
-    bool node_valid = rb_itor_first(it);
-
-    while (node_valid)
-    {
-        struct page *old_p = (page *) *rb_itor_datum(it);
-        size_t off = (size_t) rb_itor_key(it);
-
-        dict_insert_result res = rb_tree_insert(new_tree, (void *) off);
-        if (!res.inserted)
-        {
-            rb_itor_free(it);
-            return -1;
-        }
-
-        page_ref(old_p);
-
-        *res.datum_ptr = old_p;
-        node_valid = rb_itor_next(it);
-    }
-
-    vmo->pages = new_tree;
-
-    return 0;
+        page_ref(p);
+        return true;
+    }) ? 0 : -1;
 }
 
 /**
@@ -322,11 +304,6 @@ vm_object *vmo_fork(vm_object *vmo, bool shared, struct vm_region *reg)
     new_vmo->type = vmo->type;
     new_vmo->priv = vmo->priv;
 
-    /* We're setting pages to the old vmo's pages so vmo_fork_pages can use them.
-     * In reality, vmo_fork_pages will just iterate through the old tree and create a copy
-     * of it.
-     */
-    new_vmo->pages = vmo->pages;
     new_vmo->cow_clone = vmo->cow_clone;
 
     if (new_vmo->cow_clone)
@@ -334,22 +311,21 @@ vm_object *vmo_fork(vm_object *vmo, bool shared, struct vm_region *reg)
 
     scoped_mutex g{vmo->page_lock};
 
-    if (vmo_fork_pages(new_vmo) < 0)
+    if (vmo_fork_pages(new_vmo, vmo) < 0)
     {
-        free(new_vmo);
+        vmo_destroy(new_vmo);
         return nullptr;
     }
 
     return new_vmo;
 }
 
-static void vmo_rollback_pages(struct page *begin, struct page *end, vm_object *vmo)
+static void vmo_rollback_pages(struct page *begin, struct page *end, size_t off, vm_object *vmo)
 {
     struct page *p = begin;
-    size_t off = 0;
     while (p != end)
     {
-        rb_tree_remove(vmo->pages, (const void *) off);
+        radix_tree_delete(&vmo->pages, off >> PAGE_SHIFT);
         p = p->next_un.next_allocation;
         off += PAGE_SIZE;
     }
@@ -377,17 +353,16 @@ int vmo_prefault(vm_object *vmo, size_t size, size_t offset)
     }
 
     struct page *_p = p;
+    const size_t start = offset;
     for (size_t i = 0; i < pages; i++, offset += PAGE_SIZE)
     {
-        dict_insert_result res = rb_tree_insert(vmo->pages, (void *) offset);
-        if (!res.inserted)
+        if (radix_tree_insert(&vmo->pages, offset >> PAGE_SHIFT, _p) < 0)
         {
-            vmo_rollback_pages(p, _p, vmo);
+            vmo_rollback_pages(p, _p, start, vmo);
             free_pages(p);
             return -1;
         }
 
-        *res.datum_ptr = _p;
         _p = _p->next_un.next_allocation;
     }
 
@@ -407,7 +382,7 @@ void vmo_destroy(vm_object *vmo)
     if (vmo->cow_clone)
         vmo_unref(vmo->cow_clone);
 
-    rb_tree_free(vmo->pages, vmo_rb_delete_func);
+    radix_tree_destroy(&vmo->pages, vmo_free_page_entry);
 
     free(vmo);
 }
@@ -422,13 +397,8 @@ void vmo_destroy(vm_object *vmo)
  */
 int vmo_add_page_unlocked(size_t off, page *p, vm_object *vmo)
 {
-    dict_insert_result res = rb_tree_insert(vmo->pages, (void *) off);
-    if (!res.inserted)
-    {
+    if (radix_tree_insert(&vmo->pages, off >> PAGE_SHIFT, p) < 0)
         return -1;
-    }
-
-    *res.datum_ptr = p;
 
     return 0;
 }
@@ -489,33 +459,37 @@ int vmo_purge_pages(size_t lower_bound, size_t upper_bound, unsigned int flags,
 {
     scoped_mutex g{vmo->page_lock, !(flags & PURGE_DO_NOT_LOCK)};
 
-    struct rb_itor it;
-    it.tree = vmo->pages;
-    it.node = nullptr;
-
     bool should_free = flags & PURGE_SHOULD_FREE;
     bool exclusive = flags & PURGE_EXCLUDE;
 
     assert(!(should_free && second != nullptr));
 
     bool (*compare_function)(size_t, size_t, size_t) = is_included;
+    /* Inclusive purges only need to look at [lower_bound, upper_bound) */
+    unsigned long start = lower_bound >> PAGE_SHIFT;
+    unsigned long max = upper_bound ? (upper_bound - 1) >> PAGE_SHIFT : 0;
 
     if (exclusive)
+    {
         compare_function = is_excluded;
+        start = 0;
+        max = -1UL >> PAGE_SHIFT;
+    }
+    else if (lower_bound >= upper_bound)
+        return 0;
 
-    bool node_valid = rb_itor_first(&it);
+    unsigned long index;
+    void *entry;
 
-    while (node_valid)
+    radix_tree_for_each_range(&vmo->pages, index, entry, start, max)
     {
-        struct page *p = (page *) *rb_itor_datum(&it);
-        size_t off = (size_t) rb_itor_key(&it);
+        size_t off = index << PAGE_SHIFT;
 
         if (compare_function(lower_bound, upper_bound, off))
         {
-            rb_itor_remove(&it);
-            node_valid = rb_itor_search_ge(&it, (const void *) off);
+            radix_tree_delete(&vmo->pages, index);
 
-            struct page *old_p = p;
+            struct page *old_p = (page *) entry;
 
             if (should_free)
             {
@@ -529,10 +503,6 @@ int vmo_purge_pages(size_t lower_bound, size_t upper_bound, unsigned int flags,
             if (second)
                 vmo_add_page(off, old_p, second);
         }
-        else
-        {
-            node_valid = rb_itor_next(&it);
-        }
     }
 
     return 0;
@@ -632,13 +602,7 @@ void vmo_sanity_check(vm_object *vmo)
 {
     scoped_mutex g{vmo->page_lock};
 
-    struct rb_itor *it = rb_itor_new(vmo->pages);
-    assert(it != nullptr);
-    bool node_valid = rb_itor_next(it);
-    while (node_valid)
-    {
-        struct page *p = (page *) *rb_itor_datum(it);
-        size_t poff = (size_t) rb_itor_key(it);
+    vmo->for_every_page(0, -1UL, [vmo](struct page *p, size_t poff) -> bool {
         if (poff > vmo->size)
         {
             printk("Bad vmobject: p->off > nr_pages << PAGE_SHIFT.\n");
@@ -654,7 +618,9 @@ void vmo_sanity_check(vm_object *vmo)
             printk("struct page: %p\n", p);
             panic("bad vmobject");
         }
-    }
+
+        return true;
+    });
 }
 
 /**
@@ -765,18 +731,24 @@ void vmo_uncow(vm_object *vmo)
  *
  * @param vmo The VMO.
  * @param off Offset of the page.
+ * @param expected The page the faulting mapping had.
  * @return The struct page of the new copied-to page.
  */
-struct page *vmo_cow_on_page(vm_object *vmo, size_t off)
+struct page *vmo_cow_on_page(vm_object *vmo, size_t off, struct page *expected)
 {
     scoped_mutex g{vmo->page_lock};
 
-    void **datum = rb_tree_search(vmo->pages, (void *) off);
+    struct page *old_page = vmo_find_page(vmo, off);
 
-    if (datum == nullptr)
+    if (old_page == nullptr)
         panic("Fatal COW bug - page not found in VMO");
 
-    struct page *old_page = (page *) *datum;
+    if (old_page != expected)
+    {
+        /* A concurrent fault already did the copy, so just hand out its copy */
+        page_pin(old_page);
+        return old_page;
+    }
 
     if (old_page->ref == 1)
     {
@@ -793,7 +765,7 @@ struct page *vmo_cow_on_page(vm_object *vmo, size_t off)
 
     // printf("COW'd page %p to vmo %p (refs %lu)\n", page_to_phys(new_page), vmo, vmo->refcount);
 
-    *datum = new_page;
+    radix_tree_replace(&vmo->pages, off >> PAGE_SHIFT, new_page);
 
     page_pin(new_page);
 
@@ -856,14 +828,8 @@ int vmo_truncate(vm_object *vmo, unsigned long size, unsigned long flags)
         }
     }
 
-    struct page *last_page = nullptr;
     auto last_page_off = cul::align_down2(original_size, PAGE_SIZE);
-    void **pp = rb_tree_search(vmo->pages, (const void *) last_page_off);
-
-    if (pp)
-    {
-        last_page = (page *) *pp;
-    }
+    struct page *last_page = vmo_find_page(vmo, last_page_off);
 
     if (last_page)
     {
@@ -877,3 +843,27 @@ int vmo_truncate(vm_object *vmo, unsigned long size, unsigned long flags)
 
     return 0;
 }
+
+/**
+ * @brief Sets a tag (VMO_TAG_*) on a resident page.
+ *
+ * @param vmo The VMO.
+ * @param off Offset of the page.
+ * @param tag The tag.
+ */
+void vmo_set_page_tag(vm_object *vmo, size_t off, unsigned int tag)
+{
+    radix_tree_tag_set(&vmo->pages, off >> PAGE_SHIFT, tag);
+}
+
+/**
+ * @brief Clears a tag (VMO_TAG_*) on a page.
+ *
+ * @param vmo The VMO.
+ * @param off Offset of the page.
+ * @param tag The tag.
+ */
+void vmo_clear_page_tag(vm_object *vmo, size_t off, unsigned int tag)
+{
+    radix_tree_tag_clear(&vmo->pages, off >> PAGE_SHIFT, tag);
+}
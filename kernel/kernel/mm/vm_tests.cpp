@@ -166,27 +166,13 @@ public:
 bool vm_unmap_tests::is_not_present_in_vmo(struct vm_object *vmo, unsigned long lower,
                                            unsigned long higher)
 {
-    struct rb_itor it;
-    it.node = nullptr;
-    it.tree = vmo->pages;
     unsigned long pages_to_be_found = (higher - lower) >> PAGE_SHIFT;
-    bool node_valid = rb_itor_first(&it);
-    while (node_valid)
-    {
-        struct page *page = (struct page *) *rb_itor_datum(&it);
-        size_t off = (size_t) rb_itor_key(&it);
-
-        if (off >= lower && off < higher)
-        {
-            pages_to_be_found--;
-            // printk("page offset %lx present!\n", page->off);
-            if (pages_to_be_found == 0)
-                return false;
-        }
-        node_valid = rb_itor_next(&it);
-    }
 
-    return true;
+    return vmo->for_every_page(lower, higher, [&](struct page *page, size_t off) -> bool {
+        pages_to_be_found--;
+        // printk("page offset %lx present!\n", off);
+        return pages_to_be_found != 0;
+    });
 }
 
 bool vm_unmap_tests::execute_shared()
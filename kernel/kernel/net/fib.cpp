@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <onyx/net/fib.h>
+
+static unsigned long fib_gen = 1;
+
+unsigned long fib_generation()
+{
+    return __atomic_load_n(&fib_gen, __ATOMIC_ACQUIRE);
+}
+
+void fib_bump_generation()
+{
+    __atomic_add_fetch(&fib_gen, 1, __ATOMIC_RELEASE);
+}
+
+unsigned int fib_common_bits(const fib_key &a, const fib_key &b, unsigned int max)
+{
+    for (unsigned int i = 0; i * 8 < max; i++)
+    {
+        uint8_t diff = a.bytes[i] ^ b.bytes[i];
+
+        if (diff)
+        {
+            unsigned int bits = i * 8 + __builtin_clz(diff) - 24;
+            return bits < max ? bits : max;
+        }
+    }
+
+    return max;
+}
+
+int fib_mask_to_prefix_len(const void *mask, unsigned int len)
+{
+    const uint8_t *bytes = (const uint8_t *) mask;
+    unsigned int i = 0;
+    int prefix_len = 0;
+
+    while (i < len && bytes[i] == 0xff)
+    {
+        prefix_len += 8;
+        i++;
+    }
+
+    if (i < len)
+    {
+        uint8_t b = bytes[i++];
+
+        /* The rest of this byte needs to be ones followed by zeroes */
+        if ((uint8_t) (b << __builtin_popcount(b)))
+            return -1;
+
+        prefix_len += __builtin_popcount(b);
+    }
+
+    for (; i < len; i++)
+    {
+        if (bytes[i])
+            return -1;
+    }
+
+    return prefix_len;
+}
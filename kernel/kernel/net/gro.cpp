@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include <onyx/byteswap.h>
+#include <onyx/net/ethernet.h>
+#include <onyx/net/gro.h>
+#include <onyx/net/ip.h>
+#include <onyx/net/tcp.h>
+#include <onyx/packetbuf.h>
+#include <onyx/percpu.h>
+
+/**
+ * Generic receive offload.
+ * While an interface is being polled, consecutive in-order TCP segments (over IPv4) of the same
+ * flow get coalesced into a single big packetbuf, which then goes through the stack once instead of
+ * once per segment. Anything we can't merge goes up right away, but only after whatever we're
+ * holding for its flow, so segments never get reordered.
+ *
+ * The first segment of a flow is held as-is; if a second one shows up and doesn't fit in its head
+ * area, everything gets moved to a linear GRO_MAX_SIZE packetbuf. Held packets go up the stack when
+ * a segment has PSH set, when we run out of space or slots, or when the poll ends.
+ */
+
+/* Max number of flows we hold packets for */
+#define GRO_MAX_HELD 8
+/* Max size of a merged packet, link header included */
+#define GRO_MAX_SIZE 0x10000
+
+struct gro_list
+{
+    /* Interface being polled, or nullptr if we're not in a GRO run */
+    struct netif *nif;
+    unsigned int nr_held;
+    /* Held packets, oldest first */
+    struct packetbuf *held[GRO_MAX_HELD];
+};
+
+PER_CPU_VAR(struct gro_list gro_lists);
+
+struct gro_tcp4_seg
+{
+    struct ip_header *iph;
+    struct tcp_header *th;
+    /* Length of the TCP header */
+    unsigned int th_len;
+    unsigned int payload_len;
+    uint16_t flags;
+};
+
+/**
+ * @brief Parse a packet as an ethernet + IPv4 + TCP segment
+ *
+ * @param buf Packet
+ * @param seg Parsed segment
+ * @return True if it's a TCP segment we may look at, else false
+ */
+static bool gro_parse(struct packetbuf *buf, struct gro_tcp4_seg &seg)
+{
+    unsigned int len = buf->tail - buf->data;
+
+    /* Only linear packets, the stack doesn't know how to read anything else */
+    if (buf->length() != len)
+        return false;
+
+    if (len < sizeof(struct eth_header) + sizeof(struct ip_header) + sizeof(struct tcp_header))
+        return false;
+
+    auto eth = (struct eth_header *) buf->data;
+    if (eth->ethertype != htons(PROTO_IPV4))
+        return false;
+
+    auto iph = (struct ip_header *) (eth + 1);
+
+    /* No IP options and no fragments */
+    if (iph->version != 4 || iph->ihl != 5 || iph->proto != IPPROTO_TCP)
+        return false;
+
+    if (ntohs(iph->frag_info) & ~IPV4_FRAG_INFO_DONT_FRAGMENT)
+        return false;
+
+    unsigned int ip_len = ntohs(iph->total_len);
+    if (ip_len > len - sizeof(struct eth_header) ||
+        ip_len < sizeof(struct ip_header) + sizeof(struct tcp_header))
+        return false;
+
+    auto th = (struct tcp_header *) (iph + 1);
+    uint16_t flags = ntohs(th->data_offset_and_flags);
+    unsigned int th_len = tcp_header_data_off_to_length(TCP_GET_DATA_OFF(flags));
+
+    if (th_len < sizeof(struct tcp_header) || sizeof(struct ip_header) + th_len > ip_len)
+        return false;
+
+    seg.iph = iph;
+    seg.th = th;
+    seg.th_len = th_len;
+    seg.payload_len = ip_len - sizeof(struct ip_header) - th_len;
+    seg.flags = flags;
+
+    return true;
+}
+
+/**
+ * @brief Check if a segment may be held (and merged with others)
+ * Only plain data segments qualify; anything that changes the connection's state has to go up on
+ * its own.
+ *
+ * @param seg Segment
+ * @return True if it can be held, else false
+ */
+static bool gro_can_hold(const struct gro_tcp4_seg &seg)
+{
+    uint16_t flags = seg.flags & 0xff;
+
+    return seg.payload_len && (flags & TCP_FLAG_ACK) &&
+           !(flags & ~(TCP_FLAG_ACK | TCP_FLAG_PSH));
+}
+
+static bool gro_same_flow(const struct gro_tcp4_seg &a, const struct gro_tcp4_seg &b)
+{
+    return a.iph->source_ip == b.iph->source_ip && a.iph->dest_ip == b.iph->dest_ip &&
+           a.th->source_port == b.th->source_port && a.th->dest_port == b.th->dest_port;
+}
+
+/**
+ * @brief Check if seg can be appended to held, which is of the same flow
+ *
+ * @param held Segment we're holding
+ * @param seg New segment
+ * @return True if it can be merged, else false
+ */
+static bool gro_can_merge(const struct gro_tcp4_seg &held, const struct gro_tcp4_seg &seg)
+{
+    unsigned int new_len = ntohs(held.iph->total_len) + seg.payload_len;
+
+    if (ntohl(held.th->sequence_number) + held.payload_len != ntohl(seg.th->sequence_number))
+        return false;
+
+    if (held.th->ack_number != seg.th->ack_number)
+        return false;
+
+    if (held.iph->tos != seg.iph->tos || held.iph->ttl != seg.iph->ttl)
+        return false;
+
+    if (held.th_len != seg.th_len ||
+        memcmp(held.th->options, seg.th->options, seg.th_len - sizeof(struct tcp_header)))
+        return false;
+
+    return new_len <= UINT16_MAX && sizeof(struct eth_header) + new_len <= GRO_MAX_SIZE;
+}
+
+/**
+ * @brief Move a held packet to a linear packetbuf big enough for GRO_MAX_SIZE
+ *
+ * @param buf Held packet (its reference is dropped on success)
+ * @param len Length of the packet, starting from the link header
+ * @return The new packet, or nullptr if we're out of memory
+ */
+static struct packetbuf *gro_grow(struct packetbuf *buf, unsigned int len)
+{
+    auto nbuf = make_refc<packetbuf>();
+    if (!nbuf)
+        return nullptr;
+
+    if (!nbuf->allocate_linear_space(GRO_MAX_SIZE))
+        return nullptr;
+
+    memcpy(nbuf->put(len), buf->data, len);
+    nbuf->needs_csum = buf->needs_csum;
+
+    buf->unref();
+
+    return nbuf.release();
+}
+
+/**
+ * @brief Append a segment's payload to the packet in slot i
+ *
+ * @param list GRO list
+ * @param i Slot
+ * @param held Parsed held segment
+ * @param seg New segment
+ * @return True on success, false if we're out of memory
+ */
+static bool gro_merge(struct gro_list *list, unsigned int i, struct gro_tcp4_seg &held,
+                      const struct gro_tcp4_seg &seg)
+{
+    struct packetbuf *buf = list->held[i];
+    unsigned int len = sizeof(struct eth_header) + ntohs(held.iph->total_len);
+
+    if ((unsigned int) (buf->end - buf->data) < len + seg.payload_len)
+    {
+        buf = gro_grow(buf, len);
+        if (!buf)
+            return false;
+
+        list->held[i] = buf;
+        gro_parse(buf, held);
+    }
+
+    /* Chop off any link layer padding, then tack the payload on */
+    buf->tail = buf->data + len;
+    memcpy(buf->put(seg.payload_len), (unsigned char *) seg.th + seg.th_len, seg.payload_len);
+
+    held.iph->total_len = htons(len - sizeof(struct eth_header) + seg.payload_len);
+    held.payload_len += seg.payload_len;
+    held.th->window_size = seg.th->window_size;
+    held.th->data_offset_and_flags |= seg.th->data_offset_and_flags & htons(TCP_FLAG_PSH);
+
+    return true;
+}
+
+/**
+ * @brief Remove the packet in slot i and send it up the stack
+ *
+ * @param list GRO list
+ * @param nif Interface
+ * @param i Slot
+ */
+static void gro_flush_one(struct gro_list *list, struct netif *nif, unsigned int i)
+{
+    struct packetbuf *buf = list->held[i];
+
+    memmove(&list->held[i], &list->held[i + 1], (list->nr_held - i - 1) * sizeof(packetbuf *));
+    list->nr_held--;
+
+    /* The IP header may have changed while merging */
+    auto iph = (struct ip_header *) (buf->data + sizeof(struct eth_header));
+    iph->header_checksum = 0;
+    iph->header_checksum = ipsum(iph, ip_header_length(iph));
+
+    nif->dll_ops->rx_packet(nif, buf);
+    buf->unref();
+}
+
+void gro_begin(struct netif *nif)
+{
+    get_per_cpu_ptr(gro_lists)->nif = nif;
+}
+
+void gro_end(struct netif *nif)
+{
+    struct gro_list *list = get_per_cpu_ptr(gro_lists);
+
+    list->nif = nullptr;
+
+    while (list->nr_held)
+        gro_flush_one(list, nif, 0);
+}
+
+int gro_receive(struct netif *nif, struct packetbuf *buf)
+{
+    struct gro_list *list = get_per_cpu_ptr(gro_lists);
+    struct gro_tcp4_seg seg;
+
+    if (list->nif != nif || nif->dll_ops != &eth_ops || !gro_parse(buf, seg))
+        return nif->dll_ops->rx_packet(nif, buf);
+
+    bool can_hold = gro_can_hold(seg);
+    bool push = seg.flags & TCP_FLAG_PSH;
+
+    for (unsigned int i = 0; i < list->nr_held; i++)
+    {
+        struct gro_tcp4_seg held;
+        gro_parse(list->held[i], held);
+
+        if (!gro_same_flow(held, seg))
+            continue;
+
+        if (can_hold && gro_can_merge(held, seg) && gro_merge(list, i, held, seg))
+        {
+            if (push)
+                gro_flush_one(list, nif, i);
+            return 0;
+        }
+
+        /* Out of order, or something we can't merge. What we have goes up first */
+        gro_flush_one(list, nif, i);
+        break;
+    }
+
+    if (!can_hold || push)
+        return nif->dll_ops->rx_packet(nif, buf);
+
+    if (list->nr_held == GRO_MAX_HELD)
+        gro_flush_one(list, nif, 0);
+
+    buf->ref();
+    list->held[list->nr_held++] = buf;
+
+    return 0;
+}
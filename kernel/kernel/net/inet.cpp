@@ -171,3 +171,30 @@ void inet_socket::copy_addr_to_sockaddr(const inet_sock_address &addr, sockaddr
         *len = sizeof(addr);
     }
 }
+
+expected<inet_route, int> inet_socket::connected_route(int domain)
+{
+    {
+        /* route_cache holds a reference to the neighbour, so copying it must not race with a
+         * concurrent sender replacing it.
+         */
+        scoped_hybrid_lock g{socket_lock, this};
+        if (route_cache_fresh()) [[likely]]
+            return route_cache;
+    }
+
+    /* The routing tables changed since we connected, look it up again. This also refreshes the
+     * neighbour, which may have changed along with the route.
+     */
+    auto res = get_proto_fam()->route(src_addr, dest_addr, domain);
+    if (res.has_error())
+        return unexpected<int>{res.error()};
+
+    scoped_hybrid_lock g{socket_lock, this};
+
+    /* Don't replace a newer route someone else looked up */
+    if ((long) (res.value().fib_gen - route_cache.fib_gen) > 0)
+        route_cache = res.value();
+
+    return res.value();
+}
@@ -14,13 +14,10 @@ int inet_cork::append_data(const iovec *vec, size_t vec_len, size_t proto_hdr_si
 {
     size_t read_in_vec = 0;
 
-    // TODO: Go straight to the tail?
-    list_for_every (&packet_list)
+    /* Only the last packet can have room, and only if it owns its pages */
+    if (!list_is_empty(&packet_list) && vec_len)
     {
-        if (!vec_len)
-            break;
-
-        auto packet = list_head_cpp<packetbuf>::self_from_list_head(l);
+        auto packet = list_head_cpp<packetbuf>::self_from_list_head(packet_list.prev);
         auto packet_len = packet->length();
 
 #if DEBUG_INET_CORK
@@ -28,12 +25,12 @@ int inet_cork::append_data(const iovec *vec, size_t vec_len, size_t proto_hdr_si
         printk("Max packet len %lu, proto hdr size %lu\n", max_packet_len, proto_hdr_size);
 #endif
 
-        if (packet_len + proto_hdr_size < max_packet_len)
+        while (!packet->zero_copy && vec_len && packet_len + proto_hdr_size < max_packet_len)
         {
             /* OOOH, we've got some room, let's expand! */
             const uint8_t *ubuf = (uint8_t *) vec->iov_base + read_in_vec;
             auto len = vec->iov_len - read_in_vec;
-            unsigned int to_expand = cul::clamp(len, max_packet_len - packet_len);
+            unsigned int to_expand = cul::clamp(len, max_packet_len - proto_hdr_size - packet_len);
 #if DEBUG_INET_CORK
             printk("Expanding buffer %u\n", to_expand);
 #endif
@@ -49,6 +46,7 @@ int inet_cork::append_data(const iovec *vec, size_t vec_len, size_t proto_hdr_si
 #endif
 
             read_in_vec += st;
+            packet_len += st;
 
             if (read_in_vec == vec->iov_len)
             {
@@ -128,6 +126,110 @@ int inet_cork::alloc_and_append(const iovec *vec, size_t vec_len, size_t proto_h
     return 0;
 }
 
+/**
+ * @brief Get a packet we can attach page fragments to
+ * That's the last packet, if it's a zero copy packet of the same send and has room to spare,
+ * else a new packet with nothing but space for the headers.
+ *
+ * @param proto_hdr_len Length of the protocol header
+ * @param max_packet_len Max length of a packet
+ * @param notif Zerocopy notification of the send, may be nullptr
+ * @param room Set to the amount of data that still fits in the packet
+ * @return The packet, or a negative error code
+ */
+expected<packetbuf *, int> inet_cork::zerocopy_tail(size_t proto_hdr_len, size_t max_packet_len,
+                                                    zerocopy_notif *notif, unsigned int &room)
+{
+    if (!list_is_empty(&packet_list))
+    {
+        auto packet = list_head_cpp<packetbuf>::self_from_list_head(packet_list.prev);
+        auto packet_len = packet->length();
+
+        if (packet->zero_copy && packet->zc == notif && packet->can_attach_page() &&
+            packet_len + proto_hdr_len < max_packet_len)
+        {
+            room = max_packet_len - proto_hdr_len - packet_len;
+            return packet;
+        }
+    }
+
+    // Only a single datagram is allowed
+    if (packet_list_len == 1 && sock_type == SOCK_DGRAM)
+        return unexpected<int>{-EMSGSIZE};
+
+    auto packet = new packetbuf;
+    if (!packet)
+        return unexpected<int>{-ENOBUFS};
+
+    if (!packet->allocate_space(proto_hdr_len + PACKET_MAX_HEAD_LENGTH))
+    {
+        delete packet;
+        return unexpected<int>{-ENOBUFS};
+    }
+
+    packet->reserve_headers(proto_hdr_len + PACKET_MAX_HEAD_LENGTH);
+
+    if (notif)
+        packet->set_zerocopy_notif(notif);
+
+    list_add_tail(&packet->list_node, &packet_list);
+    packet_list_len++;
+
+    room = max_packet_len - proto_hdr_len;
+    return packet;
+}
+
+int inet_cork::append_user_pages(const iovec *vec, size_t vec_len, size_t proto_hdr_size,
+                                 size_t max_packet_len, zerocopy_notif *notif)
+{
+    for (; vec_len; vec++, vec_len--)
+    {
+        const uint8_t *ubuf = (const uint8_t *) vec->iov_base;
+        size_t len = vec->iov_len;
+
+        while (len)
+        {
+            unsigned int room;
+            auto ex = zerocopy_tail(proto_hdr_size, max_packet_len, notif, room);
+            if (ex.has_error())
+                return ex.error();
+
+            auto packet = ex.value();
+            auto st = packet->attach_user_pages(ubuf, cul::clamp(len, (size_t) room));
+
+            if (st < 0)
+                return st;
+
+            ubuf += st;
+            len -= st;
+        }
+    }
+
+    return 0;
+}
+
+int inet_cork::append_page(struct page *page, unsigned int off, unsigned int len,
+                           size_t proto_hdr_size, size_t max_packet_len, zerocopy_notif *notif)
+{
+    while (len)
+    {
+        unsigned int room;
+        auto ex = zerocopy_tail(proto_hdr_size, max_packet_len, notif, room);
+        if (ex.has_error())
+            return ex.error();
+
+        auto to_attach = cul::min(len, room);
+
+        if (int st = ex.value()->attach_page(page, off, to_attach); st < 0)
+            return st;
+
+        off += to_attach;
+        len -= to_attach;
+    }
+
+    return 0;
+}
+
 int inet_cork::send(const iflow &flow, void (*prepare_headers)(packetbuf *buf, const iflow &flow))
 {
     int pending = this->pending();
@@ -17,6 +17,7 @@
 #include <onyx/init.h>
 #include <onyx/net/arp.h>
 #include <onyx/net/ethernet.h>
+#include <onyx/net/fib.h>
 #include <onyx/net/icmp.h>
 #include <onyx/net/ip.h>
 #include <onyx/net/netif.h>
@@ -592,8 +593,15 @@ void proto_family::unbind(inet_socket *sock)
     sock->proto_info->get_socket_table()->remove_socket(sock, 0);
 }
 
-rwlock routing_table_lock;
-cul::vector<shared_ptr<inet4_route>> routing_table;
+/* Routes get looked up without locks, see fib.h */
+static fib_trie<inet4_route, 32> routing_table;
+
+static fib_key inet4_fib_key(in_addr_t addr)
+{
+    fib_key key{};
+    memcpy(key.bytes, &addr, sizeof(addr));
+    return key;
+}
 
 expected<inet_route, int> proto_family::route(const inet_sock_address &from,
                                               const inet_sock_address &to, int domain)
@@ -612,9 +620,10 @@ expected<inet_route, int> proto_family::route(const inet_sock_address &from,
     /* Else, we're searching through the routing table to find the best interface to use in order
      * to reach our destination
      */
-    shared_ptr<inet4_route> best_route;
-    int highest_metric = 0;
     auto dest = to.in4.s_addr;
+    /* Look the route up with the generation we started with, so changes that race with us
+     * invalidate it */
+    auto gen = fib_generation();
 
     // TODO: Multicast
     if (addr_is_local_broadcast(dest))
@@ -625,6 +634,7 @@ expected<inet_route, int> proto_family::route(const inet_sock_address &from,
         r.flags = INET4_ROUTE_FLAG_BROADCAST;
         r.mask.in4.s_addr = INADDR_BROADCAST;
         r.gateway_addr.in4 = {};
+        r.fib_gen = gen;
         r.nif = required_netif ? required_netif : netif_choose();
 
         if (!r.nif)
@@ -633,51 +643,35 @@ expected<inet_route, int> proto_family::route(const inet_sock_address &from,
         return r;
     }
 
-    rw_lock_read(&routing_table_lock);
-
-    for (auto &r : routing_table)
-    {
-        /* Do a bitwise and between the destination address and the mask
-         * If the result = r.dest, we can use this interface.
-         */
-#if 0
-		printk("dest %x, mask %x, supposed dest %x\n", dest, r->mask, r->dest);
-#endif
-        if ((dest & r->mask) != r->dest)
-            continue;
-
-        if (required_netif && r->nif != required_netif)
-            continue;
-#if 0
-		printk("%s is good\n", r->nif->name);
-		printk("is loopback set %u\n", r->nif->flags & NETIF_LOOPBACK);
-#endif
+    /* Look for the most specific route, and if that prefix has more than one, use the one with the
+     * highest metric. Gateway routes lose ties.
+     */
+    auto score = [required_netif](const inet4_route &r) -> int {
+        if (required_netif && r.nif != required_netif)
+            return -1;
 
         int mods = 0;
-        if (r->flags & INET4_ROUTE_FLAG_GATEWAY)
+        if (r.flags & INET4_ROUTE_FLAG_GATEWAY)
             mods--;
 
-        if (r->metric + mods > highest_metric)
-        {
-            best_route = r;
-            highest_metric = r->metric;
-        }
-    }
+        return r.metric + mods;
+    };
 
-    rw_unlock_read(&routing_table_lock);
+    inet4_route best_route;
 
-    if (!best_route)
+    if (!routing_table.lookup(inet4_fib_key(dest), score, best_route))
     {
         return unexpected<int>{-ENETUNREACH};
     }
 
     inet_route r;
     r.dst_addr.in4 = to.in4;
-    r.nif = best_route->nif;
-    r.mask.in4.s_addr = best_route->mask;
+    r.nif = best_route.nif;
+    r.mask.in4.s_addr = best_route.mask;
     r.src_addr.in4.s_addr = r.nif->local_ip.sin_addr.s_addr;
-    r.flags = best_route->flags;
-    r.gateway_addr.in4.s_addr = best_route->gateway;
+    r.flags = best_route.flags;
+    r.gateway_addr.in4.s_addr = best_route.gateway;
+    r.fib_gen = gen;
 
     if (addr_is_broadcast(to.in4.s_addr, r))
     {
@@ -709,19 +703,16 @@ expected<inet_route, int> proto_family::route(const inet_sock_address &from,
 
 bool add_route(inet4_route &route)
 {
-    rw_lock_write(&routing_table_lock);
-
-    auto ptr = make_shared<inet4_route>();
-    if (!ptr)
+    int prefix_len = fib_mask_to_prefix_len(&route.mask, sizeof(route.mask));
+    if (prefix_len < 0)
         return false;
 
-    memcpy(ptr.get(), &route, sizeof(route));
-
-    bool st = routing_table.push_back(ptr);
+    if (!routing_table.insert(inet4_fib_key(route.dest & route.mask), prefix_len, route))
+        return false;
 
-    rw_unlock_write(&routing_table_lock);
+    fib_bump_generation();
 
-    return st;
+    return true;
 }
 
 static proto_family v4_protocol;
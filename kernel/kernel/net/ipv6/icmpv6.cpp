@@ -184,6 +184,7 @@ int icmp6_socket::connect(sockaddr *addr, socklen_t len, int flags)
         return 0;
     }
 
+    scoped_hybrid_lock g{socket_lock, this};
     route_cache = route_result.value();
     route_cache_valid = 1;
 
@@ -245,7 +246,11 @@ ssize_t icmp6_socket::sendmsg(const struct msghdr *msg, int flags)
 
     if (connected && route_cache_valid)
     {
-        rt = route_cache;
+        auto result = connected_route(AF_INET6);
+        if (result.has_error())
+            return result.error();
+
+        rt = result.value();
     }
     else
     {
@@ -460,10 +465,9 @@ short icmp6_socket::poll(void *poll_file, short events)
 
     if (events & POLLIN)
     {
+        poll_wait_helper(poll_file, &rx_wq);
         if (has_data_available())
             avail_events |= POLLIN;
-        else
-            poll_wait_helper(poll_file, &rx_wq);
     }
 
     // printk("avail events: %u\n", avail_events);
@@ -6,6 +6,7 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <onyx/net/fib.h>
 #include <onyx/net/icmpv6.h>
 #include <onyx/net/ip.h>
 #include <onyx/net/ndp.h>
@@ -194,8 +195,15 @@ void proto_family::unbind(inet_socket *sock)
     sock->proto_info->get_socket_table()->remove_socket(sock, 0);
 }
 
-rwlock routing_table_lock;
-cul::vector<shared_ptr<inet6_route>> routing_table;
+/* Routes get looked up without locks, see fib.h */
+static fib_trie<inet6_route, 128> routing_table;
+
+static fib_key inet6_fib_key(const in6_addr &addr)
+{
+    fib_key key;
+    memcpy(key.bytes, addr.s6_addr, sizeof(key.bytes));
+    return key;
+}
 
 void print_v6_addr(const in6_addr &addr)
 {
@@ -220,58 +228,37 @@ uint16_t flags_from_dest(const in6_addr &dst)
 expected<inet_route, int> route_from_routing_table(const inet_sock_address &to,
                                                    netif *required_netif)
 {
-    shared_ptr<inet6_route> best_route;
-    int highest_metric = 0;
-    auto dest = to.in6;
-
-    {
+    auto gen = fib_generation();
 
-        scoped_rwlock<rw_lock::read> g{routing_table_lock};
-
-        for (auto &r : routing_table)
-        {
-            /* Do a bitwise and between the destination address and the mask
-             * If the result = r.dest, we can use this interface.
-             */
-#if 0
-		print_v6_addr(dest);
-		print_v6_addr(r->mask);
-		print_v6_addr(r->dest);
-#endif
-            if ((dest & r->mask) != r->dest)
-                continue;
+    /* Look for the most specific route, and if that prefix has more than one, use the one with the
+     * highest metric. Gateway routes lose ties.
+     */
+    auto score = [required_netif](const inet6_route &r) -> int {
+        if (required_netif && r.nif != required_netif)
+            return -1;
 
-            if (required_netif && r->nif != required_netif)
-                continue;
-#if 0
-		printk("%s is good\n", r->nif->name);
-		printk("is loopback set %u\n", r->nif->flags & NETIF_LOOPBACK);
-#endif
+        int mods = 0;
+        if (r.flags & INET4_ROUTE_FLAG_GATEWAY)
+            mods--;
 
-            int mods = 0;
-            if (r->flags & INET4_ROUTE_FLAG_GATEWAY)
-                mods--;
+        return r.metric + mods;
+    };
 
-            if (r->metric + mods > highest_metric)
-            {
-                best_route = r;
-                highest_metric = r->metric;
-            }
-        }
-    }
+    inet6_route best_route;
 
-    if (!best_route)
+    if (!routing_table.lookup(inet6_fib_key(to.in6), score, best_route))
         return unexpected<int>{-ENETUNREACH};
 
     auto saddr_flags = flags_from_dest(to.in6);
 
     inet_route r;
     r.dst_addr.in6 = to.in6;
-    r.nif = best_route->nif;
-    r.mask.in6 = best_route->mask;
+    r.nif = best_route.nif;
+    r.mask.in6 = best_route.mask;
     r.src_addr.in6 = netif_get_v6_address(r.nif, saddr_flags);
-    r.flags = best_route->flags;
-    r.gateway_addr.in6 = best_route->gateway;
+    r.flags = best_route.flags;
+    r.gateway_addr.in6 = best_route.gateway;
+    r.fib_gen = gen;
 
     return r;
 }
@@ -300,6 +287,7 @@ expected<inet_route, int> route_local(const inet_sock_address &to, netif *requir
     rt.mask.in6 = in6addr_any;
     rt.src_addr.in6 = netif_get_v6_address(rt.nif, INET6_ADDR_LOCAL);
     rt.dst_hw = nullptr;
+    rt.fib_gen = fib_generation();
 
     return rt;
 }
@@ -362,19 +350,16 @@ expected<inet_route, int> proto_family::route(const inet_sock_address &from,
 
 bool add_route(inet6_route &route)
 {
-    rw_lock_write(&routing_table_lock);
-
-    auto ptr = make_shared<inet6_route>();
-    if (!ptr)
+    int prefix_len = fib_mask_to_prefix_len(&route.mask, sizeof(route.mask));
+    if (prefix_len < 0)
         return false;
 
-    memcpy(ptr.get(), &route, sizeof(route));
-
-    bool st = routing_table.push_back(ptr);
+    if (!routing_table.insert(inet6_fib_key(route.dest & route.mask), prefix_len, route))
+        return false;
 
-    rw_unlock_write(&routing_table_lock);
+    fib_bump_generation();
 
-    return st;
+    return true;
 }
 
 static ip::v6::proto_family v6_protocol;
@@ -11,6 +11,7 @@
 #include <onyx/net/netif.h>
 #include <onyx/net/network.h>
 #include <onyx/packetbuf.h>
+#include <onyx/random.h>
 
 int loopback_send_packet(packetbuf *buf, netif *nif)
 {
@@ -19,6 +20,13 @@ int loopback_send_packet(packetbuf *buf, netif *nif)
 	printk("send packet loopback\n");
 #endif
 
+#ifdef CONFIG_LOOPBACK_LOSS
+    /* Lossy loopback, for testing loss recovery: drop one in every CONFIG_LOOPBACK_LOSS
+     * packets */
+    if (arc4random_uniform(CONFIG_LOOPBACK_LOSS) == 0)
+        return 0;
+#endif
+
     auto new_buf = make_refc<packetbuf>();
     if (!new_buf)
         return -ENOMEM;
@@ -14,10 +14,12 @@
 #include <onyx/byteswap.h>
 #include <onyx/dev.h>
 #include <onyx/init.h>
+#include <onyx/net/gro.h>
 #include <onyx/net/netif.h>
 #include <onyx/net/netkernel.h>
 #include <onyx/net/tcp.h>
 #include <onyx/net/udp.h>
+#include <onyx/scheduler.h>
 #include <onyx/softirq.h>
 #include <onyx/spinlock.h>
 #include <onyx/vector.h>
@@ -236,10 +238,25 @@ netif *netif_from_name(const char *name)
     return nullptr;
 }
 
+/**
+ * RX is done NAPI-style: drivers signal RX from their IRQ handlers (with RX IRQs then left masked)
+ * and we poll them from the NETRX softirq. Every interface gets to process up to rx_weight packets
+ * per go, round-robin, and a softirq run processes at most NETIF_RX_BUDGET packets. If there's
+ * still work left after that, the CPU's netrx thread takes over, so a busy NIC can't starve every
+ * other thread on the CPU.
+ */
+
+/* Max number of packets processed per softirq run (and per netrx thread go) */
+#define NETIF_RX_BUDGET 300
+
 struct rx_queue_percpu
 {
     struct list_head to_rx_list;
     struct spinlock lock;
+    /* Kernel thread that polls when the softirq runs out of budget */
+    struct thread *rx_thread;
+    /* True if rx_thread was woken up and is in charge of polling */
+    bool thread_owned;
 };
 
 PER_CPU_VAR(rx_queue_percpu rx_queue);
@@ -284,13 +301,33 @@ void netif_signal_rx(netif *nif)
     softirq_raise(softirq_vector::SOFTIRQ_VECTOR_NETRX);
 }
 
-void netif_do_rxpoll(netif *nif)
+/**
+ * @brief Poll an interface
+ *
+ * @param nif Interface
+ * @param budget Max number of packets to process
+ * @return Number of packets processed. If it's less than budget, the interface is done and
+ * has been taken out of RX.
+ */
+static int netif_do_rxpoll(netif *nif, int budget)
 {
+    int done = 0;
+
     __atomic_or_fetch(&nif->flags, NETIF_DOING_RX_POLL, __ATOMIC_RELAXED);
 
     while (true)
     {
-        nif->poll_rx(nif);
+        gro_begin(nif);
+        done += nif->poll_rx(nif, budget - done);
+        gro_end(nif);
+
+        if (done >= budget)
+        {
+            /* Out of budget. RX stays signalled, and we get polled again later */
+            __atomic_and_fetch(&nif->flags, ~(NETIF_DOING_RX_POLL | NETIF_MISSED_RX),
+                               __ATOMIC_RELEASE);
+            break;
+        }
 
         unsigned int flags, og_flags;
 
@@ -312,29 +349,137 @@ void netif_do_rxpoll(netif *nif)
         if (!(flags & NETIF_DOING_RX_POLL))
             break;
     }
+
+    return done;
+}
+
+/**
+ * @brief Poll this CPU's interfaces, round-robin
+ * Must be called with preemption disabled.
+ *
+ * @param queue This CPU's RX queue
+ * @param budget Max number of packets to process
+ * @return True if every interface got done, false if we ran out of budget
+ */
+static bool netif_rx_run(rx_queue_percpu *queue, int budget)
+{
+    while (true)
+    {
+        unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
+
+        if (list_is_empty(&queue->to_rx_list))
+        {
+            spin_unlock_irqrestore(&queue->lock, cpu_flags);
+            return true;
+        }
+
+        if (budget <= 0)
+        {
+            spin_unlock_irqrestore(&queue->lock, cpu_flags);
+            return false;
+        }
+
+        netif *nif = container_of(list_first_element(&queue->to_rx_list), netif, rx_queue_node);
+        list_remove(&nif->rx_queue_node);
+
+        spin_unlock_irqrestore(&queue->lock, cpu_flags);
+
+        int weight = min((int) (nif->rx_weight ?: NETIF_RX_WEIGHT), budget);
+        int done = netif_do_rxpoll(nif, weight);
+
+        budget -= done;
+
+        if (done >= weight)
+        {
+            /* It still has packets for us, let the others have a go first */
+            cpu_flags = spin_lock_irqsave(&queue->lock);
+            list_add_tail(&nif->rx_queue_node, &queue->to_rx_list);
+            spin_unlock_irqrestore(&queue->lock, cpu_flags);
+        }
+    }
+}
+
+static void netif_rx_thread(void *arg)
+{
+    auto queue = (rx_queue_percpu *) arg;
+
+    while (true)
+    {
+        sched_disable_preempt();
+        bool done = netif_rx_run(queue, NETIF_RX_BUDGET);
+        /* This is where we get preempted if someone else needs the CPU */
+        sched_enable_preempt();
+
+        if (!done)
+            continue;
+
+        unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
+
+        if (!list_is_empty(&queue->to_rx_list))
+        {
+            spin_unlock_irqrestore(&queue->lock, cpu_flags);
+            continue;
+        }
+
+        /* Nothing left, give it back to the softirq and go to sleep */
+        queue->thread_owned = false;
+        set_current_state(THREAD_UNINTERRUPTIBLE);
+
+        spin_unlock_irqrestore(&queue->lock, cpu_flags);
+
+        sched_yield();
+    }
 }
 
 int netif_do_rx(void)
 {
     auto queue = get_per_cpu_ptr(rx_queue);
 
-    scoped_lock g{queue->lock};
+    /* The netrx thread is already on it */
+    if (__atomic_load_n(&queue->thread_owned, __ATOMIC_RELAXED))
+        return 0;
 
-    list_for_every (&queue->to_rx_list)
-    {
-        netif *n = container_of(l, netif, rx_queue_node);
+    thread *rx_thread = __atomic_load_n(&queue->rx_thread, __ATOMIC_ACQUIRE);
 
-        netif_do_rxpoll(n);
+    if (!rx_thread)
+    {
+        /* Early boot, before the netrx threads exist */
+        while (!netif_rx_run(queue, NETIF_RX_BUDGET))
+            ;
+        return 0;
     }
 
-    list_reset(&queue->to_rx_list);
+    if (netif_rx_run(queue, NETIF_RX_BUDGET))
+        return 0;
+
+    unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
+    queue->thread_owned = true;
+    spin_unlock_irqrestore(&queue->lock, cpu_flags);
+
+    thread_wake_up(rx_thread);
 
     return 0;
 }
 
+static void netif_start_rx_threads()
+{
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        auto queue = get_per_cpu_ptr_any(rx_queue, i);
+        thread *t = sched_create_thread(netif_rx_thread, THREAD_KERNEL, queue);
+
+        assert(t != nullptr);
+
+        sched_start_thread_for_cpu(t, i);
+        __atomic_store_n(&queue->rx_thread, t, __ATOMIC_RELEASE);
+    }
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(netif_start_rx_threads);
+
 int netif_process_pbuf(netif *nif, packetbuf *buf)
 {
-    return nif->dll_ops->rx_packet(nif, buf);
+    return gro_receive(nif, buf);
 }
 
 int netif_add_v6_address(netif *nif, const if_inet6_addr &addr_)
@@ -12,7 +12,9 @@
 
 #include <onyx/compiler.h>
 #include <onyx/mm/vm_object.h>
+#include <onyx/net/zerocopy.h>
 #include <onyx/packetbuf.h>
+#include <onyx/vm.h>
 
 #include <onyx/memory.hpp>
 #include <onyx/mm/pool.hpp>
@@ -39,6 +41,25 @@ void packetbuf::operator delete(void *ptr)
  * @return Returns true if it was successful, false if it was not.
  */
 bool packetbuf::allocate_space(size_t length)
+{
+    return do_allocate_space(length, false);
+}
+
+/**
+ * @brief Reserve space for the packet, as a single physically contiguous head area.
+ * Meant for packets that need to be linear but may not fit in a page (e.g GRO'd packets).
+ * Like allocate_space(), it's only meant to be called once.
+ *
+ * @param length The maximum length of the whole packet(including headers and footers)
+ *
+ * @return Returns true if it was successful, false if it was not.
+ */
+bool packetbuf::allocate_linear_space(size_t length)
+{
+    return do_allocate_space(length, true);
+}
+
+bool packetbuf::do_allocate_space(size_t length, bool linear)
 {
     /* This should only be called once - essentially,
      * we allocate enough pages for the packet and fill page_vec.
@@ -46,7 +67,7 @@ bool packetbuf::allocate_space(size_t length)
 
     auto nr_pages = vm_size_to_pages(length);
 
-    page *pages = alloc_pages(nr_pages, PAGE_ALLOC_NO_ZERO);
+    page *pages = alloc_pages(nr_pages, PAGE_ALLOC_NO_ZERO | (linear ? PAGE_ALLOC_CONTIGUOUS : 0));
     if (!pages)
         return false;
 
@@ -74,7 +95,8 @@ bool packetbuf::allocate_space(size_t length)
 
         if (i == 0)
         {
-            page_vec[i].length = min(length, PAGE_SIZE);
+            /* Linear packets have everything in the head area */
+            page_vec[i].length = linear ? length : min(length, PAGE_SIZE);
         }
         else
         {
@@ -108,7 +130,7 @@ bool packetbuf::allocate_space(size_t length)
 
     net_header = transport_header = nullptr;
     data = tail = (unsigned char *) buffer_start;
-    end = (unsigned char *) buffer_start + PAGE_SIZE;
+    end = (unsigned char *) buffer_start + (linear ? nr_pages << PAGE_SHIFT : PAGE_SIZE);
 
     return true;
 }
@@ -175,6 +197,10 @@ packetbuf::~packetbuf()
         if (v.page)
             free_page(v.page);
     }
+
+    /* Now that the pages are gone, the send is complete */
+    if (zc)
+        zc->unref();
 }
 
 /**
@@ -301,3 +327,93 @@ ssize_t packetbuf::expand_buffer(const void *ubuf_, unsigned int len)
 
     return ret;
 }
+
+/**
+ * @brief Attach a page fragment to the end of the data area, without copying it.
+ * Takes a reference to the page, and makes the packetbuf a zero copy one.
+ *
+ * @param page Page
+ * @param off Offset of the data in the page
+ * @param len Length of the data
+ * @return 0 on success, -ENOBUFS if the page vector is full
+ */
+int packetbuf::attach_page(struct page *page, unsigned int off, unsigned int len)
+{
+    if (!can_attach_page())
+        return -ENOBUFS;
+
+    auto &v = page_vec[count_page_vecs()];
+
+    /* The head area now ends at tail, since drivers look at its length */
+    page_vec[0].length = tail - (unsigned char *) buffer_start;
+
+    page_ref(page);
+    v.page = page;
+    v.page_off = off;
+    v.length = len;
+    zero_copy = 1;
+
+    return 0;
+}
+
+/**
+ * @brief Pin user memory and attach it to the end of the data area, without copying it.
+ *
+ * @param ubuf User address of the buffer.
+ * @param len Length of the buffer.
+ * @return The amount attached (which may be short if the page vector fills up), or a negative
+ * error code if we failed to attach anything.
+ */
+ssize_t packetbuf::attach_user_pages(const void *ubuf, unsigned int len)
+{
+    struct page *pages[PACKETBUF_MAX_NR_PAGES];
+    unsigned long addr = (unsigned long) ubuf;
+    unsigned int page_off = addr & (PAGE_SIZE - 1);
+    unsigned int free_vecs = PACKETBUF_MAX_NR_PAGES + 1 - count_page_vecs();
+
+    if (!len)
+        return 0;
+
+    if (!free_vecs)
+        return -ENOBUFS;
+
+    size_t nr_pages = cul::min(vm_size_to_pages(page_off + len), (size_t) free_vecs);
+
+    if (!(get_phys_pages((void *) (addr - page_off), GPP_READ | GPP_USER, pages, nr_pages) &
+          GPP_ACCESS_OK))
+        return -EFAULT;
+
+    ssize_t attached = 0;
+
+    for (size_t i = 0; i < nr_pages; i++)
+    {
+        unsigned int to_attach = cul::min(len, (unsigned int) PAGE_SIZE - page_off);
+
+        /* attach_page() takes its own reference, so drop the pin afterwards */
+        int st = attach_page(pages[i], page_off, to_attach);
+        assert(st == 0);
+        page_unpin(pages[i]);
+
+        len -= to_attach;
+        attached += to_attach;
+        page_off = 0;
+    }
+
+    return attached;
+}
+
+/**
+ * @brief Set the zerocopy notification of the packetbuf, taking a reference to it.
+ *
+ * @param notif Notification
+ */
+void packetbuf::set_zerocopy_notif(zerocopy_notif *notif)
+{
+    assert(zc == nullptr || zc == notif);
+
+    if (zc)
+        return;
+
+    notif->ref();
+    zc = notif;
+}
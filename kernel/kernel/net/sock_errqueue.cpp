@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <string.h>
+
+#include <onyx/net/sock_errqueue.h>
+#include <onyx/poll.h>
+#include <onyx/scoped_lock.h>
+
+sock_errqueue::~sock_errqueue()
+{
+    sock_err_entry *entry;
+
+    while ((entry = pop()))
+        delete entry;
+}
+
+/**
+ * @brief Check if a zerocopy completion can be folded into the previous one
+ *
+ * @param last Last entry of the queue
+ * @param entry New entry
+ * @return True if so, else false
+ */
+static bool sock_errqueue_can_merge(const sock_err_entry *last, const sock_err_entry *entry)
+{
+    if (last->ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || entry->ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        return false;
+
+    return last->ee.ee_code == entry->ee.ee_code && last->ee.ee_data + 1 == entry->ee.ee_info;
+}
+
+void sock_errqueue::push(sock_err_entry *entry)
+{
+    unsigned long cpu_flags = spin_lock_irqsave(&lock);
+
+    if (!list_is_empty(&queue))
+    {
+        auto last = container_of(queue.prev, sock_err_entry, list_node);
+
+        if (sock_errqueue_can_merge(last, entry))
+        {
+            last->ee.ee_data = entry->ee.ee_data;
+            spin_unlock_irqrestore(&lock, cpu_flags);
+            delete entry;
+            return;
+        }
+    }
+
+    list_add_tail(&entry->list_node, &queue);
+    spin_unlock_irqrestore(&lock, cpu_flags);
+
+    wait_queue_wake_all(&wq);
+}
+
+sock_err_entry *sock_errqueue::pop()
+{
+    sock_err_entry *entry = nullptr;
+    unsigned long cpu_flags = spin_lock_irqsave(&lock);
+
+    if (!list_is_empty(&queue))
+    {
+        entry = container_of(list_first_element(&queue), sock_err_entry, list_node);
+        list_remove(&entry->list_node);
+    }
+
+    spin_unlock_irqrestore(&lock, cpu_flags);
+
+    return entry;
+}
+
+bool sock_errqueue::empty()
+{
+    unsigned long cpu_flags = spin_lock_irqsave(&lock);
+    bool is_empty = list_is_empty(&queue);
+    spin_unlock_irqrestore(&lock, cpu_flags);
+
+    return is_empty;
+}
+
+bool sock_errqueue::poll(void *poll_file)
+{
+    poll_wait_helper(poll_file, &wq);
+    return !empty();
+}
+
+/**
+ * @brief Receive an extended error off a socket's error queue
+ * The error gets copied to the control message buffer, as SOL_IP/IP_RECVERR (or
+ * SOL_IPV6/IPV6_RECVERR for AF_INET6 sockets), and no data is returned.
+ *
+ * @param queue Error queue, may be nullptr
+ * @param domain Domain of the socket
+ * @param msg Message header (kernel copy)
+ * @return 0 on success, -EAGAIN if there are no errors, or a negative error code
+ */
+ssize_t sock_recv_errqueue(sock_errqueue *queue, int domain, struct msghdr *msg)
+{
+    if (!queue)
+        return -EAGAIN;
+
+    sock_err_entry *entry = queue->pop();
+    if (!entry)
+        return -EAGAIN;
+
+    msg->msg_flags = MSG_ERRQUEUE;
+    msg->msg_namelen = 0;
+
+    if (msg->msg_controllen < CMSG_SPACE(sizeof(sock_extended_err)))
+    {
+        /* Like Linux, the error is consumed anyway */
+        msg->msg_flags |= MSG_CTRUNC;
+        msg->msg_controllen = 0;
+    }
+    else
+    {
+        auto cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(sock_extended_err));
+        cmsg->cmsg_level = domain == AF_INET6 ? SOL_IPV6 : SOL_IP;
+        cmsg->cmsg_type = domain == AF_INET6 ? IPV6_RECVERR : IP_RECVERR;
+        memcpy(CMSG_DATA(cmsg), &entry->ee, sizeof(sock_extended_err));
+        msg->msg_controllen = CMSG_SPACE(sizeof(sock_extended_err));
+    }
+
+    delete entry;
+
+    return 0;
+}
@@ -14,6 +14,7 @@
 #include <onyx/net/ip.h>
 #include <onyx/net/netkernel.h>
 #include <onyx/net/socket.h>
+#include <onyx/net/zerocopy.h>
 #include <onyx/poll.h>
 #include <onyx/scoped_lock.h>
 #include <onyx/utils.h>
@@ -200,11 +201,8 @@ bool recv_queue::poll(void *poll_file)
 {
     scoped_lock guard{recv_queue_lock};
 
-    if (has_data_available(0, 0))
-        return true;
-
     poll_wait_helper(poll_file, &recv_wait);
-    return false;
+    return has_data_available(0, 0);
 }
 
 /* Returns with recv_queue_lock held on success */
@@ -255,6 +253,71 @@ ssize_t socket::recvmsg(struct msghdr *msg, int flags)
     return -EIO;
 }
 
+ssize_t socket::sendpage(struct page *page, unsigned int off, unsigned int len, int flags)
+{
+    msghdr msg;
+    msg.msg_control = nullptr;
+    msg.msg_controllen = 0;
+    msg.msg_flags = 0;
+    msg.msg_name = nullptr;
+    msg.msg_namelen = 0;
+
+    iovec vec0;
+    vec0.iov_base = (char *) PAGE_TO_VIRT(page) + off;
+    vec0.iov_len = len;
+    msg.msg_iov = &vec0;
+    msg.msg_iovlen = 1;
+
+    /* The buffer is a kernel one, let sendmsg's copies know */
+    unsigned long old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st = sendmsg(&msg, flags & ~MSG_ZEROCOPY);
+    thread_change_addr_limit(old);
+
+    return st;
+}
+
+sock_errqueue *socket::get_errqueue()
+{
+    sock_errqueue *queue = __atomic_load_n(&errqueue, __ATOMIC_ACQUIRE);
+    if (queue)
+        return queue;
+
+    queue = new sock_errqueue;
+    if (!queue)
+        return nullptr;
+
+    sock_errqueue *expected = nullptr;
+
+    if (!__atomic_compare_exchange_n(&errqueue, &expected, queue, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+    {
+        /* Someone beat us to it */
+        queue->unref();
+        return expected;
+    }
+
+    return queue;
+}
+
+zerocopy_notif *socket::zerocopy_start()
+{
+    auto queue = get_errqueue();
+    if (!queue)
+        return nullptr;
+
+    return zerocopy_notif_create(queue, zc_next_id);
+}
+
+void socket::zerocopy_end(zerocopy_notif *notif, bool sent)
+{
+    if (sent)
+        zc_next_id++;
+    else
+        notif->cancel();
+
+    notif->unref();
+}
+
 size_t socket_write(size_t offset, size_t len, void *buffer, struct file *file)
 {
     socket *s = file_to_socket(file);
@@ -303,6 +366,13 @@ size_t socket_read(size_t offset, size_t len, void *buffer, file *file)
     return res;
 }
 
+ssize_t socket_sendpage(struct page *page, unsigned int off, unsigned int len, struct file *file)
+{
+    socket *s = file_to_socket(file);
+
+    return s->sendpage(page, off, len, fd_flags_to_msg_flags(file));
+}
+
 short socket::poll(void *poll_file, short events)
 {
     short avail_events = POLLOUT;
@@ -332,7 +402,14 @@ short socket_poll(void *poll_file, short events, struct file *node)
 	if(s->s_ops->poll)
 		return s->s_ops->poll(poll_file, events, s);
 #endif
-    return s->poll(poll_file, events);
+    short revents = s->poll(poll_file, events);
+
+    /* POLLERR is always reported, whether or not it was asked for */
+    sock_errqueue *queue = __atomic_load_n(&s->errqueue, __ATOMIC_ACQUIRE);
+    if (queue && queue->poll(poll_file))
+        revents |= POLLERR;
+
+    return revents;
 }
 
 void socket_close(struct inode *ino);
@@ -523,6 +600,7 @@ struct file_ops socket_ops = {
     .close = socket_close,
     .ioctl = socket_ioctl,
     .poll = socket_poll,
+    .sendpage = socket_sendpage,
 };
 
 auto_file get_socket_fd(int fd)
@@ -642,7 +720,12 @@ ssize_t sys_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockad
     msg.msg_name = src_addr ? &sa : nullptr;
     msg.msg_namelen = src_addr ? addrlen : 0;
 
-    ssize_t ret = s->recvmsg(&msg, flags);
+    ssize_t ret;
+
+    if (flags & MSG_ERRQUEUE)
+        ret = sock_recv_errqueue(__atomic_load_n(&s->errqueue, __ATOMIC_ACQUIRE), s->domain, &msg);
+    else
+        ret = s->recvmsg(&msg, flags);
 
     if (ret < 0)
         return ret;
@@ -1116,6 +1199,11 @@ int socket::getsockopt_socket_level(int optname, void *optval, socklen_t *optlen
             return put_option<int>(bcast_allowed, optval, optlen);
         }
 
+        case SO_ZEROCOPY: {
+            const int zc = (int) zerocopy;
+            return put_option<int>(zc, optval, optlen);
+        }
+
         default:
             return -ENOPROTOOPT;
     }
@@ -1164,6 +1252,24 @@ int socket::setsockopt_socket_level(int optname, const void *optval, socklen_t o
             broadcast_allowed = ex.value() != 0;
             return 0;
         }
+
+        case SO_ZEROCOPY: {
+            auto ex = get_socket_option<int>(optval, optlen);
+
+            if (ex.has_error())
+                return ex.error();
+
+            /* Only inet sockets know how to send pages */
+            if (domain != AF_INET && domain != AF_INET6)
+                return -EOPNOTSUPP;
+
+            /* Completions need somewhere to go */
+            if (ex.value() && !get_errqueue())
+                return -ENOMEM;
+
+            zerocopy = ex.value() != 0;
+            return 0;
+        }
     }
 
     return -ENOPROTOOPT;
@@ -1383,7 +1489,15 @@ ssize_t socket_recvmsg(socket *sock, msghdr *umsg, int flags)
     if (int st = copy_msghdr_from_user(&msg, umsg, g); st < 0)
         return st;
 
-    auto st = sock->recvmsg(&msg, flags);
+    ssize_t st;
+
+    if (flags & MSG_ERRQUEUE)
+    {
+        st = sock_recv_errqueue(__atomic_load_n(&sock->errqueue, __ATOMIC_ACQUIRE), sock->domain,
+                                &msg);
+    }
+    else
+        st = sock->recvmsg(&msg, flags);
 
     if (st < 0)
         return st;
@@ -1400,7 +1514,7 @@ ssize_t socket_recvmsg(socket *sock, msghdr *umsg, int flags)
 
     if (msg.msg_name)
     {
-        if (copy_to_user(msg.msg_name, g.uname, msg.msg_namelen) < 0)
+        if (copy_to_user(msg.msg_name, &g.sa, msg.msg_namelen) < 0)
             return -EFAULT;
     }
 
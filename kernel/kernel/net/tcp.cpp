@@ -14,9 +14,11 @@
 #include <onyx/net/ip.h>
 #include <onyx/net/socket_table.h>
 #include <onyx/net/tcp.h>
+#include <onyx/net/zerocopy.h>
 #include <onyx/poll.h>
 #include <onyx/random.h>
 #include <onyx/timer.h>
+#include <onyx/tracepoint.h>
 
 socket_table tcp_table;
 
@@ -60,6 +62,89 @@ uint16_t tcp_calculate_checksum(const tcp_header *header, uint16_t len, const in
 
 #define TCP_MAKE_DATA_OFF(off) (off << TCP_DATA_OFFSET_SHIFT)
 
+/**
+ * @brief Get the smallest window scale that makes a window fit in the header
+ *
+ * @param window Window, in bytes
+ * @return Shift
+ */
+static uint8_t tcp_window_shift(uint32_t window)
+{
+    uint8_t shift = 0;
+
+    while (shift < TCP_MAX_WINDOW_SHIFT && (window >> shift) > UINT16_MAX)
+        shift++;
+
+    return shift;
+}
+
+/**
+ * @brief Get the largest window we can advertise
+ *
+ * @param rx_max_buf Size of the receive buffer
+ * @param wscale True if window scaling is on
+ * @return The window, in bytes
+ */
+static uint32_t tcp_max_window(unsigned int rx_max_buf, bool wscale)
+{
+    return cul::min(rx_max_buf, wscale ? (unsigned int) UINT16_MAX << TCP_MAX_WINDOW_SHIFT
+                                        : (unsigned int) UINT16_MAX);
+}
+
+/**
+ * @brief Get the SACK blocks out of a segment
+ *
+ * @param tcphdr Header of the segment
+ * @param blocks Array of blocks
+ * @param max Size of the array
+ * @return Number of blocks
+ */
+static unsigned int tcp_parse_sack(const tcp_header *tcphdr, tcp_sack_block *blocks,
+                                   unsigned int max)
+{
+    uint16_t data_off = TCP_GET_DATA_OFF(ntohs(tcphdr->data_offset_and_flags));
+    const uint8_t *options = reinterpret_cast<const uint8_t *>(tcphdr + 1);
+    const uint8_t *end = (const uint8_t *) tcphdr + tcp_header_data_off_to_length(data_off);
+
+    while (options < end)
+    {
+        uint8_t opt_byte = *options;
+
+        if (opt_byte == TCP_OPTION_END_OF_OPTIONS)
+            break;
+
+        if (opt_byte == TCP_OPTION_NOP)
+        {
+            options++;
+            continue;
+        }
+
+        if (end - options < 2 || options[1] < 2 || options[1] > end - options)
+            break;
+
+        uint8_t length = options[1];
+
+        if (opt_byte == TCP_OPTION_SACK)
+        {
+            unsigned int nr = cul::min((unsigned int) (length - 2) / 8, max);
+
+            for (unsigned int i = 0; i < nr; i++)
+            {
+                uint32_t edges[2];
+                memcpy(edges, options + 2 + i * 8, sizeof(edges));
+                blocks[i].start = ntohl(edges[0]);
+                blocks[i].end = ntohl(edges[1]);
+            }
+
+            return nr;
+        }
+
+        options += length;
+    }
+
+    return 0;
+}
+
 int tcp_init_netif(struct netif *netif)
 {
     return 0;
@@ -112,7 +197,12 @@ int tcp_socket::do_receive_syn_sent(const packet_handling_data &data)
         return -EIO;
     }
 
-    window_size = ntohs(tcphdr->window_size) << window_size_shift;
+    /* Windows in SYN segments are never scaled */
+    window_size = ntohs(tcphdr->window_size);
+
+    /* We know the MSS now, so we can size the initial window. Anything we retransmitted so far
+     * was the SYN. */
+    tcp_cong_start(cong, mss, cong.total_retrans != 0);
 
     auto starting_seq_number = ntohl(tcphdr->sequence_number);
     uint32_t seqs = 1;
@@ -154,6 +244,9 @@ void tcp_socket::do_ack(packetbuf *buf)
 {
     tcp_header *tcphdr = (tcp_header *) buf->transport_header;
     auto ack = ntohl(tcphdr->ack_number);
+    auto flags = ntohs(tcphdr->data_offset_and_flags);
+    uint16_t window = ntohs(tcphdr->window_size);
+    hrtime_t sent_at = 0;
 
     scoped_lock g{pending_out_lock};
 
@@ -172,6 +265,12 @@ void tcp_socket::do_ack(packetbuf *buf)
             state = tcp_state::TCP_STATE_FIN_WAIT_2;
         }
 
+        if (!pkt->retransmitted)
+            sent_at = cul::max(sent_at, pkt->sent_at);
+
+        if (pkt->sacked)
+            sacked_out -= pkt->end_seq() - pkt->seq();
+
         pkt->do_ack();
 
         wait_queue_wake_all(&pkt->wq);
@@ -182,21 +281,247 @@ void tcp_socket::do_ack(packetbuf *buf)
         pkt->unref();
     }
 
-    last_ack_number = ack;
+    /* Recovery needs an up-to-date scoreboard */
+    if (sack_ok)
+        sack_update(tcphdr, ack);
+
+    if (tcp_seq_after(ack, last_ack_number))
+    {
+        uint32_t flight = bytes_in_flight();
+        uint32_t acked = ack - last_ack_number;
+
+        last_ack_number = ack;
+
+        if (sent_at)
+            tcp_rtt_sample(cong, clocksource_get_time() - sent_at);
+
+        if (state != tcp_state::TCP_STATE_SYN_SENT)
+            cong_new_ack(ack, acked, flight);
+    }
+    else if (ack == last_ack_number && (flags & 0xff) == TCP_FLAG_ACK && !buf->length() &&
+             window == last_ack_window && !list_is_empty(&pending_out_packets))
+    {
+        cong_dupack();
+    }
+
+    last_ack_window = window;
 
     g.unlock();
 
+    // Try to send any possible pending packets, the windows may have opened up
+    if (int st = try_to_send(); st < 0)
+    {
+        sock_err = -st;
+        return;
+    }
+}
+
+bool tcp_socket::cong_can_send(uint32_t len) const
+{
+    /* SACKed segments already left the network */
+    uint32_t flight = bytes_in_flight() - sacked_out;
+
+    /* Always let a segment through if nothing's in flight, so we can't get stuck */
+    return flight == 0 || flight + len <= cong.cwnd;
+}
+
+void tcp_socket::cong_new_ack(uint32_t ack, uint32_t acked, uint32_t flight)
+{
+    cong.dupacks = 0;
+    cong.backoff = 0;
+
+    switch (cong.ca_state)
+    {
+        case tcp_ca_state::TCP_CA_RECOVERY:
+            if (tcp_seq_before(ack, cong.recover))
+            {
+                /* Partial ACK (RFC 6582, section 3.2): the next segment got lost too. Resend it,
+                 * and deflate the window by the amount of new data acked. */
+                retransmit_next();
+                cong.cwnd -= cul::min(acked, cong.cwnd);
+                if (acked >= cong.mss)
+                    cong.cwnd += cong.mss;
+                return;
+            }
+
+            /* Full ACK, deflate the window and go back to congestion avoidance */
+            cong.cwnd = cul::min(cong.ssthresh, cul::max(seq_number - ack, cong.mss) + cong.mss);
+            cong.ca_state = tcp_ca_state::TCP_CA_OPEN;
+            return;
+        case tcp_ca_state::TCP_CA_LOSS:
+            /* We slow start back up after a timeout, and we're done when everything that was in
+             * flight at the time is acked */
+            if (!tcp_seq_before(ack, cong.recover))
+                cong.ca_state = tcp_ca_state::TCP_CA_OPEN;
+            break;
+        default:
+            break;
+    }
+
+    /* Don't grow the window if we're not using it */
+    if (flight >= cong.cwnd / 2)
+        cc->cong_avoid(cong, acked);
+}
+
+void tcp_socket::cong_dupack()
+{
+    if (cong.ca_state == tcp_ca_state::TCP_CA_RECOVERY)
+    {
+        /* Every duplicate ACK means a segment left the network, so inflate the window. With
+         * SACK, we also know what else got lost, so fill the next hole. */
+        cong.cwnd += cong.mss;
+        if (sack_ok)
+            retransmit_next();
+        return;
+    }
+
+    if (cong.ca_state != tcp_ca_state::TCP_CA_OPEN || ++cong.dupacks < TCP_DUPACK_THRESHOLD)
+        return;
+
+    /* Fast retransmit (RFC 5681, section 3.2) */
+    cong.ssthresh = cc->ssthresh(cong);
+    cong.cwnd = cong.ssthresh + TCP_DUPACK_THRESHOLD * cong.mss;
+    cong.recover = seq_number;
+    cong.ca_state = tcp_ca_state::TCP_CA_RECOVERY;
+    high_rxt = last_ack_number;
+    retransmit_next();
+}
+
+void tcp_socket::retransmit_first()
+{
     if (list_is_empty(&pending_out_packets))
+        return;
+
+    auto pkt = list_head_cpp<tcp_pending_out>::self_from_list_head(
+        list_first_element(&pending_out_packets));
+
+    if (int st = retransmit(pkt); st < 0)
+        sock_err = -st;
+}
+
+void tcp_socket::retransmit_next()
+{
+    if (!sack_ok)
     {
-        // Try to send any possible pending packets
-        if (int st = try_to_send(); st < 0)
-        {
+        retransmit_first();
+        return;
+    }
+
+    list_for_every (&pending_out_packets)
+    {
+        auto pkt = list_head_cpp<tcp_pending_out>::self_from_list_head(l);
+        uint32_t seq = pkt->seq();
+
+        /* Anything past the highest SACKed segment may still be on its way, but the oldest
+         * segment is always considered lost once we're recovering */
+        if (!tcp_seq_before(seq, high_sacked) && seq != last_ack_number)
+            break;
+
+        if (pkt->sacked || tcp_seq_before(seq, high_rxt))
+            continue;
+
+        high_rxt = pkt->end_seq();
+
+        if (int st = retransmit(pkt); st < 0)
             sock_err = -st;
-            return;
+        return;
+    }
+}
+
+void tcp_socket::sack_update(const tcp_header *tcphdr, uint32_t ack)
+{
+    tcp_sack_block blocks[TCP_MAX_SACK_BLOCKS];
+    unsigned int nr = tcp_parse_sack(tcphdr, blocks, TCP_MAX_SACK_BLOCKS);
+
+    if (tcp_seq_before(high_sacked, ack))
+        high_sacked = ack;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        const auto &block = blocks[i];
+
+        /* Skip blocks for data that was already acked (D-SACK) or never sent */
+        if (!tcp_seq_before(block.start, block.end) || !tcp_seq_after(block.start, ack) ||
+            tcp_seq_after(block.end, seq_number))
+            continue;
+
+        list_for_every (&pending_out_packets)
+        {
+            auto pkt = list_head_cpp<tcp_pending_out>::self_from_list_head(l);
+            uint32_t start = pkt->seq();
+            uint32_t end = pkt->end_seq();
+
+            if (pkt->sacked || tcp_seq_before(start, block.start))
+                continue;
+
+            /* Segments are in order, so nothing after this one fits in the block either */
+            if (tcp_seq_after(end, block.end))
+                break;
+
+            pkt->sacked = true;
+            sacked_out += end - start;
+
+            if (tcp_seq_after(end, high_sacked))
+                high_sacked = end;
         }
     }
 }
 
+bool tcp_socket::should_retransmit(const tcp_pending_out *pkt)
+{
+    /* The receiver is allowed to throw away SACKed data (RFC 2018, section 8), so if the oldest
+     * segment timed out, it goes out again regardless */
+    return !pkt->sacked || list_first_element(&pending_out_packets) == &pkt->node;
+}
+
+/**
+ * @brief Retransmit a segment
+ *
+ * @param pkt Segment to retransmit
+ * @return 0 on success, negative error codes
+ */
+int tcp_socket::retransmit(tcp_pending_out *pkt)
+{
+    iflow flow{route_cache, IPPROTO_TCP, effective_domain() == AF_INET6};
+
+    pkt->retransmitted = true;
+    cong.total_retrans++;
+
+    trace_tcp_retransmit(ntohs(src_addr.port), ntohs(dest_addr.port), pkt->seq(),
+                         pkt->transmission_try);
+
+    // Since the packet has already been pre-prepared by the network stack
+    // we can just send it straight through the network interface
+    return netif_send_packet(flow.nif, pkt->buf.get());
+}
+
+/**
+ * @brief Handle a retransmission timeout, cutting the congestion window
+ * Note: pending_out_lock held
+ *
+ * @param pkt Segment that timed out
+ * @return Timeout for the segment's next retransmission, in ns
+ */
+hrtime_t tcp_socket::retransmit_timeout(tcp_pending_out *pkt)
+{
+    /* Back off the RTO for new segments too (RFC 6298, section 5.5) */
+    if (pkt->transmission_try > cong.backoff)
+        cong.backoff = pkt->transmission_try;
+
+    /* The window is still unset if this is the SYN. Segments sent before the timeout are going
+     * to time out too, but it's the same loss as far as the window goes. */
+    if (cong.mss && cong.ca_state != tcp_ca_state::TCP_CA_LOSS)
+    {
+        cong.ssthresh = cc->ssthresh(cong);
+        cong.cwnd = cong.mss;
+        cong.recover = seq_number;
+        cong.dupacks = 0;
+        cong.ca_state = tcp_ca_state::TCP_CA_LOSS;
+    }
+
+    return tcp_rto(cong, pkt->transmission_try);
+}
+
 /**
  * @brief Send a reset segment
  *
@@ -224,8 +549,7 @@ void tcp_socket::send_reset()
 
     auto data_off = TCP_MAKE_DATA_OFF(tcp_header_length_to_data_off(sizeof(tcp_header)));
 
-    /* Assume the max window size as the window size, for now */
-    tph->window_size = htons(our_window_size);
+    tph->window_size = htons(advertised_window(false));
     tph->source_port = saddr().port;
     tph->sequence_number = htonl(sequence_nr());
     tph->data_offset_and_flags = htons(data_off | flags);
@@ -279,6 +603,7 @@ void tcp_socket::reset()
         pkt->unref();
     }
 
+    sacked_out = 0;
     state = tcp_state::TCP_STATE_CLOSED;
 }
 
@@ -314,8 +639,9 @@ void tcp_socket::set_time_wait()
  */
 void tcp_socket::handle_fin(packetbuf *buf)
 {
-    // Shutdown RD
+    // Shutdown RD, and let readers see the EOF
     shutdown_state |= SHUTDOWN_RD;
+    wait_queue_wake_all(&rx_wq);
 
     switch (state)
     {
@@ -350,12 +676,30 @@ void tcp_socket::handle_fin(packetbuf *buf)
  */
 void tcp_socket::send_ack()
 {
+    tcp_option sack_opt{TCP_OPTION_SACK, 0};
     tcp_packet pkt{{}, this, TCP_FLAG_ACK, src_addr};
+
+    if (sack_ok && !ooo_queue.empty())
+    {
+        tcp_sack_block blocks[TCP_MAX_SACK_BLOCKS];
+        unsigned int nr = ooo_queue.sack_blocks(blocks, TCP_MAX_SACK_BLOCKS);
+
+        for (unsigned int i = 0; i < nr; i++)
+        {
+            uint32_t edges[2] = {htonl(blocks[i].start), htonl(blocks[i].end)};
+            memcpy(&sack_opt.data._data[i * sizeof(edges)], edges, sizeof(edges));
+        }
+
+        sack_opt.length = 2 + nr * sizeof(tcp_sack_block);
+        pkt.append_option(&sack_opt);
+    }
+
     auto pbuf = pkt.result();
 
     if (!pbuf)
     {
         sock_err = ENOBUFS;
+        return;
     }
 
     if (auto ex = sendpbuf(pbuf, true); ex.has_error())
@@ -376,7 +720,8 @@ bool tcp_connection_req::parse_syn(const tcp_header *tcphdr)
 {
     uint16_t data_off = ntohs(tcphdr->data_offset_and_flags) >> TCP_DATA_OFFSET_SHIFT;
 
-    window_size = tcphdr->window_size;
+    /* Windows in SYN segments are never scaled */
+    window_size = ntohs(tcphdr->window_size);
     ack_number = ntohl(tcphdr->sequence_number) + 1; // 1 for the SYN
 
     if (data_off == tcp_header_length_to_data_off(min_header_size))
@@ -387,7 +732,7 @@ bool tcp_connection_req::parse_syn(const tcp_header *tcphdr)
     const uint8_t *options = reinterpret_cast<const uint8_t *>(tcphdr + 1);
     const uint8_t *end = options + (data_off_bytes - min_header_size);
 
-    while (options != end)
+    while (options < end)
     {
         uint8_t opt_byte = *options;
 
@@ -404,6 +749,9 @@ bool tcp_connection_req::parse_syn(const tcp_header *tcphdr)
             continue;
         }
 
+        if (end - options < 2 || options[1] < 2 || options[1] > end - options)
+            return false;
+
         uint8_t length = *(options + 1);
 
         switch (opt_byte)
@@ -414,10 +762,11 @@ bool tcp_connection_req::parse_syn(const tcp_header *tcphdr)
                 mss = ntohs(mss);
                 break;
             case TCP_OPTION_WINDOW_SCALE:
-
-                uint8_t wss = *(options + 2);
-                window_shift = wss;
-                window_size = window_size << window_shift;
+                window_shift = cul::min(*(options + 2), (uint8_t) TCP_MAX_WINDOW_SHIFT);
+                wscale_ok = true;
+                break;
+            case TCP_OPTION_SACK_PERMITTED:
+                sack_ok = true;
                 break;
         }
 
@@ -443,21 +792,41 @@ int tcp_connection_req::send_synack()
 
     buf->reserve_headers(MAX_TCP_HEADER_LENGTH);
     size_t header_len = sizeof(tcp_header);
-    // Push any options we need to send
-    uint8_t *mss_option = (uint8_t *) buf->push_header(4);
-    header_len += 4;
+    // Push any options we need to send. Window scale and SACK only go out if the SYN had them.
+    size_t options_len = 4 + (wscale_ok ? 4 : 0) + (sack_ok ? 4 : 0);
+    uint8_t *mss_option = (uint8_t *) buf->push_header(options_len);
+    header_len += options_len;
     mss_option[0] = TCP_OPTION_MSS;
     mss_option[1] = 4;
     auto inet_hdr_len = domain == AF_INET ? sizeof(ip_header) : sizeof(ip6hdr);
     uint16_t our_mss = htons(route.nif->mtu - sizeof(tcp_header) - inet_hdr_len);
     memcpy(&mss_option[2], &our_mss, sizeof(our_mss));
 
+    uint8_t *opt = mss_option + 4;
+
+    if (wscale_ok)
+    {
+        opt[0] = TCP_OPTION_NOP;
+        opt[1] = TCP_OPTION_WINDOW_SCALE;
+        opt[2] = 3;
+        opt[3] = rcv_window_shift;
+        opt += 4;
+    }
+
+    if (sack_ok)
+    {
+        opt[0] = TCP_OPTION_NOP;
+        opt[1] = TCP_OPTION_NOP;
+        opt[2] = TCP_OPTION_SACK_PERMITTED;
+        opt[3] = 2;
+    }
+
     auto tph = (tcp_header *) buf->push_header(sizeof(tcp_header));
     tph->ack_number = htonl(ack_number);
     tph->source_port = from.port;
     tph->dest_port = to.port;
     tph->urgent_pointer = 0;
-    tph->window_size = UINT16_MAX;
+    tph->window_size = htons(cul::min(rcv_window, (uint32_t) UINT16_MAX));
     tph->sequence_number = htonl(seq_number);
     tph->checksum = 0;
     tph->data_offset_and_flags = htons(
@@ -525,6 +894,9 @@ int tcp_socket::incoming_syn(const packet_handling_data &data)
     if (!req->parse_syn(tcphdr))
         return 0;
 
+    req->rcv_window = tcp_max_window(rx_max_buf, req->wscale_ok);
+    req->rcv_window_shift = req->wscale_ok ? tcp_window_shift(req->rcv_window) : 0;
+
     // Get a random starting sequence number
     req->seq_number = arc4random();
 
@@ -563,10 +935,15 @@ int tcp_socket::make_connection_from(const tcp_connection_req *req)
 
     seq_number = req->seq_number;
     ack_number = req->ack_number;
-    last_ack_number = ack_number - 1;
+    /* Our SYN-ACK was just acked */
+    last_ack_number = seq_number;
     mss = req->mss;
     window_size = req->window_size;
-    window_size_shift = req->window_size;
+    /* Window scaling is only on if both sides sent the option (RFC 7323, section 1.3) */
+    window_size_shift = req->wscale_ok ? req->window_shift : 0;
+    our_window_size = req->rcv_window;
+    our_window_shift = req->rcv_window_shift;
+    sack_ok = req->sack_ok;
     route_cache = req->route;
     route_cache_valid = 1;
 
@@ -593,6 +970,8 @@ int tcp_socket::make_connection_from(const tcp_connection_req *req)
         list_add_tail(&pbf->list_node, &rx_packet_list);
     }
 
+    tcp_cong_start(cong, mss, req->syn_ack_pending->transmission_try != 0);
+
     state = tcp_state::TCP_STATE_ESTABLISHED;
 
     connected = true;
@@ -634,6 +1013,18 @@ int tcp_socket::accept_connection(tcp_connection_req *req, const packet_handling
     sock->proto = proto;
     sock->type = type;
 
+    if (!sock->cc)
+        return -ENOBUFS;
+
+    /* Accepted sockets inherit the listener's congestion control */
+    if (cc && strcmp(cc->name(), sock->cc->name()))
+    {
+        if (int st = sock->set_congestion_control(cc->name()); st < 0)
+            return st;
+    }
+
+    sock->rx_max_buf = rx_max_buf;
+
     if (int st = sock->make_connection_from(req); st < 0)
         return st;
 
@@ -737,50 +1128,87 @@ int tcp_socket::do_established_rcv(const packet_handling_data &data)
         return 0;
     }
 
-    /* ack_number holds the other side of the connection's sequence number */
     auto starting_seq_number = ntohl(data.header->sequence_number);
     auto data_off = TCP_GET_DATA_OFF(ntohs(data.header->data_offset_and_flags));
     uint16_t data_size = data.tcp_segment_size - tcp_header_data_off_to_length(data_off);
-    uint32_t seqs = data_size;
-    if (flags & TCP_FLAG_FIN)
-        seqs++;
-
-    ack_number = starting_seq_number + seqs;
 
-    // Send a reset if we got data and we're not queueing data anymore
-    if (shutdown_state & SHUTDOWN_RD && data_size != 0)
+    // Send a reset if we got new data and we're not queueing data anymore
+    if (shutdown_state & SHUTDOWN_RD && data_size != 0 &&
+        tcp_seq_after(starting_seq_number + data_size, ack_number))
     {
         reset();
         send_reset();
         return 0;
     }
 
-    if (flags & TCP_FLAG_FIN)
+    // Every segment carries an ACK
+    do_ack(data.buffer);
+
+    if (data_size || flags & TCP_FLAG_FIN)
+        receive_data(data.buffer, starting_seq_number, flags & TCP_FLAG_FIN);
+
+    return 0;
+}
+
+/**
+ * @brief Queue received data, dealing with segments that arrive out of order
+ *
+ * @param buf Segment, with data pointing to its payload
+ * @param seq Sequence number of the segment
+ * @param fin True if the segment has FIN set
+ */
+void tcp_socket::receive_data(packetbuf *buf, uint32_t seq, bool fin)
+{
+    /* ack_number holds the next sequence number we expect from the other side */
+    uint32_t end = seq + buf->length();
+
+    /* Nothing new (a retransmission, or a window probe), or past our window */
+    if (tcp_seq_before(end, ack_number) || (end == ack_number && !fin) ||
+        !tcp_seq_before(seq, ack_number + our_window_size))
     {
-        handle_fin(data.buffer);
-        return 0;
+        send_ack();
+        return;
     }
 
-    if (data_size || flags & TCP_FLAG_FIN)
+    if (tcp_seq_after(seq, ack_number))
     {
-        // If this wasn't a FIN packet, it has data
-        // so append it to the receive buffers
-        if (!(flags & TCP_FLAG_FIN))
-        {
-            auto buf = data.buffer;
-            append_inet_rx_pbuf(buf);
-        }
+        /* There's a hole before this one. Hold on to it and send a duplicate ACK right away, so
+         * the other side finds out (RFC 5681, section 4.2). */
+        if (ooo_queue.bytes() + buf->length() <= rx_max_buf)
+            ooo_queue.insert(buf, seq, fin);
 
-        // Now ack it
         send_ack();
+        return;
+    }
+
+    /* In order, though it may start with data we already have */
+    buf->data += ack_number - seq;
+    if (buf->length())
+        append_inet_rx_pbuf(buf);
+
+    ack_number = end;
+
+    /* This may have filled a hole, so see what else we can deliver. Nothing comes after a FIN. */
+    if (!fin)
+    {
+        while (packetbuf *next = ooo_queue.pop(ack_number))
+        {
+            ack_number += next->length();
+            append_inet_rx_pbuf(next);
+            next->unref();
+        }
     }
-    else if (data_size == 0 && (flags & 0xff) == TCP_FLAG_ACK)
+
+    if (fin || ooo_queue.pop_fin(ack_number))
     {
-        // Process the ACK
-        do_ack(data.buffer);
+        /* The FIN takes up a sequence number */
+        ack_number++;
+        ooo_queue.clear();
+        handle_fin(buf);
+        return;
     }
 
-    return 0;
+    send_ack();
 }
 
 /**
@@ -883,7 +1311,8 @@ int tcp_socket::handle_packet(const tcp_socket::packet_handling_data &data)
 
     auto flags = htons(data.header->data_offset_and_flags);
 
-    window_size = ntohs(data.header->window_size) << window_size_shift;
+    if (!(flags & TCP_FLAG_SYN))
+        window_size = ntohs(data.header->window_size) << window_size_shift;
 
     if (flags & TCP_FLAG_RST)
     {
@@ -1134,8 +1563,7 @@ ref_guard<packetbuf> tcp_packet::result()
 
     auto data_off = TCP_MAKE_DATA_OFF(tcp_header_length_to_data_off(header_size));
 
-    /* Assume the max window size as the window size, for now */
-    header->window_size = htons(socket->our_window_size);
+    header->window_size = htons(socket->advertised_window(flags & TCP_FLAG_SYN));
     header->source_port = socket->saddr().port;
     header->sequence_number = htonl(socket->sequence_nr());
     header->data_offset_and_flags = htons(data_off | flags);
@@ -1203,19 +1631,16 @@ bool tcp_socket::parse_options(tcp_header *packet)
     auto flags = ntohs(packet->data_offset_and_flags);
 
     bool syn_set = flags & TCP_FLAG_SYN;
-    (void) syn_set;
+    bool got_wscale = false;
 
     uint16_t data_off = flags >> TCP_DATA_OFFSET_SHIFT;
 
-    if (data_off == tcp_header_length_to_data_off(min_header_size))
-        return true;
-
     auto data_off_bytes = tcp_header_data_off_to_length(data_off);
 
     uint8_t *options = reinterpret_cast<uint8_t *>(packet + 1);
     uint8_t *end = options + (data_off_bytes - min_header_size);
 
-    while (options != end)
+    while (options < end)
     {
         uint8_t opt_byte = *options;
 
@@ -1232,6 +1657,9 @@ bool tcp_socket::parse_options(tcp_header *packet)
             continue;
         }
 
+        if (end - options < 2 || options[1] < 2 || options[1] > end - options)
+            return false;
+
         uint8_t length = *(options + 1);
 
         switch (opt_byte)
@@ -1247,14 +1675,28 @@ bool tcp_socket::parse_options(tcp_header *packet)
                 if (!syn_set)
                     return false;
 
-                uint8_t wss = *(options + 2);
-                window_size_shift = wss;
+                window_size_shift = cul::min(*(options + 2), (uint8_t) TCP_MAX_WINDOW_SHIFT);
+                got_wscale = true;
+                break;
+            case TCP_OPTION_SACK_PERMITTED:
+                if (!syn_set)
+                    return false;
+
+                sack_ok = true;
                 break;
         }
 
         options += length;
     }
 
+    /* Window scaling is only on if both sides sent the option (RFC 7323, section 1.3) */
+    if (!got_wscale)
+    {
+        window_size_shift = 0;
+        our_window_shift = 0;
+        our_window_size = tcp_max_window(our_window_size, false);
+    }
+
     return true;
 }
 
@@ -1281,14 +1723,22 @@ void tcp_out_timeout(clockevent *ev)
         return;
     }
 
-    t->transmission_try++;
     tcp_socket *sock = t->sock;
 
-    iflow flow{sock->route_cache, IPPROTO_TCP, sock->effective_domain() == AF_INET6};
+    scoped_lock g{sock->pending_out_lock};
 
-    // Since the packet has already been pre-prepared by the network stack
-    // we can just send it straight through the network interface
-    int st = netif_send_packet(flow.nif, t->buf.get());
+    if (!sock->should_retransmit(t))
+    {
+        ev->deadline = clocksource_get_time() + sock->current_rto();
+        return;
+    }
+
+    t->transmission_try++;
+
+    hrtime_t next_timeout = sock->retransmit_timeout(t);
+    int st = sock->retransmit(t);
+
+    g.unlock();
 
     if (st < 0)
     {
@@ -1298,18 +1748,12 @@ void tcp_out_timeout(clockevent *ev)
         ev->flags &= ~CLOCKEVENT_FLAG_PULSE;
         if (t->fail)
             t->fail(t);
-        scoped_lock g{t->sock->pending_out_lock};
+        scoped_lock g2{t->sock->pending_out_lock};
         list_remove(&t->node);
         return;
     }
 
-    hrtime_t next_timeout = 200;
-    for (unsigned int i = 0; i < t->transmission_try; i++)
-    {
-        next_timeout *= 2;
-    }
-
-    ev->deadline = clocksource_get_time() + next_timeout * NS_PER_MS;
+    ev->deadline = clocksource_get_time() + next_timeout;
 }
 
 /**
@@ -1388,9 +1832,10 @@ expected<ref_guard<tcp_pending_out>, int> tcp_socket::sendpbuf(ref_guard<packetb
         }
 
         pending->buf = buf;
-        pending->timer.deadline = clocksource_get_time() + 200 * NS_PER_MS;
+        pending->sent_at = clocksource_get_time();
+        pending->timer.deadline = pending->sent_at + tcp_rto(cong, cong.backoff);
         pending->timer.priv = pending.get();
-        pending->timer.flags = CLOCKEVENT_FLAG_PULSE;
+        pending->timer.flags = CLOCKEVENT_FLAG_PULSE | CLOCKEVENT_FLAG_COARSE;
         pending->timer.callback = tcp_out_timeout;
         append_pending_out(pending.get());
     }
@@ -1436,7 +1881,7 @@ int tcp_connection_req::sendpbuf(ref_guard<packetbuf> buf, bool noack)
         pending->buf = buf;
         pending->timer.deadline = clocksource_get_time() + 200 * NS_PER_MS;
         pending->timer.priv = pending.get();
-        pending->timer.flags = CLOCKEVENT_FLAG_PULSE;
+        pending->timer.flags = CLOCKEVENT_FLAG_PULSE | CLOCKEVENT_FLAG_COARSE;
         pending->timer.callback = tcp_out_synack_timeout;
         syn_ack_pending = pending;
     }
@@ -1471,14 +1916,19 @@ void tcp_socket::conn_fail(int error)
 
 int tcp_socket::start_handshake(netif *nif, int flags)
 {
+    tcp_option opt{TCP_OPTION_MSS, 4};
+    tcp_option wscale_opt{TCP_OPTION_WINDOW_SCALE, 3};
+    tcp_option sack_opt{TCP_OPTION_SACK_PERMITTED, 2};
     tcp_packet first_packet{{}, this, TCP_FLAG_SYN, src_addr};
     first_packet.set_packet_flags(TCP_PACKET_FLAG_ON_STACK | TCP_PACKET_FLAG_WANTS_ACK_HEADER);
 
-    tcp_option opt{TCP_OPTION_MSS, 4};
-
     uint16_t our_mss = nif->mtu - tcp_headers_overhead - get_headers_len();
     opt.data.mss = htons(our_mss);
+    wscale_opt.data.window_scale_shift = our_window_shift;
 
+    // Options get prepended, so this ends up as MSS, window scale, SACK permitted
+    first_packet.append_option(&sack_opt);
+    first_packet.append_option(&wscale_opt);
     first_packet.append_option(&opt);
 
     auto buf = first_packet.result();
@@ -1541,7 +1991,11 @@ void tcp_socket::finish_conn()
 
 int tcp_socket::start_connection(int flags)
 {
+    if (!cc)
+        return -ENOBUFS;
+
     seq_number = arc4random();
+    last_ack_number = seq_number;
 
     auto fam = get_proto_fam();
 
@@ -1561,7 +2015,10 @@ int tcp_socket::start_connection(int flags)
 
     route_cache_valid = 1;
 
-    our_window_size = UINT16_MAX;
+    /* Advertise the whole receive buffer, scaled down to fit in the header. If the other side
+     * doesn't do window scaling, this gets cut down to 64KiB when we get the SYN-ACK. */
+    our_window_size = tcp_max_window(rx_max_buf, true);
+    our_window_shift = tcp_window_shift(our_window_size);
 
     int st = start_handshake(route_cache.nif, flags);
     if (st < 0)
@@ -1607,6 +2064,36 @@ ssize_t tcp_socket::queue_data(iovec *vec, int vlen, size_t len)
     return pending_out.append_data(vec, vlen, 0, mss);
 }
 
+/**
+ * @brief Queue data for a MSG_ZEROCOPY send
+ * If the device can't use the user's pages, the data gets copied and the send completes right
+ * away, with SO_EE_CODE_ZEROCOPY_COPIED.
+ *
+ * @param vec Iovecs
+ * @param vlen Number of iovecs
+ * @return 0 on success, negative error codes
+ */
+ssize_t tcp_socket::queue_data_zerocopy(iovec *vec, int vlen)
+{
+    auto notif = zerocopy_start();
+    if (!notif)
+        return -ENOBUFS;
+
+    ssize_t st;
+
+    if (can_send_pages())
+        st = pending_out.append_user_pages(vec, vlen, 0, mss, notif);
+    else
+    {
+        notif->set_copied();
+        st = queue_data(vec, vlen, 0);
+    }
+
+    zerocopy_end(notif, st == 0);
+
+    return st;
+}
+
 ssize_t tcp_socket::get_max_payload_len(uint16_t tcp_header_len)
 {
     return 0;
@@ -1639,7 +2126,7 @@ int tcp_socket::send_segment(packetbuf *buf)
         // so just try to re-trigger sendpbuf
 
         // Horrible logic, should be separated into another function
-        auto segment_len = buf->tail - (buf->transport_header + sizeof(tcp_header));
+        auto segment_len = buf->length() - (buf->transport_header_off() + sizeof(tcp_header));
         auto ex = sendpbuf(ref_guard<packetbuf>{buf});
 
         if (ex.has_error())
@@ -1661,8 +2148,7 @@ int tcp_socket::send_segment(packetbuf *buf)
 
     auto data_off = TCP_MAKE_DATA_OFF(tcp_header_length_to_data_off(sizeof(tcp_header)));
 
-    /* Assume the max window size as the window size, for now */
-    header->window_size = htons(our_window_size);
+    header->window_size = htons(advertised_window(false));
     header->source_port = saddr().port;
     header->sequence_number = htonl(sequence_nr());
     header->data_offset_and_flags = htons(data_off | flags);
@@ -1728,6 +2214,12 @@ int tcp_socket::try_to_send()
             break;
         }
 
+        // Same for the congestion window
+        if (!cong_can_send(pbf->length()))
+        {
+            break;
+        }
+
         // If we're on nagle and nagle doesn't allow us to send, stop sending
         if (nagle_enabled && !nagle_can_send(pbf))
         {
@@ -1768,7 +2260,13 @@ ssize_t tcp_socket::sendmsg(const msghdr *msg, int flags)
     if (len < 0)
         return len;
 
-    auto st = queue_data(msg->msg_iov, msg->msg_iovlen, (size_t) len);
+    ssize_t st;
+
+    if (flags & MSG_ZEROCOPY && zerocopy)
+        st = queue_data_zerocopy(msg->msg_iov, msg->msg_iovlen);
+    else
+        st = queue_data(msg->msg_iov, msg->msg_iovlen, (size_t) len);
+
     if (st < 0)
     {
         return st;
@@ -1782,6 +2280,31 @@ ssize_t tcp_socket::sendmsg(const msghdr *msg, int flags)
     return len;
 }
 
+ssize_t tcp_socket::sendpage(struct page *page, unsigned int off, unsigned int len, int flags)
+{
+    scoped_hybrid_lock g{socket_lock, this};
+
+    if (!can_send())
+        return -ENOTCONN;
+
+    CONSUME_SOCK_ERR;
+
+    if (!can_send_pages())
+    {
+        g.unlock();
+        return socket::sendpage(page, off, len, flags);
+    }
+
+    /* The page is referenced until the data is acked */
+    if (int st = pending_out.append_page(page, off, len, 0, mss, nullptr); st < 0)
+        return st;
+
+    if (int st = try_to_send(); st < 0)
+        return st;
+
+    return len;
+}
+
 void tcp_socket::append_pending_out(tcp_pending_out *pckt)
 {
     list_add_tail(&pckt->node, &pending_out_packets);
@@ -1798,11 +2321,154 @@ void tcp_socket::remove_pending_out(tcp_pending_out *pkt)
     pkt->unref();
 }
 
+/**
+ * @brief Switch to another congestion control algorithm
+ *
+ * @param name Name of the algorithm
+ * @return 0 on success, negative error codes
+ */
+int tcp_socket::set_congestion_control(const char *name)
+{
+    if (!tcp_cong_exists(name))
+        return -ENOENT;
+
+    tcp_congestion_ops *new_cc = tcp_cong_create(name);
+    if (!new_cc)
+        return -ENOMEM;
+
+    /* Timers use the algorithm without the socket lock, so swap it under pending_out_lock */
+    scoped_lock g{pending_out_lock};
+    tcp_congestion_ops *old = cc.release();
+    cc.reset(new_cc);
+    g.unlock();
+
+    delete old;
+
+    return 0;
+}
+
+int tcp_socket::setsockopt_tcp(int opt, const void *optval, socklen_t optlen)
+{
+    switch (opt)
+    {
+        case TCP_CONGESTION: {
+            char name[TCP_CA_NAME_MAX];
+            size_t len = cul::min((size_t) optlen, sizeof(name) - 1);
+
+            memcpy(name, optval, len);
+            name[len] = '\0';
+
+            return set_congestion_control(name);
+        }
+    }
+
+    return -ENOPROTOOPT;
+}
+
+/**
+ * @brief tcp_state to TCP_INFO state table
+ *
+ */
+static const uint8_t tcp_info_states[] = {
+    [(int) tcp_state::TCP_STATE_LISTEN] = TCP_LISTEN,
+    [(int) tcp_state::TCP_STATE_SYN_SENT] = TCP_SYN_SENT,
+    [(int) tcp_state::TCP_STATE_SYN_RECEIVED] = TCP_SYN_RECV,
+    [(int) tcp_state::TCP_STATE_ESTABLISHED] = TCP_ESTABLISHED,
+    [(int) tcp_state::TCP_STATE_FIN_WAIT_1] = TCP_FIN_WAIT1,
+    [(int) tcp_state::TCP_STATE_FIN_WAIT_2] = TCP_FIN_WAIT2,
+    [(int) tcp_state::TCP_STATE_CLOSE_WAIT] = TCP_CLOSE_WAIT,
+    [(int) tcp_state::TCP_STATE_CLOSING] = TCP_CLOSING,
+    [(int) tcp_state::TCP_STATE_LAST_ACK] = TCP_LAST_ACK,
+    [(int) tcp_state::TCP_STATE_TIME_WAIT] = TCP_TIME_WAIT,
+    [(int) tcp_state::TCP_STATE_CLOSED] = TCP_CLOSE,
+};
+
+int tcp_socket::getsockopt_tcp(int opt, void *optval, socklen_t *optlen)
+{
+    switch (opt)
+    {
+        case TCP_CONGESTION: {
+            char name[TCP_CA_NAME_MAX] = {};
+
+            if (!cc)
+                return -ENOMEM;
+
+            strncpy(name, cc->name(), sizeof(name) - 1);
+            return put_option(name, optval, optlen);
+        }
+
+        case TCP_INFO: {
+            tcp_info info;
+            memset(&info, 0, sizeof(info));
+
+            scoped_lock g{pending_out_lock};
+
+            info.tcpi_state = tcp_info_states[(int) state];
+
+            switch (cong.ca_state)
+            {
+                case tcp_ca_state::TCP_CA_RECOVERY:
+                    info.tcpi_ca_state = TCP_CA_Recovery;
+                    break;
+                case tcp_ca_state::TCP_CA_LOSS:
+                    info.tcpi_ca_state = TCP_CA_Loss;
+                    break;
+                default:
+                    info.tcpi_ca_state = cong.dupacks ? TCP_CA_Disorder : TCP_CA_Open;
+                    break;
+            }
+
+            info.tcpi_retransmits = cong.backoff;
+            info.tcpi_backoff = cong.backoff;
+            info.tcpi_snd_wscale = window_size_shift;
+            info.tcpi_rcv_wscale = our_window_shift;
+            if (window_size_shift || our_window_shift)
+                info.tcpi_options |= TCPI_OPT_WSCALE;
+            if (sack_ok)
+                info.tcpi_options |= TCPI_OPT_SACK;
+
+            info.tcpi_rto = cong.rto / NS_PER_US;
+            info.tcpi_rtt = cong.srtt / NS_PER_US;
+            info.tcpi_rttvar = cong.rttvar / NS_PER_US;
+            info.tcpi_snd_mss = mss;
+            info.tcpi_rcv_mss = mss;
+            info.tcpi_advmss = mss;
+
+            /* Windows are reported in segments */
+            info.tcpi_snd_cwnd = cong.cwnd / mss;
+            info.tcpi_snd_ssthresh = cong.ssthresh == TCP_INFINITE_SSTHRESH
+                                         ? TCP_INFINITE_SSTHRESH
+                                         : cong.ssthresh / mss;
+
+            list_for_every (&pending_out_packets)
+            {
+                auto pkt = list_head_cpp<tcp_pending_out>::self_from_list_head(l);
+                info.tcpi_unacked++;
+                if (pkt->sacked)
+                    info.tcpi_sacked++;
+            }
+
+            info.tcpi_rcv_space = our_window_size;
+
+            info.tcpi_total_retrans = cong.total_retrans;
+
+            g.unlock();
+
+            return put_option(info, optval, optlen);
+        }
+    }
+
+    return -ENOPROTOOPT;
+}
+
 int tcp_socket::setsockopt(int level, int opt, const void *optval, socklen_t optlen)
 {
     if (level == SOL_SOCKET)
         return setsockopt_socket_level(opt, optval, optlen);
 
+    if (level == SOL_TCP)
+        return setsockopt_tcp(opt, optval, optlen);
+
     if (is_inet_level(level))
         return setsockopt_inet(level, opt, optval, optlen);
 
@@ -1813,6 +2479,10 @@ int tcp_socket::getsockopt(int level, int opt, void *optval, socklen_t *optlen)
 {
     if (level == SOL_SOCKET)
         return getsockopt_socket_level(opt, optval, optlen);
+
+    if (level == SOL_TCP)
+        return getsockopt_tcp(opt, optval, optlen);
+
     return -ENOPROTOOPT;
 }
 
@@ -1940,8 +2610,7 @@ int tcp_socket::send_fin()
 
     auto data_off = TCP_MAKE_DATA_OFF(tcp_header_length_to_data_off(sizeof(tcp_header)));
 
-    /* Assume the max window size as the window size, for now */
-    tph->window_size = htons(our_window_size);
+    tph->window_size = htons(advertised_window(false));
     tph->source_port = saddr().port;
     tph->sequence_number = htonl(sequence_nr());
     tph->data_offset_and_flags = htons(data_off | flags);
@@ -2035,20 +2704,6 @@ ssize_t tcp_socket::recvmsg(msghdr *msg, int flags)
         ip::copy_msgname_to_user(msg, buf, domain == AF_INET6, hdr->source_port);
     }
 
-    auto tph = (tcp_header *) buf->transport_header;
-
-    if (ntohs(tph->data_offset_and_flags) & TCP_FLAG_FIN)
-    {
-        // FIN packet! Let's return EOF and, if !MSG_PEEK, discard it.
-        if (!(flags & MSG_PEEK))
-        {
-            list_remove(&buf->list_node);
-            buf->unref();
-        }
-
-        return 0;
-    }
-
     for (int i = 0; i < msg->msg_iovlen; i++)
     {
         auto iov = msg->msg_iov[i];
@@ -2102,14 +2757,9 @@ short tcp_socket::poll(void *poll_file, short events)
     {
         if (events & POLLIN)
         {
+            poll_wait_helper(poll_file, &accept_wq);
             if (accept_queue_len != 0)
-            {
                 avail_events |= POLLIN;
-            }
-            else
-            {
-                poll_wait_helper(poll_file, &accept_wq);
-            }
         }
 
         return avail_events & events;
@@ -2120,9 +2770,8 @@ short tcp_socket::poll(void *poll_file, short events)
         avail_events &= ~POLLOUT;
         if (events & POLLOUT)
         {
-            if (connection_pending)
-                poll_wait_helper(poll_file, &conn_wq);
-            else
+            poll_wait_helper(poll_file, &conn_wq);
+            if (!connection_pending)
                 avail_events |= POLLOUT;
         }
 
@@ -2137,10 +2786,9 @@ short tcp_socket::poll(void *poll_file, short events)
 
     if (events & POLLIN)
     {
+        poll_wait_helper(poll_file, &rx_wq);
         if (has_data_available() || shutdown_state & SHUTDOWN_RD)
             avail_events |= POLLIN;
-        else
-            poll_wait_helper(poll_file, &rx_wq);
     }
 
     // printk("avail events: %u\n", avail_events);
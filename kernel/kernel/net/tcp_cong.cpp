@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <string.h>
+
+#include <onyx/net/tcp_cong.h>
+#include <onyx/utility.hpp>
+
+void tcp_cong_init(tcp_cong_state &st)
+{
+    memset(&st, 0, sizeof(st));
+    st.ssthresh = TCP_INFINITE_SSTHRESH;
+    st.rto = TCP_RTO_INITIAL;
+    st.ca_state = tcp_ca_state::TCP_CA_OPEN;
+}
+
+void tcp_cong_start(tcp_cong_state &st, uint32_t mss, bool syn_lost)
+{
+    st.mss = mss;
+    /* RFC 5681, section 3.1: if the SYN got lost, the initial window is a single segment */
+    st.cwnd = (syn_lost ? 1 : TCP_INIT_CWND) * mss;
+    st.ssthresh = TCP_INFINITE_SSTHRESH;
+    st.ca_state = tcp_ca_state::TCP_CA_OPEN;
+    st.dupacks = 0;
+}
+
+void tcp_rtt_sample(tcp_cong_state &st, hrtime_t rtt)
+{
+    if (!rtt)
+        rtt = 1;
+
+    if (!st.srtt)
+    {
+        st.srtt = rtt;
+        st.rttvar = rtt / 2;
+    }
+    else
+    {
+        hrtime_t err = st.srtt > rtt ? st.srtt - rtt : rtt - st.srtt;
+        st.rttvar = (3 * st.rttvar + err) / 4;
+        st.srtt = (7 * st.srtt + rtt) / 8;
+    }
+
+    hrtime_t rto = st.srtt + 4 * st.rttvar;
+
+    if (rto < TCP_RTO_MIN)
+        rto = TCP_RTO_MIN;
+    else if (rto > TCP_RTO_MAX)
+        rto = TCP_RTO_MAX;
+
+    st.rto = rto;
+}
+
+hrtime_t tcp_rto(const tcp_cong_state &st, unsigned int tries)
+{
+    hrtime_t rto = st.rto;
+
+    while (tries-- && rto < TCP_RTO_MAX)
+        rto *= 2;
+
+    return cul::min(rto, (hrtime_t) TCP_RTO_MAX);
+}
+
+uint32_t tcp_slow_start(tcp_cong_state &st, uint32_t acked)
+{
+    if (st.cwnd >= st.ssthresh)
+        return acked;
+
+    /* Appropriate byte counting (RFC 3465), with L = 2 * SMSS */
+    uint32_t inc = cul::min(acked, 2 * st.mss);
+    if (inc > st.ssthresh - st.cwnd)
+        inc = st.ssthresh - st.cwnd;
+
+    st.cwnd += inc;
+
+    return st.cwnd >= st.ssthresh ? acked - inc : 0;
+}
+
+/**
+ * NewReno (RFC 5681 and RFC 6582). The recovery part lives in the TCP core, here we only do
+ * congestion avoidance: one segment per window's worth of acked bytes, and halve on loss.
+ */
+class tcp_newreno : public tcp_congestion_ops
+{
+private:
+    uint32_t ack_bytes{};
+
+public:
+    const char *name() const override
+    {
+        return "newreno";
+    }
+
+    void cong_avoid(tcp_cong_state &st, uint32_t acked) override
+    {
+        acked = tcp_slow_start(st, acked);
+        if (!acked)
+            return;
+
+        ack_bytes += acked;
+
+        if (ack_bytes >= st.cwnd)
+        {
+            ack_bytes -= st.cwnd;
+            st.cwnd += st.mss;
+        }
+    }
+
+    uint32_t ssthresh(tcp_cong_state &st) override
+    {
+        ack_bytes = 0;
+        return cul::max(st.cwnd / 2, 2 * st.mss);
+    }
+};
+
+/**
+ * CUBIC (RFC 8312). After a loss, the window follows W(t) = C * (t - K)^3 + W_max, which
+ * plateaus around the window where we last saw a loss and probes past it afterwards. We do the
+ * maths with windows in segments and times in ms.
+ */
+
+/* beta_cubic = 0.7 */
+#define CUBIC_BETA_NUM 7
+#define CUBIC_BETA_DEN 10
+/* C = 0.4; with t in ms, C * t^3 = 4 * t^3 / 10^10 */
+#define CUBIC_C_NUM 4
+#define CUBIC_C_DEN 10000000000ULL
+/* K = cbrt(delta / C) s = cbrt(delta * 2.5 * 10^9) ms */
+#define CUBIC_K_FACTOR 2500000000ULL
+
+/* Clamps that keep the 64-bit maths from overflowing */
+#define CUBIC_MAX_DELTA (1U << 20)
+#define CUBIC_MAX_OFFS  (1ULL << 20)
+
+/**
+ * @brief Integer cube root
+ *
+ * @param x Number, must be under 2^54
+ * @return floor(cbrt(x))
+ */
+static uint64_t cubic_root(uint64_t x)
+{
+    uint64_t y = 0;
+
+    for (int s = 51; s >= 0; s -= 3)
+    {
+        y *= 2;
+        uint64_t b = 3 * y * (y + 1) + 1;
+        if ((x >> s) >= b)
+        {
+            x -= b << s;
+            y++;
+        }
+    }
+
+    return y;
+}
+
+class tcp_cubic : public tcp_congestion_ops
+{
+private:
+    uint32_t w_max{};
+    uint32_t w_last_max{};
+    /* Plateau of the current curve */
+    uint32_t origin{};
+    /* Time it takes for the curve to get to the plateau */
+    uint64_t k{};
+    /* Start of the current congestion avoidance epoch, 0 if none */
+    hrtime_t epoch_start{};
+    uint64_t ack_bytes{};
+
+    /**
+     * @brief Get the number of segments that need to be acked to grow cwnd by a segment
+     *
+     * @param st Congestion state
+     * @return Number of segments
+     */
+    uint64_t growth_rate(const tcp_cong_state &st);
+
+public:
+    const char *name() const override
+    {
+        return "cubic";
+    }
+
+    void cong_avoid(tcp_cong_state &st, uint32_t acked) override;
+    uint32_t ssthresh(tcp_cong_state &st) override;
+};
+
+uint64_t tcp_cubic::growth_rate(const tcp_cong_state &st)
+{
+    uint64_t cwnd = st.cwnd / st.mss;
+    hrtime_t now = clocksource_get_time();
+
+    if (!epoch_start)
+    {
+        epoch_start = now;
+        ack_bytes = 0;
+
+        if (cwnd < w_max)
+        {
+            k = cubic_root(cul::min(w_max - (uint32_t) cwnd, CUBIC_MAX_DELTA) * CUBIC_K_FACTOR);
+            origin = w_max;
+        }
+        else
+        {
+            k = 0;
+            origin = cwnd;
+        }
+    }
+
+    uint64_t rtt = cul::max(st.srtt / NS_PER_MS, (hrtime_t) 1);
+    uint64_t t = (now - epoch_start) / NS_PER_MS;
+
+    /* Aim for where the curve will be in an RTT */
+    uint64_t tt = t + rtt;
+    uint64_t offs = cul::min(tt < k ? k - tt : tt - k, (uint64_t) CUBIC_MAX_OFFS);
+    uint64_t delta = CUBIC_C_NUM * offs * offs * offs / CUBIC_C_DEN;
+    uint64_t target;
+
+    if (tt < k)
+        target = origin > delta ? origin - delta : 0;
+    else
+        target = origin + delta;
+
+    uint64_t cnt = target > cwnd ? cwnd / (target - cwnd) : 100 * cwnd;
+
+    /* Don't be slower than Reno would be: W_est = W_max * beta + 3 * (1 - beta) / (1 + beta) *
+     * t / RTT (RFC 8312, section 4.2) */
+    uint64_t w_est = (uint64_t) w_max * CUBIC_BETA_NUM / CUBIC_BETA_DEN + 9 * t / (17 * rtt);
+
+    if (w_est > cwnd)
+        cnt = cul::min(cnt, cwnd / (w_est - cwnd));
+
+    /* And never grow by more than half a window per RTT */
+    return cul::max(cnt, (uint64_t) 2);
+}
+
+void tcp_cubic::cong_avoid(tcp_cong_state &st, uint32_t acked)
+{
+    acked = tcp_slow_start(st, acked);
+    if (!acked)
+        return;
+
+    uint64_t thresh = growth_rate(st) * st.mss;
+
+    ack_bytes += acked;
+
+    while (ack_bytes >= thresh)
+    {
+        ack_bytes -= thresh;
+        st.cwnd += st.mss;
+    }
+}
+
+uint32_t tcp_cubic::ssthresh(tcp_cong_state &st)
+{
+    uint32_t cwnd = st.cwnd / st.mss;
+
+    epoch_start = 0;
+
+    /* Fast convergence: if we lost before getting back to the last W_max, another flow is
+     * probably ramping up, so let go of a bit more bandwidth */
+    if (cwnd < w_last_max)
+        w_max = cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) / (2 * CUBIC_BETA_DEN);
+    else
+        w_max = cwnd;
+
+    w_last_max = cwnd;
+
+    uint64_t thresh = (uint64_t) st.cwnd * CUBIC_BETA_NUM / CUBIC_BETA_DEN;
+
+    return cul::max((uint32_t) thresh, 2 * st.mss);
+}
+
+struct tcp_cong_algo
+{
+    const char *name;
+    tcp_congestion_ops *(*create)();
+};
+
+template <typename Algo>
+static tcp_congestion_ops *tcp_cong_new()
+{
+    return new Algo;
+}
+
+/* The first one is the default. "reno" is there for software that asks for Linux's name */
+static const tcp_cong_algo tcp_cong_algos[] = {
+    {"cubic", tcp_cong_new<tcp_cubic>},
+    {"newreno", tcp_cong_new<tcp_newreno>},
+    {"reno", tcp_cong_new<tcp_newreno>},
+};
+
+static const tcp_cong_algo *tcp_cong_find(const char *name)
+{
+    for (const auto &algo : tcp_cong_algos)
+    {
+        if (!strcmp(algo.name, name))
+            return &algo;
+    }
+
+    return nullptr;
+}
+
+bool tcp_cong_exists(const char *name)
+{
+    return tcp_cong_find(name) != nullptr;
+}
+
+tcp_congestion_ops *tcp_cong_create(const char *name)
+{
+    const tcp_cong_algo *algo = name ? tcp_cong_find(name) : &tcp_cong_algos[0];
+
+    if (!algo)
+        return nullptr;
+
+    return algo->create();
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <assert.h>
+
+#include <onyx/net/tcp.h>
+#include <onyx/net/tcp_ooo.h>
+#include <onyx/packetbuf.h>
+
+struct tcp_ooo_seg
+{
+    struct bst_node node;
+    /* Sequence space covered by the payload, [seq, end) */
+    uint32_t seq;
+    uint32_t end;
+    packetbuf *buf;
+};
+
+/* Segments that overlap compare as equal, which is what makes tree searches find overlaps */
+static int tcp_ooo_cmp(struct bst_node *lhs_, struct bst_node *rhs_)
+{
+    auto lhs = container_of(lhs_, tcp_ooo_seg, node);
+    auto rhs = container_of(rhs_, tcp_ooo_seg, node);
+
+    if (!tcp_seq_before(rhs->seq, lhs->end))
+        return 1;
+    else if (!tcp_seq_after(rhs->end, lhs->seq))
+        return -1;
+    return 0;
+}
+
+static void tcp_ooo_free(tcp_ooo_seg *seg)
+{
+    seg->buf->unref();
+    delete seg;
+}
+
+bool tcp_ooo_queue::insert(packetbuf *buf, uint32_t seq, bool fin)
+{
+    uint32_t end = seq + buf->length();
+
+    if (fin)
+    {
+        has_fin = true;
+        fin_seq = end;
+    }
+
+    if (seq == end)
+        return true;
+
+    last_seq = seq;
+
+    /* Allocate it first, so we don't trim anything if we can't queue the new data */
+    auto new_seg = new tcp_ooo_seg{};
+    if (!new_seg)
+        return false;
+
+    bst_node_initialize(&new_seg->node);
+    new_seg->seq = seq;
+    new_seg->end = end;
+    new_seg->buf = buf;
+
+    struct bst_node *node = bst_search(&root, &new_seg->node, tcp_ooo_cmp);
+
+    if (node)
+    {
+        /* Find the first segment that overlaps, and go through every one of them. The new
+         * segment's data wins, unless we already have all of it. */
+        struct bst_node *prev;
+        while ((prev = bst_prev(&root, node)) && !tcp_ooo_cmp(prev, &new_seg->node))
+            node = prev;
+
+        while (node && !tcp_ooo_cmp(node, &new_seg->node))
+        {
+            auto seg = container_of(node, tcp_ooo_seg, node);
+            node = bst_next(&root, node);
+
+            if (!tcp_seq_after(seg->seq, seq) && !tcp_seq_before(seg->end, end))
+            {
+                last_seq = seg->seq;
+                delete new_seg;
+                return true;
+            }
+
+            if (!tcp_seq_before(seg->seq, seq) && !tcp_seq_after(seg->end, end))
+            {
+                bst_delete(&root, &seg->node);
+                nr_bytes -= seg->end - seg->seq;
+                tcp_ooo_free(seg);
+            }
+            else if (tcp_seq_before(seg->seq, seq))
+            {
+                /* It overlaps our head, chop off its tail */
+                seg->buf->tail -= seg->end - seq;
+                nr_bytes -= seg->end - seq;
+                seg->end = seq;
+            }
+            else
+            {
+                /* It overlaps our tail, chop off its head. This doesn't change its place in the
+                 * tree. */
+                seg->buf->data += end - seg->seq;
+                nr_bytes -= end - seg->seq;
+                seg->seq = end;
+            }
+        }
+    }
+
+    bool inserted = bst_insert(&root, &new_seg->node, tcp_ooo_cmp);
+    assert(inserted);
+
+    buf->ref();
+    nr_bytes += end - seq;
+
+    return true;
+}
+
+packetbuf *tcp_ooo_queue::pop(uint32_t rcv_nxt)
+{
+    struct bst_node *node;
+
+    while ((node = bst_min(&root, nullptr)))
+    {
+        auto seg = container_of(node, tcp_ooo_seg, node);
+
+        if (tcp_seq_after(seg->seq, rcv_nxt))
+            return nullptr;
+
+        bst_delete(&root, node);
+        nr_bytes -= seg->end - seg->seq;
+
+        if (!tcp_seq_after(seg->end, rcv_nxt))
+        {
+            /* Retransmissions filled the hole past this one */
+            tcp_ooo_free(seg);
+            continue;
+        }
+
+        packetbuf *buf = seg->buf;
+        buf->data += rcv_nxt - seg->seq;
+        delete seg;
+
+        return buf;
+    }
+
+    return nullptr;
+}
+
+bool tcp_ooo_queue::pop_fin(uint32_t rcv_nxt)
+{
+    if (!has_fin || fin_seq != rcv_nxt)
+        return false;
+
+    has_fin = false;
+    return true;
+}
+
+/**
+ * @brief Call cb for every run of contiguous segments in the tree
+ *
+ * @param root Tree
+ * @param cb Callback, which takes a const tcp_sack_block &
+ */
+template <typename Callable>
+static void tcp_ooo_for_each_run(struct bst_root *root, Callable cb)
+{
+    tcp_sack_block run{};
+    bool in_run = false;
+
+    for (struct bst_node *node = bst_min(root, nullptr); node; node = bst_next(root, node))
+    {
+        auto seg = container_of(node, tcp_ooo_seg, node);
+
+        if (in_run && run.end == seg->seq)
+        {
+            run.end = seg->end;
+            continue;
+        }
+
+        if (in_run)
+            cb(run);
+
+        run.start = seg->seq;
+        run.end = seg->end;
+        in_run = true;
+    }
+
+    if (in_run)
+        cb(run);
+}
+
+static bool tcp_sack_block_has(const tcp_sack_block &block, uint32_t seq)
+{
+    return !tcp_seq_before(seq, block.start) && tcp_seq_before(seq, block.end);
+}
+
+unsigned int tcp_ooo_queue::sack_blocks(tcp_sack_block *blocks, unsigned int max)
+{
+    unsigned int nr = 0;
+
+    if (!max)
+        return 0;
+
+    /* RFC 2018, section 4: the first block has to have the segment that triggered the ACK. We
+     * send the rest in order instead of in the order they were last reported. */
+    tcp_ooo_for_each_run(&root, [&](const tcp_sack_block &run) {
+        if (tcp_sack_block_has(run, last_seq))
+            blocks[nr++] = run;
+    });
+
+    tcp_ooo_for_each_run(&root, [&](const tcp_sack_block &run) {
+        if (nr < max && !tcp_sack_block_has(run, last_seq))
+            blocks[nr++] = run;
+    });
+
+    return nr;
+}
+
+void tcp_ooo_queue::clear()
+{
+    tcp_ooo_seg *seg;
+
+    bst_for_every_entry_delete(&root, seg, tcp_ooo_seg, node)
+    {
+        tcp_ooo_free(seg);
+    }
+
+    nr_bytes = 0;
+    has_fin = false;
+}
@@ -23,6 +23,7 @@
 #include <onyx/net/netif.h>
 #include <onyx/net/socket_table.h>
 #include <onyx/net/udp.h>
+#include <onyx/net/zerocopy.h>
 #include <onyx/packetbuf.h>
 #include <onyx/poll.h>
 #include <onyx/scoped_lock.h>
@@ -156,15 +157,17 @@ int udp_socket::connect(sockaddr *addr, socklen_t len, int flags)
         return route_result.error();
     }
 
-    route_cache = route_result.value();
-
-    if (route_cache.flags & (INET4_ROUTE_FLAG_BROADCAST | INET4_ROUTE_FLAG_MULTICAST) &&
+    if (route_result.value().flags & (INET4_ROUTE_FLAG_BROADCAST | INET4_ROUTE_FLAG_MULTICAST) &&
         !broadcast_allowed)
     {
         return -EACCES;
     }
 
-    route_cache_valid = 1;
+    {
+        scoped_hybrid_lock g{socket_lock, this};
+        route_cache = route_result.value();
+        route_cache_valid = 1;
+    }
 
     connected = true;
 
@@ -199,6 +202,50 @@ int udp_put_data(packetbuf *buf, const msghdr *msg, size_t length)
     return 0;
 }
 
+/**
+ * @brief Count the number of pages the iovecs span
+ *
+ * @param msg Message header
+ * @return Number of pages
+ */
+static size_t udp_count_pages(const msghdr *msg)
+{
+    size_t nr_pages = 0;
+
+    for (int i = 0; i < msg->msg_iovlen; i++)
+    {
+        const auto &vec = msg->msg_iov[i];
+        unsigned long page_off = (unsigned long) vec.iov_base & (PAGE_SIZE - 1);
+
+        if (vec.iov_len)
+            nr_pages += vm_size_to_pages(page_off + vec.iov_len);
+    }
+
+    return nr_pages;
+}
+
+int udp_put_pages(packetbuf *buf, const msghdr *msg)
+{
+    for (int i = 0; i < msg->msg_iovlen; i++)
+    {
+        const auto &vec = msg->msg_iov[i];
+        const uint8_t *ubuf = (const uint8_t *) vec.iov_base;
+        size_t len = vec.iov_len;
+
+        while (len)
+        {
+            auto st = buf->attach_user_pages(ubuf, len);
+            if (st < 0)
+                return st;
+
+            ubuf += st;
+            len -= st;
+        }
+    }
+
+    return 0;
+}
+
 template <int domain>
 void udp_do_csum(packetbuf *buf, const inet_route &route)
 {
@@ -238,6 +285,61 @@ int udp_do_send(packetbuf *buf, const inet_route &route)
     return ret;
 }
 
+/**
+ * @brief Send a datagram with MSG_ZEROCOPY
+ * The user's pages only get used if the device computes the checksum and the datagram doesn't
+ * need fragmenting, since we never look at the data then. Else, the data gets copied.
+ *
+ * @param msg Message header
+ * @param payload_size Size of the payload
+ * @param route Route
+ * @param sport Source port
+ * @param dport Destination port
+ * @param notif Zerocopy notification of the send
+ * @return Size of the payload, or a negative error code
+ */
+template <int domain>
+ssize_t udp_send_zerocopy(const msghdr *msg, size_t payload_size, const inet_route &route,
+                          in_port_t sport, in_port_t dport, zerocopy_notif *notif)
+{
+    auto nif = route.nif;
+    bool use_pages = nif->flags & NETIF_SUPPORTS_CSUM_OFFLOAD &&
+                     nif->mtu >= payload_size + sizeof(udphdr) + inet_header_size(domain) &&
+                     udp_count_pages(msg) <= PACKETBUF_MAX_NR_PAGES;
+
+    auto pbf_st = udp_create_pbuf(use_pages ? 0 : payload_size, inet_header_size(domain));
+
+    if (pbf_st.has_error())
+        return pbf_st.error();
+
+    auto buf = pbf_st.value();
+
+    udp_prepare_headers(buf.get(), sport, dport, payload_size);
+
+    int st;
+
+    if (use_pages)
+    {
+        buf->set_zerocopy_notif(notif);
+        st = udp_put_pages(buf.get(), msg);
+    }
+    else
+    {
+        notif->set_copied();
+        st = udp_put_data(buf.get(), msg, payload_size);
+    }
+
+    if (st < 0)
+        return st;
+
+    udp_do_csum<domain>(buf.get(), route);
+
+    if (st = udp_do_send<domain>(buf.get(), route); st < 0)
+        return st;
+
+    return payload_size;
+}
+
 template <typename AddrType>
 ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_address &dst)
 {
@@ -285,7 +387,11 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
 
     if (connected && route_cache_valid)
     {
-        route = route_cache;
+        auto result = connected_route(our_domain);
+        if (result.has_error())
+            return result.error();
+
+        route = result.value();
     }
     else
     {
@@ -305,6 +411,18 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
      */
     if (!will_append) [[likely]]
     {
+        if (flags & MSG_ZEROCOPY && zerocopy)
+        {
+            auto notif = zerocopy_start();
+            if (!notif)
+                return -ENOBUFS;
+
+            auto st = udp_send_zerocopy<our_domain>(msg, payload_size, route, src_addr.port,
+                                                    dst.port, notif);
+            zerocopy_end(notif, st >= 0);
+            return st;
+        }
+
         auto pbf_st = udp_create_pbuf(payload_size, inet_header_size(our_domain));
 
         if (pbf_st.has_error())
@@ -335,6 +453,17 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
         return st;
     }
 
+    if (flags & MSG_ZEROCOPY && zerocopy)
+    {
+        /* Corked data always gets copied, so complete the send right away */
+        auto notif = zerocopy_start();
+        if (notif)
+        {
+            notif->set_copied();
+            zerocopy_end(notif, true);
+        }
+    }
+
 #if DEBUG_UDP_CORK
     printk("appending %lu, total len %u\n", msg->msg_iov[0].iov_len,
            list_head_cpp<packetbuf>::self_from_list_head(list_first_element(cork.get_packet_list()))
@@ -683,10 +812,9 @@ short udp_socket::poll(void *poll_file, short events)
 
     if (events & POLLIN)
     {
+        poll_wait_helper(poll_file, &rx_wq);
         if (has_data_available())
             avail_events |= POLLIN;
-        else
-            poll_wait_helper(poll_file, &rx_wq);
     }
 
     // printk("avail events: %u\n", avail_events);
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <onyx/net/zerocopy.h>
+
+zerocopy_notif::~zerocopy_notif()
+{
+    if (entry)
+        queue->push(entry);
+    queue->unref();
+}
+
+/**
+ * @brief Create a zerocopy notification for a send
+ *
+ * @param queue Error queue of the socket
+ * @param id ID of the send; IDs go up by one for every zerocopy send that goes through
+ * @return The notification, or nullptr if we're out of memory
+ */
+zerocopy_notif *zerocopy_notif_create(sock_errqueue *queue, uint32_t id)
+{
+    /* Allocate the entry now, since the completion may come from a context where we can't */
+    auto entry = new sock_err_entry{};
+    if (!entry)
+        return nullptr;
+
+    entry->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+    entry->ee.ee_info = id;
+    entry->ee.ee_data = id;
+
+    auto notif = new zerocopy_notif{queue, entry};
+    if (!notif)
+    {
+        delete entry;
+        return nullptr;
+    }
+
+    return notif;
+}
@@ -37,7 +37,6 @@
 #include <onyx/user.h>
 #include <onyx/utils.h>
 #include <onyx/vdso.h>
-#include <onyx/worker.h>
 
 ids *process_ids = nullptr;
 
@@ -1256,7 +1255,7 @@ ssize_t process::query(void *ubuf, ssize_t len, unsigned long what, size_t *howm
 ssize_t process::query_vm_regions(void *ubuf, ssize_t len, unsigned long what, size_t *howmany,
                                   void *arg)
 {
-    scoped_mutex g{address_space->vm_lock};
+    scoped_rwlock<rw_lock::read> g{address_space->vm_lock};
     size_t needed_len = 0;
 
     vm_for_every_region(*address_space, [&](vm_region *region) -> bool {
@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <onyx/percpu.h>
+#include <onyx/radix.h>
+#include <onyx/scheduler.h>
+#include <onyx/scoped_lock.h>
+
+/* tags[RADIX_TAG_PRESENT] has a bit set for every slot that has something in it */
+#define RADIX_TAG_PRESENT 0
+
+#define radix_load(ptr)       __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define radix_store(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/* Bumped every time nodes get unlinked. Starts at 1, as 0 means "not reading" below. */
+static unsigned long radix_epoch = 1;
+/* Epoch this CPU's lockless reader started at, or 0 if it's not reading */
+static PER_CPU_VAR(unsigned long radix_reader_epoch) = 0;
+
+/**
+ * @brief Start a lockless walk of the tree
+ * Nodes unlinked after this don't get freed until we're done (see radix_tree_reclaim()).
+ *
+ * @return Cookie for radix_read_end()
+ */
+static inline unsigned long radix_read_begin()
+{
+    sched_disable_preempt();
+
+    /* We may have interrupted another reader on this CPU, in which case its epoch covers us */
+    unsigned long prev = get_per_cpu(radix_reader_epoch);
+    if (!prev)
+    {
+        write_per_cpu(radix_reader_epoch, __atomic_load_n(&radix_epoch, __ATOMIC_RELAXED));
+        /* Pairs with the fence in radix_tree_reclaim(): either the writer sees us, or we don't
+         * see the nodes it unlinked.
+         */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    return prev;
+}
+
+static inline void radix_read_end(unsigned long prev)
+{
+    if (!prev)
+    {
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        write_per_cpu(radix_reader_epoch, 0);
+    }
+
+    sched_enable_preempt();
+}
+
+/**
+ * @brief Get the epoch the oldest running reader started at
+ *
+ * @return Oldest reader's epoch, or ~0UL if no one is reading
+ */
+static unsigned long radix_oldest_reader()
+{
+    unsigned long oldest = ~0UL;
+
+    for (unsigned long cpu = 0; cpu < percpu_get_nr_bases(); cpu++)
+    {
+        unsigned long epoch = __atomic_load_n(other_cpu_get_ptr(radix_reader_epoch, cpu),
+                                              __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    return oldest;
+}
+
+/**
+ * @brief Get the mask of the index bits a node covers
+ *
+ * @param shift Node's shift
+ * @return Mask
+ */
+static inline unsigned long radix_node_span(unsigned int shift)
+{
+    unsigned int bits = shift + RADIX_TREE_MAP_SHIFT;
+    return bits >= sizeof(unsigned long) * 8 ? ~0UL : (1UL << bits) - 1;
+}
+
+static inline unsigned int radix_node_offset(const struct radix_tree_node *node,
+                                             unsigned long index)
+{
+    return (index >> node->shift) & RADIX_TREE_MAP_MASK;
+}
+
+static struct radix_tree_node *radix_node_alloc(unsigned int shift)
+{
+    struct radix_tree_node *node = (radix_tree_node *) zalloc(sizeof(*node));
+    if (!node)
+        return nullptr;
+
+    node->shift = shift;
+    return node;
+}
+
+/**
+ * @brief Set a tag on a slot, and on every node above it
+ *
+ * @param node Node
+ * @param off Slot
+ * @param tag Tag (internal numbering)
+ */
+static void radix_node_set_tag(struct radix_tree_node *node, unsigned int off, unsigned int tag)
+{
+    while (node)
+    {
+        unsigned long word = node->tags[tag];
+
+        /* If it's already set here, it's set all the way up */
+        if (word & (1UL << off))
+            return;
+
+        __atomic_store_n(&node->tags[tag], word | (1UL << off), __ATOMIC_RELAXED);
+        off = node->offset;
+        node = node->parent;
+    }
+}
+
+/**
+ * @brief Clear a tag on a slot, and on every node above it that ends up with nothing tagged
+ *
+ * @param node Node
+ * @param off Slot
+ * @param tag Tag (internal numbering)
+ */
+static void radix_node_clear_tag(struct radix_tree_node *node, unsigned int off, unsigned int tag)
+{
+    if (!(node->tags[tag] & (1UL << off)))
+        return;
+
+    while (node)
+    {
+        unsigned long word = node->tags[tag] & ~(1UL << off);
+
+        __atomic_store_n(&node->tags[tag], word, __ATOMIC_RELAXED);
+        if (word)
+            return;
+
+        off = node->offset;
+        node = node->parent;
+    }
+}
+
+/**
+ * @brief Find the leaf node that holds index
+ *
+ * @param tree Tree
+ * @param index Index
+ * @return The leaf, or NULL if there's none
+ */
+static struct radix_tree_node *radix_tree_lookup_leaf(struct radix_tree *tree, unsigned long index)
+{
+    struct radix_tree_node *node = radix_load(&tree->root);
+
+    if (!node || index > radix_node_span(node->shift))
+        return nullptr;
+
+    while (node && node->shift)
+        node = (radix_tree_node *) radix_load(&node->slots[radix_node_offset(node, index)]);
+
+    return node;
+}
+
+/**
+ * @brief Grow the tree until index fits in it
+ * Needs to be called with the tree's lock held.
+ *
+ * @param tree Tree
+ * @param index Index
+ * @return 0 on success, -ENOMEM if out of memory
+ */
+static int radix_tree_extend(struct radix_tree *tree, unsigned long index)
+{
+    struct radix_tree_node *root = tree->root;
+
+    if (!root)
+    {
+        unsigned int shift = 0;
+        while (index > radix_node_span(shift))
+            shift += RADIX_TREE_MAP_SHIFT;
+
+        root = radix_node_alloc(shift);
+        if (!root)
+            return -ENOMEM;
+
+        radix_store(&tree->root, root);
+        return 0;
+    }
+
+    while (index > radix_node_span(root->shift))
+    {
+        struct radix_tree_node *node = radix_node_alloc(root->shift + RADIX_TREE_MAP_SHIFT);
+        if (!node)
+            return -ENOMEM;
+
+        /* The old root becomes slot 0 of the new one. Readers that still have the old root
+         * keep working, since it still covers the same indices.
+         */
+        for (unsigned int i = 0; i < RADIX_TREE_MAX_TAGS + 1; i++)
+        {
+            if (root->tags[i])
+                node->tags[i] = 1;
+        }
+
+        node->slots[0] = root;
+        root->parent = node;
+        root->offset = 0;
+
+        radix_store(&tree->root, node);
+        root = node;
+    }
+
+    return 0;
+}
+
+void radix_tree_init(struct radix_tree *tree)
+{
+    tree->root = nullptr;
+    tree->free_list = nullptr;
+    spinlock_init(&tree->lock);
+}
+
+static void radix_node_free(struct radix_tree_node *node, unsigned long base,
+                            void (*free_entry)(unsigned long index, void *entry))
+{
+    for (unsigned int i = 0; i < RADIX_TREE_MAP_SIZE; i++)
+    {
+        void *slot = node->slots[i];
+        if (!slot)
+            continue;
+
+        unsigned long index = base | ((unsigned long) i << node->shift);
+
+        if (node->shift)
+            radix_node_free((radix_tree_node *) slot, index, free_entry);
+        else if (free_entry)
+            free_entry(index, slot);
+    }
+
+    free(node);
+}
+
+/**
+ * @brief Free a chain of unlinked nodes
+ *
+ * @param node First node, chained through ->parent
+ */
+static void radix_free_unlinked(struct radix_tree_node *node)
+{
+    while (node)
+    {
+        struct radix_tree_node *next = node->parent;
+        /* Any child left is an empty leftover from a failed insert */
+        radix_node_free(node, 0, nullptr);
+        node = next;
+    }
+}
+
+/**
+ * @brief Free the nodes that were unlinked from the tree, if no reader can be looking at them
+ * Needs to be called with the tree's lock held.
+ *
+ * @param tree Tree
+ */
+static void radix_tree_reclaim(struct radix_tree *tree)
+{
+    if (!tree->free_list)
+        return;
+
+    /* Pairs with radix_read_begin(): either we see the reader, or the reader doesn't see the
+     * unlinked nodes.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long oldest = radix_oldest_reader();
+
+    /* Readers that started after a node's unlink can't reach it. The list goes from newest to
+     * oldest, so everything past the first node old enough can go.
+     */
+    struct radix_tree_node **pp = &tree->free_list;
+    while (*pp && (*pp)->retire_epoch >= oldest)
+        pp = &(*pp)->parent;
+
+    radix_free_unlinked(*pp);
+    *pp = nullptr;
+}
+
+/**
+ * @brief Unlink a node if it's empty, and then every ancestor that ends up empty
+ * The nodes are put on the tree's free list. Needs to be called with the tree's lock held.
+ *
+ * @param tree Tree
+ * @param node Node
+ */
+static void radix_tree_unlink_empty(struct radix_tree *tree, struct radix_tree_node *node)
+{
+    struct radix_tree_node *unlinked = nullptr;
+
+    while (node && !node->tags[RADIX_TAG_PRESENT])
+    {
+        struct radix_tree_node *parent = node->parent;
+
+        if (parent)
+            radix_store(&parent->slots[node->offset], (void *) nullptr);
+        else
+            radix_store(&tree->root, (radix_tree_node *) nullptr);
+
+        node->parent = unlinked;
+        unlinked = node;
+        node = parent;
+    }
+
+    if (!unlinked)
+        return;
+
+    /* Readers that see the new epoch (or a later one) also see the unlinks */
+    unsigned long epoch = __atomic_fetch_add(&radix_epoch, 1, __ATOMIC_SEQ_CST);
+
+    while (unlinked)
+    {
+        struct radix_tree_node *next = unlinked->parent;
+        unlinked->retire_epoch = epoch;
+        unlinked->parent = tree->free_list;
+        tree->free_list = unlinked;
+        unlinked = next;
+    }
+}
+
+void radix_tree_destroy(struct radix_tree *tree,
+                        void (*free_entry)(unsigned long index, void *entry))
+{
+    if (tree->root)
+        radix_node_free(tree->root, 0, free_entry);
+    tree->root = nullptr;
+
+    /* Nobody is looking at the tree, so the readers are gone */
+    radix_free_unlinked(tree->free_list);
+    tree->free_list = nullptr;
+}
+
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index)
+{
+    unsigned long cookie = radix_read_begin();
+
+    struct radix_tree_node *leaf = radix_tree_lookup_leaf(tree, index);
+    void *entry = leaf ? radix_load(&leaf->slots[index & RADIX_TREE_MAP_MASK]) : nullptr;
+
+    radix_read_end(cookie);
+    return entry;
+}
+
+int radix_tree_insert(struct radix_tree *tree, unsigned long index, void *entry)
+{
+    scoped_lock g{tree->lock};
+
+    if (int st = radix_tree_extend(tree, index); st < 0)
+        return st;
+
+    struct radix_tree_node *node = tree->root;
+
+    while (node->shift)
+    {
+        unsigned int off = radix_node_offset(node, index);
+        struct radix_tree_node *child = (radix_tree_node *) node->slots[off];
+
+        if (!child)
+        {
+            child = radix_node_alloc(node->shift - RADIX_TREE_MAP_SHIFT);
+            if (!child)
+                return -ENOMEM;
+
+            child->parent = node;
+            child->offset = off;
+            radix_store(&node->slots[off], (void *) child);
+        }
+
+        node = child;
+    }
+
+    unsigned int off = index & RADIX_TREE_MAP_MASK;
+
+    if (node->slots[off])
+        return -EEXIST;
+
+    radix_store(&node->slots[off], entry);
+    radix_node_set_tag(node, off, RADIX_TAG_PRESENT);
+
+    /* Good time to free what previous deletes couldn't */
+    radix_tree_reclaim(tree);
+
+    return 0;
+}
+
+void *radix_tree_replace(struct radix_tree *tree, unsigned long index, void *entry)
+{
+    scoped_lock g{tree->lock};
+
+    struct radix_tree_node *leaf = radix_tree_lookup_leaf(tree, index);
+    if (!leaf)
+        return nullptr;
+
+    unsigned int off = index & RADIX_TREE_MAP_MASK;
+    void *old = leaf->slots[off];
+
+    if (old)
+        radix_store(&leaf->slots[off], entry);
+
+    return old;
+}
+
+void *radix_tree_delete(struct radix_tree *tree, unsigned long index)
+{
+    scoped_lock g{tree->lock};
+
+    struct radix_tree_node *leaf = radix_tree_lookup_leaf(tree, index);
+    if (!leaf)
+        return nullptr;
+
+    unsigned int off = index & RADIX_TREE_MAP_MASK;
+    void *old = leaf->slots[off];
+
+    if (!old)
+        return nullptr;
+
+    radix_store(&leaf->slots[off], (void *) nullptr);
+
+    for (unsigned int i = 0; i < RADIX_TREE_MAX_TAGS + 1; i++)
+        radix_node_clear_tag(leaf, off, i);
+
+    radix_tree_unlink_empty(tree, leaf);
+    radix_tree_reclaim(tree);
+
+    return old;
+}
+
+bool radix_tree_tag_set(struct radix_tree *tree, unsigned long index, unsigned int tag)
+{
+    scoped_lock g{tree->lock};
+
+    struct radix_tree_node *leaf = radix_tree_lookup_leaf(tree, index);
+    unsigned int off = index & RADIX_TREE_MAP_MASK;
+
+    if (!leaf || !leaf->slots[off])
+        return false;
+
+    radix_node_set_tag(leaf, off, tag + 1);
+    return true;
+}
+
+void radix_tree_tag_clear(struct radix_tree *tree, unsigned long index, unsigned int tag)
+{
+    scoped_lock g{tree->lock};
+
+    struct radix_tree_node *leaf = radix_tree_lookup_leaf(tree, index);
+
+    if (leaf)
+        radix_node_clear_tag(leaf, index & RADIX_TREE_MAP_MASK, tag + 1);
+}
+
+bool radix_tree_tag_get(struct radix_tree *tree, unsigned long index, unsigned int tag)
+{
+    bool tagged = false;
+
+    unsigned long cookie = radix_read_begin();
+
+    struct radix_tree_node *leaf = radix_tree_lookup_leaf(tree, index);
+    if (leaf)
+    {
+        tagged = __atomic_load_n(&leaf->tags[tag + 1], __ATOMIC_RELAXED) &
+                 (1UL << (index & RADIX_TREE_MAP_MASK));
+    }
+
+    radix_read_end(cookie);
+    return tagged;
+}
+
+bool radix_tree_tagged(struct radix_tree *tree, unsigned int tag)
+{
+    unsigned long cookie = radix_read_begin();
+
+    struct radix_tree_node *root = radix_load(&tree->root);
+    bool tagged = root && __atomic_load_n(&root->tags[tag + 1], __ATOMIC_RELAXED);
+
+    radix_read_end(cookie);
+    return tagged;
+}
+
+/**
+ * @brief Find the first slot at off or after it with a tag set
+ *
+ * @param node Node
+ * @param off First slot to look at
+ * @param tag Tag (internal numbering)
+ * @return The slot, or RADIX_TREE_MAP_SIZE if there's none
+ */
+static unsigned int radix_node_find(struct radix_tree_node *node, unsigned int off,
+                                    unsigned int tag)
+{
+    unsigned long word = __atomic_load_n(&node->tags[tag], __ATOMIC_RELAXED) & (~0UL << off);
+
+    return word ? __builtin_ctzl(word) : RADIX_TREE_MAP_SIZE;
+}
+
+static void *__radix_tree_next(struct radix_tree *tree, unsigned long *pindex, unsigned long max,
+                               int tag)
+{
+    unsigned int t = tag < 0 ? RADIX_TAG_PRESENT : tag + 1;
+    unsigned long index = *pindex;
+    struct radix_tree_node *node;
+
+restart:
+    if (index > max)
+        return nullptr;
+
+    node = radix_load(&tree->root);
+
+    if (!node || index > radix_node_span(node->shift))
+        return nullptr;
+
+    for (;;)
+    {
+        unsigned int shift = node->shift;
+        unsigned long span = radix_node_span(shift);
+        unsigned int cur = radix_node_offset(node, index);
+        unsigned int off = radix_node_find(node, cur, t);
+
+        if (off == RADIX_TREE_MAP_SIZE)
+        {
+            /* Nothing left under this node, go look right after it */
+            if (span == ~0UL || (index | span) == ~0UL)
+                return nullptr;
+            index = (index | span) + 1;
+            goto restart;
+        }
+
+        if (off != cur)
+            index = (index & ~span) | ((unsigned long) off << shift);
+
+        if (index > max)
+            return nullptr;
+
+        void *entry = radix_load(&node->slots[off]);
+
+        if (!entry)
+        {
+            /* Raced with a delete, skip the slot */
+            unsigned long slot_mask = (1UL << shift) - 1;
+            if ((index | slot_mask) == ~0UL)
+                return nullptr;
+            index = (index | slot_mask) + 1;
+            goto restart;
+        }
+
+        if (!shift)
+        {
+            *pindex = index;
+            return entry;
+        }
+
+        node = (radix_tree_node *) entry;
+    }
+}
+
+void *radix_tree_next(struct radix_tree *tree, unsigned long *pindex, unsigned long max, int tag)
+{
+    unsigned long cookie = radix_read_begin();
+    void *entry = __radix_tree_next(tree, pindex, max, tag);
+    radix_read_end(cookie);
+    return entry;
+}
+
+#ifdef CONFIG_KTEST_RADIX
+
+#include <libtest/libtest.h>
+
+static unsigned long radix_test_freed;
+
+static void radix_test_free(unsigned long index, void *entry)
+{
+    radix_test_freed++;
+}
+
+#define RADIX_TEST_ENTRY(i) ((void *) (((i) << 4) | 1))
+
+static bool radix_basic_test()
+{
+    struct radix_tree tree;
+    radix_tree_init(&tree);
+
+    const unsigned long indices[] = {0, 1, 63, 64, 4095, 4096, 0x123456, ~0UL};
+
+    for (unsigned long i : indices)
+    {
+        if (radix_tree_insert(&tree, i, RADIX_TEST_ENTRY(i)) < 0)
+            return false;
+    }
+
+    if (radix_tree_insert(&tree, 64, RADIX_TEST_ENTRY(64UL)) != -EEXIST)
+        return false;
+
+    for (unsigned long i : indices)
+    {
+        if (radix_tree_lookup(&tree, i) != RADIX_TEST_ENTRY(i))
+            return false;
+    }
+
+    if (radix_tree_lookup(&tree, 2) || radix_tree_lookup(&tree, 0x123457))
+        return false;
+
+    /* Iteration needs to return everything, in order */
+    unsigned long index;
+    void *entry;
+    unsigned int seen = 0;
+
+    radix_tree_for_each_range(&tree, index, entry, 0, ~0UL - 1)
+    {
+        if (index != indices[seen] || entry != RADIX_TEST_ENTRY(index))
+            return false;
+        seen++;
+    }
+
+    if (seen != sizeof(indices) / sizeof(indices[0]) - 1)
+        return false;
+
+    /* Iterating all the way up to ~0UL must stop after ~0UL, not wrap back around to 0 */
+    seen = 0;
+    radix_tree_for_each_range(&tree, index, entry, 0, ~0UL)
+    {
+        if (seen++ == sizeof(indices) / sizeof(indices[0]))
+            return false;
+    }
+
+    if (seen != sizeof(indices) / sizeof(indices[0]) || index != ~0UL)
+        return false;
+
+    /* Tagged iteration only returns tagged entries */
+    radix_tree_tag_set(&tree, 63, 0);
+    radix_tree_tag_set(&tree, 0x123456, 0);
+
+    if (!radix_tree_tagged(&tree, 0) || radix_tree_tagged(&tree, 1))
+        return false;
+
+    seen = 0;
+    radix_tree_for_each_tagged(&tree, index, entry, 0, ~0UL - 1, 0)
+    {
+        if (index != (seen ? 0x123456UL : 63UL))
+            return false;
+        seen++;
+    }
+
+    if (seen != 2)
+        return false;
+
+    radix_tree_tag_set(&tree, ~0UL, 1);
+    seen = 0;
+    radix_tree_for_each_tagged(&tree, index, entry, 0, ~0UL, 1)
+    {
+        if (index != ~0UL || seen++)
+            return false;
+    }
+
+    if (seen != 1)
+        return false;
+    radix_tree_tag_clear(&tree, ~0UL, 1);
+
+    /* Deleting an entry clears its tags */
+    if (radix_tree_delete(&tree, 63) != RADIX_TEST_ENTRY(63UL))
+        return false;
+    radix_tree_tag_clear(&tree, 0x123456, 0);
+
+    if (radix_tree_tagged(&tree, 0) || radix_tree_lookup(&tree, 63))
+        return false;
+
+    radix_test_freed = 0;
+    radix_tree_destroy(&tree, radix_test_free);
+
+    return radix_test_freed == sizeof(indices) / sizeof(indices[0]) - 1;
+}
+
+DECLARE_TEST(radix_basic_test, 1);
+
+static bool radix_delete_test()
+{
+    struct radix_tree tree;
+    radix_tree_init(&tree);
+
+    for (unsigned long i = 0; i < 4096; i += 3)
+    {
+        if (radix_tree_insert(&tree, i, RADIX_TEST_ENTRY(i)) < 0)
+            return false;
+    }
+
+    if (radix_tree_insert(&tree, 1UL << 40, RADIX_TEST_ENTRY(1UL)) < 0)
+        return false;
+
+    /* Once a subtree is empty, it gets unlinked. A reader on this CPU may be walking through it,
+     * so it can't be freed yet.
+     */
+    unsigned long cookie = radix_read_begin();
+
+    if (radix_tree_delete(&tree, 1UL << 40) != RADIX_TEST_ENTRY(1UL))
+    {
+        radix_read_end(cookie);
+        return false;
+    }
+
+    bool kept = tree.free_list != nullptr;
+    radix_read_end(cookie);
+
+    if (!kept || tree.root->slots[(1UL << 40) >> tree.root->shift])
+        return false;
+
+    for (unsigned long i = 0; i < 4096; i += 3)
+    {
+        if (radix_tree_delete(&tree, i) != RADIX_TEST_ENTRY(i))
+            return false;
+    }
+
+    if (tree.root)
+        return false;
+
+    /* And the tree can still grow back afterwards */
+    if (radix_tree_insert(&tree, 4095, RADIX_TEST_ENTRY(4095UL)) < 0 ||
+        radix_tree_lookup(&tree, 4095) != RADIX_TEST_ENTRY(4095UL))
+        return false;
+
+    radix_tree_destroy(&tree, nullptr);
+    return true;
+}
+
+DECLARE_TEST(radix_delete_test, 1);
+
+#endif
@@ -39,8 +39,18 @@ bool rw_lock_trywrite(rwlock *lock)
 {
     unsigned long expected = 0;
     unsigned long write_value = RDWR_LOCK_WRITE;
-    return __atomic_compare_exchange_n(&lock->lock, &expected, write_value, false, __ATOMIC_ACQUIRE,
-                                       __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&lock->lock, &expected, write_value, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return false;
+
+    lock->writer = get_current_thread();
+    return true;
+}
+
+bool rw_lock_holds_write(rwlock *lock)
+{
+    return __atomic_load_n(&lock->lock, __ATOMIC_RELAXED) == RDWR_LOCK_WRITE &&
+           lock->writer == get_current_thread();
 }
 
 static void rwlock_prepare_sleep(rwlock *rwl, int state)
@@ -206,6 +216,7 @@ void rw_unlock_read(rwlock *lock)
 
 void rw_unlock_write(rwlock *lock)
 {
+    lock->writer = nullptr;
     __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
     /* Implementation note: If we're unlocking a write lock, wake up every single thread
      * because we can have both readers and writers waiting to get woken up.
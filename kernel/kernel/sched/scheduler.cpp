@@ -19,9 +19,10 @@
 #include <onyx/clock.h>
 #include <onyx/condvar.h>
 #include <onyx/cpu.h>
-#include <onyx/dpc.h>
 #include <onyx/elf.h>
 #include <onyx/fpu.h>
+#include <onyx/futex.h>
+#include <onyx/init.h>
 #include <onyx/irq.h>
 #include <onyx/mm/kasan.h>
 #include <onyx/panic.h>
@@ -31,11 +32,13 @@
 #include <onyx/rwlock.h>
 #include <onyx/semaphore.h>
 #include <onyx/spinlock.h>
+#include <onyx/sysfs.h>
 #include <onyx/task_switching.h>
 #include <onyx/timer.h>
+#include <onyx/tracepoint.h>
 #include <onyx/tss.h>
 #include <onyx/vm.h>
-#include <onyx/worker.h>
+#include <onyx/workqueue.h>
 
 #include <libdict/rb_tree.h>
 
@@ -46,6 +49,8 @@ static bool is_initialized = false;
 void sched_append_to_queue(int priority, unsigned int cpu, thread_t *thread);
 void sched_block(thread *thread);
 void __sched_append_to_queue(int priority, unsigned int cpu, thread_t *thread);
+static void __sched_dequeue(thread *thread, unsigned int cpu);
+static void sched_idle_pull(unsigned int cpu);
 
 int sched_rbtree_cmp(const void *t1, const void *t2);
 static rb_tree glbl_thread_list = {.cmp_func = sched_rbtree_cmp};
@@ -55,6 +60,234 @@ PER_CPU_VAR(spinlock scheduler_lock) = STATIC_SPINLOCK_INIT;
 PER_CPU_VAR(thread *thread_queues_head[NUM_PRIO]);
 PER_CPU_VAR(thread *thread_queues_tail[NUM_PRIO]);
 PER_CPU_VAR(thread *current_thread);
+/* This CPU's idle thread, which never leaves it */
+PER_CPU_VAR(thread *sched_idle_thread);
+/* The last thread we switched away from. Its stack may still be in use until the context switch
+ * is done, so it can't be migrated to another CPU.
+ */
+PER_CPU_VAR(thread *sched_last_thread);
+
+/**
+ * Per-CPU run queue statistics, exported through /sys/sched/runqueues.
+ * These are only modified with the CPU's scheduler lock held.
+ */
+struct sched_rq_stats
+{
+    /* Number of threads in the run queue, not counting the idle thread */
+    unsigned long nr_queued;
+    /* Number of threads that got migrated to this CPU */
+    unsigned long nr_migrations;
+    /* Number of those that were pulled by this CPU when it went idle */
+    unsigned long nr_idle_pulls;
+    /* Number of those that were placed here on wakeup */
+    unsigned long nr_wake_migrations;
+};
+
+PER_CPU_VAR(struct sched_rq_stats sched_rq_stats);
+
+/**
+ * Fair scheduling class.
+ * Every non-real-time thread has a virtual runtime, which is the time it has run weighted by
+ * its priority (higher priorities make it go slower). The thread with the smallest vruntime runs
+ * next, for a slice of SCHED_LATENCY_NS proportional to its weight, and threads that wake up
+ * preempt the current one if they're sufficiently behind it. Real-time threads
+ * (priority >= SCHED_PRIO_RT_MIN) always run before fair threads, in strict priority order.
+ */
+
+/* Period in which every runnable fair thread should get to run */
+#define SCHED_LATENCY_NS            (6 * NS_PER_MS)
+/* Smallest slice we hand out, regardless of how many threads are runnable */
+#define SCHED_MIN_GRANULARITY_NS    (750 * NS_PER_US)
+/* How far behind the current thread a waking thread's vruntime needs to be for it to preempt */
+#define SCHED_WAKEUP_GRANULARITY_NS (1 * NS_PER_MS)
+
+#define SCHED_NICE_0_WEIGHT 1024
+
+struct sched_fair_rq
+{
+    /* Queued threads, sorted by vruntime. The thread that's running isn't in here. */
+    struct bst_root tree;
+    /* Monotonically increasing vruntime floor, which waking threads get placed relative to */
+    hrtime_t min_vruntime;
+    /* Sum of the weights of the queued threads */
+    unsigned long load_weight;
+};
+
+PER_CPU_VAR(struct sched_fair_rq fair_rq);
+
+/* Weight of each nice level, from -20 to 19. Each level is worth about 10% of CPU time. */
+static const unsigned int sched_prio_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+static unsigned int sched_thread_weight(thread *t)
+{
+    /* SCHED_PRIO_NORMAL is nice 0, and every priority level above it is one nice level below */
+    int idx = 20 - (t->priority - SCHED_PRIO_NORMAL);
+
+    if (idx < 0)
+        idx = 0;
+    else if (idx > 39)
+        idx = 39;
+
+    return sched_prio_to_weight[idx];
+}
+
+static bool sched_is_fair(thread *t, unsigned int cpu)
+{
+    return t->priority < SCHED_PRIO_RT_MIN && t != get_per_cpu_any(sched_idle_thread, cpu);
+}
+
+static hrtime_t sched_calc_delta_fair(hrtime_t delta, thread *t)
+{
+    return delta * SCHED_NICE_0_WEIGHT / sched_thread_weight(t);
+}
+
+/* vruntimes are only compared relative to each other, so they're allowed to wrap around */
+static inline long sched_vruntime_diff(hrtime_t a, hrtime_t b)
+{
+    return (long) (a - b);
+}
+
+static int sched_fair_cmp(struct bst_node *lhs_, struct bst_node *rhs_)
+{
+    auto lhs = container_of(lhs_, thread, fair_node);
+    auto rhs = container_of(rhs_, thread, fair_node);
+    long diff = sched_vruntime_diff(rhs->vruntime, lhs->vruntime);
+
+    if (diff > 0)
+        return 1;
+    else if (diff < 0)
+        return -1;
+
+    /* Equal vruntimes, use the address as a tie-breaker */
+    if (rhs > lhs)
+        return 1;
+    else if (rhs < lhs)
+        return -1;
+    return 0;
+}
+
+static thread *sched_fair_first(unsigned int cpu)
+{
+    struct bst_node *node = bst_min(&get_per_cpu_ptr_any(fair_rq, cpu)->tree, nullptr);
+    return node ? container_of(node, thread, fair_node) : nullptr;
+}
+
+static void sched_fair_update_min_vruntime(unsigned int cpu)
+{
+    struct sched_fair_rq *rq = get_per_cpu_ptr_any(fair_rq, cpu);
+    thread *curr = get_thread_for_cpu(cpu);
+    thread *first = sched_fair_first(cpu);
+    hrtime_t vruntime = rq->min_vruntime;
+
+    if (curr && sched_is_fair(curr, cpu))
+    {
+        vruntime = curr->vruntime;
+        if (first && sched_vruntime_diff(first->vruntime, vruntime) < 0)
+            vruntime = first->vruntime;
+    }
+    else if (first)
+        vruntime = first->vruntime;
+
+    if (sched_vruntime_diff(vruntime, rq->min_vruntime) > 0)
+        rq->min_vruntime = vruntime;
+}
+
+/**
+ * @brief Account the time a thread has been running for, since the last call
+ *
+ * @param curr Thread running on cpu
+ * @param cpu CPU
+ */
+static void sched_fair_update_curr(thread *curr, unsigned int cpu)
+{
+    MUST_HOLD_LOCK(get_per_cpu_ptr_any(scheduler_lock, cpu));
+
+    hrtime_t now = clocksource_get_time();
+    hrtime_t delta = now - curr->exec_start;
+    curr->exec_start = now;
+
+    if (!sched_is_fair(curr, cpu))
+        return;
+
+    curr->vruntime += sched_calc_delta_fair(delta, curr);
+    sched_fair_update_min_vruntime(cpu);
+}
+
+/**
+ * @brief Place a thread that's becoming runnable in cpu's timeline
+ * New threads start at min_vruntime. Threads that slept get up to half a latency period of
+ * credit, so they get to run soon after waking up, but can't build up credit by sleeping.
+ *
+ * @param t Thread
+ * @param cpu CPU
+ * @param initial True if the thread is new
+ */
+static void sched_fair_place(thread *t, unsigned int cpu, bool initial)
+{
+    hrtime_t vruntime = get_per_cpu_ptr_any(fair_rq, cpu)->min_vruntime;
+
+    if (!initial)
+        vruntime -= SCHED_LATENCY_NS / 2;
+
+    /* Never hand vruntime back */
+    if (initial || sched_vruntime_diff(vruntime, t->vruntime) > 0)
+        t->vruntime = vruntime;
+}
+
+/**
+ * @brief Move a thread's vruntime from one CPU's timeline to another's
+ *
+ * @param t Thread
+ * @param src Old CPU
+ * @param dst New CPU
+ */
+static void sched_fair_migrate(thread *t, unsigned int src, unsigned int dst)
+{
+    t->vruntime -= get_per_cpu_ptr_any(fair_rq, src)->min_vruntime;
+    t->vruntime += get_per_cpu_ptr_any(fair_rq, dst)->min_vruntime;
+}
+
+/**
+ * @brief Get the slice a fair thread gets to run for
+ *
+ * @param curr Thread
+ * @param cpu CPU it's running on
+ * @return Slice, in ns
+ */
+static hrtime_t sched_fair_slice(thread *curr, unsigned int cpu)
+{
+    unsigned long weight = sched_thread_weight(curr);
+    unsigned long total = get_per_cpu_ptr_any(fair_rq, cpu)->load_weight + weight;
+    hrtime_t slice = SCHED_LATENCY_NS * weight / total;
+
+    return slice < SCHED_MIN_GRANULARITY_NS ? SCHED_MIN_GRANULARITY_NS : slice;
+}
+
+/**
+ * @brief Check if a thread that just became runnable on cpu should preempt the current one
+ *
+ * @param t Thread
+ * @param cpu CPU
+ * @return True if we should reschedule, else false
+ */
+static bool sched_wakeup_preempt(thread *t, unsigned int cpu)
+{
+    thread *curr = get_thread_for_cpu(cpu);
+
+    if (curr == get_per_cpu_any(sched_idle_thread, cpu))
+        return true;
+
+    if (!sched_is_fair(t, cpu) || !sched_is_fair(curr, cpu))
+        return t->priority > curr->priority;
+
+    return sched_vruntime_diff(curr->vruntime, t->vruntime) >
+           (long) sched_calc_delta_fair(SCHED_WAKEUP_GRANULARITY_NS, t);
+}
 
 void thread_append_to_global_list(thread *t)
 {
@@ -158,14 +391,29 @@ unsigned long sched_lock(thread *thread)
     /* 1st - Lock the per-cpu scheduler */
     /* 2nd - Lock the thread */
 
-    assert(thread->cpu < percpu_get_nr_bases());
-    spinlock *l = get_per_cpu_ptr_any(scheduler_lock, thread->cpu);
+    /* The thread may get migrated while we wait for the scheduler lock, so retry if
+     * thread->cpu changed from under us. thread->cpu is only changed with the old CPU's
+     * scheduler lock held.
+     */
+    while (true)
+    {
+        unsigned int cpu = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        assert(cpu < percpu_get_nr_bases());
+        spinlock *l = get_per_cpu_ptr_any(scheduler_lock, cpu);
 
-    unsigned long cpu_flags = spin_lock_irqsave(l);
-    unsigned long _ = spin_lock_irqsave(&thread->lock);
-    (void) _;
+        unsigned long cpu_flags = spin_lock_irqsave(l);
+
+        if (thread->cpu != cpu) [[unlikely]]
+        {
+            spin_unlock_irqrestore(l, cpu_flags);
+            continue;
+        }
 
-    return cpu_flags;
+        unsigned long _ = spin_lock_irqsave(&thread->lock);
+        (void) _;
+
+        return cpu_flags;
+    }
 }
 
 void sched_unlock(thread *thread, unsigned long cpu_flags)
@@ -194,6 +442,8 @@ thread_t *__sched_find_next(unsigned int cpu)
 
     if (current_thread)
     {
+        sched_fair_update_curr(current_thread, cpu);
+
         unsigned long cpu_flags = spin_lock_irqsave(&current_thread->lock);
 
         if (current_thread->status == THREAD_RUNNABLE)
@@ -202,22 +452,44 @@ thread_t *__sched_find_next(unsigned int cpu)
             __sched_append_to_queue(current_thread->priority, cpu, current_thread);
         }
 
+        write_per_cpu_any(sched_last_thread, current_thread, cpu);
+
         spin_unlock_irqrestore(&current_thread->lock, cpu_flags);
     }
 
-    /* Go through the different queues, from the highest to lowest */
-    for (int i = NUM_PRIO - 1; i >= 0; i--)
+    /* If we only have the idle thread left, try to steal some work from a busier CPU */
+    if (get_per_cpu_ptr_any(sched_rq_stats, cpu)->nr_queued == 0)
+        sched_idle_pull(cpu);
+
+    /* Real-time threads go first, from the highest priority to the lowest */
+    for (int i = NUM_PRIO - 1; i >= SCHED_PRIO_RT_MIN; i--)
     {
         /* If this queue has a thread, we found a runnable thread! */
         if (thread_queues[i])
         {
             thread_t *ret = thread_queues[i];
 
-            /* Advance the queue by one */
-            thread_queues[i] = ret->next_prio;
-            if (thread_queues[i])
-                ret->prev_prio = nullptr;
-            ret->next_prio = nullptr;
+            __sched_dequeue(ret, cpu);
+
+            return ret;
+        }
+    }
+
+    /* Then the fair thread that's the most behind */
+    if (thread *ret = sched_fair_first(cpu))
+    {
+        __sched_dequeue(ret, cpu);
+        return ret;
+    }
+
+    /* And finally, the idle thread */
+    for (int i = SCHED_PRIO_RT_MIN - 1; i >= 0; i--)
+    {
+        if (thread_queues[i])
+        {
+            thread_t *ret = thread_queues[i];
+
+            __sched_dequeue(ret, cpu);
 
             return ret;
         }
@@ -267,17 +539,56 @@ void sched_save_thread(thread *thread, void *stack)
 
 #define SCHED_QUANTUM 10
 
+/* Run the periodic load balancer every SCHED_BALANCE_INTERVAL ticks */
+#define SCHED_BALANCE_INTERVAL 4
+
 PER_CPU_VAR(uint32_t sched_quantum) = 0;
+PER_CPU_VAR(uint32_t sched_balance_ticks) = 0;
 PER_CPU_VAR(clockevent *sched_pulse);
 
+static void sched_balance_tick(void);
+
+/**
+ * @brief Account the current fair thread's runtime, and preempt it if its slice is over
+ *
+ * @param curr Current thread
+ */
+static void sched_fair_tick(thread *curr)
+{
+    unsigned int cpu = get_cpu_nr();
+    spinlock *l = get_per_cpu_ptr(scheduler_lock);
+    unsigned long cpu_flags = spin_lock_irqsave(l);
+
+    sched_fair_update_curr(curr, cpu);
+
+    hrtime_t ran = curr->exec_start - curr->slice_start;
+
+    if (sched_fair_first(cpu) && ran >= sched_fair_slice(curr, cpu))
+        curr->flags |= THREAD_NEEDS_RESCHED;
+
+    spin_unlock_irqrestore(l, cpu_flags);
+}
+
 void sched_decrease_quantum(clockevent *ev)
 {
+    thread *curr = get_current_thread();
+
     add_per_cpu(sched_quantum, -1);
 
-    if (get_per_cpu(sched_quantum) == 0)
-    {
-        thread *curr = get_current_thread();
+    /* Fair threads get preempted when their slice runs out, everyone else round-robins every
+     * SCHED_QUANTUM ticks.
+     */
+    if (sched_is_fair(curr, get_cpu_nr()))
+        sched_fair_tick(curr);
+    else if (get_per_cpu(sched_quantum) == 0)
         curr->flags |= THREAD_NEEDS_RESCHED;
+
+    add_per_cpu(sched_balance_ticks, 1);
+
+    if (get_per_cpu(sched_balance_ticks) == SCHED_BALANCE_INTERVAL)
+    {
+        write_per_cpu(sched_balance_ticks, 0);
+        sched_balance_tick();
     }
 
     ev->deadline = clocksource_get_time() + NS_PER_MS;
@@ -296,6 +607,8 @@ void sched_load_thread(thread *thread, unsigned int cpu)
 
     write_per_cpu(sched_quantum, SCHED_QUANTUM);
 
+    thread->exec_start = thread->slice_start = clocksource_get_time();
+
     cputime_restart_accounting(thread);
 
     spin_unlock_irqrestore(get_per_cpu_ptr_any(scheduler_lock, cpu), irq_save_and_disable());
@@ -361,6 +674,8 @@ extern "C" void *sched_schedule(void *last_stack)
 
     if (source_thread != curr_thread)
     {
+        trace_sched_switch(source_thread->id, curr_thread->id, source_thread->status);
+
         if (source_thread->owner)
         {
             source_thread->get_aspace()->active_mask.remove_cpu_atomic(get_cpu_nr());
@@ -410,7 +725,16 @@ void __sched_append_to_queue(int priority, unsigned int cpu, thread *thread)
 
     auto thread_queues = (struct thread **) get_per_cpu_ptr_any(thread_queues_head, cpu);
     thread_t *queue = thread_queues[priority];
-    if (!queue)
+
+    if (sched_is_fair(thread, cpu))
+    {
+        struct sched_fair_rq *rq = get_per_cpu_ptr_any(fair_rq, cpu);
+
+        rq->load_weight += sched_thread_weight(thread);
+        bool inserted = bst_insert(&rq->tree, &thread->fair_node, sched_fair_cmp);
+        assert(inserted);
+    }
+    else if (!queue)
     {
         thread_queues[priority] = thread;
     }
@@ -428,6 +752,47 @@ void __sched_append_to_queue(int priority, unsigned int cpu, thread *thread)
         queue->next_prio = thread;
         thread->prev_prio = queue;
     }
+
+    if (thread != get_per_cpu_any(sched_idle_thread, cpu))
+        get_per_cpu_ptr_any(sched_rq_stats, cpu)->nr_queued++;
+}
+
+/**
+ * @brief Unlink a thread from a CPU's run queue
+ *
+ * @param thread Thread (must be in the run queue)
+ * @param cpu CPU
+ */
+static void __sched_dequeue(thread *thread, unsigned int cpu)
+{
+    MUST_HOLD_LOCK(get_per_cpu_ptr_any(scheduler_lock, cpu));
+
+    auto thread_queues = (struct thread **) get_per_cpu_ptr_any(thread_queues_head, cpu);
+
+    if (thread->fair_node.rank)
+    {
+        /* A non-zero rank means the node is in the fair tree */
+        struct sched_fair_rq *rq = get_per_cpu_ptr_any(fair_rq, cpu);
+
+        bst_delete(&rq->tree, &thread->fair_node);
+        rq->load_weight -= sched_thread_weight(thread);
+    }
+    else
+    {
+        if (thread->prev_prio)
+            thread->prev_prio->next_prio = thread->next_prio;
+        else
+            thread_queues[thread->priority] = thread->next_prio;
+
+        if (thread->next_prio)
+            thread->next_prio->prev_prio = thread->prev_prio;
+
+        thread->prev_prio = nullptr;
+        thread->next_prio = nullptr;
+    }
+
+    if (thread != get_per_cpu_any(sched_idle_thread, cpu))
+        get_per_cpu_ptr_any(sched_rq_stats, cpu)->nr_queued--;
 }
 
 void sched_append_to_queue(int priority, unsigned int cpu, thread_t *thread)
@@ -439,35 +804,255 @@ void sched_append_to_queue(int priority, unsigned int cpu, thread_t *thread)
     spin_unlock(get_per_cpu_ptr_any(scheduler_lock, cpu));
 }
 
-PER_CPU_VAR(unsigned long active_threads) = 0;
+/* Minimum difference in load between two CPUs before we bother moving threads around */
+#define SCHED_IMBALANCE 2
+
+/**
+ * @brief Get a CPU's load, which is the number of runnable threads it has (including the one
+ * that's running, but not the idle thread).
+ * This is racy, and only meant for load balancing decisions.
+ *
+ * @param cpu CPU
+ * @return Load
+ */
+static unsigned long sched_cpu_load(unsigned int cpu)
+{
+    unsigned long load =
+        __atomic_load_n(&get_per_cpu_ptr_any(sched_rq_stats, cpu)->nr_queued, __ATOMIC_RELAXED);
+
+    if (get_thread_for_cpu(cpu) != get_per_cpu_any(sched_idle_thread, cpu))
+        load++;
+
+    return load;
+}
+
+/**
+ * @brief Find the CPU with the most load, other than this_cpu
+ *
+ * @param this_cpu CPU that's looking for work
+ * @param min_load Ignore CPUs with less load than this
+ * @return The busiest CPU, or SCHED_NO_CPU_PREFERENCE if no CPU has at least min_load
+ */
+static unsigned int sched_find_busiest(unsigned int this_cpu, unsigned long min_load)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+    unsigned int busiest = SCHED_NO_CPU_PREFERENCE;
+    unsigned long max_load = min_load;
+
+    for (unsigned int i = 0; i < nr_cpus; i++)
+    {
+        if (i == this_cpu)
+            continue;
+
+        unsigned long load = sched_cpu_load(i);
+        if (load >= max_load)
+        {
+            busiest = i;
+            max_load = load + 1;
+        }
+    }
+
+    return busiest;
+}
+
+/**
+ * @brief Find a queued thread that can be moved off a CPU
+ *
+ * @param cpu CPU
+ * @return The thread, or nullptr
+ */
+static thread *sched_find_migratable(unsigned int cpu)
+{
+    MUST_HOLD_LOCK(get_per_cpu_ptr_any(scheduler_lock, cpu));
+
+    auto thread_queues = (struct thread **) get_per_cpu_ptr_any(thread_queues_head, cpu);
+    thread *last = get_per_cpu_any(sched_last_thread, cpu);
+
+    for (int i = NUM_PRIO - 1; i >= 0; i--)
+    {
+        for (thread *t = thread_queues[i]; t; t = t->next_prio)
+        {
+            /* The last thread that ran may still be switching out, and its cache is hot anyway */
+            if (t->flags & THREAD_CPU_BOUND || t == last)
+                continue;
+
+            return t;
+        }
+    }
+
+    struct sched_fair_rq *rq = get_per_cpu_ptr_any(fair_rq, cpu);
+
+    for (struct bst_node *node = bst_min(&rq->tree, nullptr); node;
+         node = bst_next(&rq->tree, node))
+    {
+        thread *t = container_of(node, thread, fair_node);
+
+        if (t->flags & THREAD_CPU_BOUND || t == last)
+            continue;
+
+        return t;
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Pull a thread from another CPU's run queue into dst's
+ * The source CPU's scheduler lock is only try-locked, since taking two scheduler locks in
+ * arbitrary order could deadlock, and failing to balance is harmless.
+ *
+ * @param src CPU to pull from
+ * @param dst CPU to pull to (its scheduler lock needs to be held)
+ * @return The migrated thread, or nullptr
+ */
+static thread *sched_pull_thread(unsigned int src, unsigned int dst)
+{
+    MUST_HOLD_LOCK(get_per_cpu_ptr_any(scheduler_lock, dst));
+
+    spinlock *l = get_per_cpu_ptr_any(scheduler_lock, src);
+    if (spin_try_lock(l))
+        return nullptr;
+
+    thread *t = sched_find_migratable(src);
+
+    if (t)
+    {
+        __sched_dequeue(t, src);
+        sched_fair_migrate(t, src, dst);
+        __atomic_store_n(&t->cpu, dst, __ATOMIC_RELEASE);
+        __sched_append_to_queue(t->priority, dst, t);
+        get_per_cpu_ptr_any(sched_rq_stats, dst)->nr_migrations++;
+    }
+
+    spin_unlock(l);
+
+    return t;
+}
+
+/**
+ * @brief Try to steal work from the busiest CPU, because we're about to go idle
+ *
+ * @param cpu Our CPU (its scheduler lock needs to be held)
+ */
+static void sched_idle_pull(unsigned int cpu)
+{
+    unsigned int busiest = sched_find_busiest(cpu, SCHED_IMBALANCE);
+    if (busiest == SCHED_NO_CPU_PREFERENCE)
+        return;
+
+    if (sched_pull_thread(busiest, cpu))
+        get_per_cpu_ptr_any(sched_rq_stats, cpu)->nr_idle_pulls++;
+}
+
+/**
+ * @brief Periodic load balancing, called from the scheduler tick
+ * Pulls a thread from the busiest CPU, if it's busy enough compared to us.
+ */
+static void sched_balance_tick(void)
+{
+    unsigned int cpu = get_cpu_nr();
+    unsigned int busiest = sched_find_busiest(cpu, sched_cpu_load(cpu) + SCHED_IMBALANCE);
+
+    if (busiest == SCHED_NO_CPU_PREFERENCE)
+        return;
+
+    spinlock *l = get_per_cpu_ptr(scheduler_lock);
+    unsigned long cpu_flags = spin_lock_irqsave(l);
+
+    thread *t = sched_pull_thread(busiest, cpu);
+
+    if (t && t->priority > get_current_thread()->priority)
+        sched_should_resched();
+
+    spin_unlock_irqrestore(l, cpu_flags);
+}
 
 unsigned int sched_allocate_processor(void)
 {
     unsigned int nr_cpus = get_nr_cpus();
     unsigned int dest_cpu = -1;
-    size_t active_threads_min = SIZE_MAX;
+    size_t min_load = SIZE_MAX;
 
     for (unsigned int i = 0; i < nr_cpus; i++)
     {
-        unsigned long active_threads_for_cpu = get_per_cpu_any(active_threads, i);
-        if (active_threads_for_cpu < active_threads_min)
+        unsigned long load = sched_cpu_load(i);
+        if (load < min_load)
         {
             dest_cpu = i;
-            active_threads_min = active_threads_for_cpu;
+            min_load = load;
         }
     }
     return dest_cpu;
 }
 
+/**
+ * @brief Pick a CPU for a thread that's waking up
+ * We prefer the CPU the thread last ran on, since its cache is probably still warm, unless it's
+ * busy and there's an idle (or much less loaded) CPU around.
+ *
+ * @param thread Thread
+ * @return The CPU
+ */
+static unsigned int sched_select_wake_cpu(thread *thread)
+{
+    unsigned int prev = thread->cpu;
+    unsigned long prev_load = sched_cpu_load(prev);
+
+    if (prev_load == 0 || thread->flags & THREAD_CPU_BOUND)
+        return prev;
+
+    /* The waker's CPU shares some of its cache with the wakee, try it first */
+    unsigned int this_cpu = get_cpu_nr();
+    if (this_cpu != prev && sched_cpu_load(this_cpu) == 0)
+        return this_cpu;
+
+    unsigned int nr_cpus = get_nr_cpus();
+    unsigned int best = prev;
+    unsigned long best_load = prev_load;
+
+    for (unsigned int i = 0; i < nr_cpus; i++)
+    {
+        unsigned long load = sched_cpu_load(i);
+        if (load < best_load)
+        {
+            best = i;
+            best_load = load;
+        }
+    }
+
+    if (best_load == 0 || best_load + SCHED_IMBALANCE <= prev_load)
+        return best;
+
+    return prev;
+}
+
 void thread_add(thread_t *thread, unsigned int cpu_num)
 {
     if (cpu_num == SCHED_NO_CPU_PREFERENCE || cpu_num > get_nr_cpus())
         cpu_num = sched_allocate_processor();
+    else
+        thread->flags |= THREAD_CPU_BOUND;
 
     thread->cpu = cpu_num;
-    add_per_cpu_any(active_threads, 1, cpu_num);
+
+    spinlock *l = get_per_cpu_ptr_any(scheduler_lock, cpu_num);
+    unsigned long cpu_flags = spin_lock_irqsave(l);
+
+    if (sched_is_fair(thread, cpu_num))
+        sched_fair_place(thread, cpu_num, true);
+
     /* Append the thread to the queue */
-    sched_append_to_queue(thread->priority, cpu_num, thread);
+    __sched_append_to_queue(thread->priority, cpu_num, thread);
+
+    if (sched_wakeup_preempt(thread, cpu_num))
+    {
+        if (cpu_num == get_cpu_nr())
+            sched_should_resched();
+        else
+            cpu_send_resched(cpu_num);
+    }
+
+    spin_unlock_irqrestore(l, cpu_flags);
 }
 
 void sched_init_cpu(unsigned int cpu)
@@ -478,8 +1063,10 @@ void sched_init_cpu(unsigned int cpu)
 
     t->priority = SCHED_PRIO_VERY_LOW;
     t->cpu = cpu;
+    t->flags |= THREAD_CPU_BOUND;
 
     write_per_cpu_any(current_thread, t, cpu);
+    write_per_cpu_any(sched_idle_thread, t, cpu);
     write_per_cpu_any(sched_quantum, SCHED_QUANTUM, cpu);
     write_per_cpu_any(preemption_counter, 0, cpu);
 
@@ -515,9 +1102,13 @@ int sched_init(void)
     assert(t != NULL);
 
     t->priority = SCHED_PRIO_NORMAL;
+    t->cpu = get_cpu_nr();
+    /* This thread becomes our idle thread, see sched_transition_to_idle() */
+    t->flags |= THREAD_CPU_BOUND;
     // sched_start_thread_for_cpu(t, get_cpu_nr());
 
     write_per_cpu(sched_quantum, SCHED_QUANTUM);
+    write_per_cpu(sched_idle_thread, t);
     set_current_thread(t);
 
     auto cev = new clockevent;
@@ -543,16 +1134,25 @@ void sched_yield(void)
     }
 
     struct flame_graph_entry *fge = nullptr;
-    const bool waiting = get_current_thread()->status == THREAD_INTERRUPTIBLE ||
-                         get_current_thread()->status == THREAD_UNINTERRUPTIBLE;
+    thread *current = get_current_thread();
+    const bool waiting =
+        current->status == THREAD_INTERRUPTIBLE || current->status == THREAD_UNINTERRUPTIBLE;
     if (perf_probe_is_enabled_wait() && waiting)
     {
         fge = (struct flame_graph_entry *) alloca(sizeof(*fge));
         perf_probe_setup_wait(fge);
     }
 
+    /* Workqueue workers that block let their pool get another worker going */
+    const bool worker_blocking = waiting && current->wq_worker;
+    if (worker_blocking)
+        wq_worker_sleeping(current);
+
     platform_yield();
 
+    if (worker_blocking)
+        wq_worker_running(current);
+
     if (fge)
         perf_probe_commit_wait(fge);
 }
@@ -607,22 +1207,17 @@ int __sched_remove_thread_from_execution(thread_t *thread, unsigned int cpu)
 {
     auto thread_queues = (struct thread **) get_per_cpu_ptr_any(thread_queues_head, cpu);
 
+    if (thread->fair_node.rank)
+    {
+        __sched_dequeue(thread, cpu);
+        return 0;
+    }
+
     for (thread_t *t = thread_queues[thread->priority]; t; t = t->next_prio)
     {
         if (t == thread)
         {
-            if (t->prev_prio)
-                t->prev_prio->next_prio = t->next_prio;
-            else
-            {
-                thread_queues[thread->priority] = t->next_prio;
-            }
-
-            if (t->next_prio)
-                t->next_prio->prev_prio = t->prev_prio;
-            t->prev_prio = NULL;
-            t->next_prio = NULL;
-
+            __sched_dequeue(t, cpu);
             return 0;
         }
     }
@@ -632,16 +1227,26 @@ int __sched_remove_thread_from_execution(thread_t *thread, unsigned int cpu)
 
 int sched_remove_thread_from_execution(thread_t *thread)
 {
-    unsigned int cpu = thread->cpu;
+    while (true)
+    {
+        unsigned int cpu = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+
+        spinlock *s = get_per_cpu_ptr_any(scheduler_lock, cpu);
+        unsigned long cpu_flags = spin_lock_irqsave(s);
 
-    spinlock *s = get_per_cpu_ptr_any(scheduler_lock, cpu);
-    unsigned long cpu_flags = spin_lock_irqsave(s);
+        /* Raced with a migration, try again */
+        if (thread->cpu != cpu) [[unlikely]]
+        {
+            spin_unlock_irqrestore(s, cpu_flags);
+            continue;
+        }
 
-    int st = __sched_remove_thread_from_execution(thread, cpu);
+        int st = __sched_remove_thread_from_execution(thread, cpu);
 
-    spin_unlock_irqrestore(s, cpu_flags);
+        spin_unlock_irqrestore(s, cpu_flags);
 
-    return st;
+        return st;
+    }
 }
 
 void sched_remove_thread(thread_t *thread)
@@ -691,6 +1296,11 @@ int sys_nanosleep(const timespec *req, timespec *rem)
 
 extern "C" void thread_finish_destruction(void *);
 
+static void thread_destroy_work(struct work_struct *work)
+{
+    thread_finish_destruction(container_of(work, struct thread, destroy_work));
+}
+
 void thread_destroy(struct thread *thread)
 {
     /* This function should destroy everything that we can destroy right now.
@@ -716,20 +1326,21 @@ void thread_destroy(struct thread *thread)
     sched_remove_thread(thread);
 
     /* Schedule further thread destruction */
-    dpc_work w;
-    w.context = thread;
-    w.funcptr = thread_finish_destruction;
-    dpc_schedule_work(&w, DPC_PRIORITY_MEDIUM);
+    work_init(&thread->destroy_work, thread_destroy_work);
+    queue_work(system_wq, &thread->destroy_work);
 }
 
 void thread_exit(void)
 {
     // printk("tid %u(%p) dying\n", get_current_thread()->id, get_current_thread()->entry);
 
-    sched_disable_preempt();
-
     thread *current = get_current_thread();
 
+    /* Hand our PI futexes over while we can still sleep */
+    futex_exit_pi(current);
+
+    sched_disable_preempt();
+
     /* We need to switch to the fallback page directory while we can, because
      * we don't know if the current pgd will be destroyed by some other thread.
      */
@@ -823,33 +1434,107 @@ void __thread_wake_up(thread *thread, unsigned int cpu)
         return;
 
     thread->status = THREAD_RUNNABLE;
+
+    if (sched_is_fair(thread, cpu))
+        sched_fair_place(thread, cpu, false);
+
     __sched_append_to_queue(thread->priority, cpu, thread);
 
+    if (!sched_wakeup_preempt(thread, cpu))
+        return;
+
     if (cpu == get_cpu_nr())
+        sched_should_resched();
+    else
     {
-        auto curr = get_current_thread();
-        if (thread->priority > curr->priority)
-        {
-            sched_should_resched();
-        }
+        /* Send a CPU message asking for a resched */
+        cpu_send_resched(cpu);
     }
-    else
+}
+
+/**
+ * @brief Check if a thread can be moved to another CPU as it's woken up
+ * This is only possible if it's blocked and not running (or switching out) on its CPU.
+ *
+ * @param thread Thread (locked with sched_lock)
+ * @return True if it can be migrated, else false
+ */
+static bool sched_can_migrate_on_wake(thread *thread)
+{
+    unsigned int cpu = thread->cpu;
+
+    if (thread->status == THREAD_RUNNABLE || thread->flags & THREAD_CPU_BOUND)
+        return false;
+
+    return get_thread_for_cpu(cpu) != thread && get_per_cpu_any(sched_last_thread, cpu) != thread;
+}
+
+void thread_wake_up(thread_t *thread)
+{
+    unsigned long f = sched_lock(thread);
+    unsigned int cpu = thread->cpu;
+
+    if (sched_can_migrate_on_wake(thread))
     {
-        auto other_thread = get_thread_for_cpu(thread->cpu);
-        int other_prio = other_thread->priority;
-        if (other_prio < thread->priority)
+        unsigned int dst = sched_select_wake_cpu(thread);
+        spinlock *dst_lock = get_per_cpu_ptr_any(scheduler_lock, dst);
+
+        /* See sched_pull_thread() as to why we only try-lock the other CPU */
+        if (dst != cpu && !spin_try_lock(dst_lock))
         {
-            /* Send a CPU message asking for a resched */
-            cpu_send_resched(thread->cpu);
+            struct sched_rq_stats *stats = get_per_cpu_ptr_any(sched_rq_stats, dst);
+
+            sched_fair_migrate(thread, cpu, dst);
+            __atomic_store_n(&thread->cpu, dst, __ATOMIC_RELEASE);
+            __thread_wake_up(thread, dst);
+            stats->nr_migrations++;
+            stats->nr_wake_migrations++;
+
+            spin_unlock(dst_lock);
+            spin_unlock_irqrestore(&thread->lock, CPU_FLAGS_NO_IRQ);
+            spin_unlock_irqrestore(get_per_cpu_ptr_any(scheduler_lock, cpu), f);
+            return;
         }
     }
+
+    __thread_wake_up(thread, cpu);
+
+    sched_unlock(thread, f);
 }
 
-void thread_wake_up(thread_t *thread)
+void sched_set_priority(thread *thread, int prio)
 {
     unsigned long f = sched_lock(thread);
+    unsigned int cpu = thread->cpu;
 
-    __thread_wake_up(thread, thread->cpu);
+    if (thread->priority == prio)
+    {
+        sched_unlock(thread, f);
+        return;
+    }
+
+    /* Queued threads need to be requeued, as the priority selects the queue (and the weight) */
+    bool queued = thread->status == THREAD_RUNNABLE && get_thread_for_cpu(cpu) != thread &&
+                  __sched_remove_thread_from_execution(thread, cpu) == 0;
+    bool was_fair = sched_is_fair(thread, cpu);
+
+    thread->priority = prio;
+
+    if (queued)
+    {
+        if (!was_fair && sched_is_fair(thread, cpu))
+            sched_fair_place(thread, cpu, false);
+
+        __sched_append_to_queue(prio, cpu, thread);
+
+        if (sched_wakeup_preempt(thread, cpu))
+        {
+            if (cpu == get_cpu_nr())
+                sched_should_resched();
+            else
+                cpu_send_resched(cpu);
+        }
+    }
 
     sched_unlock(thread, f);
 }
@@ -1141,3 +1826,68 @@ extern "C" unsigned long thread_get_addr_limit(void)
     assert(t->addr_limit != 0);
     return t->addr_limit;
 }
+
+/* Longest line sched_runqueues_read() prints per CPU */
+#define SCHED_RQ_LINE_MAX 384
+
+static ssize_t sched_runqueues_read(void *buffer, size_t size, off_t off)
+{
+    unsigned int nr_cpus = get_nr_cpus();
+    size_t len = nr_cpus * SCHED_RQ_LINE_MAX;
+    size_t pos = 0;
+
+    char *buf = (char *) malloc(len);
+    if (!buf)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < nr_cpus; i++)
+    {
+        struct sched_rq_stats *stats = get_per_cpu_ptr_any(sched_rq_stats, i);
+        pos += snprintf(buf + pos, len - pos,
+                        "cpu%u nr_running %lu migrations %lu idle_pulls %lu wake_migrations %lu",
+                        i, sched_cpu_load(i), stats->nr_migrations, stats->nr_idle_pulls,
+                        stats->nr_wake_migrations);
+#ifdef CONFIG_SPINLOCK_STATS
+        struct spinlock_stats *lstats = &get_per_cpu_ptr_any(scheduler_lock, i)->stats;
+        pos += snprintf(buf + pos, len - pos,
+                        " lock_acquisitions %lu lock_contentions %lu lock_wait_ns %lu "
+                        "lock_max_wait_ns %lu",
+                        lstats->acquisitions, lstats->contentions, lstats->wait_ns,
+                        lstats->max_wait_ns);
+#endif
+        pos += snprintf(buf + pos, len - pos, "\n");
+    }
+
+    ssize_t st = 0;
+
+    if ((size_t) off < pos)
+    {
+        st = pos - off < size ? pos - off : size;
+        if (copy_to_user(buffer, buf + off, st) < 0)
+            st = -EFAULT;
+    }
+
+    free(buf);
+    return st;
+}
+
+static struct sysfs_object sched_obj;
+static struct sysfs_object runqueues_obj;
+
+/**
+ * @brief Initialises sysfs nodes for the scheduler (/sys/sched)
+ *
+ */
+static void sched_sysfs_init(void)
+{
+    assert(sysfs_object_init("sched", &sched_obj) == 0);
+    sched_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("runqueues", &runqueues_obj, &sched_obj) == 0);
+    runqueues_obj.read = sched_runqueues_read;
+    runqueues_obj.perms = 0444 | S_IFREG;
+
+    sysfs_add(&sched_obj, nullptr);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(sched_sysfs_init);
@@ -6,8 +6,10 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <onyx/clock.h>
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
+#include <onyx/percpu.h>
 #include <onyx/scheduler.h>
 #include <onyx/spinlock.h>
 #include <onyx/task_switching.h>
@@ -26,35 +28,171 @@ static inline void post_release_actions(struct spinlock *lock)
 #endif
 }
 
-void spin_lock_preempt(struct spinlock *lock)
+/**
+ * Spinlocks are queued (MCS) locks.
+ * An uncontended lock is taken with a single cmpxchg of 0 -> owner. Contended lockers append
+ * themselves to a queue, whose tail is kept in the lock word. Every waiter spins on its own
+ * queue node instead of on the lock word, and the lock gets handed over in FIFO order. Only the
+ * waiter at the head of the queue looks at the lock word, waiting for the owner to let go.
+ *
+ * Every CPU has SPINLOCK_MAX_NESTING queue nodes, since we can get interrupted while waiting for
+ * a lock, by something that takes another lock. Tails are encoded as ((cpu + 1) << 2) | node.
+ */
+
+#define SPINLOCK_MAX_NESTING 4
+
+struct spinlock_node
 {
-    raw_spinlock_t expected_val = 0;
-    raw_spinlock_t what_to_insert = get_cpu_nr() + 1;
+    struct spinlock_node *next;
+    unsigned int locked;
+};
+
+PER_CPU_VAR(struct spinlock_node spinlock_nodes[SPINLOCK_MAX_NESTING]);
+PER_CPU_VAR(unsigned int spinlock_nesting) = 0;
+
+static inline raw_spinlock_t spinlock_encode_tail(unsigned int cpu, unsigned int idx)
+{
+    return (((cpu + 1) << 2) | idx) << SPINLOCK_TAIL_SHIFT;
+}
+
+static inline struct spinlock_node *spinlock_decode_tail(raw_spinlock_t tail)
+{
+    tail >>= SPINLOCK_TAIL_SHIFT;
+    unsigned int cpu = (tail >> 2) - 1;
+    auto nodes = (struct spinlock_node *) get_per_cpu_ptr_any(spinlock_nodes, cpu);
+    return &nodes[tail & (SPINLOCK_MAX_NESTING - 1)];
+}
+
+/**
+ * @brief Take the lock by spinning on the lock word, without queueing up
+ * Only used if we run out of queue nodes, since it's unfair.
+ *
+ * @param lock Lock
+ * @param owner Our owner value
+ */
+static void spin_lock_unqueued(struct spinlock *lock, raw_spinlock_t owner)
+{
+    raw_spinlock_t val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+
+    while (true)
+    {
+        if (!(val & SPINLOCK_OWNER_MASK) &&
+            __atomic_compare_exchange_n(&lock->lock, &val, val | owner, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            return;
+
+        cpu_relax();
+        val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+    }
+}
+
+static void spin_lock_slow(struct spinlock *lock, raw_spinlock_t owner)
+{
+    unsigned int idx = get_per_cpu(spinlock_nesting);
+
+    if (idx >= SPINLOCK_MAX_NESTING) [[unlikely]]
+    {
+        spin_lock_unqueued(lock, owner);
+        return;
+    }
+
+    add_per_cpu(spinlock_nesting, 1);
+
+    auto node = (struct spinlock_node *) get_per_cpu_ptr(spinlock_nodes) + idx;
+    node->next = nullptr;
+    node->locked = 0;
+
+    raw_spinlock_t tail = spinlock_encode_tail(get_cpu_nr(), idx);
+    raw_spinlock_t val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+
+    /* Make ourselves the new tail of the queue */
+    while (!__atomic_compare_exchange_n(&lock->lock, &val, (val & SPINLOCK_OWNER_MASK) | tail,
+                                        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    if (val & ~SPINLOCK_OWNER_MASK)
+    {
+        /* Link ourselves to the previous tail, and wait for it to pass us the head */
+        struct spinlock_node *prev = spinlock_decode_tail(val & ~SPINLOCK_OWNER_MASK);
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+        while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+            cpu_relax();
+    }
+
+    /* We're the head of the queue, wait for the owner to let go */
+    val = __atomic_load_n(&lock->lock, __ATOMIC_ACQUIRE);
 
     while (true)
     {
-        if (__atomic_compare_exchange_n(&lock->lock, &expected_val, what_to_insert, false,
-                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        if (val & SPINLOCK_OWNER_MASK)
+        {
+            cpu_relax();
+            val = __atomic_load_n(&lock->lock, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        /* If we're the last one in the queue, clear the tail as we take the lock */
+        raw_spinlock_t new_val = (val & ~SPINLOCK_OWNER_MASK) == tail ? owner : val | owner;
+
+        if (__atomic_compare_exchange_n(&lock->lock, &val, new_val, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
             break;
+    }
 
-        while (__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) != 0)
+    if ((val & ~SPINLOCK_OWNER_MASK) != tail)
+    {
+        /* Someone queued up behind us, wait for them to link in and make them the head */
+        struct spinlock_node *next;
+
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
             cpu_relax();
 
-        expected_val = 0;
+        __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
     }
 
+    add_per_cpu(spinlock_nesting, -1);
+}
+
+void spin_lock_preempt(struct spinlock *lock)
+{
+    raw_spinlock_t expected_val = 0;
+    raw_spinlock_t owner = get_cpu_nr() + 1;
+
+    if (!__atomic_compare_exchange_n(&lock->lock, &expected_val, owner, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)) [[unlikely]]
+    {
+#ifdef CONFIG_SPINLOCK_STATS
+        hrtime_t start = clocksource_get_time();
+#endif
+        spin_lock_slow(lock, owner);
+
+#ifdef CONFIG_SPINLOCK_STATS
+        hrtime_t wait = clocksource_get_time() - start;
+        lock->stats.contentions++;
+        lock->stats.wait_ns += wait;
+        if (wait > lock->stats.max_wait_ns)
+            lock->stats.max_wait_ns = wait;
+#endif
+    }
+
+#ifdef CONFIG_SPINLOCK_STATS
+    lock->stats.acquisitions++;
+#endif
+
     post_lock_actions(lock);
 }
 
 void spin_unlock_preempt(struct spinlock *lock)
 {
 #ifdef CONFIG_SPINLOCK_DEBUG
-    assert(lock->lock > 0);
+    assert(lock->lock & SPINLOCK_OWNER_MASK);
 #endif
 
     post_release_actions(lock);
 
-    __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
+    /* Waiters may be changing the tail under us, so we can't just store 0 */
+    __atomic_fetch_and(&lock->lock, ~SPINLOCK_OWNER_MASK, __ATOMIC_RELEASE);
 }
 
 void spin_lock(struct spinlock *lock)
@@ -89,6 +227,10 @@ int spin_try_lock(struct spinlock *lock)
         return 1;
     }
 
+#ifdef CONFIG_SPINLOCK_STATS
+    lock->stats.acquisitions++;
+#endif
+
     post_lock_actions(lock);
     return 0;
 }
@@ -18,6 +18,336 @@
 #include <onyx/user.h>
 #include <onyx/vm.h>
 
+/**
+ * Every CPU's timer keeps two structures:
+ *  - A pairing heap ordered by deadline, for high resolution events (sleeps, the scheduler tick).
+ *    Insertion is O(1), removal O(log n) amortised.
+ *  - A hierarchical timer wheel for CLOCKEVENT_FLAG_COARSE events (network timeouts and the like),
+ *    which mostly get cancelled before they expire. Insertion and removal are O(1), and a whole
+ *    bucket expires at once.
+ * The hardware timer gets programmed for whichever of the two expires first.
+ */
+
+#define WHEEL_LVL_MASK      (TIMER_WHEEL_LVL_SIZE - 1)
+#define WHEEL_LVL_CLK_MASK  ((1UL << TIMER_WHEEL_CLK_SHIFT) - 1)
+#define WHEEL_LVL_SHIFT(n)  ((n) * TIMER_WHEEL_CLK_SHIFT)
+#define WHEEL_LVL_GRAN(n)   (1UL << WHEEL_LVL_SHIFT(n))
+#define WHEEL_LVL_START(n)  ((TIMER_WHEEL_LVL_SIZE - 1) << (((n) - 1) * TIMER_WHEEL_CLK_SHIFT))
+#define WHEEL_LVL_OFFS(n)   ((n) * TIMER_WHEEL_LVL_SIZE)
+#define WHEEL_CUTOFF        WHEEL_LVL_START(TIMER_WHEEL_DEPTH)
+#define WHEEL_MAX_TIMEOUT   (WHEEL_CUTOFF - WHEEL_LVL_GRAN(TIMER_WHEEL_DEPTH - 1))
+#define WHEEL_NO_EXPIRY     ~0UL
+
+void timer_init_events(struct timer *t)
+{
+    t->heap = nullptr;
+    INIT_LIST_HEAD(&t->pending_list);
+
+    struct timer_wheel *w = &t->wheel;
+    w->clk = clocksource_get_time() / TIMER_WHEEL_GRAN_NS;
+    w->next_expiry = WHEEL_NO_EXPIRY;
+
+    for (auto &p : w->pending)
+        p = 0;
+    for (auto &bucket : w->buckets)
+        INIT_LIST_HEAD(&bucket);
+}
+
+static struct clockevent *heap_meld(struct clockevent *a, struct clockevent *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (b->deadline < a->deadline)
+    {
+        struct clockevent *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    /* b becomes a's first child */
+    b->heap_prev = a;
+    b->heap_next = a->heap_child;
+    if (a->heap_child)
+        a->heap_child->heap_prev = b;
+    a->heap_child = b;
+
+    return a;
+}
+
+/**
+ * @brief Two-pass pairing of a list of siblings into a single heap
+ *
+ * @param first First sibling
+ * @return The new heap
+ */
+static struct clockevent *heap_merge_pairs(struct clockevent *first)
+{
+    struct clockevent *stack = nullptr;
+
+    /* Meld pairs left to right, keeping the results in a stack (linked through heap_next) */
+    while (first)
+    {
+        struct clockevent *a = first;
+        struct clockevent *b = first->heap_next;
+        first = b ? b->heap_next : nullptr;
+
+        a->heap_prev = a->heap_next = nullptr;
+        if (b)
+            b->heap_prev = b->heap_next = nullptr;
+
+        struct clockevent *m = heap_meld(a, b);
+        m->heap_next = stack;
+        stack = m;
+    }
+
+    /* And then meld them right to left */
+    struct clockevent *root = nullptr;
+
+    while (stack)
+    {
+        struct clockevent *next = stack->heap_next;
+        stack->heap_next = nullptr;
+        root = heap_meld(root, stack);
+        stack = next;
+    }
+
+    return root;
+}
+
+static void heap_insert(struct timer *t, struct clockevent *ev)
+{
+    ev->heap_child = ev->heap_next = ev->heap_prev = nullptr;
+    t->heap = heap_meld(t->heap, ev);
+}
+
+static void heap_remove(struct timer *t, struct clockevent *ev)
+{
+    if (ev == t->heap)
+    {
+        t->heap = heap_merge_pairs(ev->heap_child);
+    }
+    else
+    {
+        /* heap_prev is either our parent (if we're its first child) or our left sibling */
+        if (ev->heap_prev->heap_child == ev)
+            ev->heap_prev->heap_child = ev->heap_next;
+        else
+            ev->heap_prev->heap_next = ev->heap_next;
+
+        if (ev->heap_next)
+            ev->heap_next->heap_prev = ev->heap_prev;
+
+        t->heap = heap_meld(t->heap, heap_merge_pairs(ev->heap_child));
+    }
+
+    ev->heap_child = ev->heap_next = ev->heap_prev = nullptr;
+}
+
+/**
+ * @brief Calculate the bucket for an expiry time
+ *
+ * @param expires Expiry, in ticks
+ * @param clk Current wheel clock
+ * @param bucket_expiry Pointer to where to store the bucket's expiry time, in ticks
+ * @return Bucket index
+ */
+static unsigned int wheel_calc_index(unsigned long expires, unsigned long clk,
+                                     unsigned long *bucket_expiry)
+{
+    if (expires < clk)
+    {
+        /* Already expired, run it on the next tick */
+        *bucket_expiry = clk;
+        return clk & WHEEL_LVL_MASK;
+    }
+
+    unsigned long delta = expires - clk;
+    unsigned int lvl;
+
+    for (lvl = 0; lvl < TIMER_WHEEL_DEPTH - 1; lvl++)
+    {
+        if (delta < WHEEL_LVL_START(lvl + 1))
+            break;
+    }
+
+    if (delta >= WHEEL_CUTOFF)
+        expires = clk + WHEEL_MAX_TIMEOUT;
+
+    /* Round up to the level's granularity, so we never expire early */
+    expires = (expires >> WHEEL_LVL_SHIFT(lvl)) + 1;
+    *bucket_expiry = expires << WHEEL_LVL_SHIFT(lvl);
+    return WHEEL_LVL_OFFS(lvl) + (expires & WHEEL_LVL_MASK);
+}
+
+/**
+ * @brief Find the earliest expiry in the wheel
+ *
+ * @param w Wheel
+ * @return Expiry, in ticks, or WHEEL_NO_EXPIRY
+ */
+static unsigned long wheel_next_expiry(struct timer_wheel *w)
+{
+    unsigned long next = WHEEL_NO_EXPIRY;
+    unsigned long clk = w->clk;
+
+    for (unsigned int lvl = 0; lvl < TIMER_WHEEL_DEPTH; lvl++)
+    {
+        unsigned long pending = w->pending[lvl];
+        unsigned int pos = clk & WHEEL_LVL_MASK;
+        unsigned long lvl_clk = clk & WHEEL_LVL_CLK_MASK;
+
+        if (pending)
+        {
+            /* Distance from the current bucket to the next pending one */
+            unsigned long rot = pos ? (pending >> pos) | (pending << (TIMER_WHEEL_LVL_SIZE - pos))
+                                    : pending;
+            unsigned long dist = __builtin_ctzl(rot);
+            unsigned long expiry = (clk + dist) << WHEEL_LVL_SHIFT(lvl);
+
+            if (expiry < next)
+                next = expiry;
+
+            /* Anything on the upper levels expires after this one */
+            if (dist <= ((WHEEL_LVL_CLK_MASK + 1 - lvl_clk) & WHEEL_LVL_CLK_MASK))
+                break;
+        }
+
+        /* The upper level's bucket for this clk has already been collected if we're not at
+         * the start of it, so look at the next one.
+         */
+        clk = (clk >> TIMER_WHEEL_CLK_SHIFT) + (lvl_clk ? 1 : 0);
+    }
+
+    return next;
+}
+
+static void wheel_add(struct timer *t, struct clockevent *ev)
+{
+    struct timer_wheel *w = &t->wheel;
+    unsigned long expires = ev->deadline / TIMER_WHEEL_GRAN_NS;
+    unsigned long now = clocksource_get_time() / TIMER_WHEEL_GRAN_NS;
+
+    /* Catch up with the current time if we've been idle, so the timeout doesn't land on a
+     * coarser level than it should. Nothing expires before next_expiry, so this is safe.
+     */
+    if (now > w->clk)
+        w->clk = now < w->next_expiry ? now : w->next_expiry;
+
+    unsigned long bucket_expiry;
+    unsigned int idx = wheel_calc_index(expires, w->clk, &bucket_expiry);
+
+    list_add_tail(&ev->list_node, &w->buckets[idx]);
+    w->pending[idx / TIMER_WHEEL_LVL_SIZE] |= 1UL << (idx & WHEEL_LVL_MASK);
+    ev->wheel_idx = idx;
+    ev->flags |= CLOCKEVENT_FLAG_WHEEL;
+
+    if (bucket_expiry < w->next_expiry)
+        w->next_expiry = bucket_expiry;
+}
+
+static void wheel_remove(struct timer *t, struct clockevent *ev)
+{
+    struct timer_wheel *w = &t->wheel;
+    unsigned int idx = ev->wheel_idx;
+
+    list_remove(&ev->list_node);
+    ev->flags &= ~CLOCKEVENT_FLAG_WHEEL;
+
+    if (list_is_empty(&w->buckets[idx]))
+        w->pending[idx / TIMER_WHEEL_LVL_SIZE] &= ~(1UL << (idx & WHEEL_LVL_MASK));
+}
+
+/**
+ * @brief Move every expired bucket's events to a list
+ *
+ * @param w Wheel
+ * @param now Current time, in ticks
+ * @param expired List where expired events get added
+ */
+static void wheel_collect_expired(struct timer_wheel *w, unsigned long now,
+                                  struct list_head *expired)
+{
+    while (now >= w->clk && now >= w->next_expiry)
+    {
+        /* Skip straight to the next bucket that expires */
+        if (w->next_expiry > w->clk)
+            w->clk = w->next_expiry;
+
+        unsigned long clk = w->clk;
+
+        for (unsigned int lvl = 0; lvl < TIMER_WHEEL_DEPTH; lvl++)
+        {
+            unsigned int idx = WHEEL_LVL_OFFS(lvl) + (clk & WHEEL_LVL_MASK);
+            unsigned long bit = 1UL << (clk & WHEEL_LVL_MASK);
+
+            if (w->pending[lvl] & bit)
+            {
+                w->pending[lvl] &= ~bit;
+
+                list_for_every_safe (&w->buckets[idx])
+                {
+                    struct clockevent *ev = container_of(l, struct clockevent, list_node);
+                    list_remove(&ev->list_node);
+                    ev->flags &= ~CLOCKEVENT_FLAG_WHEEL;
+                    list_add_tail(&ev->list_node, expired);
+                }
+            }
+
+            /* Upper levels only expire when the lower bits wrap around */
+            if (clk & WHEEL_LVL_CLK_MASK)
+                break;
+            clk >>= TIMER_WHEEL_CLK_SHIFT;
+        }
+
+        w->clk++;
+        w->next_expiry = wheel_next_expiry(w);
+    }
+}
+
+static void timer_enqueue(struct timer *t, struct clockevent *ev)
+{
+    if (ev->flags & CLOCKEVENT_FLAG_COARSE)
+        wheel_add(t, ev);
+    else
+        heap_insert(t, ev);
+}
+
+static void timer_dequeue(struct timer *t, struct clockevent *ev)
+{
+    if (ev->flags & CLOCKEVENT_FLAG_PENDING)
+    {
+        list_remove(&ev->list_node);
+        ev->flags &= ~CLOCKEVENT_FLAG_PENDING;
+    }
+    else if (ev->flags & CLOCKEVENT_FLAG_WHEEL)
+        wheel_remove(t, ev);
+    else
+        heap_remove(t, ev);
+}
+
+/**
+ * @brief Get the next deadline we need to be woken up for
+ *
+ * @param t Timer
+ * @return Deadline, or TIMER_NEXT_EVENT_NOT_PENDING
+ */
+static hrtime_t timer_next_deadline(struct timer *t)
+{
+    hrtime_t next = t->heap ? t->heap->deadline : TIMER_NEXT_EVENT_NOT_PENDING;
+
+    if (t->wheel.next_expiry != WHEEL_NO_EXPIRY)
+    {
+        hrtime_t wheel_next = t->wheel.next_expiry * TIMER_WHEEL_GRAN_NS;
+        if (wheel_next < next)
+            next = wheel_next;
+    }
+
+    return next;
+}
+
 void timer_queue_clockevent(struct clockevent *ev)
 {
     auto timer = platform_get_timer();
@@ -29,15 +359,18 @@ void timer_queue_clockevent(struct clockevent *ev)
         panic("Tried to queue clockevent that's already queued");
 
     ev->timer = timer;
+    ev->flags &= ~(CLOCKEVENT_FLAG_PENDING | CLOCKEVENT_FLAG_WHEEL);
 
-    list_add_tail(&ev->list_node, &timer->event_list);
+    timer_enqueue(timer, ev);
 
     ev->flags |= CLOCKEVENT_FLAG_POISON;
 
-    if (timer->next_event > ev->deadline)
+    hrtime_t next = timer_next_deadline(timer);
+
+    if (timer->next_event > next)
     {
-        timer->next_event = ev->deadline;
-        timer->set_oneshot(ev->deadline);
+        timer->next_event = next;
+        timer->set_oneshot(next);
     }
 }
 
@@ -47,93 +380,120 @@ void timer_disable(struct timer *t)
         t->disable_timer();
 }
 
+/**
+ * @brief Handle an expired event, with the timer's lock held
+ *
+ * @param t Timer
+ * @param ev Expired event, already removed from the timer's structures
+ * @param atomic_context True if we can't run non-atomic events
+ * @param to_handle List of non-atomic events to run after dropping the lock
+ * @return True if the timer softirq needs to be raised
+ */
+static bool timer_expire_event(struct timer *t, struct clockevent *ev, bool atomic_context,
+                               struct list_head *to_handle)
+{
+    if (ev->flags & CLOCKEVENT_FLAG_ATOMIC)
+    {
+        ev->callback(ev);
+        if (!(ev->flags & CLOCKEVENT_FLAG_PULSE))
+            ev->flags &= ~CLOCKEVENT_FLAG_POISON;
+        else
+            timer_enqueue(t, ev);
+    }
+    else if (!atomic_context)
+    {
+        ev->timer = nullptr;
+        list_add_tail(&ev->list_node, to_handle);
+    }
+    else
+    {
+        ev->flags |= CLOCKEVENT_FLAG_PENDING;
+        list_add_tail(&ev->list_node, &t->pending_list);
+        return true;
+    }
+
+    return false;
+}
+
 void timer_handle_events(struct timer *t)
 {
     bool atomic_context = irq_is_disabled();
-    bool has_raised_softirq = false;
+    bool raise_softirq = false;
     struct list_head to_handle;
+    struct list_head expired;
     INIT_LIST_HEAD(&to_handle);
+    INIT_LIST_HEAD(&expired);
 
     auto current_time = clocksource_get_time();
 
     unsigned long cpu_flags = spin_lock_irqsave(&t->event_list_lock);
 
-    hrtime_t lowest = UINT64_MAX;
-
-    list_for_every_safe (&t->event_list)
+    if (!atomic_context)
     {
-        struct clockevent *ev = container_of(l, struct clockevent, list_node);
-        if (ev->deadline > current_time)
-        {
-            lowest = lowest < ev->deadline ? lowest : ev->deadline;
-            continue;
-        }
-
-        if (ev->flags & CLOCKEVENT_FLAG_ATOMIC)
-        {
-            ev->callback(ev);
-            if (!(ev->flags & CLOCKEVENT_FLAG_PULSE))
-            {
-                ev->flags &= ~CLOCKEVENT_FLAG_POISON;
-                list_remove(&ev->list_node);
-            }
-            else
-            {
-                lowest = lowest < ev->deadline ? lowest : ev->deadline;
-            }
-        }
-        else if (!atomic_context)
+        /* Pick up whatever got deferred to us */
+        list_for_every_safe (&t->pending_list)
         {
-            ev->timer = nullptr;
+            struct clockevent *ev = container_of(l, struct clockevent, list_node);
             list_remove(&ev->list_node);
+            ev->flags &= ~CLOCKEVENT_FLAG_PENDING;
+            ev->timer = nullptr;
             list_add_tail(&ev->list_node, &to_handle);
         }
-        else
-        {
-            ev->flags |= CLOCKEVENT_FLAG_PENDING;
-            if (!has_raised_softirq)
-            {
-                has_raised_softirq = true;
-                softirq_raise(SOFTIRQ_VECTOR_TIMER);
-            }
-        }
     }
 
-    if (lowest == UINT64_MAX)
+    /* Pop every expired event from the heap first, and only then run them, since pulse events
+     * get requeued.
+     */
+    while (t->heap && t->heap->deadline <= current_time)
+    {
+        struct clockevent *ev = t->heap;
+        heap_remove(t, ev);
+        list_add_tail(&ev->list_node, &expired);
+    }
+
+    wheel_collect_expired(&t->wheel, current_time / TIMER_WHEEL_GRAN_NS, &expired);
+
+    list_for_every_safe (&expired)
+    {
+        struct clockevent *ev = container_of(l, struct clockevent, list_node);
+        list_remove(&ev->list_node);
+
+        if (timer_expire_event(t, ev, atomic_context, &to_handle))
+            raise_softirq = true;
+    }
+
+    hrtime_t next = timer_next_deadline(t);
+
+    if (next == TIMER_NEXT_EVENT_NOT_PENDING)
     {
         t->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
         timer_disable(t);
     }
     else
     {
-        t->next_event = lowest;
-        t->set_oneshot(lowest);
+        t->next_event = next;
+        t->set_oneshot(next);
     }
 
     spin_unlock_irqrestore(&t->event_list_lock, cpu_flags);
 
+    if (raise_softirq)
+        softirq_raise(SOFTIRQ_VECTOR_TIMER);
+
     if (!atomic_context)
     {
         // Handle non-atomic contexts
         list_for_every_safe (&to_handle)
         {
             struct clockevent *ev = container_of(l, struct clockevent, list_node);
+            list_remove(&ev->list_node);
 
             ev->callback(ev);
 
-            ev->flags &= ~CLOCKEVENT_FLAG_PENDING;
-            if (!(ev->flags & CLOCKEVENT_FLAG_PULSE))
-            {
-                ev->flags &= ~CLOCKEVENT_FLAG_POISON;
-                list_remove(&to_handle);
-                ev->timer = nullptr;
-            }
-            else
-            {
-                ev->flags &= ~CLOCKEVENT_FLAG_POISON;
+            ev->flags &= ~CLOCKEVENT_FLAG_POISON;
+
+            if (ev->flags & CLOCKEVENT_FLAG_PULSE)
                 timer_queue_clockevent(ev);
-                lowest = lowest < ev->deadline ? lowest : ev->deadline;
-            }
         }
     }
 }
@@ -143,18 +503,18 @@ void timer_cancel_event(struct clockevent *ev)
     scoped_lock<spinlock, true> g{ev->lock};
     auto timer = ev->timer;
 
-    /* ev->timer is set after list_remove up there, therefore we check first
-     * if ev->timer is nullptr. If so, it's not in there and we don't need to lock.
-     * If it's set, we lock the event list, and recheck for CLOCKEVENT_POISON; if it's set,
-     * the event is still in there and we need to list_remove it.
+    /* ev->timer is cleared when the event gets handed off to be run, therefore we check first
+     * if ev->timer is nullptr. If so, it's not queued and we don't need to lock.
+     * If it's set, we lock the timer, and recheck for CLOCKEVENT_POISON; if it's set,
+     * the event is still queued and we need to remove it.
      */
     if (timer != nullptr && ev->flags & CLOCKEVENT_FLAG_POISON)
     {
         unsigned long cpu_flags = spin_lock_irqsave(&timer->event_list_lock);
 
-        if (ev->flags & CLOCKEVENT_FLAG_POISON)
+        if (ev->flags & CLOCKEVENT_FLAG_POISON && ev->timer == timer)
         {
-            list_remove(&ev->list_node);
+            timer_dequeue(timer, ev);
             ev->flags &= ~CLOCKEVENT_FLAG_POISON;
         }
 
@@ -6,7 +6,6 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <onyx/dpc.h>
 #include <onyx/serial.h>
 
 static ssize_t serial_write_tty(const void *buffer, size_t size, struct tty *tty)
@@ -64,9 +63,9 @@ void serial_port::dispatch()
     }
 }
 
-void do_dispatch(void *ctx)
+void serial_port::dispatch_work_func(work_struct *work)
 {
-    serial_port *port = (serial_port *) ctx;
+    serial_port *port = container_of(work, dispatch_work_struct, work)->port;
     port->dispatch();
 }
 
@@ -80,10 +79,6 @@ void serial_port::receive_byte(uint8_t data)
         byte_buf[byte_buf_size++] = data;
     }
 
-    struct dpc_work work;
-    work.context = (void *) this;
-
-    work.funcptr = do_dispatch;
-
-    dpc_schedule_work(&work, DPC_PRIORITY_HIGH);
+    /* If it's still pending, the dispatch will pick this byte up too */
+    queue_work(system_wq, &dispatch_work.work);
 }
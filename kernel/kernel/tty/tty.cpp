@@ -606,10 +606,9 @@ short tty_poll(void *poll_file, short events, struct file *f)
 
         spin_lock(&tty->input_lock);
 
+        poll_wait_helper(poll_file, &tty->read_queue);
         if (__tty_has_input_available(tty))
             revents |= POLLIN;
-        else
-            poll_wait_helper(poll_file, &tty->read_queue);
 
         spin_unlock(&tty->input_lock);
 
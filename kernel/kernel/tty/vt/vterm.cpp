@@ -15,7 +15,6 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
-#include <onyx/dpc.h>
 #include <onyx/font.h>
 #include <onyx/framebuffer.h>
 #include <onyx/init.h>
@@ -25,12 +24,14 @@
 #include <onyx/input/state.h>
 #include <onyx/intrinsics.h>
 #include <onyx/scheduler.h>
+#include <onyx/scoped_lock.h>
 #include <onyx/semaphore.h>
 #include <onyx/serial.h>
 #include <onyx/thread.h>
 #include <onyx/tty.h>
 #include <onyx/utf8.h>
 #include <onyx/vm.h>
+#include <onyx/workqueue.h>
 
 #include <onyx/utility.hpp>
 
@@ -95,7 +96,22 @@ struct vterm_message
     struct vterm_message *next;
 };
 
+/* Glyph rows are at most 8 pixels wide, so rather than caching whole glyphs, we cache every
+ * possible glyph row (all 256 of them), pre-rendered in the framebuffer's pixel format. This takes
+ * 8KiB per fg/bg color pair, and doesn't depend on the font's size or number of glyphs.
+ */
+#define VTERM_GLYPH_CACHE_ENTRIES 8
+
+struct glyph_cache_entry
+{
+    bool valid;
+    uint32_t fg, bg;
+    unsigned long last_use;
+    uint32_t rows[256][8];
+};
+
 #define MAX_ARGS 4
+#define VTERM_INPUT_RING_SIZE 32
 struct vterm
 {
     struct mutex vt_lock;
@@ -117,6 +133,26 @@ struct vterm
     struct mutex condvar_mutex;
     struct vterm_message *msgs;
 
+    /* Copy of the framebuffer, in its pixel format. Cells get rendered here, and the changed parts
+     * are then copied to the framebuffer, which tends to be slow to access.
+     */
+    uint8_t *shadow;
+    unsigned int shadow_pitch;
+    /* Lines we scrolled up by since the last flush, that the shadow hasn't caught up with */
+    unsigned int pending_scroll;
+    /* Copy the whole shadow to the framebuffer on the next flush */
+    bool full_blit;
+    struct glyph_cache_entry *glyph_cache;
+    unsigned long glyph_cache_clock;
+
+    /* Keyboard input gets handed off to the tty from a work item, since we get it in IRQ
+     * context. Pending input strings are kept in a small ring buffer.
+     */
+    struct work_struct input_work;
+    struct spinlock input_lock;
+    const char *input_ring[VTERM_INPUT_RING_SIZE];
+    unsigned int input_head, input_tail;
+
     // Buffer used for any multibyte buffering for utf8
     char multibyte_buffer[10];
 
@@ -193,66 +229,217 @@ static inline uint32_t unpack_rgba(struct color color, struct framebuffer *fb)
     return c;
 }
 
-static void draw_char(uint32_t c, unsigned int x, unsigned int y, struct framebuffer *fb,
-                      struct color fg, struct color bg)
+/**
+ * @brief Get the pre-rendered glyph rows for a color pair
+ *
+ * @param vt Vterm
+ * @param fg Foreground color
+ * @param bg Background color
+ * @return Glyph cache entry
+ */
+static struct glyph_cache_entry *vterm_get_glyphs(struct vterm *vt, struct color fg,
+                                                  struct color bg)
+{
+    uint32_t fg_pixel = unpack_rgba(fg, vt->fb);
+    uint32_t bg_pixel = unpack_rgba(bg, vt->fb);
+    struct glyph_cache_entry *victim = nullptr;
+
+    vt->glyph_cache_clock++;
+
+    for (unsigned int i = 0; i < VTERM_GLYPH_CACHE_ENTRIES; i++)
+    {
+        struct glyph_cache_entry *e = &vt->glyph_cache[i];
+
+        if (e->valid && e->fg == fg_pixel && e->bg == bg_pixel)
+        {
+            e->last_use = vt->glyph_cache_clock;
+            return e;
+        }
+
+        /* Evict the least recently used entry */
+        if (!victim || !e->valid || (victim->valid && e->last_use < victim->last_use))
+            victim = e;
+    }
+
+    struct font *font = get_font_data();
+
+    for (unsigned int bits = 0; bits < 256; bits++)
+    {
+        for (unsigned int j = 0; j < 8; j++)
+            victim->rows[bits][j] = bits & font->mask[j] ? fg_pixel : bg_pixel;
+    }
+
+    victim->valid = true;
+    victim->fg = fg_pixel;
+    victim->bg = bg_pixel;
+    victim->last_use = vt->glyph_cache_clock;
+
+    return victim;
+}
+
+/**
+ * @brief Render a cell into the shadow buffer
+ *
+ * @param vt Vterm
+ * @param x Column
+ * @param y Row
+ * @param cell Cell
+ */
+static void vterm_render_cell(struct vterm *vt, unsigned int x, unsigned int y,
+                              struct console_cell *cell)
 {
     struct font *font = get_font_data();
+    uint32_t c = cell->codepoint;
+    unsigned int bytespp = vt->fb->bpp / 8;
 
     if (c >= font->chars)
         c = '?';
 
-    volatile char *buffer = (volatile char *) fb->framebuffer;
+    struct glyph_cache_entry *glyphs = vterm_get_glyphs(vt, cell->fg, cell->bg);
+    const unsigned char *bitmap = &font->font_bitmap[c * font->height];
+    uint8_t *dst = vt->shadow + y * font->height * vt->shadow_pitch + x * font->width * bytespp;
 
-    buffer += y * fb->pitch + x * (fb->bpp / 8);
+    for (unsigned int i = 0; i < font->height; i++, dst += vt->shadow_pitch)
+    {
+        const uint32_t *row = glyphs->rows[bitmap[i]];
 
-    unsigned int font_start = c * font->height;
+        if (bytespp == 4)
+        {
+            memcpy(dst, row, font->width * 4);
+            continue;
+        }
 
-    for (int i = 0; i < 16; i++)
-    {
-        for (int j = 0; j < 8; j++)
+        for (unsigned int j = 0; j < font->width; j++)
         {
-            struct color color;
-            unsigned char f = font->font_bitmap[font_start + i];
+            uint32_t pixel = row[j];
+            for (unsigned int k = 0; k < bytespp; k++, pixel >>= 8)
+                dst[j * bytespp + k] = pixel;
+        }
+    }
+}
 
-            if (f & font->mask[j])
-                color = fg;
-            else
-                color = bg;
+/**
+ * @brief Copy a row of pixels to the framebuffer
+ * Framebuffers are usually uncached or write-combining, so we use the widest non-temporal stores
+ * we can.
+ *
+ * @param dst Framebuffer pointer
+ * @param src Shadow buffer pointer
+ * @param len Length, in bytes
+ */
+static void fb_copy_row(volatile uint8_t *dst, const uint8_t *src, size_t len)
+{
+    while (len && (unsigned long) dst & (sizeof(uint64_t) - 1))
+    {
+        *dst++ = *src++;
+        len--;
+    }
 
-            uint32_t color_u32 = unpack_rgba(color, fb);
-            volatile uint32_t *b = (volatile uint32_t *) ((uint32_t *) buffer + j);
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t))
+    {
+        uint64_t val;
+        memcpy(&val, src, sizeof(uint64_t));
+        mov_non_temporal((volatile uint64_t *) dst, val);
+        dst += sizeof(uint64_t);
+        src += sizeof(uint64_t);
+    }
 
-            /* If the bpp is 32 bits, we can just blit it out */
-            if (fb->bpp == 32)
-                mov_non_temporal(b, color_u32);
-            else
-            {
-                volatile unsigned char *buf = (volatile unsigned char *) (buffer + j);
-                int bytes = fb->bpp / 8;
-                for (int k = 0; k < bytes; k++)
-                {
-                    buf[k] = color_u32;
-                    color_u32 >>= 8;
-                }
-            }
-        }
+    while (len--)
+        *dst++ = *src++;
+}
 
-        buffer = (volatile char *) (((char *) buffer) + fb->pitch);
+/**
+ * @brief Copy a rectangle of cells from the shadow buffer to the framebuffer
+ *
+ * @param vt Vterm
+ * @param x0 First column
+ * @param y0 First row
+ * @param x1 Last column (exclusive)
+ * @param y1 Last row (exclusive)
+ */
+static void vterm_blit(struct vterm *vt, unsigned int x0, unsigned int y0, unsigned int x1,
+                       unsigned int y1)
+{
+    struct font *font = get_font_data();
+    struct framebuffer *fb = vt->fb;
+    unsigned int bytespp = fb->bpp / 8;
+    size_t off = x0 * font->width * bytespp;
+    size_t len = (x1 - x0) * font->width * bytespp;
+
+    for (unsigned int py = y0 * font->height; py < y1 * font->height; py++)
+    {
+        fb_copy_row((volatile uint8_t *) fb->framebuffer + py * fb->pitch + off,
+                    vt->shadow + py * vt->shadow_pitch + off, len);
     }
 }
 
-void do_vterm_flush_all(struct vterm *vterm)
+/**
+ * @brief Scroll the shadow buffer by the lines we scrolled since the last flush
+ *
+ * @param vt Vterm
+ */
+static void vterm_apply_scroll(struct vterm *vt)
 {
-    struct font *f = get_font_data();
-    for (unsigned int i = 0; i < vterm->columns; i++)
+    if (!vt->pending_scroll)
+        return;
+
+    /* Scrolled-in lines are dirty, so they'll get rendered anyway */
+    if (vt->pending_scroll < vt->rows)
     {
-        for (unsigned int j = 0; j < vterm->rows; j++)
+        size_t line_size = get_font_data()->height * vt->shadow_pitch;
+        memmove(vt->shadow, vt->shadow + vt->pending_scroll * line_size,
+                (vt->rows - vt->pending_scroll) * line_size);
+    }
+
+    vt->pending_scroll = 0;
+    vt->full_blit = true;
+}
+
+/**
+ * @brief Render the dirty cells and copy them to the framebuffer
+ *
+ * @param vterm Vterm
+ * @param blit_all Copy the whole screen to the framebuffer
+ */
+static void __vterm_flush(struct vterm *vterm, bool blit_all)
+{
+    vterm_apply_scroll(vterm);
+
+    blit_all = blit_all || vterm->full_blit;
+
+    for (unsigned int j = 0; j < vterm->rows; j++)
+    {
+        unsigned int first = vterm->columns, last = 0;
+
+        for (unsigned int i = 0; i < vterm->columns; i++)
         {
             struct console_cell *cell = &vterm->cells[j * vterm->columns + i];
-            draw_char(cell->codepoint, i * f->width, j * f->height, vterm->fb, cell->fg, cell->bg);
+
+            if (!vterm_is_dirty(cell))
+                continue;
+
+            vterm_render_cell(vterm, i, j, cell);
             vterm_clear_dirty(cell);
+
+            if (first == vterm->columns)
+                first = i;
+            last = i;
         }
+
+        /* Coalesce each row's dirty cells into a single blit */
+        if (!blit_all && first != vterm->columns)
+            vterm_blit(vterm, first, j, last + 1, j + 1);
     }
+
+    if (blit_all)
+        vterm_blit(vterm, 0, 0, vterm->columns, vterm->rows);
+
+    vterm->full_blit = false;
+}
+
+void do_vterm_flush_all(struct vterm *vterm)
+{
+    __vterm_flush(vterm, true);
 }
 
 void vterm_flush_all(struct vterm *vterm)
@@ -274,11 +461,17 @@ void vterm_scroll(struct framebuffer *fb, struct vterm *vt)
         c->codepoint = ' ';
         c->bg = vt->bg;
         c->fg = vt->fg;
+        vterm_set_dirty(c);
     }
+
+    /* The shadow gets scrolled on flush, so scrolling a bunch of lines costs a single memmove */
+    vt->pending_scroll++;
 }
 
 void vterm_scroll_down(struct framebuffer *fb, struct vterm *vt)
 {
+    vterm_apply_scroll(vt);
+
     memmove(vt->cells + vt->columns, vt->cells,
             sizeof(struct console_cell) * (vt->rows - 1) * vt->columns);
 
@@ -288,8 +481,14 @@ void vterm_scroll_down(struct framebuffer *fb, struct vterm *vt)
         c->codepoint = ' ';
         c->bg = vt->bg;
         c->fg = vt->fg;
+        vterm_set_dirty(c);
     }
+
+    size_t line_size = get_font_data()->height * vt->shadow_pitch;
+    memmove(vt->shadow + line_size, vt->shadow, (vt->rows - 1) * line_size);
+    vt->full_blit = true;
 }
+
 void vterm_set_char(utf32_t c, unsigned int x, unsigned int y, struct color fg, struct color bg,
                     struct vterm *vterm)
 {
@@ -456,21 +655,7 @@ void vterm_flush(struct vterm *vterm);
 
 void do_vterm_flush(struct vterm *vterm)
 {
-    struct font *f = get_font_data();
-    for (unsigned int i = 0; i < vterm->columns; i++)
-    {
-        for (unsigned int j = 0; j < vterm->rows; j++)
-        {
-            struct console_cell *cell = &vterm->cells[j * vterm->columns + i];
-
-            if (vterm_is_dirty(cell))
-            {
-                draw_char(cell->codepoint, i * f->width, j * f->height, vterm->fb, cell->fg,
-                          cell->bg);
-                vterm_clear_dirty(cell);
-            }
-        }
-    }
+    __vterm_flush(vterm, false);
 }
 
 void platform_serial_write(const char *s, size_t size);
@@ -623,16 +808,17 @@ void vterm_blink_thread(void *ctx)
             mutex_lock(&vt->vt_lock);
         }
 
-        struct color c = vt->fg;
         if (vt->blink_status == true)
         {
+            /* Hide the cursor by copying its cell back from the shadow buffer */
             vt->blink_status = false;
-            c = vt->bg;
+            vterm_blit(vt, vt->cursor_x, vt->cursor_y, vt->cursor_x + 1, vt->cursor_y + 1);
         }
         else
+        {
             vt->blink_status = true;
-
-        draw_cursor(vt->cursor_x * f->width, vt->cursor_y * f->height, vt->fb, c);
+            draw_cursor(vt->cursor_x * f->width, vt->cursor_y * f->height, vt->fb, vt->fg);
+        }
 
         mutex_unlock(&vt->vt_lock);
         sched_sleep_ms(500);
@@ -1092,14 +1278,14 @@ void vterm::do_csi_command(char escape)
         case ANSI_SCROLL_UP: {
             for (unsigned long i = 0; i < args[0]; i++)
                 vterm_scroll(fb, this);
-            vterm_flush_all(this);
+            vterm_flush(this);
             break;
         }
 
         case ANSI_SCROLL_DOWN: {
             for (unsigned long i = 0; i < args[0]; i++)
                 vterm_scroll_down(fb, this);
-            vterm_flush_all(this);
+            vterm_flush(this);
             break;
         }
 
@@ -1290,7 +1476,6 @@ ssize_t vterm_write_tty(const void *buffer, size_t size, struct tty *tty)
     mutex_lock(&vt->vt_lock);
     size_t i = 0;
     const char *data = (const char *) buffer;
-    bool did_scroll = false;
 
     for (; i < size; i++)
     {
@@ -1316,18 +1501,15 @@ ssize_t vterm_write_tty(const void *buffer, size_t size, struct tty *tty)
             platform_serial_write(x, strlen(x));
 #endif
             // platform_serial_write(data + i, 1);
-            if (vterm_putc(codepoint, vt))
-                did_scroll = true;
+            vterm_putc(codepoint, vt);
 
             /* We sub a 1 because we're incrementing on the for loop */
             i += codepoint_length - 1;
         }
     }
 
-    if (!did_scroll)
-        vterm_flush(vt);
-    else
-        vterm_flush_all(vt);
+    /* Scrolls are cheap now, as they only cost a memmove of the shadow buffer */
+    vterm_flush(vt);
     update_cursor(vt);
 
     mutex_unlock(&vt->vt_lock);
@@ -1356,12 +1538,16 @@ unsigned int vterm_ioctl_tty(int request, void *argp, struct tty *tty)
     }
 }
 
+static void vterm_input_work(struct work_struct *work);
+
 void vterm_init(struct tty *tty)
 {
     struct vterm *vt = (vterm *) tty->priv;
 
     mutex_init(&vt->vt_lock);
     mutex_init(&vt->condvar_mutex);
+    spinlock_init(&vt->input_lock);
+    work_init(&vt->input_work, vterm_input_work);
 
     tty->is_vterm = true;
     struct framebuffer *fb = get_primary_framebuffer();
@@ -1374,11 +1560,22 @@ void vterm_init(struct tty *tty)
                                  VM_TYPE_REGULAR, VM_READ | VM_WRITE);
     assert(vt->cells != NULL);
 
+    /* Glyph rows are cached as 8-pixel rows */
+    assert(font->width <= 8);
+
+    vt->shadow_pitch = fb->width * (fb->bpp / 8);
+    vt->shadow = (uint8_t *) vmalloc(vm_size_to_pages(fb->height * vt->shadow_pitch),
+                                     VM_TYPE_REGULAR, VM_READ | VM_WRITE);
+    assert(vt->shadow != NULL);
+
+    vt->glyph_cache = (glyph_cache_entry *) vmalloc(
+        vm_size_to_pages(VTERM_GLYPH_CACHE_ENTRIES * sizeof(*vt->glyph_cache)), VM_TYPE_REGULAR,
+        VM_READ | VM_WRITE);
+    assert(vt->glyph_cache != NULL);
+
     vt->fg = default_fg;
     vt->bg = default_bg;
 
-    assert(vt->cells != NULL);
-
     vterm_fill_screen(vt, ' ', vt->fg, vt->bg);
 
     vterm_flush(vt);
@@ -1542,10 +1739,41 @@ struct key_action pt_pt_key_actions[] = {
 
 const size_t nr_actions = sizeof(key_actions) / sizeof(key_actions[0]);
 
-void __vterm_receive_input(void *p)
+static void vterm_input_work(struct work_struct *work)
 {
-    char *s = (char *) p;
-    vterm_receive_input(s);
+    struct vterm *vt = container_of(work, struct vterm, input_work);
+
+    while (true)
+    {
+        const char *s = nullptr;
+
+        {
+            scoped_lock<spinlock, true> g{vt->input_lock};
+            if (vt->input_head == vt->input_tail)
+                return;
+            s = vt->input_ring[vt->input_tail++ % VTERM_INPUT_RING_SIZE];
+        }
+
+        vterm_receive_input((char *) s);
+    }
+}
+
+static void vterm_queue_input(struct vterm *vt, const char *s)
+{
+    /* Not set up (no framebuffer) */
+    if (!vt->tty)
+        return;
+
+    {
+        scoped_lock<spinlock, true> g{vt->input_lock};
+
+        /* If the ring is full, drop the keypress */
+        if (vt->input_head - vt->input_tail == VTERM_INPUT_RING_SIZE)
+            return;
+        vt->input_ring[vt->input_head++ % VTERM_INPUT_RING_SIZE] = s;
+    }
+
+    queue_work(system_wq, &vt->input_work);
 }
 
 void sched_dump_threads(void);
@@ -1599,12 +1827,7 @@ int vterm_handle_key(struct vterm *vt, struct input_device *dev, struct input_ev
     }
 
     if (likely(action_string))
-    {
-        struct dpc_work w;
-        w.context = (void *) action_string;
-        w.funcptr = __vterm_receive_input;
-        dpc_schedule_work(&w, DPC_PRIORITY_MEDIUM);
-    }
+        vterm_queue_input(vt, action_string);
 
     return 0;
 }
@@ -29,42 +29,40 @@ void wait_queue_wait(struct wait_queue *queue)
     sched_yield();
 }
 
-struct wait_queue_token *wait_queue_wake_unlocked(struct wait_queue *queue)
+static void wait_queue_wake_token(struct wait_queue_token *token)
 {
-    MUST_HOLD_LOCK(&queue->lock);
-    assert(list_is_empty(&queue->token_list) == false);
+    if (token->callback)
+        token->callback(token->context, token);
 
-    struct list_head *token_lh = list_first_element(&queue->token_list);
-
-    assert(token_lh != NULL);
-
-    struct wait_queue_token *token = container_of(token_lh, struct wait_queue_token, token_node);
-
-    list_remove(token_lh);
-
-    list_assert_correct(&queue->token_list);
-
-    token->signaled = true;
-
-    return token;
+    /* Persistent tokens don't necessarily have a thread behind them */
+    if (token->thread)
+        thread_wake_up(token->thread);
 }
 
 void wait_queue_wake(struct wait_queue *queue)
 {
     unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
 
-    if (list_is_empty(&queue->token_list))
+    /* Wake up the first regular waiter. Persistent tokens in front of it are notified but don't
+     * count as a wakeup, since they don't consume it.
+     */
+    list_for_every_safe(&queue->token_list)
     {
-        spin_unlock_irqrestore(&queue->lock, cpu_flags);
-        return;
+        struct wait_queue_token *t = container_of(l, struct wait_queue_token, token_node);
+
+        if (t->flags & WQ_TOKEN_PERSISTENT)
+        {
+            wait_queue_wake_token(t);
+            continue;
+        }
+
+        list_remove(&t->token_node);
+        t->signaled = true;
+        wait_queue_wake_token(t);
+        break;
     }
 
-    struct wait_queue_token *t = wait_queue_wake_unlocked(queue);
-
-    if (t->callback)
-        t->callback(t->context, t);
-
-    thread_wake_up(t->thread);
+    list_assert_correct(&queue->token_list);
 
     spin_unlock_irqrestore(&queue->lock, cpu_flags);
 }
@@ -73,15 +71,21 @@ void wait_queue_wake_all(struct wait_queue *queue)
 {
     unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
 
-    while (!list_is_empty(&queue->token_list))
+    list_for_every_safe(&queue->token_list)
     {
-        struct wait_queue_token *t = wait_queue_wake_unlocked(queue);
+        struct wait_queue_token *t = container_of(l, struct wait_queue_token, token_node);
 
-        if (t->callback)
-            t->callback(t->context, t);
-        thread_wake_up(t->thread);
+        if (!(t->flags & WQ_TOKEN_PERSISTENT))
+        {
+            list_remove(&t->token_node);
+            t->signaled = true;
+        }
+
+        wait_queue_wake_token(t);
     }
 
+    list_assert_correct(&queue->token_list);
+
     spin_unlock_irqrestore(&queue->lock, cpu_flags);
 }
 
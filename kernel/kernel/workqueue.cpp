@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <assert.h>
+#include <stdio.h>
+
+#include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/panic.h>
+#include <onyx/percpu.h>
+#include <onyx/scheduler.h>
+#include <onyx/smp.h>
+#include <onyx/spinlock.h>
+#include <onyx/wait_queue.h>
+#include <onyx/workqueue.h>
+
+/**
+ * Every CPU has a bound worker pool, and there's a single unbound pool shared by every CPU.
+ * Workqueues don't own any threads; they just pick the pool work goes to.
+ *
+ * A pool lets at most max_running workers run work at the same time (1 for bound pools, the
+ * number of CPUs for the unbound pool). Workers that block stop counting as running, and the
+ * pool wakes up an idle worker to take over. To make sure there's always one around, a worker
+ * that starts running work when no one else is idle creates a new one first; we can't create
+ * threads from the scheduler or from IRQs. Workers that find the pool with too many idle workers
+ * exit.
+ */
+
+#define WQ_CPU_UNBOUND      (unsigned int) -1
+#define WQ_MAX_IDLE_WORKERS 2
+
+/* The worker is on the pool's idle list, waiting to be woken up */
+#define WORKER_IDLE     (1 << 0)
+/* The worker is running work, and counts towards nr_running */
+#define WORKER_RUNNING  (1 << 1)
+/* The worker blocked while running work, and stopped counting towards nr_running */
+#define WORKER_SLEEPING (1 << 2)
+
+struct worker
+{
+    struct thread *thread;
+    struct worker_pool *pool;
+    unsigned int flags;
+    /* Work item we're running right now, if any */
+    struct work_struct *current_work;
+    struct list_head pool_node;
+    struct list_head idle_node;
+};
+
+struct worker_pool
+{
+    struct spinlock lock;
+    struct list_head worklist;
+    /* Every worker of the pool, and the idle ones */
+    struct list_head workers;
+    struct list_head idle_list;
+    unsigned int nr_workers;
+    /* Workers that were created but haven't started running yet */
+    unsigned int nr_starting;
+    unsigned int nr_idle;
+    unsigned int nr_running;
+    unsigned int max_running;
+    unsigned int cpu;
+    /* Woken up every time a work item is done running */
+    struct wait_queue done_wq;
+};
+
+struct workqueue
+{
+    const char *name;
+    unsigned int flags;
+    /* Number of work items queued and not done running yet */
+    unsigned long nr_inflight{0};
+    struct wait_queue flush_wq;
+
+    constexpr workqueue(const char *name, unsigned int flags) : name{name}, flags{flags}
+    {
+    }
+};
+
+PER_CPU_VAR(worker_pool bound_pool);
+static worker_pool unbound_pool;
+
+static workqueue system_workqueue{"system", 0};
+static workqueue system_unbound_workqueue{"system_unbound", WQ_UNBOUND};
+
+struct workqueue *system_wq = &system_workqueue;
+struct workqueue *system_unbound_wq = &system_unbound_workqueue;
+
+static void worker_pool_init(struct worker_pool *pool, unsigned int cpu, unsigned int max_running)
+{
+    spinlock_init(&pool->lock);
+    INIT_LIST_HEAD(&pool->worklist);
+    INIT_LIST_HEAD(&pool->workers);
+    INIT_LIST_HEAD(&pool->idle_list);
+    init_wait_queue_head(&pool->done_wq);
+    pool->nr_workers = pool->nr_starting = pool->nr_idle = pool->nr_running = 0;
+    pool->max_running = max_running;
+    pool->cpu = cpu;
+}
+
+static void worker_enter_idle(struct worker *w)
+{
+    struct worker_pool *pool = w->pool;
+    MUST_HOLD_LOCK(&pool->lock);
+
+    w->flags |= WORKER_IDLE;
+    list_add(&w->idle_node, &pool->idle_list);
+    pool->nr_idle++;
+}
+
+static void worker_leave_idle(struct worker *w)
+{
+    struct worker_pool *pool = w->pool;
+    MUST_HOLD_LOCK(&pool->lock);
+
+    w->flags &= ~WORKER_IDLE;
+    list_remove(&w->idle_node);
+    pool->nr_idle--;
+}
+
+/**
+ * @brief Wake up an idle worker, if there's one
+ *
+ * @param pool Worker pool
+ */
+static void pool_wake_idle_worker(struct worker_pool *pool)
+{
+    MUST_HOLD_LOCK(&pool->lock);
+
+    if (list_is_empty(&pool->idle_list))
+        return;
+
+    struct worker *w = container_of(list_first_element(&pool->idle_list), worker, idle_node);
+    worker_leave_idle(w);
+    thread_wake_up(w->thread);
+}
+
+static bool pool_may_run_more(struct worker_pool *pool)
+{
+    return !list_is_empty(&pool->worklist) && pool->nr_running < pool->max_running;
+}
+
+static void worker_thread(void *arg);
+
+/**
+ * @brief Create a new worker for a pool
+ * The caller needs to bump pool->nr_starting first; the worker adds itself to the pool once
+ * it starts running.
+ *
+ * @param pool Worker pool
+ * @return True on success, false on OOM
+ */
+static bool create_worker(struct worker_pool *pool)
+{
+    struct worker *w = new worker;
+    struct thread *t = nullptr;
+
+    if (w)
+        t = sched_create_thread(worker_thread, THREAD_KERNEL, w);
+
+    if (!t)
+    {
+        delete w;
+        unsigned long cpu_flags = spin_lock_irqsave(&pool->lock);
+        pool->nr_starting--;
+        spin_unlock_irqrestore(&pool->lock, cpu_flags);
+        return false;
+    }
+
+    w->thread = t;
+    w->pool = pool;
+    w->flags = 0;
+    w->current_work = nullptr;
+    t->wq_worker = w;
+
+    if (pool->cpu == WQ_CPU_UNBOUND)
+        sched_start_thread(t);
+    else
+        sched_start_thread_for_cpu(t, pool->cpu);
+
+    return true;
+}
+
+static void wq_work_done(struct workqueue *wq)
+{
+    if (__atomic_sub_fetch(&wq->nr_inflight, 1, __ATOMIC_RELEASE) == 0)
+        wait_queue_wake_all(&wq->flush_wq);
+}
+
+/**
+ * @brief Run a work item off the pool's worklist
+ * Drops and retakes the pool's lock.
+ *
+ * @param w Current worker
+ * @param cpu_flags Saved CPU flags, from spin_lock_irqsave
+ * @return New saved CPU flags
+ */
+static unsigned long worker_process_one(struct worker *w, unsigned long cpu_flags)
+{
+    struct worker_pool *pool = w->pool;
+    struct work_struct *work =
+        container_of(list_first_element(&pool->worklist), work_struct, list_node);
+
+    list_remove(&work->list_node);
+    /* Clear pending before running it, so it can requeue itself */
+    __atomic_and_fetch(&work->flags, ~(WORK_PENDING | WORK_QUEUED), __ATOMIC_RELEASE);
+
+    struct workqueue *wq = work->wq;
+    work_func_t func = work->func;
+    w->current_work = work;
+    w->flags |= WORKER_RUNNING;
+    pool->nr_running++;
+
+    if (pool_may_run_more(pool))
+        pool_wake_idle_worker(pool);
+
+    spin_unlock_irqrestore(&pool->lock, cpu_flags);
+
+    /* Note that work may be freed by func, so it can't be touched afterwards */
+    func(work);
+
+    cpu_flags = spin_lock_irqsave(&pool->lock);
+
+    w->flags &= ~WORKER_RUNNING;
+    pool->nr_running--;
+    w->current_work = nullptr;
+
+    spin_unlock_irqrestore(&pool->lock, cpu_flags);
+
+    wq_work_done(wq);
+    wait_queue_wake_all(&pool->done_wq);
+
+    return spin_lock_irqsave(&pool->lock);
+}
+
+static void worker_thread(void *arg)
+{
+    struct worker *w = (struct worker *) arg;
+    struct worker_pool *pool = w->pool;
+
+    unsigned long cpu_flags = spin_lock_irqsave(&pool->lock);
+
+    list_add_tail(&w->pool_node, &pool->workers);
+    pool->nr_workers++;
+    pool->nr_starting--;
+
+    while (true)
+    {
+        if (w->flags & WORKER_IDLE)
+        {
+            /* pool_wake_idle_worker takes us off the idle list before waking us up */
+            set_current_state(THREAD_UNINTERRUPTIBLE);
+            spin_unlock_irqrestore(&pool->lock, cpu_flags);
+            sched_yield();
+            cpu_flags = spin_lock_irqsave(&pool->lock);
+            continue;
+        }
+
+        if (!pool_may_run_more(pool))
+        {
+            if (pool->nr_idle >= WQ_MAX_IDLE_WORKERS)
+                break;
+
+            worker_enter_idle(w);
+            continue;
+        }
+
+        if (pool->nr_idle == 0 && pool->nr_starting == 0)
+        {
+            /* Make sure there's someone to take over if this work blocks. If we fail to create
+             * a worker, we'll try again on the next work item.
+             */
+            pool->nr_starting++;
+            spin_unlock_irqrestore(&pool->lock, cpu_flags);
+            create_worker(pool);
+            cpu_flags = spin_lock_irqsave(&pool->lock);
+
+            if (!pool_may_run_more(pool))
+                continue;
+        }
+
+        cpu_flags = worker_process_one(w, cpu_flags);
+    }
+
+    list_remove(&w->pool_node);
+    pool->nr_workers--;
+    w->thread->wq_worker = nullptr;
+
+    spin_unlock_irqrestore(&pool->lock, cpu_flags);
+
+    delete w;
+}
+
+void wq_worker_sleeping(struct thread *thread)
+{
+    struct worker *w = thread->wq_worker;
+    struct worker_pool *pool = w->pool;
+
+    unsigned long cpu_flags = spin_lock_irqsave(&pool->lock);
+
+    if (w->flags & WORKER_RUNNING && !(w->flags & WORKER_SLEEPING))
+    {
+        w->flags |= WORKER_SLEEPING;
+        pool->nr_running--;
+
+        if (pool_may_run_more(pool))
+            pool_wake_idle_worker(pool);
+    }
+
+    spin_unlock_irqrestore(&pool->lock, cpu_flags);
+}
+
+void wq_worker_running(struct thread *thread)
+{
+    struct worker *w = thread->wq_worker;
+    struct worker_pool *pool = w->pool;
+
+    unsigned long cpu_flags = spin_lock_irqsave(&pool->lock);
+
+    if (w->flags & WORKER_SLEEPING)
+    {
+        w->flags &= ~WORKER_SLEEPING;
+        pool->nr_running++;
+    }
+
+    spin_unlock_irqrestore(&pool->lock, cpu_flags);
+}
+
+static struct worker_pool *wq_get_pool(struct workqueue *wq, unsigned int cpu)
+{
+    if (wq->flags & WQ_UNBOUND)
+        return &unbound_pool;
+    return get_per_cpu_ptr_any(bound_pool, cpu);
+}
+
+/**
+ * @brief Add a pending work item to a pool's worklist
+ *
+ * @param cpu CPU whose pool we want, for bound workqueues
+ * @param wq Workqueue
+ * @param work Work item, with WORK_PENDING set
+ */
+static void __queue_work(unsigned int cpu, struct workqueue *wq, struct work_struct *work)
+{
+    struct worker_pool *pool = wq_get_pool(wq, cpu);
+
+    __atomic_add_fetch(&wq->nr_inflight, 1, __ATOMIC_RELAXED);
+
+    unsigned long cpu_flags = spin_lock_irqsave(&pool->lock);
+
+    work->pool = pool;
+    work->wq = wq;
+    __atomic_or_fetch(&work->flags, WORK_QUEUED, __ATOMIC_RELAXED);
+    list_add_tail(&work->list_node, &pool->worklist);
+
+    if (pool->nr_running < pool->max_running)
+        pool_wake_idle_worker(pool);
+
+    spin_unlock_irqrestore(&pool->lock, cpu_flags);
+}
+
+static bool work_test_and_set_pending(struct work_struct *work)
+{
+    return __atomic_fetch_or(&work->flags, WORK_PENDING, __ATOMIC_ACQ_REL) & WORK_PENDING;
+}
+
+bool queue_work_on(unsigned int cpu, struct workqueue *wq, struct work_struct *work)
+{
+    if (work_test_and_set_pending(work))
+        return false;
+
+    __queue_work(cpu, wq, work);
+    return true;
+}
+
+bool queue_work(struct workqueue *wq, struct work_struct *work)
+{
+    return queue_work_on(get_cpu_nr(), wq, work);
+}
+
+static void delayed_work_timer(struct clockevent *ev)
+{
+    struct delayed_work *dwork = (struct delayed_work *) ev->priv;
+
+    /* cancel_delayed_work_sync may have beaten us to it */
+    if (__atomic_exchange_n(&dwork->armed, false, __ATOMIC_ACQ_REL))
+        __queue_work(dwork->cpu, dwork->wq, &dwork->work);
+}
+
+void delayed_work_init(struct delayed_work *dwork, work_func_t func)
+{
+    work_init(&dwork->work, func);
+    dwork->timer.callback = delayed_work_timer;
+    dwork->timer.priv = dwork;
+    dwork->timer.flags = 0;
+    dwork->timer.timer = nullptr;
+    dwork->wq = nullptr;
+    dwork->cpu = 0;
+    dwork->armed = false;
+}
+
+bool queue_delayed_work(struct workqueue *wq, struct delayed_work *dwork, hrtime_t delay)
+{
+    if (work_test_and_set_pending(&dwork->work))
+        return false;
+
+    if (delay == 0)
+    {
+        __queue_work(get_cpu_nr(), wq, &dwork->work);
+        return true;
+    }
+
+    /* The timer's last run may still be finishing up on another CPU (the work got queued, ran
+     * and requeued itself before the timer code was done with it). Cancelling waits for it.
+     */
+    timer_cancel_event(&dwork->timer);
+
+    dwork->wq = wq;
+    dwork->cpu = get_cpu_nr();
+    dwork->timer.deadline = clocksource_get_time() + delay;
+    /* Delayed work never needs to be precise */
+    dwork->timer.flags = CLOCKEVENT_FLAG_ATOMIC | CLOCKEVENT_FLAG_COARSE;
+    __atomic_store_n(&dwork->armed, true, __ATOMIC_RELEASE);
+
+    timer_queue_clockevent(&dwork->timer);
+
+    return true;
+}
+
+/**
+ * @brief Check if a work item is queued or running on a pool
+ *
+ * @param pool Worker pool
+ * @param work Work item
+ * @return True if so, else false
+ */
+static bool work_busy(struct worker_pool *pool, struct work_struct *work)
+{
+    unsigned long cpu_flags = spin_lock_irqsave(&pool->lock);
+
+    bool busy = work->pool == pool && work->flags & WORK_QUEUED;
+
+    list_for_every (&pool->workers)
+    {
+        struct worker *w = container_of(l, worker, pool_node);
+        if (w->current_work == work)
+            busy = true;
+    }
+
+    spin_unlock_irqrestore(&pool->lock, cpu_flags);
+
+    return busy;
+}
+
+static void work_wait_done(struct worker_pool *pool, struct work_struct *work)
+{
+    wait_for_event(&pool->done_wq, !work_busy(pool, work));
+}
+
+bool flush_work(struct work_struct *work)
+{
+    struct worker_pool *pool = __atomic_load_n(&work->pool, __ATOMIC_ACQUIRE);
+
+    if (!pool || !work_busy(pool, work))
+        return false;
+
+    work_wait_done(pool, work);
+    return true;
+}
+
+static void wq_wait_idle(struct workqueue *wq)
+{
+    wait_for_event(&wq->flush_wq, __atomic_load_n(&wq->nr_inflight, __ATOMIC_ACQUIRE) == 0);
+}
+
+void flush_workqueue(struct workqueue *wq)
+{
+    wq_wait_idle(wq);
+}
+
+/**
+ * @brief Take a pending work item off its pool's worklist
+ * If it's pending but not on a worklist yet (i.e it's being queued), we wait for it to be.
+ *
+ * @param work Work item
+ * @return True if it was pending, else false
+ */
+static bool work_grab_pending(struct work_struct *work)
+{
+    while (__atomic_load_n(&work->flags, __ATOMIC_ACQUIRE) & WORK_PENDING)
+    {
+        struct worker_pool *pool = __atomic_load_n(&work->pool, __ATOMIC_ACQUIRE);
+
+        if (pool)
+        {
+            unsigned long cpu_flags = spin_lock_irqsave(&pool->lock);
+
+            if (work->pool == pool && work->flags & WORK_QUEUED)
+            {
+                list_remove(&work->list_node);
+                __atomic_and_fetch(&work->flags, ~(WORK_PENDING | WORK_QUEUED), __ATOMIC_RELEASE);
+                spin_unlock_irqrestore(&pool->lock, cpu_flags);
+                wq_work_done(work->wq);
+                return true;
+            }
+
+            spin_unlock_irqrestore(&pool->lock, cpu_flags);
+        }
+
+        cpu_relax();
+    }
+
+    return false;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+    bool was_pending = work_grab_pending(work);
+    flush_work(work);
+    return was_pending;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+    timer_cancel_event(&dwork->timer);
+
+    if (__atomic_exchange_n(&dwork->armed, false, __ATOMIC_ACQ_REL))
+    {
+        /* The timer never fired, so the work isn't anywhere; we just need to clear pending */
+        __atomic_and_fetch(&dwork->work.flags, ~WORK_PENDING, __ATOMIC_RELEASE);
+        flush_work(&dwork->work);
+        return true;
+    }
+
+    return cancel_work_sync(&dwork->work);
+}
+
+struct workqueue *workqueue_create(const char *name, unsigned int flags)
+{
+    return new workqueue{name, flags};
+}
+
+static void workqueue_init_percpu(unsigned int cpu)
+{
+    worker_pool_init(get_per_cpu_ptr_any(bound_pool, cpu), cpu, 1);
+}
+
+INIT_LEVEL_CORE_PERCPU_CTOR(workqueue_init_percpu);
+
+/* Set up the unbound pool early, so work can be queued on it before the scheduler is up */
+static void workqueue_early_init()
+{
+    worker_pool_init(&unbound_pool, WQ_CPU_UNBOUND, 1);
+}
+
+INIT_LEVEL_EARLY_CORE_KERNEL_ENTRY(workqueue_early_init);
+
+static void workqueue_init()
+{
+    unsigned long cpu_flags = spin_lock_irqsave(&unbound_pool.lock);
+    unbound_pool.max_running = get_nr_cpus();
+    unbound_pool.nr_starting++;
+    spin_unlock_irqrestore(&unbound_pool.lock, cpu_flags);
+
+    if (!create_worker(&unbound_pool))
+        panic("workqueue: Could not create the unbound pool's worker");
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(workqueue_init);
+
+/* Bound workers are started once every CPU is up and running. Work queued on a bound pool
+ * before that just waits on the worklist.
+ */
+static void workqueue_start_bound_workers()
+{
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        auto pool = get_per_cpu_ptr_any(bound_pool, i);
+        pool->nr_starting++;
+
+        if (!create_worker(pool))
+            panic("workqueue: Could not create a worker for cpu%u", i);
+    }
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(workqueue_start_bound_workers);
+
+#ifdef CONFIG_KTEST_WORKQUEUE
+
+#include <libtest/libtest.h>
+
+struct wq_test_work
+{
+    struct work_struct work;
+    struct delayed_work dwork;
+    unsigned long runs;
+    bool block;
+};
+
+static void wq_test_func(struct work_struct *work)
+{
+    auto t = container_of(work, wq_test_work, work);
+
+    /* Blocking here must not stop the other work items from running */
+    if (t->block)
+        sched_sleep_ms(10);
+
+    __atomic_add_fetch(&t->runs, 1, __ATOMIC_RELAXED);
+}
+
+static void wq_test_delayed_func(struct work_struct *work)
+{
+    auto t = container_of(to_delayed_work(work), wq_test_work, dwork);
+    __atomic_add_fetch(&t->runs, 1, __ATOMIC_RELAXED);
+}
+
+static bool workqueue_test()
+{
+    static wq_test_work items[16];
+
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        work_init(&items[i].work, wq_test_func);
+        delayed_work_init(&items[i].dwork, wq_test_delayed_func);
+        items[i].runs = 0;
+        items[i].block = i % 4 == 0;
+    }
+
+    for (auto &item : items)
+    {
+        if (!queue_work(system_unbound_wq, &item.work))
+            return false;
+    }
+
+    /* Queueing pending work does nothing */
+    queue_work(system_unbound_wq, &items[0].work);
+
+    flush_workqueue(system_unbound_wq);
+
+    for (auto &item : items)
+    {
+        if (item.runs != 1)
+            return false;
+    }
+
+    /* Delayed work runs after the delay, and cancelling it before that stops it from running */
+    queue_delayed_work(system_unbound_wq, &items[0].dwork, 5 * NS_PER_MS);
+    queue_delayed_work(system_unbound_wq, &items[1].dwork, 1000 * NS_PER_MS);
+
+    if (!cancel_delayed_work_sync(&items[1].dwork))
+        return false;
+
+    sched_sleep_ms(50);
+    flush_workqueue(system_unbound_wq);
+
+    return items[0].runs == 2 && items[1].runs == 1;
+}
+
+DECLARE_TEST(workqueue_test, 1);
+
+#endif
@@ -3,17 +3,42 @@
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
+#define WORD_SIZE (sizeof(size_t))
+
+typedef size_t __attribute__((__may_alias__)) word_t;
+
 int memcmp(const void *aptr, const void *bptr, size_t size)
 {
     const unsigned char *a = (const unsigned char *) aptr;
     const unsigned char *b = (const unsigned char *) bptr;
-    size_t i;
-    for (i = 0; i < size; i++)
-        if (a[i] < b[i])
-            return -1;
-        else if (b[i] < a[i])
-            return 1;
+
+    /* If both buffers can be aligned at the same time, compare a word at a time until we find
+     * a difference, and then let the byte loop find it.
+     */
+    if (!(((uintptr_t) a ^ (uintptr_t) b) & (WORD_SIZE - 1)))
+    {
+        for (; size && ((uintptr_t) a & (WORD_SIZE - 1)); size--, a++, b++)
+        {
+            if (*a != *b)
+                return *a < *b ? -1 : 1;
+        }
+
+        for (; size >= WORD_SIZE; size -= WORD_SIZE, a += WORD_SIZE, b += WORD_SIZE)
+        {
+            if (*(const word_t *) a != *(const word_t *) b)
+                break;
+        }
+    }
+
+    for (; size; size--, a++, b++)
+    {
+        if (*a != *b)
+            return *a < *b ? -1 : 1;
+    }
+
     return 0;
 }
@@ -42,16 +42,22 @@ extern "C" NO_ASAN size_t strlen(const char *s)
     return s - start;
 }
 
-size_t strnlen(const char *s, size_t maxlen)
+extern "C" NO_ASAN size_t strnlen(const char *s, size_t maxlen)
 {
     size_t length = 0;
-    // Can we optimise it as above? Maybe, who knows
-    for (size_t i = 0; i < maxlen; i++)
+
+    for (; length < maxlen && !ALIGNED((s + length), WORD_SIZE); length++)
     {
-        if (s[i] == '\0')
-            break;
-        length++;
+        if (!s[length])
+            return length;
     }
 
+    auto ptr = reinterpret_cast<const word_t *>(s + length);
+
+    for (; maxlen - length >= WORD_SIZE && !HASZERO(*ptr); ptr++)
+        length += WORD_SIZE;
+
+    for (; length < maxlen && s[length]; length++)
+        ;
     return length;
 }
@@ -34,6 +34,9 @@ int main()
            stat.page_cache_pages * page_size);
     printf("Kernel heap memory: %lu pages(%lu bytes)\n", stat.kernel_heap_pages,
            stat.kernel_heap_pages * page_size);
+    printf("Dirty: %lu pages(%lu bytes)\n", stat.dirty_pages, stat.dirty_pages * page_size);
+    printf("Writeback: %lu pages(%lu bytes)\n", stat.writeback_pages,
+           stat.writeback_pages * page_size);
 
     double memory_pressure = (double) stat.allocated_pages / (double) stat.total_pages;
     printf("Memory pressure: %f(%f%%)\n", memory_pressure, memory_pressure * 100);
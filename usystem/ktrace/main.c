@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <onyx/public/ktrace.h>
+
+static const char *event_names[KTRACE_EV_MAX] = {
+    [KTRACE_EV_FUNCTION] = "function",
+    [KTRACE_EV_SCHED_SWITCH] = "sched_switch",
+    [KTRACE_EV_PAGE_FAULT] = "page_fault",
+    [KTRACE_EV_BLOCK_RQ_ISSUE] = "block_rq_issue",
+    [KTRACE_EV_BLOCK_RQ_COMPLETE] = "block_rq_complete",
+    [KTRACE_EV_TCP_RETRANSMIT] = "tcp_retransmit",
+};
+
+struct cpu_ring
+{
+    struct ktrace_ring_header *hdr;
+    const uint8_t *data;
+};
+
+static volatile sig_atomic_t should_stop = 0;
+
+static void stop(int sig)
+{
+    (void) sig;
+    should_stop = 1;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [-e event[,event...]] [-f function] [-d seconds]\n"
+            "Events:",
+            progname);
+    for (int i = 1; i < KTRACE_EV_MAX; i++)
+        fprintf(stderr, " %s", event_names[i]);
+    fprintf(stderr, "\nBy default, every event except function is traced.\n");
+}
+
+static uint64_t parse_events(char *list)
+{
+    uint64_t mask = 0;
+
+    for (char *ev = strtok(list, ","); ev; ev = strtok(NULL, ","))
+    {
+        int i;
+        for (i = 1; i < KTRACE_EV_MAX; i++)
+        {
+            if (!strcmp(ev, event_names[i]))
+                break;
+        }
+
+        if (i == KTRACE_EV_MAX)
+            errx(1, "unknown event %s", ev);
+
+        mask |= KTRACE_EV_MASK(i);
+    }
+
+    return mask;
+}
+
+static void print_record(const struct ktrace_record *rec)
+{
+    printf("[%u] %lu.%09lu %s: ", rec->cpu, (unsigned long) (rec->timestamp / 1000000000),
+           (unsigned long) (rec->timestamp % 1000000000), event_names[rec->type]);
+
+    switch (rec->type)
+    {
+        case KTRACE_EV_FUNCTION: {
+            const struct ktrace_function_event *ev = (const void *) rec;
+            printf("pid %d tid %u ip %#lx caller %#lx\n", ev->pid, ev->tid, (unsigned long) ev->ip,
+                   (unsigned long) ev->caller);
+            break;
+        }
+
+        case KTRACE_EV_SCHED_SWITCH: {
+            const struct ktrace_sched_switch_event *ev = (const void *) rec;
+            printf("%u (status %d) -> %u\n", ev->prev_tid, ev->prev_status, ev->next_tid);
+            break;
+        }
+
+        case KTRACE_EV_PAGE_FAULT: {
+            const struct ktrace_page_fault_event *ev = (const void *) rec;
+            printf("tid %u address %#lx ip %#lx%s%s%s\n", ev->tid, (unsigned long) ev->address,
+                   (unsigned long) ev->ip, ev->flags & KTRACE_PF_WRITE ? " write" : "",
+                   ev->flags & KTRACE_PF_EXEC ? " exec" : "",
+                   ev->flags & KTRACE_PF_USER ? " user" : "");
+            break;
+        }
+
+        case KTRACE_EV_BLOCK_RQ_ISSUE:
+        case KTRACE_EV_BLOCK_RQ_COMPLETE: {
+            const struct ktrace_block_rq_event *ev = (const void *) rec;
+            printf("%s sector %lu length %lu", ev->op ? "write" : "read",
+                   (unsigned long) ev->sector, (unsigned long) ev->length);
+            if (rec->type == KTRACE_EV_BLOCK_RQ_COMPLETE)
+                printf(" status %#x", ev->status);
+            putchar('\n');
+            break;
+        }
+
+        case KTRACE_EV_TCP_RETRANSMIT: {
+            const struct ktrace_tcp_retransmit_event *ev = (const void *) rec;
+            printf("%u -> %u seq %u try %u\n", ev->sport, ev->dport, ev->seq, ev->try_nr);
+            break;
+        }
+
+        default:
+            printf("unknown record type %u\n", rec->type);
+            break;
+    }
+}
+
+/**
+ * @brief Print every record that's in a ring, and hand the space back to the kernel
+ *
+ * @param ring Ring
+ * @return Number of records consumed
+ */
+static size_t consume(struct cpu_ring *ring)
+{
+    uint64_t head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->hdr->tail;
+    uint32_t size = ring->hdr->data_size;
+    size_t nr = 0;
+
+    while (tail < head)
+    {
+        const struct ktrace_record *rec = (const void *) (ring->data + (tail & (size - 1)));
+
+        if (rec->size == 0)
+            errx(1, "corrupted trace ring");
+
+        if (rec->type != KTRACE_EV_PADDING)
+        {
+            print_record(rec);
+            nr++;
+        }
+
+        tail += rec->size;
+    }
+
+    __atomic_store_n(&ring->hdr->tail, tail, __ATOMIC_RELEASE);
+    return nr;
+}
+
+static void set_events(int fd, uint64_t mask)
+{
+    if (ioctl(fd, KTRACE_ENABLE_EVENTS, &mask) < 0)
+        err(1, "KTRACE_ENABLE_EVENTS");
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t mask = 0;
+    unsigned long duration = 0;
+    char **functions = calloc(argc, sizeof(char *));
+    int nr_functions = 0;
+    int opt;
+
+    if (!functions)
+        err(1, "calloc");
+
+    while ((opt = getopt(argc, argv, "e:f:d:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'e':
+                mask |= parse_events(optarg);
+                break;
+            case 'f':
+                functions[nr_functions++] = optarg;
+                mask |= KTRACE_EV_MASK(KTRACE_EV_FUNCTION);
+                break;
+            case 'd':
+                duration = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!mask)
+        mask = (KTRACE_EV_MASK(KTRACE_EV_MAX) - 1) & ~KTRACE_EV_MASK(KTRACE_EV_PADDING) &
+               ~KTRACE_EV_MASK(KTRACE_EV_FUNCTION);
+
+    int fd = open("/dev/ktrace", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        err(1, "/dev/ktrace");
+
+    struct ktrace_info info;
+    if (ioctl(fd, KTRACE_GET_INFO, &info) < 0)
+        err(1, "KTRACE_GET_INFO");
+
+    for (int i = 0; i < nr_functions; i++)
+    {
+        if (ioctl(fd, KTRACE_TRACE_FUNCTION, functions[i]) < 0)
+            err(1, "Failed to trace %s", functions[i]);
+    }
+
+    struct cpu_ring *rings = calloc(info.nr_cpus, sizeof(struct cpu_ring));
+    if (!rings)
+        err(1, "calloc");
+
+    /* Enable the events first, as that's what sets up the rings */
+    set_events(fd, mask);
+
+    for (uint32_t i = 0; i < info.nr_cpus; i++)
+    {
+        void *ptr = mmap(NULL, info.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                         (off_t) i * info.mmap_size);
+        if (ptr == MAP_FAILED)
+            err(1, "mmap");
+
+        rings[i].hdr = ptr;
+        rings[i].data = (const uint8_t *) ptr + (info.mmap_size - info.data_size);
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    time_t end = duration ? time(NULL) + duration : 0;
+
+    while (!should_stop && (!end || time(NULL) < end))
+    {
+        size_t nr = 0;
+        for (uint32_t i = 0; i < info.nr_cpus; i++)
+            nr += consume(&rings[i]);
+
+        /* Nothing to do, so let the rings fill up a bit */
+        if (!nr)
+            usleep(10000);
+    }
+
+    set_events(fd, 0);
+
+    for (uint32_t i = 0; i < info.nr_cpus; i++)
+    {
+        consume(&rings[i]);
+        if (rings[i].hdr->lost)
+            fprintf(stderr, "cpu%u: lost %lu events\n", i, (unsigned long) rings[i].hdr->lost);
+    }
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <libonyx/unique_fd.h>
+
+class Epoll : public ::testing::Test
+{
+protected:
+    onx::unique_fd epfd;
+    onx::unique_fd rd;
+    onx::unique_fd wr;
+
+    void SetUp() override
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        ASSERT_TRUE(epfd.valid());
+
+        int p[2];
+        ASSERT_EQ(pipe2(p, O_CLOEXEC | O_NONBLOCK), 0);
+        rd = p[0];
+        wr = p[1];
+    }
+
+    void add(uint32_t events)
+    {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.u64 = 0xdeadbeef;
+        ASSERT_EQ(epoll_ctl(epfd, EPOLL_CTL_ADD, rd, &ev), 0);
+    }
+
+    int wait()
+    {
+        epoll_event ev;
+        int st = epoll_wait(epfd, &ev, 1, 0);
+
+        if (st == 1)
+        {
+            EXPECT_EQ(ev.data.u64, 0xdeadbeefUL);
+            EXPECT_TRUE(ev.events & EPOLLIN);
+        }
+
+        return st;
+    }
+
+    void put_byte()
+    {
+        char c = 0;
+        ASSERT_EQ(write(wr, &c, 1), 1);
+    }
+
+    void drain()
+    {
+        char buf[16];
+        while (read(rd, buf, sizeof(buf)) > 0)
+            ;
+    }
+};
+
+TEST_F(Epoll, LevelTriggered)
+{
+    add(EPOLLIN);
+    EXPECT_EQ(wait(), 0);
+
+    put_byte();
+    EXPECT_EQ(wait(), 1);
+    // Still readable, so still reported
+    EXPECT_EQ(wait(), 1);
+
+    drain();
+    EXPECT_EQ(wait(), 0);
+}
+
+TEST_F(Epoll, EdgeTriggered)
+{
+    add(EPOLLIN | EPOLLET);
+
+    put_byte();
+    EXPECT_EQ(wait(), 1);
+    EXPECT_EQ(wait(), 0);
+
+    // New data is a new edge, even if the old data wasn't read
+    put_byte();
+    EXPECT_EQ(wait(), 1);
+    EXPECT_EQ(wait(), 0);
+}
+
+TEST_F(Epoll, OneShot)
+{
+    add(EPOLLIN | EPOLLONESHOT);
+
+    put_byte();
+    EXPECT_EQ(wait(), 1);
+
+    put_byte();
+    EXPECT_EQ(wait(), 0);
+
+    // EPOLL_CTL_MOD rearms it
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = 0xdeadbeef;
+    ASSERT_EQ(epoll_ctl(epfd, EPOLL_CTL_MOD, rd, &ev), 0);
+    EXPECT_EQ(wait(), 1);
+    EXPECT_EQ(wait(), 0);
+}
+
+TEST_F(Epoll, WaitSleepsUntilReady)
+{
+    add(EPOLLIN);
+
+    epoll_event ev;
+    EXPECT_EQ(epoll_wait(epfd, &ev, 1, 10), 0);
+
+    put_byte();
+    EXPECT_EQ(epoll_wait(epfd, &ev, 1, -1), 1);
+}
+
+TEST_F(Epoll, ClosedFilesGetRemoved)
+{
+    add(EPOLLIN);
+    put_byte();
+
+    int fd = rd.release();
+    close(fd);
+
+    EXPECT_EQ(wait(), 0);
+}
+
+TEST_F(Epoll, CtlErrors)
+{
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+
+    EXPECT_EQ(epoll_ctl(epfd, EPOLL_CTL_MOD, rd, &ev), -1);
+    EXPECT_EQ(errno, ENOENT);
+
+    EXPECT_EQ(epoll_ctl(epfd, EPOLL_CTL_DEL, rd, &ev), -1);
+    EXPECT_EQ(errno, ENOENT);
+
+    ASSERT_EQ(epoll_ctl(epfd, EPOLL_CTL_ADD, rd, &ev), 0);
+
+    EXPECT_EQ(epoll_ctl(epfd, EPOLL_CTL_ADD, rd, &ev), -1);
+    EXPECT_EQ(errno, EEXIST);
+
+    EXPECT_EQ(epoll_ctl(epfd, EPOLL_CTL_ADD, epfd, &ev), -1);
+    EXPECT_EQ(errno, EINVAL);
+
+    EXPECT_EQ(epoll_ctl(rd, EPOLL_CTL_ADD, wr, &ev), -1);
+    EXPECT_EQ(errno, EINVAL);
+
+    EXPECT_EQ(epoll_ctl(epfd, EPOLL_CTL_DEL, rd, &ev), 0);
+}
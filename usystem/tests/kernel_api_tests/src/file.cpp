@@ -7,9 +7,17 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 #include <gtest/gtest.h>
 #include <libonyx/unique_fd.h>
 
@@ -156,3 +164,180 @@ TEST(File, ChownDoesntClearMandatoryLocking)
     ASSERT_NE(fstat(fd.get(), &buf), -1);
     ASSERT_TRUE((buf.st_mode & S_ISGID) == S_ISGID);
 }
+
+TEST(File, DirectIoIsCoherentWithTheCache)
+{
+    onx::unique_fd fd = open("test_file", O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0777);
+
+    ASSERT_TRUE(fd.valid());
+
+    onx::unique_fd dfd = open("test_file", O_RDWR | O_DIRECT | O_CLOEXEC);
+    ASSERT_TRUE(dfd.valid());
+
+    ASSERT_NE(unlink("test_file"), -1);
+
+    constexpr size_t size = 16384;
+    void *buf;
+    ASSERT_EQ(posix_memalign(&buf, 4096, size), 0);
+    std::unique_ptr<char, decltype(&free)> g{(char *) buf, free};
+    std::vector<char> cached(size);
+
+    // Dirty the page cache first, direct reads need to see it
+    memset(cached.data(), 'a', size);
+    ASSERT_EQ(pwrite(fd.get(), cached.data(), size, 0), (ssize_t) size);
+    ASSERT_EQ(pread(dfd.get(), buf, size, 0), (ssize_t) size);
+    EXPECT_EQ(memcmp(buf, cached.data(), size), 0);
+
+    // And buffered reads need to see direct writes
+    memset(buf, 'b', size);
+    ASSERT_EQ(pwrite(dfd.get(), buf, size, 0), (ssize_t) size);
+    ASSERT_EQ(pread(fd.get(), cached.data(), size, 0), (ssize_t) size);
+    EXPECT_EQ(memcmp(buf, cached.data(), size), 0);
+
+    // Extending writes update the size
+    ASSERT_EQ(pwrite(dfd.get(), buf, 4096, size), 4096);
+    struct stat st;
+    ASSERT_NE(fstat(fd.get(), &st), -1);
+    EXPECT_EQ(st.st_size, (off_t) (size + 4096));
+}
+
+TEST(File, HoleWriteIsAllocatedOnFsync)
+{
+    onx::unique_fd fd = open("test_file", O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0777);
+
+    ASSERT_TRUE(fd.valid());
+    ASSERT_NE(unlink("test_file"), -1);
+
+    // Write a page in the middle of a hole. Its blocks may only get picked at writeback
+    constexpr off_t size = 1024 * 1024;
+    ASSERT_NE(ftruncate(fd.get(), size), -1);
+
+    std::vector<char> buf(4096, 'a');
+    ASSERT_EQ(pwrite(fd.get(), buf.data(), buf.size(), size / 2), (ssize_t) buf.size());
+    ASSERT_NE(fsync(fd.get()), -1);
+
+    struct stat st;
+    ASSERT_NE(fstat(fd.get(), &st), -1);
+    EXPECT_EQ(st.st_size, size);
+    // The page's blocks (plus maybe an indirect block or two), but not the whole file
+    EXPECT_GE(st.st_blocks, (blkcnt_t) (buf.size() / 512));
+    EXPECT_LT(st.st_blocks, (blkcnt_t) (size / 512));
+
+    std::vector<char> rbuf(buf.size());
+    ASSERT_EQ(pread(fd.get(), rbuf.data(), rbuf.size(), size / 2), (ssize_t) rbuf.size());
+    EXPECT_EQ(memcmp(buf.data(), rbuf.data(), buf.size()), 0);
+
+    // And the rest of the hole still reads as zeroes
+    ASSERT_EQ(pread(fd.get(), rbuf.data(), rbuf.size(), 0), (ssize_t) rbuf.size());
+    EXPECT_EQ(std::count(rbuf.begin(), rbuf.end(), 0), (long) rbuf.size());
+}
+
+TEST(File, TruncatingDirtyDataGivesBackItsSpace)
+{
+    onx::unique_fd fd = open("test_file", O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0777);
+
+    ASSERT_TRUE(fd.valid());
+    ASSERT_NE(unlink("test_file"), -1);
+
+    struct statfs before;
+    ASSERT_NE(fstatfs(fd.get(), &before), -1);
+
+    // Dirty 1MiB, and truncate it away before it gets written back
+    std::vector<char> buf(1024 * 1024, 'a');
+    ASSERT_EQ(write(fd.get(), buf.data(), buf.size()), (ssize_t) buf.size());
+    ASSERT_NE(ftruncate(fd.get(), 0), -1);
+    ASSERT_NE(fsync(fd.get()), -1);
+
+    struct statfs after;
+    ASSERT_NE(fstatfs(fd.get(), &after), -1);
+
+    // Allow for a bit of noise from anything else using the filesystem
+    EXPECT_GE(after.f_bfree + 8, before.f_bfree);
+
+    struct stat st;
+    ASSERT_NE(fstat(fd.get(), &st), -1);
+    EXPECT_EQ(st.st_blocks, 0);
+}
+
+TEST(File, FaultingWriteDoesntLeakSpace)
+{
+    onx::unique_fd fd = open("test_file", O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0777);
+
+    ASSERT_TRUE(fd.valid());
+    ASSERT_NE(unlink("test_file"), -1);
+
+    struct statfs before;
+    ASSERT_NE(fstatfs(fd.get(), &before), -1);
+
+    void *bad = mmap(nullptr, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(bad, MAP_FAILED);
+
+    // Writes into holes from a bad buffer fail, and must not keep any space for themselves
+    for (off_t i = 0; i < 64; i++)
+    {
+        errno = 0;
+        EXPECT_EQ(pwrite(fd.get(), bad, 4096, i * 65536), -1);
+        EXPECT_EQ(errno, EFAULT);
+    }
+
+    munmap(bad, 4096);
+
+    struct statfs after;
+    ASSERT_NE(fstatfs(fd.get(), &after), -1);
+
+    EXPECT_GE(after.f_bfree + 8, before.f_bfree);
+}
+
+TEST(File, EnospcIsReportedByWrite)
+{
+    onx::unique_fd fd = open("test_file", O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0777);
+
+    ASSERT_TRUE(fd.valid());
+    ASSERT_NE(unlink("test_file"), -1);
+
+    struct statfs before;
+    ASSERT_NE(fstatfs(fd.get(), &before), -1);
+
+    // We need to fill the filesystem up, don't do it on big ones
+    if ((unsigned long) before.f_bavail * before.f_bsize > 256UL * 1024 * 1024)
+        GTEST_SKIP();
+
+    // With delayed allocation, running out of space must still be reported by write(), and not
+    // get lost at writeback.
+    std::vector<char> buf(65536, 'a');
+    size_t written = 0;
+
+    while (true)
+    {
+        ssize_t st = write(fd.get(), buf.data(), buf.size());
+        if (st < 0)
+        {
+            EXPECT_EQ(errno, ENOSPC);
+            break;
+        }
+
+        written += st;
+        if ((size_t) st != buf.size())
+            break;
+    }
+
+    ASSERT_GT(written, 0u);
+    EXPECT_NE(fsync(fd.get()), -1);
+
+    struct stat st;
+    ASSERT_NE(fstat(fd.get(), &st), -1);
+    EXPECT_EQ(st.st_size, (off_t) written);
+    EXPECT_GE((size_t) st.st_blocks * 512, written);
+
+    // Everything write() took is there
+    std::vector<char> rbuf(buf.size());
+    ssize_t st2 = pread(fd.get(), rbuf.data(), rbuf.size(), written - rbuf.size());
+    EXPECT_EQ(st2, (ssize_t) rbuf.size());
+    EXPECT_EQ(memcmp(buf.data(), rbuf.data(), rbuf.size()), 0);
+
+    // And truncating it gives the space back
+    ASSERT_NE(ftruncate(fd.get(), 0), -1);
+    struct statfs after;
+    ASSERT_NE(fstatfs(fd.get(), &after), -1);
+    EXPECT_GE(after.f_bfree + 8, before.f_bfree);
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <libonyx/unique_fd.h>
+
+#include <onyx/public/errqueue.h>
+
+// Big enough to go through a good number of windows. Build the kernel with
+// CONFIG_LOOPBACK_LOSS=<n> to have loopback drop one in every n packets, which makes this test
+// go through out-of-order reassembly and SACK recovery as well.
+static constexpr size_t tcp_transfer_size = 8 * 1024 * 1024;
+
+static uint8_t tcp_pattern(size_t off)
+{
+    return (uint8_t) (off * 31 + (off >> 12));
+}
+
+static bool tcp_connect_loopback(onx::unique_fd &client, onx::unique_fd &server)
+{
+    onx::unique_fd listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (!listener.valid())
+        return false;
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+
+    if (bind(listener, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (sockaddr *) &addr, &len) < 0)
+        return false;
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (!client.valid() || connect(client, (sockaddr *) &addr, sizeof(addr)) < 0)
+        return false;
+
+    server = accept(listener, nullptr, nullptr);
+    return server.valid();
+}
+
+TEST(Tcp, NegotiatesWindowScaleAndSack)
+{
+    onx::unique_fd client, server;
+    ASSERT_TRUE(tcp_connect_loopback(client, server));
+
+    for (int fd : {client.get(), server.get()})
+    {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+
+        ASSERT_EQ(getsockopt(fd, SOL_TCP, TCP_INFO, &info, &len), 0);
+        EXPECT_TRUE(info.tcpi_options & TCPI_OPT_WSCALE);
+        EXPECT_TRUE(info.tcpi_options & TCPI_OPT_SACK);
+        // The default receive buffer doesn't fit in 16 bits
+        EXPECT_GT(info.tcpi_rcv_wscale, 0);
+        EXPECT_EQ(info.tcpi_snd_wscale, info.tcpi_rcv_wscale);
+        EXPECT_GT(info.tcpi_rcv_space, (uint32_t) UINT16_MAX);
+    }
+}
+
+TEST(Tcp, BulkTransferIsIntact)
+{
+    onx::unique_fd client, server;
+    ASSERT_TRUE(tcp_connect_loopback(client, server));
+
+    std::thread sender{[&]() {
+        std::vector<uint8_t> chunk(64 * 1024);
+        size_t off = 0;
+
+        while (off < tcp_transfer_size)
+        {
+            for (size_t i = 0; i < chunk.size(); i++)
+                chunk[i] = tcp_pattern(off + i);
+
+            ssize_t st = send(client, chunk.data(), chunk.size(), 0);
+            if (st <= 0)
+                break;
+
+            // Short sends would break the pattern, so go back to where we stopped
+            off += st;
+        }
+
+        shutdown(client, SHUT_WR);
+    }};
+
+    std::vector<uint8_t> buf(32 * 1024);
+    size_t received = 0;
+    size_t bad = 0;
+
+    while (true)
+    {
+        ssize_t st = recv(server, buf.data(), buf.size(), 0);
+        EXPECT_GE(st, 0);
+
+        if (st <= 0)
+            break;
+
+        for (ssize_t i = 0; i < st; i++)
+        {
+            if (buf[i] != tcp_pattern(received + i))
+                bad++;
+        }
+
+        received += st;
+    }
+
+    sender.join();
+
+    EXPECT_EQ(received, tcp_transfer_size);
+    EXPECT_EQ(bad, 0UL);
+}
+
+TEST(Tcp, SendfileIsIntact)
+{
+    static constexpr size_t file_size = 1024 * 1024 + 123;
+
+    onx::unique_fd fd = open("test_file", O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0777);
+    ASSERT_TRUE(fd.valid());
+
+    // Unlink it straight away, as it is a temporary file
+    ASSERT_NE(unlink("test_file"), -1);
+
+    std::vector<uint8_t> contents(file_size);
+    for (size_t i = 0; i < file_size; i++)
+        contents[i] = tcp_pattern(i);
+
+    ASSERT_EQ(write(fd, contents.data(), file_size), (ssize_t) file_size);
+
+    onx::unique_fd client, server;
+    ASSERT_TRUE(tcp_connect_loopback(client, server));
+
+    // Start off in the middle of a page, to test unaligned offsets
+    off_t off = 100;
+
+    std::thread sender{[&]() {
+        while ((size_t) off < file_size)
+        {
+            if (sendfile(client, fd, &off, file_size - off) <= 0)
+                break;
+        }
+
+        shutdown(client, SHUT_WR);
+    }};
+
+    std::vector<uint8_t> buf(32 * 1024);
+    size_t received = 0;
+    size_t bad = 0;
+
+    while (true)
+    {
+        ssize_t st = recv(server, buf.data(), buf.size(), 0);
+        EXPECT_GE(st, 0);
+
+        if (st <= 0)
+            break;
+
+        for (ssize_t i = 0; i < st; i++)
+        {
+            if (buf[i] != contents[100 + received + i])
+                bad++;
+        }
+
+        received += st;
+    }
+
+    sender.join();
+
+    EXPECT_EQ(off, (off_t) file_size);
+    EXPECT_EQ(received, file_size - 100);
+    EXPECT_EQ(bad, 0UL);
+}
+
+TEST(Tcp, ZerocopySendCompletes)
+{
+    onx::unique_fd client, server;
+    ASSERT_TRUE(tcp_connect_loopback(client, server));
+
+    int one = 1;
+    ASSERT_EQ(setsockopt(client, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)), 0);
+
+    std::vector<uint8_t> data(16 * 1024);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = tcp_pattern(i);
+
+    // Two sends, which should get merged into a single completion
+    for (int i = 0; i < 2; i++)
+        ASSERT_EQ(send(client, data.data(), data.size(), MSG_ZEROCOPY), (ssize_t) data.size());
+
+    std::vector<uint8_t> buf(data.size());
+    size_t received = 0;
+
+    while (received < 2 * data.size())
+    {
+        ssize_t st = recv(server, buf.data(), buf.size(), 0);
+        ASSERT_GT(st, 0);
+        received += st;
+    }
+
+    // Completions come once the data is acked
+    struct pollfd pfd = {client, 0, 0};
+    ASSERT_EQ(poll(&pfd, 1, 5000), 1);
+    EXPECT_TRUE(pfd.revents & POLLERR);
+
+    uint32_t lo = UINT32_MAX, hi = 0;
+
+    while (true)
+    {
+        char control[CMSG_SPACE(sizeof(sock_extended_err))];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(client, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            EXPECT_EQ(errno, EAGAIN);
+            break;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        ASSERT_NE(cmsg, nullptr);
+        EXPECT_EQ(cmsg->cmsg_level, SOL_IP);
+        EXPECT_EQ(cmsg->cmsg_type, IP_RECVERR);
+
+        sock_extended_err ee;
+        memcpy(&ee, CMSG_DATA(cmsg), sizeof(ee));
+        EXPECT_EQ(ee.ee_origin, SO_EE_ORIGIN_ZEROCOPY);
+
+        lo = std::min(lo, ee.ee_info);
+        hi = std::max(hi, ee.ee_data);
+    }
+
+    EXPECT_EQ(lo, 0U);
+    EXPECT_EQ(hi, 1U);
+}
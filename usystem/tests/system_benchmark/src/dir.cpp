@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <random>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+/* A directory with range(0) empty files, created in the current directory (so it's on the
+ * filesystem we want to measure).
+ */
+class populated_dir
+{
+public:
+    std::string path;
+    long nr_files{0};
+
+    static std::string file_name(long i)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "bench_file_with_a_longish_name_%ld", i);
+        return name;
+    }
+
+    std::string file_path(long i) const
+    {
+        return path + "/" + file_name(i);
+    }
+
+    bool setup(long nr)
+    {
+        char tmpl[] = "dir_bench.XXXXXX";
+        if (!mkdtemp(tmpl))
+            return false;
+
+        path = tmpl;
+
+        for (; nr_files < nr; nr_files++)
+        {
+            int fd = open(file_path(nr_files).c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0)
+                return false;
+            close(fd);
+        }
+
+        return true;
+    }
+
+    void cleanup()
+    {
+        if (path.empty())
+            return;
+
+        for (long i = 0; i < nr_files; i++)
+            unlink(file_path(i).c_str());
+        rmdir(path.c_str());
+
+        path.clear();
+        nr_files = 0;
+    }
+
+    ~populated_dir()
+    {
+        cleanup();
+    }
+};
+
+/* stat a random name out of range(0) files in the same directory */
+static void dir_lookup(benchmark::State& state)
+{
+    populated_dir dir;
+    if (!dir.setup(state.range(0)))
+    {
+        state.SkipWithError("Failed to populate the directory");
+        return;
+    }
+
+    std::mt19937 rng{0};
+    std::uniform_int_distribution<long> dist{0, dir.nr_files - 1};
+
+    for (auto _ : state)
+    {
+        struct stat buf;
+        if (stat(dir.file_path(dist(rng)).c_str(), &buf) < 0)
+        {
+            state.SkipWithError("stat failed");
+            break;
+        }
+    }
+}
+
+BENCHMARK(dir_lookup)->Arg(100)->Arg(1000)->Arg(10000);
+
+/* Same as above, with names that aren't there (the worst case for a linear scan) */
+static void dir_lookup_missing(benchmark::State& state)
+{
+    populated_dir dir;
+    if (!dir.setup(state.range(0)))
+    {
+        state.SkipWithError("Failed to populate the directory");
+        return;
+    }
+
+    std::mt19937 rng{0};
+    std::uniform_int_distribution<long> dist{0, dir.nr_files - 1};
+
+    for (auto _ : state)
+    {
+        struct stat buf;
+        std::string path = dir.path + "/missing_" + std::to_string(dist(rng));
+
+        if (stat(path.c_str(), &buf) == 0)
+        {
+            state.SkipWithError("stat found a file that shouldn't exist");
+            break;
+        }
+    }
+}
+
+BENCHMARK(dir_lookup_missing)->Arg(100)->Arg(1000)->Arg(10000);
+
+/* Create and unlink a file in a directory with range(0) files */
+static void dir_create_unlink(benchmark::State& state)
+{
+    populated_dir dir;
+    if (!dir.setup(state.range(0)))
+    {
+        state.SkipWithError("Failed to populate the directory");
+        return;
+    }
+
+    std::string path = dir.path + "/new_file";
+
+    for (auto _ : state)
+    {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            state.SkipWithError("open failed");
+            break;
+        }
+
+        close(fd);
+
+        if (unlink(path.c_str()) < 0)
+        {
+            state.SkipWithError("unlink failed");
+            break;
+        }
+    }
+}
+
+BENCHMARK(dir_create_unlink)->Arg(100)->Arg(1000)->Arg(10000);
+
+/* Fill an empty directory with range(0) files */
+static void dir_populate(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        populated_dir dir;
+        if (!dir.setup(state.range(0)))
+        {
+            state.SkipWithError("Failed to populate the directory");
+            break;
+        }
+
+        /* Don't count the cleanup */
+        state.PauseTiming();
+        dir.cleanup();
+        state.ResumeTiming();
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(dir_populate)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
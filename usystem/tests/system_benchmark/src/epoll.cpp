@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2022 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+/* range(0) UDP sockets bound on loopback, and one socket to send them datagrams with */
+class udp_socket_set
+{
+public:
+    std::vector<int> fds;
+    std::vector<sockaddr_in> addrs;
+    int sender{-1};
+
+    bool setup(long nr)
+    {
+        rlimit rlim;
+        if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+            return false;
+
+        if (rlim.rlim_cur < (rlim_t) nr + 64)
+        {
+            rlim.rlim_cur = rlim.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &rlim) < 0 || rlim.rlim_cur < (rlim_t) nr + 64)
+                return false;
+        }
+
+        sender = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sender < 0)
+            return false;
+
+        for (long i = 0; i < nr; i++)
+        {
+            int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            if (fd < 0)
+                return false;
+
+            fds.push_back(fd);
+
+            sockaddr_in sa = {};
+            sa.sin_family = AF_INET;
+            sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            if (bind(fd, (sockaddr *) &sa, sizeof(sa)) < 0)
+                return false;
+
+            socklen_t len = sizeof(sa);
+            if (getsockname(fd, (sockaddr *) &sa, &len) < 0)
+                return false;
+
+            addrs.push_back(sa);
+        }
+
+        return true;
+    }
+
+    bool send_to(size_t idx)
+    {
+        char c = 0;
+        return sendto(sender, &c, 1, 0, (const sockaddr *) &addrs[idx], sizeof(sockaddr_in)) == 1;
+    }
+
+    ~udp_socket_set()
+    {
+        for (int fd : fds)
+            close(fd);
+        if (sender >= 0)
+            close(sender);
+    }
+};
+
+/* One datagram goes to a random socket out of range(0), and we wait for it with epoll_wait */
+static void epoll_wait_sockets(benchmark::State& state)
+{
+    udp_socket_set set;
+    if (!set.setup(state.range(0)))
+    {
+        state.SkipWithError("Failed to set up the sockets");
+        return;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        state.SkipWithError("epoll_create1 failed");
+        return;
+    }
+
+    for (size_t i = 0; i < set.fds.size(); i++)
+    {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, set.fds[i], &ev) < 0)
+        {
+            close(epfd);
+            state.SkipWithError("epoll_ctl failed");
+            return;
+        }
+    }
+
+    std::mt19937 rng{0};
+    std::uniform_int_distribution<size_t> dist{0, set.fds.size() - 1};
+
+    for (auto _ : state)
+    {
+        if (!set.send_to(dist(rng)))
+        {
+            state.SkipWithError("sendto failed");
+            break;
+        }
+
+        epoll_event ev;
+        if (epoll_wait(epfd, &ev, 1, -1) != 1)
+        {
+            state.SkipWithError("epoll_wait failed");
+            break;
+        }
+
+        char c;
+        recv(set.fds[ev.data.u64], &c, 1, 0);
+    }
+
+    close(epfd);
+}
+
+BENCHMARK(epoll_wait_sockets)->Arg(100)->Arg(1000)->Arg(10000);
+
+/* Same as above, with poll(2), to compare against */
+static void poll_sockets(benchmark::State& state)
+{
+    udp_socket_set set;
+    if (!set.setup(state.range(0)))
+    {
+        state.SkipWithError("Failed to set up the sockets");
+        return;
+    }
+
+    std::vector<pollfd> pfds;
+    for (int fd : set.fds)
+        pfds.push_back({fd, POLLIN, 0});
+
+    std::mt19937 rng{0};
+    std::uniform_int_distribution<size_t> dist{0, set.fds.size() - 1};
+
+    for (auto _ : state)
+    {
+        if (!set.send_to(dist(rng)))
+        {
+            state.SkipWithError("sendto failed");
+            break;
+        }
+
+        if (poll(pfds.data(), pfds.size(), -1) != 1)
+        {
+            state.SkipWithError("poll failed");
+            break;
+        }
+
+        for (auto& pfd : pfds)
+        {
+            if (pfd.revents & POLLIN)
+            {
+                char c;
+                recv(pfd.fd, &c, 1, 0);
+                break;
+            }
+        }
+    }
+}
+
+BENCHMARK(poll_sockets)->Arg(100)->Arg(1000)->Arg(10000);
@@ -122,3 +122,118 @@ void BM_string_strlen(benchmark::State& state)
     delete[] s;
 }
 BENCHMARK(BM_string_strlen)->AT_COMMON_SIZES;
+
+#ifdef KSTRING_TEST_HOOK
+
+// The kernel's memcpy/memmove/memset (kernel/arch/x86_64/string.S, built with KSTRING_TEST_HOOK).
+// range(1) selects whether they use the ERMS (fast rep movsb/stosb) paths, like the kernel would
+// patch in at boot on CPUs that have it.
+extern "C"
+{
+extern unsigned int kstring_features;
+void* kstring_memcpy(void* dst, const void* src, size_t n);
+void* kstring_memmove(void* dst, const void* src, size_t n);
+void* kstring_memset(void* dst, int c, size_t n);
+}
+
+#define KSTRING_ERMS (1 << 0)
+
+static void kstring_args(benchmark::internal::Benchmark* b)
+{
+    for (int features : {0, KSTRING_ERMS})
+    {
+        for (long size : {8, 16, 32, 64, 128, 256, 512, 1 * KB, 8 * KB, 64 * KB})
+            b->Args({size, features});
+    }
+}
+
+static void kstring_set_features(benchmark::State& state)
+{
+    kstring_features = state.range(1);
+
+    state.SetLabel(kstring_features & KSTRING_ERMS ? "erms" : "generic");
+}
+
+void BM_kstring_memcpy(benchmark::State& state)
+{
+    const auto nbytes = state.range(0);
+    char* src = new char[nbytes];
+    char* dst = new char[nbytes];
+    memset(src, 'x', nbytes);
+    memset(dst, 'x', nbytes);
+    kstring_set_features(state);
+
+    for (auto _ : state)
+    {
+        auto val = kstring_memcpy(dst, src, nbytes);
+        benchmark::DoNotOptimize(val);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * nbytes);
+    delete[] src;
+    delete[] dst;
+}
+
+BENCHMARK(BM_kstring_memcpy)->Apply(kstring_args);
+
+void BM_kstring_memmove_forward(benchmark::State& state)
+{
+    const auto nbytes = state.range(0);
+    char* buf = new char[nbytes + 64];
+    memset(buf, 'x', nbytes + 64);
+    kstring_set_features(state);
+
+    for (auto _ : state)
+    {
+        auto val = kstring_memmove(buf, buf + 1, nbytes);
+        benchmark::DoNotOptimize(val);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * nbytes);
+    delete[] buf;
+}
+
+BENCHMARK(BM_kstring_memmove_forward)->Apply(kstring_args);
+
+void BM_kstring_memmove_backward(benchmark::State& state)
+{
+    const auto nbytes = state.range(0);
+    char* buf = new char[nbytes + 64];
+    memset(buf, 'x', nbytes + 64);
+    kstring_set_features(state);
+
+    for (auto _ : state)
+    {
+        auto val = kstring_memmove(buf + 1, buf, nbytes);
+        benchmark::DoNotOptimize(val);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * nbytes);
+    delete[] buf;
+}
+
+BENCHMARK(BM_kstring_memmove_backward)->Apply(kstring_args);
+
+void BM_kstring_memset(benchmark::State& state)
+{
+    const auto nbytes = state.range(0);
+    char* dst = new char[nbytes];
+    kstring_set_features(state);
+
+    for (auto _ : state)
+    {
+        auto ret = kstring_memset(dst, 0, nbytes);
+        benchmark::DoNotOptimize(ret);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * nbytes);
+    delete[] dst;
+}
+
+BENCHMARK(BM_kstring_memset)->Apply(kstring_args);
+
+#endif
@@ -3,9 +3,14 @@
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 #include <benchmark/benchmark.h>
 
@@ -25,4 +30,72 @@ static void thread_spawning_bench(benchmark::State& state)
 }
 
 BENCHMARK(thread_spawning_bench)->RangeMultiplier(2)->Range(8, 8 << 10);
-;
+
+/* Measures how long a thread takes to get running after being woken up, while range(0)
+ * CPU-bound threads are competing for the CPU.
+ */
+static void sched_wakeup_latency(benchmark::State& state)
+{
+    using clock = std::chrono::steady_clock;
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> hogs;
+
+    for (long i = 0; i < state.range(0); i++)
+        hogs.emplace_back([&]() {
+            while (!stop.load(std::memory_order_relaxed))
+                ;
+        });
+
+    std::mutex lock;
+    std::condition_variable cv;
+    bool wake = false;
+    bool done = false;
+    clock::time_point woken;
+
+    std::thread wakee([&]() {
+        std::unique_lock<std::mutex> g{lock};
+
+        while (true)
+        {
+            cv.wait(g, [&]() { return wake || done; });
+            if (done)
+                break;
+            woken = clock::now();
+            wake = false;
+            cv.notify_all();
+        }
+    });
+
+    double max_latency = 0;
+
+    for (auto _ : state)
+    {
+        std::unique_lock<std::mutex> g{lock};
+        auto start = clock::now();
+        wake = true;
+        cv.notify_all();
+        cv.wait(g, [&]() { return !wake; });
+
+        double latency = std::chrono::duration<double>(woken - start).count();
+        if (latency > max_latency)
+            max_latency = latency;
+        state.SetIterationTime(latency);
+    }
+
+    {
+        std::lock_guard<std::mutex> g{lock};
+        done = true;
+    }
+
+    cv.notify_all();
+    wakee.join();
+
+    stop.store(true, std::memory_order_relaxed);
+
+    for (auto& t : hogs)
+        t.join();
+
+    state.counters["max_latency_us"] = max_latency * 1000000;
+}
+
+BENCHMARK(sched_wakeup_latency)->DenseRange(0, 8, 2)->UseManualTime();
@@ -40,3 +40,54 @@ static void write_fault_bench(benchmark::State& state)
 }
 
 BENCHMARK(write_fault_bench);
+
+static char* threaded_fault_region;
+
+/* Every thread faults in its own slice of the same mapping, so faults on the same region can
+ * run concurrently. Measures how well page faults scale with the number of threads.
+ */
+template <bool write>
+static void threaded_fault_bench(benchmark::State& state)
+{
+    const size_t nr_pages = state.range(0);
+    const size_t size = nr_pages << 12;
+
+    /* The loop doesn't start before every thread gets here, so thread 0 can map the region */
+    if (state.thread_index() == 0)
+    {
+        void* ptr = mmap(nullptr, size * state.threads(), PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        assert(ptr != MAP_FAILED);
+        threaded_fault_region = (char*) ptr;
+    }
+
+    for (auto _ : state)
+    {
+        volatile char* p = threaded_fault_region + size * state.thread_index();
+
+        for (size_t i = 0; i < size; i += 4096)
+        {
+            if (write)
+                p[i] = 10;
+            else
+                benchmark::DoNotOptimize(p[i]);
+        }
+
+        benchmark::ClobberMemory();
+
+        /* Replace our slice with fresh pages, so the next iteration faults again */
+        state.PauseTiming();
+        void* ptr = mmap((void*) p, size, PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+        assert(ptr != MAP_FAILED);
+        state.ResumeTiming();
+    }
+
+    if (state.thread_index() == 0)
+        munmap(threaded_fault_region, size * state.threads());
+
+    state.SetItemsProcessed(state.iterations() * nr_pages);
+}
+
+BENCHMARK_TEMPLATE(threaded_fault_bench, false)->Arg(256)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_TEMPLATE(threaded_fault_bench, true)->Arg(256)->ThreadRange(1, 16)->UseRealTime();
@@ -5,13 +5,54 @@
  *
  * SPDX-License-Identifier: MIT
  */
+#include <errno.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <mutex>
 #include <thread>
 
 #include <test/libtest.h>
 
+#define FUTEX_WAIT         0
+#define FUTEX_WAKE         1
+#define FUTEX_WAKE_OP      5
+#define FUTEX_LOCK_PI      6
+#define FUTEX_UNLOCK_PI    7
+#define FUTEX_TRYLOCK_PI   8
+#define FUTEX_WAIT_BITSET  9
+#define FUTEX_WAKE_BITSET  10
+#define FUTEX_PRIVATE_FLAG 128
+
+#define FUTEX_OP_SET    0
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP(op, oparg, cmp, cmparg) \
+    ((((op) & 0xf) << 28) | (((cmp) & 0xf) << 24) | (((oparg) & 0xfff) << 12) | ((cmparg) & 0xfff))
+
+#define FUTEX2_SIZE_U32 0x02
+
+struct futex_waitv
+{
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t __reserved;
+};
+
+using futex_word = std::atomic<uint32_t>;
+
+static long futex(futex_word *uaddr, int op, uint32_t val, const void *timeout = nullptr,
+                  futex_word *uaddr2 = nullptr, uint32_t val3 = 0)
+{
+    return syscall(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val, timeout, uaddr2, val3);
+}
+
 static volatile unsigned long counter = 0;
 static constexpr size_t nr_threads = 4;
 static std::array<std::thread, nr_threads> thread_list;
@@ -49,3 +90,231 @@ bool mutex_test()
 }
 
 DECLARE_TEST(mutex_test, 10);
+
+/* A PI mutex like pthread's PTHREAD_PRIO_INHERIT ones: user space only takes and releases
+ * uncontended locks */
+class pi_mutex
+{
+    futex_word word{0};
+
+    static uint32_t tid()
+    {
+        static thread_local uint32_t tid = syscall(SYS_gettid);
+        return tid;
+    }
+
+public:
+    bool lock()
+    {
+        uint32_t expected = 0;
+        if (word.compare_exchange_strong(expected, tid(), std::memory_order_acquire))
+            return true;
+
+        long st;
+        while ((st = futex(&word, FUTEX_LOCK_PI, 0)) < 0 && errno == EINTR)
+            ;
+        return st == 0;
+    }
+
+    void unlock()
+    {
+        uint32_t expected = tid();
+        if (word.compare_exchange_strong(expected, 0, std::memory_order_release))
+            return;
+
+        futex(&word, FUTEX_UNLOCK_PI, 0);
+    }
+
+    futex_word *get_word()
+    {
+        return &word;
+    }
+};
+
+/* Have nr_threads threads fight over a mutex, and print how long it took */
+template <typename Mutex>
+static bool contention_bench(Mutex &m, const char *name)
+{
+    std::array<std::thread, nr_threads> threads;
+    counter = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < nr_threads; i++)
+    {
+        threads[i] = std::thread{[&m, i]() {
+            for (long j = 0; j < UINT16_MAX; j++)
+            {
+                m.lock();
+
+                if (i % 2)
+                    counter = counter + 1;
+                else
+                    counter = counter - 1;
+                m.unlock();
+            }
+        }};
+    }
+
+    for (auto &t : threads)
+        t.join();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+    unsigned long ops = nr_threads * UINT16_MAX;
+
+    std::cout << name << ": " << ops << " lock/unlock pairs on " << nr_threads << " threads in "
+              << ns / 1000000 << "ms (" << ns / ops << "ns each)\n";
+
+    return counter == 0;
+}
+
+bool mutex_contention_bench()
+{
+    return contention_bench(lock, "std::mutex");
+}
+
+DECLARE_TEST(mutex_contention_bench, 1);
+
+bool pi_mutex_contention_bench()
+{
+    pi_mutex m;
+    return contention_bench(m, "PI futex mutex");
+}
+
+DECLARE_TEST(pi_mutex_contention_bench, 1);
+
+bool pi_mutex_test()
+{
+    pi_mutex m;
+
+    if (!m.lock())
+        return false;
+
+    /* Locking it again is a deadlock, and other threads can't trylock it */
+    if (futex(m.get_word(), FUTEX_LOCK_PI, 0) != -1 || errno != EDEADLK)
+        return false;
+
+    long st = 0;
+    int err = 0;
+    std::thread t{[&]() {
+        st = futex(m.get_word(), FUTEX_TRYLOCK_PI, 0);
+        err = errno;
+    }};
+    t.join();
+
+    if (st != -1 || err != EAGAIN)
+        return false;
+
+    m.unlock();
+
+    /* Unlocking a mutex we don't own isn't allowed */
+    m.get_word()->store(1);
+    if (futex(m.get_word(), FUTEX_UNLOCK_PI, 0) != -1 || errno != EPERM)
+        return false;
+
+    return true;
+}
+
+DECLARE_TEST(pi_mutex_test, 1);
+
+bool futex_bitset_test()
+{
+    futex_word word{0};
+    std::atomic<uint32_t> woken{0};
+    std::array<std::thread, 2> threads;
+
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        threads[i] = std::thread{[&, i]() {
+            futex(&word, FUTEX_WAIT_BITSET, 0, nullptr, nullptr, 1 << i);
+            woken |= 1 << i;
+        }};
+    }
+
+    /* Give them time to go to sleep */
+    usleep(100000);
+
+    /* Only the waiter with bit 1 set should wake up */
+    bool ok = futex(&word, FUTEX_WAKE_BITSET, INT32_MAX, nullptr, nullptr, 1 << 1) == 1;
+    usleep(100000);
+    ok = ok && woken == (1 << 1);
+
+    ok = futex(&word, FUTEX_WAKE_BITSET, INT32_MAX, nullptr, nullptr, 1 << 0) == 1 && ok;
+
+    for (auto &t : threads)
+        t.join();
+
+    return ok && woken == 3;
+}
+
+DECLARE_TEST(futex_bitset_test, 1);
+
+bool futex_wake_op_test()
+{
+    futex_word word1{0};
+    futex_word word2{0};
+
+    std::thread t{[&]() { futex(&word2, FUTEX_WAIT, 0); }};
+
+    usleep(100000);
+
+    /* Set word2 to 5, and wake its waiter if it used to be 0 */
+    long st = futex(&word1, FUTEX_WAKE_OP, 1, (const void *) 1, &word2,
+                    FUTEX_OP(FUTEX_OP_SET, 5, FUTEX_OP_CMP_EQ, 0));
+    t.join();
+
+    return st == 1 && word2 == 5;
+}
+
+DECLARE_TEST(futex_wake_op_test, 1);
+
+bool futex_waitv_test()
+{
+    std::array<futex_word, 3> words{};
+    futex_waitv waiters[3];
+
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        waiters[i].val = 0;
+        waiters[i].uaddr = (uintptr_t) &words[i];
+        waiters[i].flags = FUTEX2_SIZE_U32 | FUTEX_PRIVATE_FLAG;
+        waiters[i].__reserved = 0;
+    }
+
+    /* Any value mismatch makes it fail */
+    words[1] = 1;
+    if (syscall(SYS_futex_waitv, waiters, 3, 0, nullptr, 0) != -1 || errno != EAGAIN)
+        return false;
+    words[1] = 0;
+
+    /* We get told which futex woke us up */
+    std::thread t{[&]() {
+        usleep(100000);
+        words[2] = 1;
+        futex(&words[2], FUTEX_WAKE, 1);
+    }};
+
+    long st = syscall(SYS_futex_waitv, waiters, 3, 0, nullptr, 0);
+    t.join();
+
+    if (st != 2)
+        return false;
+
+    /* The timeout is absolute */
+    words[2] = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += 10000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    return syscall(SYS_futex_waitv, waiters, 3, 0, &ts, CLOCK_MONOTONIC) == -1 &&
+           errno == ETIMEDOUT;
+}
+
+DECLARE_TEST(futex_waitv_test, 1);